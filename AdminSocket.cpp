@@ -0,0 +1,363 @@
+#include "AdminSocket.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+//-----------------------------------------------------------------------------
+// setNonBlocking
+// Makes reads and writes on a descriptor return instead of waiting
+//
+// @pre:   fd is open
+// @post:  O_NONBLOCK is set
+// @param  fd: The descriptor
+//-----------------------------------------------------------------------------
+static void setNonBlocking(int fd) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+//-----------------------------------------------------------------------------
+// AdminSocket Constructor
+// Creates a closed admin socket
+//
+// @pre:   None
+// @post:  isOpen() is false
+//-----------------------------------------------------------------------------
+AdminSocket::AdminSocket() {
+  listener = -1;
+  wakePipe[0] = -1;
+  wakePipe[1] = -1;
+  nextClient = 1;
+  path = "";
+  pthread_mutex_init(&lock, NULL);
+}
+
+//-----------------------------------------------------------------------------
+// AdminSocket Destructor
+// Closes the socket and every client
+//
+// @pre:   No thread is in wait()
+// @post:  The socket file is removed
+//-----------------------------------------------------------------------------
+AdminSocket::~AdminSocket() {
+  close();
+  pthread_mutex_destroy(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// open
+// Listens on a path, replacing any stale socket file
+//
+// @pre:   The socket is closed
+// @post:  Clients can connect if true is returned
+// @param  path:  The socket file
+// @returns bool: False if the socket cannot be created (errno is set)
+//-----------------------------------------------------------------------------
+bool AdminSocket::open(const string& path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  strcpy(address.sun_path, path.c_str());
+  int sd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sd < 0) {
+    return false;
+  }
+  unlink(path.c_str());
+  if (bind(sd, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+      listen(sd, SOMAXCONN) < 0 || pipe(wakePipe) < 0) {
+    int error = errno;
+    ::close(sd);
+    wakePipe[0] = -1;
+    wakePipe[1] = -1;
+    errno = error;
+    return false;
+  }
+  setNonBlocking(sd);
+  setNonBlocking(wakePipe[0]);
+  setNonBlocking(wakePipe[1]);
+  pthread_mutex_lock(&lock);
+  listener = sd;
+  this->path = path;
+  pthread_mutex_unlock(&lock);
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// close
+// Disconnects every client and stops listening
+//
+// @pre:   No thread is in wait()
+// @post:  isOpen() is false and the socket file is removed
+//-----------------------------------------------------------------------------
+void AdminSocket::close() {
+  pthread_mutex_lock(&lock);
+  for (map<int, adminClient>::iterator client = clients.begin();
+      client != clients.end(); client++) {
+    ::close(client->second.sd);
+  }
+  clients.clear();
+  if (listener >= 0) {
+    ::close(listener);
+    unlink(path.c_str());
+    ::close(wakePipe[0]);
+    ::close(wakePipe[1]);
+  }
+  listener = -1;
+  wakePipe[0] = -1;
+  wakePipe[1] = -1;
+  path = "";
+  pthread_mutex_unlock(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// isOpen
+// Returns whether the socket is listening
+//
+// @pre:   None
+// @post:  None
+// @returns bool: True between open() and close()
+//-----------------------------------------------------------------------------
+bool AdminSocket::isOpen() {
+  pthread_mutex_lock(&lock);
+  bool open = listener >= 0;
+  pthread_mutex_unlock(&lock);
+  return open;
+}
+
+//-----------------------------------------------------------------------------
+// getPath
+// Returns the path the socket listens on
+//
+// @pre:   None
+// @post:  None
+// @returns string: The socket file, "" if closed
+//-----------------------------------------------------------------------------
+string AdminSocket::getPath() {
+  pthread_mutex_lock(&lock);
+  string current = path;
+  pthread_mutex_unlock(&lock);
+  return current;
+}
+
+//-----------------------------------------------------------------------------
+// wait
+// Waits until a client sends a complete line, output is queued or wake() is
+// called; accepts new clients, writes queued output and drops clients that
+// went away
+//
+// @pre:   The socket is open; only one thread calls wait()
+// @post:  requests holds the complete lines received, in order per client
+// @param  timeoutMs: Longest time to wait, -1 for no limit
+// @param  requests:  Receives the requests
+//-----------------------------------------------------------------------------
+void AdminSocket::wait(int timeoutMs, vector<AdminRequest>& requests) {
+  vector<struct pollfd> fds;
+  vector<int> ids;
+  struct pollfd entry;
+  entry.revents = 0;
+  pthread_mutex_lock(&lock);
+  entry.fd = wakePipe[0];
+  entry.events = POLLIN;
+  fds.push_back(entry);
+  entry.fd = listener;
+  fds.push_back(entry);
+  map<int, adminClient>::iterator listed = clients.begin();
+  while (listed != clients.end()) {
+    if (listed->second.closing && listed->second.output.empty()) {
+      ::close(listed->second.sd);
+      clients.erase(listed++);
+      continue;
+    }
+    entry.fd = listed->second.sd;
+    entry.events = listed->second.closing ? 0 : POLLIN;
+    if (!listed->second.output.empty()) {
+      entry.events |= POLLOUT;
+    }
+    fds.push_back(entry);
+    ids.push_back(listed->first);
+    listed++;
+  }
+  pthread_mutex_unlock(&lock);
+  if (poll(&fds[0], fds.size(), timeoutMs) <= 0) {
+    return;
+  }
+  char buffer[4096];
+  if (fds[0].revents != 0) {
+    while (read(wakePipe[0], buffer, sizeof(buffer)) > 0) {
+    }
+  }
+  pthread_mutex_lock(&lock);
+  if (fds[1].revents != 0) {
+    int sd = -1;
+    while ((sd = accept(listener, NULL, NULL)) >= 0) {
+      setNonBlocking(sd);
+      adminClient client;
+      client.sd = sd;
+      client.subscribed = false;
+      client.overflowed = false;
+      client.closing = false;
+      clients[nextClient++] = client;
+    }
+  }
+  for (size_t i = 0; i < ids.size(); i++) {
+    map<int, adminClient>::iterator found = clients.find(ids[i]);
+    if (found == clients.end()) {
+      continue;
+    }
+    adminClient& client = found->second;
+    bool alive = !client.overflowed;
+    if (alive && !client.closing &&
+        (fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR)) != 0) {
+      ssize_t bytes = 0;
+      while ((bytes = recv(client.sd, buffer, sizeof(buffer), 0)) > 0) {
+        client.input.append(buffer, bytes);
+      }
+      client.closing = bytes == 0;
+      alive = client.closing || errno == EAGAIN || errno == EWOULDBLOCK;
+      size_t newline = 0;
+      while ((newline = client.input.find('\n')) != string::npos) {
+        AdminRequest request;
+        request.client = ids[i];
+        request.line = client.input.substr(0, newline);
+        if (!request.line.empty() &&
+            request.line[request.line.size() - 1] == '\r') {
+          request.line.erase(request.line.size() - 1);
+        }
+        requests.push_back(request);
+        client.input.erase(0, newline + 1);
+      }
+      alive = alive && client.input.size() <= (size_t)ADMIN_MAX_LINE;
+    }
+    if (alive) {
+      alive = flushLocked(client);
+    }
+    if (!alive) {
+      ::close(client.sd);
+      clients.erase(found);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// reply
+// Queues output for one client
+//
+// @pre:   None
+// @post:  The text is queued unless the client is gone
+// @param  client: AdminRequest::client
+// @param  text:   Complete lines
+//-----------------------------------------------------------------------------
+void AdminSocket::reply(int client, const string& text) {
+  pthread_mutex_lock(&lock);
+  map<int, adminClient>::iterator found = clients.find(client);
+  if (found != clients.end()) {
+    queueLocked(found->second, text);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// publish
+// Queues output for every subscribed client
+//
+// @pre:   None
+// @post:  The text is queued for each subscriber
+// @param  text: Complete lines
+//-----------------------------------------------------------------------------
+void AdminSocket::publish(const string& text) {
+  pthread_mutex_lock(&lock);
+  for (map<int, adminClient>::iterator client = clients.begin();
+      client != clients.end(); client++) {
+    if (client->second.subscribed) {
+      queueLocked(client->second, text);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// setSubscribed
+// Selects whether a client receives publish() output
+//
+// @pre:   None
+// @post:  The client's subscription is updated
+// @param  client:     AdminRequest::client
+// @param  subscribed: True to receive events
+//-----------------------------------------------------------------------------
+void AdminSocket::setSubscribed(int client, bool subscribed) {
+  pthread_mutex_lock(&lock);
+  map<int, adminClient>::iterator found = clients.find(client);
+  if (found != clients.end()) {
+    found->second.subscribed = subscribed;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// wake
+// Makes a thread in wait() return
+//
+// @pre:   None
+// @post:  None
+//-----------------------------------------------------------------------------
+void AdminSocket::wake() {
+  if (wakePipe[1] < 0) {
+    return;
+  }
+  //If the pipe is full, a wake-up is already pending
+  ssize_t written = write(wakePipe[1], "w", 1);
+  (void)written;
+}
+
+//-----------------------------------------------------------------------------
+// queueLocked
+// Appends output for a client and wakes wait() to write it
+//
+// @pre:   The caller holds lock
+// @post:  The text is queued, or the client is marked to be dropped if it
+//         fell too far behind
+// @param  client: The client
+// @param  text:   Complete lines
+//-----------------------------------------------------------------------------
+void AdminSocket::queueLocked(adminClient& client, const string& text) {
+  if (client.overflowed) {
+    return;
+  }
+  client.output += text;
+  if (client.output.size() > (size_t)ADMIN_MAX_OUTPUT) {
+    client.overflowed = true;
+    client.output.clear();
+  }
+  wake();
+}
+
+//-----------------------------------------------------------------------------
+// flushLocked
+// Writes as much queued output as the client's socket takes
+//
+// @pre:   The caller holds lock
+// @post:  The output written is removed from the queue
+// @param  client: The client
+// @returns bool:  False if the client went away
+//-----------------------------------------------------------------------------
+bool AdminSocket::flushLocked(adminClient& client) {
+  while (!client.output.empty()) {
+    ssize_t bytes = send(client.sd, client.output.data(),
+        client.output.size(), MSG_NOSIGNAL);
+    if (bytes > 0) {
+      client.output.erase(0, bytes);
+    } else {
+      return bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+          errno == EINTR);
+    }
+  }
+  return true;
+}
@@ -0,0 +1,167 @@
+#ifndef ADMINSOCKET_H_
+#define ADMINSOCKET_H_
+
+#include <pthread.h>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+const int ADMIN_MAX_LINE = 65536;      //Longest request line accepted
+const int ADMIN_MAX_OUTPUT = 1048576;  //Unsent bytes a client may fall behind
+                                       //before it is dropped
+
+//A complete request line and the client that sent it
+struct AdminRequest {
+  int client;           //ID for reply()
+  string line;          //Without the newline
+};
+
+//-----------------------------------------------------------------------------
+// Class:       AdminSocket
+// Description: The transport of a line-based admin protocol on a Unix stream
+//              socket. Any number of clients connect and send requests, one
+//              per line; one thread calls wait() to accept clients, read
+//              their complete lines and write out what was queued for them.
+//              Every socket is non-blocking, so no client can stall the
+//              thread running wait(). A client may shut down its side after
+//              its last request; it is disconnected once the replies queued
+//              by then are written.
+//
+//              Other threads queue output with reply() and publish(), which
+//              only append to a buffer and wake wait() through a pipe, so
+//              relay threads can report events without waiting on a client.
+//              A client that falls more than ADMIN_MAX_OUTPUT bytes behind
+//              is disconnected rather than buffered without bound.
+//-----------------------------------------------------------------------------
+class AdminSocket {
+ public:
+  //---------------------------------------------------------------------------
+  // AdminSocket Constructor
+  // Creates a closed admin socket
+  //
+  // @pre:   None
+  // @post:  isOpen() is false
+  //---------------------------------------------------------------------------
+  AdminSocket();
+
+  //---------------------------------------------------------------------------
+  // AdminSocket Destructor
+  // Closes the socket and every client
+  //
+  // @pre:   No thread is in wait()
+  // @post:  The socket file is removed
+  //---------------------------------------------------------------------------
+  ~AdminSocket();
+
+  //---------------------------------------------------------------------------
+  // open
+  // Listens on a path, replacing any stale socket file
+  //
+  // @pre:   The socket is closed
+  // @post:  Clients can connect if true is returned
+  // @param  path:  The socket file
+  // @returns bool: False if the socket cannot be created (errno is set)
+  //---------------------------------------------------------------------------
+  bool open(const string& path);
+
+  //---------------------------------------------------------------------------
+  // close
+  // Disconnects every client and stops listening
+  //
+  // @pre:   No thread is in wait()
+  // @post:  isOpen() is false and the socket file is removed
+  //---------------------------------------------------------------------------
+  void close();
+
+  //---------------------------------------------------------------------------
+  // isOpen / getPath
+  // Return whether the socket is listening, and on which path
+  //
+  // @pre:   None
+  // @post:  None
+  //---------------------------------------------------------------------------
+  bool isOpen();
+  string getPath();
+
+  //---------------------------------------------------------------------------
+  // wait
+  // Waits until a client sends a complete line, output is queued or wake()
+  // is called; accepts new clients, writes queued output and drops clients
+  // that went away
+  //
+  // @pre:   The socket is open; only one thread calls wait()
+  // @post:  requests holds the complete lines received, in order per client
+  // @param  timeoutMs: Longest time to wait, -1 for no limit
+  // @param  requests:  Receives the requests
+  //---------------------------------------------------------------------------
+  void wait(int timeoutMs, vector<AdminRequest>& requests);
+
+  //---------------------------------------------------------------------------
+  // reply
+  // Queues output for one client
+  //
+  // @pre:   None
+  // @post:  The text is queued unless the client is gone
+  // @param  client: AdminRequest::client
+  // @param  text:   Complete lines
+  //---------------------------------------------------------------------------
+  void reply(int client, const string& text);
+
+  //---------------------------------------------------------------------------
+  // publish
+  // Queues output for every subscribed client
+  //
+  // @pre:   None
+  // @post:  The text is queued for each subscriber
+  // @param  text: Complete lines
+  //---------------------------------------------------------------------------
+  void publish(const string& text);
+
+  //---------------------------------------------------------------------------
+  // setSubscribed
+  // Selects whether a client receives publish() output
+  //
+  // @pre:   None
+  // @post:  The client's subscription is updated
+  // @param  client:     AdminRequest::client
+  // @param  subscribed: True to receive events
+  //---------------------------------------------------------------------------
+  void setSubscribed(int client, bool subscribed);
+
+  //---------------------------------------------------------------------------
+  // wake
+  // Makes a thread in wait() return
+  //
+  // @pre:   None
+  // @post:  None
+  //---------------------------------------------------------------------------
+  void wake();
+
+ private:
+  //A connected client
+  struct adminClient {
+    int sd;
+    string input;         //Received, not yet a complete line
+    string output;        //Queued, not yet written
+    bool subscribed;      //Receives publish() output
+    bool overflowed;      //Fell ADMIN_MAX_OUTPUT behind; dropped by wait()
+    bool closing;         //Shut down its side; dropped once output is out
+  };
+
+  //Appends output for a client and wakes wait(); the caller holds lock
+  void queueLocked(adminClient& client, const string& text);
+
+  //Writes as much queued output as the socket takes; the caller holds lock
+  bool flushLocked(adminClient& client);
+
+  map<int, adminClient> clients;   //Clients by ID
+  int listener;
+  int wakePipe[2];                 //wake() writes, wait() polls the read end
+  int nextClient;
+  string path;
+  pthread_mutex_t lock;            //Guards clients and path
+};
+
+#endif /* ADMINSOCKET_H_ */
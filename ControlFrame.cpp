@@ -0,0 +1,337 @@
+#include "ControlFrame.h"
+
+const int CONTROL_MAGIC_SIZE = 3;   //-32, -31, -29
+const int TYPE_OFFSET = 3;
+const int SEQUENCE_OFFSET = 4;
+const int TIMESTAMP_OFFSET = 8;
+const int CAPABILITY_SIZE = CONTROL_MAGIC_SIZE + 4;  //Marker and 32-bit bits
+const int IDENTITY_SIZE = 6;        //Node ID and group address
+const int FRAGMENT_LENGTH_OFFSET = 8;
+const int FRAGMENT_OFFSET_OFFSET = 12;
+const int FRAGMENT_SOURCE_OFFSET = 16;
+
+//-----------------------------------------------------------------------------
+// putMagic
+// Writes the control marker -32, -31, -29 at the start of a buffer
+//
+// @pre:   buffer holds at least 3 bytes
+// @post:  The first 3 bytes are the control marker
+// @param  buffer: The buffer to write
+//-----------------------------------------------------------------------------
+static void putMagic(char* buffer) {
+  buffer[0] = -32;
+  buffer[1] = -31;
+  buffer[2] = -29;
+}
+
+//-----------------------------------------------------------------------------
+// hasMagic
+// Returns true if a buffer starts with the control marker
+//
+// @pre:   buffer holds at least 3 bytes
+// @post:  None
+// @param  buffer: The buffer to inspect
+// @returns bool:  True if the marker is present
+//-----------------------------------------------------------------------------
+static bool hasMagic(const char* buffer) {
+  return buffer[0] == -32 && buffer[1] == -31 && buffer[2] == -29;
+}
+
+//-----------------------------------------------------------------------------
+// putBigEndian
+// Stores the low "bytes" bytes of a value big endian
+//
+// @pre:   buffer holds bytes bytes
+// @post:  buffer holds the value
+// @param  buffer: Where to write
+// @param  value:  The value
+// @param  bytes:  Number of bytes to write
+//-----------------------------------------------------------------------------
+static void putBigEndian(char* buffer, unsigned long long value, int bytes) {
+  for (int i = bytes - 1; i >= 0; i--) {
+    buffer[i] = (char)(value & 0xFF);
+    value >>= 8;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// getBigEndian
+// Reads a big endian value of "bytes" bytes
+//
+// @pre:   buffer holds bytes bytes
+// @post:  None
+// @param  buffer: Where to read
+// @param  bytes:  Number of bytes to read
+// @returns unsigned long long: The value
+//-----------------------------------------------------------------------------
+static unsigned long long getBigEndian(const char* buffer, int bytes) {
+  unsigned long long value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value = (value << 8) | (unsigned char)buffer[i];
+  }
+  return value;
+}
+
+//-----------------------------------------------------------------------------
+// isControl
+// Returns true if a frame received on a TCP connection is a control frame
+//
+// @pre:   frame holds at least 4 bytes
+// @post:  None
+// @param  frame: The frame to inspect
+// @returns bool: True for a control frame, false for a packet
+//-----------------------------------------------------------------------------
+bool ControlFrame::isControl(const char* frame) {
+  return hasMagic(frame);
+}
+
+//-----------------------------------------------------------------------------
+// build
+// Writes a control frame
+//
+// @pre:   frame is capacity bytes long, capacity >= CONTROL_FRAME_SIZE
+// @post:  frame holds the control frame, the rest of the buffer zeroed
+// @param  frame:       The buffer to fill
+// @param  capacity:    Size of the buffer
+// @param  type:        CONTROL_HELLO, CONTROL_PING, CONTROL_PONG, ...
+// @param  sequence:    Sequence number
+// @param  timestampUs: Timestamp to carry
+//-----------------------------------------------------------------------------
+void ControlFrame::build(char* frame, int capacity, int type,
+    unsigned int sequence, long long timestampUs) {
+  memset(frame, 0, capacity);
+  putMagic(frame);
+  frame[TYPE_OFFSET] = (char)type;
+  putBigEndian(frame + SEQUENCE_OFFSET, sequence, 4);
+  putBigEndian(frame + TIMESTAMP_OFFSET, timestampUs, 8);
+}
+
+//-----------------------------------------------------------------------------
+// getType
+// Returns the type of a control frame
+//
+// @pre:   isControl(frame)
+// @post:  None
+// @param  frame: The frame to inspect
+// @returns int:  The frame type
+//-----------------------------------------------------------------------------
+int ControlFrame::getType(const char* frame) {
+  return (unsigned char)frame[TYPE_OFFSET];
+}
+
+//-----------------------------------------------------------------------------
+// getSequence
+// Returns the sequence number of a control frame
+//
+// @pre:   isControl(frame)
+// @post:  None
+// @param  frame:         The frame to inspect
+// @returns unsigned int: The sequence number
+//-----------------------------------------------------------------------------
+unsigned int ControlFrame::getSequence(const char* frame) {
+  return (unsigned int)getBigEndian(frame + SEQUENCE_OFFSET, 4);
+}
+
+//-----------------------------------------------------------------------------
+// getTimestamp
+// Returns the timestamp of a control frame
+//
+// @pre:   isControl(frame)
+// @post:  None
+// @param  frame:      The frame to inspect
+// @returns long long: The timestamp in us
+//-----------------------------------------------------------------------------
+long long ControlFrame::getTimestamp(const char* frame) {
+  return (long long)getBigEndian(frame + TIMESTAMP_OFFSET, 8);
+}
+
+//-----------------------------------------------------------------------------
+// setTimestamp
+// Overwrites the timestamp of a control frame
+//
+// @pre:   isControl(frame)
+// @post:  getTimestamp(frame) == timestampUs
+// @param  frame:       The frame to modify
+// @param  timestampUs: The new timestamp
+//-----------------------------------------------------------------------------
+void ControlFrame::setTimestamp(char* frame, long long timestampUs) {
+  putBigEndian(frame + TIMESTAMP_OFFSET, timestampUs, 8);
+}
+
+//-----------------------------------------------------------------------------
+// addCapabilities
+// Appends capability bits after the \0-terminated host name of a connection
+// handshake
+//
+// @pre:   handshake holds a \0-terminated name and is capacity bytes long
+// @post:  The capabilities and node identity follow the name if they fit
+// @param  handshake:    The handshake buffer
+// @param  capacity:     Size of the buffer
+// @param  capabilities: CAPABILITY_* bits
+// @param  nodeId:       The sender's node ID
+// @param  groupAddress: The sender's group IP, packed
+//-----------------------------------------------------------------------------
+void ControlFrame::addCapabilities(char* handshake, int capacity,
+    unsigned int capabilities, unsigned int nodeId,
+    unsigned int groupAddress) {
+  int offset = strnlen(handshake, capacity) + 1;
+  if (offset + CAPABILITY_SIZE + IDENTITY_SIZE > capacity) {
+    return;
+  }
+  putMagic(handshake + offset);
+  putBigEndian(handshake + offset + CONTROL_MAGIC_SIZE, capabilities, 4);
+  putBigEndian(handshake + offset + CAPABILITY_SIZE, nodeId, 2);
+  putBigEndian(handshake + offset + CAPABILITY_SIZE + 2, groupAddress, 4);
+}
+
+//-----------------------------------------------------------------------------
+// getCapabilities
+// Returns the capability bits of a connection handshake
+//
+// @pre:   handshake is capacity bytes long
+// @post:  None
+// @param  handshake:     The handshake received
+// @param  capacity:      Size of the buffer
+// @returns unsigned int: CAPABILITY_* bits, 0 from relays that send none
+//-----------------------------------------------------------------------------
+unsigned int ControlFrame::getCapabilities(const char* handshake,
+    int capacity) {
+  int offset = strnlen(handshake, capacity) + 1;
+  if (offset + CAPABILITY_SIZE > capacity || !hasMagic(handshake + offset)) {
+    return 0;
+  }
+  return (unsigned int)getBigEndian(handshake + offset + CONTROL_MAGIC_SIZE,
+      4);
+}
+
+//-----------------------------------------------------------------------------
+// getNodeIdentity
+// Reads the node identity that follows the capabilities of a handshake
+//
+// @pre:   handshake is capacity bytes long
+// @post:  nodeId and groupAddress are set if true is returned
+// @param  handshake:    The handshake received
+// @param  capacity:     Size of the buffer
+// @param  nodeId:       Receives the sender's node ID
+// @param  groupAddress: Receives the sender's group IP, packed
+// @returns bool:        False from relays that send no identity
+//-----------------------------------------------------------------------------
+bool ControlFrame::getNodeIdentity(const char* handshake, int capacity,
+    unsigned int& nodeId, unsigned int& groupAddress) {
+  int offset = strnlen(handshake, capacity) + 1;
+  if (offset + CAPABILITY_SIZE + IDENTITY_SIZE > capacity ||
+      !hasMagic(handshake + offset)) {
+    return false;
+  }
+  nodeId = (unsigned int)getBigEndian(handshake + offset + CAPABILITY_SIZE, 2);
+  groupAddress = (unsigned int)getBigEndian(
+      handshake + offset + CAPABILITY_SIZE + 2, 4);
+  return groupAddress != 0;
+}
+
+//-----------------------------------------------------------------------------
+// packIdentity
+// Converts a node identity to the timestamp field of a hello
+//
+// @pre:   nodeId < 65536
+// @post:  None
+// @param  nodeId:       The node ID
+// @param  groupAddress: The group IP, packed
+// @returns long long:   The timestamp field
+//-----------------------------------------------------------------------------
+long long ControlFrame::packIdentity(unsigned int nodeId,
+    unsigned int groupAddress) {
+  return ((long long)groupAddress << 16) | (nodeId & 0xFFFF);
+}
+
+//-----------------------------------------------------------------------------
+// unpackIdentity
+// Converts the timestamp field of a hello back to a node identity
+//
+// @pre:   None
+// @post:  nodeId and groupAddress hold the identity, 0 if none was sent
+// @param  identity:     The timestamp field of a hello
+// @param  nodeId:       Receives the node ID
+// @param  groupAddress: Receives the group IP, packed
+//-----------------------------------------------------------------------------
+void ControlFrame::unpackIdentity(long long identity, unsigned int& nodeId,
+    unsigned int& groupAddress) {
+  nodeId = (unsigned int)(identity & 0xFFFF);
+  groupAddress = (unsigned int)((identity >> 16) & 0xFFFFFFFF);
+}
+
+//-----------------------------------------------------------------------------
+// buildFragment
+// Writes a fragment frame holding as much of a packet from offset on as fits
+// in capacity
+//
+// @pre:   frame is capacity bytes long, capacity > FRAGMENT_HEADER_SIZE,
+//         0 <= offset < length
+// @post:  frame holds the fragment
+// @param  frame:    The buffer to fill
+// @param  capacity: Size of the frame
+// @param  packetId: ID shared by all fragments of the packet
+// @param  source:   The fragmenting sender's ID
+// @param  packet:   The whole packet
+// @param  length:   Bytes in the packet
+// @param  offset:   First packet byte this fragment carries
+// @returns int:     Number of packet bytes the fragment carries
+//-----------------------------------------------------------------------------
+int ControlFrame::buildFragment(char* frame, int capacity,
+    unsigned int packetId, unsigned int source, const char* packet,
+    int length, int offset) {
+  int data = capacity - FRAGMENT_HEADER_SIZE;
+  if (data > length - offset) {
+    data = length - offset;
+  }
+  putMagic(frame);
+  frame[TYPE_OFFSET] = (char)CONTROL_FRAGMENT;
+  putBigEndian(frame + SEQUENCE_OFFSET, packetId, 4);
+  putBigEndian(frame + FRAGMENT_LENGTH_OFFSET, length, 4);
+  putBigEndian(frame + FRAGMENT_OFFSET_OFFSET, offset, 4);
+  putBigEndian(frame + FRAGMENT_SOURCE_OFFSET, source, 4);
+  memcpy(frame + FRAGMENT_HEADER_SIZE, packet + offset, data);
+  return data;
+}
+
+//-----------------------------------------------------------------------------
+// getFragment
+// Reads the fields of a fragment frame
+//
+// @pre:   getType(frame) == CONTROL_FRAGMENT, frame is capacity bytes long
+// @post:  The fields are set if true is returned
+// @param  frame:      The frame received
+// @param  capacity:   Bytes received: the datagram length, or the frame size
+//                     on a TCP connection
+// @param  packetId:   Receives the packet ID
+// @param  source:     Receives the fragmenting sender's ID
+// @param  length:     Receives the length of the whole packet
+// @param  offset:     Receives the offset of the data
+// @param  data:       Receives a pointer to the data within frame
+// @param  dataLength: Receives the number of data bytes
+// @returns bool:      False if the fields are inconsistent
+//-----------------------------------------------------------------------------
+bool ControlFrame::getFragment(const char* frame, int capacity,
+    unsigned int& packetId, unsigned int& source, int& length, int& offset,
+    const char*& data, int& dataLength) {
+  if (capacity <= FRAGMENT_HEADER_SIZE) {
+    return false;
+  }
+  packetId = getSequence(frame);
+  source = (unsigned int)getBigEndian(frame + FRAGMENT_SOURCE_OFFSET, 4);
+  unsigned int total = (unsigned int)getBigEndian(
+      frame + FRAGMENT_LENGTH_OFFSET, 4);
+  unsigned int start = (unsigned int)getBigEndian(
+      frame + FRAGMENT_OFFSET_OFFSET, 4);
+  if (total > 0x7FFFFFFF || start >= total) {
+    return false;
+  }
+  length = (int)total;
+  offset = (int)start;
+  data = frame + FRAGMENT_HEADER_SIZE;
+  dataLength = capacity - FRAGMENT_HEADER_SIZE;
+  if (dataLength > length - offset) {
+    dataLength = length - offset;
+  }
+  return true;
+}
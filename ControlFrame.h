@@ -0,0 +1,255 @@
+#ifndef CONTROLFRAME_H_
+#define CONTROLFRAME_H_
+
+#include <string.h>
+
+//Control frame types
+const int CONTROL_HELLO = 1;      //Sender understands control frames
+const int CONTROL_PING = 2;       //Heartbeat, answered by a pong
+const int CONTROL_PONG = 3;       //Heartbeat answer echoing the ping
+const int CONTROL_JUMBO = 4;      //The packet after it is larger than a frame
+const int CONTROL_FRAGMENT = 5;   //Carries part of a larger packet
+const int CONTROL_REDUNDANT = 6;  //The packet after it is one copy of a
+                                  //message sent over several paths
+const int CONTROL_NODE = 7;       //Binds a node ID to a relay anywhere in the
+                                  //mesh, passed on by every relay it is new to
+const int CONTROL_FRAME_SIZE = 16; //Bytes used; frames are sent padded to
+                                  //the full packet size
+const int FRAGMENT_HEADER_SIZE = 20; //Bytes before a fragment's data
+
+//Capability bits carried in the connection handshake
+const unsigned int CAPABILITY_CONTROL = 0x1;  //Accepts control frames
+const unsigned int CAPABILITY_HEADER_V2 = 0x2; //Accepts version 2 headers
+const unsigned int CAPABILITY_HEADER_BLOOM = 0x4; //Accepts version 3 headers
+const unsigned int CAPABILITY_JUMBO = 0x8;    //Accepts jumbo and fragment
+                                              //frames
+const unsigned int CAPABILITY_TRACE = 0x10;   //Parses the trace extension
+const unsigned int CAPABILITY_PRIORITY = 0x20; //Reads priority bits in the
+                                               //hop byte
+
+//-----------------------------------------------------------------------------
+// Class:       ControlFrame
+// Description: Static helpers for the link-level frames relays exchange on a
+//              TCP connection next to packets. A control frame is the same
+//              size as a packet but starts with -32, -31, -29 so it can never
+//              be mistaken for one:
+//
+//              Byte 0-2:  -32, -31, -29
+//              Byte 3:    Frame type (CONTROL_HELLO, _PING, _PONG, ...)
+//              Byte 4-7:  Sequence number, big endian
+//              Byte 8-15: Timestamp in us, big endian. A ping carries the
+//                         sender's monotonic clock; a pong echoes it.
+//
+//              A packet larger than a frame goes to a relay that offered
+//              CAPABILITY_JUMBO either whole, after a jumbo frame whose
+//              sequence is the packet's length, or split into fragment
+//              frames that the receiver reassembles:
+//
+//              Byte 0-3:   -32, -31, -29, CONTROL_FRAGMENT
+//              Byte 4-7:   Packet ID, unique per sender
+//              Byte 8-11:  Length of the whole packet
+//              Byte 12-15: Offset of this fragment's data in the packet
+//              Byte 16-19: ID of the sender that fragmented it, random per
+//                          process
+//              Byte 20-:   Data, as much as the frame holds
+//
+//              Fragments are also multicast on a local group whose MTU is
+//              smaller than a packet, one fragment per datagram.
+//
+//              A packet of a redundant group follows a redundant frame whose
+//              sequence is the index of the path it was sent on and whose
+//              timestamp is the message ID, the same in every copy: the
+//              sender's fragment ID in the high 32 bits and a per-sender
+//              count in the low 32. A UDP link sends the frame's first
+//              CONTROL_FRAME_SIZE bytes and the packet as one frame.
+//
+//              Control frames are only sent to relays known to understand
+//              them. A connecting relay appends its capabilities to the host
+//              name it sends when it connects (after the name's \0, which
+//              older relays ignore); the accepting relay answers with a hello
+//              frame, which tells the connecting relay the reverse.
+//
+//              Both also carry the sender's node identity, its 16-bit node ID
+//              and its group address: the handshake after the capabilities,
+//              a hello in its sequence (capabilities) and timestamp
+//              (packIdentity) fields. Relays that predate node IDs send a
+//              hello with both fields 0. A node frame carries another relay's
+//              identity the same way in its timestamp, so IDs that collide
+//              between relays that are not directly connected are found too.
+//-----------------------------------------------------------------------------
+class ControlFrame {
+ public:
+  //---------------------------------------------------------------------------
+  // isControl
+  // Returns true if a frame received on a TCP connection is a control frame
+  //
+  // @pre:   frame holds at least 4 bytes
+  // @post:  None
+  // @param  frame: The frame to inspect
+  // @returns bool: True for a control frame, false for a packet
+  //---------------------------------------------------------------------------
+  static bool isControl(const char* frame);
+
+  //---------------------------------------------------------------------------
+  // build
+  // Writes a control frame
+  //
+  // @pre:   frame is capacity bytes long, capacity >= CONTROL_FRAME_SIZE
+  // @post:  frame holds the control frame, the rest of the buffer zeroed
+  // @param  frame:       The buffer to fill
+  // @param  capacity:    Size of the buffer
+  // @param  type:        CONTROL_HELLO, CONTROL_PING, CONTROL_PONG, ...
+  // @param  sequence:    Sequence number
+  // @param  timestampUs: Timestamp to carry
+  //---------------------------------------------------------------------------
+  static void build(char* frame, int capacity, int type, unsigned int sequence,
+      long long timestampUs);
+
+  //---------------------------------------------------------------------------
+  // getType
+  // Returns the type of a control frame
+  //
+  // @pre:   isControl(frame)
+  // @post:  None
+  // @param  frame: The frame to inspect
+  // @returns int:  The frame type
+  //---------------------------------------------------------------------------
+  static int getType(const char* frame);
+
+  //---------------------------------------------------------------------------
+  // getSequence
+  // Returns the sequence number of a control frame
+  //
+  // @pre:   isControl(frame)
+  // @post:  None
+  // @param  frame:         The frame to inspect
+  // @returns unsigned int: The sequence number
+  //---------------------------------------------------------------------------
+  static unsigned int getSequence(const char* frame);
+
+  //---------------------------------------------------------------------------
+  // getTimestamp
+  // Returns the timestamp of a control frame
+  //
+  // @pre:   isControl(frame)
+  // @post:  None
+  // @param  frame:      The frame to inspect
+  // @returns long long: The timestamp in us
+  //---------------------------------------------------------------------------
+  static long long getTimestamp(const char* frame);
+
+  //---------------------------------------------------------------------------
+  // setTimestamp
+  // Overwrites the timestamp of a control frame
+  //
+  // @pre:   isControl(frame)
+  // @post:  getTimestamp(frame) == timestampUs
+  // @param  frame:       The frame to modify
+  // @param  timestampUs: The new timestamp
+  //---------------------------------------------------------------------------
+  static void setTimestamp(char* frame, long long timestampUs);
+
+  //---------------------------------------------------------------------------
+  // addCapabilities
+  // Appends capability bits after the \0-terminated host name of a
+  // connection handshake
+  //
+  // @pre:   handshake holds a \0-terminated name and is capacity bytes long
+  // @post:  The capabilities and node identity follow the name if they fit
+  // @param  handshake:    The handshake buffer
+  // @param  capacity:     Size of the buffer
+  // @param  capabilities: CAPABILITY_* bits
+  // @param  nodeId:       The sender's node ID
+  // @param  groupAddress: The sender's group IP, packed
+  //---------------------------------------------------------------------------
+  static void addCapabilities(char* handshake, int capacity,
+      unsigned int capabilities, unsigned int nodeId,
+      unsigned int groupAddress);
+
+  //---------------------------------------------------------------------------
+  // getCapabilities
+  // Returns the capability bits of a connection handshake
+  //
+  // @pre:   handshake is capacity bytes long
+  // @post:  None
+  // @param  handshake:     The handshake received
+  // @param  capacity:      Size of the buffer
+  // @returns unsigned int: CAPABILITY_* bits, 0 from relays that send none
+  //---------------------------------------------------------------------------
+  static unsigned int getCapabilities(const char* handshake, int capacity);
+
+  //---------------------------------------------------------------------------
+  // getNodeIdentity
+  // Reads the node identity that follows the capabilities of a handshake
+  //
+  // @pre:   handshake is capacity bytes long
+  // @post:  nodeId and groupAddress are set if true is returned
+  // @param  handshake:    The handshake received
+  // @param  capacity:     Size of the buffer
+  // @param  nodeId:       Receives the sender's node ID
+  // @param  groupAddress: Receives the sender's group IP, packed
+  // @returns bool:        False from relays that send no identity
+  //---------------------------------------------------------------------------
+  static bool getNodeIdentity(const char* handshake, int capacity,
+      unsigned int& nodeId, unsigned int& groupAddress);
+
+  //---------------------------------------------------------------------------
+  // packIdentity / unpackIdentity
+  // Converts a node identity to and from the timestamp field of a hello
+  //
+  // @pre:   nodeId < 65536
+  // @post:  None
+  // @param  nodeId:       The node ID
+  // @param  groupAddress: The group IP, packed
+  // @param  identity:     The timestamp field of a hello
+  //---------------------------------------------------------------------------
+  static long long packIdentity(unsigned int nodeId, unsigned int groupAddress);
+  static void unpackIdentity(long long identity, unsigned int& nodeId,
+      unsigned int& groupAddress);
+
+  //---------------------------------------------------------------------------
+  // buildFragment
+  // Writes a fragment frame holding as much of a packet from offset on as
+  // fits in capacity
+  //
+  // @pre:   frame is capacity bytes long, capacity > FRAGMENT_HEADER_SIZE,
+  //         0 <= offset < length
+  // @post:  frame holds the fragment
+  // @param  frame:    The buffer to fill
+  // @param  capacity: Size of the frame
+  // @param  packetId: ID shared by all fragments of the packet
+  // @param  source:   The fragmenting sender's ID
+  // @param  packet:   The whole packet
+  // @param  length:   Bytes in the packet
+  // @param  offset:   First packet byte this fragment carries
+  // @returns int:     Number of packet bytes the fragment carries
+  //---------------------------------------------------------------------------
+  static int buildFragment(char* frame, int capacity, unsigned int packetId,
+      unsigned int source, const char* packet, int length, int offset);
+
+  //---------------------------------------------------------------------------
+  // getFragment
+  // Reads the fields of a fragment frame
+  //
+  // @pre:   getType(frame) == CONTROL_FRAGMENT, frame is capacity bytes long
+  // @post:  The fields are set if true is returned
+  // @param  frame:      The frame received
+  // @param  capacity:   Bytes received: the datagram length, or the frame
+  //                     size on a TCP connection
+  // @param  packetId:   Receives the packet ID
+  // @param  source:     Receives the fragmenting sender's ID
+  // @param  length:     Receives the length of the whole packet
+  // @param  offset:     Receives the offset of the data
+  // @param  data:       Receives a pointer to the data within frame
+  // @param  dataLength: Receives the number of data bytes
+  // @returns bool:      False if the fields are inconsistent
+  //---------------------------------------------------------------------------
+  static bool getFragment(const char* frame, int capacity,
+      unsigned int& packetId, unsigned int& source, int& length, int& offset,
+      const char*& data, int& dataLength);
+
+ private:
+  ControlFrame() {}
+};
+
+#endif /* CONTROLFRAME_H_ */
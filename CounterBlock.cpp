@@ -0,0 +1,110 @@
+#include "CounterBlock.h"
+
+//-----------------------------------------------------------------------------
+// CounterBlock Constructor
+// Creates zeroed counters for a direction and peer
+//
+// @pre:   None
+// @post:  Every count is 0
+// @param  direction: What is counted, e.g. "received" or "sent"
+// @param  peer:      The peer, or "local" for the local group
+//-----------------------------------------------------------------------------
+CounterBlock::CounterBlock(const string& direction, const string& peer) {
+  this->direction = direction;
+  this->peer = peer;
+  packets = 0;
+  bytes = 0;
+  for (int i = 0; i < COUNTER_GROUPS; i++) {
+    groups[i].group = 0;
+    groups[i].packets = 0;
+    groups[i].bytes = 0;
+  }
+  others.group = 0;
+  others.packets = 0;
+  others.bytes = 0;
+}
+
+//-----------------------------------------------------------------------------
+// count
+// Counts one packet
+//
+// @pre:   Called only by the owning thread
+// @post:  The totals and the group's counts are incremented
+// @param  group: The packet's origin group IP in host byte order
+// @param  bytes: The packet's length
+//-----------------------------------------------------------------------------
+void CounterBlock::count(unsigned int group, int bytes) {
+  packets = packets + 1;
+  this->bytes = this->bytes + bytes;
+  groupSlot* slot = &others;
+  if (group != 0) {
+    for (int probe = 0; probe < COUNTER_GROUPS; probe++) {
+      groupSlot& candidate = groups[(group + probe) % COUNTER_GROUPS];
+      if (candidate.group == group) {
+        slot = &candidate;
+        break;
+      }
+      if (candidate.group == 0) {
+        //Claim the slot; readers skip it until the group is visible
+        candidate.group = group;
+        __sync_synchronize();
+        slot = &candidate;
+        break;
+      }
+    }
+  }
+  slot->packets = slot->packets + 1;
+  slot->bytes = slot->bytes + bytes;
+}
+
+//-----------------------------------------------------------------------------
+// addTo
+// Adds the current counts to a snapshot
+//
+// @pre:   None
+// @post:  snapshot holds its previous counts plus this block's
+// @param  snapshot: The totals to add to
+//-----------------------------------------------------------------------------
+void CounterBlock::addTo(CounterSnapshot& snapshot) const {
+  snapshot.packets += packets;
+  snapshot.bytes += bytes;
+  for (int i = 0; i < COUNTER_GROUPS; i++) {
+    unsigned int group = groups[i].group;
+    if (group == 0) {
+      continue;
+    }
+    __sync_synchronize();
+    pair<long long, long long>& counts = snapshot.groups[group];
+    counts.first += groups[i].packets;
+    counts.second += groups[i].bytes;
+  }
+  if (others.packets > 0) {
+    pair<long long, long long>& counts = snapshot.groups[0];
+    counts.first += others.packets;
+    counts.second += others.bytes;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// getDirection
+// Returns what the block counts
+//
+// @pre:   None
+// @post:  None
+// @returns string: The direction given to the constructor
+//-----------------------------------------------------------------------------
+const string& CounterBlock::getDirection() const {
+  return direction;
+}
+
+//-----------------------------------------------------------------------------
+// getPeer
+// Returns the peer the block counts for
+//
+// @pre:   None
+// @post:  None
+// @returns string: The peer given to the constructor
+//-----------------------------------------------------------------------------
+const string& CounterBlock::getPeer() const {
+  return peer;
+}
@@ -0,0 +1,93 @@
+#ifndef COUNTERBLOCK_H_
+#define COUNTERBLOCK_H_
+
+#include <map>
+#include <string>
+#include <utility>
+
+using namespace std;
+
+const int COUNTER_GROUPS = 64;  //Origin groups counted apart per block; the
+                                //rest are counted under group 0
+
+//Totals read from one or more counter blocks
+struct CounterSnapshot {
+  long long packets;
+  long long bytes;
+  map<unsigned int, pair<long long, long long> > groups; //(packets, bytes)
+                                                         //by origin group
+  CounterSnapshot() : packets(0), bytes(0) {}
+};
+
+//-----------------------------------------------------------------------------
+// Class:       CounterBlock
+// Description: Packet and byte counters owned by one relay thread, with a
+//              breakdown by origin group. Only the owning thread calls
+//              count(), so counting is a few plain stores with no lock or
+//              atomic instruction; any other thread may call addTo() at the
+//              same time to read a snapshot. Each value is an aligned 64-bit
+//              word, so on 64-bit hosts a reader sees it either before or
+//              after an update, and a group's slot is published before
+//              its counts so a reader never sees counts without their group.
+//-----------------------------------------------------------------------------
+class CounterBlock {
+ public:
+  //---------------------------------------------------------------------------
+  // CounterBlock Constructor
+  // Creates zeroed counters for a direction and peer
+  //
+  // @pre:   None
+  // @post:  Every count is 0
+  // @param  direction: What is counted, e.g. "received" or "sent"
+  // @param  peer:      The peer, or "local" for the local group
+  //---------------------------------------------------------------------------
+  CounterBlock(const string& direction, const string& peer);
+
+  //---------------------------------------------------------------------------
+  // count
+  // Counts one packet
+  //
+  // @pre:   Called only by the owning thread
+  // @post:  The totals and the group's counts are incremented
+  // @param  group: The packet's origin group IP in host byte order
+  // @param  bytes: The packet's length
+  //---------------------------------------------------------------------------
+  void count(unsigned int group, int bytes);
+
+  //---------------------------------------------------------------------------
+  // addTo
+  // Adds the current counts to a snapshot
+  //
+  // @pre:   None
+  // @post:  snapshot holds its previous counts plus this block's
+  // @param  snapshot: The totals to add to
+  //---------------------------------------------------------------------------
+  void addTo(CounterSnapshot& snapshot) const;
+
+  //---------------------------------------------------------------------------
+  // getDirection / getPeer
+  // Return what the block counts and for which peer
+  //
+  // @pre:   None
+  // @post:  None
+  //---------------------------------------------------------------------------
+  const string& getDirection() const;
+  const string& getPeer() const;
+
+ private:
+  //Counts for one origin group, open addressed by group
+  struct groupSlot {
+    volatile unsigned int group;   //0 = free
+    volatile long long packets;
+    volatile long long bytes;
+  };
+
+  string direction;
+  string peer;
+  volatile long long packets;
+  volatile long long bytes;
+  groupSlot groups[COUNTER_GROUPS];
+  groupSlot others;                //Groups that found no free slot
+};
+
+#endif /* COUNTERBLOCK_H_ */
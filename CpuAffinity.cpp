@@ -0,0 +1,92 @@
+#include "CpuAffinity.h"
+#include <fstream>
+#include <sstream>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+//-----------------------------------------------------------------------------
+// parse
+// Converts a CPU specification into a cpu_set_t
+//
+// @pre:   None
+// @post:  cpus holds the CPUs named by spec if it was valid
+// @param  spec:  A CPU specification as described in the class header
+// @param  cpus:  Receives the CPU set
+// @returns bool: False if spec is malformed or names no CPUs
+//-----------------------------------------------------------------------------
+bool CpuAffinity::parse(const string& spec, cpu_set_t& cpus) {
+  CPU_ZERO(&cpus);
+  if (spec.empty() || spec == "none") {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    for (long i = 0; i < online && i < CPU_SETSIZE; i++) {
+      CPU_SET(i, &cpus);
+    }
+    return online > 0;
+  }
+  if (spec.compare(0, 4, "node") == 0) {
+    string path = "/sys/devices/system/node/" + spec + "/cpulist";
+    ifstream cpulist(path.c_str());
+    string list;
+    if (!getline(cpulist, list)) {
+      return false;
+    }
+    return parseList(list, cpus);
+  }
+  return parseList(spec, cpus);
+}
+
+//-----------------------------------------------------------------------------
+// pinCurrentThread
+// Restricts the calling thread to the CPUs named by spec
+//
+// @pre:   None
+// @post:  The calling thread only runs on those CPUs, or is unchanged on
+//         failure
+// @param  spec:  A CPU specification as described in the class header
+// @returns bool: False if spec is invalid or the kernel refused it
+//-----------------------------------------------------------------------------
+bool CpuAffinity::pinCurrentThread(const string& spec) {
+  cpu_set_t cpus;
+  if (!parse(spec, cpus)) {
+    return false;
+  }
+  return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+}
+
+//-----------------------------------------------------------------------------
+// parseList
+// Adds every CPU of a Linux cpulist string ("0-3,8,10-11") to cpus
+//
+// @pre:   None
+// @post:  cpus includes the listed CPUs
+// @param  list:  The cpulist string
+// @returns bool: False if the list is malformed or empty
+//-----------------------------------------------------------------------------
+bool CpuAffinity::parseList(const string& list, cpu_set_t& cpus) {
+  stringstream items(list);
+  string item;
+  bool any = false;
+  while (getline(items, item, ',')) {
+    if (item.empty()) {
+      continue;
+    }
+    char* end = NULL;
+    long first = strtol(item.c_str(), &end, 10);
+    long last = first;
+    if (*end == '-') {
+      last = strtol(end + 1, &end, 10);
+    }
+    if (*end != '\0' && *end != '\n') {
+      return false;
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE) {
+      return false;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      CPU_SET(cpu, &cpus);
+      any = true;
+    }
+  }
+  return any;
+}
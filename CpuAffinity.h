@@ -0,0 +1,51 @@
+#ifndef CPUAFFINITY_H_
+#define CPUAFFINITY_H_
+
+#include <sched.h>
+#include <string>
+
+using namespace std;
+
+//-----------------------------------------------------------------------------
+// Class:       CpuAffinity
+// Description: Static helpers that pin the calling thread to a set of CPUs.
+//              A CPU specification is one of:
+//
+//              "3", "0,2", "4-7"  CPU numbers and ranges (Linux cpulist form)
+//              "node1"            every CPU of NUMA node 1, read from sysfs
+//              "none" or ""       every online CPU (undoes a previous pin)
+//-----------------------------------------------------------------------------
+class CpuAffinity {
+ public:
+  //---------------------------------------------------------------------------
+  // parse
+  // Converts a CPU specification into a cpu_set_t
+  //
+  // @pre:   None
+  // @post:  cpus holds the CPUs named by spec if it was valid
+  // @param  spec:  A CPU specification as described above
+  // @param  cpus:  Receives the CPU set
+  // @returns bool: False if spec is malformed or names no CPUs
+  //---------------------------------------------------------------------------
+  static bool parse(const string& spec, cpu_set_t& cpus);
+
+  //---------------------------------------------------------------------------
+  // pinCurrentThread
+  // Restricts the calling thread to the CPUs named by spec
+  //
+  // @pre:   None
+  // @post:  The calling thread only runs on those CPUs, or is unchanged on
+  //         failure
+  // @param  spec:  A CPU specification as described above
+  // @returns bool: False if spec is invalid or the kernel refused it
+  //---------------------------------------------------------------------------
+  static bool pinCurrentThread(const string& spec);
+
+ private:
+  CpuAffinity() {}
+
+  //Adds a cpulist string ("0-3,8") to cpus
+  static bool parseList(const string& list, cpu_set_t& cpus);
+};
+
+#endif /* CPUAFFINITY_H_ */
@@ -0,0 +1,403 @@
+#include "Handoff.h"
+#include <errno.h>
+#include <stdint.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+//-----------------------------------------------------------------------------
+// fillAddress
+// Builds the address of a Unix socket file
+//
+// @pre:   None
+// @post:  address holds path if true is returned
+// @param  path:    The socket file
+// @param  address: Receives the address
+// @returns bool:   False if the path is too long (errno is set)
+//-----------------------------------------------------------------------------
+static bool fillAddress(const string& path, struct sockaddr_un& address) {
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  strcpy(address.sun_path, path.c_str());
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// sendAll
+// Sends every byte of a buffer
+//
+// @pre:   sd is a connected stream socket
+// @post:  None
+// @param  sd:     The socket
+// @param  buffer: The bytes
+// @param  length: Bytes to send
+// @returns bool:  False if the other end went away
+//-----------------------------------------------------------------------------
+static bool sendAll(int sd, const char* buffer, size_t length) {
+  size_t sent = 0;
+  while (sent < length) {
+    ssize_t bytes = ::send(sd, buffer + sent, length - sent, MSG_NOSIGNAL);
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes <= 0) {
+      return false;
+    }
+    sent += bytes;
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// receiveAll
+// Receives exactly length bytes
+//
+// @pre:   sd is a connected stream socket, buffer holds length bytes
+// @post:  buffer holds the bytes if true is returned
+// @param  sd:     The socket
+// @param  buffer: Receives the bytes
+// @param  length: Bytes to receive
+// @returns bool:  False if the stream ended first
+//-----------------------------------------------------------------------------
+static bool receiveAll(int sd, char* buffer, size_t length) {
+  size_t received = 0;
+  while (received < length) {
+    ssize_t bytes = recv(sd, buffer + received, length - received, 0);
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes <= 0) {
+      return false;
+    }
+    received += bytes;
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// listenAt
+// Creates a Unix stream socket listening on a path, replacing any stale
+// socket file
+//
+// @pre:   None
+// @post:  The path exists if a socket is returned
+// @param  path: The socket file
+// @returns int: The listening socket, -1 on failure (errno is set)
+//-----------------------------------------------------------------------------
+int Handoff::listenAt(const string& path) {
+  struct sockaddr_un address;
+  if (!fillAddress(path, address)) {
+    return -1;
+  }
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) {
+    return -1;
+  }
+  unlink(path.c_str());
+  if (bind(listener, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+      listen(listener, 1) < 0) {
+    int error = errno;
+    close(listener);
+    errno = error;
+    return -1;
+  }
+  return listener;
+}
+
+//-----------------------------------------------------------------------------
+// acceptWithin
+// Waits for a process to connect to a listening socket
+//
+// @pre:   listener was returned by listenAt
+// @post:  None
+// @param  listener:  The listening socket
+// @param  timeoutMs: Longest time to wait
+// @returns int:      The connected socket, -1 on timeout or failure
+//-----------------------------------------------------------------------------
+int Handoff::acceptWithin(int listener, int timeoutMs) {
+  struct pollfd waiting;
+  waiting.fd = listener;
+  waiting.events = POLLIN;
+  waiting.revents = 0;
+  int ready = 0;
+  do {
+    ready = poll(&waiting, 1, timeoutMs);
+  } while (ready < 0 && errno == EINTR);
+  if (ready <= 0) {
+    return -1;
+  }
+  return accept(listener, NULL, NULL);
+}
+
+//-----------------------------------------------------------------------------
+// connectTo
+// Connects to a process listening on a path
+//
+// @pre:   None
+// @post:  None
+// @param  path: The socket file
+// @returns int: The connected socket, -1 on failure (errno is set)
+//-----------------------------------------------------------------------------
+int Handoff::connectTo(const string& path) {
+  struct sockaddr_un address;
+  if (!fillAddress(path, address)) {
+    return -1;
+  }
+  int sd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sd < 0) {
+    return -1;
+  }
+  if (connect(sd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+    int error = errno;
+    close(sd);
+    errno = error;
+    return -1;
+  }
+  return sd;
+}
+
+//-----------------------------------------------------------------------------
+// send
+// Sends the state and descriptors. The descriptors stay open in this process.
+//
+// @pre:   sd is a connected Unix stream socket
+// @post:  None
+// @param  sd:    The socket
+// @param  state: The serialized state
+// @param  fds:   The descriptors to pass
+// @returns bool: False if the other process went away
+//-----------------------------------------------------------------------------
+bool Handoff::send(int sd, const string& state, const vector<int>& fds) {
+  uint32_t header[2];
+  header[0] = htonl(state.size());
+  header[1] = htonl(fds.size());
+  if (!sendAll(sd, (const char*)header, sizeof(header)) ||
+      !sendAll(sd, state.data(), state.size())) {
+    return false;
+  }
+  char control[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MESSAGE)];
+  for (size_t first = 0; first < fds.size();
+      first += HANDOFF_FDS_PER_MESSAGE) {
+    size_t count = fds.size() - first;
+    if (count > (size_t)HANDOFF_FDS_PER_MESSAGE) {
+      count = HANDOFF_FDS_PER_MESSAGE;
+    }
+    //Ancillary data must ride on at least one byte of data
+    char marker = 'F';
+    struct iovec data;
+    data.iov_base = &marker;
+    data.iov_len = 1;
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    memset(control, 0, sizeof(control));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    struct cmsghdr* rights = CMSG_FIRSTHDR(&message);
+    rights->cmsg_level = SOL_SOCKET;
+    rights->cmsg_type = SCM_RIGHTS;
+    rights->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(rights), &fds[first], sizeof(int) * count);
+    ssize_t sent = 0;
+    do {
+      sent = sendmsg(sd, &message, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    if (sent != 1) {
+      return false;
+    }
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// receive
+// Receives the state and descriptors sent with send()
+//
+// @pre:   sd is a connected Unix stream socket
+// @post:  fds holds new descriptors, in the order they were sent, if true is
+//         returned
+// @param  sd:    The socket
+// @param  state: Receives the serialized state
+// @param  fds:   Receives the descriptors
+// @returns bool: False if the stream ended or was malformed
+//-----------------------------------------------------------------------------
+bool Handoff::receive(int sd, string& state, vector<int>& fds) {
+  uint32_t header[2];
+  if (!receiveAll(sd, (char*)header, sizeof(header))) {
+    return false;
+  }
+  state.assign(ntohl(header[0]), '\0');
+  size_t expected = ntohl(header[1]);
+  if (!state.empty() && !receiveAll(sd, &state[0], state.size())) {
+    return false;
+  }
+  fds.clear();
+  char control[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MESSAGE)];
+  while (fds.size() < expected) {
+    char marker = 0;
+    struct iovec data;
+    data.iov_base = &marker;
+    data.iov_len = 1;
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    ssize_t received = 0;
+    do {
+      received = recvmsg(sd, &message, 0);
+    } while (received < 0 && errno == EINTR);
+    if (received != 1) {
+      return false;
+    }
+    size_t before = fds.size();
+    for (struct cmsghdr* rights = CMSG_FIRSTHDR(&message); rights != NULL;
+        rights = CMSG_NXTHDR(&message, rights)) {
+      if (rights->cmsg_level != SOL_SOCKET ||
+          rights->cmsg_type != SCM_RIGHTS) {
+        continue;
+      }
+      size_t count = (rights->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (size_t i = 0; i < count; i++) {
+        int fd = -1;
+        memcpy(&fd, CMSG_DATA(rights) + i * sizeof(int), sizeof(int));
+        fds.push_back(fd);
+      }
+    }
+    if (fds.size() == before || (message.msg_flags & MSG_CTRUNC) != 0) {
+      return false;
+    }
+  }
+  return fds.size() == expected;
+}
+
+//-----------------------------------------------------------------------------
+// putNumber
+// Appends a number to a state, as 8 bytes in network order
+//
+// @pre:   None
+// @post:  state is 8 bytes longer
+// @param  state: The state
+// @param  value: The number
+//-----------------------------------------------------------------------------
+void Handoff::putNumber(string& state, long long value) {
+  for (int shift = 56; shift >= 0; shift -= 8) {
+    state += (char)((unsigned long long)value >> shift);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// putBytes
+// Appends a byte string to a state, preceded by its length
+//
+// @pre:   None
+// @post:  state holds the length and the bytes
+// @param  state: The state
+// @param  bytes: The bytes
+//-----------------------------------------------------------------------------
+void Handoff::putBytes(string& state, const string& bytes) {
+  putNumber(state, bytes.size());
+  state += bytes;
+}
+
+//-----------------------------------------------------------------------------
+// getNumber
+// Reads a number appended with putNumber
+//
+// @pre:   position is where the number starts
+// @post:  position is past the number if true is returned
+// @param  state:    The state
+// @param  position: Offset in state
+// @param  value:    Receives the number
+// @returns bool:    False if the state ends before the number does
+//-----------------------------------------------------------------------------
+bool Handoff::getNumber(const string& state, size_t& position,
+    long long& value) {
+  if (state.size() < position + 8) {
+    return false;
+  }
+  unsigned long long number = 0;
+  for (int i = 0; i < 8; i++) {
+    number = (number << 8) | (unsigned char)state[position + i];
+  }
+  value = (long long)number;
+  position += 8;
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// getBytes
+// Reads a byte string appended with putBytes
+//
+// @pre:   position is where the string starts
+// @post:  position is past the string if true is returned
+// @param  state:    The state
+// @param  position: Offset in state
+// @param  bytes:    Receives the bytes
+// @returns bool:    False if the state ends before the string does
+//-----------------------------------------------------------------------------
+bool Handoff::getBytes(const string& state, size_t& position, string& bytes) {
+  long long length = 0;
+  size_t start = position;
+  if (!getNumber(state, position, length) || length < 0 ||
+      (unsigned long long)length > state.size() - position) {
+    position = start;
+    return false;
+  }
+  bytes = state.substr(position, length);
+  position += length;
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// findListener
+// Finds this process's TCP socket listening on a port, for sockets that were
+// opened by a library that does not expose them
+//
+// @pre:   None
+// @post:  None
+// @param  port: The port in host byte order
+// @returns int: The listening socket, -1 if there is none
+//-----------------------------------------------------------------------------
+int Handoff::findListener(int port) {
+  int limit = getdtablesize();
+  for (int fd = 0; fd < limit; fd++) {
+    int listening = 0;
+    int type = 0;
+    socklen_t optionLength = sizeof(listening);
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening,
+        &optionLength) < 0 || !listening) {
+      continue;
+    }
+    optionLength = sizeof(type);
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &optionLength) < 0 ||
+        type != SOCK_STREAM) {
+      continue;
+    }
+    struct sockaddr_storage address;
+    socklen_t addressLength = sizeof(address);
+    if (getsockname(fd, (struct sockaddr*)&address, &addressLength) < 0) {
+      continue;
+    }
+    int boundPort = -1;
+    if (address.ss_family == AF_INET) {
+      boundPort = ntohs(((struct sockaddr_in*)&address)->sin_port);
+    } else if (address.ss_family == AF_INET6) {
+      boundPort = ntohs(((struct sockaddr_in6*)&address)->sin6_port);
+    }
+    if (boundPort == port) {
+      return fd;
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,126 @@
+#ifndef HANDOFF_H_
+#define HANDOFF_H_
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+const int HANDOFF_FDS_PER_MESSAGE = 64; //Descriptors passed per sendmsg(),
+                                        //below the kernel's SCM_MAX_FD
+
+//-----------------------------------------------------------------------------
+// Class:       Handoff
+// Description: Passes a relay's state and open sockets to the process that
+//              replaces it, over a Unix stream socket. The old process
+//              listens on a path and the new one connects to it; the state
+//              is an opaque byte string built with putNumber/putBytes, and
+//              the sockets travel as SCM_RIGHTS ancillary data, so the new
+//              process receives descriptors for the same open connections
+//              and the peers notice nothing.
+//
+//              On the wire: the state length and descriptor count as 4-byte
+//              network order integers, the state, then one byte per batch of
+//              up to HANDOFF_FDS_PER_MESSAGE descriptors.
+//-----------------------------------------------------------------------------
+class Handoff {
+ public:
+  //---------------------------------------------------------------------------
+  // listenAt
+  // Creates a Unix stream socket listening on a path, replacing any stale
+  // socket file
+  //
+  // @pre:   None
+  // @post:  The path exists if a socket is returned
+  // @param  path: The socket file
+  // @returns int: The listening socket, -1 on failure (errno is set)
+  //---------------------------------------------------------------------------
+  static int listenAt(const string& path);
+
+  //---------------------------------------------------------------------------
+  // acceptWithin
+  // Waits for a process to connect to a listening socket
+  //
+  // @pre:   listener was returned by listenAt
+  // @post:  None
+  // @param  listener:  The listening socket
+  // @param  timeoutMs: Longest time to wait
+  // @returns int:      The connected socket, -1 on timeout or failure
+  //---------------------------------------------------------------------------
+  static int acceptWithin(int listener, int timeoutMs);
+
+  //---------------------------------------------------------------------------
+  // connectTo
+  // Connects to a process listening on a path
+  //
+  // @pre:   None
+  // @post:  None
+  // @param  path: The socket file
+  // @returns int: The connected socket, -1 on failure (errno is set)
+  //---------------------------------------------------------------------------
+  static int connectTo(const string& path);
+
+  //---------------------------------------------------------------------------
+  // send
+  // Sends the state and descriptors. The descriptors stay open in this
+  // process.
+  //
+  // @pre:   sd is a connected Unix stream socket
+  // @post:  None
+  // @param  sd:    The socket
+  // @param  state: The serialized state
+  // @param  fds:   The descriptors to pass
+  // @returns bool: False if the other process went away
+  //---------------------------------------------------------------------------
+  static bool send(int sd, const string& state, const vector<int>& fds);
+
+  //---------------------------------------------------------------------------
+  // receive
+  // Receives the state and descriptors sent with send()
+  //
+  // @pre:   sd is a connected Unix stream socket
+  // @post:  fds holds new descriptors, in the order they were sent, if true
+  //         is returned
+  // @param  sd:    The socket
+  // @param  state: Receives the serialized state
+  // @param  fds:   Receives the descriptors
+  // @returns bool: False if the stream ended or was malformed
+  //---------------------------------------------------------------------------
+  static bool receive(int sd, string& state, vector<int>& fds);
+
+  //---------------------------------------------------------------------------
+  // putNumber / putBytes
+  // Append a number, or a length-prefixed byte string, to a state
+  //
+  // @pre:   None
+  // @post:  state is longer by the encoded value
+  //---------------------------------------------------------------------------
+  static void putNumber(string& state, long long value);
+  static void putBytes(string& state, const string& bytes);
+
+  //---------------------------------------------------------------------------
+  // getNumber / getBytes
+  // Read a value appended with putNumber or putBytes
+  //
+  // @pre:   position is where the value starts
+  // @post:  position is past the value if true is returned
+  // @returns bool: False if the state ends before the value does
+  //---------------------------------------------------------------------------
+  static bool getNumber(const string& state, size_t& position,
+      long long& value);
+  static bool getBytes(const string& state, size_t& position, string& bytes);
+
+  //---------------------------------------------------------------------------
+  // findListener
+  // Finds this process's TCP socket listening on a port, for sockets that
+  // were opened by a library that does not expose them
+  //
+  // @pre:   None
+  // @post:  None
+  // @param  port: The port in host byte order
+  // @returns int: The listening socket, -1 if there is none
+  //---------------------------------------------------------------------------
+  static int findListener(int port);
+};
+
+#endif /* HANDOFF_H_ */
@@ -0,0 +1,65 @@
+#include "IdleBackoff.h"
+#include <sched.h>
+#include <time.h>
+
+//-----------------------------------------------------------------------------
+// IdleBackoff Constructor
+// Creates a backoff that starts in the spinning phase
+//
+// @pre:   All limits >= 0, minSleepUs <= maxSleepUs
+// @post:  The next pause() spins
+// @param  spinLimit:  Number of pauses spent spinning
+// @param  yieldLimit: Number of pauses spent yielding after spinning
+// @param  minSleepUs: First sleep after yielding
+// @param  maxSleepUs: Longest sleep
+//-----------------------------------------------------------------------------
+IdleBackoff::IdleBackoff(int spinLimit, int yieldLimit, int minSleepUs,
+    int maxSleepUs) {
+  this->spinLimit = spinLimit;
+  this->yieldLimit = yieldLimit;
+  this->minSleepUs = minSleepUs;
+  this->maxSleepUs = maxSleepUs;
+  reset();
+}
+
+//-----------------------------------------------------------------------------
+// pause
+// Waits after an empty poll according to how long the caller has been idle
+//
+// @pre:   None
+// @post:  The idle count advances by one
+//-----------------------------------------------------------------------------
+void IdleBackoff::pause() {
+  if (idlePolls < spinLimit) {
+    idlePolls++;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+    return;
+  }
+  if (idlePolls < spinLimit + yieldLimit) {
+    idlePolls++;
+    sched_yield();
+    return;
+  }
+  struct timespec nap;
+  nap.tv_sec = sleepUs / 1000000;
+  nap.tv_nsec = (sleepUs % 1000000) * 1000L;
+  nanosleep(&nap, NULL);
+  sleepUs *= 2;
+  if (sleepUs > maxSleepUs) {
+    sleepUs = maxSleepUs;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// reset
+// Records that the last poll found work
+//
+// @pre:   None
+// @post:  The next pause() spins
+//-----------------------------------------------------------------------------
+void IdleBackoff::reset() {
+  idlePolls = 0;
+  sleepUs = minSleepUs;
+}
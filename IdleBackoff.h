@@ -0,0 +1,63 @@
+#ifndef IDLEBACKOFF_H_
+#define IDLEBACKOFF_H_
+
+const int DEFAULT_SPIN_LIMIT = 2000;     //Empty polls spent spinning
+const int DEFAULT_YIELD_LIMIT = 200;     //Empty polls spent yielding
+const int DEFAULT_MIN_SLEEP_US = 50;     //First sleep once yielding is over
+const int DEFAULT_MAX_SLEEP_US = 1000;   //Longest sleep between polls
+
+//-----------------------------------------------------------------------------
+// Class:       IdleBackoff
+// Description: Pacing for threads that poll non-blocking sockets or rings.
+//              Each call to pause() after an empty poll escalates from busy
+//              spinning (lowest wakeup latency) to sched_yield() and finally
+//              to sleeps that double up to a ceiling, so an idle relay does
+//              not burn a full core forever. reset() after useful work drops
+//              back to spinning.
+//-----------------------------------------------------------------------------
+class IdleBackoff {
+ public:
+  //---------------------------------------------------------------------------
+  // IdleBackoff Constructor
+  // Creates a backoff that starts in the spinning phase
+  //
+  // @pre:   All limits >= 0, minSleepUs <= maxSleepUs
+  // @post:  The next pause() spins
+  // @param  spinLimit:  Number of pauses spent spinning
+  // @param  yieldLimit: Number of pauses spent yielding after spinning
+  // @param  minSleepUs: First sleep after yielding
+  // @param  maxSleepUs: Longest sleep
+  //---------------------------------------------------------------------------
+  IdleBackoff(int spinLimit = DEFAULT_SPIN_LIMIT,
+      int yieldLimit = DEFAULT_YIELD_LIMIT,
+      int minSleepUs = DEFAULT_MIN_SLEEP_US,
+      int maxSleepUs = DEFAULT_MAX_SLEEP_US);
+
+  //---------------------------------------------------------------------------
+  // pause
+  // Waits after an empty poll according to how long the caller has been idle
+  //
+  // @pre:   None
+  // @post:  The idle count advances by one
+  //---------------------------------------------------------------------------
+  void pause();
+
+  //---------------------------------------------------------------------------
+  // reset
+  // Records that the last poll found work
+  //
+  // @pre:   None
+  // @post:  The next pause() spins
+  //---------------------------------------------------------------------------
+  void reset();
+
+ private:
+  int spinLimit;
+  int yieldLimit;
+  int minSleepUs;
+  int maxSleepUs;
+  int idlePolls;     //Empty polls since the last reset
+  int sleepUs;       //Length of the next sleep
+};
+
+#endif /* IDLEBACKOFF_H_ */
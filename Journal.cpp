@@ -0,0 +1,546 @@
+#include "Journal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <sstream>
+
+const char* const SEGMENT_PREFIX = "journal-";
+const char* const SEGMENT_SUFFIX = ".seg";
+
+//Segment header, padded to JOURNAL_HEADER_SIZE
+struct JournalSegmentHeader {
+  unsigned int magic;
+  int version;
+  long long bytes;          //Size the segment was created with
+  unsigned int sequence;
+};
+
+//-----------------------------------------------------------------------------
+// recordSize
+// Returns the space a record with length bytes of data takes in a segment
+//
+// @pre:   None
+// @post:  None
+// @param  length:     Bytes of data
+// @returns long long: Header plus data, rounded up to 8 bytes
+//-----------------------------------------------------------------------------
+static long long recordSize(int length) {
+  return (sizeof(JournalRecordHeader) + length + 7) / 8 * 8;
+}
+
+//-----------------------------------------------------------------------------
+// segmentName
+// Returns the file name of a segment
+//
+// @pre:   None
+// @post:  None
+// @param  sequence: Segment number
+// @returns string:  journal-<10 digit sequence>.seg
+//-----------------------------------------------------------------------------
+static string segmentName(unsigned int sequence) {
+  char name[64];
+  snprintf(name, sizeof(name), "%s%010u%s", SEGMENT_PREFIX, sequence,
+      SEGMENT_SUFFIX);
+  return name;
+}
+
+//-----------------------------------------------------------------------------
+// listSegments
+// Returns the segment numbers found in a directory, in ascending order
+//
+// @pre:   None
+// @post:  None
+// @param  directory: The journal directory
+// @returns vector<unsigned int>: Segment numbers
+//-----------------------------------------------------------------------------
+static vector<unsigned int> listSegments(const string& directory) {
+  vector<unsigned int> sequences;
+  DIR* dir = opendir(directory.c_str());
+  if (dir == NULL) {
+    return sequences;
+  }
+  size_t prefixLength = strlen(SEGMENT_PREFIX);
+  size_t suffixLength = strlen(SEGMENT_SUFFIX);
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    string name = entry->d_name;
+    if (name.length() == prefixLength + 10 + suffixLength &&
+        name.compare(0, prefixLength, SEGMENT_PREFIX) == 0 &&
+        name.compare(prefixLength + 10, suffixLength, SEGMENT_SUFFIX) == 0) {
+      sequences.push_back(
+          strtoul(name.substr(prefixLength, 10).c_str(), NULL, 10));
+    }
+  }
+  closedir(dir);
+  sort(sequences.begin(), sequences.end());
+  return sequences;
+}
+
+//-----------------------------------------------------------------------------
+// syncRange
+// msyncs part of a mapping, widening it to whole pages
+//
+// @pre:   memory is page aligned and maps at least to bytes
+// @post:  [from, to) is on disk
+// @param  memory: Start of the mapping
+// @param  from:   First byte to flush
+// @param  to:     One past the last byte to flush
+//-----------------------------------------------------------------------------
+static void syncRange(char* memory, long long from, long long to) {
+  if (to <= from) {
+    return;
+  }
+  long long page = sysconf(_SC_PAGESIZE);
+  long long start = from / page * page;
+  msync(memory + start, to - start, MS_SYNC);
+}
+
+//-----------------------------------------------------------------------------
+// Journal Constructor
+// Creates a closed journal
+//
+// @pre:   None
+// @post:  isOpen() is false
+//-----------------------------------------------------------------------------
+Journal::Journal() {
+  segmentBytes = 0;
+  commitMs = DEFAULT_COMMIT_MS;
+  commitRecords = DEFAULT_COMMIT_RECORDS;
+  opened = false;
+  current.memory = NULL;
+  current.bytes = 0;
+  current.fd = -1;
+  current.synced = 0;
+  writeOffset = 0;
+  sequence = 0;
+  unflushed = 0;
+  records = 0;
+  flushes = 0;
+  dropped = 0;
+  stopping = false;
+  flusherRunning = false;
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&wake, NULL);
+}
+
+//-----------------------------------------------------------------------------
+// Journal Destructor
+// Closes the journal, flushing everything appended
+//
+// @pre:   No thread is in append()
+// @post:  All records are on disk
+//-----------------------------------------------------------------------------
+Journal::~Journal() {
+  close();
+  pthread_cond_destroy(&wake);
+  pthread_mutex_destroy(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// open
+// Starts journaling into a directory
+//
+// @pre:   None
+// @post:  The first segment is created and the flusher thread runs
+// @param  directory:     Where segments are written; must exist
+// @param  segmentBytes:  Size of each segment file
+// @param  commitMs:      Longest a record waits to be flushed
+// @param  commitRecords: Records that trigger a flush before commitMs
+// @returns bool:         False if the journal is already open or the first
+//                        segment could not be created
+//-----------------------------------------------------------------------------
+bool Journal::open(const string& directory, long long segmentBytes,
+    int commitMs, int commitRecords) {
+  pthread_mutex_lock(&lock);
+  if (flusherRunning || segmentBytes < JOURNAL_HEADER_SIZE + recordSize(0) ||
+      commitMs <= 0 || commitRecords <= 0) {
+    pthread_mutex_unlock(&lock);
+    return false;
+  }
+  this->directory = directory;
+  this->segmentBytes = segmentBytes;
+  this->commitMs = commitMs;
+  this->commitRecords = commitRecords;
+  vector<unsigned int> existing = listSegments(directory);
+  sequence = existing.empty() ? 0 : existing.back();
+  records = 0;
+  flushes = 0;
+  dropped = 0;
+  if (!startSegment()) {
+    pthread_mutex_unlock(&lock);
+    return false;
+  }
+  opened = true;
+  stopping = false;
+  flusherRunning = true;
+  pthread_mutex_unlock(&lock);
+  pthread_create(&flusherThreadID, NULL, flusherThread, (void*)this);
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// close
+// Flushes and closes the journal; later appends are ignored
+//
+// @pre:   None
+// @post:  isOpen() is false and every record is on disk
+//-----------------------------------------------------------------------------
+void Journal::close() {
+  pthread_mutex_lock(&lock);
+  if (!flusherRunning) {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+  opened = false;
+  stopping = true;
+  if (current.memory != NULL) {
+    retired.push_back(current);
+    current.memory = NULL;
+  }
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+  pthread_join(flusherThreadID, NULL);
+  pthread_mutex_lock(&lock);
+  flusherRunning = false;
+  pthread_mutex_unlock(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// append
+// Copies a packet into the journal
+//
+// @pre:   None
+// @post:  The record is in the current segment and will be flushed within the
+//         commit interval
+// @param  direction:   JOURNAL_LOCAL or JOURNAL_REMOTE
+// @param  data:        The packet bytes
+// @param  length:      Number of bytes
+// @param  timestampUs: Wall clock time to store with the record
+// @returns bool:       False if the journal is closed or a new segment could
+//                      not be created
+//-----------------------------------------------------------------------------
+bool Journal::append(int direction, const char* data, int length,
+    long long timestampUs) {
+  long long needed = recordSize(length);
+  pthread_mutex_lock(&lock);
+  if (!opened || length <= 0 ||
+      needed > segmentBytes - JOURNAL_HEADER_SIZE) {
+    dropped++;
+    pthread_mutex_unlock(&lock);
+    return false;
+  }
+  if (writeOffset + needed > current.bytes) {
+    retired.push_back(current);
+    current.memory = NULL;
+    if (!startSegment()) {
+      //Nothing to write to; refuse records until the journal is reopened
+      opened = false;
+      dropped++;
+      pthread_cond_signal(&wake);
+      pthread_mutex_unlock(&lock);
+      return false;
+    }
+  }
+  JournalRecordHeader* header =
+      (JournalRecordHeader*)(current.memory + writeOffset);
+  header->direction = (unsigned char)direction;
+  header->timestampUs = timestampUs;
+  memcpy(current.memory + writeOffset + sizeof(JournalRecordHeader), data,
+      length);
+  __sync_synchronize();
+  header->length = length;
+  writeOffset += needed;
+  records++;
+  if (++unflushed >= commitRecords) {
+    pthread_cond_signal(&wake);
+  }
+  pthread_mutex_unlock(&lock);
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// isOpen
+// Returns true while the journal accepts records
+//
+// @pre:   None
+// @post:  None
+// @returns bool: True between open() and close()
+//-----------------------------------------------------------------------------
+bool Journal::isOpen() {
+  pthread_mutex_lock(&lock);
+  bool result = opened;
+  pthread_mutex_unlock(&lock);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+// getStatus
+// Describes the journal for the "journal" command
+//
+// @pre:   None
+// @post:  None
+// @returns string: Directory, segment and counters, or "off"
+//-----------------------------------------------------------------------------
+string Journal::getStatus() {
+  pthread_mutex_lock(&lock);
+  stringstream status;
+  if (!opened) {
+    status << "off";
+  } else {
+    status << directory << "/" << segmentName(sequence) << " at "
+        << writeOffset << "/" << current.bytes << " bytes, commit every "
+        << commitMs << "ms or " << commitRecords << " records";
+  }
+  status << "; " << records << " records, " << flushes << " flushes, "
+      << dropped << " dropped";
+  pthread_mutex_unlock(&lock);
+  return status.str();
+}
+
+//-----------------------------------------------------------------------------
+// startSegment
+// Creates, preallocates and maps the segment after the current one
+//
+// @pre:   lock is held, current is not mapped
+// @post:  current is the new segment and writeOffset its first record
+// @returns bool: False if the file could not be created or allocated
+//-----------------------------------------------------------------------------
+bool Journal::startSegment() {
+  sequence++;
+  string path = directory + "/" + segmentName(sequence);
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0640);
+  if (fd < 0) {
+    return false;
+  }
+  if (posix_fallocate(fd, 0, segmentBytes) != 0) {
+    ::close(fd);
+    unlink(path.c_str());
+    return false;
+  }
+  void* memory = mmap(NULL, segmentBytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+      fd, 0);
+  if (memory == MAP_FAILED) {
+    ::close(fd);
+    unlink(path.c_str());
+    return false;
+  }
+  JournalSegmentHeader* header = (JournalSegmentHeader*)memory;
+  header->magic = JOURNAL_MAGIC;
+  header->version = JOURNAL_VERSION;
+  header->bytes = segmentBytes;
+  header->sequence = sequence;
+  current.memory = (char*)memory;
+  current.bytes = segmentBytes;
+  current.fd = fd;
+  current.synced = 0;
+  writeOffset = JOURNAL_HEADER_SIZE;
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// flusherThread
+// Thread function of the flusher thread. Waits for the commit interval or
+// enough records, then flushes, until the journal is closed
+//
+// @pre:   *arg parameter represents a valid Journal object
+// @post:  Everything appended before close() is on disk
+// @param  *arg:  A void pointer to the Journal
+//-----------------------------------------------------------------------------
+void* Journal::flusherThread(void* arg) {
+  Journal* journal = (Journal*)arg;
+  pthread_mutex_lock(&journal->lock);
+  while (!journal->stopping) {
+    if (journal->unflushed < journal->commitRecords &&
+        journal->retired.empty()) {
+      struct timeval now;
+      gettimeofday(&now, NULL);
+      long long deadlineUs = now.tv_sec * 1000000LL + now.tv_usec +
+          journal->commitMs * 1000LL;
+      struct timespec deadline;
+      deadline.tv_sec = deadlineUs / 1000000;
+      deadline.tv_nsec = (deadlineUs % 1000000) * 1000;
+      pthread_cond_timedwait(&journal->wake, &journal->lock, &deadline);
+    }
+    pthread_mutex_unlock(&journal->lock);
+    journal->flush();
+    pthread_mutex_lock(&journal->lock);
+  }
+  pthread_mutex_unlock(&journal->lock);
+  journal->flush();
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// flush
+// msyncs the records written since the last flush, then unmaps and closes
+// retired segments once they are completely on disk. Runs without the lock
+// so appends continue during the msync; only this thread unmaps segments.
+//
+// @pre:   Called by the flusher thread
+// @post:  Every record appended before the call is on disk
+//-----------------------------------------------------------------------------
+void Journal::flush() {
+  pthread_mutex_lock(&lock);
+  deque<segment> finished;
+  finished.swap(retired);
+  segment active = current;
+  long long activeEnd = writeOffset;
+  bool dirty = unflushed > 0 || !finished.empty();
+  unflushed = 0;
+  pthread_mutex_unlock(&lock);
+
+  for (size_t i = 0; i < finished.size(); i++) {
+    msync(finished[i].memory, finished[i].bytes, MS_SYNC);
+    munmap(finished[i].memory, finished[i].bytes);
+    ::close(finished[i].fd);
+  }
+  if (active.memory != NULL && activeEnd > active.synced) {
+    syncRange(active.memory, active.synced, activeEnd);
+    pthread_mutex_lock(&lock);
+    if (current.memory == active.memory) {
+      current.synced = activeEnd;
+    }
+    pthread_mutex_unlock(&lock);
+  }
+  if (dirty) {
+    pthread_mutex_lock(&lock);
+    flushes++;
+    pthread_mutex_unlock(&lock);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// JournalReader Constructor
+// Lists the segments of a journal directory
+//
+// @pre:   None
+// @post:  The reader is positioned before the first record
+// @param  directory: The journal directory
+//-----------------------------------------------------------------------------
+JournalReader::JournalReader(const string& directory) {
+  vector<unsigned int> sequences = listSegments(directory);
+  for (size_t i = 0; i < sequences.size(); i++) {
+    paths.push_back(directory + "/" + segmentName(sequences[i]));
+  }
+  index = -1;
+  memory = NULL;
+  bytes = 0;
+  offset = 0;
+}
+
+//-----------------------------------------------------------------------------
+// JournalReader Destructor
+// Unmaps the segment being read
+//
+// @pre:   None
+// @post:  None
+//-----------------------------------------------------------------------------
+JournalReader::~JournalReader() {
+  unmapSegment();
+}
+
+//-----------------------------------------------------------------------------
+// next
+// Reads the next record
+//
+// @pre:   None
+// @post:  record describes the next record if true is returned
+// @param  record: Receives the record
+// @returns bool:  False once every segment has been read
+//-----------------------------------------------------------------------------
+bool JournalReader::next(JournalRecord& record) {
+  while (true) {
+    if (memory != NULL &&
+        offset + (long long)sizeof(JournalRecordHeader) <= bytes) {
+      const JournalRecordHeader* header =
+          (const JournalRecordHeader*)(memory + offset);
+      long long length = header->length;
+      __sync_synchronize();
+      if (length > 0 && offset + recordSize(length) <= bytes) {
+        record.timestampUs = header->timestampUs;
+        record.direction = header->direction;
+        record.length = (int)length;
+        record.data = memory + offset + sizeof(JournalRecordHeader);
+        offset += recordSize(length);
+        return true;
+      }
+    }
+    //End of this segment; move on to the next valid one
+    unmapSegment();
+    do {
+      index++;
+      if (index >= (int)paths.size()) {
+        return false;
+      }
+    } while (!mapSegment(index));
+  }
+}
+
+//-----------------------------------------------------------------------------
+// getSegmentCount
+// Returns the number of segments found in the directory
+//
+// @pre:   None
+// @post:  None
+// @returns int: Segment files
+//-----------------------------------------------------------------------------
+int JournalReader::getSegmentCount() const {
+  return paths.size();
+}
+
+//-----------------------------------------------------------------------------
+// mapSegment
+// Maps a segment read-only and positions the reader at its first record
+//
+// @pre:   No segment is mapped
+// @post:  memory maps the segment if true is returned
+// @param  segmentIndex: Index into paths
+// @returns bool:        False if the file is missing or not a segment
+//-----------------------------------------------------------------------------
+bool JournalReader::mapSegment(int segmentIndex) {
+  int fd = ::open(paths[segmentIndex].c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) < 0 || info.st_size < JOURNAL_HEADER_SIZE) {
+    ::close(fd);
+    return false;
+  }
+  void* mapped = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mapped == MAP_FAILED) {
+    return false;
+  }
+  const JournalSegmentHeader* header = (const JournalSegmentHeader*)mapped;
+  if (header->magic != JOURNAL_MAGIC || header->version != JOURNAL_VERSION) {
+    munmap(mapped, info.st_size);
+    return false;
+  }
+  memory = (char*)mapped;
+  bytes = info.st_size;
+  offset = JOURNAL_HEADER_SIZE;
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// unmapSegment
+// Unmaps the segment being read, if any
+//
+// @pre:   None
+// @post:  memory is NULL
+//-----------------------------------------------------------------------------
+void JournalReader::unmapSegment() {
+  if (memory != NULL) {
+    munmap(memory, bytes);
+    memory = NULL;
+  }
+}
@@ -0,0 +1,240 @@
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <pthread.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+const unsigned int JOURNAL_MAGIC = 0x4C4E4A52;   //"RJNL", starts a segment
+const int JOURNAL_VERSION = 1;
+const int JOURNAL_HEADER_SIZE = 64;     //Segment header before the records
+const int DEFAULT_SEGMENT_MB = 64;      //Preallocated size of a segment
+const int DEFAULT_COMMIT_MS = 10;       //Longest a record waits for msync
+const int DEFAULT_COMMIT_RECORDS = 256; //Records that force an early msync
+
+//Where a journaled packet entered the relay
+const int JOURNAL_LOCAL = 0;    //From the local group, publish() or shm
+const int JOURNAL_REMOTE = 1;   //From a remote relay over TCP
+
+//Precedes every record in a segment; the data follows, padded to 8 bytes.
+//length is written last, so a reader that sees it non-zero sees the rest.
+struct JournalRecordHeader {
+  volatile unsigned int length; //Bytes of data, 0 = end of the segment
+  unsigned char direction;      //JOURNAL_LOCAL or JOURNAL_REMOTE
+  unsigned char reserved[3];
+  long long timestampUs;        //Wall clock when the packet was journaled
+};
+
+//A record returned by JournalReader::next
+struct JournalRecord {
+  long long timestampUs;
+  int direction;
+  int length;
+  const char* data;   //Valid until the next call to next()
+};
+
+//-----------------------------------------------------------------------------
+// Class:       Journal
+// Description: An append-only, on-disk log of relayed packets. Records are
+//              copied into memory-mapped segment files that are preallocated
+//              when they are created, so appending never calls into the file
+//              system and a full disk is found when a segment is opened
+//              rather than as a SIGBUS on a later write.
+//
+//              Durability uses group commit: a flusher thread msyncs the
+//              records written since the last flush once DEFAULT_COMMIT_MS
+//              (or the configured interval) has passed or enough records
+//              have piled up, so one disk flush covers many packets and
+//              writers never wait for the disk.
+//
+//              Segments are named journal-<sequence>.seg and are never
+//              reopened for writing; a new journal continues after the
+//              highest sequence number already in the directory.
+//-----------------------------------------------------------------------------
+class Journal {
+ public:
+  //---------------------------------------------------------------------------
+  // Journal Constructor
+  // Creates a closed journal
+  //
+  // @pre:   None
+  // @post:  isOpen() is false
+  //---------------------------------------------------------------------------
+  Journal();
+
+  //---------------------------------------------------------------------------
+  // Journal Destructor
+  // Closes the journal, flushing everything appended
+  //
+  // @pre:   No thread is in append()
+  // @post:  All records are on disk
+  //---------------------------------------------------------------------------
+  ~Journal();
+
+  //---------------------------------------------------------------------------
+  // open
+  // Starts journaling into a directory
+  //
+  // @pre:   None
+  // @post:  The first segment is created and the flusher thread runs
+  // @param  directory:     Where segments are written; must exist
+  // @param  segmentBytes:  Size of each segment file
+  // @param  commitMs:      Longest a record waits to be flushed
+  // @param  commitRecords: Records that trigger a flush before commitMs
+  // @returns bool:         False if the journal is already open or the first
+  //                        segment could not be created
+  //---------------------------------------------------------------------------
+  bool open(const string& directory, long long segmentBytes, int commitMs,
+      int commitRecords);
+
+  //---------------------------------------------------------------------------
+  // close
+  // Flushes and closes the journal; later appends are ignored
+  //
+  // @pre:   None
+  // @post:  isOpen() is false and every record is on disk
+  //---------------------------------------------------------------------------
+  void close();
+
+  //---------------------------------------------------------------------------
+  // append
+  // Copies a packet into the journal
+  //
+  // @pre:   None
+  // @post:  The record is in the current segment and will be flushed within
+  //         the commit interval
+  // @param  direction:   JOURNAL_LOCAL or JOURNAL_REMOTE
+  // @param  data:        The packet bytes
+  // @param  length:      Number of bytes
+  // @param  timestampUs: Wall clock time to store with the record
+  // @returns bool:       False if the journal is closed or a new segment
+  //                      could not be created
+  //---------------------------------------------------------------------------
+  bool append(int direction, const char* data, int length,
+      long long timestampUs);
+
+  //---------------------------------------------------------------------------
+  // isOpen
+  // Returns true while the journal accepts records
+  //
+  // @pre:   None
+  // @post:  None
+  // @returns bool: True between open() and close()
+  //---------------------------------------------------------------------------
+  bool isOpen();
+
+  //---------------------------------------------------------------------------
+  // getStatus
+  // Describes the journal for the "journal" command
+  //
+  // @pre:   None
+  // @post:  None
+  // @returns string: Directory, segment and counters, or "off"
+  //---------------------------------------------------------------------------
+  string getStatus();
+
+ private:
+  //A mapped segment file
+  struct segment {
+    char* memory;
+    long long bytes;
+    int fd;
+    long long synced;   //Bytes known to be on disk
+  };
+
+  //Creates and maps the next segment; caller holds lock
+  bool startSegment();
+
+  //Thread function of the flusher thread
+  static void* flusherThread(void* arg);
+
+  //Flushes what has been written to segments and retires finished ones
+  void flush();
+
+  string directory;
+  long long segmentBytes;
+  int commitMs;
+  int commitRecords;
+  bool opened;
+  segment current;             //Segment being written
+  long long writeOffset;       //Next record position in current
+  unsigned int sequence;       //Number of the current segment
+  deque<segment> retired;      //Full segments awaiting their final flush
+  int unflushed;               //Records appended since the last flush
+  long long records;           //Records appended since open()
+  long long flushes;           //msync rounds since open()
+  long long dropped;           //Appends refused since open()
+  bool stopping;               //Tells the flusher thread to exit
+  bool flusherRunning;         //Between open() and close()
+  pthread_t flusherThreadID;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;         //Signals the flusher thread
+};
+
+//-----------------------------------------------------------------------------
+// Class:       JournalReader
+// Description: Reads the records of every segment in a journal directory in
+//              the order they were written. Segments are mapped read-only one
+//              at a time; a segment still being written is read up to its
+//              last complete record.
+//-----------------------------------------------------------------------------
+class JournalReader {
+ public:
+  //---------------------------------------------------------------------------
+  // JournalReader Constructor
+  // Lists the segments of a journal directory
+  //
+  // @pre:   None
+  // @post:  The reader is positioned before the first record
+  // @param  directory: The journal directory
+  //---------------------------------------------------------------------------
+  JournalReader(const string& directory);
+
+  //---------------------------------------------------------------------------
+  // JournalReader Destructor
+  // Unmaps the segment being read
+  //
+  // @pre:   None
+  // @post:  None
+  //---------------------------------------------------------------------------
+  ~JournalReader();
+
+  //---------------------------------------------------------------------------
+  // next
+  // Reads the next record
+  //
+  // @pre:   None
+  // @post:  record describes the next record if true is returned
+  // @param  record: Receives the record
+  // @returns bool:  False once every segment has been read
+  //---------------------------------------------------------------------------
+  bool next(JournalRecord& record);
+
+  //---------------------------------------------------------------------------
+  // getSegmentCount
+  // Returns the number of segments found in the directory
+  //
+  // @pre:   None
+  // @post:  None
+  // @returns int: Segment files
+  //---------------------------------------------------------------------------
+  int getSegmentCount() const;
+
+ private:
+  //Maps a segment read-only; returns false if it is not a valid segment
+  bool mapSegment(int segmentIndex);
+
+  //Unmaps the current segment
+  void unmapSegment();
+
+  vector<string> paths;     //Segment files in sequence order
+  int index;                //Segment being read, -1 before the first
+  char* memory;
+  long long bytes;
+  long long offset;         //Next record in memory
+};
+
+#endif /* JOURNAL_H_ */
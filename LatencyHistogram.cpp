@@ -0,0 +1,134 @@
+#include "LatencyHistogram.h"
+#include <time.h>
+
+//-----------------------------------------------------------------------------
+// monotonicMicros
+// Returns CLOCK_MONOTONIC in microseconds. Only differences between two calls
+// on the same host are meaningful.
+//
+// @pre:   None
+// @post:  None
+// @returns long long: Microseconds since an arbitrary fixed point
+//-----------------------------------------------------------------------------
+long long monotonicMicros() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+//-----------------------------------------------------------------------------
+// realtimeMicros
+// Returns CLOCK_REALTIME in microseconds since the epoch. Differences between
+// hosts are only as good as their clock synchronization.
+//
+// @pre:   None
+// @post:  None
+// @returns long long: Microseconds since 1970-01-01 UTC
+//-----------------------------------------------------------------------------
+long long realtimeMicros() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+//-----------------------------------------------------------------------------
+// LatencyHistogram Constructor
+// Creates an empty histogram
+//
+// @pre:   None
+// @post:  count() == 0
+//-----------------------------------------------------------------------------
+LatencyHistogram::LatencyHistogram() {
+  reset();
+}
+
+//-----------------------------------------------------------------------------
+// record
+// Adds one sample; negative samples (clock steps) are recorded as 0
+//
+// @pre:   None
+// @post:  The bucket covering micros is incremented
+// @param  micros: The latency to record
+//-----------------------------------------------------------------------------
+void LatencyHistogram::record(long long micros) {
+  if (micros < 0) {
+    micros = 0;
+  }
+  //Bucket i is (2^(i-1), 2^i], so a sample of exactly 2^i lands in bucket i
+  int bucket = 0;
+  if (micros > 1) {
+    bucket = 64 - __builtin_clzll((unsigned long long)(micros - 1));
+  }
+  if (bucket >= LATENCY_BUCKETS) {
+    bucket = LATENCY_BUCKETS - 1;
+  }
+  buckets[bucket]++;
+  samples++;
+  total += micros;
+  if (micros > largest) {
+    largest = micros;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// merge
+// Adds every sample of another histogram into this one
+//
+// @pre:   None
+// @post:  This histogram holds the samples of both
+// @param  other: The histogram to add
+//-----------------------------------------------------------------------------
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    buckets[i] += other.buckets[i];
+  }
+  samples += other.samples;
+  total += other.total;
+  if (other.largest > largest) {
+    largest = other.largest;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// reset
+// Discards all samples
+//
+// @pre:   None
+// @post:  count() == 0
+//-----------------------------------------------------------------------------
+void LatencyHistogram::reset() {
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    buckets[i] = 0;
+  }
+  samples = 0;
+  total = 0;
+  largest = 0;
+}
+
+//-----------------------------------------------------------------------------
+// percentile
+// Returns an upper bound for the given percentile
+//
+// @pre:   0 < p <= 100
+// @post:  None
+// @param  p:          The percentile to report
+// @returns long long: Upper bound in microseconds, 0 if empty
+//-----------------------------------------------------------------------------
+long long LatencyHistogram::percentile(double p) const {
+  if (samples == 0) {
+    return 0;
+  }
+  long long rank = (long long)(samples * p / 100.0 + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+  long long seen = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += buckets[i];
+    if (seen >= rank) {
+      long long bound = bucketBound(i);
+      return (bound < largest) ? bound : largest;
+    }
+  }
+  return largest;
+}
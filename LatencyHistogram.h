@@ -0,0 +1,111 @@
+#ifndef LATENCYHISTOGRAM_H_
+#define LATENCYHISTOGRAM_H_
+
+const int LATENCY_BUCKETS = 32;   //Bucket i holds samples up to 2^i us
+
+//-----------------------------------------------------------------------------
+// monotonicMicros
+// Returns CLOCK_MONOTONIC in microseconds. Only differences between two calls
+// on the same host are meaningful.
+//
+// @pre:   None
+// @post:  None
+// @returns long long: Microseconds since an arbitrary fixed point
+//-----------------------------------------------------------------------------
+long long monotonicMicros();
+
+//-----------------------------------------------------------------------------
+// realtimeMicros
+// Returns CLOCK_REALTIME in microseconds since the epoch. Differences between
+// hosts are only as good as their clock synchronization.
+//
+// @pre:   None
+// @post:  None
+// @returns long long: Microseconds since 1970-01-01 UTC
+//-----------------------------------------------------------------------------
+long long realtimeMicros();
+
+//-----------------------------------------------------------------------------
+// Class:       LatencyHistogram
+// Description: A fixed-size histogram of latencies in microseconds using
+//              power-of-two buckets, so recording is a bit scan and the
+//              memory footprint does not depend on the number of samples.
+//              Percentiles are reported as the upper bound of the bucket that
+//              contains them. One thread records into a histogram; any
+//              other thread may merge it into its own at the same time. Each
+//              count is an aligned 64-bit word, so on 64-bit hosts the reader
+//              sees it either before or after an update; a merge taken
+//              mid-record may have the sample in its bucket but not yet in
+//              count().
+//-----------------------------------------------------------------------------
+class LatencyHistogram {
+ public:
+  //---------------------------------------------------------------------------
+  // LatencyHistogram Constructor
+  // Creates an empty histogram
+  //
+  // @pre:   None
+  // @post:  count() == 0
+  //---------------------------------------------------------------------------
+  LatencyHistogram();
+
+  //---------------------------------------------------------------------------
+  // record
+  // Adds one sample; negative samples (clock steps) are recorded as 0
+  //
+  // @pre:   None
+  // @post:  The bucket covering micros is incremented
+  // @param  micros: The latency to record
+  //---------------------------------------------------------------------------
+  void record(long long micros);
+
+  //---------------------------------------------------------------------------
+  // merge
+  // Adds every sample of another histogram into this one
+  //
+  // @pre:   None
+  // @post:  This histogram holds the samples of both
+  // @param  other: The histogram to add
+  //---------------------------------------------------------------------------
+  void merge(const LatencyHistogram& other);
+
+  //---------------------------------------------------------------------------
+  // reset
+  // Discards all samples
+  //
+  // @pre:   None
+  // @post:  count() == 0
+  //---------------------------------------------------------------------------
+  void reset();
+
+  //---------------------------------------------------------------------------
+  // percentile
+  // Returns an upper bound for the given percentile
+  //
+  // @pre:   0 < p <= 100
+  // @post:  None
+  // @param  p:          The percentile to report
+  // @returns long long: Upper bound in microseconds, 0 if empty
+  //---------------------------------------------------------------------------
+  long long percentile(double p) const;
+
+  //---------------------------------------------------------------------------
+  // Accessors
+  // count: samples recorded, sum: total microseconds, max: largest sample,
+  // bucketCount: samples in bucket i, bucketBound: inclusive upper bound of
+  // bucket i in microseconds, as a Prometheus le label is
+  //---------------------------------------------------------------------------
+  long long count() const { return samples; }
+  long long sum() const { return total; }
+  long long max() const { return largest; }
+  long long bucketCount(int i) const { return buckets[i]; }
+  static long long bucketBound(int i) { return 1LL << i; }
+
+ private:
+  volatile long long buckets[LATENCY_BUCKETS];
+  volatile long long samples;
+  volatile long long total;
+  volatile long long largest;
+};
+
+#endif /* LATENCYHISTOGRAM_H_ */
@@ -0,0 +1,229 @@
+#include "MetricsServer.h"
+#include "LatencyHistogram.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sstream>
+
+//-----------------------------------------------------------------------------
+// MetricsServer Constructor
+// Creates a closed server
+//
+// @pre:   None
+// @post:  isOpen() is false
+//-----------------------------------------------------------------------------
+MetricsServer::MetricsServer() {
+  listener = -1;
+}
+
+//-----------------------------------------------------------------------------
+// MetricsServer Destructor
+// Closes the server and every client
+//
+// @pre:   None
+// @post:  None
+//-----------------------------------------------------------------------------
+MetricsServer::~MetricsServer() {
+  close();
+}
+
+//-----------------------------------------------------------------------------
+// open
+// Listens for scrapes on a TCP port
+//
+// @pre:   The server is closed
+// @post:  Scrapers can connect if true is returned
+// @param  address: The IP to bind, "" for every interface
+// @param  port:    The port
+// @returns bool:   False if the port cannot be bound (errno is set)
+//-----------------------------------------------------------------------------
+bool MetricsServer::open(const string& address, int port) {
+  struct sockaddr_in local;
+  memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_port = htons(port);
+  local.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (!address.empty() && inet_aton(address.c_str(), &local.sin_addr) == 0) {
+    errno = EINVAL;
+    return false;
+  }
+  int sd = socket(AF_INET, SOCK_STREAM, 0);
+  if (sd < 0) {
+    return false;
+  }
+  int reuse = 1;
+  setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  if (bind(sd, (struct sockaddr*)&local, sizeof(local)) < 0 ||
+      listen(sd, METRICS_MAX_CLIENTS) < 0) {
+    int error = errno;
+    ::close(sd);
+    errno = error;
+    return false;
+  }
+  fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK);
+  listener = sd;
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// close
+// Disconnects every client and stops listening
+//
+// @pre:   None
+// @post:  isOpen() is false
+//-----------------------------------------------------------------------------
+void MetricsServer::close() {
+  for (size_t i = 0; i < clients.size(); i++) {
+    ::close(clients[i].sd);
+  }
+  clients.clear();
+  if (listener >= 0) {
+    ::close(listener);
+  }
+  listener = -1;
+}
+
+//-----------------------------------------------------------------------------
+// isOpen
+// Returns whether the server is listening
+//
+// @pre:   None
+// @post:  None
+// @returns bool: True between open() and close()
+//-----------------------------------------------------------------------------
+bool MetricsServer::isOpen() const {
+  return listener >= 0;
+}
+
+//-----------------------------------------------------------------------------
+// serve
+// Waits up to timeoutMs for scrapers, accepting them, reading their requests
+// and writing their responses; only sleeps if the server is closed
+//
+// @pre:   None
+// @post:  Every complete request received has its response queued
+// @param  timeoutMs: Longest time to wait
+// @param  render:    Writes the body of a "GET /metrics" response
+// @param  context:   Passed to render
+//-----------------------------------------------------------------------------
+void MetricsServer::serve(int timeoutMs, MetricsRenderer render,
+    void* context) {
+  if (listener < 0) {
+    usleep(timeoutMs * 1000);
+    return;
+  }
+  vector<struct pollfd> fds;
+  struct pollfd entry;
+  entry.revents = 0;
+  entry.fd = listener;
+  entry.events = POLLIN;
+  fds.push_back(entry);
+  for (size_t i = 0; i < clients.size(); i++) {
+    entry.fd = clients[i].sd;
+    entry.events = clients[i].answered ? POLLOUT : POLLIN;
+    fds.push_back(entry);
+  }
+  if (poll(&fds[0], fds.size(), timeoutMs) < 0) {
+    return;
+  }
+  long long nowUs = monotonicMicros();
+  vector<metricsClient> kept;
+  for (size_t i = 0; i < clients.size(); i++) {
+    metricsClient& client = clients[i];
+    bool alive = nowUs < client.deadlineUs;
+    if (alive && !client.answered && fds[i + 1].revents != 0) {
+      char buffer[1024];
+      ssize_t bytes = 0;
+      while ((bytes = recv(client.sd, buffer, sizeof(buffer), 0)) > 0) {
+        client.input.append(buffer, bytes);
+      }
+      //A scraper may shut down its side once the request is sent
+      alive = bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+      if (client.input.find("\r\n\r\n") != string::npos ||
+          client.input.find("\n\n") != string::npos) {
+        client.output = respond(client.input, render, context);
+        client.answered = true;
+        alive = true;
+      }
+      alive = alive && client.input.size() <= (size_t)METRICS_MAX_REQUEST;
+    }
+    while (alive && client.answered && !client.output.empty()) {
+      ssize_t bytes = send(client.sd, client.output.data(),
+          client.output.size(), MSG_NOSIGNAL);
+      if (bytes > 0) {
+        client.output.erase(0, bytes);
+      } else {
+        alive = bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        break;
+      }
+    }
+    if (alive && !(client.answered && client.output.empty())) {
+      kept.push_back(client);
+    } else {
+      ::close(client.sd);
+    }
+  }
+  clients.swap(kept);
+  if (fds[0].revents != 0) {
+    int sd = -1;
+    while ((sd = accept(listener, NULL, NULL)) >= 0) {
+      if (clients.size() >= (size_t)METRICS_MAX_CLIENTS) {
+        ::close(sd);
+        continue;
+      }
+      fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK);
+      metricsClient client;
+      client.sd = sd;
+      client.answered = false;
+      client.deadlineUs = nowUs + METRICS_CLIENT_TIMEOUT_MS * 1000LL;
+      clients.push_back(client);
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+// respond
+// Builds the response to a complete request: the metrics for "GET /metrics",
+// an error otherwise
+//
+// @pre:   request holds at least the request line and headers
+// @post:  None
+// @param  request: The request received
+// @param  render:  Writes the metrics
+// @param  context: Passed to render
+// @returns string: The status line, headers and body
+//-----------------------------------------------------------------------------
+string MetricsServer::respond(const string& request, MetricsRenderer render,
+    void* context) {
+  stringstream requestLine(request.substr(0, request.find('\n')));
+  string method = "";
+  string target = "";
+  requestLine >> method >> target;
+  string status = "200 OK";
+  string type = "text/plain; version=0.0.4; charset=utf-8";
+  string body = "";
+  if (method != "GET" && method != "HEAD") {
+    status = "405 Method Not Allowed";
+    type = "text/plain";
+    body = "only GET is supported\n";
+  } else if (target != "/metrics" && target.find("/metrics?") != 0) {
+    status = "404 Not Found";
+    type = "text/plain";
+    body = "metrics are at /metrics\n";
+  } else {
+    render(body, context);
+  }
+  stringstream response;
+  response << "HTTP/1.0 " << status << "\r\nContent-Type: " << type
+      << "\r\nContent-Length: " << body.size()
+      << "\r\nConnection: close\r\n\r\n";
+  if (method != "HEAD") {
+    response << body;
+  }
+  return response.str();
+}
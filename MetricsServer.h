@@ -0,0 +1,111 @@
+#ifndef METRICSSERVER_H_
+#define METRICSSERVER_H_
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+const int METRICS_MAX_CLIENTS = 16;          //Scrapes served at once
+const int METRICS_MAX_REQUEST = 8192;        //Longest request header accepted
+const int METRICS_CLIENT_TIMEOUT_MS = 5000;  //Time a client has to finish
+
+//Writes the response body for a scrape; context is the one given to serve()
+typedef void (*MetricsRenderer)(string& body, void* context);
+
+//-----------------------------------------------------------------------------
+// Class:       MetricsServer
+// Description: A minimal HTTP/1.0 server for Prometheus scrapes. It has no
+//              thread of its own: the owner calls serve() from its event
+//              loop, which waits on the listening socket and the clients
+//              for at most the given time, answers "GET /metrics" with the
+//              text the renderer writes and closes each connection once the
+//              response is out. Every socket is non-blocking, and a client
+//              that does not finish within METRICS_CLIENT_TIMEOUT_MS is
+//              dropped, so a stuck scraper cannot stall the loop. Not
+//              thread-safe: one thread calls every method.
+//-----------------------------------------------------------------------------
+class MetricsServer {
+ public:
+  //---------------------------------------------------------------------------
+  // MetricsServer Constructor
+  // Creates a closed server
+  //
+  // @pre:   None
+  // @post:  isOpen() is false
+  //---------------------------------------------------------------------------
+  MetricsServer();
+
+  //---------------------------------------------------------------------------
+  // MetricsServer Destructor
+  // Closes the server and every client
+  //
+  // @pre:   None
+  // @post:  None
+  //---------------------------------------------------------------------------
+  ~MetricsServer();
+
+  //---------------------------------------------------------------------------
+  // open
+  // Listens for scrapes on a TCP port
+  //
+  // @pre:   The server is closed
+  // @post:  Scrapers can connect if true is returned
+  // @param  address: The IP to bind, "" for every interface
+  // @param  port:    The port
+  // @returns bool:   False if the port cannot be bound (errno is set)
+  //---------------------------------------------------------------------------
+  bool open(const string& address, int port);
+
+  //---------------------------------------------------------------------------
+  // close
+  // Disconnects every client and stops listening
+  //
+  // @pre:   None
+  // @post:  isOpen() is false
+  //---------------------------------------------------------------------------
+  void close();
+
+  //---------------------------------------------------------------------------
+  // isOpen
+  // Returns whether the server is listening
+  //
+  // @pre:   None
+  // @post:  None
+  // @returns bool: True between open() and close()
+  //---------------------------------------------------------------------------
+  bool isOpen() const;
+
+  //---------------------------------------------------------------------------
+  // serve
+  // Waits up to timeoutMs for scrapers, accepting them, reading their
+  // requests and writing their responses; only sleeps if the server is
+  // closed
+  //
+  // @pre:   None
+  // @post:  Every complete request received has its response queued
+  // @param  timeoutMs: Longest time to wait
+  // @param  render:    Writes the body of a "GET /metrics" response
+  // @param  context:   Passed to render
+  //---------------------------------------------------------------------------
+  void serve(int timeoutMs, MetricsRenderer render, void* context);
+
+ private:
+  //A connected scraper
+  struct metricsClient {
+    int sd;
+    string input;           //Request received so far
+    string output;          //Response not yet written
+    bool answered;          //output holds the whole response
+    long long deadlineUs;   //Dropped if not done by then
+  };
+
+  //Builds the response to a complete request
+  string respond(const string& request, MetricsRenderer render,
+      void* context);
+
+  vector<metricsClient> clients;
+  int listener;
+};
+
+#endif /* METRICSSERVER_H_ */
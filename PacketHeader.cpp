@@ -0,0 +1,875 @@
+#include "PacketHeader.h"
+#include <math.h>
+
+//-----------------------------------------------------------------------------
+// build
+// Writes an untraced bulk packet with an empty hop list around a message
+//
+// @pre:   packet is capacity bytes long
+// @post:  packet holds the header, the message and a terminating \0; bytes
+//         after the \0 are left as they were
+// @param  packet:   The buffer to fill
+// @param  capacity: Size of the packet buffer
+// @param  message:  The message bytes
+// @param  length:   Number of message bytes
+// @returns bool:    False if the message does not fit
+//-----------------------------------------------------------------------------
+bool PacketHeader::build(char* packet, int capacity, const char* message,
+    int length) {
+  int payload = MAGIC_SIZE + 1;
+  if (length < 0 || payload + length + 1 > capacity) {
+    return false;
+  }
+  memset(packet, 0, payload);
+  packet[0] = -32;
+  packet[1] = -31;
+  packet[2] = -30;
+  memcpy(packet + payload, message, length);
+  packet[payload + length] = '\0';
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// getVersion
+// Returns the header version of a buffer
+//
+// @pre:   packet holds at least V2_HEADER_SIZE bytes
+// @post:  None
+// @param  packet: The buffer to inspect
+// @returns int:   1, 2 or 3, or 0 if the buffer is not a relay packet
+//-----------------------------------------------------------------------------
+int PacketHeader::getVersion(const char* packet) {
+  if (packet[0] != -32 || packet[1] != -31) {
+    return 0;
+  }
+  if (packet[2] == -30) {
+    return 1;
+  }
+  if (packet[2] == HEADER_V2_MARKER &&
+      (packet[VERSION_BYTE] == 2 || packet[VERSION_BYTE] == 3)) {
+    return packet[VERSION_BYTE];
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// getHopCount
+// Returns the number of relays recorded in the header
+//
+// @pre:   packet has valid packet format
+// @post:  None
+// @param  packet: The packet to inspect
+// @returns int:   Number of hops recorded
+//-----------------------------------------------------------------------------
+int PacketHeader::getHopCount(const char* packet) {
+  if (packet[2] == HEADER_V2_MARKER) {
+    return (unsigned char)packet[V2_HOPS_BYTE];
+  }
+  return packet[HOP_BYTE] & HOP_COUNT_MASK;
+}
+
+//-----------------------------------------------------------------------------
+// setHopCount
+// Overwrites the hop count, leaving the flag bits intact
+//
+// @pre:   0 <= hops <= MAX_HOPS (MAX_HOPS_V2 for version 2)
+// @post:  getHopCount(packet) == hops
+// @param  packet: The packet to modify
+// @param  hops:   The new hop count
+//-----------------------------------------------------------------------------
+void PacketHeader::setHopCount(char* packet, int hops) {
+  if (packet[2] == HEADER_V2_MARKER) {
+    packet[V2_HOPS_BYTE] = (char)(hops & 0xFF);
+    return;
+  }
+  packet[HOP_BYTE] = (packet[HOP_BYTE] & ~HOP_COUNT_MASK) |
+      (hops & HOP_COUNT_MASK);
+}
+
+//-----------------------------------------------------------------------------
+// getPriority
+// Returns the priority class carried in the header
+//
+// @pre:   packet has valid packet format
+// @post:  None
+// @param  packet: The packet to inspect
+// @returns int:   PRIORITY_BULK through PRIORITY_CONTROL
+//-----------------------------------------------------------------------------
+int PacketHeader::getPriority(const char* packet) {
+  return (packet[getFlagsByte(packet)] & PRIORITY_MASK) >> PRIORITY_SHIFT;
+}
+
+//-----------------------------------------------------------------------------
+// setPriority
+// Stores a priority class in the header, leaving the hop count intact
+//
+// @pre:   0 <= priority < NUM_PRIORITIES
+// @post:  getPriority(packet) == priority
+// @param  packet:   The packet to modify
+// @param  priority: The priority class to store
+//-----------------------------------------------------------------------------
+void PacketHeader::setPriority(char* packet, int priority) {
+  int flags = getFlagsByte(packet);
+  packet[flags] = (packet[flags] & ~PRIORITY_MASK) |
+      ((priority << PRIORITY_SHIFT) & PRIORITY_MASK);
+}
+
+//-----------------------------------------------------------------------------
+// getPayloadOffset
+// Returns the offset of the message that follows the hop list
+//
+// @pre:   packet has valid packet format
+// @post:  None
+// @param  packet: The packet to inspect
+// @returns int:   Byte offset of the message
+//-----------------------------------------------------------------------------
+int PacketHeader::getPayloadOffset(const char* packet) {
+  int offset = getTraceOffset(packet);
+  if (hasTrace(packet)) {
+    offset += TRACE_BASE_SIZE + (getHopCount(packet) * TRACE_ENTRY_SIZE);
+  }
+  return offset;
+}
+
+//-----------------------------------------------------------------------------
+// getLength
+// Returns the number of bytes a packet actually uses: header, hop list, trace
+// extension and the message up to and including its \0
+//
+// @pre:   packet has valid packet format and is capacity bytes long
+// @post:  None
+// @param  packet:   The packet to inspect
+// @param  capacity: Size of the packet buffer
+// @returns int:     Bytes used, at most capacity
+//-----------------------------------------------------------------------------
+int PacketHeader::getLength(const char* packet, int capacity) {
+  int offset = getPayloadOffset(packet);
+  if (offset >= capacity) {
+    return capacity;
+  }
+  int length = 0;
+  if (packet[2] == HEADER_V2_MARKER) {
+    const unsigned char* field =
+        (const unsigned char*)packet + V2_LENGTH_OFFSET;
+    length = offset + ((field[0] << 8) | field[1]) + 1;
+  } else {
+    length = offset + strnlen(packet + offset, capacity - offset) + 1;
+  }
+  return length > capacity ? capacity : length;
+}
+
+//-----------------------------------------------------------------------------
+// getOriginAddress
+// Returns the first IP address in the hop list packed into a 32-bit value
+// (first octet in the most significant byte), or 0 if the list is empty.
+// Version 2 packets carry node IDs, not addresses, and also return 0.
+//
+// @pre:   packet has valid packet format
+// @post:  None
+// @param  packet:    The packet to inspect
+// @returns unsigned: The group IP of the relay that first saw the packet
+//-----------------------------------------------------------------------------
+unsigned int PacketHeader::getOriginAddress(const char* packet) {
+  if (packet[2] == HEADER_V2_MARKER || getHopCount(packet) == 0) {
+    return 0;
+  }
+  return getHop(packet, 0);
+}
+
+//-----------------------------------------------------------------------------
+// getHop
+// Returns one entry of the hop list
+//
+// @pre:   getVersion(packet) != 3 and 0 <= hop < getHopCount(packet)
+// @post:  None
+// @param  packet:    The packet to inspect
+// @param  hop:       Index into the hop list, 0 = origin
+// @returns unsigned: The relay's group IP packed as by getOriginAddress
+//                    (version 1) or its node ID (version 2)
+//-----------------------------------------------------------------------------
+unsigned int PacketHeader::getHop(const char* packet, int hop) {
+  if (packet[2] == HEADER_V2_MARKER) {
+    const unsigned char* entry = (const unsigned char*)packet +
+        V2_HEADER_SIZE + (hop * NODE_ENTRY_SIZE);
+    return ((unsigned int)entry[0] << 8) | (unsigned int)entry[1];
+  }
+  const unsigned char* entry = (const unsigned char*)packet + MAGIC_SIZE + 1 +
+      (hop * HOP_ENTRY_SIZE);
+  return ((unsigned int)entry[0] << 24) | ((unsigned int)entry[1] << 16) |
+      ((unsigned int)entry[2] << 8) | (unsigned int)entry[3];
+}
+
+//-----------------------------------------------------------------------------
+// appendHop
+// Adds a 4-byte relay address to the end of the hop list and, if the packet is
+// traced, a zeroed trace entry for the new hop. The message is shifted to make
+// room and truncated at capacity.
+//
+// @pre:   getVersion(packet) == 1 and packet is capacity bytes long
+// @post:  The hop count is incremented unless the list is full
+// @param  packet:   The packet to modify
+// @param  capacity: Size of the packet buffer
+// @param  address:  The four address bytes to add
+// @returns bool:    False if the hop list already holds MAX_HOPS entries
+//-----------------------------------------------------------------------------
+bool PacketHeader::appendHop(char* packet, int capacity, const char* address) {
+  return insertHop(packet, capacity, address, HOP_ENTRY_SIZE, MAX_HOPS);
+}
+
+//-----------------------------------------------------------------------------
+// appendNode
+// The version 2 counterpart of appendHop: adds a 16-bit node ID
+//
+// @pre:   getVersion(packet) == 2 and packet is capacity bytes long
+// @post:  The hop count is incremented unless the list is full
+// @param  packet:   The packet to modify
+// @param  capacity: Size of the packet buffer
+// @param  node:     The node ID to add
+// @returns bool:    False if the list already holds MAX_HOPS_V2 entries or the
+//                   message would not fit
+//-----------------------------------------------------------------------------
+bool PacketHeader::appendNode(char* packet, int capacity, unsigned short node) {
+  char entry[NODE_ENTRY_SIZE];
+  entry[0] = (char)(node >> 8);
+  entry[1] = (char)(node & 0xFF);
+  return insertHop(packet, capacity, entry, NODE_ENTRY_SIZE, MAX_HOPS_V2);
+}
+
+//-----------------------------------------------------------------------------
+// convert
+// Writes a version 1 or 2 packet in the other of these versions with a
+// translated hop list, keeping flags, trace entries and the message
+//
+// @pre:   packet has valid packet format, both buffers are capacity bytes and
+//         do not overlap, hops has getHopCount(packet) entries
+// @post:  out holds the converted packet if true is returned
+// @param  packet:     The packet to convert
+// @param  out:        Receives the converted packet
+// @param  capacity:   Size of both buffers
+// @param  version:    1 or 2
+// @param  hops:       Hop list for the new version, origin first: packed IPs
+//                     for version 1, node IDs for version 2
+// @param  dropOldest: Leading hops (and their trace entries) to leave out
+// @returns bool:      False if the hops or the message do not fit
+//-----------------------------------------------------------------------------
+bool PacketHeader::convert(const char* packet, char* out, int capacity,
+    int version, const unsigned int* hops, int dropOldest) {
+  int hopCount = getHopCount(packet) - dropOldest;
+  bool traced = hasTrace(packet);
+  int messageOffset = getPayloadOffset(packet);
+  int messageLength = getLength(packet, capacity) - messageOffset - 1;
+  int headerSize = version == 2 ? V2_HEADER_SIZE : MAGIC_SIZE + 1;
+  int entrySize = version == 2 ? NODE_ENTRY_SIZE : HOP_ENTRY_SIZE;
+  int traceSize = traced ? TRACE_BASE_SIZE + (hopCount * TRACE_ENTRY_SIZE) : 0;
+  if (dropOldest < 0 || hopCount < 0 || messageLength < 0 ||
+      hopCount > (version == 2 ? MAX_HOPS_V2 : MAX_HOPS) ||
+      headerSize + (hopCount * entrySize) + traceSize + messageLength + 1 >
+      capacity) {
+    return false;
+  }
+  memset(out, 0, headerSize);
+  out[0] = -32;
+  out[1] = -31;
+  char flags = packet[getFlagsByte(packet)] & (TRACE_FLAG | PRIORITY_MASK);
+  if (version == 2) {
+    out[2] = HEADER_V2_MARKER;
+    out[VERSION_BYTE] = 2;
+    out[V2_FLAGS_BYTE] = flags;
+    out[V2_LENGTH_OFFSET] = (char)(messageLength >> 8);
+    out[V2_LENGTH_OFFSET + 1] = (char)(messageLength & 0xFF);
+  } else {
+    out[2] = -30;
+    out[HOP_BYTE] = flags;
+  }
+  setHopCount(out, hopCount);
+  char* entry = out + headerSize;
+  for (int i = 0; i < hopCount; i++) {
+    unsigned int value = hops[dropOldest + i];
+    for (int j = entrySize - 1; j >= 0; j--) {
+      entry[j] = (char)(value & 0xFF);
+      value >>= 8;
+    }
+    entry += entrySize;
+  }
+  if (traced) {
+    const char* trace = packet + getTraceOffset(packet);
+    memcpy(entry, trace, TRACE_BASE_SIZE);
+    memcpy(entry + TRACE_BASE_SIZE,
+        trace + TRACE_BASE_SIZE + (dropOldest * TRACE_ENTRY_SIZE),
+        hopCount * TRACE_ENTRY_SIZE);
+    entry += traceSize;
+  }
+  memcpy(entry, packet + messageOffset, messageLength);
+  entry[messageLength] = '\0';
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// hasTrace
+// Returns true if the packet carries the per-hop trace extension
+//
+// @pre:   packet has valid packet format
+// @post:  None
+// @param  packet: The packet to inspect
+// @returns bool:  True if the trace flag is set
+//-----------------------------------------------------------------------------
+bool PacketHeader::hasTrace(const char* packet) {
+  return (packet[getFlagsByte(packet)] & TRACE_FLAG) != 0;
+}
+
+//-----------------------------------------------------------------------------
+// startTrace
+// Inserts the trace extension after the hop list with zeroed entries for the
+// hops already recorded, shifting the message (truncated at capacity)
+//
+// @pre:   packet has valid packet format and is capacity bytes long
+// @post:  hasTrace(packet) is true unless the packet was already traced or is
+//         version 3
+// @param  packet:   The packet to modify
+// @param  capacity: Size of the packet buffer
+// @param  originUs: Origin time in microseconds since the epoch
+//-----------------------------------------------------------------------------
+void PacketHeader::startTrace(char* packet, int capacity, long long originUs) {
+  if (hasTrace(packet) || getVersion(packet) == 3) {
+    return;
+  }
+  int offset = getTraceOffset(packet);
+  int length = TRACE_BASE_SIZE + (getHopCount(packet) * TRACE_ENTRY_SIZE);
+  //Version 2 states the message length, so its message is never truncated
+  if (offset + length > capacity || (packet[2] == HEADER_V2_MARKER &&
+      getLength(packet, capacity) + length > capacity)) {
+    return;
+  }
+  shiftTail(packet, capacity, offset, length);
+  memset(packet + offset, 0, length);
+  unsigned long long origin = (unsigned long long)originUs;
+  for (int i = TRACE_BASE_SIZE - 1; i >= 0; i--) {
+    packet[offset + i] = (char)(origin & 0xFF);
+    origin >>= 8;
+  }
+  packet[getFlagsByte(packet)] |= TRACE_FLAG;
+}
+
+//-----------------------------------------------------------------------------
+// stripTrace
+// Removes the trace extension and clears the trace flag so that consumers
+// which only understand the plain header can parse the packet
+//
+// @pre:   packet has valid packet format and is capacity bytes long
+// @post:  hasTrace(packet) is false
+// @param  packet:   The packet to modify
+// @param  capacity: Size of the packet buffer
+//-----------------------------------------------------------------------------
+void PacketHeader::stripTrace(char* packet, int capacity) {
+  if (!hasTrace(packet)) {
+    return;
+  }
+  int offset = getTraceOffset(packet);
+  int length = getPayloadOffset(packet) - offset;
+  int used = getLength(packet, capacity);
+  memmove(packet + offset, packet + offset + length, used - offset - length);
+  memset(packet + used - length, 0, length);
+  packet[getFlagsByte(packet)] &= ~TRACE_FLAG;
+}
+
+//-----------------------------------------------------------------------------
+// getTraceOrigin
+// Returns the origin time stored in the trace extension
+//
+// @pre:   hasTrace(packet)
+// @post:  None
+// @param  packet:     The packet to inspect
+// @returns long long: Microseconds since the epoch
+//-----------------------------------------------------------------------------
+long long PacketHeader::getTraceOrigin(const char* packet) {
+  const unsigned char* field =
+      (const unsigned char*)packet + getTraceOffset(packet);
+  unsigned long long origin = 0;
+  for (int i = 0; i < TRACE_BASE_SIZE; i++) {
+    origin = (origin << 8) | field[i];
+  }
+  return (long long)origin;
+}
+
+//-----------------------------------------------------------------------------
+// getTraceEntry
+// Reads the trace entry of one hop
+//
+// @pre:   hasTrace(packet) and 0 <= hop < getHopCount(packet)
+// @post:  arrivalUs and residenceUs hold the entry, or -1 if saturated
+// @param  packet:      The packet to inspect
+// @param  hop:         Index into the hop list
+// @param  arrivalUs:   Receives the arrival offset from the origin time
+// @param  residenceUs: Receives the time the hop held the packet
+//-----------------------------------------------------------------------------
+void PacketHeader::getTraceEntry(const char* packet, int hop,
+    long long& arrivalUs, long long& residenceUs) {
+  const unsigned char* entry = (const unsigned char*)packet +
+      getTraceOffset(packet) + TRACE_BASE_SIZE + (hop * TRACE_ENTRY_SIZE);
+  int arrival = (entry[0] << 8) | entry[1];
+  int residence = (entry[2] << 8) | entry[3];
+  arrivalUs = (arrival == TRACE_SATURATED) ?
+      -1 : (long long)arrival * TRACE_ARRIVAL_UNIT;
+  residenceUs = (residence == TRACE_SATURATED) ? -1 : residence;
+}
+
+//-----------------------------------------------------------------------------
+// setTraceArrival
+// Stores the arrival offset of one hop in TRACE_ARRIVAL_UNIT steps
+//
+// @pre:   hasTrace(packet) and 0 <= hop < getHopCount(packet)
+// @post:  The hop's trace entry is updated
+// @param  packet: The packet to modify
+// @param  hop:    Index into the hop list
+// @param  micros: Microseconds since the origin time
+//-----------------------------------------------------------------------------
+void PacketHeader::setTraceArrival(char* packet, int hop, long long micros) {
+  putDelta(packet + getTraceOffset(packet) + TRACE_BASE_SIZE +
+      (hop * TRACE_ENTRY_SIZE), micros / TRACE_ARRIVAL_UNIT);
+}
+
+//-----------------------------------------------------------------------------
+// setTraceResidence
+// Stores the residence time of one hop
+//
+// @pre:   hasTrace(packet) and 0 <= hop < getHopCount(packet)
+// @post:  The hop's trace entry is updated
+// @param  packet: The packet to modify
+// @param  hop:    Index into the hop list
+// @param  micros: Microseconds between arrival and departure
+//-----------------------------------------------------------------------------
+void PacketHeader::setTraceResidence(char* packet, int hop, long long micros) {
+  putDelta(packet + getTraceOffset(packet) + TRACE_BASE_SIZE +
+      (hop * TRACE_ENTRY_SIZE) + 2, micros);
+}
+
+//-----------------------------------------------------------------------------
+// toBloom
+// Writes a version 1 or 2 packet as version 3, with every hop's node ID in the
+// filter. A trace extension is dropped.
+//
+// @pre:   packet has valid packet format, both buffers are capacity bytes and
+//         do not overlap, nodes has getHopCount(packet) entries
+// @post:  out holds the converted packet if true is returned
+// @param  packet:   The packet to convert
+// @param  out:      Receives the converted packet
+// @param  capacity: Size of both buffers
+// @param  words:    Filter size, MIN_BLOOM_WORDS to MAX_BLOOM_WORDS
+// @param  hashes:   Bits set per node ID, 1 to MAX_BLOOM_HASHES
+// @param  ttl:      Relays the packet may pass from here, 1 to 255
+// @param  nodes:    Node IDs of the hop list, origin first
+// @returns bool:    False if the geometry is invalid or the message does not
+//                   fit
+//-----------------------------------------------------------------------------
+bool PacketHeader::toBloom(const char* packet, char* out, int capacity,
+    int words, int hashes, int ttl, const unsigned int* nodes) {
+  if (words < MIN_BLOOM_WORDS || words > MAX_BLOOM_WORDS || hashes < 1 ||
+      hashes > MAX_BLOOM_HASHES || ttl < 1 || ttl > 255 ||
+      !wrapMessage(packet, out, capacity, 3, words * BLOOM_WORD_SIZE)) {
+    return false;
+  }
+  int hops = getHopCount(packet);
+  out[BLOOM_TTL_BYTE] = (char)ttl;
+  out[BLOOM_WORDS_BYTE] = (char)words;
+  out[BLOOM_HASHES_BYTE] = (char)hashes;
+  if (hops > 0) {
+    out[BLOOM_ORIGIN_OFFSET] = (char)((nodes[0] >> 8) & 0xFF);
+    out[BLOOM_ORIGIN_OFFSET + 1] = (char)(nodes[0] & 0xFF);
+  }
+  char* filter = out + BLOOM_FILTER_OFFSET;
+  for (int i = 0; i < hops; i++) {
+    unsigned long long mask[MAX_BLOOM_WORDS];
+    bloomMask(nodes[i], words, hashes, mask);
+    const char* bits = (const char*)mask;
+    for (int j = 0; j < words * BLOOM_WORD_SIZE; j++) {
+      filter[j] |= bits[j];
+    }
+  }
+  setHopCount(out, hops);
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// fromBloom
+// Writes a version 3 packet as version 1 or 2 with the given hop list,
+// typically the origin, the relays known to be in the filter and the
+// converting relay
+//
+// @pre:   getVersion(packet) == 3, both buffers are capacity bytes and do not
+//         overlap
+// @post:  out holds the converted packet if true is returned
+// @param  packet:   The packet to convert
+// @param  out:      Receives the converted packet
+// @param  capacity: Size of both buffers
+// @param  version:  1 or 2
+// @param  hops:     Hop list, origin first: packed IPs for version 1, node IDs
+//                   for version 2
+// @param  hopCount: Entries in hops
+// @returns bool:    False if the hops or the message do not fit
+//-----------------------------------------------------------------------------
+bool PacketHeader::fromBloom(const char* packet, char* out, int capacity,
+    int version, const unsigned int* hops, int hopCount) {
+  int entrySize = version == 2 ? NODE_ENTRY_SIZE : HOP_ENTRY_SIZE;
+  if (hopCount < 0 || hopCount > (version == 2 ? MAX_HOPS_V2 : MAX_HOPS) ||
+      !wrapMessage(packet, out, capacity, version, hopCount * entrySize)) {
+    return false;
+  }
+  char* entry = out + (version == 2 ? V2_HEADER_SIZE : MAGIC_SIZE + 1);
+  for (int i = 0; i < hopCount; i++) {
+    unsigned int value = hops[i];
+    for (int j = entrySize - 1; j >= 0; j--) {
+      entry[j] = (char)(value & 0xFF);
+      value >>= 8;
+    }
+    entry += entrySize;
+  }
+  setHopCount(out, hopCount);
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// bloomMask
+// Computes the filter bits of a node ID. Masks are computed once per node and
+// geometry so that checking and adding a node are word-wide ANDs and ORs
+// independent of the path length.
+//
+// @pre:   mask holds MAX_BLOOM_WORDS words
+// @post:  The first words words of mask hold the node's bits
+// @param  node:   The node ID
+// @param  words:  Filter size in words
+// @param  hashes: Bits set per node ID
+// @param  mask:   Receives the mask
+//-----------------------------------------------------------------------------
+void PacketHeader::bloomMask(unsigned int node, int words, int hashes,
+    unsigned long long* mask) {
+  memset(mask, 0, MAX_BLOOM_WORDS * BLOOM_WORD_SIZE);
+  //Two 32-bit mixes of the ID (MurmurHash3's finalizer) give the bit
+  //positions by double hashing: h1 + i * h2
+  unsigned int mixed[2];
+  for (int i = 0; i < 2; i++) {
+    unsigned int x = (node & 0xFFFF) ^ (i == 0 ? 0 : 0x5BD1E995);
+    x ^= x >> 16;
+    x *= 0x85EBCA6B;
+    x ^= x >> 13;
+    x *= 0xC2B2AE35;
+    x ^= x >> 16;
+    mixed[i] = x;
+  }
+  unsigned int bits = words * BLOOM_WORD_SIZE * 8;
+  unsigned char* bytes = (unsigned char*)mask;
+  for (int i = 0; i < hashes; i++) {
+    unsigned int bit = (mixed[0] + (i * (mixed[1] | 1))) % bits;
+    bytes[bit / 8] |= (unsigned char)(1 << (bit % 8));
+  }
+}
+
+//-----------------------------------------------------------------------------
+// bloomContains
+// Returns true if every bit of a mask is set in the packet's filter, that is
+// if the node has (or, at the false positive rate, may have) passed it
+//
+// @pre:   getVersion(packet) == 3 and mask was computed for its geometry
+// @post:  None
+// @param  packet: The packet to inspect
+// @param  mask:   A mask from bloomMask
+// @returns bool:  True if the node is in the filter
+//-----------------------------------------------------------------------------
+bool PacketHeader::bloomContains(const char* packet,
+    const unsigned long long* mask) {
+  int words = getBloomWords(packet);
+  const char* filter = packet + BLOOM_FILTER_OFFSET;
+  for (int i = 0; i < words; i++) {
+    unsigned long long word;
+    memcpy(&word, filter + (i * BLOOM_WORD_SIZE), BLOOM_WORD_SIZE);
+    if ((word & mask[i]) != mask[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// bloomAdd
+// Records a relay in the filter, decrements the TTL and counts the hop. The
+// first relay added also becomes the origin.
+//
+// @pre:   getVersion(packet) == 3 and mask is node's mask for its geometry
+// @post:  The packet carries the node unless its TTL had run out
+// @param  packet: The packet to modify
+// @param  node:   The relay's node ID
+// @param  mask:   The relay's mask from bloomMask
+// @returns bool:  False if the TTL is 0, in which case the packet is left
+//                 unchanged
+//-----------------------------------------------------------------------------
+bool PacketHeader::bloomAdd(char* packet, unsigned short node,
+    const unsigned long long* mask) {
+  int ttl = getBloomTtl(packet);
+  if (ttl == 0) {
+    return false;
+  }
+  int words = getBloomWords(packet);
+  char* filter = packet + BLOOM_FILTER_OFFSET;
+  for (int i = 0; i < words; i++) {
+    unsigned long long word;
+    memcpy(&word, filter + (i * BLOOM_WORD_SIZE), BLOOM_WORD_SIZE);
+    word |= mask[i];
+    memcpy(filter + (i * BLOOM_WORD_SIZE), &word, BLOOM_WORD_SIZE);
+  }
+  int hops = getHopCount(packet);
+  if (hops == 0) {
+    packet[BLOOM_ORIGIN_OFFSET] = (char)(node >> 8);
+    packet[BLOOM_ORIGIN_OFFSET + 1] = (char)(node & 0xFF);
+  }
+  if (hops < MAX_HOPS_V2) {
+    setHopCount(packet, hops + 1);
+  }
+  packet[BLOOM_TTL_BYTE] = (char)(ttl - 1);
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// getBloomWords
+// Returns the filter size of a version 3 header
+//
+// @pre:   getVersion(packet) == 3
+// @post:  None
+// @param  packet: The packet to inspect
+// @returns int:   Filter size in words, clamped to the valid range
+//-----------------------------------------------------------------------------
+int PacketHeader::getBloomWords(const char* packet) {
+  int words = (unsigned char)packet[BLOOM_WORDS_BYTE];
+  if (words < MIN_BLOOM_WORDS) {
+    return MIN_BLOOM_WORDS;
+  }
+  return words > MAX_BLOOM_WORDS ? MAX_BLOOM_WORDS : words;
+}
+
+//-----------------------------------------------------------------------------
+// getBloomHashes
+// Returns the bits set per node ID in a version 3 header
+//
+// @pre:   getVersion(packet) == 3
+// @post:  None
+// @param  packet: The packet to inspect
+// @returns int:   Bits per node ID
+//-----------------------------------------------------------------------------
+int PacketHeader::getBloomHashes(const char* packet) {
+  return (unsigned char)packet[BLOOM_HASHES_BYTE];
+}
+
+//-----------------------------------------------------------------------------
+// getBloomTtl
+// Returns the number of relays a version 3 packet may still pass
+//
+// @pre:   getVersion(packet) == 3
+// @post:  None
+// @param  packet: The packet to inspect
+// @returns int:   The TTL, 0-255
+//-----------------------------------------------------------------------------
+int PacketHeader::getBloomTtl(const char* packet) {
+  return (unsigned char)packet[BLOOM_TTL_BYTE];
+}
+
+//-----------------------------------------------------------------------------
+// getBloomOrigin
+// Returns the node ID of the relay that first saw a version 3 packet
+//
+// @pre:   getVersion(packet) == 3
+// @post:  None
+// @param  packet:          The packet to inspect
+// @returns unsigned short: The origin's node ID, 0 if no relay has added it
+//-----------------------------------------------------------------------------
+unsigned short PacketHeader::getBloomOrigin(const char* packet) {
+  const unsigned char* field =
+      (const unsigned char*)packet + BLOOM_ORIGIN_OFFSET;
+  return (unsigned short)((field[0] << 8) | field[1]);
+}
+
+//-----------------------------------------------------------------------------
+// bloomFalsePositiveRate
+// Estimates the chance that a node not on the path is reported as passed
+//
+// @pre:   words > 0, hashes > 0
+// @post:  None
+// @param  words:   Filter size in words
+// @param  hashes:  Bits set per node ID
+// @param  entries: Node IDs in the filter
+// @returns double: (1 - e^(-hashes * entries / bits))^hashes
+//-----------------------------------------------------------------------------
+double PacketHeader::bloomFalsePositiveRate(int words, int hashes,
+    int entries) {
+  double bits = words * BLOOM_WORD_SIZE * 8.0;
+  return pow(1 - exp(-hashes * entries / bits), hashes);
+}
+
+//-----------------------------------------------------------------------------
+// getTraceOffset
+// Returns the offset directly after the hop list, where the trace extension
+// starts if present
+//
+// @pre:   packet has valid packet format
+// @post:  None
+// @param  packet: The packet to inspect
+// @returns int:   Byte offset of the trace extension
+//-----------------------------------------------------------------------------
+int PacketHeader::getTraceOffset(const char* packet) {
+  if (packet[2] == HEADER_V2_MARKER && packet[VERSION_BYTE] == 3) {
+    return BLOOM_FILTER_OFFSET + (getBloomWords(packet) * BLOOM_WORD_SIZE);
+  }
+  if (packet[2] == HEADER_V2_MARKER) {
+    return V2_HEADER_SIZE + (getHopCount(packet) * NODE_ENTRY_SIZE);
+  }
+  return MAGIC_SIZE + 1 + (getHopCount(packet) * HOP_ENTRY_SIZE);
+}
+
+//-----------------------------------------------------------------------------
+// getFlagsByte
+// Returns the index of the byte holding the trace flag and priority class
+//
+// @pre:   packet has valid packet format
+// @post:  None
+// @param  packet: The packet to inspect
+// @returns int:   HOP_BYTE for version 1, V2_FLAGS_BYTE for versions 2 and 3
+//-----------------------------------------------------------------------------
+int PacketHeader::getFlagsByte(const char* packet) {
+  return packet[2] == HEADER_V2_MARKER ? V2_FLAGS_BYTE : HOP_BYTE;
+}
+
+//-----------------------------------------------------------------------------
+// insertHop
+// Adds an entry to the end of the hop list and, if the packet is traced, a
+// zeroed trace entry for the new hop. The message is shifted to make room; a
+// version 1 message is truncated at capacity, a version 2 packet whose
+// message would not fit is left unchanged.
+//
+// @pre:   packet has valid packet format and is capacity bytes long
+// @post:  The hop count is incremented unless the list is full
+// @param  packet:    The packet to modify
+// @param  capacity:  Size of the packet buffer
+// @param  entry:     The entry bytes to add
+// @param  entrySize: HOP_ENTRY_SIZE or NODE_ENTRY_SIZE
+// @param  maxHops:   Largest hop count of the packet's version
+// @returns bool:     False if the entry was not added
+//-----------------------------------------------------------------------------
+bool PacketHeader::insertHop(char* packet, int capacity, const char* entry,
+    int entrySize, int maxHops) {
+  int hops = getHopCount(packet);
+  int payload = getPayloadOffset(packet);
+  int growth = entrySize;
+  if (hasTrace(packet)) {
+    growth += TRACE_ENTRY_SIZE;
+  }
+  if (hops >= maxHops || payload + growth > capacity ||
+      (packet[2] == HEADER_V2_MARKER &&
+      getLength(packet, capacity) + growth > capacity)) {
+    return false;
+  }
+  int listEnd = getTraceOffset(packet);
+  shiftTail(packet, capacity, payload, growth);
+  if (hasTrace(packet)) {
+    //The trace moves up by one entry; its new entry goes at the end
+    memmove(packet + listEnd + entrySize, packet + listEnd,
+        payload - listEnd);
+    memset(packet + payload + entrySize, 0, TRACE_ENTRY_SIZE);
+  }
+  memcpy(packet + listEnd, entry, entrySize);
+  setHopCount(packet, hops + 1);
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// shiftTail
+// Moves the bytes of a packet from offset up to the end of its message up by
+// growth bytes. Only the bytes in use are moved, so the cost does not depend
+// on the buffer size; a message pushed past capacity is truncated and keeps
+// a terminating \0.
+//
+// @pre:   packet has valid packet format and is capacity bytes long,
+//         offset + growth <= capacity
+// @post:  The growth bytes at offset hold stale data for the caller to fill
+// @param  packet:   The packet to modify
+// @param  capacity: Size of the packet buffer
+// @param  offset:   First byte to move
+// @param  growth:   Bytes to open up at offset
+//-----------------------------------------------------------------------------
+void PacketHeader::shiftTail(char* packet, int capacity, int offset,
+    int growth) {
+  int moved = getLength(packet, capacity) - offset;
+  bool truncated = offset + growth + moved > capacity;
+  if (truncated) {
+    moved = capacity - offset - growth;
+  }
+  memmove(packet + offset + growth, packet + offset, moved);
+  if (truncated) {
+    packet[capacity - 1] = '\0';
+  }
+}
+
+//-----------------------------------------------------------------------------
+// putDelta
+// Writes a 16-bit big-endian value, saturating at TRACE_SATURATED
+//
+// @pre:   field has two writable bytes
+// @post:  field holds the value
+// @param  field: Where to write
+// @param  value: The value to store; negative values are stored as 0
+//-----------------------------------------------------------------------------
+void PacketHeader::putDelta(char* field, long long value) {
+  if (value < 0) {
+    value = 0;
+  }
+  if (value > TRACE_SATURATED) {
+    value = TRACE_SATURATED;
+  }
+  field[0] = (char)((value >> 8) & 0xFF);
+  field[1] = (char)(value & 0xFF);
+}
+
+//-----------------------------------------------------------------------------
+// wrapMessage
+// Writes the magic, version and priority of packet into out in the given
+// version and copies the message after room for a hop list or filter. The
+// hop count and trace flag are left 0.
+//
+// @pre:   packet has valid packet format, both buffers are capacity bytes and
+//         do not overlap
+// @post:  out holds everything but the hop list or filter if true is returned
+// @param  packet:   The packet whose message to copy
+// @param  out:      Receives the new packet
+// @param  capacity: Size of both buffers
+// @param  version:  1, 2 or 3
+// @param  listSize: Bytes to leave for the hop list or filter
+// @returns bool:    False if the message does not fit
+//-----------------------------------------------------------------------------
+bool PacketHeader::wrapMessage(const char* packet, char* out, int capacity,
+    int version, int listSize) {
+  int messageOffset = getPayloadOffset(packet);
+  int messageLength = getLength(packet, capacity) - messageOffset - 1;
+  int headerSize = MAGIC_SIZE + 1;
+  if (version == 2) {
+    headerSize = V2_HEADER_SIZE;
+  } else if (version == 3) {
+    headerSize = BLOOM_FILTER_OFFSET;
+  }
+  if (messageLength < 0 ||
+      headerSize + listSize + messageLength + 1 > capacity) {
+    return false;
+  }
+  memset(out, 0, headerSize + listSize);
+  out[0] = -32;
+  out[1] = -31;
+  char priority = packet[getFlagsByte(packet)] & PRIORITY_MASK;
+  if (version == 1) {
+    out[2] = -30;
+    out[HOP_BYTE] = priority;
+  } else {
+    out[2] = HEADER_V2_MARKER;
+    out[VERSION_BYTE] = (char)version;
+    out[V2_FLAGS_BYTE] = priority;
+    out[V2_LENGTH_OFFSET] = (char)(messageLength >> 8);
+    out[V2_LENGTH_OFFSET + 1] = (char)(messageLength & 0xFF);
+  }
+  memcpy(out + headerSize + listSize, packet + messageOffset, messageLength);
+  out[headerSize + listSize + messageLength] = '\0';
+  return true;
+}
@@ -0,0 +1,485 @@
+#ifndef PACKETHEADER_H_
+#define PACKETHEADER_H_
+
+#include <string.h>
+
+const int MAGIC_SIZE = 3;          //-32, -31, -30 at the start of a packet
+const int HOP_BYTE = 3;            //Offset of the hop/flags byte
+const int HOP_ENTRY_SIZE = 4;      //Bytes per hop (one byte per IP octet)
+const int HOP_COUNT_MASK = 0x1F;   //Low 5 bits of the hop byte: hop count
+const int MAX_HOPS = HOP_COUNT_MASK;    //31; longer paths need version 2
+const int PRIORITY_SHIFT = 5;      //Bits 5-6 of the hop byte: priority class
+const int PRIORITY_MASK = 0x60;
+const int TRACE_FLAG = 0x80;       //Bit 7 of the hop byte: trace extension
+const int TRACE_BASE_SIZE = 8;     //Origin timestamp at the start of a trace
+const int TRACE_ENTRY_SIZE = 4;    //Arrival and residence per hop
+const int TRACE_ARRIVAL_UNIT = 10; //Microseconds per arrival offset step
+const int TRACE_SATURATED = 0xFFFF; //Delta too large to represent
+
+//Version 2 header fields
+const int HEADER_V2_MARKER = -28;  //Byte 2 of a versioned header
+const int VERSION_BYTE = 3;        //Header version, 2 or later
+const int V2_FLAGS_BYTE = 4;       //Trace flag and priority, as in version 1
+const int V2_HOPS_BYTE = 5;        //Hop count, 0-255
+const int V2_LENGTH_OFFSET = 6;    //Message length in bytes, big endian
+const int V2_HEADER_SIZE = 8;
+const int NODE_ENTRY_SIZE = 2;     //Bytes per hop: a 16-bit node ID
+const int MAX_HOPS_V2 = 255;
+
+//Version 3 (Bloom filter) header fields; bytes 0-7 are as in version 2
+const int BLOOM_TTL_BYTE = 8;      //Relays the packet may still pass
+const int BLOOM_WORDS_BYTE = 9;    //Filter size in BLOOM_WORD_SIZE words
+const int BLOOM_HASHES_BYTE = 10;  //Filter bits set per node ID
+const int BLOOM_ORIGIN_OFFSET = 12; //Node ID of the first relay, big endian
+const int BLOOM_FILTER_OFFSET = 16;
+const int BLOOM_WORD_SIZE = 8;
+const int MIN_BLOOM_WORDS = 4;     //32-byte filter
+const int MAX_BLOOM_WORDS = 8;     //64-byte filter
+const int MAX_BLOOM_HASHES = 16;
+
+//Priority classes carried in the header. Class 0 is what an untagged (or
+//legacy) packet decodes to, so it must stay the lowest priority.
+const int PRIORITY_BULK = 0;
+const int PRIORITY_NORMAL = 1;
+const int PRIORITY_INTERACTIVE = 2;
+const int PRIORITY_CONTROL = 3;
+const int NUM_PRIORITIES = 4;
+
+//-----------------------------------------------------------------------------
+// Class:       PacketHeader
+// Description: Static helpers that read and modify the UdpRelay packet header
+//              in place. There are three header versions; every helper
+//              accepts all of them. Version 1 is:
+//
+//              Byte 0-2:  -32, -31, -30
+//              Byte 3:    bit 7     trace extension present
+//                         bits 5-6  priority class (0 = bulk ... 3 = control)
+//                         bits 0-4  hop count
+//              Byte 4-:   4-byte IP addresses of all relays the packet has
+//                         passed through, one per hop
+//              If traced: 8-byte origin time (us since the epoch, big
+//                         endian), then one 4-byte entry per hop: a 16-bit
+//                         arrival offset from the origin time in 10us units
+//                         and a 16-bit residence time (arrival to departure,
+//                         monotonic clock) in us. Both saturate at 0xFFFF.
+//              Followed by the message terminated by \0
+//
+//              Relays that predate priority classes read byte 3 as a plain
+//              hop count, which is still correct for bulk (class 0) packets
+//              that are not traced.
+//
+//              Version 2 records 16-bit node IDs instead of addresses, so a
+//              hop costs 2 bytes and up to 255 hops fit:
+//
+//              Byte 0-2:  -32, -31, -28
+//              Byte 3:    version (2)
+//              Byte 4:    bit 7 trace, bits 5-6 priority, as in version 1
+//              Byte 5:    hop count
+//              Byte 6-7:  message length without the \0, big endian
+//              Byte 8-:   2-byte node IDs, big endian, one per hop
+//              Then the trace extension and the message as in version 1.
+//
+//              Version 3 replaces the hop list with a fixed-size Bloom filter
+//              of the node IDs passed, so the header does not grow with the
+//              path and a loop check is a few ANDs:
+//
+//              Byte 0-7:  as in version 2 with version 3; the hop count
+//                         counts relays passed and stops at 255
+//              Byte 8:    TTL, relays the packet may still pass
+//              Byte 9:    filter size in 8-byte words (4-8)
+//              Byte 10:   bits set per node ID
+//              Byte 12-13: node ID of the origin relay, big endian
+//              Byte 16-:  the filter, bit b in byte b / 8 (LSB first)
+//              Then the message. Version 3 packets are never traced.
+//
+//              Relays only send version 2 or 3 to peers that offered it when
+//              they connected; convert(), toBloom() and fromBloom()
+//              translate between the versions.
+//-----------------------------------------------------------------------------
+class PacketHeader {
+ public:
+  //---------------------------------------------------------------------------
+  // build
+  // Writes an untraced bulk packet with an empty hop list around a message
+  //
+  // @pre:   packet is capacity bytes long
+  // @post:  packet holds the header, the message and a terminating \0, with
+  //         the rest of the buffer zeroed
+  // @param  packet:   The buffer to fill
+  // @param  capacity: Size of the packet buffer
+  // @param  message:  The message bytes
+  // @param  length:   Number of message bytes
+  // @returns bool:    False if the message does not fit
+  //---------------------------------------------------------------------------
+  static bool build(char* packet, int capacity, const char* message,
+      int length);
+
+  //---------------------------------------------------------------------------
+  // getVersion
+  // Returns the header version of a buffer
+  //
+  // @pre:   packet holds at least V2_HEADER_SIZE bytes
+  // @post:  None
+  // @param  packet: The buffer to inspect
+  // @returns int:   1, 2 or 3, or 0 if the buffer is not a relay packet
+  //---------------------------------------------------------------------------
+  static int getVersion(const char* packet);
+
+  //---------------------------------------------------------------------------
+  // getHopCount
+  // Returns the number of relays recorded in the header
+  //
+  // @pre:   packet has valid packet format
+  // @post:  None
+  // @param  packet: The packet to inspect
+  // @returns int:   Number of hops recorded
+  //---------------------------------------------------------------------------
+  static int getHopCount(const char* packet);
+
+  //---------------------------------------------------------------------------
+  // setHopCount
+  // Overwrites the hop count, leaving the flag bits intact
+  //
+  // @pre:   0 <= hops <= MAX_HOPS (MAX_HOPS_V2 for version 2)
+  // @post:  getHopCount(packet) == hops
+  // @param  packet: The packet to modify
+  // @param  hops:   The new hop count
+  //---------------------------------------------------------------------------
+  static void setHopCount(char* packet, int hops);
+
+  //---------------------------------------------------------------------------
+  // getPriority
+  // Returns the priority class carried in the header
+  //
+  // @pre:   packet has valid packet format
+  // @post:  None
+  // @param  packet: The packet to inspect
+  // @returns int:   PRIORITY_BULK through PRIORITY_CONTROL
+  //---------------------------------------------------------------------------
+  static int getPriority(const char* packet);
+
+  //---------------------------------------------------------------------------
+  // setPriority
+  // Stores a priority class in the header, leaving the hop count intact
+  //
+  // @pre:   0 <= priority < NUM_PRIORITIES
+  // @post:  getPriority(packet) == priority
+  // @param  packet:   The packet to modify
+  // @param  priority: The priority class to store
+  //---------------------------------------------------------------------------
+  static void setPriority(char* packet, int priority);
+
+  //---------------------------------------------------------------------------
+  // getPayloadOffset
+  // Returns the offset of the message that follows the hop list
+  //
+  // @pre:   packet has valid packet format
+  // @post:  None
+  // @param  packet: The packet to inspect
+  // @returns int:   Byte offset of the message
+  //---------------------------------------------------------------------------
+  static int getPayloadOffset(const char* packet);
+
+  //---------------------------------------------------------------------------
+  // getLength
+  // Returns the number of bytes a packet actually uses: header, hop list,
+  // trace extension and the message up to and including its \0
+  //
+  // @pre:   packet has valid packet format and is capacity bytes long
+  // @post:  None
+  // @param  packet:   The packet to inspect
+  // @param  capacity: Size of the packet buffer
+  // @returns int:     Bytes used, at most capacity
+  //---------------------------------------------------------------------------
+  static int getLength(const char* packet, int capacity);
+
+  //---------------------------------------------------------------------------
+  // getOriginAddress
+  // Returns the first IP address in the hop list packed into a 32-bit value
+  // (first octet in the most significant byte), or 0 if the list is empty.
+  // Version 2 packets carry node IDs, not addresses, and also return 0.
+  //
+  // @pre:   packet has valid packet format
+  // @post:  None
+  // @param  packet:    The packet to inspect
+  // @returns unsigned: The group IP of the relay that first saw the packet
+  //---------------------------------------------------------------------------
+  static unsigned int getOriginAddress(const char* packet);
+
+  //---------------------------------------------------------------------------
+  // getHop
+  // Returns one entry of the hop list
+  //
+  // @pre:   getVersion(packet) != 3 and 0 <= hop < getHopCount(packet)
+  // @post:  None
+  // @param  packet:    The packet to inspect
+  // @param  hop:       Index into the hop list, 0 = origin
+  // @returns unsigned: The relay's group IP packed as by getOriginAddress
+  //                    (version 1) or its node ID (version 2)
+  //---------------------------------------------------------------------------
+  static unsigned int getHop(const char* packet, int hop);
+
+  //---------------------------------------------------------------------------
+  // appendHop
+  // Adds a 4-byte relay address to the end of the hop list and, if the packet
+  // is traced, a zeroed trace entry for the new hop. The message is shifted
+  // to make room and truncated at capacity.
+  //
+  // @pre:   getVersion(packet) == 1 and packet is capacity bytes long
+  // @post:  The hop count is incremented unless the list is full
+  // @param  packet:   The packet to modify
+  // @param  capacity: Size of the packet buffer
+  // @param  address:  The four address bytes to add
+  // @returns bool:    False if the hop list already holds MAX_HOPS entries
+  //---------------------------------------------------------------------------
+  static bool appendHop(char* packet, int capacity, const char* address);
+
+  //---------------------------------------------------------------------------
+  // appendNode
+  // The version 2 counterpart of appendHop: adds a 16-bit node ID
+  //
+  // @pre:   getVersion(packet) == 2 and packet is capacity bytes long
+  // @post:  The hop count is incremented unless the list is full
+  // @param  packet:   The packet to modify
+  // @param  capacity: Size of the packet buffer
+  // @param  node:     The node ID to add
+  // @returns bool:    False if the list already holds MAX_HOPS_V2 entries or
+  //                   the message would not fit
+  //---------------------------------------------------------------------------
+  static bool appendNode(char* packet, int capacity, unsigned short node);
+
+  //---------------------------------------------------------------------------
+  // convert
+  // Writes a version 1 or 2 packet in the other of these versions with a
+  // translated hop list, keeping flags, trace entries and the message
+  //
+  // @pre:   packet has valid packet format, both buffers are capacity bytes
+  //         and do not overlap, hops has getHopCount(packet) entries
+  // @post:  out holds the converted packet if true is returned
+  // @param  packet:     The packet to convert
+  // @param  out:        Receives the converted packet
+  // @param  capacity:   Size of both buffers
+  // @param  version:    1 or 2
+  // @param  hops:       Hop list for the new version, origin first: packed
+  //                     IPs for version 1, node IDs for version 2
+  // @param  dropOldest: Leading hops (and their trace entries) to leave out
+  // @returns bool:      False if the hops or the message do not fit
+  //---------------------------------------------------------------------------
+  static bool convert(const char* packet, char* out, int capacity, int version,
+      const unsigned int* hops, int dropOldest);
+
+  //---------------------------------------------------------------------------
+  // hasTrace
+  // Returns true if the packet carries the per-hop trace extension
+  //
+  // @pre:   packet has valid packet format
+  // @post:  None
+  // @param  packet: The packet to inspect
+  // @returns bool:  True if the trace flag is set
+  //---------------------------------------------------------------------------
+  static bool hasTrace(const char* packet);
+
+  //---------------------------------------------------------------------------
+  // startTrace
+  // Inserts the trace extension after the hop list with zeroed entries for
+  // the hops already recorded, shifting the message (truncated at capacity)
+  //
+  // @pre:   packet has valid packet format and is capacity bytes long
+  // @post:  hasTrace(packet) is true unless the packet was already traced or
+  //         is version 3
+  // @param  packet:   The packet to modify
+  // @param  capacity: Size of the packet buffer
+  // @param  originUs: Origin time in microseconds since the epoch
+  //---------------------------------------------------------------------------
+  static void startTrace(char* packet, int capacity, long long originUs);
+
+  //---------------------------------------------------------------------------
+  // stripTrace
+  // Removes the trace extension and clears the trace flag so that consumers
+  // which only understand the plain header can parse the packet
+  //
+  // @pre:   packet has valid packet format and is capacity bytes long
+  // @post:  hasTrace(packet) is false
+  // @param  packet:   The packet to modify
+  // @param  capacity: Size of the packet buffer
+  //---------------------------------------------------------------------------
+  static void stripTrace(char* packet, int capacity);
+
+  //---------------------------------------------------------------------------
+  // getTraceOrigin
+  // Returns the origin time stored in the trace extension
+  //
+  // @pre:   hasTrace(packet)
+  // @post:  None
+  // @param  packet:     The packet to inspect
+  // @returns long long: Microseconds since the epoch
+  //---------------------------------------------------------------------------
+  static long long getTraceOrigin(const char* packet);
+
+  //---------------------------------------------------------------------------
+  // getTraceEntry
+  // Reads the trace entry of one hop
+  //
+  // @pre:   hasTrace(packet) and 0 <= hop < getHopCount(packet)
+  // @post:  arrivalUs and residenceUs hold the entry, or -1 if saturated
+  // @param  packet:      The packet to inspect
+  // @param  hop:         Index into the hop list
+  // @param  arrivalUs:   Receives the arrival offset from the origin time
+  // @param  residenceUs: Receives the time the hop held the packet
+  //---------------------------------------------------------------------------
+  static void getTraceEntry(const char* packet, int hop, long long& arrivalUs,
+      long long& residenceUs);
+
+  //---------------------------------------------------------------------------
+  // setTraceArrival / setTraceResidence
+  // Stores the arrival offset or residence time of one hop, saturating at
+  // the largest value the 16-bit field can hold
+  //
+  // @pre:   hasTrace(packet) and 0 <= hop < getHopCount(packet)
+  // @post:  The hop's trace entry is updated
+  // @param  packet: The packet to modify
+  // @param  hop:    Index into the hop list
+  // @param  micros: The delta to store
+  //---------------------------------------------------------------------------
+  static void setTraceArrival(char* packet, int hop, long long micros);
+  static void setTraceResidence(char* packet, int hop, long long micros);
+
+  //---------------------------------------------------------------------------
+  // toBloom
+  // Writes a version 1 or 2 packet as version 3, with every hop's node ID in
+  // the filter. A trace extension is dropped.
+  //
+  // @pre:   packet has valid packet format, both buffers are capacity bytes
+  //         and do not overlap, nodes has getHopCount(packet) entries
+  // @post:  out holds the converted packet if true is returned
+  // @param  packet:   The packet to convert
+  // @param  out:      Receives the converted packet
+  // @param  capacity: Size of both buffers
+  // @param  words:    Filter size, MIN_BLOOM_WORDS to MAX_BLOOM_WORDS
+  // @param  hashes:   Bits set per node ID, 1 to MAX_BLOOM_HASHES
+  // @param  ttl:      Relays the packet may pass from here, 1 to 255
+  // @param  nodes:    Node IDs of the hop list, origin first
+  // @returns bool:    False if the geometry is invalid or the message does
+  //                   not fit
+  //---------------------------------------------------------------------------
+  static bool toBloom(const char* packet, char* out, int capacity, int words,
+      int hashes, int ttl, const unsigned int* nodes);
+
+  //---------------------------------------------------------------------------
+  // fromBloom
+  // Writes a version 3 packet as version 1 or 2 with the given hop list,
+  // typically the origin, the relays known to be in the filter and the
+  // converting relay
+  //
+  // @pre:   getVersion(packet) == 3, both buffers are capacity bytes and do
+  //         not overlap
+  // @post:  out holds the converted packet if true is returned
+  // @param  packet:   The packet to convert
+  // @param  out:      Receives the converted packet
+  // @param  capacity: Size of both buffers
+  // @param  version:  1 or 2
+  // @param  hops:     Hop list, origin first: packed IPs for version 1, node
+  //                   IDs for version 2
+  // @param  hopCount: Entries in hops
+  // @returns bool:    False if the hops or the message do not fit
+  //---------------------------------------------------------------------------
+  static bool fromBloom(const char* packet, char* out, int capacity,
+      int version, const unsigned int* hops, int hopCount);
+
+  //---------------------------------------------------------------------------
+  // bloomMask
+  // Computes the filter bits of a node ID. Masks are computed once per node
+  // and geometry so that checking and adding a node are word-wide ANDs and
+  // ORs independent of the path length.
+  //
+  // @pre:   mask holds MAX_BLOOM_WORDS words
+  // @post:  The first words words of mask hold the node's bits
+  // @param  node:   The node ID
+  // @param  words:  Filter size in words
+  // @param  hashes: Bits set per node ID
+  // @param  mask:   Receives the mask
+  //---------------------------------------------------------------------------
+  static void bloomMask(unsigned int node, int words, int hashes,
+      unsigned long long* mask);
+
+  //---------------------------------------------------------------------------
+  // bloomContains
+  // Returns true if every bit of a mask is set in the packet's filter, that
+  // is if the node has (or, at the false positive rate, may have) passed it
+  //
+  // @pre:   getVersion(packet) == 3 and mask was computed for its geometry
+  // @post:  None
+  // @param  packet: The packet to inspect
+  // @param  mask:   A mask from bloomMask
+  // @returns bool:  True if the node is in the filter
+  //---------------------------------------------------------------------------
+  static bool bloomContains(const char* packet, const unsigned long long* mask);
+
+  //---------------------------------------------------------------------------
+  // bloomAdd
+  // Records a relay in the filter, decrements the TTL and counts the hop.
+  // The first relay added also becomes the origin.
+  //
+  // @pre:   getVersion(packet) == 3 and mask is node's mask for its geometry
+  // @post:  The packet carries the node unless its TTL had run out
+  // @param  packet: The packet to modify
+  // @param  node:   The relay's node ID
+  // @param  mask:   The relay's mask from bloomMask
+  // @returns bool:  False if the TTL is 0, in which case the packet is left
+  //                 unchanged
+  //---------------------------------------------------------------------------
+  static bool bloomAdd(char* packet, unsigned short node,
+      const unsigned long long* mask);
+
+  //---------------------------------------------------------------------------
+  // getBloomWords / getBloomHashes / getBloomTtl / getBloomOrigin
+  // Read the fields of a version 3 header
+  //
+  // @pre:   getVersion(packet) == 3
+  // @post:  None
+  // @param  packet: The packet to inspect
+  //---------------------------------------------------------------------------
+  static int getBloomWords(const char* packet);
+  static int getBloomHashes(const char* packet);
+  static int getBloomTtl(const char* packet);
+  static unsigned short getBloomOrigin(const char* packet);
+
+  //---------------------------------------------------------------------------
+  // bloomFalsePositiveRate
+  // Estimates the chance that a node not on the path is reported as passed
+  //
+  // @pre:   words > 0, hashes > 0
+  // @post:  None
+  // @param  words:   Filter size in words
+  // @param  hashes:  Bits set per node ID
+  // @param  entries: Node IDs in the filter
+  // @returns double: (1 - e^(-hashes * entries / bits))^hashes
+  //---------------------------------------------------------------------------
+  static double bloomFalsePositiveRate(int words, int hashes, int entries);
+
+ private:
+  PacketHeader() {}
+
+  //Offset of the trace extension (directly after the hop list)
+  static int getTraceOffset(const char* packet);
+
+  //Index of the byte holding the trace flag and priority
+  static int getFlagsByte(const char* packet);
+
+  //Inserts a hop entry of entrySize bytes at the end of the hop list
+  static bool insertHop(char* packet, int capacity, const char* entry,
+      int entrySize, int maxHops);
+
+  //Moves the used bytes from offset on up by growth, truncating at capacity
+  static void shiftTail(char* packet, int capacity, int offset, int growth);
+
+  //Writes a saturated 16-bit big-endian value
+  static void putDelta(char* field, long long value);
+
+  //Writes packet's priority and message into out in version, leaving
+  //listSize bytes for the hop list or filter
+  static bool wrapMessage(const char* packet, char* out, int capacity,
+      int version, int listSize);
+};
+
+#endif /* PACKETHEADER_H_ */
@@ -0,0 +1,380 @@
+#include "PacketQueue.h"
+#include "ControlFrame.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/time.h>
+
+//-----------------------------------------------------------------------------
+// PacketQueue Constructor
+// Creates an empty queue in strict priority mode
+//
+// @pre:   laneCapacity > 0
+// @post:  All lanes are empty, every weight is 1
+// @param  laneCapacity: Maximum number of packets held in each lane
+//-----------------------------------------------------------------------------
+PacketQueue::PacketQueue(int laneCapacity) {
+  capacity = laneCapacity;
+  total = 0;
+  weighted = false;
+  closed = false;
+  keying = NULL;
+  conflated = 0;
+  for (int i = 0; i < NUM_PRIORITIES; i++) {
+    queued[i] = 0;
+    dropped[i] = 0;
+    weights[i] = 1;
+    credits[i] = 1;
+  }
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&notEmpty, NULL);
+}
+
+//-----------------------------------------------------------------------------
+// PacketQueue Destructor
+// Frees every packet still queued
+//
+// @pre:   No thread is blocked in pop()
+// @post:  All queued packet buffers are deleted
+//-----------------------------------------------------------------------------
+PacketQueue::~PacketQueue() {
+  for (int i = 0; i < NUM_PRIORITIES; i++) {
+    while (!lanes[i].empty()) {
+      delete[] lanes[i].front().data;
+      lanes[i].pop();
+    }
+  }
+  for (size_t i = 0; i < keyings.size(); i++) {
+    delete keyings[i];
+  }
+  pthread_cond_destroy(&notEmpty);
+  pthread_mutex_destroy(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// push
+// Copies a packet onto the lane for its priority class and wakes the consumer
+//
+// @pre:   packet is at least length bytes, 0 <= priority < NUM_PRIORITIES
+// @post:  The packet is queued, or counted as dropped if its lane is full or
+//         the queue has been closed
+// @param  packet:   The packet bytes to copy
+// @param  length:   Number of bytes to copy
+// @param  priority: The lane to queue the packet on
+// @param  arrivalUs: When the packet reached the relay, carried through to the
+//                    consumer for residence time measurements
+// @param  messageId: Redundant copy's message ID, carried through to the
+//                    consumer, 0 if none
+// @param  origin:   The packet's origin group, part of the key when
+//                   conflating by source; 0 if not known
+// @returns bool:    True if the packet was queued
+//-----------------------------------------------------------------------------
+bool PacketQueue::push(const char* packet, int length, int priority,
+    long long arrivalUs, long long messageId, unsigned int origin) {
+  if (priority < 0 || priority >= NUM_PRIORITIES) {
+    priority = PRIORITY_BULK;
+  }
+  QueuedPacket entry;
+  entry.data = new char[length];
+  entry.length = length;
+  entry.priority = priority;
+  entry.arrivalUs = arrivalUs;
+  entry.messageId = messageId;
+  entry.origin = origin;
+  memcpy(entry.data, packet, length);
+  string key;
+  keySettings* settings = keying;
+  bool hasKey = settings != NULL &&
+      getKey(settings, packet, length, origin, key);
+
+  pthread_mutex_lock(&lock);
+  if (settings != keying) {
+    //setConflation ran meanwhile and forgot every key of the old settings
+    settings = keying;
+    hasKey = settings != NULL &&
+        getKey(settings, packet, length, origin, key);
+  }
+  hasKey = hasKey && !closed;
+  if (hasKey) {
+    map<string, QueuedPacket*>::iterator older = keyed.find(key);
+    if (older != keyed.end()) {
+      //Take the older packet's place in line; no new room is used
+      delete[] older->second->data;
+      entry.priority = older->second->priority;
+      *older->second = entry;
+      conflated++;
+      pthread_mutex_unlock(&lock);
+      return true;
+    }
+  }
+  if (closed || (int)lanes[priority].size() >= capacity) {
+    dropped[priority]++;
+    pthread_mutex_unlock(&lock);
+    delete[] entry.data;
+    return false;
+  }
+  lanes[priority].push(entry);
+  queued[priority]++;
+  if (hasKey) {
+    keyed[key] = &lanes[priority].back();  //Deque elements never move
+  }
+  total++;
+  pthread_cond_signal(&notEmpty);
+  pthread_mutex_unlock(&lock);
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// pop
+// Removes the next packet according to the scheduling mode, waiting up to
+// timeoutMs for one to arrive (forever if timeoutMs < 0, not at all if 0)
+//
+// @pre:   None
+// @post:  On success the caller owns out.data and must delete[] it
+// @param  out:       Receives the dequeued packet
+// @param  timeoutMs: Milliseconds to wait, or < 0 to wait indefinitely
+// @returns bool:     False on timeout or if the queue was closed and empty
+//-----------------------------------------------------------------------------
+bool PacketQueue::pop(QueuedPacket& out, int timeoutMs) {
+  struct timespec deadline;
+  if (timeoutMs >= 0) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    long nsec = now.tv_usec * 1000L + (timeoutMs % 1000) * 1000000L;
+    deadline.tv_sec = now.tv_sec + timeoutMs / 1000 + nsec / 1000000000L;
+    deadline.tv_nsec = nsec % 1000000000L;
+  }
+
+  pthread_mutex_lock(&lock);
+  while (total == 0 && !closed && timeoutMs != 0) {
+    if (timeoutMs < 0) {
+      pthread_cond_wait(&notEmpty, &lock);
+    } else if (pthread_cond_timedwait(&notEmpty, &lock, &deadline)
+        == ETIMEDOUT) {
+      break;
+    }
+  }
+  if (total == 0) {
+    pthread_mutex_unlock(&lock);
+    return false;
+  }
+  int lane = nextLane();
+  out = lanes[lane].front();
+  string key;
+  if (!keyed.empty() && getKey(keying, out.data, out.length, out.origin,
+      key)) {
+    map<string, QueuedPacket*>::iterator held = keyed.find(key);
+    if (held != keyed.end() && held->second == &lanes[lane].front()) {
+      keyed.erase(held);
+    }
+  }
+  lanes[lane].pop();
+  queued[lane]--;
+  total--;
+  pthread_mutex_unlock(&lock);
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// nextLane
+// Picks the lane to serve next. Strict mode takes the highest non-empty lane.
+// Weighted mode takes the highest non-empty lane that still has credit this
+// round, starting a new round when every non-empty lane has used its credit.
+//
+// @pre:   lock is held and total > 0
+// @post:  One credit is consumed from the chosen lane in weighted mode
+// @returns int:  The lane to pop from
+//-----------------------------------------------------------------------------
+int PacketQueue::nextLane() {
+  if (!weighted) {
+    for (int i = NUM_PRIORITIES - 1; i >= 0; i--) {
+      if (!lanes[i].empty()) {
+        return i;
+      }
+    }
+  }
+  for (int round = 0; round < 2; round++) {
+    for (int i = NUM_PRIORITIES - 1; i >= 0; i--) {
+      if (!lanes[i].empty() && credits[i] > 0) {
+        credits[i]--;
+        return i;
+      }
+    }
+    for (int i = 0; i < NUM_PRIORITIES; i++) {
+      credits[i] = weights[i];
+    }
+  }
+  return NUM_PRIORITIES - 1;
+}
+
+//-----------------------------------------------------------------------------
+// setWeights
+// Switches to weighted round robin using the given per-lane weights, or back
+// to strict priority if weights is NULL
+//
+// @pre:   weights is NULL or holds NUM_PRIORITIES values > 0
+// @post:  Subsequent pops use the new scheduling mode
+// @param  weights: Packets each lane may send per round, lowest lane first
+//-----------------------------------------------------------------------------
+void PacketQueue::setWeights(const int* weights) {
+  pthread_mutex_lock(&lock);
+  weighted = (weights != NULL);
+  for (int i = 0; i < NUM_PRIORITIES; i++) {
+    this->weights[i] = (weights != NULL && weights[i] > 0) ? weights[i] : 1;
+    credits[i] = this->weights[i];
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// setCapacity
+// Changes how many packets each lane may hold. Packets already queued past a
+// lower capacity stay queued; only new pushes are refused
+//
+// @pre:   laneCapacity > 0
+// @post:  Subsequent pushes use the new capacity
+// @param  laneCapacity: Maximum number of packets held in each lane
+//-----------------------------------------------------------------------------
+void PacketQueue::setCapacity(int laneCapacity) {
+  pthread_mutex_lock(&lock);
+  capacity = laneCapacity;
+  pthread_mutex_unlock(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// close
+// Wakes all waiting consumers and refuses further pushes
+//
+// @pre:   None
+// @post:  pop() returns queued packets, then false once empty
+//-----------------------------------------------------------------------------
+void PacketQueue::close() {
+  pthread_mutex_lock(&lock);
+  closed = true;
+  pthread_cond_broadcast(&notEmpty);
+  pthread_mutex_unlock(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// isClosed
+// Returns true once close() has been called
+//
+// @pre:   None
+// @post:  None
+// @returns bool: True if the queue refuses new packets
+//-----------------------------------------------------------------------------
+bool PacketQueue::isClosed() {
+  pthread_mutex_lock(&lock);
+  bool result = closed;
+  pthread_mutex_unlock(&lock);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+// size
+// Returns the number of packets queued on a lane, or on all lanes
+//
+// @pre:   lane is -1 or a valid priority class
+// @post:  None
+// @param  lane:  The lane to count, or -1 for the total
+// @returns int:  Number of packets queued
+//-----------------------------------------------------------------------------
+int PacketQueue::size(int lane) {
+  return (lane < 0) ? total : queued[lane];
+}
+
+//-----------------------------------------------------------------------------
+// getDropped
+// Returns how many packets were dropped on a lane because it was full
+//
+// @pre:   0 <= lane < NUM_PRIORITIES
+// @post:  None
+// @param  lane:  The lane to report
+// @returns long: Number of packets dropped since construction
+//-----------------------------------------------------------------------------
+long PacketQueue::getDropped(int lane) {
+  return dropped[lane];
+}
+
+//-----------------------------------------------------------------------------
+// setConflation
+// Turns latest-value conflation on with the given key, or off if length is 0.
+// Packets already queued are not replaced by later ones.
+//
+// @pre:   offset >= 0, length >= 0
+// @post:  Subsequent pushes replace queued packets with the same key
+// @param  offset:   First payload byte of the key
+// @param  length:   Number of payload bytes in the key, 0 = off
+// @param  bySource: Put the origin given to push in the key too
+//-----------------------------------------------------------------------------
+void PacketQueue::setConflation(int offset, int length, bool bySource) {
+  keySettings* settings = NULL;
+  if (length > 0) {
+    settings = new keySettings;
+    settings->offset = offset;
+    settings->length = length;
+    settings->bySource = bySource;
+  }
+  pthread_mutex_lock(&lock);
+  if (settings != NULL) {
+    //Pushes may still read the old settings, so they live as long as the queue
+    keyings.push_back(settings);
+  }
+  __sync_synchronize();
+  keying = settings;
+  keyed.clear();
+  pthread_mutex_unlock(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// getConflated
+// Returns how many queued packets were replaced by a newer one
+//
+// @pre:   None
+// @post:  None
+// @returns long: Number of packets conflated since construction
+//-----------------------------------------------------------------------------
+long PacketQueue::getConflated() {
+  return conflated;
+}
+
+//-----------------------------------------------------------------------------
+// getKey
+// Writes the conflation key of a packet: the key bytes of its message, after
+// its origin group if the settings key by source. Control frames, messages
+// that end before the key's last byte and packets whose origin is unknown have
+// no key. A version 1 message ends at its first \0; later versions state
+// their message length, so their key bytes may hold \0.
+//
+// @pre:   packet holds length bytes
+// @post:  key holds the key if true is returned
+// @param  settings: The key to build, NULL if conflation is off
+// @param  packet:   The packet
+// @param  length:   Its length
+// @param  origin:   Its origin group as given to push
+// @param  key:      Receives the key
+// @returns bool:    False if the packet has no key
+//-----------------------------------------------------------------------------
+bool PacketQueue::getKey(const keySettings* settings, const char* packet,
+    int length, unsigned int origin, string& key) {
+  if (settings == NULL || length < CONTROL_FRAME_SIZE ||
+      ControlFrame::isControl(packet)) {
+    return false;
+  }
+  int payload = PacketHeader::getPayloadOffset(packet);
+  int end = payload + settings->offset + settings->length;
+  //getLength counts the message's terminating \0
+  if (end >= PacketHeader::getLength(packet, length)) {
+    return false;
+  }
+  key.clear();
+  if (settings->bySource) {
+    //The group, not the raw hop entry, so a source keys the same in every
+    //header version
+    if (origin == 0 && PacketHeader::getHopCount(packet) > 0) {
+      return false;
+    }
+    key.append((const char*)&origin, sizeof(origin));
+  }
+  key.append(packet + payload + settings->offset, settings->length);
+  return true;
+}
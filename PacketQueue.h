@@ -0,0 +1,231 @@
+#ifndef PACKETQUEUE_H_
+#define PACKETQUEUE_H_
+
+#include <pthread.h>
+#include <map>
+#include <queue>
+#include <string>
+#include <vector>
+#include "PacketHeader.h"
+
+using namespace std;
+
+const int DEFAULT_LANE_CAPACITY = 1024;  //Packets held per priority lane
+
+
+
+//A packet owned by the queue until popped, then by the caller (delete[] data)
+struct QueuedPacket {
+  char* data;     //Copy of the packet bytes
+  int length;     //Number of valid bytes in data
+  int priority;   //Lane the packet was queued on
+  long long arrivalUs;  //monotonicMicros() when the relay received it
+  long long messageId;  //Shared by the copies sent over redundant paths,
+                        //0 if the packet is not redundant
+  unsigned int origin;  //Origin group given to push, 0 if not known
+};
+
+//-----------------------------------------------------------------------------
+// Class:       PacketQueue
+// Description: A bounded, thread-safe packet queue with one FIFO lane per
+//              priority class. Producers push copies of packets onto the lane
+//              matching their class; a single consumer pops them either in
+//              strict priority order (a higher lane always goes first) or by
+//              weighted round robin (each lane may send "weight" packets per
+//              round so bulk traffic cannot be starved outright).
+//
+//              When a lane is full the new packet is dropped and counted
+//              rather than blocking the producer, so a slow link never stalls
+//              the thread that feeds it. size(), getDropped() and
+//              getConflated() read counts kept in aligned words without the
+//              lock, so monitoring never waits on the producers.
+//
+//              With conflation on, packets carrying per-key state keep at
+//              most one queued packet per key: a packet whose key (a byte
+//              range of its message, optionally with its origin) matches one
+//              still queued replaces that packet's bytes in place, keeping
+//              its place in line. A queue that cannot drain then holds one
+//              packet per key, however fast updates arrive, and each one is
+//              the latest value. Packets without a key queue as usual.
+//              The key is built before the queue is locked, from settings
+//              that are replaced, never changed, and an origin the caller
+//              worked out before taking its own locks.
+//-----------------------------------------------------------------------------
+class PacketQueue {
+ public:
+  //---------------------------------------------------------------------------
+  // PacketQueue Constructor
+  // Creates an empty queue in strict priority mode
+  //
+  // @pre:   laneCapacity > 0
+  // @post:  All lanes are empty, every weight is 1
+  // @param  laneCapacity: Maximum number of packets held in each lane
+  //---------------------------------------------------------------------------
+  PacketQueue(int laneCapacity = DEFAULT_LANE_CAPACITY);
+
+  //---------------------------------------------------------------------------
+  // PacketQueue Destructor
+  // Frees every packet still queued
+  //
+  // @pre:   No thread is blocked in pop()
+  // @post:  All queued packet buffers are deleted
+  //---------------------------------------------------------------------------
+  ~PacketQueue();
+
+  //---------------------------------------------------------------------------
+  // push
+  // Copies a packet onto the lane for its priority class and wakes the
+  // consumer
+  //
+  // @pre:   packet is at least length bytes, 0 <= priority < NUM_PRIORITIES
+  // @post:  The packet is queued, or counted as dropped if its lane is full
+  //         or the queue has been closed
+  // @param  packet:   The packet bytes to copy
+  // @param  length:   Number of bytes to copy
+  // @param  priority: The lane to queue the packet on
+  // @param  arrivalUs: When the packet reached the relay, carried through to
+  //                    the consumer for residence time measurements
+  // @param  messageId: Redundant copy's message ID, carried through to the
+  //                    consumer, 0 if none
+  // @param  origin:   The packet's origin group, part of the key when
+  //                   conflating by source; 0 if not known
+  // @returns bool:    True if the packet was queued
+  //---------------------------------------------------------------------------
+  bool push(const char* packet, int length, int priority,
+      long long arrivalUs = 0, long long messageId = 0,
+      unsigned int origin = 0);
+
+  //---------------------------------------------------------------------------
+  // pop
+  // Removes the next packet according to the scheduling mode, waiting up to
+  // timeoutMs for one to arrive (forever if timeoutMs < 0, not at all if 0)
+  //
+  // @pre:   None
+  // @post:  On success the caller owns out.data and must delete[] it
+  // @param  out:       Receives the dequeued packet
+  // @param  timeoutMs: Milliseconds to wait, or < 0 to wait indefinitely
+  // @returns bool:     False on timeout or if the queue was closed and empty
+  //---------------------------------------------------------------------------
+  bool pop(QueuedPacket& out, int timeoutMs = -1);
+
+  //---------------------------------------------------------------------------
+  // setWeights
+  // Switches to weighted round robin using the given per-lane weights, or
+  // back to strict priority if weights is NULL
+  //
+  // @pre:   weights is NULL or holds NUM_PRIORITIES values > 0
+  // @post:  Subsequent pops use the new scheduling mode
+  // @param  weights: Packets each lane may send per round, lowest lane first
+  //---------------------------------------------------------------------------
+  void setWeights(const int* weights);
+
+  //---------------------------------------------------------------------------
+  // setCapacity
+  // Changes how many packets each lane may hold. Packets already queued past
+  // a lower capacity stay queued; only new pushes are refused
+  //
+  // @pre:   laneCapacity > 0
+  // @post:  Subsequent pushes use the new capacity
+  // @param  laneCapacity: Maximum number of packets held in each lane
+  //---------------------------------------------------------------------------
+  void setCapacity(int laneCapacity);
+
+  //---------------------------------------------------------------------------
+  // close
+  // Wakes all waiting consumers and refuses further pushes
+  //
+  // @pre:   None
+  // @post:  pop() returns queued packets, then false once empty
+  //---------------------------------------------------------------------------
+  void close();
+
+  //---------------------------------------------------------------------------
+  // isClosed
+  // Returns true once close() has been called
+  //
+  // @pre:   None
+  // @post:  None
+  // @returns bool: True if the queue refuses new packets
+  //---------------------------------------------------------------------------
+  bool isClosed();
+
+  //---------------------------------------------------------------------------
+  // size
+  // Returns the number of packets queued on a lane, or on all lanes
+  //
+  // @pre:   lane is -1 or a valid priority class
+  // @post:  None
+  // @param  lane:  The lane to count, or -1 for the total
+  // @returns int:  Number of packets queued
+  //---------------------------------------------------------------------------
+  int size(int lane = -1);
+
+  //---------------------------------------------------------------------------
+  // getDropped
+  // Returns how many packets were dropped on a lane because it was full
+  //
+  // @pre:   0 <= lane < NUM_PRIORITIES
+  // @post:  None
+  // @param  lane:  The lane to report
+  // @returns long: Number of packets dropped since construction
+  //---------------------------------------------------------------------------
+  long getDropped(int lane);
+
+  //---------------------------------------------------------------------------
+  // setConflation
+  // Turns latest-value conflation on with the given key, or off if length is
+  // 0. Packets already queued are not replaced by later ones.
+  //
+  // @pre:   offset >= 0, length >= 0
+  // @post:  Subsequent pushes replace queued packets with the same key
+  // @param  offset:   First payload byte of the key
+  // @param  length:   Number of payload bytes in the key, 0 = off
+  // @param  bySource: Put the origin given to push in the key too
+  //---------------------------------------------------------------------------
+  void setConflation(int offset, int length, bool bySource = false);
+
+  //---------------------------------------------------------------------------
+  // getConflated
+  // Returns how many queued packets were replaced by a newer one
+  //
+  // @pre:   None
+  // @post:  None
+  // @returns long: Number of packets conflated since construction
+  //---------------------------------------------------------------------------
+  long getConflated();
+
+ private:
+  //A conflation key, never changed once published in keying
+  struct keySettings {
+    int offset;       //First payload byte of the key
+    int length;       //Number of payload bytes in the key
+    bool bySource;    //Origin prefixed to the key
+  };
+
+  //Picks the lane to serve next; caller holds lock and the queue is not empty
+  int nextLane();
+
+  //Writes the conflation key of a packet; false if it has none. Needs no lock
+  bool getKey(const keySettings* settings, const char* packet, int length,
+      unsigned int origin, string& key);
+
+  queue<QueuedPacket> lanes[NUM_PRIORITIES];  //One FIFO per priority class
+  volatile int queued[NUM_PRIORITIES]; //lanes[i].size(), read without the
+                                   //lock
+  volatile long dropped[NUM_PRIORITIES]; //Packets refused per lane
+  int weights[NUM_PRIORITIES];     //Packets per round in weighted mode
+  int credits[NUM_PRIORITIES];     //Packets left in the current round
+  bool weighted;                   //False = strict priority
+  bool closed;                     //Set by close()
+  int capacity;                    //Max packets per lane
+  volatile int total;              //Packets across all lanes
+  keySettings* volatile keying;    //Current key, NULL = no conflation; read
+                                   //without the lock
+  vector<keySettings*> keyings;    //Every key published, freed with the queue
+  map<string, QueuedPacket*> keyed; //Queued packet holding each key
+  volatile long conflated;         //Packets replaced by a newer one
+  pthread_mutex_t lock;
+  pthread_cond_t notEmpty;
+};
+
+#endif /* PACKETQUEUE_H_ */
@@ -0,0 +1,426 @@
+#include "PcapReader.h"
+#include "PcapWriter.h"
+#include <string.h>
+
+const unsigned int PCAP_MAGIC_MICROS = 0xA1B2C3D4;
+const unsigned int PCAP_MAGIC_NANOS = 0xA1B23C4D;
+const int PCAP_FILE_HEADER = 24;
+const int PCAP_RECORD_HEADER = 16;
+const int MAX_CAPTURE_BLOCK = 16777216;   //Larger lengths mean a damaged file
+const unsigned short OPTION_IF_TSRESOL = 9;
+
+//Link types with a known way to the IP header
+const int LINKTYPE_NULL = 0;              //4-byte address family
+const int LINKTYPE_ETHERNET = 1;
+const int LINKTYPE_IPV4 = 228;
+const int LINKTYPE_LINUX_SLL = 113;       //16-byte cooked header
+const int LINKTYPE_LINUX_SLL2 = 276;      //20-byte cooked header
+const unsigned short ETHERTYPE_IPV4 = 0x0800;
+const unsigned short ETHERTYPE_VLAN = 0x8100;
+
+//-----------------------------------------------------------------------------
+// swap32
+// Reverses the byte order of a 32-bit value
+//
+// @pre:   None
+// @post:  None
+// @param  value:     The value
+// @returns unsigned: value with its bytes reversed
+//-----------------------------------------------------------------------------
+static unsigned int swap32(unsigned int value) {
+  return (value >> 24) | ((value >> 8) & 0xFF00) | ((value << 8) & 0xFF0000) |
+      (value << 24);
+}
+
+//-----------------------------------------------------------------------------
+// bigEndian16
+// Reads a 16-bit value stored in network byte order
+//
+// @pre:   bytes holds 2 bytes
+// @post:  None
+// @param  bytes:     Where to read
+// @returns unsigned: The value
+//-----------------------------------------------------------------------------
+static unsigned short bigEndian16(const unsigned char* bytes) {
+  return (bytes[0] << 8) | bytes[1];
+}
+
+//-----------------------------------------------------------------------------
+// bigEndian32
+// Reads a 32-bit value stored in network byte order
+//
+// @pre:   bytes holds 4 bytes
+// @post:  None
+// @param  bytes:     Where to read
+// @returns unsigned: The value
+//-----------------------------------------------------------------------------
+static unsigned int bigEndian32(const unsigned char* bytes) {
+  return ((unsigned int)bigEndian16(bytes) << 16) | bigEndian16(bytes + 2);
+}
+
+//-----------------------------------------------------------------------------
+// PcapReader Constructor
+// Creates a reader with no file open
+//
+// @pre:   None
+// @post:  next() returns false until open() succeeds
+//-----------------------------------------------------------------------------
+PcapReader::PcapReader() {
+  file = NULL;
+  pcapng = false;
+  swapped = false;
+  nanoseconds = false;
+  linkType = -1;
+  frame = NULL;
+  frameLength = 0;
+  skipped = 0;
+}
+
+//-----------------------------------------------------------------------------
+// PcapReader Destructor
+// Closes the file if one is open
+//
+// @pre:   None
+// @post:  None
+//-----------------------------------------------------------------------------
+PcapReader::~PcapReader() {
+  close();
+}
+
+//-----------------------------------------------------------------------------
+// open
+// Opens a pcap or pcapng file and reads its file header
+//
+// @pre:   None
+// @post:  The reader is positioned before the first packet
+// @param  path:  File to read
+// @returns bool: False if the file cannot be read or is not a capture
+//-----------------------------------------------------------------------------
+bool PcapReader::open(const string& path) {
+  close();
+  file = fopen(path.c_str(), "rb");
+  if (file == NULL) {
+    return false;
+  }
+  skipped = 0;
+  interfaces.clear();
+  unsigned char header[PCAP_FILE_HEADER];
+  if (fread(header, 4, 1, file) != 1) {
+    close();
+    return false;
+  }
+  unsigned int magic;
+  memcpy(&magic, header, 4);
+  if (magic == PCAPNG_SECTION_HEADER) {
+    //Let nextPcapngFrame read the section header like any other
+    pcapng = true;
+    rewind(file);
+    return true;
+  }
+  pcapng = false;
+  swapped = magic == swap32(PCAP_MAGIC_MICROS) ||
+      magic == swap32(PCAP_MAGIC_NANOS);
+  nanoseconds = magic == PCAP_MAGIC_NANOS || magic == swap32(PCAP_MAGIC_NANOS);
+  if ((!swapped && magic != PCAP_MAGIC_MICROS && magic != PCAP_MAGIC_NANOS) ||
+      fread(header + 4, PCAP_FILE_HEADER - 4, 1, file) != 1) {
+    close();
+    return false;
+  }
+  linkType = toHost32(header + 20) & 0xFFFF;  //Upper bits hold FCS flags
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// close
+// Closes the capture file
+//
+// @pre:   None
+// @post:  next() returns false
+//-----------------------------------------------------------------------------
+void PcapReader::close() {
+  if (file != NULL) {
+    fclose(file);
+    file = NULL;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// next
+// Reads up to the next IPv4 UDP datagram
+//
+// @pre:   None
+// @post:  datagram describes the datagram if true is returned
+// @param  datagram: Receives the datagram
+// @returns bool:    False at the end of the file or on a damaged block
+//-----------------------------------------------------------------------------
+bool PcapReader::next(PcapDatagram& datagram) {
+  if (file == NULL) {
+    return false;
+  }
+  while (true) {
+    long long timestampUs = 0;
+    int frameLinkType = -1;
+    bool found = pcapng ? nextPcapngFrame(timestampUs, frameLinkType) :
+        nextPcapFrame(timestampUs, frameLinkType);
+    if (!found) {
+      return false;
+    }
+    if (decode(frameLinkType, datagram)) {
+      datagram.timestampUs = timestampUs;
+      return true;
+    }
+    skipped++;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// getSkipped
+// Returns the number of frames that were not IPv4 UDP datagrams
+//
+// @pre:   None
+// @post:  None
+// @returns long: Frames skipped since open()
+//-----------------------------------------------------------------------------
+long PcapReader::getSkipped() const {
+  return skipped;
+}
+
+//-----------------------------------------------------------------------------
+// toHost32
+// Reads a 32-bit value in the byte order of the file
+//
+// @pre:   bytes holds 4 bytes
+// @post:  None
+// @param  bytes:     Where to read
+// @returns unsigned: The value in host byte order
+//-----------------------------------------------------------------------------
+unsigned int PcapReader::toHost32(const unsigned char* bytes) const {
+  unsigned int value;
+  memcpy(&value, bytes, 4);
+  return swapped ? swap32(value) : value;
+}
+
+//-----------------------------------------------------------------------------
+// toHost16
+// Reads a 16-bit value in the byte order of the file
+//
+// @pre:   bytes holds 2 bytes
+// @post:  None
+// @param  bytes:     Where to read
+// @returns unsigned: The value in host byte order
+//-----------------------------------------------------------------------------
+unsigned short PcapReader::toHost16(const unsigned char* bytes) const {
+  unsigned short value;
+  memcpy(&value, bytes, 2);
+  return swapped ? (unsigned short)((value >> 8) | (value << 8)) : value;
+}
+
+//-----------------------------------------------------------------------------
+// nextPcapFrame
+// Reads the next record of a classic pcap file
+//
+// @pre:   The file is a classic pcap file positioned at a record
+// @post:  frame and frameLength describe the record's frame
+// @param  timestampUs:   Receives the capture time in us
+// @param  frameLinkType: Receives the file's link type
+// @returns bool:         False at the end of the file or on a damaged record
+//-----------------------------------------------------------------------------
+bool PcapReader::nextPcapFrame(long long& timestampUs, int& frameLinkType) {
+  unsigned char header[PCAP_RECORD_HEADER];
+  if (fread(header, sizeof(header), 1, file) != 1) {
+    return false;
+  }
+  unsigned int seconds = toHost32(header);
+  unsigned int fraction = toHost32(header + 4);
+  unsigned int captured = toHost32(header + 8);
+  if (captured > (unsigned int)MAX_CAPTURE_BLOCK) {
+    return false;
+  }
+  block.resize(captured + 1);
+  if (captured > 0 && fread(&block[0], captured, 1, file) != 1) {
+    return false;
+  }
+  timestampUs = seconds * 1000000LL + (nanoseconds ? fraction / 1000 :
+      fraction);
+  frameLinkType = linkType;
+  frame = &block[0];
+  frameLength = captured;
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// nextPcapngFrame
+// Reads pcapng blocks until a packet block, tracking sections and interfaces
+// on the way
+//
+// @pre:   The file is a pcapng file positioned at a block
+// @post:  frame and frameLength describe the packet's frame
+// @param  timestampUs:   Receives the capture time in us
+// @param  frameLinkType: Receives the link type of the packet's interface
+// @returns bool:         False at the end of the file or on a damaged block
+//-----------------------------------------------------------------------------
+bool PcapReader::nextPcapngFrame(long long& timestampUs, int& frameLinkType) {
+  while (true) {
+    unsigned char head[12];
+    if (fread(head, 8, 1, file) != 1) {
+      return false;
+    }
+    unsigned int type;
+    memcpy(&type, head, 4);
+    if (type == PCAPNG_SECTION_HEADER) {
+      //The byte order magic decides how this section's lengths are read
+      if (fread(head + 8, 4, 1, file) != 1) {
+        return false;
+      }
+      unsigned int byteOrder;
+      memcpy(&byteOrder, head + 8, 4);
+      if (byteOrder != PCAPNG_BYTE_ORDER_MAGIC &&
+          byteOrder != swap32(PCAPNG_BYTE_ORDER_MAGIC)) {
+        return false;
+      }
+      swapped = byteOrder != PCAPNG_BYTE_ORDER_MAGIC;
+      interfaces.clear();
+    }
+    type = toHost32(head);
+    unsigned int length = toHost32(head + 4);
+    int headBytes = type == PCAPNG_SECTION_HEADER ? 12 : 8;
+    if (length < 12 || length % 4 != 0 ||
+        length > (unsigned int)MAX_CAPTURE_BLOCK) {
+      return false;
+    }
+    block.resize(length);
+    memcpy(&block[0], head, headBytes);
+    if (fread(&block[headBytes], length - headBytes, 1, file) != 1) {
+      return false;
+    }
+    const unsigned char* body = &block[0];
+    if (type == PCAPNG_INTERFACE && length >= 20) {
+      interface added;
+      added.linkType = toHost16(body + 8);
+      added.ticksPerSecond = 1000000;
+      unsigned int offset = 16;
+      while (offset + 4 <= length - 4) {
+        unsigned short code = toHost16(body + offset);
+        unsigned short optionLength = toHost16(body + offset + 2);
+        if (code == 0 || offset + 4 + optionLength > length - 4) {
+          break;
+        }
+        if (code == OPTION_IF_TSRESOL && optionLength >= 1) {
+          //High bit set: a negative power of 2, else of 10
+          unsigned char resolution = body[offset + 4];
+          added.ticksPerSecond = 1;
+          for (int i = 0; i < (resolution & 0x7F) && i < 63; i++) {
+            added.ticksPerSecond *= (resolution & 0x80) ? 2 : 10;
+          }
+        }
+        offset += 4 + ((optionLength + 3) & ~3);
+      }
+      interfaces.push_back(added);
+    }
+    else if (type == PCAPNG_ENHANCED_PACKET && length >= 32) {
+      unsigned int interfaceID = toHost32(body + 8);
+      unsigned int captured = toHost32(body + 20);
+      if (interfaceID >= interfaces.size() || captured > length - 32) {
+        skipped++;
+        continue;
+      }
+      unsigned long long ticks =
+          ((unsigned long long)toHost32(body + 12) << 32) | toHost32(body + 16);
+      unsigned long long perSecond = interfaces[interfaceID].ticksPerSecond;
+      timestampUs = perSecond == 1000000 ? (long long)ticks :
+          (long long)((long double)ticks * 1000000 / perSecond);
+      frameLinkType = interfaces[interfaceID].linkType;
+      frame = body + 28;
+      frameLength = captured;
+      return true;
+    }
+    else if (type == PCAPNG_SIMPLE_PACKET) {
+      skipped++;    //No timestamp to replay it at
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+// decode
+// Finds the IPv4 UDP datagram in the current frame
+//
+// @pre:   frame and frameLength describe a frame
+// @post:  datagram holds the addresses, ports and payload if true is returned
+// @param  frameLinkType: Link type of the frame
+// @param  datagram:      Receives the datagram
+// @returns bool:         False if the frame is not an unfragmented IPv4 UDP
+//                        datagram
+//-----------------------------------------------------------------------------
+bool PcapReader::decode(int frameLinkType, PcapDatagram& datagram) {
+  int offset = 0;
+  unsigned short etherType = ETHERTYPE_IPV4;
+  switch (frameLinkType) {
+    case LINKTYPE_NULL:
+      //Address family in the byte order of the capturing host; AF_INET is 2
+      if (frameLength < 4 || (frame[0] != 2 && frame[3] != 2)) {
+        return false;
+      }
+      offset = 4;
+      break;
+    case LINKTYPE_ETHERNET:
+      if (frameLength < 14) {
+        return false;
+      }
+      etherType = bigEndian16(frame + 12);
+      offset = 14;
+      if (etherType == ETHERTYPE_VLAN && frameLength >= 18) {
+        etherType = bigEndian16(frame + 16);
+        offset = 18;
+      }
+      break;
+    case PCAP_LINKTYPE_RAW:
+    case LINKTYPE_IPV4:
+      break;
+    case LINKTYPE_LINUX_SLL:
+      if (frameLength < 16) {
+        return false;
+      }
+      etherType = bigEndian16(frame + 14);
+      offset = 16;
+      break;
+    case LINKTYPE_LINUX_SLL2:
+      if (frameLength < 20) {
+        return false;
+      }
+      etherType = bigEndian16(frame);
+      offset = 20;
+      break;
+    default:
+      return false;
+  }
+  const unsigned char* ip = frame + offset;
+  int available = frameLength - offset;
+  if (etherType != ETHERTYPE_IPV4 || available < 20 || (ip[0] >> 4) != 4) {
+    return false;
+  }
+  int ipHeader = (ip[0] & 0x0F) * 4;
+  int totalLength = bigEndian16(ip + 2);
+  //Protocol 17 is UDP; a set MF bit or fragment offset means a fragment
+  if (ipHeader < 20 || ip[9] != 17 || (bigEndian16(ip + 6) & 0x3FFF) != 0 ||
+      available < ipHeader + 8 || totalLength < ipHeader + 8) {
+    return false;
+  }
+  if (totalLength < available) {
+    available = totalLength;    //Ethernet padding
+  }
+  const unsigned char* udp = ip + ipHeader;
+  int payloadLength = bigEndian16(udp + 4) - 8;
+  if (payloadLength < 0) {
+    return false;
+  }
+  if (payloadLength > available - ipHeader - 8) {
+    payloadLength = available - ipHeader - 8;   //Truncated by the snap length
+  }
+  datagram.sourceIp = bigEndian32(ip + 12);
+  datagram.destinationIp = bigEndian32(ip + 16);
+  datagram.sourcePort = bigEndian16(udp);
+  datagram.destinationPort = bigEndian16(udp + 2);
+  datagram.payload = (const char*)(udp + 8);
+  datagram.length = payloadLength;
+  return true;
+}
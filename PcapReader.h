@@ -0,0 +1,126 @@
+#ifndef PCAPREADER_H_
+#define PCAPREADER_H_
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+//A UDP datagram returned by PcapReader::next
+struct PcapDatagram {
+  long long timestampUs;        //Capture time, us since the epoch
+  unsigned int sourceIp;        //IPv4 addresses, host byte order
+  unsigned int destinationIp;
+  unsigned short sourcePort;
+  unsigned short destinationPort;
+  const char* payload;          //Valid until the next call to next()
+  int length;                   //Bytes of payload captured
+};
+
+//-----------------------------------------------------------------------------
+// Class:       PcapReader
+// Description: Reads the IPv4 UDP datagrams of a capture file in file order.
+//              Both the classic pcap format (microsecond or nanosecond, either
+//              byte order) and pcapng are recognized from the file's first
+//              bytes. Frames may be raw IP, Ethernet (with or without one
+//              VLAN tag), Linux cooked (SLL and SLL2) or BSD loopback; other
+//              link types, other protocols and IP fragments are skipped and
+//              counted.
+//-----------------------------------------------------------------------------
+class PcapReader {
+ public:
+  //---------------------------------------------------------------------------
+  // PcapReader Constructor
+  // Creates a reader with no file open
+  //
+  // @pre:   None
+  // @post:  next() returns false until open() succeeds
+  //---------------------------------------------------------------------------
+  PcapReader();
+
+  //---------------------------------------------------------------------------
+  // PcapReader Destructor
+  // Closes the file if one is open
+  //
+  // @pre:   None
+  // @post:  None
+  //---------------------------------------------------------------------------
+  ~PcapReader();
+
+  //---------------------------------------------------------------------------
+  // open
+  // Opens a pcap or pcapng file and reads its file header
+  //
+  // @pre:   None
+  // @post:  The reader is positioned before the first packet
+  // @param  path:  File to read
+  // @returns bool: False if the file cannot be read or is not a capture
+  //---------------------------------------------------------------------------
+  bool open(const string& path);
+
+  //---------------------------------------------------------------------------
+  // close
+  // Closes the capture file
+  //
+  // @pre:   None
+  // @post:  next() returns false
+  //---------------------------------------------------------------------------
+  void close();
+
+  //---------------------------------------------------------------------------
+  // next
+  // Reads up to the next IPv4 UDP datagram
+  //
+  // @pre:   None
+  // @post:  datagram describes the datagram if true is returned
+  // @param  datagram: Receives the datagram
+  // @returns bool:    False at the end of the file or on a damaged block
+  //---------------------------------------------------------------------------
+  bool next(PcapDatagram& datagram);
+
+  //---------------------------------------------------------------------------
+  // getSkipped
+  // Returns the number of frames that were not IPv4 UDP datagrams
+  //
+  // @pre:   None
+  // @post:  None
+  // @returns long: Frames skipped since open()
+  //---------------------------------------------------------------------------
+  long getSkipped() const;
+
+ private:
+  //Reads a 32-bit value in the byte order of the file
+  unsigned int toHost32(const unsigned char* bytes) const;
+
+  //Reads a 16-bit value in the byte order of the file
+  unsigned short toHost16(const unsigned char* bytes) const;
+
+  //Reads the next frame of a classic pcap file into frame
+  bool nextPcapFrame(long long& timestampUs, int& frameLinkType);
+
+  //Reads pcapng blocks up to the next packet into frame
+  bool nextPcapngFrame(long long& timestampUs, int& frameLinkType);
+
+  //Finds the UDP datagram in frame; false if there is none
+  bool decode(int frameLinkType, PcapDatagram& datagram);
+
+  //An interface of the current pcapng section
+  struct interface {
+    int linkType;
+    unsigned long long ticksPerSecond;   //From if_tsresol, default 10^6
+  };
+
+  FILE* file;
+  bool pcapng;
+  bool swapped;               //File byte order differs from ours
+  bool nanoseconds;           //Classic pcap with nanosecond timestamps
+  int linkType;               //Classic pcap link type
+  vector<interface> interfaces;
+  vector<unsigned char> block; //Current block or record
+  const unsigned char* frame; //Link-layer frame within block
+  int frameLength;
+  long skipped;
+};
+
+#endif /* PCAPREADER_H_ */
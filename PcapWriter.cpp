@@ -0,0 +1,235 @@
+#include "PcapWriter.h"
+#include <string.h>
+
+const unsigned short OPTION_END = 0;
+const unsigned short OPTION_COMMENT = 1;
+const unsigned short OPTION_IF_NAME = 2;
+const unsigned short OPTION_EPB_FLAGS = 2;
+const unsigned int EPB_INBOUND = 1;
+const unsigned int EPB_OUTBOUND = 2;
+
+//-----------------------------------------------------------------------------
+// padded
+// Rounds a length up to the 4-byte alignment of pcapng
+//
+// @pre:   None
+// @post:  None
+// @param  length: A length in bytes
+// @returns int:   length rounded up to a multiple of 4
+//-----------------------------------------------------------------------------
+static int padded(int length) {
+  return (length + 3) & ~3;
+}
+
+//-----------------------------------------------------------------------------
+// putBigEndian16
+// Stores a 16-bit value in network byte order
+//
+// @pre:   buffer holds 2 bytes
+// @post:  buffer holds the value
+// @param  buffer: Where to write
+// @param  value:  The value
+//-----------------------------------------------------------------------------
+static void putBigEndian16(unsigned char* buffer, unsigned int value) {
+  buffer[0] = (value >> 8) & 0xFF;
+  buffer[1] = value & 0xFF;
+}
+
+//-----------------------------------------------------------------------------
+// putBigEndian32
+// Stores a 32-bit value in network byte order
+//
+// @pre:   buffer holds 4 bytes
+// @post:  buffer holds the value
+// @param  buffer: Where to write
+// @param  value:  The value
+//-----------------------------------------------------------------------------
+static void putBigEndian32(unsigned char* buffer, unsigned int value) {
+  putBigEndian16(buffer, value >> 16);
+  putBigEndian16(buffer + 2, value & 0xFFFF);
+}
+
+//-----------------------------------------------------------------------------
+// PcapWriter Constructor
+// Creates a writer with no file open
+//
+// @pre:   None
+// @post:  isOpen() is false
+//-----------------------------------------------------------------------------
+PcapWriter::PcapWriter() {
+  file = NULL;
+}
+
+//-----------------------------------------------------------------------------
+// PcapWriter Destructor
+// Closes the file if one is open
+//
+// @pre:   None
+// @post:  Everything written is flushed
+//-----------------------------------------------------------------------------
+PcapWriter::~PcapWriter() {
+  close();
+}
+
+//-----------------------------------------------------------------------------
+// open
+// Creates a capture file and writes its section and interface headers
+//
+// @pre:   None
+// @post:  The file is truncated and ready for write()
+// @param  path:  File to create
+// @returns bool: False if the file could not be created
+//-----------------------------------------------------------------------------
+bool PcapWriter::open(const string& path) {
+  close();
+  file = fopen(path.c_str(), "wb");
+  if (file == NULL) {
+    return false;
+  }
+  //Section header: no options, unknown section length
+  unsigned int section[7];
+  section[0] = PCAPNG_SECTION_HEADER;
+  section[1] = sizeof(section);
+  section[2] = PCAPNG_BYTE_ORDER_MAGIC;
+  section[3] = 1;           //Major version 1, minor version 0
+  section[4] = 0xFFFFFFFF;  //Section length -1 (64 bits)
+  section[5] = 0xFFFFFFFF;
+  section[6] = sizeof(section);
+  fwrite(section, sizeof(section), 1, file);
+
+  //Interface description: raw IPv4, no snap length, named after the relay
+  const char* name = "udprelay";
+  unsigned int nameLength = strlen(name);
+  unsigned int interfaceLength = 16 + 4 + padded(nameLength) + 4 + 4;
+  unsigned int interfaceHead[4];
+  interfaceHead[0] = PCAPNG_INTERFACE;
+  interfaceHead[1] = interfaceLength;
+  interfaceHead[2] = PCAP_LINKTYPE_RAW;   //Link type, then 16 reserved bits
+  interfaceHead[3] = 0;                   //Snap length: unlimited
+  fwrite(interfaceHead, sizeof(interfaceHead), 1, file);
+  writeOption(OPTION_IF_NAME, name, nameLength);
+  writeOption(OPTION_END, NULL, 0);
+  fwrite(&interfaceLength, 4, 1, file);
+  return ferror(file) == 0;
+}
+
+//-----------------------------------------------------------------------------
+// close
+// Flushes and closes the capture file
+//
+// @pre:   None
+// @post:  isOpen() is false
+//-----------------------------------------------------------------------------
+void PcapWriter::close() {
+  if (file != NULL) {
+    fclose(file);
+    file = NULL;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// isOpen
+// Returns true while a capture file is open
+//
+// @pre:   None
+// @post:  None
+// @returns bool: True between open() and close()
+//-----------------------------------------------------------------------------
+bool PcapWriter::isOpen() const {
+  return file != NULL;
+}
+
+//-----------------------------------------------------------------------------
+// write
+// Appends one packet as a UDP datagram
+//
+// @pre:   isOpen()
+// @post:  The packet is buffered for the file
+// @param  timestampUs: Wall clock time of the packet in us
+// @param  inbound:     True if the relay received the packet
+// @param  comment:     Stored with the packet, e.g. the peer name
+// @param  sourceIp:    IPv4 source address, host byte order
+// @param  groupIp:     IPv4 destination address, host byte order
+// @param  port:        UDP source and destination port
+// @param  payload:     The relay packet
+// @param  length:      Bytes of payload
+// @returns bool:       False if the write failed
+//-----------------------------------------------------------------------------
+bool PcapWriter::write(long long timestampUs, bool inbound,
+    const string& comment, unsigned int sourceIp, unsigned int groupIp,
+    unsigned short port, const char* payload, int length) {
+  if (file == NULL || length < 0) {
+    return false;
+  }
+  unsigned char headers[PCAP_IP_UDP_HEADER];
+  memset(headers, 0, sizeof(headers));
+  int datagramLength = PCAP_IP_UDP_HEADER + length;
+  headers[0] = 0x45;                          //IPv4, 20-byte header
+  putBigEndian16(headers + 2, datagramLength);
+  putBigEndian16(headers + 6, 0x4000);        //Don't fragment
+  headers[8] = 1;                             //TTL 1, as on the group
+  headers[9] = 17;                            //UDP
+  putBigEndian32(headers + 12, sourceIp);
+  putBigEndian32(headers + 16, groupIp);
+  unsigned int checksum = 0;
+  for (int i = 0; i < 20; i += 2) {
+    checksum += (headers[i] << 8) | headers[i + 1];
+  }
+  while (checksum >> 16) {
+    checksum = (checksum & 0xFFFF) + (checksum >> 16);
+  }
+  putBigEndian16(headers + 10, ~checksum & 0xFFFF);
+  putBigEndian16(headers + 20, port);
+  putBigEndian16(headers + 22, port);
+  putBigEndian16(headers + 24, 8 + length);   //UDP checksum 0: not computed
+
+  unsigned short commentLength = comment.length() > 0xFFF0 ?
+      0xFFF0 : comment.length();
+  unsigned int optionsLength = 4 + 4 +
+      (commentLength > 0 ? 4 + padded(commentLength) : 0) + 4;
+  unsigned int blockLength = 28 + padded(datagramLength) + optionsLength + 4;
+  unsigned int block[7];
+  block[0] = PCAPNG_ENHANCED_PACKET;
+  block[1] = blockLength;
+  block[2] = 0;                               //Interface 0
+  block[3] = (unsigned int)((unsigned long long)timestampUs >> 32);
+  block[4] = (unsigned int)(timestampUs & 0xFFFFFFFF);
+  block[5] = datagramLength;                  //Captured length
+  block[6] = datagramLength;                  //Original length
+  fwrite(block, sizeof(block), 1, file);
+  fwrite(headers, sizeof(headers), 1, file);
+  fwrite(payload, length, 1, file);
+  static const char zeros[4] = {0, 0, 0, 0};
+  fwrite(zeros, padded(datagramLength) - datagramLength, 1, file);
+  unsigned int flags = inbound ? EPB_INBOUND : EPB_OUTBOUND;
+  writeOption(OPTION_EPB_FLAGS, &flags, 4);
+  if (commentLength > 0) {
+    writeOption(OPTION_COMMENT, comment.data(), commentLength);
+  }
+  writeOption(OPTION_END, NULL, 0);
+  fwrite(&blockLength, 4, 1, file);
+  return ferror(file) == 0;
+}
+
+//-----------------------------------------------------------------------------
+// writeOption
+// Writes a pcapng option: code, length, value padded to 4 bytes
+//
+// @pre:   file is open
+// @post:  The option is buffered for the file
+// @param  code:   Option code
+// @param  value:  Option value, NULL if length is 0
+// @param  length: Bytes of value
+//-----------------------------------------------------------------------------
+void PcapWriter::writeOption(unsigned short code, const void* value,
+    unsigned short length) {
+  unsigned short head[2];
+  head[0] = code;
+  head[1] = length;
+  fwrite(head, sizeof(head), 1, file);
+  if (length > 0) {
+    static const char zeros[4] = {0, 0, 0, 0};
+    fwrite(value, length, 1, file);
+    fwrite(zeros, padded(length) - length, 1, file);
+  }
+}
@@ -0,0 +1,108 @@
+#ifndef PCAPWRITER_H_
+#define PCAPWRITER_H_
+
+#include <stdio.h>
+#include <string>
+
+using namespace std;
+
+const int PCAP_LINKTYPE_RAW = 101;    //Packets start with an IPv4 header
+const int PCAP_IP_UDP_HEADER = 28;    //IPv4 (20) + UDP (8) header bytes
+
+//pcapng block types and the section byte order magic
+const unsigned int PCAPNG_SECTION_HEADER = 0x0A0D0D0A;
+const unsigned int PCAPNG_INTERFACE = 0x00000001;
+const unsigned int PCAPNG_SIMPLE_PACKET = 0x00000003;
+const unsigned int PCAPNG_ENHANCED_PACKET = 0x00000006;
+const unsigned int PCAPNG_BYTE_ORDER_MAGIC = 0x1A2B3C4D;
+
+//-----------------------------------------------------------------------------
+// Class:       PcapWriter
+// Description: Writes relay packets to a pcapng file that Wireshark and
+//              tcpdump can open. Each packet becomes the UDP datagram it is
+//              (or would be) on a multicast group: a synthesized IPv4/UDP
+//              header followed by the relay packet. Enhanced packet blocks
+//              carry microsecond timestamps, the inbound/outbound flag and
+//              a comment naming the peer the packet came from or went to.
+//
+//              Not thread-safe; one writer thread owns the file.
+//-----------------------------------------------------------------------------
+class PcapWriter {
+ public:
+  //---------------------------------------------------------------------------
+  // PcapWriter Constructor
+  // Creates a writer with no file open
+  //
+  // @pre:   None
+  // @post:  isOpen() is false
+  //---------------------------------------------------------------------------
+  PcapWriter();
+
+  //---------------------------------------------------------------------------
+  // PcapWriter Destructor
+  // Closes the file if one is open
+  //
+  // @pre:   None
+  // @post:  Everything written is flushed
+  //---------------------------------------------------------------------------
+  ~PcapWriter();
+
+  //---------------------------------------------------------------------------
+  // open
+  // Creates a capture file and writes its section and interface headers
+  //
+  // @pre:   None
+  // @post:  The file is truncated and ready for write()
+  // @param  path:  File to create
+  // @returns bool: False if the file could not be created
+  //---------------------------------------------------------------------------
+  bool open(const string& path);
+
+  //---------------------------------------------------------------------------
+  // close
+  // Flushes and closes the capture file
+  //
+  // @pre:   None
+  // @post:  isOpen() is false
+  //---------------------------------------------------------------------------
+  void close();
+
+  //---------------------------------------------------------------------------
+  // isOpen
+  // Returns true while a capture file is open
+  //
+  // @pre:   None
+  // @post:  None
+  // @returns bool: True between open() and close()
+  //---------------------------------------------------------------------------
+  bool isOpen() const;
+
+  //---------------------------------------------------------------------------
+  // write
+  // Appends one packet as a UDP datagram
+  //
+  // @pre:   isOpen()
+  // @post:  The packet is buffered for the file
+  // @param  timestampUs: Wall clock time of the packet in us
+  // @param  inbound:     True if the relay received the packet
+  // @param  comment:     Stored with the packet, e.g. the peer name
+  // @param  sourceIp:    IPv4 source address, host byte order
+  // @param  groupIp:     IPv4 destination address, host byte order
+  // @param  port:        UDP source and destination port
+  // @param  payload:     The relay packet
+  // @param  length:      Bytes of payload
+  // @returns bool:       False if the write failed
+  //---------------------------------------------------------------------------
+  bool write(long long timestampUs, bool inbound, const string& comment,
+      unsigned int sourceIp, unsigned int groupIp, unsigned short port,
+      const char* payload, int length);
+
+ private:
+  //Writes a pcapng option, padded to 4 bytes
+  void writeOption(unsigned short code, const void* value,
+      unsigned short length);
+
+  FILE* file;
+};
+
+#endif /* PCAPWRITER_H_ */
@@ -0,0 +1,276 @@
+#include "Reassembler.h"
+#include <string.h>
+
+//-----------------------------------------------------------------------------
+// Reassembler Constructor
+// Creates an empty reassembler
+//
+// @pre:   maxPacket > 0, memoryLimit > 0, timeoutMs > 0
+// @post:  No packets are pending
+// @param  maxPacket:   Largest packet accepted, in bytes
+// @param  memoryLimit: Bytes of partial packets held per source
+// @param  timeoutMs:   Time a packet has to complete
+//-----------------------------------------------------------------------------
+Reassembler::Reassembler(int maxPacket, int memoryLimit, int timeoutMs) {
+  this->maxPacket = maxPacket;
+  this->memoryLimit = memoryLimit;
+  timeoutUs = timeoutMs * 1000LL;
+  nextExpiryUs = 0;
+  pendingBytes = 0;
+  reassembled = 0;
+  dropped = 0;
+  pthread_mutex_init(&lock, NULL);
+}
+
+//-----------------------------------------------------------------------------
+// Reassembler Destructor
+// Frees the partial packets
+//
+// @pre:   No other thread uses the reassembler
+// @post:  Pending packets are discarded
+//-----------------------------------------------------------------------------
+Reassembler::~Reassembler() {
+  for (map<string, sourceState>::iterator source = sources.begin();
+      source != sources.end(); source++) {
+    for (partialMap::iterator packet = source->second.packets.begin();
+        packet != source->second.packets.end(); packet++) {
+      delete[] packet->second.data;
+    }
+  }
+  pthread_mutex_destroy(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// add
+// Stores one fragment and returns the packet once all of it has arrived.
+// Fragments that repeat one already stored are ignored.
+//
+// @pre:   packet holds maxPacket bytes, 0 <= offset,
+//         offset + dataLength <= length
+// @post:  packet holds the whole packet if a positive value is returned
+// @param  source:     The link or sender the fragment came from
+// @param  packetId:   The packet ID of the fragment
+// @param  length:     Length of the whole packet
+// @param  offset:     Offset of the fragment's data in the packet
+// @param  data:       The fragment's data
+// @param  dataLength: Bytes of data
+// @param  nowUs:      The monotonic clock in us
+// @param  packet:     Receives the packet when it is complete
+// @returns int:       The packet's length when it is complete, 0 while it is
+//                     not, -1 if the fragment was refused
+//-----------------------------------------------------------------------------
+int Reassembler::add(const string& source, unsigned int packetId, int length,
+    int offset, const char* data, int dataLength, long long nowUs,
+    char* packet) {
+  pthread_mutex_lock(&lock);
+  if (nowUs >= nextExpiryUs) {
+    expireLocked(nowUs);
+    nextExpiryUs = nowUs + timeoutUs / 2;
+  }
+  if (length > maxPacket || length > memoryLimit || dataLength <= 0) {
+    dropped++;
+    pthread_mutex_unlock(&lock);
+    return -1;
+  }
+  sourceState& state = sources[source];
+  partialMap::iterator pending = state.packets.find(packetId);
+  if (pending != state.packets.end() && pending->second.length != length) {
+    //The sender restarted its packet IDs; the old packet cannot complete
+    discard(state, pending);
+    dropped++;
+    pending = state.packets.end();
+  }
+  if (pending == state.packets.end()) {
+    while (state.bytes + length > memoryLimit) {
+      discardOldest(state);
+    }
+    partial fresh;
+    fresh.data = new char[length];
+    fresh.length = length;
+    fresh.received = 0;
+    fresh.startUs = nowUs;
+    pending = state.packets.insert(make_pair(packetId, fresh)).first;
+    state.bytes += length;
+    pendingBytes += length;
+  }
+  partial& assembling = pending->second;
+  if (assembling.offsets.insert(offset).second) {
+    memcpy(assembling.data + offset, data, dataLength);
+    assembling.received += dataLength;
+  }
+  int complete = 0;
+  if (assembling.received >= assembling.length) {
+    complete = assembling.length;
+    memcpy(packet, assembling.data, complete);
+    discard(state, pending);
+    reassembled++;
+  }
+  if (state.packets.empty()) {
+    sources.erase(source);
+  }
+  pthread_mutex_unlock(&lock);
+  return complete;
+}
+
+//-----------------------------------------------------------------------------
+// expire
+// Gives up every packet that has been pending longer than the timeout
+//
+// @pre:   None
+// @post:  No pending packet is older than timeoutMs
+// @param  nowUs: The monotonic clock in us
+//-----------------------------------------------------------------------------
+void Reassembler::expire(long long nowUs) {
+  pthread_mutex_lock(&lock);
+  expireLocked(nowUs);
+  pthread_mutex_unlock(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// removeSource
+// Discards the partial packets of a source, e.g. a link that has closed
+//
+// @pre:   None
+// @post:  The source holds no memory
+// @param  source: The link or sender
+//-----------------------------------------------------------------------------
+void Reassembler::removeSource(const string& source) {
+  pthread_mutex_lock(&lock);
+  map<string, sourceState>::iterator state = sources.find(source);
+  if (state != sources.end()) {
+    while (!state->second.packets.empty()) {
+      discard(state->second, state->second.packets.begin());
+      dropped++;
+    }
+    sources.erase(state);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// setLimits
+// Changes the memory limit and timeout for packets started from now on
+//
+// @pre:   memoryLimit > 0, timeoutMs > 0
+// @post:  The limits are in effect
+// @param  memoryLimit: Bytes of partial packets held per source
+// @param  timeoutMs:   Time a packet has to complete
+//-----------------------------------------------------------------------------
+void Reassembler::setLimits(int memoryLimit, int timeoutMs) {
+  pthread_mutex_lock(&lock);
+  this->memoryLimit = memoryLimit;
+  timeoutUs = timeoutMs * 1000LL;
+  nextExpiryUs = 0;
+  pthread_mutex_unlock(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// getPendingBytes
+// Returns the bytes held in partial packets
+//
+// @pre:   None
+// @post:  None
+// @returns int: Sum of the pending packets' lengths
+//-----------------------------------------------------------------------------
+int Reassembler::getPendingBytes() {
+  pthread_mutex_lock(&lock);
+  int bytes = pendingBytes;
+  pthread_mutex_unlock(&lock);
+  return bytes;
+}
+
+//-----------------------------------------------------------------------------
+// getReassembled
+// Returns the number of packets completed
+//
+// @pre:   None
+// @post:  None
+// @returns long: Packets returned by add()
+//-----------------------------------------------------------------------------
+long Reassembler::getReassembled() {
+  pthread_mutex_lock(&lock);
+  long count = reassembled;
+  pthread_mutex_unlock(&lock);
+  return count;
+}
+
+//-----------------------------------------------------------------------------
+// getDropped
+// Returns the number of packets given up
+//
+// @pre:   None
+// @post:  None
+// @returns long: Packets evicted, timed out or refused
+//-----------------------------------------------------------------------------
+long Reassembler::getDropped() {
+  pthread_mutex_lock(&lock);
+  long count = dropped;
+  pthread_mutex_unlock(&lock);
+  return count;
+}
+
+//-----------------------------------------------------------------------------
+// discard
+// Frees a pending packet
+//
+// @pre:   The caller holds lock; packet is in state.packets
+// @post:  The packet's memory is released and no longer counted
+// @param  state:  The packet's source
+// @param  packet: The packet to free
+//-----------------------------------------------------------------------------
+void Reassembler::discard(sourceState& state, partialMap::iterator packet) {
+  state.bytes -= packet->second.length;
+  pendingBytes -= packet->second.length;
+  delete[] packet->second.data;
+  state.packets.erase(packet);
+}
+
+//-----------------------------------------------------------------------------
+// discardOldest
+// Gives up the packet of a source whose first fragment arrived earliest
+//
+// @pre:   The caller holds lock; state holds at least one packet
+// @post:  The packet is freed and counted as dropped
+// @param  state: The source
+//-----------------------------------------------------------------------------
+void Reassembler::discardOldest(sourceState& state) {
+  partialMap::iterator oldest = state.packets.begin();
+  for (partialMap::iterator packet = state.packets.begin();
+      packet != state.packets.end(); packet++) {
+    if (packet->second.startUs < oldest->second.startUs) {
+      oldest = packet;
+    }
+  }
+  discard(state, oldest);
+  dropped++;
+}
+
+//-----------------------------------------------------------------------------
+// expireLocked
+// Gives up every packet that has been pending longer than the timeout
+//
+// @pre:   The caller holds lock
+// @post:  No pending packet is older than the timeout
+// @param  nowUs: The monotonic clock in us
+//-----------------------------------------------------------------------------
+void Reassembler::expireLocked(long long nowUs) {
+  map<string, sourceState>::iterator source = sources.begin();
+  while (source != sources.end()) {
+    partialMap& packets = source->second.packets;
+    partialMap::iterator packet = packets.begin();
+    while (packet != packets.end()) {
+      partialMap::iterator next = packet;
+      next++;
+      if (nowUs - packet->second.startUs > timeoutUs) {
+        discard(source->second, packet);
+        dropped++;
+      }
+      packet = next;
+    }
+    if (packets.empty()) {
+      sources.erase(source++);
+    } else {
+      source++;
+    }
+  }
+}
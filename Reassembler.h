@@ -0,0 +1,158 @@
+#ifndef REASSEMBLER_H_
+#define REASSEMBLER_H_
+
+#include <pthread.h>
+#include <map>
+#include <set>
+#include <string>
+
+using namespace std;
+
+const int DEFAULT_REASSEMBLY_BYTES = 1048576;   //Partial packets held per
+                                                //source
+const int DEFAULT_REASSEMBLY_TIMEOUT_MS = 2000; //Age at which a partial
+                                                //packet is given up
+
+//-----------------------------------------------------------------------------
+// Class:       Reassembler
+// Description: A thread-safe store of partially received packets that puts
+//              fragment frames (see ControlFrame) back together. Packets are
+//              keyed by source, the link or local sender they came from, and
+//              by the fragmenting relay's packet ID.
+//
+//              Each source may hold at most memoryLimit bytes of partial
+//              packets; starting a packet past that gives up the source's
+//              oldest ones first, so a source that loses fragments cannot
+//              take memory from the others. A packet still incomplete after
+//              timeoutMs is given up as well. Packets given up are counted
+//              as dropped.
+//-----------------------------------------------------------------------------
+class Reassembler {
+ public:
+  //---------------------------------------------------------------------------
+  // Reassembler Constructor
+  // Creates an empty reassembler
+  //
+  // @pre:   maxPacket > 0, memoryLimit > 0, timeoutMs > 0
+  // @post:  No packets are pending
+  // @param  maxPacket:   Largest packet accepted, in bytes
+  // @param  memoryLimit: Bytes of partial packets held per source
+  // @param  timeoutMs:   Time a packet has to complete
+  //---------------------------------------------------------------------------
+  Reassembler(int maxPacket, int memoryLimit = DEFAULT_REASSEMBLY_BYTES,
+      int timeoutMs = DEFAULT_REASSEMBLY_TIMEOUT_MS);
+
+  //---------------------------------------------------------------------------
+  // Reassembler Destructor
+  // Frees the partial packets
+  //
+  // @pre:   No other thread uses the reassembler
+  // @post:  Pending packets are discarded
+  //---------------------------------------------------------------------------
+  ~Reassembler();
+
+  //---------------------------------------------------------------------------
+  // add
+  // Stores one fragment and returns the packet once all of it has arrived.
+  // Fragments that repeat one already stored are ignored.
+  //
+  // @pre:   packet holds maxPacket bytes, 0 <= offset,
+  //         offset + dataLength <= length
+  // @post:  packet holds the whole packet if a positive value is returned
+  // @param  source:     The link or sender the fragment came from
+  // @param  packetId:   The packet ID of the fragment
+  // @param  length:     Length of the whole packet
+  // @param  offset:     Offset of the fragment's data in the packet
+  // @param  data:       The fragment's data
+  // @param  dataLength: Bytes of data
+  // @param  nowUs:      The monotonic clock in us
+  // @param  packet:     Receives the packet when it is complete
+  // @returns int:       The packet's length when it is complete, 0 while it
+  //                     is not, -1 if the fragment was refused
+  //---------------------------------------------------------------------------
+  int add(const string& source, unsigned int packetId, int length, int offset,
+      const char* data, int dataLength, long long nowUs, char* packet);
+
+  //---------------------------------------------------------------------------
+  // expire
+  // Gives up every packet that has been pending longer than the timeout
+  //
+  // @pre:   None
+  // @post:  No pending packet is older than timeoutMs
+  // @param  nowUs: The monotonic clock in us
+  //---------------------------------------------------------------------------
+  void expire(long long nowUs);
+
+  //---------------------------------------------------------------------------
+  // removeSource
+  // Discards the partial packets of a source, e.g. a link that has closed
+  //
+  // @pre:   None
+  // @post:  The source holds no memory
+  // @param  source: The link or sender
+  //---------------------------------------------------------------------------
+  void removeSource(const string& source);
+
+  //---------------------------------------------------------------------------
+  // setLimits
+  // Changes the memory limit and timeout for packets started from now on
+  //
+  // @pre:   memoryLimit > 0, timeoutMs > 0
+  // @post:  The limits are in effect
+  // @param  memoryLimit: Bytes of partial packets held per source
+  // @param  timeoutMs:   Time a packet has to complete
+  //---------------------------------------------------------------------------
+  void setLimits(int memoryLimit, int timeoutMs);
+
+  //---------------------------------------------------------------------------
+  // getPendingBytes / getReassembled / getDropped
+  // Return the bytes held in partial packets, the packets completed and the
+  // packets given up
+  //
+  // @pre:   None
+  // @post:  None
+  //---------------------------------------------------------------------------
+  int getPendingBytes();
+  long getReassembled();
+  long getDropped();
+
+ private:
+  //A packet some of whose fragments have arrived
+  struct partial {
+    char* data;
+    int length;
+    int received;           //Bytes stored so far
+    long long startUs;      //When the first fragment arrived
+    set<int> offsets;       //Offsets of the fragments stored
+  };
+
+  typedef map<unsigned int, partial> partialMap;
+
+  //The packets pending from one source
+  struct sourceState {
+    sourceState() : bytes(0) {}
+    partialMap packets;
+    int bytes;              //Sum of the packets' lengths
+  };
+
+  //Frees a pending packet; the caller holds lock
+  void discard(sourceState& state, partialMap::iterator packet);
+
+  //Gives up the oldest packet of a source; the caller holds lock
+  void discardOldest(sourceState& state);
+
+  //Gives up timed out packets; the caller holds lock
+  void expireLocked(long long nowUs);
+
+  map<string, sourceState> sources;
+  int maxPacket;
+  int memoryLimit;
+  long long timeoutUs;
+  long long nextExpiryUs;   //When add() next sweeps for timed out packets
+  int pendingBytes;
+  long reassembled;
+  long dropped;
+  pthread_mutex_t lock;
+};
+
+#endif /* REASSEMBLER_H_ */
@@ -0,0 +1,107 @@
+#include "RedundancyFilter.h"
+#include <string.h>
+
+//-----------------------------------------------------------------------------
+// RedundancyFilter Constructor
+// Creates a filter that has seen no message
+//
+// @pre:   window > 0
+// @post:  None
+// @param  window: Message IDs remembered
+//-----------------------------------------------------------------------------
+RedundancyFilter::RedundancyFilter(int window) {
+  pthread_mutex_init(&lock, NULL);
+  this->window = window;
+}
+
+//-----------------------------------------------------------------------------
+// RedundancyFilter Destructor
+//
+// @pre:   No thread uses the filter any more
+// @post:  None
+//-----------------------------------------------------------------------------
+RedundancyFilter::~RedundancyFilter() {
+  pthread_mutex_destroy(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// arrived
+// Records a copy of a message and tells whether it is the first
+//
+// @pre:   messageId != 0
+// @post:  The path's counts are updated
+// @param  messageId: The ID the copy carries
+// @param  path:      Name of the path it came over
+// @param  arrivalUs: monotonicMicros() when it arrived
+// @returns bool:     True if no copy of the message arrived before
+//-----------------------------------------------------------------------------
+bool RedundancyFilter::arrived(long long messageId, const string& path,
+    long long arrivalUs) {
+  pthread_mutex_lock(&lock);
+  map<string, RedundantPathStats>::iterator counts = paths.find(path);
+  if (counts == paths.end()) {
+    counts = paths.insert(make_pair(path, RedundantPathStats())).first;
+    memset(&counts->second, 0, sizeof(counts->second));
+  }
+  map<long long, winner>::iterator first = seen.find(messageId);
+  if (first != seen.end()) {
+    counts->second.duplicates++;
+    if (arrivalUs > first->second.arrivalUs) {
+      counts->second.lagUs += arrivalUs - first->second.arrivalUs;
+    }
+    pthread_mutex_unlock(&lock);
+    return false;
+  }
+  winner copy;
+  copy.path = path;
+  copy.arrivalUs = arrivalUs;
+  seen[messageId] = copy;
+  order.push_back(messageId);
+  while ((int)order.size() > window) {
+    seen.erase(order.front());
+    order.pop_front();
+  }
+  counts->second.wins++;
+  pthread_mutex_unlock(&lock);
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// retract
+// Undoes arrived() for a first copy the caller could not deliver, so the
+// next copy of the message is delivered instead
+//
+// @pre:   arrived(messageId, path, ...) returned true
+// @post:  The message is forgotten and the path's win uncounted
+// @param  messageId: The ID the copy carries
+// @param  path:      Name of the path it came over
+//-----------------------------------------------------------------------------
+void RedundancyFilter::retract(long long messageId, const string& path) {
+  pthread_mutex_lock(&lock);
+  //Its entry in order stays; at worst a later copy is forgotten early
+  seen.erase(messageId);
+  map<string, RedundantPathStats>::iterator counts = paths.find(path);
+  if (counts != paths.end() && counts->second.wins > 0) {
+    counts->second.wins--;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// getPaths
+// Copies every path's counts
+//
+// @pre:   None
+// @post:  paths holds one entry per path a copy came over
+// @param  paths: Receives the counts by path name
+//-----------------------------------------------------------------------------
+void RedundancyFilter::getPaths(
+    vector<pair<string, RedundantPathStats> >& paths) {
+  paths.clear();
+  pthread_mutex_lock(&lock);
+  for (map<string, RedundantPathStats>::iterator entry = this->paths.begin();
+      entry != this->paths.end(); entry++) {
+    paths.push_back(make_pair(entry->first, entry->second));
+  }
+  pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,107 @@
+#ifndef REDUNDANCYFILTER_H_
+#define REDUNDANCYFILTER_H_
+
+#include <pthread.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+const int DEFAULT_REDUNDANCY_WINDOW = 65536; //Message IDs remembered; a copy
+                                             //later than this many messages
+                                             //is delivered again
+
+//What the copies that came in over one path did, see RedundancyFilter
+struct RedundantPathStats {
+  long long wins;         //Copies that arrived first and were delivered
+  long long duplicates;   //Copies suppressed because another path won
+  long long lagUs;        //Total time the duplicates arrived after the winner
+};
+
+//-----------------------------------------------------------------------------
+// Class:       RedundancyFilter
+// Description: First-arrival suppression for packets a sender relays over
+//              several independent paths at once. Each copy carries the same
+//              message ID, unique per sender; the first copy of an ID is
+//              delivered and every later copy is dropped.
+//
+//              The filter remembers the last window IDs in arrival order and
+//              forgets the oldest once more arrive, so memory stays bounded
+//              however long the relay runs; a copy delayed by more than a
+//              window of messages is taken for a new one. Per path, it counts
+//              how often that path's copy won, how often it lost and by how
+//              much, which shows whether a path is worth its bandwidth.
+//              Thread safe: every link's receive thread calls arrived().
+//-----------------------------------------------------------------------------
+class RedundancyFilter {
+ public:
+  //---------------------------------------------------------------------------
+  // RedundancyFilter Constructor
+  // Creates a filter that has seen no message
+  //
+  // @pre:   window > 0
+  // @post:  None
+  // @param  window: Message IDs remembered
+  //---------------------------------------------------------------------------
+  RedundancyFilter(int window = DEFAULT_REDUNDANCY_WINDOW);
+
+  //---------------------------------------------------------------------------
+  // RedundancyFilter Destructor
+  //
+  // @pre:   No thread uses the filter any more
+  // @post:  None
+  //---------------------------------------------------------------------------
+  ~RedundancyFilter();
+
+  //---------------------------------------------------------------------------
+  // arrived
+  // Records a copy of a message and tells whether it is the first
+  //
+  // @pre:   messageId != 0
+  // @post:  The path's counts are updated
+  // @param  messageId: The ID the copy carries
+  // @param  path:      Name of the path it came over
+  // @param  arrivalUs: monotonicMicros() when it arrived
+  // @returns bool:     True if no copy of the message arrived before
+  //---------------------------------------------------------------------------
+  bool arrived(long long messageId, const string& path, long long arrivalUs);
+
+  //---------------------------------------------------------------------------
+  // retract
+  // Undoes arrived() for a first copy the caller could not deliver, so the
+  // next copy of the message is delivered instead
+  //
+  // @pre:   arrived(messageId, path, ...) returned true
+  // @post:  The message is forgotten and the path's win uncounted
+  // @param  messageId: The ID the copy carries
+  // @param  path:      Name of the path it came over
+  //---------------------------------------------------------------------------
+  void retract(long long messageId, const string& path);
+
+  //---------------------------------------------------------------------------
+  // getPaths
+  // Copies every path's counts
+  //
+  // @pre:   None
+  // @post:  paths holds one entry per path a copy came over
+  // @param  paths: Receives the counts by path name
+  //---------------------------------------------------------------------------
+  void getPaths(vector<pair<string, RedundantPathStats> >& paths);
+
+ private:
+  //The first copy of a remembered message
+  struct winner {
+    string path;
+    long long arrivalUs;
+  };
+
+  pthread_mutex_t lock;       //Guards everything below
+  int window;
+  map<long long, winner> seen; //First copy by message ID
+  deque<long long> order;     //IDs in seen, oldest first
+  map<string, RedundantPathStats> paths;
+};
+
+#endif /* REDUNDANCYFILTER_H_ */
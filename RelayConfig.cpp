@@ -0,0 +1,202 @@
+#include "RelayConfig.h"
+#include <stdlib.h>
+#include <fstream>
+#include <sstream>
+
+//-----------------------------------------------------------------------------
+// RelayConfig Constructor
+// Creates an empty configuration
+//
+// @pre:   None
+// @post:  No peers or commands, quorum 0
+//-----------------------------------------------------------------------------
+RelayConfig::RelayConfig() {
+  quorum = 0;
+  connectTimeoutMs = DEFAULT_CONNECT_TIMEOUT_MS;
+}
+
+//-----------------------------------------------------------------------------
+// load
+// Replaces the configuration with the one in a file
+//
+// @pre:   None
+// @post:  The configuration holds the file's directives if true is returned;
+//         otherwise getError() describes the first bad line
+// @param  path:  The file to read
+// @returns bool: False if the file cannot be read or has a bad line
+//-----------------------------------------------------------------------------
+bool RelayConfig::load(const string& path) {
+  ifstream file(path.c_str());
+  if (!file) {
+    error = "cannot read " + path;
+    return false;
+  }
+  vector<string> newPeers;
+  vector<string> newCommands;
+  int newTimeoutMs = DEFAULT_CONNECT_TIMEOUT_MS;
+  string quorumSpec = "";
+  string line = "";
+  int lineNumber = 0;
+  while (getline(file, line)) {
+    lineNumber++;
+    stringstream where;
+    where << path << ":" << lineNumber << ": ";
+    size_t comment = line.find('#');
+    if (comment != string::npos) {
+      line.erase(comment);
+    }
+    stringstream lineStream(line);
+    string keyword = "";
+    if (!(lineStream >> keyword)) {
+      continue;
+    }
+    string value = "";
+    lineStream >> value;
+    if (keyword == "peer" || keyword == "add") {
+      string host = value.substr(0, value.find(':'));
+      if (host.empty()) {
+        error = where.str() + "peer needs a host";
+        return false;
+      }
+      bool repeated = false;
+      for (size_t i = 0; i < newPeers.size(); i++) {
+        repeated = repeated || newPeers[i] == host;
+      }
+      if (!repeated) {
+        newPeers.push_back(host);
+      }
+    } else if (keyword == "quorum") {
+      if (value.empty() || atoi(value.c_str()) < 0) {
+        error = where.str() + "quorum needs a count or a percentage";
+        return false;
+      }
+      quorumSpec = value;
+    } else if (keyword == "connecttimeout") {
+      newTimeoutMs = atoi(value.c_str());
+      if (newTimeoutMs <= 0) {
+        error = where.str() + "connecttimeout needs a time in ms";
+        return false;
+      }
+    } else if (keyword == "quit" || keyword == "delete" ||
+        keyword == "config" || keyword == "reload" || keyword == "upgrade") {
+      error = where.str() + keyword + " cannot be used in a config file";
+      return false;
+    } else {
+      //Console commands are kept whole and checked when they are run
+      size_t start = line.find_first_not_of(" \t");
+      size_t end = line.find_last_not_of(" \t\r");
+      newCommands.push_back(line.substr(start, end - start + 1));
+    }
+  }
+  int newQuorum = newPeers.size();
+  if (!quorumSpec.empty()) {
+    newQuorum = atoi(quorumSpec.c_str());
+    if (quorumSpec[quorumSpec.size() - 1] == '%') {
+      //Round up, so "quorum 50%" of 3 peers needs 2
+      newQuorum = (newQuorum * (int)newPeers.size() + 99) / 100;
+    }
+    if (newQuorum > (int)newPeers.size()) {
+      stringstream message;
+      message << path << ": quorum " << quorumSpec << " exceeds the "
+          << newPeers.size() << " peers";
+      error = message.str();
+      return false;
+    }
+  }
+  peers = newPeers;
+  commands = newCommands;
+  quorum = newQuorum;
+  connectTimeoutMs = newTimeoutMs;
+  error = "";
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// getPeers
+// Returns the peers in file order without repeats
+//
+// @pre:   None
+// @post:  None
+// @returns vector<string>: Peer host names or IPs
+//-----------------------------------------------------------------------------
+const vector<string>& RelayConfig::getPeers() const {
+  return peers;
+}
+
+//-----------------------------------------------------------------------------
+// getQuorum
+// Returns the number of peers that must be connected for the relay to be
+// ready
+//
+// @pre:   None
+// @post:  None
+// @returns int: 0 to getPeers().size()
+//-----------------------------------------------------------------------------
+int RelayConfig::getQuorum() const {
+  return quorum;
+}
+
+//-----------------------------------------------------------------------------
+// getConnectTimeoutMs
+// Returns the time each peer has to accept the connection
+//
+// @pre:   None
+// @post:  None
+// @returns int: Timeout in ms
+//-----------------------------------------------------------------------------
+int RelayConfig::getConnectTimeoutMs() const {
+  return connectTimeoutMs;
+}
+
+//-----------------------------------------------------------------------------
+// getCommands
+// Returns the console commands in file order
+//
+// @pre:   None
+// @post:  None
+// @returns vector<string>: Commands without comments or surrounding blanks
+//-----------------------------------------------------------------------------
+const vector<string>& RelayConfig::getCommands() const {
+  return commands;
+}
+
+//-----------------------------------------------------------------------------
+// getError
+// Returns the reason the last load failed
+//
+// @pre:   None
+// @post:  None
+// @returns string: "file:line: reason", or "" after a successful load
+//-----------------------------------------------------------------------------
+const string& RelayConfig::getError() const {
+  return error;
+}
+
+//-----------------------------------------------------------------------------
+// getKey
+// Returns the setting a console command changes, so two configs can be
+// compared: the command name, plus the group, ring, UDP link or thread role
+// for the commands that set one of many ("priority 239.0.0.1 bulk" gives
+// "priority 239.0.0.1")
+//
+// @pre:   None
+// @post:  None
+// @param  command: A console command line
+// @returns string: The setting the command changes
+//-----------------------------------------------------------------------------
+string RelayConfig::getKey(const string& command) {
+  stringstream commandStream(command);
+  string name = "";
+  string subject = "";
+  commandStream >> name >> subject;
+  if ((name == "shm" || name == "udplink") &&
+      (subject == "add" || subject == "delete")) {
+    commandStream >> subject;
+    return name + " " + subject;
+  }
+  if (name == "priority" || name == "pin" || name == "tunnel" ||
+      name == "redundant" || name == "conflate") {
+    return name + " " + subject;
+  }
+  return name;
+}
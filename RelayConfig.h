@@ -0,0 +1,88 @@
+#ifndef RELAYCONFIG_H_
+#define RELAYCONFIG_H_
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+const int DEFAULT_CONNECT_TIMEOUT_MS = 3000; //Time a configured peer has to
+                                             //accept the connection
+
+//-----------------------------------------------------------------------------
+// Class:       RelayConfig
+// Description: A relay configuration read from a text file, one directive
+//              per line. Blank lines and text after a # are ignored.
+//
+//              peer host[:port]     A remote group to connect to; the port
+//                                   is ignored as it is for "add"
+//              quorum N | quorum P% Peers that must be connected before the
+//                                   relay reports ready (default: all)
+//              connecttimeout ms    Time each peer has to accept
+//
+//              Any other line is a console command (see
+//              UdpRelay::displayHelpMenu), e.g. "priority 239.0.0.1 bulk" for
+//              a group or "heartbeat 500 3" for tuning, and is run in file
+//              order before the peers are connected.
+//-----------------------------------------------------------------------------
+class RelayConfig {
+ public:
+  //---------------------------------------------------------------------------
+  // RelayConfig Constructor
+  // Creates an empty configuration
+  //
+  // @pre:   None
+  // @post:  No peers or commands, quorum 0
+  //---------------------------------------------------------------------------
+  RelayConfig();
+
+  //---------------------------------------------------------------------------
+  // load
+  // Replaces the configuration with the one in a file
+  //
+  // @pre:   None
+  // @post:  The configuration holds the file's directives if true is
+  //         returned; otherwise getError() describes the first bad line
+  // @param  path:  The file to read
+  // @returns bool: False if the file cannot be read or has a bad line
+  //---------------------------------------------------------------------------
+  bool load(const string& path);
+
+  //---------------------------------------------------------------------------
+  // getPeers / getQuorum / getConnectTimeoutMs / getCommands / getError
+  // Return the peers in file order without repeats, the number of them that
+  // must be connected, the connect timeout, the console commands in file
+  // order and the reason the last load failed
+  //
+  // @pre:   None
+  // @post:  None
+  //---------------------------------------------------------------------------
+  const vector<string>& getPeers() const;
+  int getQuorum() const;
+  int getConnectTimeoutMs() const;
+  const vector<string>& getCommands() const;
+  const string& getError() const;
+
+  //---------------------------------------------------------------------------
+  // getKey
+  // Returns the setting a console command changes, so two configs can be
+  // compared: the command name, plus the group, ring, UDP link or thread
+  // role for the commands that set one of many ("priority 239.0.0.1 bulk"
+  // gives "priority 239.0.0.1")
+  //
+  // @pre:   None
+  // @post:  None
+  // @param  command: A console command line
+  // @returns string: The setting the command changes
+  //---------------------------------------------------------------------------
+  static string getKey(const string& command);
+
+ private:
+  vector<string> peers;
+  int quorum;
+  int connectTimeoutMs;
+  vector<string> commands;
+  string error;
+};
+
+#endif /* RELAYCONFIG_H_ */
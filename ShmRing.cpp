@@ -0,0 +1,406 @@
+#include "ShmRing.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+const int CACHE_LINE = 64;    //Slots are padded to whole cache lines
+
+//Slot sequence numbers. A queue slot for position p holds p while it is free
+//for that position's producer and p + 1 once the packet is written; release()
+//sets it to p + slotCount for the producer one lap later. A broadcast slot
+//holds 0 while being written and p + 1 once the packet at p is complete.
+
+//-----------------------------------------------------------------------------
+// create
+// Creates (or replaces) a ring in shared memory
+//
+// @pre:   name is a valid shm_open name without the leading '/'
+// @post:  /dev/shm/<name> holds an empty ring
+// @param  name:      Name of the shared memory object
+// @param  slotCount: Number of slots, rounded up to a power of 2
+// @param  slotSize:  Bytes of data per slot
+// @param  broadcast: True for a broadcast ring, false for a queue
+// @returns ShmRing*: The ring, owned by the caller, or NULL on failure
+//-----------------------------------------------------------------------------
+ShmRing* ShmRing::create(const string& name, int slotCount, int slotSize,
+    bool broadcast) {
+  int count = 0;
+  size_t bytes = 0;
+  if (!layout(slotCount, slotSize, count, bytes)) {
+    return NULL;
+  }
+
+  string path = "/" + name;
+  shm_unlink(path.c_str());
+  int fd = shm_open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0660);
+  if (fd < 0) {
+    return NULL;
+  }
+  if (ftruncate(fd, bytes) < 0) {
+    close(fd);
+    shm_unlink(path.c_str());
+    return NULL;
+  }
+  void* memory = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    shm_unlink(path.c_str());
+    return NULL;
+  }
+  return format(name, memory, bytes, count, slotSize, broadcast, true);
+}
+
+//-----------------------------------------------------------------------------
+// createLocal
+// Creates a queue ring in private memory, for threads of one process
+//
+// @pre:   None
+// @post:  None
+// @param  slotCount: Number of slots, rounded up to a power of 2
+// @param  slotSize:  Bytes of data per slot
+// @returns ShmRing*: The ring, owned by the caller, or NULL on failure
+//-----------------------------------------------------------------------------
+ShmRing* ShmRing::createLocal(int slotCount, int slotSize) {
+  int count = 0;
+  size_t bytes = 0;
+  if (!layout(slotCount, slotSize, count, bytes)) {
+    return NULL;
+  }
+  void* memory = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    return NULL;
+  }
+  return format("", memory, bytes, count, slotSize, false, false);
+}
+
+//-----------------------------------------------------------------------------
+// attach
+// Maps a ring created by another process
+//
+// @pre:   None
+// @post:  None
+// @param  name:      Name the ring was created with
+// @returns ShmRing*: The ring, owned by the caller, or NULL if it does not
+//                    exist or is not a valid ring
+//-----------------------------------------------------------------------------
+ShmRing* ShmRing::attach(const string& name) {
+  string path = "/" + name;
+  int fd = shm_open(path.c_str(), O_RDWR, 0);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat info;
+  if (fstat(fd, &info) < 0 || (size_t)info.st_size < sizeof(ShmRingHeader)) {
+    close(fd);
+    return NULL;
+  }
+  size_t bytes = info.st_size;
+  void* memory = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    return NULL;
+  }
+  ShmRingHeader* header = (ShmRingHeader*)memory;
+  __sync_synchronize();
+  if (header->magic != SHM_RING_MAGIC || header->slotCount <= 0 ||
+      (header->slotCount & (header->slotCount - 1)) != 0 ||
+      header->slotSize <= 0) {
+    munmap(memory, bytes);
+    return NULL;
+  }
+  ShmRing* ring = new ShmRing(name, memory, bytes, false);
+  if (sizeof(ShmRingHeader) + (size_t)header->slotCount * ring->stride >
+      bytes) {
+    delete ring;
+    return NULL;
+  }
+  return ring;
+}
+
+//-----------------------------------------------------------------------------
+// ShmRing Constructor
+// Wraps a mapped ring
+//
+// @pre:   memory maps mappedBytes bytes starting with a ShmRingHeader whose
+//         slotSize is set
+// @post:  The object refers to the mapping
+// @param  name:        shm_open name of the ring
+// @param  memory:      Start of the mapping
+// @param  mappedBytes: Length of the mapping
+// @param  owner:       True if this process created the ring
+//-----------------------------------------------------------------------------
+ShmRing::ShmRing(const string& name, void* memory, size_t mappedBytes,
+    bool owner) {
+  this->name = name;
+  this->memory = memory;
+  this->mappedBytes = mappedBytes;
+  this->owner = owner;
+  header = (ShmRingHeader*)memory;
+  slots = (char*)memory + sizeof(ShmRingHeader);
+  stride = (sizeof(ShmSlotHeader) + header->slotSize + CACHE_LINE - 1) /
+      CACHE_LINE * CACHE_LINE;
+}
+
+//-----------------------------------------------------------------------------
+// ShmRing Destructor
+// Unmaps the ring, and removes its name if this object created it
+//
+// @pre:   None
+// @post:  The ring memory is no longer mapped in this process
+//-----------------------------------------------------------------------------
+ShmRing::~ShmRing() {
+  munmap(memory, mappedBytes);
+  if (owner) {
+    shm_unlink(("/" + name).c_str());
+  }
+}
+
+//-----------------------------------------------------------------------------
+// push
+// Copies a packet into the next free slot
+//
+// @pre:   Only one thread in all processes pushes to a broadcast ring
+// @post:  The packet is visible to consumers if true is returned
+// @param  data:   The packet bytes
+// @param  length: Number of bytes, at most getSlotSize()
+// @returns bool:  False if the packet is too long or the queue is full
+//-----------------------------------------------------------------------------
+bool ShmRing::push(const char* data, int length) {
+  if (length <= 0 || length > header->slotSize) {
+    return false;
+  }
+  unsigned int position = header->head;
+  ShmSlotHeader* slot = NULL;
+  if (header->broadcast) {
+    slot = slotAt(position);
+    slot->sequence = 0;
+    __sync_synchronize();
+  } else {
+    while (true) {
+      slot = slotAt(position);
+      int lag = (int)(slot->sequence - position);
+      if (lag == 0) {
+        if (__sync_bool_compare_and_swap(&header->head, position,
+            position + 1)) {
+          break;
+        }
+        position = header->head;
+      } else if (lag < 0) {
+        return false;   //The consumer has not released this slot yet
+      } else {
+        position = header->head;
+      }
+    }
+  }
+  slot->length = length;
+  memcpy((char*)slot + sizeof(ShmSlotHeader), data, length);
+  __sync_synchronize();
+  slot->sequence = position + 1;
+  if (header->broadcast) {
+    __sync_synchronize();
+    header->head = position + 1;
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// peek
+// Returns the oldest unread slot of a queue without copying it
+//
+// @pre:   Called only by the queue's single consumer
+// @post:  The slot stays owned by the consumer until release()
+// @param  length: Receives the number of bytes the producer wrote
+// @returns char*: The slot data (getSlotSize() bytes, writable), or NULL if
+//                 the queue is empty
+//-----------------------------------------------------------------------------
+char* ShmRing::peek(int& length) {
+  unsigned int position = header->tail;
+  ShmSlotHeader* slot = slotAt(position);
+  if (slot->sequence != position + 1) {
+    return NULL;
+  }
+  __sync_synchronize();
+  length = slot->length;
+  if (length < 0 || length > header->slotSize) {
+    length = header->slotSize;
+  }
+  return (char*)slot + sizeof(ShmSlotHeader);
+}
+
+//-----------------------------------------------------------------------------
+// release
+// Hands the slot returned by peek() back to the producers
+//
+// @pre:   peek() returned a slot that has not been released
+// @post:  The slot may be overwritten
+//-----------------------------------------------------------------------------
+void ShmRing::release() {
+  unsigned int position = header->tail;
+  __sync_synchronize();
+  slotAt(position)->sequence = position + header->slotCount;
+  header->tail = position + 1;
+}
+
+//-----------------------------------------------------------------------------
+// read
+// Copies the packet at a consumer's read position out of a broadcast ring
+//
+// @pre:   buffer holds capacity bytes
+// @post:  position advances past the packet read or the packets lost
+// @param  buffer:   Receives the packet
+// @param  capacity: Size of buffer
+// @param  position: The consumer's read position, initially getHead()
+// @returns int:     Packet length, 0 if nothing is new, or -1 if packets
+//                   were overwritten before they could be read
+//-----------------------------------------------------------------------------
+int ShmRing::read(char* buffer, int capacity, unsigned int& position) {
+  unsigned int head = header->head;
+  __sync_synchronize();
+  int behind = (int)(head - position);
+  if (behind == 0) {
+    return 0;
+  }
+  //The slot the producer writes next still holds head - slotCount, so the
+  //oldest packet that is safe to read is one newer than that
+  unsigned int oldestSafe = head - header->slotCount + 1;
+  if (behind < 0 || behind >= header->slotCount) {
+    position = oldestSafe;
+    return -1;
+  }
+  ShmSlotHeader* slot = slotAt(position);
+  unsigned int sequence = slot->sequence;
+  __sync_synchronize();
+  int length = slot->length;
+  if (length > capacity) {
+    length = capacity;
+  }
+  if (length > header->slotSize) {
+    length = header->slotSize;
+  }
+  if (sequence == position + 1 && length > 0) {
+    memcpy(buffer, (char*)slot + sizeof(ShmSlotHeader), length);
+  }
+  __sync_synchronize();
+  if (sequence != position + 1 || slot->sequence != sequence ||
+      length <= 0) {
+    position = header->head - header->slotCount + 1;
+    return -1;
+  }
+  position++;
+  return length;
+}
+
+//-----------------------------------------------------------------------------
+// getHead
+// Returns the position the next pushed packet will take
+//
+// @pre:   None
+// @post:  None
+// @returns unsigned int: The producer position
+//-----------------------------------------------------------------------------
+unsigned int ShmRing::getHead() const {
+  return header->head;
+}
+
+//-----------------------------------------------------------------------------
+// size
+// Returns the number of packets a queue holds (0 for broadcast rings)
+//
+// @pre:   None
+// @post:  None
+// @returns int: Packets pushed but not yet released
+//-----------------------------------------------------------------------------
+int ShmRing::size() const {
+  if (header->broadcast) {
+    return 0;
+  }
+  return (int)(header->head - header->tail);
+}
+
+//-----------------------------------------------------------------------------
+// getSlotSize
+// Returns the number of data bytes per slot
+//
+// @pre:   None
+// @post:  None
+// @returns int: Bytes per slot
+//-----------------------------------------------------------------------------
+int ShmRing::getSlotSize() const {
+  return header->slotSize;
+}
+
+//-----------------------------------------------------------------------------
+// layout
+// Computes the slot count and mapping size of a ring
+//
+// @pre:   None
+// @post:  count and bytes are set if true is returned
+// @param  slotCount: Requested number of slots
+// @param  slotSize:  Bytes of data per slot
+// @param  count:     Receives slotCount rounded up to a power of 2
+// @param  bytes:     Receives the size of the mapping
+// @returns bool:     False if either argument is not positive
+//-----------------------------------------------------------------------------
+bool ShmRing::layout(int slotCount, int slotSize, int& count, size_t& bytes) {
+  if (slotCount <= 0 || slotSize <= 0) {
+    return false;
+  }
+  count = 1;
+  while (count < slotCount) {
+    count <<= 1;
+  }
+  int stride = (sizeof(ShmSlotHeader) + slotSize + CACHE_LINE - 1) /
+      CACHE_LINE * CACHE_LINE;
+  bytes = sizeof(ShmRingHeader) + (size_t)count * stride;
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// format
+// Initializes an empty ring in freshly mapped memory
+//
+// @pre:   memory maps bytes bytes as computed by layout()
+// @post:  The ring is valid; magic is written last
+// @param  name:      shm_open name, or "" for a private ring
+// @param  memory:    Start of the mapping
+// @param  bytes:     Length of the mapping
+// @param  count:     Number of slots, a power of 2
+// @param  slotSize:  Bytes of data per slot
+// @param  broadcast: True for a broadcast ring, false for a queue
+// @param  owner:     True if the destructor should unlink the name
+// @returns ShmRing*: The ring, owned by the caller
+//-----------------------------------------------------------------------------
+ShmRing* ShmRing::format(const string& name, void* memory, size_t bytes,
+    int count, int slotSize, bool broadcast, bool owner) {
+  ShmRingHeader* header = (ShmRingHeader*)memory;
+  header->slotCount = count;
+  header->slotSize = slotSize;
+  header->broadcast = broadcast ? 1 : 0;
+  header->head = 0;
+  header->tail = 0;
+  ShmRing* ring = new ShmRing(name, memory, bytes, owner);
+  for (int i = 0; i < count; i++) {
+    ring->slotAt(i)->sequence = broadcast ? 0 : i;
+    ring->slotAt(i)->length = 0;
+  }
+  __sync_synchronize();
+  header->magic = SHM_RING_MAGIC;
+  return ring;
+}
+
+//-----------------------------------------------------------------------------
+// slotAt
+// Returns the slot for a position
+//
+// @pre:   None
+// @post:  None
+// @param  position:        Any ring position
+// @returns ShmSlotHeader*: The slot that position maps to
+//-----------------------------------------------------------------------------
+ShmSlotHeader* ShmRing::slotAt(unsigned int position) const {
+  return (ShmSlotHeader*)(slots +
+      (size_t)(position & (header->slotCount - 1)) * stride);
+}
@@ -0,0 +1,201 @@
+#ifndef SHMRING_H_
+#define SHMRING_H_
+
+#include <sys/types.h>
+#include <string>
+
+using namespace std;
+
+const unsigned int SHM_RING_MAGIC = 0x52524732; //"RRG2", marks a valid ring
+const int DEFAULT_SHM_SLOTS = 1024;   //Slots per ring unless told otherwise
+
+//Layout at the start of the shared memory, followed by the slots
+struct ShmRingHeader {
+  unsigned int magic;         //SHM_RING_MAGIC once the ring is initialized
+  int slotCount;              //Power of 2
+  int slotSize;               //Bytes of data per slot
+  int broadcast;              //1 for a broadcast ring, 0 for a queue
+  volatile unsigned int head; //Next position producers write
+  char padding[44];           //Keeps head and tail on separate cache lines
+  volatile unsigned int tail; //Next position the consumer reads (queue only)
+  char tailPadding[60];       //Starts the slots on a cache line
+};
+
+//Start of every slot, followed by slotSize bytes of data
+struct ShmSlotHeader {
+  volatile unsigned int sequence; //Position + 1 once written, see ShmRing.cpp
+  int length;                     //Bytes of data written
+};
+
+//-----------------------------------------------------------------------------
+// Class:       ShmRing
+// Description: A ring of fixed-size packet slots in POSIX shared memory
+//              (/dev/shm/<name>) that lets processes on the same host hand
+//              packets to the relay without going through the kernel. A ring
+//              works in one of two modes:
+//
+//              Queue:     Any number of producers push, a single consumer
+//                         reads each slot in place (peek/release) and hands
+//                         it back. Push fails while the ring is full.
+//              Broadcast: A single producer pushes and never waits; any
+//                         number of consumers each copy every packet out
+//                         with their own read position. A consumer that
+//                         falls more than a ring behind skips ahead and is
+//                         told that it lost packets.
+//
+//              Every slot carries a sequence number so readers can tell a
+//              finished slot from one still being written. Producers and
+//              consumers spin; there is no cross-process wakeup. A queue can
+//              also live in private memory (createLocal) as a lock-free
+//              hand-off between threads of the relay itself.
+//-----------------------------------------------------------------------------
+class ShmRing {
+ public:
+  //---------------------------------------------------------------------------
+  // create
+  // Creates (or replaces) a ring in shared memory
+  //
+  // @pre:   name is a valid shm_open name without the leading '/'
+  // @post:  /dev/shm/<name> holds an empty ring
+  // @param  name:      Name of the shared memory object
+  // @param  slotCount: Number of slots, rounded up to a power of 2
+  // @param  slotSize:  Bytes of data per slot
+  // @param  broadcast: True for a broadcast ring, false for a queue
+  // @returns ShmRing*: The ring, owned by the caller, or NULL on failure
+  //---------------------------------------------------------------------------
+  static ShmRing* create(const string& name, int slotCount, int slotSize,
+      bool broadcast);
+
+  //---------------------------------------------------------------------------
+  // attach
+  // Maps a ring created by another process
+  //
+  // @pre:   None
+  // @post:  None
+  // @param  name:      Name the ring was created with
+  // @returns ShmRing*: The ring, owned by the caller, or NULL if it does not
+  //                    exist or is not a valid ring
+  //---------------------------------------------------------------------------
+  static ShmRing* attach(const string& name);
+
+  //---------------------------------------------------------------------------
+  // createLocal
+  // Creates a queue ring in private memory, for threads of one process
+  //
+  // @pre:   None
+  // @post:  None
+  // @param  slotCount: Number of slots, rounded up to a power of 2
+  // @param  slotSize:  Bytes of data per slot
+  // @returns ShmRing*: The ring, owned by the caller, or NULL on failure
+  //---------------------------------------------------------------------------
+  static ShmRing* createLocal(int slotCount, int slotSize);
+
+  //---------------------------------------------------------------------------
+  // ShmRing Destructor
+  // Unmaps the ring, and removes its name if this object created it
+  //
+  // @pre:   None
+  // @post:  The ring memory is no longer mapped in this process
+  //---------------------------------------------------------------------------
+  ~ShmRing();
+
+  //---------------------------------------------------------------------------
+  // push
+  // Copies a packet into the next free slot
+  //
+  // @pre:   Only one thread in all processes pushes to a broadcast ring
+  // @post:  The packet is visible to consumers if true is returned
+  // @param  data:   The packet bytes
+  // @param  length: Number of bytes, at most getSlotSize()
+  // @returns bool:  False if the packet is too long or the queue is full
+  //---------------------------------------------------------------------------
+  bool push(const char* data, int length);
+
+  //---------------------------------------------------------------------------
+  // peek
+  // Returns the oldest unread slot of a queue without copying it
+  //
+  // @pre:   Called only by the queue's single consumer
+  // @post:  The slot stays owned by the consumer until release()
+  // @param  length: Receives the number of bytes the producer wrote
+  // @returns char*: The slot data (getSlotSize() bytes, writable), or NULL if
+  //                 the queue is empty
+  //---------------------------------------------------------------------------
+  char* peek(int& length);
+
+  //---------------------------------------------------------------------------
+  // release
+  // Hands the slot returned by peek() back to the producers
+  //
+  // @pre:   peek() returned a slot that has not been released
+  // @post:  The slot may be overwritten
+  //---------------------------------------------------------------------------
+  void release();
+
+  //---------------------------------------------------------------------------
+  // read
+  // Copies the packet at a consumer's read position out of a broadcast ring
+  //
+  // @pre:   buffer holds capacity bytes
+  // @post:  position advances past the packet read or the packets lost
+  // @param  buffer:   Receives the packet
+  // @param  capacity: Size of buffer
+  // @param  position: The consumer's read position, initially getHead()
+  // @returns int:     Packet length, 0 if nothing is new, or -1 if packets
+  //                   were overwritten before they could be read
+  //---------------------------------------------------------------------------
+  int read(char* buffer, int capacity, unsigned int& position);
+
+  //---------------------------------------------------------------------------
+  // getHead
+  // Returns the position the next pushed packet will take
+  //
+  // @pre:   None
+  // @post:  None
+  // @returns unsigned int: The producer position
+  //---------------------------------------------------------------------------
+  unsigned int getHead() const;
+
+  //---------------------------------------------------------------------------
+  // size
+  // Returns the number of packets a queue holds (0 for broadcast rings)
+  //
+  // @pre:   None
+  // @post:  None
+  // @returns int: Packets pushed but not yet released
+  //---------------------------------------------------------------------------
+  int size() const;
+
+  //---------------------------------------------------------------------------
+  // getSlotSize
+  // Returns the number of data bytes per slot
+  //
+  // @pre:   None
+  // @post:  None
+  // @returns int: Bytes per slot
+  //---------------------------------------------------------------------------
+  int getSlotSize() const;
+
+ private:
+  ShmRing(const string& name, void* memory, size_t mappedBytes, bool owner);
+
+  //Computes the power-of-2 slot count and mapping size of a ring
+  static bool layout(int slotCount, int slotSize, int& count, size_t& bytes);
+
+  //Initializes an empty ring in freshly mapped memory
+  static ShmRing* format(const string& name, void* memory, size_t bytes,
+      int count, int slotSize, bool broadcast, bool owner);
+
+  //Returns the slot for a position
+  ShmSlotHeader* slotAt(unsigned int position) const;
+
+  string name;              //shm_open name
+  void* memory;             //Start of the mapping
+  size_t mappedBytes;       //Length of the mapping
+  bool owner;               //Created (and unlinks) the ring
+  ShmRingHeader* header;
+  char* slots;              //First slot, right after the header
+  int stride;               //Bytes from one slot to the next
+};
+
+#endif /* SHMRING_H_ */
@@ -0,0 +1,191 @@
+#include "SocketTimestamps.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+
+const int CONTROL_BUFFER_SIZE = 512;  //Room for timestamp ancillary data
+
+//-----------------------------------------------------------------------------
+// enable
+// Requests receive (and optionally transmit) timestamps on a socket
+//
+// @pre:   sd is an open socket
+// @post:  Later recvWithTimestamp / readTxTimestamps calls report times.
+//         Enabling transmit timestamps restarts the byte key at 0.
+// @param  sd:       The socket to configure
+// @param  transmit: True to also timestamp sends
+// @param  hardware: True to also request NIC timestamps
+// @returns bool:    False if the kernel refused the request
+//-----------------------------------------------------------------------------
+bool SocketTimestamps::enable(int sd, bool transmit, bool hardware) {
+  int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+  if (transmit) {
+    flags |= SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_OPT_ID |
+        SOF_TIMESTAMPING_OPT_TSONLY;
+  }
+  if (hardware) {
+    flags |= SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+    if (transmit) {
+      flags |= SOF_TIMESTAMPING_TX_HARDWARE;
+    }
+  }
+  return setsockopt(sd, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+      sizeof(flags)) == 0;
+}
+
+//-----------------------------------------------------------------------------
+// disable
+// Turns all timestamping off on a socket
+//
+// @pre:   sd is an open socket
+// @post:  No further timestamps are generated
+// @param  sd: The socket to configure
+//-----------------------------------------------------------------------------
+void SocketTimestamps::disable(int sd) {
+  int flags = 0;
+  setsockopt(sd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+}
+
+//-----------------------------------------------------------------------------
+// enableHardware
+// Asks a network interface to timestamp all packets in hardware
+// (SIOCSHWTSTAMP). Needs CAP_NET_ADMIN and a NIC that supports it.
+//
+// @pre:   None
+// @post:  The interface timestamps RX and TX packets on success
+// @param  interface: Interface name, e.g. eth0
+// @returns bool:     False if the ioctl failed
+//-----------------------------------------------------------------------------
+bool SocketTimestamps::enableHardware(const string& interface) {
+  int sd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sd < 0) {
+    return false;
+  }
+  struct hwtstamp_config config;
+  memset(&config, 0, sizeof(config));
+  config.tx_type = HWTSTAMP_TX_ON;
+  config.rx_filter = HWTSTAMP_FILTER_ALL;
+  struct ifreq request;
+  memset(&request, 0, sizeof(request));
+  strncpy(request.ifr_name, interface.c_str(), IFNAMSIZ - 1);
+  request.ifr_data = (char*)&config;
+  bool result = ioctl(sd, SIOCSHWTSTAMP, &request) == 0;
+  close(sd);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+// pickTimestamp
+// Returns the hardware timestamp of an SCM_TIMESTAMPING message if set,
+// otherwise the software one, in microseconds
+//
+// @pre:   stamps points at the payload of an SCM_TIMESTAMPING cmsg
+// @post:  None
+// @param  stamps:     The three timespecs (software, legacy, hardware)
+// @returns long long: Microseconds, 0 if neither is set
+//-----------------------------------------------------------------------------
+static long long pickTimestamp(const struct timespec* stamps) {
+  const struct timespec& chosen =
+      (stamps[2].tv_sec != 0 || stamps[2].tv_nsec != 0) ? stamps[2] : stamps[0];
+  return chosen.tv_sec * 1000000LL + chosen.tv_nsec / 1000;
+}
+
+//-----------------------------------------------------------------------------
+// recvWithTimestamp
+// recv() that also returns the receive timestamp of the data, if any
+//
+// @pre:   buffer holds length bytes
+// @post:  kernelUs is the hardware timestamp if present, else the software
+//         timestamp, else 0
+// @param  sd:       The socket to read
+// @param  buffer:   Receives the data
+// @param  length:   Maximum number of bytes to read
+// @param  flags:    recv() flags
+// @param  kernelUs: Receives the timestamp in microseconds
+// @returns int:     The recv() result
+//-----------------------------------------------------------------------------
+int SocketTimestamps::recvWithTimestamp(int sd, char* buffer, int length,
+    int flags, long long& kernelUs) {
+  char control[CONTROL_BUFFER_SIZE];
+  struct iovec data;
+  data.iov_base = buffer;
+  data.iov_len = length;
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &data;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+
+  kernelUs = 0;
+  int received = recvmsg(sd, &message, flags);
+  if (received <= 0) {
+    return received;
+  }
+  for (struct cmsghdr* header = CMSG_FIRSTHDR(&message); header != NULL;
+      header = CMSG_NXTHDR(&message, header)) {
+    if (header->cmsg_level == SOL_SOCKET &&
+        header->cmsg_type == SCM_TIMESTAMPING) {
+      kernelUs = pickTimestamp((const struct timespec*)CMSG_DATA(header));
+    }
+  }
+  return received;
+}
+
+//-----------------------------------------------------------------------------
+// readTxTimestamps
+// Drains the socket error queue without blocking and appends every transmit
+// timestamp found to out
+//
+// @pre:   Transmit timestamps were enabled on sd
+// @post:  The error queue is empty
+// @param  sd:   The socket to drain
+// @param  out:  Receives (byte key, timestamp) pairs
+// @returns int: Number of timestamps appended
+//-----------------------------------------------------------------------------
+int SocketTimestamps::readTxTimestamps(int sd, vector<TxTimestamp>& out) {
+  int found = 0;
+  while (true) {
+    char control[CONTROL_BUFFER_SIZE];
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    if (recvmsg(sd, &message, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+      break;
+    }
+    long long stamp = 0;
+    bool haveKey = false;
+    unsigned int key = 0;
+    for (struct cmsghdr* header = CMSG_FIRSTHDR(&message); header != NULL;
+        header = CMSG_NXTHDR(&message, header)) {
+      if (header->cmsg_level == SOL_SOCKET &&
+          header->cmsg_type == SCM_TIMESTAMPING) {
+        stamp = pickTimestamp((const struct timespec*)CMSG_DATA(header));
+      } else if ((header->cmsg_level == SOL_IP &&
+          header->cmsg_type == IP_RECVERR) ||
+          (header->cmsg_level == SOL_IPV6 &&
+          header->cmsg_type == IPV6_RECVERR)) {
+        const struct sock_extended_err* error =
+            (const struct sock_extended_err*)CMSG_DATA(header);
+        if (error->ee_errno == ENOMSG &&
+            error->ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+          key = error->ee_data;
+          haveKey = true;
+        }
+      }
+    }
+    if (haveKey && stamp != 0) {
+      out.push_back(TxTimestamp(key, stamp));
+      found++;
+    }
+  }
+  return found;
+}
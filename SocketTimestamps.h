@@ -0,0 +1,100 @@
+#ifndef SOCKETTIMESTAMPS_H_
+#define SOCKETTIMESTAMPS_H_
+
+#include <string>
+#include <vector>
+#include <utility>
+
+using namespace std;
+
+//A transmit timestamp read back from a socket's error queue
+typedef pair<unsigned int, long long> TxTimestamp;  //(byte key, us)
+
+//-----------------------------------------------------------------------------
+// Class:       SocketTimestamps
+// Description: Static helpers around the kernel's SO_TIMESTAMPING interface.
+//              Receive timestamps arrive as ancillary data on recvmsg() and
+//              mark when the kernel (software) or the NIC (hardware) saw the
+//              packet. Transmit timestamps are queued on the socket's error
+//              queue once the packet is handed to the driver, tagged with the
+//              byte offset of the last byte of the send() call.
+//
+//              All timestamps are returned in microseconds on the realtime
+//              clock. Hardware timestamps come from the NIC's clock and are
+//              only comparable with the host clock when the two are kept in
+//              sync (e.g. by phc2sys); software timestamps are used whenever
+//              no hardware timestamp is present.
+//-----------------------------------------------------------------------------
+class SocketTimestamps {
+ public:
+  //---------------------------------------------------------------------------
+  // enable
+  // Requests receive (and optionally transmit) timestamps on a socket
+  //
+  // @pre:   sd is an open socket
+  // @post:  Later recvWithTimestamp / readTxTimestamps calls report times.
+  //         Enabling transmit timestamps restarts the byte key at 0.
+  // @param  sd:       The socket to configure
+  // @param  transmit: True to also timestamp sends
+  // @param  hardware: True to also request NIC timestamps
+  // @returns bool:    False if the kernel refused the request
+  //---------------------------------------------------------------------------
+  static bool enable(int sd, bool transmit, bool hardware);
+
+  //---------------------------------------------------------------------------
+  // disable
+  // Turns all timestamping off on a socket
+  //
+  // @pre:   sd is an open socket
+  // @post:  No further timestamps are generated
+  // @param  sd: The socket to configure
+  //---------------------------------------------------------------------------
+  static void disable(int sd);
+
+  //---------------------------------------------------------------------------
+  // enableHardware
+  // Asks a network interface to timestamp all packets in hardware
+  // (SIOCSHWTSTAMP). Needs CAP_NET_ADMIN and a NIC that supports it.
+  //
+  // @pre:   None
+  // @post:  The interface timestamps RX and TX packets on success
+  // @param  interface: Interface name, e.g. eth0
+  // @returns bool:     False if the ioctl failed
+  //---------------------------------------------------------------------------
+  static bool enableHardware(const string& interface);
+
+  //---------------------------------------------------------------------------
+  // recvWithTimestamp
+  // recv() that also returns the receive timestamp of the data, if any
+  //
+  // @pre:   buffer holds length bytes
+  // @post:  kernelUs is the hardware timestamp if present, else the software
+  //         timestamp, else 0
+  // @param  sd:       The socket to read
+  // @param  buffer:   Receives the data
+  // @param  length:   Maximum number of bytes to read
+  // @param  flags:    recv() flags
+  // @param  kernelUs: Receives the timestamp in microseconds
+  // @returns int:     The recv() result
+  //---------------------------------------------------------------------------
+  static int recvWithTimestamp(int sd, char* buffer, int length, int flags,
+      long long& kernelUs);
+
+  //---------------------------------------------------------------------------
+  // readTxTimestamps
+  // Drains the socket error queue without blocking and appends every
+  // transmit timestamp found to out
+  //
+  // @pre:   Transmit timestamps were enabled on sd
+  // @post:  The error queue is empty
+  // @param  sd:   The socket to drain
+  // @param  out:  Receives (byte key, timestamp) pairs
+  // @returns int: Number of timestamps appended
+  //---------------------------------------------------------------------------
+  static int readTxTimestamps(int sd, vector<TxTimestamp>& out);
+
+ private:
+  SocketTimestamps() {}
+};
+
+#endif /* SOCKETTIMESTAMPS_H_ */
@@ -0,0 +1,219 @@
+#include "SpscRing.h"
+#include <string.h>
+
+//-----------------------------------------------------------------------------
+// SpscRing Constructor
+// Creates an empty ring
+//
+// @pre:   bytes > 0
+// @post:  The ring is empty and open
+// @param  bytes: Buffer size, rounded up to a power of 2
+//-----------------------------------------------------------------------------
+SpscRing::SpscRing(int bytes) {
+  unsigned int size = 4 * sizeof(record);
+  while (size < (unsigned int)bytes) {
+    size <<= 1;
+  }
+  buffer = new char[size];
+  mask = size - 1;
+  closed = false;
+  head = 0;
+  tailSeen = 0;
+  pushed = 0;
+  highWater = 0;
+  stalls = 0;
+  tail = 0;
+  headSeen = 0;
+  popped = 0;
+}
+
+//-----------------------------------------------------------------------------
+// SpscRing Destructor
+// Frees the buffer and any packet still in it
+//
+// @pre:   Neither thread uses the ring any more
+// @post:  None
+//-----------------------------------------------------------------------------
+SpscRing::~SpscRing() {
+  delete[] buffer;
+}
+
+//-----------------------------------------------------------------------------
+// push
+// Copies a packet into the ring
+//
+// @pre:   Called only by the producer
+// @post:  The packet is visible to the consumer if true is returned,
+//         otherwise the full push is counted
+// @param  data:   The packet bytes
+// @param  length: Number of bytes, at most getMaxPacket()
+// @param  stamp:  A value returned with the packet, e.g. its arrival time
+// @returns bool:  False if the ring has no room for the packet now
+//-----------------------------------------------------------------------------
+bool SpscRing::push(const char* data, int length, long long stamp) {
+  if (length <= 0 || length > getMaxPacket()) {
+    return false;
+  }
+  unsigned int size = (sizeof(record) + length + 15) & ~15u;
+  unsigned int offset = head & mask;
+  //Records never wrap: one that would is written at the start instead
+  unsigned int skip = mask + 1 - offset < size ? mask + 1 - offset : 0;
+  if (head + skip + size - tailSeen > mask + 1) {
+    tailSeen = tail;    //Only read the consumer's line when it looks full
+    __sync_synchronize();
+    if (head + skip + size - tailSeen > mask + 1) {
+      stalls = stalls + 1;
+      return false;
+    }
+  }
+  if (skip > 0) {
+    ((record*)(buffer + offset))->length = -1;
+    offset = 0;
+  }
+  record* entry = (record*)(buffer + offset);
+  entry->length = length;
+  entry->stamp = stamp;
+  memcpy(buffer + offset + sizeof(record), data, length);
+  __sync_synchronize();
+  head = head + skip + size;
+  pushed = pushed + 1;
+  if ((pushed & (SPSC_SAMPLE_PUSHES - 1)) == 0) {
+    tailSeen = tail;
+    int used = head - tailSeen;
+    if (used > highWater) {
+      highWater = used;
+    }
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// pop
+// Copies the oldest packet out of the ring
+//
+// @pre:   Called only by the consumer; packet holds capacity bytes
+// @post:  The packet's room is handed back to the producer
+// @param  packet:   Receives the packet, cut to capacity bytes
+// @param  capacity: Size of packet
+// @param  stamp:    Receives the value pushed with the packet
+// @returns int:     Packet length, 0 if the ring is empty
+//-----------------------------------------------------------------------------
+int SpscRing::pop(char* packet, int capacity, long long& stamp) {
+  if (tail == headSeen) {
+    headSeen = head;    //Only read the producer's line when it looks empty
+    __sync_synchronize();
+    if (tail == headSeen) {
+      return 0;
+    }
+  }
+  record* entry = (record*)(buffer + (tail & mask));
+  if (entry->length < 0) {
+    tail = tail + (mask + 1 - (tail & mask));
+    entry = (record*)buffer;
+  }
+  int length = entry->length;
+  stamp = entry->stamp;
+  memcpy(packet, (char*)entry + sizeof(record),
+      length < capacity ? length : capacity);
+  __sync_synchronize();
+  tail = tail + ((sizeof(record) + length + 15) & ~15u);
+  popped = popped + 1;
+  return length < capacity ? length : capacity;
+}
+
+//-----------------------------------------------------------------------------
+// close
+// Marks that the producer is done; the consumer still pops what is left
+//
+// @pre:   Called by the producer after its last push
+// @post:  isClosed() is true
+//-----------------------------------------------------------------------------
+void SpscRing::close() {
+  __sync_synchronize();
+  closed = true;
+}
+
+//-----------------------------------------------------------------------------
+// isClosed
+// Returns whether the producer is done
+//
+// @pre:   None
+// @post:  None
+// @returns bool: True once close() was called
+//-----------------------------------------------------------------------------
+bool SpscRing::isClosed() const {
+  return closed;
+}
+
+//-----------------------------------------------------------------------------
+// getUsed
+// Returns the bytes the ring holds, including record headers and skips
+//
+// @pre:   None
+// @post:  None
+// @returns int: Bytes between tail and head
+//-----------------------------------------------------------------------------
+int SpscRing::getUsed() const {
+  return head - tail;
+}
+
+//-----------------------------------------------------------------------------
+// getPackets
+// Returns the number of packets the ring holds
+//
+// @pre:   None
+// @post:  None
+// @returns int: Packets pushed and not yet popped
+//-----------------------------------------------------------------------------
+int SpscRing::getPackets() const {
+  return pushed - popped;
+}
+
+//-----------------------------------------------------------------------------
+// getCapacity
+// Returns the size of the buffer
+//
+// @pre:   None
+// @post:  None
+// @returns int: Bytes, a power of 2
+//-----------------------------------------------------------------------------
+int SpscRing::getCapacity() const {
+  return mask + 1;
+}
+
+//-----------------------------------------------------------------------------
+// getMaxPacket
+// Returns the longest packet push() accepts
+//
+// @pre:   None
+// @post:  None
+// @returns int: Half the buffer less a record header, so a packet fits in an
+//               empty ring even after a skip
+//-----------------------------------------------------------------------------
+int SpscRing::getMaxPacket() const {
+  return (mask + 1) / 2 - sizeof(record);
+}
+
+//-----------------------------------------------------------------------------
+// getHighWater
+// Returns the most bytes the ring has held at once
+//
+// @pre:   None
+// @post:  None
+// @returns int: Bytes, sampled by the producer every SPSC_SAMPLE_PUSHES pushes
+//-----------------------------------------------------------------------------
+int SpscRing::getHighWater() const {
+  return highWater;
+}
+
+//-----------------------------------------------------------------------------
+// getStalls
+// Returns the number of pushes that found the ring full
+//
+// @pre:   None
+// @post:  None
+// @returns long long: Full pushes, each one a wait or a drop upstream
+//-----------------------------------------------------------------------------
+long long SpscRing::getStalls() const {
+  return stalls;
+}
@@ -0,0 +1,126 @@
+#ifndef SPSCRING_H_
+#define SPSCRING_H_
+
+const int DEFAULT_STAGE_RING_BYTES = 1 << 20; //Bytes between two relay stages
+const int SPSC_CACHE_LINE = 64;               //Bytes the indexes are kept apart
+const int SPSC_SAMPLE_PUSHES = 64;  //Pushes between two reads of the tail for
+                                    //the high-water mark; a power of 2
+
+//-----------------------------------------------------------------------------
+// Class:       SpscRing
+// Description: A bounded, lock-free byte ring that hands variable-length
+//              packets from exactly one producer thread to exactly one
+//              consumer thread. Each packet is copied in as a record (a
+//              small header and the bytes, rounded up to 16) and copied out
+//              in the same order; a record that would cross the end of the
+//              buffer is moved to its start instead.
+//
+//              The producer only writes head and the consumer only writes
+//              tail, each on its own cache line with the fields its own side
+//              uses, so neither side's stores invalidate the other's line
+//              more than once per packet. A full ring makes push() return
+//              false instead of blocking or dropping: the producer decides
+//              how to wait, which is how a slow stage pushes back on the
+//              ones before it. Occupancy, the high-water mark and the number
+//              of full pushes can be read from any thread.
+//-----------------------------------------------------------------------------
+class SpscRing {
+ public:
+  //---------------------------------------------------------------------------
+  // SpscRing Constructor
+  // Creates an empty ring
+  //
+  // @pre:   bytes > 0
+  // @post:  The ring is empty and open
+  // @param  bytes: Buffer size, rounded up to a power of 2
+  //---------------------------------------------------------------------------
+  SpscRing(int bytes = DEFAULT_STAGE_RING_BYTES);
+
+  //---------------------------------------------------------------------------
+  // SpscRing Destructor
+  // Frees the buffer and any packet still in it
+  //
+  // @pre:   Neither thread uses the ring any more
+  // @post:  None
+  //---------------------------------------------------------------------------
+  ~SpscRing();
+
+  //---------------------------------------------------------------------------
+  // push
+  // Copies a packet into the ring
+  //
+  // @pre:   Called only by the producer
+  // @post:  The packet is visible to the consumer if true is returned,
+  //         otherwise the full push is counted
+  // @param  data:   The packet bytes
+  // @param  length: Number of bytes, at most getMaxPacket()
+  // @param  stamp:  A value returned with the packet, e.g. its arrival time
+  // @returns bool:  False if the ring has no room for the packet now
+  //---------------------------------------------------------------------------
+  bool push(const char* data, int length, long long stamp);
+
+  //---------------------------------------------------------------------------
+  // pop
+  // Copies the oldest packet out of the ring
+  //
+  // @pre:   Called only by the consumer; packet holds capacity bytes
+  // @post:  The packet's room is handed back to the producer
+  // @param  packet:   Receives the packet, cut to capacity bytes
+  // @param  capacity: Size of packet
+  // @param  stamp:    Receives the value pushed with the packet
+  // @returns int:     Packet length, 0 if the ring is empty
+  //---------------------------------------------------------------------------
+  int pop(char* packet, int capacity, long long& stamp);
+
+  //---------------------------------------------------------------------------
+  // close / isClosed
+  // Mark that the producer is done, or tell whether it is; the consumer
+  // still pops what is left
+  //
+  // @pre:   close: called by the producer after its last push
+  // @post:  None
+  //---------------------------------------------------------------------------
+  void close();
+  bool isClosed() const;
+
+  //---------------------------------------------------------------------------
+  // Occupancy
+  // getUsed: bytes held, getPackets: packets held, getCapacity: buffer size,
+  // getMaxPacket: longest packet that fits, getHighWater: most bytes held at
+  // once (sampled), getStalls: pushes that found the ring full. Safe from any
+  // thread.
+  //---------------------------------------------------------------------------
+  int getUsed() const;
+  int getPackets() const;
+  int getCapacity() const;
+  int getMaxPacket() const;
+  int getHighWater() const;
+  long long getStalls() const;
+
+ private:
+  //Start of every record, followed by the packet bytes
+  struct record {
+    int length;                 //-1 = skip to the start of the buffer
+    int padding;
+    long long stamp;
+  };
+
+  char* buffer;
+  unsigned int mask;            //Buffer size - 1
+  volatile bool closed;
+  char padding0[SPSC_CACHE_LINE];
+  //Producer's line
+  volatile unsigned int head;   //Bytes ever pushed, including skips
+  unsigned int tailSeen;        //Last tail the producer read
+  volatile unsigned int pushed; //Packets ever pushed
+  volatile int highWater;
+  volatile long long stalls;
+  char padding1[SPSC_CACHE_LINE];
+  //Consumer's line
+  volatile unsigned int tail;   //Bytes ever popped, including skips
+  unsigned int headSeen;        //Last head the consumer read
+  volatile unsigned int popped; //Packets ever popped
+  char padding2[SPSC_CACHE_LINE];
+};
+
+#endif /* SPSCRING_H_ */
@@ -0,0 +1,218 @@
+#include "StoreForward.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+//-----------------------------------------------------------------------------
+// StoreForward Constructor
+// Creates an empty backlog
+//
+// @pre:   packetSize > 0, memoryLimit > 0
+// @post:  The backlog is empty; no file has been created yet
+// @param  packetSize:  Bytes per packet
+// @param  memoryLimit: Packets held in memory
+// @param  spillPath:   File to spill to, or "" to drop instead
+// @param  spillLimit:  Packets held in the spill file
+//-----------------------------------------------------------------------------
+StoreForward::StoreForward(int packetSize, int memoryLimit,
+    const string& spillPath, int spillLimit) {
+  this->packetSize = packetSize;
+  this->memoryLimit = memoryLimit;
+  this->spillPath = spillPath;
+  this->spillLimit = spillLimit;
+  spillFd = -1;
+  readOffset = 0;
+  writeOffset = 0;
+  held = 0;
+  dropped = 0;
+  pthread_mutex_init(&lock, NULL);
+}
+
+//-----------------------------------------------------------------------------
+// StoreForward Destructor
+// Frees the buffered packets and removes the spill file
+//
+// @pre:   No other thread uses the backlog
+// @post:  Buffered packets are discarded
+//-----------------------------------------------------------------------------
+StoreForward::~StoreForward() {
+  while (!memory.empty()) {
+    delete[] memory.front();
+    memory.pop_front();
+  }
+  if (spillFd >= 0) {
+    close(spillFd);
+    unlink(spillPath.c_str());
+  }
+  pthread_mutex_destroy(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// push
+// Appends a packet to the backlog
+//
+// @pre:   packet holds packetSize bytes
+// @post:  The packet is buffered, or counted as dropped if the backlog is full
+// @param  packet: The packet to copy
+// @returns bool:  True if the packet was buffered
+//-----------------------------------------------------------------------------
+bool StoreForward::push(const char* packet) {
+  pthread_mutex_lock(&lock);
+  bool buffered = false;
+  //Once anything is on disk, newer packets must follow it there
+  if ((int)memory.size() < memoryLimit && readOffset == writeOffset) {
+    char* copy = new char[packetSize];
+    memcpy(copy, packet, packetSize);
+    memory.push_back(copy);
+    buffered = true;
+  } else {
+    buffered = spill(packet);
+  }
+  if (buffered) {
+    held++;
+  } else {
+    dropped++;
+  }
+  pthread_mutex_unlock(&lock);
+  return buffered;
+}
+
+//-----------------------------------------------------------------------------
+// pop
+// Removes the oldest buffered packet
+//
+// @pre:   packet holds packetSize bytes
+// @post:  packet holds the oldest packet if true is returned
+// @param  packet: Receives the packet
+// @returns bool:  False if the backlog is empty
+//-----------------------------------------------------------------------------
+bool StoreForward::pop(char* packet) {
+  pthread_mutex_lock(&lock);
+  if (memory.empty()) {
+    refill();
+  }
+  if (memory.empty()) {
+    pthread_mutex_unlock(&lock);
+    return false;
+  }
+  memcpy(packet, memory.front(), packetSize);
+  delete[] memory.front();
+  memory.pop_front();
+  held--;
+  pthread_mutex_unlock(&lock);
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// size
+// Returns the number of packets buffered in memory and on disk
+//
+// @pre:   None
+// @post:  None
+// @returns int: Packets buffered
+//-----------------------------------------------------------------------------
+int StoreForward::size() {
+  return held;
+}
+
+//-----------------------------------------------------------------------------
+// getSpilled
+// Returns the number of packets currently held in the spill file
+//
+// @pre:   None
+// @post:  None
+// @returns int: Packets on disk
+//-----------------------------------------------------------------------------
+int StoreForward::getSpilled() {
+  pthread_mutex_lock(&lock);
+  int count = (int)((writeOffset - readOffset) / packetSize);
+  pthread_mutex_unlock(&lock);
+  return count;
+}
+
+//-----------------------------------------------------------------------------
+// getDropped
+// Returns how many packets were refused because the backlog was full
+//
+// @pre:   None
+// @post:  None
+// @returns long: Packets dropped since construction
+//-----------------------------------------------------------------------------
+long StoreForward::getDropped() {
+  pthread_mutex_lock(&lock);
+  long count = dropped;
+  pthread_mutex_unlock(&lock);
+  return count;
+}
+
+//-----------------------------------------------------------------------------
+// setMemoryLimit
+// Changes how many packets are held in memory. Packets already held past a
+// lower limit stay until they are popped; new ones spill or are dropped
+//
+// @pre:   memoryLimit > 0
+// @post:  Subsequent pushes and refills use the new limit
+// @param  memoryLimit: Packets held in memory
+//-----------------------------------------------------------------------------
+void StoreForward::setMemoryLimit(int memoryLimit) {
+  pthread_mutex_lock(&lock);
+  this->memoryLimit = memoryLimit;
+  pthread_mutex_unlock(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// spill
+// Appends a packet to the spill file, creating it on first use
+//
+// @pre:   lock is held
+// @post:  The packet is on disk if true is returned
+// @param  packet: The packet to write
+// @returns bool:  False if spilling is off, the file is full or a write failed
+//-----------------------------------------------------------------------------
+bool StoreForward::spill(const char* packet) {
+  if (spillPath.empty() ||
+      (writeOffset - readOffset) / packetSize >= spillLimit) {
+    return false;
+  }
+  if (spillFd < 0) {
+    spillFd = open(spillPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (spillFd < 0) {
+      return false;
+    }
+  }
+  if (pwrite(spillFd, packet, packetSize, writeOffset) != packetSize) {
+    return false;
+  }
+  writeOffset += packetSize;
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// refill
+// Reads spilled packets back into memory, oldest first, and truncates the
+// file once it has been read completely
+//
+// @pre:   lock is held, memory is empty
+// @post:  memory holds up to memoryLimit packets from the file
+//-----------------------------------------------------------------------------
+void StoreForward::refill() {
+  while (readOffset < writeOffset && (int)memory.size() < memoryLimit) {
+    char* copy = new char[packetSize];
+    if (pread(spillFd, copy, packetSize, readOffset) != packetSize) {
+      delete[] copy;
+      //Unreadable remainder; count it as lost and start over
+      dropped += (writeOffset - readOffset) / packetSize;
+      held -= (int)((writeOffset - readOffset) / packetSize);
+      readOffset = writeOffset;
+      break;
+    }
+    memory.push_back(copy);
+    readOffset += packetSize;
+  }
+  if (spillFd >= 0 && readOffset == writeOffset) {
+    if (ftruncate(spillFd, 0) == 0) {
+      readOffset = 0;
+      writeOffset = 0;
+    }
+  }
+}
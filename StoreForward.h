@@ -0,0 +1,135 @@
+#ifndef STOREFORWARD_H_
+#define STOREFORWARD_H_
+
+#include <pthread.h>
+#include <deque>
+#include <string>
+
+using namespace std;
+
+const int DEFAULT_BACKLOG_PACKETS = 4096;   //Packets held in memory per peer
+const int DEFAULT_SPILL_PACKETS = 1048576;  //Packets held in a spill file
+
+//-----------------------------------------------------------------------------
+// Class:       StoreForward
+// Description: A bounded, thread-safe FIFO of fixed-size packets that holds
+//              traffic for a peer while its link is down. Packets are kept in
+//              memory up to a limit; past that they are appended to an
+//              optional spill file and read back in order once the memory
+//              part has drained. Packets that fit in neither are dropped and
+//              counted, so the oldest buffered traffic is what survives.
+//
+//              The spill file is created on first use, truncated whenever it
+//              has been read back completely and removed by the destructor.
+//-----------------------------------------------------------------------------
+class StoreForward {
+ public:
+  //---------------------------------------------------------------------------
+  // StoreForward Constructor
+  // Creates an empty backlog
+  //
+  // @pre:   packetSize > 0, memoryLimit > 0
+  // @post:  The backlog is empty; no file has been created yet
+  // @param  packetSize:  Bytes per packet
+  // @param  memoryLimit: Packets held in memory
+  // @param  spillPath:   File to spill to, or "" to drop instead
+  // @param  spillLimit:  Packets held in the spill file
+  //---------------------------------------------------------------------------
+  StoreForward(int packetSize, int memoryLimit, const string& spillPath,
+      int spillLimit = DEFAULT_SPILL_PACKETS);
+
+  //---------------------------------------------------------------------------
+  // StoreForward Destructor
+  // Frees the buffered packets and removes the spill file
+  //
+  // @pre:   No other thread uses the backlog
+  // @post:  Buffered packets are discarded
+  //---------------------------------------------------------------------------
+  ~StoreForward();
+
+  //---------------------------------------------------------------------------
+  // push
+  // Appends a packet to the backlog
+  //
+  // @pre:   packet holds packetSize bytes
+  // @post:  The packet is buffered, or counted as dropped if the backlog is
+  //         full
+  // @param  packet: The packet to copy
+  // @returns bool:  True if the packet was buffered
+  //---------------------------------------------------------------------------
+  bool push(const char* packet);
+
+  //---------------------------------------------------------------------------
+  // pop
+  // Removes the oldest buffered packet
+  //
+  // @pre:   packet holds packetSize bytes
+  // @post:  packet holds the oldest packet if true is returned
+  // @param  packet: Receives the packet
+  // @returns bool:  False if the backlog is empty
+  //---------------------------------------------------------------------------
+  bool pop(char* packet);
+
+  //---------------------------------------------------------------------------
+  // size
+  // Returns the number of packets buffered in memory and on disk
+  //
+  // @pre:   None
+  // @post:  None
+  // @returns int: Packets buffered
+  //---------------------------------------------------------------------------
+  int size();
+
+  //---------------------------------------------------------------------------
+  // getSpilled
+  // Returns the number of packets currently held in the spill file
+  //
+  // @pre:   None
+  // @post:  None
+  // @returns int: Packets on disk
+  //---------------------------------------------------------------------------
+  int getSpilled();
+
+  //---------------------------------------------------------------------------
+  // getDropped
+  // Returns how many packets were refused because the backlog was full
+  //
+  // @pre:   None
+  // @post:  None
+  // @returns long: Packets dropped since construction
+  //---------------------------------------------------------------------------
+  long getDropped();
+
+  //---------------------------------------------------------------------------
+  // setMemoryLimit
+  // Changes how many packets are held in memory. Packets already held past a
+  // lower limit stay until they are popped; new ones spill or are dropped
+  //
+  // @pre:   memoryLimit > 0
+  // @post:  Subsequent pushes and refills use the new limit
+  // @param  memoryLimit: Packets held in memory
+  //---------------------------------------------------------------------------
+  void setMemoryLimit(int memoryLimit);
+
+ private:
+  //Appends a packet to the spill file; caller holds lock
+  bool spill(const char* packet);
+
+  //Moves packets from the spill file into memory; caller holds lock
+  void refill();
+
+  deque<char*> memory;      //Oldest packets, in order
+  int packetSize;
+  int memoryLimit;
+  string spillPath;         //"" if spilling is off
+  int spillLimit;
+  int spillFd;              //-1 until the file is first needed
+  long long readOffset;     //Next spilled packet to read back
+  long long writeOffset;    //Where the next spilled packet goes
+  volatile int held;        //Packets in memory and on disk, read by size()
+                            //without the lock
+  long dropped;
+  pthread_mutex_t lock;
+};
+
+#endif /* STOREFORWARD_H_ */
@@ -0,0 +1,559 @@
+#include "UdpLink.h"
+#include "LatencyHistogram.h"
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+//Datagram types
+static const int LINK_DATA = 1;
+static const int LINK_ACK = 2;
+
+//-----------------------------------------------------------------------------
+// UdpLink Constructor
+// Creates a link to a peer over a socket shared with other links
+//
+// @pre:   sd is a UDP socket
+// @post:  Nothing is sent until send()
+// @param  sd:      The socket, owned by the caller
+// @param  peer:    The peer's address
+// @param  deliver: Takes frames received in order
+// @param  context: Passed to deliver
+//-----------------------------------------------------------------------------
+UdpLink::UdpLink(int sd, const struct sockaddr_in& peer,
+    UdpLinkDelivery deliver, void* context) {
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&windowOpen, NULL);
+  this->sd = sd;
+  this->peer = peer;
+  this->deliver = deliver;
+  this->context = context;
+  epoch = (unsigned int)(monotonicMicros() ^ ((long long)getpid() << 20) ^
+      (long long)(size_t)this) | 1;
+  peerEpoch = 0;
+  inFlight = 0;
+  cwnd = UDPLINK_INITIAL_CWND;
+  ssthresh = UDPLINK_MAX_CWND;
+  srttUs = 0;
+  rttvarUs = 0;
+  rtoUs = UDPLINK_INITIAL_RTO_MS * 1000LL;
+  recoveryUntilUs = 0;
+  closed = false;
+  memset(&stats, 0, sizeof(stats));
+}
+
+//-----------------------------------------------------------------------------
+// UdpLink Destructor
+// Frees every frame still held
+//
+// @pre:   No thread uses the link any more
+// @post:  None
+//-----------------------------------------------------------------------------
+UdpLink::~UdpLink() {
+  pthread_cond_destroy(&windowOpen);
+  pthread_mutex_destroy(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// send
+// Sends a frame on a stream, waiting while the congestion window is full
+// or the stream's queue is
+//
+// @pre:   None
+// @post:  The frame is sent, or queued behind its stream's window, and
+//         kept until acknowledged if true is returned
+// @param  frame:  The frame bytes
+// @param  length: Number of bytes, at most getMaxFrame()
+// @param  stream: The stream, e.g. the frame's origin group
+// @returns bool:  False if the link is closed or the frame is too long
+//-----------------------------------------------------------------------------
+bool UdpLink::send(const char* frame, int length, unsigned int stream) {
+  if (length <= 0 || length > getMaxFrame()) {
+    return false;
+  }
+  pthread_mutex_lock(&lock);
+  map<unsigned int, sendStream>::iterator found = sending.find(stream);
+  if (found == sending.end()) {
+    found = sending.insert(make_pair(stream, sendStream())).first;
+    found->second.next = 0;
+  }
+  sendStream& state = found->second;
+  while (!closed && (opened(state) ? inFlight >= (int)cwnd :
+      (int)state.waiting.size() >= UDPLINK_MAX_WAITING)) {
+    pthread_cond_wait(&windowOpen, &lock);
+  }
+  if (closed) {
+    pthread_mutex_unlock(&lock);
+    return false;
+  }
+  if (opened(state)) {
+    launch(stream, state, string(frame, length));
+  } else {
+    state.waiting.push_back(string(frame, length));
+  }
+  pthread_mutex_unlock(&lock);
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// receive
+// Handles a datagram the peer sent: delivers, holds or acknowledges DATA and
+// releases or resends frames for an ACK
+//
+// @pre:   isLinkDatagram(datagram, length)
+// @post:  None
+// @param  datagram: The datagram
+// @param  length:   Its length
+//-----------------------------------------------------------------------------
+void UdpLink::receive(const char* datagram, int length) {
+  unsigned int field[8];
+  memcpy(field, datagram, sizeof(field));
+  int type = (unsigned char)datagram[4];
+  unsigned int peerEpochSeen = ntohl(field[2]);
+  unsigned int stream = ntohl(field[3]);
+  unsigned int sequence = ntohl(field[4]);
+  unsigned int ack = ntohl(field[5]);
+  unsigned long long sack = ((unsigned long long)ntohl(field[6]) << 32) |
+      ntohl(field[7]);
+  pthread_mutex_lock(&lock);
+  if (peerEpoch != peerEpochSeen) {
+    receiving.clear();    //The peer restarted; its sequences start over
+    peerEpoch = peerEpochSeen;
+  }
+  if (type == LINK_ACK) {
+    acknowledged(stream, ack, sack);
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+  map<unsigned int, receiveStream>::iterator found = receiving.find(stream);
+  if (found == receiving.end()) {
+    //Start at the oldest frame the sender still has
+    found = receiving.insert(make_pair(stream, receiveStream())).first;
+    found->second.expected = ack;
+  }
+  receiveStream& state = found->second;
+  if ((int)(ack - state.expected) > 0) {
+    //The sender no longer has the frames before ack
+    while (!state.held.empty() &&
+        (int)(state.held.begin()->first - ack) < 0) {
+      state.held.erase(state.held.begin());
+    }
+    state.expected = ack;
+  }
+  int ahead = (int)(sequence - state.expected);
+  if (ahead < 0 || state.held.count(sequence) > 0) {
+    stats.duplicates++;
+  } else if (ahead < UDPLINK_WINDOW &&
+      (int)state.ready.size() < UDPLINK_WINDOW) {
+    //Beyond the window, or while the owner is behind, the frame is not
+    //acknowledged and the sender's timeout slows it down
+    state.held[sequence].assign(datagram + UDPLINK_HEADER_SIZE,
+        length - UDPLINK_HEADER_SIZE);
+    stats.received++;
+    map<unsigned int, string>::iterator next = state.held.find(state.expected);
+    while (next != state.held.end()) {
+      state.ready.push_back(string());
+      state.ready.back().swap(next->second);
+      state.held.erase(next);
+      state.expected++;
+      next = state.held.find(state.expected);
+    }
+    offer(state);
+  }
+  acknowledge(stream, state);
+  pthread_mutex_unlock(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// service
+// Resends frames whose timeout ran out and offers held frames to the owner
+// again
+//
+// @pre:   Called at least every getTimeoutMs()
+// @post:  None
+//-----------------------------------------------------------------------------
+void UdpLink::service() {
+  pthread_mutex_lock(&lock);
+  long long nowUs = monotonicMicros();
+  bool expired = false;
+  for (map<unsigned int, sendStream>::iterator stream = sending.begin();
+      stream != sending.end(); stream++) {
+    for (map<unsigned int, outstanding>::iterator entry =
+        stream->second.unacked.begin();
+        entry != stream->second.unacked.end(); entry++) {
+      if (nowUs - entry->second.sentUs < rtoUs) {
+        continue;
+      }
+      entry->second.sentUs = nowUs;
+      entry->second.retransmitted = true;
+      entry->second.passed = 0;
+      stats.retransmitted++;
+      transmit(LINK_DATA, stream->first, entry->first, base(stream->second),
+          0, entry->second.frame);
+      expired = true;
+    }
+  }
+  if (expired) {
+    //A timeout means the path lost a whole window: start over slowly
+    ssthresh = cwnd / 2 < 2 ? 2 : cwnd / 2;
+    cwnd = 1;
+    rtoUs = rtoUs * 2 > UDPLINK_MAX_RTO_MS * 1000LL ?
+        UDPLINK_MAX_RTO_MS * 1000LL : rtoUs * 2;
+    recoveryUntilUs = nowUs + rtoUs;
+  }
+  for (map<unsigned int, receiveStream>::iterator stream = receiving.begin();
+      stream != receiving.end(); stream++) {
+    offer(stream->second);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// getTimeoutMs
+// Returns how soon service() has work
+//
+// @pre:   None
+// @post:  None
+// @returns int: Milliseconds until the next retransmission timeout,
+//               UDPLINK_MAX_RTO_MS if nothing is in flight
+//-----------------------------------------------------------------------------
+int UdpLink::getTimeoutMs() {
+  pthread_mutex_lock(&lock);
+  long long nowUs = monotonicMicros();
+  long long waitUs = UDPLINK_MAX_RTO_MS * 1000LL;
+  for (map<unsigned int, sendStream>::iterator stream = sending.begin();
+      stream != sending.end(); stream++) {
+    for (map<unsigned int, outstanding>::iterator entry =
+        stream->second.unacked.begin();
+        entry != stream->second.unacked.end(); entry++) {
+      long long dueUs = entry->second.sentUs + rtoUs - nowUs;
+      if (dueUs < waitUs) {
+        waitUs = dueUs < 0 ? 0 : dueUs;
+      }
+    }
+  }
+  for (map<unsigned int, receiveStream>::iterator stream = receiving.begin();
+      stream != receiving.end(); stream++) {
+    if (!stream->second.ready.empty()) {
+      waitUs = 1000;    //Owner was full: try again soon
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return (waitUs + 999) / 1000;
+}
+
+//-----------------------------------------------------------------------------
+// close
+// Makes send() fail from now on and wakes the threads waiting in it
+//
+// @pre:   None
+// @post:  None
+//-----------------------------------------------------------------------------
+void UdpLink::close() {
+  pthread_mutex_lock(&lock);
+  closed = true;
+  pthread_cond_broadcast(&windowOpen);
+  pthread_mutex_unlock(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// getStats
+// Returns the link's counts
+//
+// @pre:   None
+// @post:  None
+// @returns UdpLinkStats: A copy of the counts and the congestion state
+//-----------------------------------------------------------------------------
+UdpLinkStats UdpLink::getStats() {
+  pthread_mutex_lock(&lock);
+  UdpLinkStats copy = stats;
+  copy.inFlight = inFlight;
+  copy.waiting = 0;
+  for (map<unsigned int, sendStream>::iterator stream = sending.begin();
+      stream != sending.end(); stream++) {
+    copy.waiting += stream->second.waiting.size();
+  }
+  copy.cwnd = cwnd;
+  copy.srttUs = srttUs;
+  pthread_mutex_unlock(&lock);
+  return copy;
+}
+
+//-----------------------------------------------------------------------------
+// getMaxFrame
+// Returns the longest frame send() takes
+//
+// @pre:   None
+// @post:  None
+// @returns int: The largest UDP payload less the link header
+//-----------------------------------------------------------------------------
+int UdpLink::getMaxFrame() {
+  return 65507 - UDPLINK_HEADER_SIZE;
+}
+
+//-----------------------------------------------------------------------------
+// isLinkDatagram
+// Returns whether a datagram is a well-formed UdpLink datagram
+//
+// @pre:   None
+// @post:  None
+// @param  datagram: The datagram
+// @param  length:   Its length
+// @returns bool:    True if it has the magic and a known type
+//-----------------------------------------------------------------------------
+bool UdpLink::isLinkDatagram(const char* datagram, int length) {
+  if (length < UDPLINK_HEADER_SIZE) {
+    return false;
+  }
+  unsigned int magic = 0;
+  memcpy(&magic, datagram, sizeof(magic));
+  int type = (unsigned char)datagram[4];
+  return ntohl(magic) == UDPLINK_MAGIC &&
+      ((type == LINK_DATA && length > UDPLINK_HEADER_SIZE) ||
+      (type == LINK_ACK && length == UDPLINK_HEADER_SIZE));
+}
+
+//-----------------------------------------------------------------------------
+// transmit
+// Sends one datagram; one the socket cannot take now is lost like any other
+//
+// @pre:   lock is held
+// @post:  None
+// @param  type:     LINK_DATA or LINK_ACK
+// @param  stream:   The stream
+// @param  sequence: The frame's sequence (DATA)
+// @param  ack:      The stream's oldest unacknowledged sequence (DATA) or
+//                   next expected sequence (ACK)
+// @param  sack:     Bit i set if sequence ack + 1 + i is held (ACK)
+// @param  frame:    The frame (DATA), empty for an ACK
+//-----------------------------------------------------------------------------
+void UdpLink::transmit(int type, unsigned int stream, unsigned int sequence,
+    unsigned int ack, unsigned long long sack, const string& frame) {
+  char datagram[UDPLINK_HEADER_SIZE + 65507];
+  unsigned int field[8];
+  field[0] = htonl(UDPLINK_MAGIC);
+  field[1] = 0;
+  field[2] = htonl(epoch);
+  field[3] = htonl(stream);
+  field[4] = htonl(sequence);
+  field[5] = htonl(ack);
+  field[6] = htonl((unsigned int)(sack >> 32));
+  field[7] = htonl((unsigned int)sack);
+  memcpy(datagram, field, sizeof(field));
+  datagram[4] = (char)type;
+  memcpy(datagram + UDPLINK_HEADER_SIZE, frame.data(), frame.size());
+  sendto(sd, datagram, UDPLINK_HEADER_SIZE + frame.size(), MSG_DONTWAIT,
+      (struct sockaddr*)&peer, sizeof(peer));
+}
+
+//-----------------------------------------------------------------------------
+// acknowledge
+// Sends the ACK for a stream: its next expected sequence and the frames held
+// after it
+//
+// @pre:   lock is held
+// @post:  None
+// @param  stream: The stream
+// @param  state:  Its receiving side
+//-----------------------------------------------------------------------------
+void UdpLink::acknowledge(unsigned int stream, receiveStream& state) {
+  unsigned long long sack = 0;
+  for (map<unsigned int, string>::iterator held = state.held.begin();
+      held != state.held.end(); held++) {
+    int bit = (int)(held->first - state.expected) - 1;
+    if (bit >= 0 && bit < UDPLINK_WINDOW) {
+      sack |= 1ULL << bit;
+    }
+  }
+  transmit(LINK_ACK, stream, 0, state.expected, sack, string());
+}
+
+//-----------------------------------------------------------------------------
+// acknowledged
+// Handles an ACK: releases the frames it covers, updates the RTT estimate and
+// the congestion window, and resends frames it shows as lost
+//
+// @pre:   lock is held
+// @post:  Threads waiting for the window are woken if it opened
+// @param  stream: The stream
+// @param  ack:    The peer's next expected sequence
+// @param  sack:   Bit i set if the peer holds sequence ack + 1 + i
+//-----------------------------------------------------------------------------
+void UdpLink::acknowledged(unsigned int stream, unsigned int ack,
+    unsigned long long sack) {
+  map<unsigned int, sendStream>::iterator found = sending.find(stream);
+  if (found == sending.end()) {
+    return;
+  }
+  map<unsigned int, outstanding>& unacked = found->second.unacked;
+  long long nowUs = monotonicMicros();
+  int released = 0;
+  bool sampled = false;
+  unsigned int highest = ack - 1;   //Newest sequence the peer has
+  for (int bit = UDPLINK_WINDOW - 1; bit >= 0; bit--) {
+    if ((sack >> bit) & 1) {
+      highest = ack + 1 + bit;
+      break;
+    }
+  }
+  map<unsigned int, outstanding>::iterator entry = unacked.begin();
+  while (entry != unacked.end()) {
+    int offset = (int)(entry->first - ack);
+    bool covered = offset < 0 || (offset > 0 &&
+        offset <= UDPLINK_WINDOW && ((sack >> (offset - 1)) & 1));
+    if (!covered) {
+      if ((int)(entry->first - highest) < 0 &&
+          ++entry->second.passed == UDPLINK_DUP_THRESHOLD) {
+        //Later frames got through: this one was lost
+        entry->second.sentUs = nowUs;
+        entry->second.retransmitted = true;
+        stats.retransmitted++;
+        transmit(LINK_DATA, stream, entry->first, base(found->second), 0,
+            entry->second.frame);
+        if (nowUs >= recoveryUntilUs) {
+          ssthresh = cwnd / 2 < 2 ? 2 : cwnd / 2;
+          cwnd = ssthresh;
+          recoveryUntilUs = nowUs + (srttUs > 0 ? srttUs : rtoUs);
+        }
+      }
+      entry++;
+      continue;
+    }
+    if (!sampled && !entry->second.retransmitted) {
+      long long rttUs = nowUs - entry->second.sentUs;
+      if (srttUs == 0) {
+        srttUs = rttUs;
+        rttvarUs = rttUs / 2;
+      } else {
+        long long error = rttUs > srttUs ? rttUs - srttUs : srttUs - rttUs;
+        rttvarUs = (3 * rttvarUs + error) / 4;
+        srttUs = (7 * srttUs + rttUs) / 8;
+      }
+      rtoUs = srttUs + 4 * rttvarUs;
+      if (rtoUs < UDPLINK_MIN_RTO_MS * 1000LL) {
+        rtoUs = UDPLINK_MIN_RTO_MS * 1000LL;
+      }
+      if (rtoUs > UDPLINK_MAX_RTO_MS * 1000LL) {
+        rtoUs = UDPLINK_MAX_RTO_MS * 1000LL;
+      }
+      sampled = true;
+    }
+    unacked.erase(entry++);
+    released++;
+  }
+  if (released == 0) {
+    return;
+  }
+  inFlight -= released;
+  for (int i = 0; i < released; i++) {
+    cwnd += cwnd < ssthresh ? 1 : 1 / cwnd;
+  }
+  if (cwnd > UDPLINK_MAX_CWND) {
+    cwnd = UDPLINK_MAX_CWND;
+  }
+  release();
+  pthread_cond_broadcast(&windowOpen);
+}
+
+//-----------------------------------------------------------------------------
+// offer
+// Passes ready frames to the owner until it refuses one
+//
+// @pre:   lock is held
+// @post:  The frames the owner took are no longer held
+// @param  state: The receiving side of a stream
+//-----------------------------------------------------------------------------
+void UdpLink::offer(receiveStream& state) {
+  while (!state.ready.empty() && deliver(state.ready.front().data(),
+      state.ready.front().size(), context)) {
+    state.ready.pop_front();
+    stats.delivered++;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// base
+// Returns the oldest sequence of a stream the peer has not acknowledged
+//
+// @pre:   lock is held
+// @post:  None
+// @param  state: The sending side of a stream
+// @returns unsigned int: The first unacknowledged sequence, or the next one
+//                        if every frame is acknowledged
+//-----------------------------------------------------------------------------
+unsigned int UdpLink::base(const sendStream& state) const {
+  unsigned int oldest = state.next;
+  for (map<unsigned int, outstanding>::const_iterator entry =
+      state.unacked.begin(); entry != state.unacked.end(); entry++) {
+    if ((int)(entry->first - oldest) < 0) {
+      oldest = entry->first;
+    }
+  }
+  return oldest;
+}
+
+//-----------------------------------------------------------------------------
+// opened
+// Returns whether a stream can send a new frame now, as far as its own
+// window goes; the congestion window is checked separately
+//
+// @pre:   lock is held
+// @post:  None
+// @param  state: The sending side of a stream
+// @returns bool: True if nothing is queued on the stream and its newest
+//                frame is less than UDPLINK_WINDOW past its oldest
+//                unacknowledged one
+//-----------------------------------------------------------------------------
+bool UdpLink::opened(const sendStream& state) const {
+  return state.waiting.empty() &&
+      (int)(state.next - base(state)) < UDPLINK_WINDOW;
+}
+
+//-----------------------------------------------------------------------------
+// launch
+// Sends a new frame on a stream and keeps it until acknowledged
+//
+// @pre:   lock is held
+// @post:  The frame counts as in flight
+// @param  stream: The stream
+// @param  state:  Its sending side
+// @param  frame:  The frame bytes
+//-----------------------------------------------------------------------------
+void UdpLink::launch(unsigned int stream, sendStream& state,
+    const string& frame) {
+  unsigned int sequence = state.next++;
+  outstanding& entry = state.unacked[sequence];
+  entry.frame = frame;
+  entry.sentUs = monotonicMicros();
+  entry.retransmitted = false;
+  entry.passed = 0;
+  inFlight++;
+  stats.sent++;
+  transmit(LINK_DATA, stream, sequence, base(state), 0, entry.frame);
+}
+
+//-----------------------------------------------------------------------------
+// release
+// Sends queued frames while both the congestion window and their stream's
+// window allow, one frame per stream in turn so no stream takes the whole
+// congestion window
+//
+// @pre:   lock is held
+// @post:  None
+//-----------------------------------------------------------------------------
+void UdpLink::release() {
+  bool launched = true;
+  while (launched && inFlight < (int)cwnd) {
+    launched = false;
+    for (map<unsigned int, sendStream>::iterator stream = sending.begin();
+        stream != sending.end() && inFlight < (int)cwnd; stream++) {
+      sendStream& state = stream->second;
+      if (!state.waiting.empty() &&
+          (int)(state.next - base(state)) < UDPLINK_WINDOW) {
+        launch(stream->first, state, state.waiting.front());
+        state.waiting.pop_front();
+        launched = true;
+      }
+    }
+  }
+}
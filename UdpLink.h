@@ -0,0 +1,253 @@
+#ifndef UDPLINK_H_
+#define UDPLINK_H_
+
+#include <pthread.h>
+#include <netinet/in.h>
+#include <deque>
+#include <map>
+#include <string>
+
+using namespace std;
+
+const unsigned int UDPLINK_MAGIC = 0x524c5531; //"RLU1", starts every datagram
+const int UDPLINK_HEADER_SIZE = 32;     //Bytes before a DATA frame
+const int UDPLINK_WINDOW = 64;          //Frames a stream holds out of order,
+                                        //one SACK bit each
+const int UDPLINK_MAX_WAITING = 256;   //Frames a stream queues past its
+                                        //window before send() blocks
+const int UDPLINK_DUP_THRESHOLD = 3;    //Later frames acked before a frame
+                                        //is resent without waiting for RTO
+const int UDPLINK_INITIAL_CWND = 4;     //Frames in flight before any ACK
+const int UDPLINK_MAX_CWND = 4096;      //Most frames in flight
+const int UDPLINK_INITIAL_RTO_MS = 200; //Retransmission timeout before RTT
+const int UDPLINK_MIN_RTO_MS = 20;      //samples, and its bounds
+const int UDPLINK_MAX_RTO_MS = 2000;
+
+//Passes a frame, in order within its stream, to the link's owner. Returning
+//false means the owner cannot take it yet; the link offers it again later.
+typedef bool (*UdpLinkDelivery)(const char* frame, int length, void* context);
+
+//Counts of one link, see UdpLink::getStats
+struct UdpLinkStats {
+  long long sent;           //DATA frames sent the first time
+  long long retransmitted;  //DATA frames sent again
+  long long received;       //DATA frames accepted the first time
+  long long duplicates;     //DATA frames already received
+  long long delivered;      //Frames passed to the owner
+  int inFlight;             //Frames sent and not yet acknowledged
+  int waiting;              //Frames queued behind their stream's window
+  double cwnd;              //Congestion window, frames
+  long long srttUs;         //Smoothed round trip time, 0 before a sample
+};
+
+//-----------------------------------------------------------------------------
+// Class:       UdpLink
+// Description: A reliable, congestion-controlled link to one peer relay over
+//              a UDP socket, as an alternative to a TCP connection. Frames
+//              are sent on streams (the relay uses the origin group); each
+//              stream has its own sequence numbers and is delivered in order,
+//              but a lost frame only holds back later frames of its own
+//              stream, never those of other streams.
+//
+//              The receiver acknowledges every DATA datagram with the
+//              stream's next expected sequence and a bitmap of the
+//              UDPLINK_WINDOW frames after it that it holds (selective ACK);
+//              a hole in that bitmap is a negative acknowledgement. The
+//              sender resends a frame once UDPLINK_DUP_THRESHOLD later frames
+//              are acknowledged past it, or when its retransmission timeout
+//              (RFC 6298 estimate) runs out. The congestion window is shared
+//              by every stream: slow start, additive increase, halved once
+//              per round trip on a fast retransmission and reset to one
+//              frame on a timeout. send() blocks while the window is full,
+//              so a lossy path slows its feeder instead of growing a queue.
+//
+//              No stream runs more than UDPLINK_WINDOW frames past its oldest
+//              unacknowledged frame, since the receiver holds no more and the
+//              SACK covers no more; a frame sent further ahead would be
+//              dropped and could only be recovered by a timeout. Frames past
+//              a stream's window are queued on that stream and sent as its
+//              ACKs arrive, so a stalled stream does not block send() for the
+//              others until it has also queued UDPLINK_MAX_WAITING frames.
+//
+//              Each side picks a random epoch when the link is created, and
+//              each DATA datagram carries the oldest sequence its stream
+//              still has unacknowledged, so either side can restart without
+//              the other waiting for frames that will never come. Thread
+//              safe: the socket thread calls receive() and service(), any
+//              thread calls send().
+//-----------------------------------------------------------------------------
+class UdpLink {
+ public:
+  //---------------------------------------------------------------------------
+  // UdpLink Constructor
+  // Creates a link to a peer over a socket shared with other links
+  //
+  // @pre:   sd is a UDP socket
+  // @post:  Nothing is sent until send()
+  // @param  sd:      The socket, owned by the caller
+  // @param  peer:    The peer's address
+  // @param  deliver: Takes frames received in order
+  // @param  context: Passed to deliver
+  //---------------------------------------------------------------------------
+  UdpLink(int sd, const struct sockaddr_in& peer, UdpLinkDelivery deliver,
+      void* context);
+
+  //---------------------------------------------------------------------------
+  // UdpLink Destructor
+  // Frees every frame still held
+  //
+  // @pre:   No thread uses the link any more
+  // @post:  None
+  //---------------------------------------------------------------------------
+  ~UdpLink();
+
+  //---------------------------------------------------------------------------
+  // send
+  // Sends a frame on a stream, waiting while the congestion window is full
+  // or the stream's queue is
+  //
+  // @pre:   None
+  // @post:  The frame is sent, or queued behind its stream's window, and
+  //         kept until acknowledged if true is returned
+  // @param  frame:  The frame bytes
+  // @param  length: Number of bytes, at most getMaxFrame()
+  // @param  stream: The stream, e.g. the frame's origin group
+  // @returns bool:  False if the link is closed or the frame is too long
+  //---------------------------------------------------------------------------
+  bool send(const char* frame, int length, unsigned int stream);
+
+  //---------------------------------------------------------------------------
+  // receive
+  // Handles a datagram the peer sent: delivers, holds or acknowledges DATA
+  // and releases or resends frames for an ACK
+  //
+  // @pre:   isLinkDatagram(datagram, length)
+  // @post:  None
+  // @param  datagram: The datagram
+  // @param  length:   Its length
+  //---------------------------------------------------------------------------
+  void receive(const char* datagram, int length);
+
+  //---------------------------------------------------------------------------
+  // service
+  // Resends frames whose timeout ran out and offers held frames to the owner
+  // again
+  //
+  // @pre:   Called at least every getTimeoutMs()
+  // @post:  None
+  //---------------------------------------------------------------------------
+  void service();
+
+  //---------------------------------------------------------------------------
+  // getTimeoutMs
+  // Returns how soon service() has work
+  //
+  // @pre:   None
+  // @post:  None
+  // @returns int: Milliseconds until the next retransmission timeout,
+  //               UDPLINK_MAX_RTO_MS if nothing is in flight
+  //---------------------------------------------------------------------------
+  int getTimeoutMs();
+
+  //---------------------------------------------------------------------------
+  // close
+  // Makes send() fail from now on and wakes the threads waiting in it
+  //
+  // @pre:   None
+  // @post:  None
+  //---------------------------------------------------------------------------
+  void close();
+
+  //---------------------------------------------------------------------------
+  // getStats / getMaxFrame
+  // Return the link's counts, or the longest frame send() takes
+  //
+  // @pre:   None
+  // @post:  None
+  //---------------------------------------------------------------------------
+  UdpLinkStats getStats();
+  static int getMaxFrame();
+
+  //---------------------------------------------------------------------------
+  // isLinkDatagram
+  // Returns whether a datagram is a well-formed UdpLink datagram
+  //
+  // @pre:   None
+  // @post:  None
+  // @param  datagram: The datagram
+  // @param  length:   Its length
+  // @returns bool:    True if it has the magic and a known type
+  //---------------------------------------------------------------------------
+  static bool isLinkDatagram(const char* datagram, int length);
+
+ private:
+  //A frame sent and not yet acknowledged
+  struct outstanding {
+    string frame;
+    long long sentUs;         //Last time it was sent
+    bool retransmitted;       //Not used for RTT samples (Karn)
+    int passed;               //ACKs that acknowledged a later frame
+  };
+
+  //Sending side of a stream
+  struct sendStream {
+    unsigned int next;        //Sequence of the next new frame
+    map<unsigned int, outstanding> unacked;
+    deque<string> waiting;    //Past the window, not yet sent
+  };
+
+  //Receiving side of a stream
+  struct receiveStream {
+    unsigned int expected;    //Next sequence to deliver
+    map<unsigned int, string> held;  //Received after a gap
+    deque<string> ready;      //In order, not yet taken by the owner
+  };
+
+  //Sends one datagram
+  void transmit(int type, unsigned int stream, unsigned int sequence,
+      unsigned int ack, unsigned long long sack, const string& frame);
+
+  //Sends the ACK for a stream
+  void acknowledge(unsigned int stream, receiveStream& state);
+
+  //Handles an ACK for a stream
+  void acknowledged(unsigned int stream, unsigned int ack,
+      unsigned long long sack);
+
+  //Passes ready frames to the owner until it refuses one
+  void offer(receiveStream& state);
+
+  //Returns the oldest unacknowledged sequence of a stream
+  unsigned int base(const sendStream& state) const;
+
+  //Returns whether a stream can send a new frame now
+  bool opened(const sendStream& state) const;
+
+  //Sends a new frame on a stream and keeps it until acknowledged
+  void launch(unsigned int stream, sendStream& state, const string& frame);
+
+  //Sends queued frames the windows now allow
+  void release();
+
+  pthread_mutex_t lock;       //Guards everything below
+  pthread_cond_t windowOpen;  //Signalled when frames are acknowledged
+  int sd;
+  struct sockaddr_in peer;
+  UdpLinkDelivery deliver;
+  void* context;
+  unsigned int epoch;         //This side's, sent in every datagram
+  unsigned int peerEpoch;     //Last seen from the peer, 0 = none yet
+  map<unsigned int, sendStream> sending;
+  map<unsigned int, receiveStream> receiving;
+  int inFlight;
+  double cwnd;
+  double ssthresh;
+  long long srttUs;
+  long long rttvarUs;
+  long long rtoUs;
+  long long recoveryUntilUs;  //No further window cut before then
+  bool closed;
+  UdpLinkStats stats;
+};
+
+#endif /* UDPLINK_H_ */
@@ -0,0 +1,211 @@
+#include "UdpTunnel.h"
+#include "LatencyHistogram.h"
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+
+//-----------------------------------------------------------------------------
+// UdpTunnel Constructor
+// Creates a tunnel end with a random epoch and no sources
+//
+// @pre:   None
+// @post:  Sequences start at 0 for every origin group
+//-----------------------------------------------------------------------------
+UdpTunnel::UdpTunnel() {
+  pthread_mutex_init(&lock, NULL);
+  epoch = (unsigned int)(monotonicMicros() ^ ((long long)getpid() << 20) ^
+      (long long)(size_t)this) | 1;
+  sent = 0;
+  failed = 0;
+}
+
+//-----------------------------------------------------------------------------
+// UdpTunnel Destructor
+//
+// @pre:   No thread uses the tunnel any more
+// @post:  None
+//-----------------------------------------------------------------------------
+UdpTunnel::~UdpTunnel() {
+  pthread_mutex_destroy(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// wrap
+// Writes the datagram that tunnels a packet, taking the next sequence of its
+// origin group
+//
+// @pre:   datagram holds UDPTUNNEL_HEADER_SIZE + length bytes
+// @post:  None
+// @param  packet:   The packet
+// @param  length:   Its length
+// @param  group:    Its origin group
+// @param  ordered:  Set UDPTUNNEL_ORDERED
+// @param  datagram: Receives the datagram
+// @returns int:     Length of the datagram
+//-----------------------------------------------------------------------------
+int UdpTunnel::wrap(const char* packet, int length, unsigned int group,
+    bool ordered, char* datagram) {
+  pthread_mutex_lock(&lock);
+  unsigned int sequence = sequences[group]++;
+  pthread_mutex_unlock(&lock);
+  unsigned int field[5];
+  field[0] = htonl(UDPTUNNEL_MAGIC);
+  field[1] = 0;
+  field[2] = htonl(epoch);
+  field[3] = htonl(group);
+  field[4] = htonl(sequence);
+  memcpy(datagram, field, sizeof(field));
+  datagram[4] = ordered ? UDPTUNNEL_ORDERED : 0;
+  memcpy(datagram + UDPTUNNEL_HEADER_SIZE, packet, length);
+  return UDPTUNNEL_HEADER_SIZE + length;
+}
+
+//-----------------------------------------------------------------------------
+// unwrap
+// Accounts for a received datagram and tells whether to deliver its packet
+//
+// @pre:   isTunnelDatagram(datagram, length)
+// @post:  The source's counts are updated
+// @param  datagram: The datagram
+// @param  length:   Its length
+// @param  sender:   Name of the relay it came from
+// @returns int:     Length of the packet at datagram + UDPTUNNEL_HEADER_SIZE,
+//                   0 if it is dropped
+//-----------------------------------------------------------------------------
+int UdpTunnel::unwrap(const char* datagram, int length, const string& sender) {
+  unsigned int field[5];
+  memcpy(field, datagram, sizeof(field));
+  bool ordered = (datagram[4] & UDPTUNNEL_ORDERED) != 0;
+  unsigned int senderEpoch = ntohl(field[2]);
+  unsigned int group = ntohl(field[3]);
+  unsigned int sequence = ntohl(field[4]);
+  struct in_addr groupAddr;
+  groupAddr.s_addr = htonl(group);
+  string name = sender + " " + inet_ntoa(groupAddr);
+  pthread_mutex_lock(&lock);
+  map<string, source>::iterator found = sources.find(name);
+  if (found == sources.end()) {
+    found = sources.insert(make_pair(name, source())).first;
+    memset(&found->second.counts, 0, sizeof(found->second.counts));
+    found->second.epoch = senderEpoch;
+    found->second.next = sequence;
+    found->second.seen = 0;
+  }
+  source& state = found->second;
+  if (state.epoch != senderEpoch) {
+    //The sender restarted: its sequences start over
+    state.epoch = senderEpoch;
+    state.next = sequence;
+    state.seen = 0;
+  }
+  state.counts.received++;
+  int ahead = (int)(sequence - state.next);
+  bool deliver = true;
+  if (ahead >= 0) {
+    state.counts.lost += ahead;
+    state.seen = ahead + 1 >= UDPTUNNEL_WINDOW ? 1 :
+        (state.seen << (ahead + 1)) | 1;
+    state.next = sequence + 1;
+  } else {
+    int behind = -ahead - 1;
+    unsigned long long bit = behind < UDPTUNNEL_WINDOW ? 1ULL << behind : 0;
+    if ((state.seen & bit) != 0) {
+      state.counts.duplicates++;
+    } else {
+      state.counts.late++;
+      if (bit != 0 && state.counts.lost > 0) {
+        state.counts.lost--;    //Reordered, not lost
+      }
+      state.seen |= bit;
+    }
+    if (ordered) {
+      state.counts.dropped++;
+      deliver = false;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return deliver ? length - UDPTUNNEL_HEADER_SIZE : 0;
+}
+
+//-----------------------------------------------------------------------------
+// countSent
+// Counts a datagram handed to the socket
+//
+// @pre:   None
+// @post:  None
+//-----------------------------------------------------------------------------
+void UdpTunnel::countSent() {
+  __sync_fetch_and_add(&sent, 1);
+}
+
+//-----------------------------------------------------------------------------
+// countFailed
+// Counts a datagram the socket did not take
+//
+// @pre:   None
+// @post:  None
+//-----------------------------------------------------------------------------
+void UdpTunnel::countFailed() {
+  __sync_fetch_and_add(&failed, 1);
+}
+
+//-----------------------------------------------------------------------------
+// getSent
+// Returns the datagrams handed to the socket
+//
+// @pre:   None
+// @post:  None
+// @returns long long: Datagrams sent since creation
+//-----------------------------------------------------------------------------
+long long UdpTunnel::getSent() {
+  return sent;
+}
+
+//-----------------------------------------------------------------------------
+// getFailed
+// Returns the datagrams the socket did not take
+//
+// @pre:   None
+// @post:  None
+// @returns long long: Datagrams dropped at the sender since creation
+//-----------------------------------------------------------------------------
+long long UdpTunnel::getFailed() {
+  return failed;
+}
+
+//-----------------------------------------------------------------------------
+// getSources
+// Copies every source's counts
+//
+// @pre:   None
+// @post:  sources holds one entry per source, by "sender group" name
+// @param  sources: Receives the counts
+//-----------------------------------------------------------------------------
+void UdpTunnel::getSources(vector<pair<string, UdpTunnelSource> >& sources) {
+  sources.clear();
+  pthread_mutex_lock(&lock);
+  for (map<string, source>::iterator entry = this->sources.begin();
+      entry != this->sources.end(); entry++) {
+    sources.push_back(make_pair(entry->first, entry->second.counts));
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+//-----------------------------------------------------------------------------
+// isTunnelDatagram
+// Returns whether a datagram is a tunnel datagram
+//
+// @pre:   None
+// @post:  None
+// @param  datagram: The datagram
+// @param  length:   Its length
+// @returns bool:    True if it has the magic and carries a packet
+//-----------------------------------------------------------------------------
+bool UdpTunnel::isTunnelDatagram(const char* datagram, int length) {
+  if (length <= UDPTUNNEL_HEADER_SIZE) {
+    return false;
+  }
+  unsigned int magic = 0;
+  memcpy(&magic, datagram, sizeof(magic));
+  return ntohl(magic) == UDPTUNNEL_MAGIC;
+}
@@ -0,0 +1,163 @@
+#ifndef UDPTUNNEL_H_
+#define UDPTUNNEL_H_
+
+#include <pthread.h>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+const unsigned int UDPTUNNEL_MAGIC = 0x524c5431; //"RLT1", starts every datagram
+const int UDPTUNNEL_HEADER_SIZE = 20;   //Bytes before the packet
+const int UDPTUNNEL_ORDERED = 0x1;      //Flag: drop packets older than one
+                                        //already delivered from the source
+const int UDPTUNNEL_WINDOW = 64;        //Sequences before the newest that a
+                                        //receiver remembers, to tell a late
+                                        //packet from a duplicate
+
+//Tunnel modes of a group, see UdpRelay::setTunnelRule
+const int TUNNEL_OFF = 0;         //Reliable, over the peer links
+const int TUNNEL_UNRELIABLE = 1;  //Unicast UDP, no retransmission
+const int TUNNEL_ORDERED = 2;     //As unreliable, and late or duplicate
+                                  //packets are dropped
+
+//What a receiver saw from one source: a sending relay and an origin group
+struct UdpTunnelSource {
+  long long received;     //Datagrams that arrived
+  long long lost;         //Sequence numbers skipped and not filled in later
+  long long late;         //Datagrams older than one already received
+  long long duplicates;   //Datagrams whose sequence already arrived
+  long long dropped;      //Late or duplicate datagrams not delivered in
+                          //ordered mode
+};
+
+//-----------------------------------------------------------------------------
+// Class:       UdpTunnel
+// Description: Best-effort tunnel of packets between relays as unicast UDP
+//              datagrams, for groups where a fresh packet is worth more than
+//              a complete stream. Nothing is acknowledged or resent: each
+//              datagram is the relay packet after a small header:
+//
+//              Byte 0-3:   UDPTUNNEL_MAGIC, big endian
+//              Byte 4:     Flags (UDPTUNNEL_ORDERED)
+//              Byte 5-7:   0
+//              Byte 8-11:  Sender's epoch, random per process
+//              Byte 12-15: Origin group the sequence belongs to
+//              Byte 16-19: Sequence number within the sender's origin group
+//
+//              The receiver keeps, per source, the next sequence it expects
+//              and which of the UDPTUNNEL_WINDOW sequences before it arrived:
+//              a skip counts the skipped packets as lost, a packet that
+//              arrives after a newer one is late and fills one lost packet
+//              back in, and a second copy of a sequence is a duplicate. A
+//              packet older than the window is taken for late but fills
+//              nothing in. Late packets and duplicates are delivered, unless
+//              UDPTUNNEL_ORDERED is set: then they are dropped, so the local
+//              group only ever sees a source's packets move forward. Nothing
+//              already delivered or queued is replaced, so this is ordering,
+//              not conflation. A new epoch means the sender restarted and
+//              resets the source. Thread safe.
+//-----------------------------------------------------------------------------
+class UdpTunnel {
+ public:
+  //---------------------------------------------------------------------------
+  // UdpTunnel Constructor
+  // Creates a tunnel end with a random epoch and no sources
+  //
+  // @pre:   None
+  // @post:  Sequences start at 0 for every origin group
+  //---------------------------------------------------------------------------
+  UdpTunnel();
+
+  //---------------------------------------------------------------------------
+  // UdpTunnel Destructor
+  //
+  // @pre:   No thread uses the tunnel any more
+  // @post:  None
+  //---------------------------------------------------------------------------
+  ~UdpTunnel();
+
+  //---------------------------------------------------------------------------
+  // wrap
+  // Writes the datagram that tunnels a packet, taking the next sequence of
+  // its origin group
+  //
+  // @pre:   datagram holds UDPTUNNEL_HEADER_SIZE + length bytes
+  // @post:  None
+  // @param  packet:   The packet
+  // @param  length:   Its length
+  // @param  group:    Its origin group
+  // @param  ordered:  Set UDPTUNNEL_ORDERED
+  // @param  datagram: Receives the datagram
+  // @returns int:     Length of the datagram
+  //---------------------------------------------------------------------------
+  int wrap(const char* packet, int length, unsigned int group, bool ordered,
+      char* datagram);
+
+  //---------------------------------------------------------------------------
+  // unwrap
+  // Accounts for a received datagram and tells whether to deliver its packet
+  //
+  // @pre:   isTunnelDatagram(datagram, length)
+  // @post:  The source's counts are updated
+  // @param  datagram: The datagram
+  // @param  length:   Its length
+  // @param  sender:   Name of the relay it came from
+  // @returns int:     Length of the packet at datagram +
+  //                   UDPTUNNEL_HEADER_SIZE, 0 if it is dropped
+  //---------------------------------------------------------------------------
+  int unwrap(const char* datagram, int length, const string& sender);
+
+  //---------------------------------------------------------------------------
+  // countSent / countFailed
+  // Count a datagram handed to the socket, or one the socket did not take
+  //
+  // @pre:   None
+  // @post:  None
+  //---------------------------------------------------------------------------
+  void countSent();
+  void countFailed();
+
+  //---------------------------------------------------------------------------
+  // getSent / getFailed / getSources
+  // Return the datagrams sent and not sent, or a copy of every source's
+  // counts by "sender group" name
+  //
+  // @pre:   None
+  // @post:  None
+  //---------------------------------------------------------------------------
+  long long getSent();
+  long long getFailed();
+  void getSources(vector<pair<string, UdpTunnelSource> >& sources);
+
+  //---------------------------------------------------------------------------
+  // isTunnelDatagram
+  // Returns whether a datagram is a tunnel datagram
+  //
+  // @pre:   None
+  // @post:  None
+  // @param  datagram: The datagram
+  // @param  length:   Its length
+  // @returns bool:    True if it has the magic and carries a packet
+  //---------------------------------------------------------------------------
+  static bool isTunnelDatagram(const char* datagram, int length);
+
+ private:
+  //Receiving state of a source
+  struct source {
+    unsigned int epoch;
+    unsigned int next;        //Sequence expected next
+    unsigned long long seen;  //Bit i set if sequence next - 1 - i arrived
+    UdpTunnelSource counts;
+  };
+
+  pthread_mutex_t lock;       //Guards everything below
+  unsigned int epoch;         //This side's, sent in every datagram
+  map<unsigned int, unsigned int> sequences; //Next sequence by origin group
+  map<string, source> sources; //By "sender group"
+  long long sent;
+  long long failed;
+};
+
+#endif /* UDPTUNNEL_H_ */
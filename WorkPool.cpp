@@ -0,0 +1,342 @@
+#include "WorkPool.h"
+#include <sched.h>
+#include <stdlib.h>
+#include <iostream>
+
+//Completion signal of a flush, run as the strand's last task
+struct flushMarker {
+  pthread_mutex_t lock;
+  pthread_cond_t ran;
+  bool done;
+};
+
+//-----------------------------------------------------------------------------
+// markFlushed
+// The task flush() submits: wakes the thread waiting in flush()
+//
+// @pre:   context is a flushMarker
+// @post:  The marker is done
+//-----------------------------------------------------------------------------
+static void markFlushed(void* context, void* argument) {
+  (void)argument;
+  flushMarker* marker = (flushMarker*)context;
+  pthread_mutex_lock(&marker->lock);
+  marker->done = true;
+  pthread_cond_signal(&marker->ran);
+  pthread_mutex_unlock(&marker->lock);
+}
+
+//-----------------------------------------------------------------------------
+// WorkPool Constructor
+// Starts the worker threads
+//
+// @pre:   workers > 0
+// @post:  The workers wait for tasks
+// @param  workers: Number of threads
+//-----------------------------------------------------------------------------
+WorkPool::WorkPool(int workers) {
+  pthread_mutex_init(&idleLock, NULL);
+  pthread_cond_init(&workReady, NULL);
+  readyStrands = 0;
+  idleWorkers = 0;
+  stopping = false;
+  nextWorker = 0;
+  for (int i = 0; i < workers; i++) {
+    worker* self = new worker;
+    self->pool = this;
+    self->index = i;
+    self->tasks = 0;
+    self->steals = 0;
+    pthread_mutex_init(&self->lock, NULL);
+    this->workers.push_back(self);
+  }
+  for (int i = 0; i < workers; i++) {
+    if (pthread_create(&this->workers[i]->thread, NULL, workerThread,
+        (void*)this->workers[i]) != 0) {
+      cerr << "Thread creation failed!" << endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+// WorkPool Destructor
+// Runs every task already submitted, then stops the workers
+//
+// @pre:   No thread submits any more tasks
+// @post:  The worker threads have exited; strands are not deleted
+//-----------------------------------------------------------------------------
+WorkPool::~WorkPool() {
+  pthread_mutex_lock(&idleLock);
+  stopping = true;
+  pthread_cond_broadcast(&workReady);
+  pthread_mutex_unlock(&idleLock);
+  for (size_t i = 0; i < workers.size(); i++) {
+    pthread_join(workers[i]->thread, NULL);
+  }
+  //Only now, since a worker still running may steal from any other's deque
+  for (size_t i = 0; i < workers.size(); i++) {
+    pthread_mutex_destroy(&workers[i]->lock);
+    delete workers[i];
+  }
+  pthread_cond_destroy(&workReady);
+  pthread_mutex_destroy(&idleLock);
+}
+
+//-----------------------------------------------------------------------------
+// addStrand
+// Creates a strand
+//
+// @pre:   None
+// @post:  None
+// @returns WorkStrand*: A strand without tasks, deleted with removeStrand
+//-----------------------------------------------------------------------------
+WorkStrand* WorkPool::addStrand() {
+  WorkStrand* strand = new WorkStrand;
+  pthread_mutex_init(&strand->lock, NULL);
+  strand->scheduled = false;
+  return strand;
+}
+
+//-----------------------------------------------------------------------------
+// removeStrand
+// Runs a strand's remaining tasks and deletes it
+//
+// @pre:   No thread submits to the strand any more; not called from a task
+// @post:  strand is deleted
+// @param  strand: The strand
+//-----------------------------------------------------------------------------
+void WorkPool::removeStrand(WorkStrand* strand) {
+  flush(strand);
+  //The worker that ran the marker may still be finishing its batch
+  bool running = true;
+  while (running) {
+    pthread_mutex_lock(&strand->lock);
+    running = strand->scheduled;
+    pthread_mutex_unlock(&strand->lock);
+    if (running) {
+      sched_yield();
+    }
+  }
+  pthread_mutex_destroy(&strand->lock);
+  delete strand;
+}
+
+//-----------------------------------------------------------------------------
+// submit
+// Queues a task on a strand
+//
+// @pre:   strand was returned by addStrand
+// @post:  A worker will call function(context, argument) after the tasks
+//         submitted to the strand before it
+// @param  strand:   The strand
+// @param  function: The task
+// @param  context:  First argument of function
+// @param  argument: Second argument of function
+//-----------------------------------------------------------------------------
+void WorkPool::submit(WorkStrand* strand, WorkFunction function,
+    void* context, void* argument) {
+  WorkItem item;
+  item.function = function;
+  item.context = context;
+  item.argument = argument;
+  pthread_mutex_lock(&strand->lock);
+  strand->items.push_back(item);
+  bool idle = !strand->scheduled;
+  strand->scheduled = true;
+  pthread_mutex_unlock(&strand->lock);
+  if (idle) {
+    schedule(strand, __sync_fetch_and_add(&nextWorker, 1) % workers.size());
+  }
+}
+
+//-----------------------------------------------------------------------------
+// flush
+// Waits until every task submitted to a strand so far has run
+//
+// @pre:   Not called from a task
+// @post:  None
+// @param  strand: The strand
+//-----------------------------------------------------------------------------
+void WorkPool::flush(WorkStrand* strand) {
+  flushMarker marker;
+  pthread_mutex_init(&marker.lock, NULL);
+  pthread_cond_init(&marker.ran, NULL);
+  marker.done = false;
+  submit(strand, markFlushed, &marker, NULL);
+  pthread_mutex_lock(&marker.lock);
+  while (!marker.done) {
+    pthread_cond_wait(&marker.ran, &marker.lock);
+  }
+  pthread_mutex_unlock(&marker.lock);
+  pthread_cond_destroy(&marker.ran);
+  pthread_mutex_destroy(&marker.lock);
+}
+
+//-----------------------------------------------------------------------------
+// getWorkers
+// Returns the number of worker threads
+//
+// @pre:   None
+// @post:  None
+// @returns int: The count given to the constructor
+//-----------------------------------------------------------------------------
+int WorkPool::getWorkers() const {
+  return workers.size();
+}
+
+//-----------------------------------------------------------------------------
+// getTasks
+// Returns the number of tasks run
+//
+// @pre:   None
+// @post:  None
+// @returns long long: Tasks run by every worker
+//-----------------------------------------------------------------------------
+long long WorkPool::getTasks() const {
+  long long tasks = 0;
+  for (size_t i = 0; i < workers.size(); i++) {
+    tasks += workers[i]->tasks;
+  }
+  return tasks;
+}
+
+//-----------------------------------------------------------------------------
+// getSteals
+// Returns the number of strands workers took from each other
+//
+// @pre:   None
+// @post:  None
+// @returns long long: Steals by every worker
+//-----------------------------------------------------------------------------
+long long WorkPool::getSteals() const {
+  long long steals = 0;
+  for (size_t i = 0; i < workers.size(); i++) {
+    steals += workers[i]->steals;
+  }
+  return steals;
+}
+
+//-----------------------------------------------------------------------------
+// workerThread
+// Thread function of a worker: runs strands until the pool is destroyed and
+// no strand has tasks left
+//
+// @pre:   arg is the worker
+// @post:  None
+// @param  arg: A void pointer to the worker
+//-----------------------------------------------------------------------------
+void* WorkPool::workerThread(void* arg) {
+  worker* self = (worker*)arg;
+  WorkPool* pool = self->pool;
+  while (true) {
+    WorkStrand* strand = pool->take(self);
+    if (strand != NULL) {
+      pool->run(strand, self);
+      continue;
+    }
+    pthread_mutex_lock(&pool->idleLock);
+    while (pool->readyStrands == 0 && !pool->stopping) {
+      pool->idleWorkers++;
+      pthread_cond_wait(&pool->workReady, &pool->idleLock);
+      pool->idleWorkers--;
+    }
+    bool finished = pool->readyStrands == 0 && pool->stopping;
+    pthread_mutex_unlock(&pool->idleLock);
+    if (finished) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// schedule
+// Puts a strand with tasks at the back of a worker's deque and wakes an idle
+// worker to run or steal it
+//
+// @pre:   The strand is marked scheduled and in no deque
+// @post:  The strand is in the worker's deque
+// @param  strand: The strand
+// @param  index:  The worker
+//-----------------------------------------------------------------------------
+void WorkPool::schedule(WorkStrand* strand, int index) {
+  worker* target = workers[index];
+  pthread_mutex_lock(&target->lock);
+  target->ready.push_back(strand);
+  pthread_mutex_unlock(&target->lock);
+  pthread_mutex_lock(&idleLock);
+  readyStrands++;
+  if (idleWorkers > 0) {
+    pthread_cond_signal(&workReady);
+  }
+  pthread_mutex_unlock(&idleLock);
+}
+
+//-----------------------------------------------------------------------------
+// take
+// Takes the strand at the front of a worker's own deque or, if it is empty,
+// steals the one at the back of another worker's deque
+//
+// @pre:   None
+// @post:  The strand returned is in no deque
+// @param  self:        The worker
+// @returns WorkStrand*: The strand to run, NULL if every deque is empty
+//-----------------------------------------------------------------------------
+WorkStrand* WorkPool::take(worker* self) {
+  WorkStrand* strand = NULL;
+  pthread_mutex_lock(&self->lock);
+  if (!self->ready.empty()) {
+    strand = self->ready.front();
+    self->ready.pop_front();
+  }
+  pthread_mutex_unlock(&self->lock);
+  for (size_t i = 1; strand == NULL && i < workers.size(); i++) {
+    worker* victim = workers[(self->index + i) % workers.size()];
+    pthread_mutex_lock(&victim->lock);
+    if (!victim->ready.empty()) {
+      strand = victim->ready.back();
+      victim->ready.pop_back();
+      self->steals = self->steals + 1;
+    }
+    pthread_mutex_unlock(&victim->lock);
+  }
+  if (strand != NULL) {
+    pthread_mutex_lock(&idleLock);
+    readyStrands--;
+    pthread_mutex_unlock(&idleLock);
+  }
+  return strand;
+}
+
+//-----------------------------------------------------------------------------
+// run
+// Runs up to WORK_STRAND_BATCH tasks of a strand, then puts it back on the
+// worker's deque if it has more
+//
+// @pre:   The strand was returned by take
+// @post:  The strand is scheduled again, or no longer scheduled if empty
+// @param  strand: The strand
+// @param  self:   The worker running it
+//-----------------------------------------------------------------------------
+void WorkPool::run(WorkStrand* strand, worker* self) {
+  WorkItem batch[WORK_STRAND_BATCH];
+  int count = 0;
+  pthread_mutex_lock(&strand->lock);
+  while (count < WORK_STRAND_BATCH && !strand->items.empty()) {
+    batch[count++] = strand->items.front();
+    strand->items.pop_front();
+  }
+  pthread_mutex_unlock(&strand->lock);
+  for (int i = 0; i < count; i++) {
+    batch[i].function(batch[i].context, batch[i].argument);
+  }
+  self->tasks = self->tasks + count;
+  pthread_mutex_lock(&strand->lock);
+  bool more = !strand->items.empty();
+  strand->scheduled = more;
+  pthread_mutex_unlock(&strand->lock);
+  if (more) {
+    schedule(strand, self->index);
+  }
+}
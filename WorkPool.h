@@ -0,0 +1,139 @@
+#ifndef WORKPOOL_H_
+#define WORKPOOL_H_
+
+#include <pthread.h>
+#include <deque>
+#include <vector>
+
+using namespace std;
+
+const int WORK_STRAND_BATCH = 32;  //Tasks a worker runs from one strand
+                                   //before other strands get a turn
+
+//A task: function(context, argument) runs on a pool thread
+typedef void (*WorkFunction)(void* context, void* argument);
+
+struct WorkItem {
+  WorkFunction function;
+  void* context;
+  void* argument;
+};
+
+//A FIFO of tasks that run in order, on one pool thread at a time
+struct WorkStrand {
+  pthread_mutex_t lock;       //Guards items and scheduled
+  deque<WorkItem> items;
+  bool scheduled;             //In a worker's ready deque or running
+};
+
+//-----------------------------------------------------------------------------
+// Class:       WorkPool
+// Description: A fixed set of threads that run tasks submitted to strands.
+//              The tasks of one strand run in submission order and never two
+//              at once, so a strand can own a resource, like a peer's output,
+//              without a lock of its own; different strands run in parallel.
+//
+//              Each worker keeps a deque of strands that have tasks. A
+//              strand with new work goes to the back of a deque, the worker
+//              runs strands from the front of its own deque, and a worker
+//              whose deque is empty steals from the back of another's, so
+//              busy strands spread over every core. A strand that still has
+//              tasks after WORK_STRAND_BATCH goes back to the end of its
+//              worker's deque, where it may be stolen.
+//-----------------------------------------------------------------------------
+class WorkPool {
+ public:
+  //---------------------------------------------------------------------------
+  // WorkPool Constructor
+  // Starts the worker threads
+  //
+  // @pre:   workers > 0
+  // @post:  The workers wait for tasks
+  // @param  workers: Number of threads
+  //---------------------------------------------------------------------------
+  WorkPool(int workers);
+
+  //---------------------------------------------------------------------------
+  // WorkPool Destructor
+  // Runs every task already submitted, then stops the workers
+  //
+  // @pre:   No thread submits any more tasks
+  // @post:  The worker threads have exited; strands are not deleted
+  //---------------------------------------------------------------------------
+  ~WorkPool();
+
+  //---------------------------------------------------------------------------
+  // addStrand / removeStrand
+  // Create a strand, or run a strand's remaining tasks and delete it
+  //
+  // @pre:   removeStrand: no thread submits to the strand any more
+  // @post:  None
+  //---------------------------------------------------------------------------
+  WorkStrand* addStrand();
+  void removeStrand(WorkStrand* strand);
+
+  //---------------------------------------------------------------------------
+  // submit
+  // Queues a task on a strand
+  //
+  // @pre:   strand was returned by addStrand
+  // @post:  A worker will call function(context, argument) after the tasks
+  //         submitted to the strand before it
+  //---------------------------------------------------------------------------
+  void submit(WorkStrand* strand, WorkFunction function, void* context,
+      void* argument);
+
+  //---------------------------------------------------------------------------
+  // flush
+  // Waits until every task submitted to a strand so far has run
+  //
+  // @pre:   Not called from a task
+  // @post:  None
+  // @param  strand: The strand
+  //---------------------------------------------------------------------------
+  void flush(WorkStrand* strand);
+
+  //---------------------------------------------------------------------------
+  // Accessors
+  // getWorkers: threads, getTasks: tasks run, getSteals: strands a worker
+  // took from another worker's deque
+  //---------------------------------------------------------------------------
+  int getWorkers() const;
+  long long getTasks() const;
+  long long getSteals() const;
+
+ private:
+  //A worker thread and its deque of strands with tasks
+  struct worker {
+    WorkPool* pool;
+    int index;
+    pthread_t thread;
+    pthread_mutex_t lock;           //Guards ready
+    deque<WorkStrand*> ready;
+    volatile long long tasks;       //Written by this worker only
+    volatile long long steals;
+  };
+
+  //Thread function of a worker
+  static void* workerThread(void* arg);
+
+  //Puts a strand with tasks on a worker's deque and wakes an idle worker
+  void schedule(WorkStrand* strand, int index);
+
+  //Takes a strand from a worker's own deque, or steals one; NULL if none
+  WorkStrand* take(worker* self);
+
+  //Runs up to WORK_STRAND_BATCH tasks of a strand
+  void run(WorkStrand* strand, worker* self);
+
+  vector<worker*> workers;
+  pthread_mutex_t idleLock;         //Guards readyStrands, idleWorkers and
+                                    //stopping
+  pthread_cond_t workReady;
+  int readyStrands;                 //Strands in the ready deques
+  int idleWorkers;
+  bool stopping;
+  unsigned int nextWorker;          //Round robin for outside submitters
+};
+
+#endif /* WORKPOOL_H_ */
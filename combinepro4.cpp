@@ -12,6 +12,20 @@
 
 // wait until a "quit" command is issued.
 
+// If interactive is false, only instantiates the data members and returns; the
+
+// caller runs the relay with start() and stop().
+
+// A config file, if given, is read here and applied by start() (see
+
+// loadConfig).
+
+// If takeoverPath is given, the relay takes over the sockets, links and
+
+// backlogs of a running relay that was told to "upgrade" on that path, instead
+
+// of opening its own; start() resumes relaying on them.
+
 //
 
 // @pre:   char* parameter is a valid IP number concatenated with a port number
@@ -20,11 +34,21 @@
 
 // @param *ipPlusPort:  The IP address and port number: (XXX.XXX.XXX.XXX:YYYYY)
 
-// @throw: throws invalid_argument if ipPlusPort is not the correct length
+// @param interactive:  False to embed the relay without a command thread
+
+// @param *configPath:  A config file (see RelayConfig), or NULL
+
+// @param *takeoverPath: The old relay's handoff socket (see handOff), or NULL
+
+// @throw: throws invalid_argument if ipPlusPort is not the correct length or
+
+//         the config file cannot be read, runtime_error if the takeover fails
 
 //-----------------------------------------------------------------------------
 
-UdpRelay::UdpRelay(const char* ipPlusPort) {
+UdpRelay::UdpRelay(const char* ipPlusPort, bool interactive,
+
+    const char* configPath, const char* takeoverPath) {
 
 
 
@@ -34,6 +58,62 @@ UdpRelay::UdpRelay(const char* ipPlusPort) {
 
   }
 
+  if (configPath != NULL && !config.load(configPath)) {
+
+    throw invalid_argument(config.getError());
+
+  }
+
+  this->configPath = configPath != NULL ? configPath : "";
+
+  quorum = 0;
+
+  ready = true;
+
+  reloading = 0;
+
+  hangupsSeen = 0;
+
+  laneCapacity = DEFAULT_LANE_CAPACITY;
+
+  handingOff = false;
+
+  listenSd = NULL_SD;
+
+  adminRunning = false;
+
+  pthread_mutex_init(&metricsLock, NULL);
+
+  metricsPort = 0;
+
+  metricsAddress = "";
+
+  metricsGeneration = 0;
+
+  ingestRing = new SpscRing();
+
+  pthread_mutex_init(&stageLock, NULL);
+
+  stageGeneration = 0;
+
+  remoteStageStopping = false;
+
+  udpLinkSd = NULL_SD;
+
+  udpLinkPort = 0;
+
+  udpLinkRunning = false;
+
+  pthread_mutex_init(&udpLinkLock, NULL);
+
+  tunnelRing = NULL;
+
+  redundantSequence = 0;
+
+  pthread_mutex_init(&fanoutLock, NULL);
+
+  fanoutPool = NULL;
+
 
 
   ipNumber = new char[16];
@@ -54,637 +134,3089 @@ UdpRelay::UdpRelay(const char* ipPlusPort) {
 
   sem_init(&mutex, 0, 0);
 
+  pthread_mutex_init(&cxnLock, NULL);
 
+  pthread_mutex_init(&ruleLock, NULL);
 
-  pthread_t commandThreadID;
-
-  pthread_create(&commandThreadID, NULL, commandThread, (void*)this);
+  weightedSchedule = false;
 
-  pthread_t inRelayThreadID;
+  for (int i = 0; i < NUM_PRIORITIES; i++) {
 
-  pthread_create(&inRelayThreadID, NULL, relayInThread, (void*)this);
+    scheduleWeights[i] = 1;
 
-  pthread_t acceptRelayThreadID;
+  }
 
-  pthread_create(&acceptRelayThreadID, NULL, acceptThread, (void*)this);
+  rebroadcastQueue = new PacketQueue();
 
+  pthread_mutex_init(&traceLock, NULL);
 
+  traceSampleRate = 0;
 
-  sem_wait(&mutex);
+  traceCounter = 0;
 
-  pthread_cancel(commandThreadID);
+  lowLatency = false;
 
-  pthread_cancel(inRelayThreadID);
+  busyPollUs = 0;
 
-  pthread_cancel(acceptRelayThreadID);
+  affinityGeneration = 0;
 
-}
+  timestampMode = TIMESTAMPS_OFF;
 
+  timestampGeneration = 0;
 
+  peerGeneration = 0;
 
-//-----------------------------------------------------------------------------
+  pthread_mutex_init(&latencyLock, NULL);
 
-// UdpRelay Destructor
+  running = false;
 
-// Deletes any dynamically allocated data members
+  started = false;
 
-//
+  liveWorkers = 0;
 
-// @pre:   None
+  pthread_mutex_init(&workerLock, NULL);
 
-// @post:  char * ipNumber is deleted
+  pthread_cond_init(&workersDone, NULL);
 
-//-----------------------------------------------------------------------------
+  pthread_mutex_init(&subscriberLock, NULL);
 
-UdpRelay::~UdpRelay() {
+  subscriberCount = 0;
 
-  if (ipNumber != NULL) {
+  nextSubscriberID = 1;
 
-    delete[] ipNumber;
+  pthread_mutex_init(&shmLock, NULL);
 
-    ipNumber = NULL;
+  shmRingCount = 0;
 
-  }
+  heartbeatMs = DEFAULT_HEARTBEAT_MS;
 
-  if(relaySock != NULL) {
+  heartbeatMisses = DEFAULT_HEARTBEAT_MISSES;
 
-    delete relaySock;
+  backlogPackets = DEFAULT_BACKLOG_PACKETS;
 
-    relaySock = NULL;
+  spillDirectory = "";
 
-  }
+  replayRate = DEFAULT_REPLAY_RATE;
 
-}
+  journaling = false;
 
+  journalDirectory = "";
 
+  replaying = 0;
 
-//-----------------------------------------------------------------------------
+  capturing = false;
 
-// sendLocalMessage
+  captureRing = NULL;
 
-// Broadcasts the char* parameter via UDP
+  capturePath = "";
 
-//
+  captureFilter = NULL;
 
-// @pre:   currentMessage is not NULL
+  captureCount = 0;
 
-// @post:  currentMessage is broadcast via UDP
+  captured = 0;
 
-// @param  *currentMessage: The message to broadcast UDP
+  captureDropped = 0;
 
-//-----------------------------------------------------------------------------
+  headerVersion = DEFAULT_HEADER_VERSION;
 
-void UdpRelay::sendLocalMessage(char * currentMessage) {
+  groupAddress = ntohl(inet_addr(ipNumber));
 
-  UdpMulticast udp(ipNumber, portNumber);
+  pthread_mutex_init(&nodeLock, NULL);
 
-  if(udp.getClientSocket() == NULL_SD) {
+  identity = NULL;
 
-    cout << "UdpMulticast client socket could not be obtained." << endl;
+  bloomTtl = DEFAULT_BLOOM_TTL;
 
-    return;
+  //6 hashes give the fewest false positives at DEFAULT_BLOOM_TTL
 
-  }
+  publishIdentity(groupAddress & 0xFFFF, DEFAULT_BLOOM_BYTES / BLOOM_WORD_SIZE,
 
-  udp.multicast(currentMessage);
+      6);
 
-}
+  nodeAddresses[identity->nodeId] = groupAddress;
 
+  addressNodes[groupAddress] = identity->nodeId;
 
+  maxPayload = DEFAULT_MAX_PAYLOAD;
 
-//-----------------------------------------------------------------------------
+  fragmentSize = 0;
 
-// recvLocalMessage
+  fragmentSequence = 0;
 
-// Receives a local UDP broadcast
+  //Relays sharing a group also share groupAddress, so fragments carry an ID
 
-//
+  //of their own
 
-// @pre:   currentMessage is not NULL and is of at least SIZE length
+  fragmentSource = ((unsigned int)getpid() << 16) ^
 
-// @post:  The message received via UDP is copied into currentMessage
+      (unsigned int)realtimeMicros();
 
-// @param  *currentMessage: The buffer that will contain the message received
+  oversized = 0;
 
-//-----------------------------------------------------------------------------
+  hopLimited = 0;
 
-void UdpRelay::recvLocalMessage(char * currentMessage) {
+  nodeCollisions = 0;
 
-  UdpMulticast udp(ipNumber, portNumber);
+  reassembler = new Reassembler(MAX_PACKET_SIZE - 1);
 
-  if(udp.getServerSocket() == NULL_SD) {
+  localRecvGroup = new UdpMulticast(ipNumber, portNumber);
 
-    cout << "UdpMulticast server socket could not be obtained." << endl;
+  if(takeoverPath != NULL) {
 
-    return;
+    //The old relay's multicast socket is already in the group
 
-  }
+    if(!takeOver(takeoverPath)) {
 
-  while (true) {
+      throw runtime_error(string("Cannot take over from ") + takeoverPath);
 
-    if (udp.recv(currentMessage, SIZE)) {
+    }
 
-      break;
+  } else {
 
-    }
+    localRecvSd = localRecvGroup->getServerSocket();
 
   }
 
-}
+  localSendGroup = new UdpMulticast(ipNumber, portNumber);
 
+  if(localSendGroup->getClientSocket() == NULL_SD) {
 
+    cout << "UdpMulticast client socket could not be obtained." << endl;
 
-//-----------------------------------------------------------------------------
+  }
 
-// commandThread
 
-// A static class method that is a thread function for the command thread
 
-//
+  if(!interactive) {
 
-// @pre:   *arg parameter represents a valid UdpRelay object
+    return;
 
-// @post:  Acts based on user input, eventually terminating upon quit command
+  }
 
-// @param  *arg:  A void pointer to the UdpRelay object creating the thread
+  start();
 
-//-----------------------------------------------------------------------------
-void* UdpRelay::commandThread(void* arg)
-{
-	string input = "";
-	string argument = "";
-	UdpRelay* oneUdpRelay = (UdpRelay*)arg;
-	while(true)
-	{
-		
-    string input = "";
-    string address = "";
-    cout << "% ";
-    cin >> input;
-    int position = address.find(":");
-    string ipAddress = "";
-    string port = "";
-		if(input == "add")
-		{	
-        cin >> address;
-        int position = address.find(":");
-        for (int i = 0; i < position; i++)
-      	{
-      		ipAddress += address[i];
-      	}
-    	  for (int i = position + 1; i< input.size(); i++)
-      	{
-      		port += address[i];
-      	}
-		
-			//argument = oneUdpRelay->getArgument(input,4);
-			oneUdpRelay->addRemoteIP(ipAddress);
-		}
-		else if(input == "delete")
-		{
-    		cin >> address;
-    		int position = address.find(":");
-    		for (int i = 0; i < position; i++)
-    		{
-    			ipAddress += address[i];
-    		}
-    		for (int i = position + 1; i < address.size(); i++)
-    		{
-    			port += address[i];
-    		}
-			  oneUdpRelay->terminateRemoteCxn(ipAddress);		
-		}
-		else if(input == "show")
-		{
-			oneUdpRelay->showTCPConnections();	
-		}
-		else if(input == "help")
-		{
-			oneUdpRelay->displayHelpMenu();
-		}
-		else if(input == "quit")
-		{
-			//-------------------------implementation of quit()------------------------
-			break;
-		}
-		else
-		{
-			cout<<"illegal command!"<<endl;
-			oneUdpRelay->displayHelpMenu();	
-		}
-	}
-}
+  pthread_t commandThreadID;
 
+  pthread_create(&commandThreadID, NULL, commandThread, (void*)this);
 
-string UdpRelay::getArgument(string input, int index)
-{
-	string argument = "";
-	for(int i = index; i < input.size(); i++)
-	{
-		argument += input[i]; 
-	}
-	return argument;
-			
-}
 
 
-//
-//void* UdpRelay::commandThread(void* arg) {
-//
-//  UdpRelay* sourceUdpRelay = (UdpRelay*)arg;
-//
-//  string currCommand = "";
-//
-//  string commandParam = "";
-//
-//  while (true) {
-//
-//    cout << "% ";
-//
-//    cin >> currCommand;
-//
-//    if (currCommand.compare(0, 3, "add") == 0) {
-//
-//      cin >> commandParam;
-//
-//      sourceUdpRelay->addRemoteIP(commandParam);
-//
-//    } else if (currCommand == "delete") {
-//
-//      cin >> commandParam;
-//
-//      sourceUdpRelay->terminateRemoteCxn(commandParam);
-//
-//    } else if (currCommand == "show") {
-//
-//      sourceUdpRelay->showTCPConnections();
-//
-//    } else if (currCommand == "help") {
-//
-//      sourceUdpRelay->displayHelpMenu();
-//
-//    } else if (currCommand == "quit") {
-//
-//      sourceUdpRelay->terminateAllTcpConnections();
-//
-//      sem_post(&sourceUdpRelay->mutex);
-//
-//      break;
-//
-//    } else {
-//
-//      cout << "Command not recognized." << endl;
-//
-//      sourceUdpRelay->displayHelpMenu();
-//
-//      continue;
-//
-//    }
-//
-//  }
-//
-//}
+  sem_wait(&mutex);
 
+  pthread_join(commandThreadID, NULL);
 
+  stop();
 
-//-----------------------------------------------------------------------------
+}
 
-// relayInThread
 
-// A static class method that is a thread function for the relayIn thread. It
 
-// loops continually, receiving UDP messages and sending them via TCP to nodes
+//-----------------------------------------------------------------------------
 
-// connected to this UdpRelay object
+// UdpRelay Destructor
 
-//
+// Deletes any dynamically allocated data members
 
-// @pre:   *arg parameter represents a valid UdpRelay object
+//
 
-// @post:  None
+// @pre:   None
 
-// @param  *arg:  A void pointer to the UdpRelay object creating the thread
+// @post:  char * ipNumber is deleted
 
 //-----------------------------------------------------------------------------
 
-void* UdpRelay::relayInThread(void* arg) {
+UdpRelay::~UdpRelay() {
 
-    UdpRelay * currInRelay = (UdpRelay*)arg;
+  stop();
 
-    char inPacket[SIZE] = {0};
+  if (ipNumber != NULL) {
 
-    while(true) {
+    delete[] ipNumber;
 
-      currInRelay->recvLocalMessage(inPacket);
+    ipNumber = NULL;
 
-      if(!currInRelay->isDuplicatePacket(inPacket)) {
+  }
 
-        currInRelay->putIPIntoPacket(inPacket);
+  if(relaySock != NULL) {
 
-        currInRelay->tcpMultiCastToRemoteGroups(inPacket);
+    delete relaySock;
 
-      }
+    relaySock = NULL;
 
-      memset(inPacket, 0, SIZE);
+  }
 
-    }
+  if(rebroadcastQueue != NULL) {
 
-}
+    delete rebroadcastQueue;
 
+    rebroadcastQueue = NULL;
 
+  }
 
-//-----------------------------------------------------------------------------
+  delete reassembler;
 
-// addRemoteIp
+  if(localRecvGroup != NULL) {
 
-// Takes a group IP/name and port number parameter and opens a TCP connection
+    delete localRecvGroup;
 
-// to that node. Sends the hostname of this machine to the remote node and
+    localRecvGroup = NULL;
 
-// updates the tcpCxns map
+  }
 
-//
+  if(localSendGroup != NULL) {
 
-// @pre:   remoteGroupID parameter is a valid group IP and port number
+    delete localSendGroup;
 
-// @post:  Socket is opened for TCP and tcpCxns map is updated
+    localSendGroup = NULL;
 
-// @param  remoteGroupID: An group IP/name and port (XXX.XXX.XXX.XXX:YYYYY)
+  }
 
-//-----------------------------------------------------------------------------
+  pthread_mutex_lock(&fanoutLock);
 
-//void UdpRelay::addNode(string address)
-void UdpRelay::addRemoteIP(string ipAddress)
-{
-	//Adds a TCP connection to a remote network segment or group 
-	char* ipAddr = new char[1024];
-	//change the addres from string to char*
-	memset(ipAddr, 0, 1024);
-	strcpy(ipAddr,ipAddress.c_str());
-	
-	int sd = relaySock->getClientSocket(ipAddr);
-		
-	if(sd < 0)
-	{
-		cerr<<"TCP connection failed!"<<endl;
-	}
-	
-	else
-	{
-		//instantiates relayOutThread 
-		//check if the ip address is already included in the relayOutConnections 
-		//if(udpRelayOutConnections.count(ipAddress) > 0) 
-    if(tcpCxns.count(ipAddress) > 0) 
-		{
-			//cancel the pthread
-			//int cancelResult = pthread_cancel(workingThreads.find(sd));
-			int cancelResult = pthread_cancel(outThreads[sd]);
-			
-			if (cancelResult != 0)
-			{
-				cerr << "pthread cancel failed in acceptThread" << endl;
-				exit(EXIT_FAILURE);
-			}
-			
-			/*close(udpRelayOutConnections[ipAddress]);-----------------------------------------------
-			udpRelayOutConnections.erase(ipAddress);
-			workingThreads.erase(ipAddress);*/
-			
-			close(tcpCxns[ipAddress]);
-			tcpCxns.erase(ipAddress);
-			outThreads.erase(sd);
-      
- 		}
-		
+  flushFanout();
 
-	/* 		if(outThreads.count(sd) > 0) {
-	  if(expiredOutThreads.size() > 5) {
-		while(!expiredOutThreads.empty()) {
-		  pthread_join(expiredOutThreads.front(), NULL);
-		  expiredOutThreads.pop();
-		}
-	  }
-	  outThreads.erase(sd);
-	}*/
-		
-	    // Add a new TCP connection
-		
-		//---------------------------------------change-----------------------------------------------------------
-		//ThreadPara* para = new ThreadPara(this,ipAddr,sd); 		
-		outThreadInfo* para = new outThreadInfo(this, ipAddr,sd);
-		
-		//int pthreadCreation = pthread_create(workingThreads[sd], NULL, relayOutThread, (void*)para);
-		int pthreadCreation = pthread_create(&outThreads[sd], NULL, relayOutThread, (void*)para);
-		
-		if(pthreadCreation != 0)
-		{
-			cerr<<"Thread creation failed!"<<endl;
-			exit(EXIT_FAILURE);
-		}
-		
-		//update the working threads and udp connection list.
-		outThreads.insert(pair<int,pthread_t>(sd,sd));
-		tcpCxns[ipAddr] = sd;
-		cout << "Registered: " << ipAddress << endl;
-		cout<< "Added: "<<ipAddr<< ":"<<sd<<endl;
-				
-		//--------------------send the hostName to remote node---------------
-		char hostName[1024];
-		hostName[1024] = '\0';
-		gethostname(hostName, 1024);
-		send(sd, hostName, 1024, 0);	
-	}
-	
-}
+  for(size_t i = 0; i < fanoutShards.size(); i++) {
 
+    fanoutPool->removeStrand(fanoutShards[i]);
 
+  }
 
-/*void UdpRelay::addRemoteIP(string remoteGroupID) {
+  fanoutShards.clear();
 
-  const char DELIMITER = ':';
+  delete fanoutPool;
 
-  const int DELIM_POS = remoteGroupID.find(DELIMITER);
+  fanoutPool = NULL;
 
-  const int LENGTH = remoteGroupID.length();
+  pthread_mutex_unlock(&fanoutLock);
 
-  string remoteIPAddress = remoteGroupID.substr(0, DELIM_POS);
+  pthread_mutex_destroy(&fanoutLock);
 
-  string remotePort = remoteGroupID.substr(DELIM_POS + 1, LENGTH);
+  pthread_mutex_destroy(&cxnLock);
 
-  int sd = 0;
+  pthread_mutex_destroy(&ruleLock);
 
-  char* clientSock = new char[GROUP_LENGTH];
+  pthread_mutex_destroy(&traceLock);
 
-  memset(clientSock, 0, GROUP_LENGTH);
+  pthread_mutex_destroy(&latencyLock);
 
-  strcpy(clientSock, remoteIPAddress.c_str());
+  pthread_mutex_destroy(&workerLock);
 
-  sd = relaySock->getClientSocket(clientSock);
+  pthread_cond_destroy(&workersDone);
 
-  cout << "Registered: " << clientSock << endl;
+  pthread_mutex_destroy(&subscriberLock);
 
-  if(sd == -1) {
+  for(map<string, volatile long long*>::iterator heard = heardTimes.begin();
 
-    cerr << "upd relay error establishing remote tcp connection" << endl;
+      heard != heardTimes.end(); heard++) {
+
+    delete heard->second;
 
   }
 
-  else {
+  //Threads cancelled by stop() or handOff leave their blocks registered
 
-    checkForDuplicateCxn(remoteGroupID);
+  for(size_t i = 0; i < counterBlocks.size(); i++) {
 
-    if(outThreads.count(sd) > 0) {
+    delete counterBlocks[i];
 
-      if(expiredOutThreads.size() > 5) {
+  }
 
-        while(!expiredOutThreads.empty()) {
+  for(size_t i = 0; i < latencyBlocks.size(); i++) {
 
-          pthread_join(expiredOutThreads.front(), NULL);
+    delete latencyBlocks[i];
 
-          expiredOutThreads.pop();
+  }
 
-        }
+  pthread_mutex_destroy(&metricsLock);
 
-      }
+  for(map<string, ShmRing*>::iterator curRingIt = shmInRings.begin();
 
-      outThreads.erase(sd);
+      curRingIt != shmInRings.end(); curRingIt++) {
 
-    }
+    delete curRingIt->second;
 
-    outThreads.insert(pair<int,pthread_t>(sd, sd));
+  }
 
-    tcpCxns[clientSock] = sd;
+  for(map<string, ShmRing*>::iterator curRingIt = shmOutRings.begin();
 
-    cout << "Added: " << clientSock << ":" << sd << endl;
+      curRingIt != shmOutRings.end(); curRingIt++) {
 
-    char hostName[GROUP_LENGTH] = {0};
+    delete curRingIt->second;
 
-    gethostname(hostName, GROUP_LENGTH);
+  }
 
-    send(sd, hostName, GROUP_LENGTH, 0);
+  pthread_mutex_destroy(&shmLock);
 
-    outThreadInfo * tempStruct = new outThreadInfo;
+  pthread_mutex_destroy(&nodeLock);
 
-    tempStruct->remoteHostName = remoteIPAddress;
+  delete ingestRing;
 
-    tempStruct->currentRelay = this;
+  pthread_mutex_destroy(&stageLock);
 
-    tempStruct->socketNumber = sd;
+  pthread_mutex_destroy(&udpLinkLock);
 
-    pthread_create(&outThreads[sd], NULL, relayOutThread, (void*)tempStruct);
+  if(captureRing != NULL) {
 
-  }
+    delete captureRing;
 
-  if(clientSock != NULL) {
+    captureRing = NULL;
 
-    delete clientSock;
+  }
 
-    clientSock = NULL;
+  for(size_t i = 0; i < captureFilters.size(); i++) {
+
+    delete captureFilters[i];
 
   }
 
-}*/
+  for(size_t i = 0; i < identities.size(); i++) {
 
+    delete identities[i];
+
+  }
 
+}
 
 //-----------------------------------------------------------------------------
 
-// checkForDuplicateCxn
+// start
 
-// Checks if the remote connection already exists and if it does, it deletes
+// Spins up the relayIn, local and remote stage, accept, rebroadcast, shmIn and
 
-// the already existing connection
+// heartbeat threads
 
 //
 
-// @pre:   string shall be a valid remote group id host name
+// @pre:   None
 
-// @post:  if a duplicate connection already existed, the previous connection
+// @post:  The relay forwards messages until stop() is called; links taken
 
-//         will be closed and deleted from the connections map. Otherwise,
+//         over from an old relay are resumed and the peers of a pending config
 
-//         there are no changes.
+//         file are connected
 
-// @param  const string& GRP_ID: remote host name
+// @returns bool: False if the relay was already started
 
 //-----------------------------------------------------------------------------
 
-void UdpRelay::checkForDuplicateCxn(const string& GRP_ID) {
+bool UdpRelay::start() {
 
-  if(tcpCxns.count(GRP_ID) > 0) {
+  if(started) {
 
-    close(tcpCxns[GRP_ID]);
+    return false;
 
-    tcpCxns.erase(tcpCxns.find(GRP_ID));
+  }
+
+  started = true;
+
+  running = true;
+
+  pthread_create(&localStageThreadID, NULL, localStageThread, (void*)this);
+
+  pthread_create(&remoteStageThreadID, NULL, remoteStageThread, (void*)this);
+
+  pthread_create(&relayInThreadID, NULL, relayInThread, (void*)this);
+
+  pthread_create(&acceptThreadID, NULL, acceptThread, (void*)this);
+
+  pthread_create(&rebroadcastThreadID, NULL, rebroadcastThread, (void*)this);
+
+  pthread_create(&shmInThreadID, NULL, shmInThread, (void*)this);
+
+  pthread_create(&heartbeatThreadID, NULL, heartbeatThread, (void*)this);
+
+  //Taken-over links first, so the config only connects peers that are new
+
+  adoptPeers();
+
+  if(!configPath.empty()) {
+
+    applyConfig(config);
 
   }
 
+  return true;
+
 }
 
+//-----------------------------------------------------------------------------
+
+// stop
+
+// Stops accepting and relaying messages, closes all TCP connections and waits
 
+// until every relay thread has exited. A stopped relay cannot be started
+
+// again.
+
+//
+
+// @pre:   None
+
+// @post:  No relay thread is running; subscribers are no longer called
 
 //-----------------------------------------------------------------------------
 
-// displayHelpMenu
+void UdpRelay::stop() {
 
-// Called by commandThread to send all available user commands to cout
+  stopAdmin();
+
+  if(!running) {
+
+    return;
+
+  }
+
+  running = false;
+
+  pthread_cancel(relayInThreadID);
+
+  pthread_cancel(acceptThreadID);
+
+  pthread_join(relayInThreadID, NULL);
+
+  pthread_join(acceptThreadID, NULL);
+
+  stopLocalStage();
+
+  pthread_join(shmInThreadID, NULL);
+
+  pthread_join(heartbeatThreadID, NULL);
+
+  stopUdpLinks();
+
+  terminateAllTcpConnections();
+
+  pthread_mutex_lock(&workerLock);
+
+  while(liveWorkers > 0) {
+
+    pthread_cond_wait(&workersDone, &workerLock);
+
+  }
+
+  pthread_mutex_unlock(&workerLock);
+
+  stopRemoteStage();
+
+  rebroadcastQueue->close();
+
+  pthread_join(rebroadcastThreadID, NULL);
+
+  journaling = false;
+
+  journal.close();
+
+  stopCapture();
+
+}
+
+//-----------------------------------------------------------------------------
+
+// publish
+
+// Sends a message from this process to every connected remote group and every
+
+// in-process subscriber, exactly as if it had been received on the local UDP
+
+// multicast group
 
 //
 
 // @pre:   None
 
-// @post:  None
+// @post:  The message is queued for all remote groups
+
+// @param  message: The message bytes; the wire format ends it at the first \0
+
+// @param  length:  Number of message bytes
+
+// @returns bool:   False if the relay is not running or the message does not
+
+//                  fit in a packet
 
 //-----------------------------------------------------------------------------
 
-void UdpRelay::displayHelpMenu() {
+bool UdpRelay::publish(const char* message, int length) {
+
+  char packet[MAX_PACKET_SIZE];
+
+  memset(packet, 0, SIZE);        //Short packets go out padded to SIZE
+
+  if(!running || length > maxPayload ||
+
+      !PacketHeader::build(packet, MAX_PACKET_SIZE, message, length)) {
+
+    return false;
+
+  }
+
+  long long arrivalUs = monotonicMicros();
+
+  deliverToSubscribers(packet);
+
+  relayLocalPacket(packet, MAX_PACKET_SIZE, arrivalUs);
+
+  return true;
 
-  cout << "UdpRelay.commandThread: accepts user command" << endl;
-	cout << "add remoteIP:remoteTcpPort : adds TCP connection to a remote network segment or group " << endl;
-	cout << "delete remoteIP : Remove TCP connection from remoteIP" << endl;
-	cout << "show : show current TCP connections" << endl;
-	cout << "help : summarize available commands" << endl;
-	cout << "quit : Terminate the UdpRelay program" << endl;
 }
 
+//-----------------------------------------------------------------------------
+
+// subscribe
+
+// Registers a callback for every message the relay delivers locally: all
+
+// messages received from remote groups and all messages published in this
+
+// process. Callbacks run on relay threads and must not call subscribe or
+
+// unsubscribe.
 
+//
+
+// @pre:   callback is not NULL
+
+// @post:  callback is called for each later message
+
+// @param  callback: The function to call
+
+// @param  context:  Passed unchanged to callback
+
+// @returns int:     Subscription ID for unsubscribe
 
 //-----------------------------------------------------------------------------
 
-// acceptThread
+int UdpRelay::subscribe(RelaySubscriber callback, void* context) {
 
-// A static class method that is a thread function for the accept thread, which
+  subscription entry;
 
-// loops continually accepting TCP connection requests
+  entry.callback = callback;
+
+  entry.context = context;
+
+  pthread_mutex_lock(&subscriberLock);
+
+  int subscriptionID = nextSubscriberID++;
+
+  subscribers[subscriptionID] = entry;
+
+  subscriberCount = subscribers.size();
+
+  pthread_mutex_unlock(&subscriberLock);
+
+  return subscriptionID;
+
+}
+
+//-----------------------------------------------------------------------------
+
+// unsubscribe
+
+// Removes a subscription. Once this returns the callback is not running and
+
+// will not be called again.
 
 //
 
-// @pre:   *arg parameter represents a valid UdpRelay object
+// @pre:   None
 
-// @post:  Opens a TCP connection socket and updates a connection map
+// @post:  The subscription no longer exists
 
-// @param  *arg:  A void pointer to the UdpRelay object creating the thread
+// @param  subscriptionID: A value returned by subscribe
 
 //-----------------------------------------------------------------------------
 
-void* UdpRelay::acceptThread(void* arg)
-{
-  UdpRelay* oneUdpRelay = (UdpRelay*)arg;
-  oneUdpRelay->threadAcception();
-	
+void UdpRelay::unsubscribe(int subscriptionID) {
+
+  pthread_mutex_lock(&subscriberLock);
+
+  subscribers.erase(subscriptionID);
+
+  subscriberCount = subscribers.size();
+
+  pthread_mutex_unlock(&subscriberLock);
+
 }
 
-void UdpRelay::threadAcception()
-{
-  int sd = 0;
-	char ipAddr[1024] ={0}; 
+//-----------------------------------------------------------------------------
 
-	while(true)
-	{
-		//sd = thisSocket->getServerSocket();------------------------------------------------------
-    sd = relaySock->getServerSocket();
-		recv(sd, ipAddr, 1024, 0);
-		string ipString(ipAddr);
+// deliverToSubscribers
+
+// Calls every in-process subscriber with the message of a packet
+
+//
+
+// @pre:   packet has valid packet format without a trace extension
+
+// @post:  None
+
+// @param  packet: The packet to deliver
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::deliverToSubscribers(const char* packet) {
+
+  if(subscriberCount == 0) {
+
+    return;
+
+  }
+
+  const char* message = packet + PacketHeader::getPayloadOffset(packet);
+
+  int length = PacketHeader::getLength(packet, MAX_PACKET_SIZE) -
+
+      (message - packet) - 1;
+
+  pthread_mutex_lock(&subscriberLock);
+
+  for(map<int, subscription>::iterator curSubIt = subscribers.begin();
+
+      curSubIt != subscribers.end(); curSubIt++) {
+
+    curSubIt->second.callback(message, length, curSubIt->second.context);
+
+  }
+
+  pthread_mutex_unlock(&subscriberLock);
+
+}
+
+//-----------------------------------------------------------------------------
+
+// addWorker
+
+// Counts a relayOut or relayEgress thread about to be spun up, so stop() can
+
+// wait for it
+
+//
+
+// @pre:   None
+
+// @post:  liveWorkers is incremented
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::addWorker() {
+
+  pthread_mutex_lock(&workerLock);
+
+  liveWorkers++;
+
+  pthread_mutex_unlock(&workerLock);
+
+}
+
+//-----------------------------------------------------------------------------
+
+// removeWorker
+
+// Called by a relayOut or relayEgress thread as its last access to this object
+
+//
+
+// @pre:   The thread was counted by addWorker
+
+// @post:  liveWorkers is decremented and stop() is woken when it reaches 0
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::removeWorker() {
+
+  pthread_mutex_lock(&workerLock);
+
+  liveWorkers--;
+
+  if(liveWorkers == 0) {
+
+    pthread_cond_broadcast(&workersDone);
+
+  }
+
+  pthread_mutex_unlock(&workerLock);
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// sendLocalMessage
+
+// Broadcasts the char* parameter via UDP on the relay's multicast client
+
+// socket, which is opened once in the constructor
+
+//
+
+// @pre:   currentMessage is not NULL
+
+// @post:  currentMessage is broadcast via UDP
+
+// @param  *currentMessage: The message to broadcast UDP
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::sendLocalMessage(char * currentMessage) {
+
+  int length = PacketHeader::getLength(currentMessage, MAX_PACKET_SIZE);
+
+  int mtu = fragmentSize > 0 ? fragmentSize : MAX_DATAGRAM_SIZE;
+
+  if(length < SIZE) {
+
+    localSendGroup->multicast(currentMessage);
+
+  } else if(length < mtu) {
+
+    sendLocalDatagram(currentMessage, length + 1);
+
+  } else {
+
+    sendLocalFragments(currentMessage, length, mtu);
+
+  }
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// sendLocalFragments
+
+// Multicasts a packet that is larger than the local group's MTU as fragment
+
+// frames of at most mtu bytes, which relays on the group reassemble
+
+//
+
+// @pre:   packet has valid packet format, mtu > FRAGMENT_HEADER_SIZE
+
+// @post:  Every fragment of the packet has been sent
+
+// @param  packet: The packet to send
+
+// @param  length: Bytes in the packet
+
+// @param  mtu:    Largest datagram to send
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::sendLocalFragments(const char* packet, int length, int mtu) {
+
+  char frame[MAX_DATAGRAM_SIZE];
+
+  unsigned int packetId = __sync_fetch_and_add(&fragmentSequence, 1);
+
+  int offset = 0;
+
+  while(offset < length) {
+
+    int carried = ControlFrame::buildFragment(frame, mtu, packetId,
+
+        fragmentSource, packet, length, offset);
+
+    sendLocalDatagram(frame, FRAGMENT_HEADER_SIZE + carried);
+
+    offset += carried;
+
+  }
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// sendLocalDatagram
+
+// Sends bytes to the local group as one datagram. UdpMulticast::multicast
+
+// always sends a SIZE byte frame, so larger packets go out here
+
+//
+
+// @pre:   bytes <= MAX_DATAGRAM_SIZE
+
+// @post:  The datagram has been sent
+
+// @param  datagram: The bytes to send
+
+// @param  bytes:    Number of bytes
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::sendLocalDatagram(const char* datagram, int bytes) {
+
+  struct sockaddr_in group;
+
+  memset(&group, 0, sizeof(group));
+
+  group.sin_family = AF_INET;
+
+  group.sin_port = htons(portNumber);
+
+  group.sin_addr.s_addr = inet_addr(ipNumber);
+
+  sendto(localSendGroup->getClientSocket(), datagram, bytes, 0,
+
+      (struct sockaddr*)&group, sizeof(group));
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// recvLocalMessage
+
+// Receives a local UDP broadcast on the relay's multicast server socket. In
+
+// low-latency mode the socket is polled without blocking and the thread spins,
+
+// yields, then sleeps while idle (see IdleBackoff)
+
+//
+
+// @pre:   currentMessage is not NULL and is of at least MAX_PACKET_SIZE
+
+//         length
+
+// @post:  The message received via UDP is copied into currentMessage,
+
+//         followed by a \0
+
+// @param  *currentMessage: The buffer that will contain the message received
+
+// @param  *kernelRxUs:     If not NULL, receives the kernel/NIC receive
+
+//         timestamp (realtime us) when timestamping is on, else 0
+
+// @returns int:            Bytes received, 0 if there is no socket, -1 if
+
+//                          the socket failed and must be reopened
+
+//-----------------------------------------------------------------------------
+
+int UdpRelay::recvLocalMessage(char * currentMessage,
+
+    long long * kernelRxUs) {
+
+  if(localRecvSd == NULL_SD) {
+
+    cout << "UdpMulticast server socket could not be obtained." << endl;
+
+    return 0;
+
+  }
+
+  IdleBackoff idle;
+
+  while (true) {
+
+    int flags = lowLatency ? MSG_DONTWAIT : 0;
+
+    long long stamp = 0;
+
+    int received = 0;
+
+    if (timestampMode != TIMESTAMPS_OFF) {
+
+      received = SocketTimestamps::recvWithTimestamp(localRecvSd,
+
+          currentMessage, MAX_PACKET_SIZE - 1, flags, stamp);
+
+    } else {
+
+      received = recv(localRecvSd, currentMessage, MAX_PACKET_SIZE - 1,
+
+          flags);
+
+    }
+
+    if (received > 0) {
+
+      if (kernelRxUs != NULL) {
+
+        *kernelRxUs = stamp;
+
+      }
+
+      currentMessage[received] = '\0';
+
+      return received;
+
+    }
+
+    if (received == 0 || errno == EINTR) {
+
+      continue;
+
+    }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+
+      //A broken socket fails the same way every time; retrying would spin
+
+      return -1;
+
+    }
+
+    if (flags != 0) {
+
+      idle.pause();
+
+    }
+
+  }
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// reopenLocalGroup
+
+// Replaces the multicast server socket after it failed: closes it and joins the
+
+// group again on a new one
+
+//
+
+// @pre:   Only relayIn calls it
+
+// @post:  localRecvSd is the new socket, or NULL_SD if none could be opened
+
+// @returns bool: False if no socket could be opened
+
+//-----------------------------------------------------------------------------
+
+bool UdpRelay::reopenLocalGroup() {
+
+  //Closes the old socket, so the new one can bind the port
+
+  delete localRecvGroup;
+
+  localRecvGroup = new UdpMulticast(ipNumber, portNumber);
+
+  localRecvSd = localRecvGroup->getServerSocket();
+
+  if(localRecvSd == NULL_SD) {
+
+    return false;
+
+  }
+
+  tuneSocket(localRecvSd);
+
+  cout << "UdpRelay: rejoined the local group" << endl;
+
+  return true;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// recvRemoteMessage
+
+// Receives one complete SIZE-byte frame from a TCP connection, polling
+
+// without blocking in low-latency mode. A jumbo frame is followed by the
+
+// packet it announces, which is received in its place. The calling thread can
+
+// be cancelled while it waits for a frame, never partway through one.
+
+//
+
+// @pre:   sd is a connected TCP socket, currentMessage holds MAX_PACKET_SIZE
+
+//         bytes
+
+// @post:  currentMessage holds the frame or packet, followed by a \0, if the
+
+//         return value is positive
+
+// @param  sd:             The socket to read
+
+// @param  currentMessage: The buffer that will contain the packet
+
+// @param  idle:           Backoff state of the calling thread
+
+// @param  kernelRxUs:     Receives the kernel/NIC receive timestamp of the
+
+//                         packet's first byte when timestamping is on, else 0
+
+// @returns int:           Bytes received (SIZE, or a jumbo packet's length),
+
+//                         or <= 0 if the connection closed, failed or
+
+//                         announced a packet larger than MAX_PACKET_SIZE
+
+//-----------------------------------------------------------------------------
+
+int UdpRelay::recvRemoteMessage(int sd, char * currentMessage,
+
+    IdleBackoff& idle, long long& kernelRxUs) {
+
+  int received = recvRemoteBytes(sd, currentMessage, SIZE, idle, kernelRxUs,
+
+      true);
+
+  if (received > 0 && ControlFrame::isControl(currentMessage) &&
+
+      ControlFrame::getType(currentMessage) == CONTROL_JUMBO) {
+
+    unsigned int length = ControlFrame::getSequence(currentMessage);
+
+    if (length >= (unsigned int)MAX_PACKET_SIZE) {
+
+      cerr << "UdpRelay: peer announced a " << length << "-byte packet"
+
+          << endl;
+
+      return -1;
+
+    }
+
+    long long packetRxUs = 0;
+
+    received = recvRemoteBytes(sd, currentMessage, length, idle, packetRxUs);
+
+  }
+
+  if (received > 0) {
+
+    currentMessage[received] = '\0';
+
+  }
+
+  return received;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// recvRemoteBytes
+
+// Receives exactly length bytes from a TCP connection, polling without
+
+// blocking in low-latency mode
+
+//
+
+// @pre:   sd is a connected TCP socket, buffer holds length bytes
+
+// @post:  buffer holds the bytes if the return value is positive
+
+// @param  sd:         The socket to read
+
+// @param  buffer:     Receives the bytes
+
+// @param  length:     Bytes to read
+
+// @param  idle:       Backoff state of the calling thread
+
+// @param  kernelRxUs: Receives the kernel/NIC receive timestamp of the first
+
+//                     byte when timestamping is on, else 0
+
+// @param  cancelable: Let the thread be cancelled until the first byte
+
+//                     arrives, so it stops only between frames
+
+// @returns int:       length, or <= 0 if the connection closed or failed
+
+//-----------------------------------------------------------------------------
+
+int UdpRelay::recvRemoteBytes(int sd, char * buffer, int length,
+
+    IdleBackoff& idle, long long& kernelRxUs, bool cancelable) {
+
+  int received = 0;
+
+  kernelRxUs = 0;
+
+  while (received < length) {
+
+    int flags = lowLatency ? MSG_DONTWAIT : 0;
+
+    int bytes = 0;
+
+    if (cancelable && received == 0) {
+
+      pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+    }
+
+    if (timestampMode != TIMESTAMPS_OFF) {
+
+      long long stamp = 0;
+
+      bytes = SocketTimestamps::recvWithTimestamp(sd,
+
+          buffer + received, length - received, flags, stamp);
+
+      if (received == 0) {
+
+        kernelRxUs = stamp;
+
+      }
+
+    } else {
+
+      bytes = recv(sd, buffer + received, length - received, flags);
+
+    }
+
+    if (cancelable && received == 0) {
+
+      pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    }
+
+    if (bytes > 0) {
+
+      received += bytes;
+
+      idle.reset();
+
+    } else if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+
+      idle.pause();
+
+    } else if (bytes < 0 && errno == EINTR) {
+
+      continue;
+
+    } else {
+
+      return bytes;
+
+    }
+
+  }
+
+  return received;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// sendAll
+
+// Writes a whole buffer to a TCP connection, resuming after short writes and
+
+// signals, so a frame is never cut off partway and the stream stays in step
+
+// with the peer's recvRemoteBytes
+
+//
+
+// @pre:   sd is a connected, blocking TCP socket
+
+// @post:  None
+
+// @param  sd:     The socket to write
+
+// @param  buffer: The bytes to send
+
+// @param  length: Number of bytes
+
+// @returns int:   length, or -1 if sending failed
+
+//-----------------------------------------------------------------------------
+
+int UdpRelay::sendAll(int sd, const char* buffer, int length) {
+
+  int sent = 0;
+
+  while(sent < length) {
+
+    int bytes = send(sd, buffer + sent, length - sent, MSG_NOSIGNAL);
+
+    if(bytes > 0) {
+
+      sent += bytes;
+
+    }
+
+    else if(bytes < 0 && errno == EINTR) {
+
+      continue;
+
+    }
+
+    else {
+
+      return -1;
+
+    }
+
+  }
+
+  return sent;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// sendFrames
+
+// Sends a packet on a TCP connection: as one SIZE-byte frame if it fits, else
+
+// to a peer that takes jumbo frames either whole after a jumbo frame or,
+
+// while fragmenting is on, as SIZE-byte fragment frames
+
+//
+
+// @pre:   sd is a connected TCP socket, packet holds max(length, SIZE) bytes
+
+// @post:  None
+
+// @param  sd:     The socket to write
+
+// @param  packet: The packet to send
+
+// @param  length: getFrameLength(packet)
+
+// @param  jumbo:  The peer offered CAPABILITY_JUMBO
+
+// @returns int:   Bytes sent, 0 if the packet is too large for the peer
+
+//                 (counted as oversized), < 0 if sending failed
+
+//-----------------------------------------------------------------------------
+
+int UdpRelay::sendFrames(int sd, const char* packet, int length, bool jumbo) {
+
+  if(length <= SIZE) {
+
+    return sendAll(sd, packet, SIZE);
+
+  }
+
+  if(!jumbo) {
+
+    __sync_fetch_and_add(&oversized, 1);
+
+    return 0;
+
+  }
+
+  char frame[SIZE];
+
+  if(fragmentSize == 0) {
+
+    ControlFrame::build(frame, SIZE, CONTROL_JUMBO, length, 0);
+
+    if(sendAll(sd, frame, SIZE) < 0 || sendAll(sd, packet, length) < 0) {
+
+      return -1;
+
+    }
+
+    return SIZE + length;
+
+  }
+
+  unsigned int packetId = __sync_fetch_and_add(&fragmentSequence, 1);
+
+  int sent = 0;
+
+  int offset = 0;
+
+  while(offset < length) {
+
+    int carried = ControlFrame::buildFragment(frame, SIZE, packetId,
+
+        fragmentSource, packet, length, offset);
+
+    memset(frame + FRAGMENT_HEADER_SIZE + carried, 0,
+
+        SIZE - FRAGMENT_HEADER_SIZE - carried);
+
+    if(sendAll(sd, frame, SIZE) < 0) {
+
+      return -1;
+
+    }
+
+    sent += SIZE;
+
+    offset += carried;
+
+  }
+
+  return sent;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// reassembleFragment
+
+// Passes a fragment frame received from a link or the local group to the
+
+// reassembler, and writes the packet over the frame once it is complete.
+
+// Fragments this relay sent itself are ignored.
+
+//
+
+// @pre:   isControl(frame), frame holds MAX_PACKET_SIZE bytes
+
+// @post:  frame holds the packet, followed by a \0, if the return value is
+
+//         positive
+
+// @param  source: The link the frame arrived on, or "local"
+
+// @param  frame:  The frame received
+
+// @param  length: Bytes received
+
+// @returns int:   The packet's length once complete, else 0
+
+//-----------------------------------------------------------------------------
+
+int UdpRelay::reassembleFragment(const string& source, char* frame,
+
+    int length) {
+
+  unsigned int packetId = 0;
+
+  unsigned int sender = 0;
+
+  int total = 0;
+
+  int offset = 0;
+
+  const char* data = NULL;
+
+  int dataLength = 0;
+
+  if(ControlFrame::getType(frame) != CONTROL_FRAGMENT ||
+
+      !ControlFrame::getFragment(frame, length, packetId, sender, total,
+
+      offset, data, dataLength) || sender == fragmentSource) {
+
+    return 0;
+
+  }
+
+  string key = source;
+
+  if(source == "local") {
+
+    //Every relay on the group fragments on its own
+
+    ostringstream senderKey;
+
+    senderKey << source << "/" << sender;
+
+    key = senderKey.str();
+
+  }
+
+  int complete = reassembler->add(key, packetId, total, offset, data,
+
+      dataLength, monotonicMicros(), frame);
+
+  if(complete <= 0) {
+
+    return 0;
+
+  }
+
+  frame[complete] = '\0';
+
+  return complete;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// isOversized
+
+// Returns true, and counts the packet, if its message is larger than the
+
+// configured maximum payload
+
+//
+
+// @pre:   packet has valid packet format and ends with a \0
+
+// @post:  None
+
+// @param  packet: The packet received
+
+// @returns bool:  True if the packet must be dropped
+
+//-----------------------------------------------------------------------------
+
+bool UdpRelay::isOversized(const char* packet) {
+
+  int message = PacketHeader::getLength(packet, MAX_PACKET_SIZE) -
+
+      PacketHeader::getPayloadOffset(packet) - 1;
+
+  if(message <= maxPayload) {
+
+    return false;
+
+  }
+
+  __sync_fetch_and_add(&oversized, 1);
+
+  return true;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// getFrameLength
+
+// Returns the bytes to queue for a packet: its length, but at least SIZE, the
+
+// size of a frame on the TCP connections
+
+//
+
+// @pre:   packet has valid packet format and its buffer holds at least SIZE
+
+//         bytes
+
+// @post:  None
+
+// @param  packet: The packet
+
+// @returns int:   max(PacketHeader::getLength(packet), SIZE)
+
+//-----------------------------------------------------------------------------
+
+int UdpRelay::getFrameLength(const char* packet) {
+
+  int length = PacketHeader::getLength(packet, MAX_PACKET_SIZE);
+
+  return length < SIZE ? SIZE : length;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// nextQueuedPacket
+
+// Pops the next packet from a queue, blocking normally or polling with backoff
+
+// in low-latency mode
+
+//
+
+// @pre:   queue is not NULL
+
+// @post:  On success the caller owns packet.data and must delete[] it
+
+// @param  queue:  The queue to pop
+
+// @param  packet: Receives the packet
+
+// @param  idle:   Backoff state of the calling thread
+
+// @returns bool:  False once the queue is closed and empty
+
+//-----------------------------------------------------------------------------
+
+bool UdpRelay::nextQueuedPacket(PacketQueue* queue, QueuedPacket& packet,
+
+    IdleBackoff& idle) {
+
+  while (lowLatency) {
+
+    if (queue->pop(packet, 0)) {
+
+      idle.reset();
+
+      return true;
+
+    }
+
+    if (queue->isClosed()) {
+
+      return false;
+
+    }
+
+    idle.pause();
+
+  }
+
+  return queue->pop(packet);
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// applyThreadAffinity
+
+// Pins the calling thread to the CPUs configured for its role if the
+
+// configuration changed since the thread last applied it
+
+//
+
+// @pre:   role is relayIn, relayOut, egress or rebroadcast
+
+// @post:  appliedGeneration equals the current configuration generation
+
+// @param  role:              The kind of thread calling
+
+// @param  appliedGeneration: The generation the thread last applied
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::applyThreadAffinity(const string& role,
+
+    int& appliedGeneration) {
+
+  int generation = affinityGeneration;
+
+  if (generation == appliedGeneration) {
+
+    return;
+
+  }
+
+  pthread_mutex_lock(&ruleLock);
+
+  string spec = threadAffinity.count(role) > 0 ? threadAffinity[role] : "";
+
+  pthread_mutex_unlock(&ruleLock);
+
+  if (!CpuAffinity::pinCurrentThread(spec)) {
+
+    cerr << "UdpRelay: could not pin " << role << " thread to " << spec
+
+        << endl;
+
+  }
+
+  appliedGeneration = generation;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// commandThread
+
+// A static class method that is a thread function for the command thread
+
+//
+
+// @pre:   *arg parameter represents a valid UdpRelay object
+
+// @post:  Acts based on user input, eventually terminating upon quit command
+
+// @param  *arg:  A void pointer to the UdpRelay object creating the thread
+
+//-----------------------------------------------------------------------------
+void* UdpRelay::commandThread(void* arg)
+{
+	UdpRelay* oneUdpRelay = (UdpRelay*)arg;
+	string line = "";
+	while(true)
+	{
+		cout << "% ";
+		if(!getline(cin, line))
+		{
+			//no console (e.g. started from a config file as a service); keep
+			//relaying until the process is killed
+			break;
+		}
+		if(!oneUdpRelay->executeCommand(line))
+		{
+			//-------------------------implementation of quit()------------------------
+			sem_post(&oneUdpRelay->mutex);
+			break;
+		}
+	}
+	return NULL;
+}
+
+
+
+//-----------------------------------------------------------------------------
+// executeCommand
+// Runs one console command line, as typed at the command thread or read from
+// a config file. Output goes to cout
+//
+// @pre:   None
+// @post:  The command has been carried out
+// @param  line:  The command and its arguments
+// @returns bool: False if the command was quit
+//-----------------------------------------------------------------------------
+bool UdpRelay::executeCommand(const string& line)
+{
+	stringstream commandStream(line);
+	string input = "";
+	string address = "";
+	string ipAddress = "";
+	string port = "";
+	if(!(commandStream >> input))
+	{
+		return true;
+	}
+	if(input == "add")
+	{	
+        commandStream >> address;
+        int position = address.find(":");
+        for (int i = 0; i < position; i++)
+      	{
+      		ipAddress += address[i];
+      	}
+    	  for (int i = position + 1; i< input.size(); i++)
+      	{
+      		port += address[i];
+      	}
+	
+		//argument = getArgument(input,4);
+		addRemoteIP(ipAddress);
+	}
+	else if(input == "delete")
+	{
+    		commandStream >> address;
+    		int position = address.find(":");
+    		for (int i = 0; i < position; i++)
+    		{
+    			ipAddress += address[i];
+    		}
+    		for (int i = position + 1; i < address.size(); i++)
+    		{
+    			port += address[i];
+    		}
+		  terminateRemoteCxn(ipAddress);		
+	}
+	else if(input == "priority")
+	{
+		string groupIP = "";
+		string className = "";
+		commandStream >> groupIP >> className;
+		setPriorityRule(groupIP, className);
+	}
+	else if(input == "tunnel")
+	{
+		string groupIP = "";
+		string mode = "";
+		commandStream >> groupIP >> mode;
+		if(groupIP.empty())
+		{
+			showTunnel();
+		}
+		else
+		{
+			setTunnelRule(groupIP, mode);
+		}
+	}
+	else if(input == "redundant")
+	{
+		string groupIP = "";
+		vector<string> paths;
+		string path = "";
+		commandStream >> groupIP;
+		while(commandStream >> path)
+		{
+			paths.push_back(path);
+		}
+		if(groupIP.empty())
+		{
+			showRedundancy();
+		}
+		else
+		{
+			setRedundancyRule(groupIP, paths);
+		}
+	}
+	else if(input == "conflate")
+	{
+		string name = "";
+		string offset = "";
+		string length = "";
+		string mode = "";
+		commandStream >> name >> offset >> length >> mode;
+		if(name.empty())
+		{
+			showConflation();
+		}
+		else if(offset == "off")
+		{
+			setConflation(name, 0, 0, false);
+		}
+		else if(length.empty() || (!mode.empty() && mode != "source"))
+		{
+			cout << "Usage: conflate name offset length [source] | conflate name off" << endl;
+		}
+		else
+		{
+			setConflation(name, atoi(offset.c_str()), atoi(length.c_str()),
+				mode == "source");
+		}
+	}
+	else if(input == "schedule")
+	{
+		string mode = "";
+		commandStream >> mode;
+		if(mode == "weighted")
+		{
+			int weights[NUM_PRIORITIES];
+			for(int i = 0; i < NUM_PRIORITIES; i++)
+			{
+				commandStream >> weights[i];
+			}
+			setSchedule(weights);
+		}
+		else
+		{
+			setSchedule(NULL);
+		}
+	}
+	else if(input == "trace")
+	{
+		string options = "";
+		getline(commandStream, options);
+		stringstream optionStream(options);
+		string mode = "";
+		optionStream >> mode;
+		if(mode == "on")
+		{
+			int sampleRate = 1;
+			optionStream >> sampleRate;
+			setTracing(sampleRate);
+		}
+		else if(mode == "off")
+		{
+			setTracing(0);
+		}
+		else
+		{
+			showTraces();
+		}
+	}
+	else if(input == "lowlatency")
+	{
+		string options = "";
+		getline(commandStream, options);
+		stringstream optionStream(options);
+		string mode = "";
+		int busyPoll = 0;
+		optionStream >> mode >> busyPoll;
+		setLowLatency(mode == "on", busyPoll);
+	}
+	else if(input == "pin")
+	{
+		string role = "";
+		string cpus = "";
+		commandStream >> role >> cpus;
+		setThreadAffinity(role, cpus);
+	}
+	else if(input == "timestamping")
+	{
+		string options = "";
+		getline(commandStream, options);
+		stringstream optionStream(options);
+		string mode = "";
+		string interface = "";
+		optionStream >> mode >> interface;
+		if(mode == "software")
+		{
+			setTimestamping(TIMESTAMPS_SOFTWARE, "");
+		}
+		else if(mode == "hardware")
+		{
+			setTimestamping(TIMESTAMPS_HARDWARE, interface);
+		}
+		else
+		{
+			setTimestamping(TIMESTAMPS_OFF, "");
+		}
+	}
+	else if(input == "latency")
+	{
+		showLatency();
+	}
+	else if(input == "shm")
+	{
+		string options = "";
+		getline(commandStream, options);
+		stringstream optionStream(options);
+		string mode = "";
+		string name = "";
+		int slots = DEFAULT_SHM_SLOTS;
+		optionStream >> mode >> name >> slots;
+		if(mode == "add")
+		{
+			addShmRing(name, slots);
+		}
+		else if(mode == "delete")
+		{
+			removeShmRing(name);
+		}
+		else
+		{
+			showShmRings();
+		}
+	}
+	else if(input == "stages")
+	{
+		showStages();
+	}
+	else if(input == "heartbeat")
+	{
+		string options = "";
+		getline(commandStream, options);
+		stringstream optionStream(options);
+		string interval = "";
+		int misses = DEFAULT_HEARTBEAT_MISSES;
+		optionStream >> interval >> misses;
+		if(interval == "off")
+		{
+			setHeartbeat(0, misses);
+		}
+		else
+		{
+			setHeartbeat(atoi(interval.c_str()), misses);
+		}
+	}
+	else if(input == "backlog")
+	{
+		string options = "";
+		getline(commandStream, options);
+		stringstream optionStream(options);
+		int packets = 0;
+		int rate = DEFAULT_REPLAY_RATE;
+		string directory = "";
+		optionStream >> packets >> rate >> directory;
+		if(directory == "none")
+		{
+			directory = "";
+		}
+		setStoreForward(packets, rate, directory);
+	}
+	else if(input == "journal")
+	{
+		string options = "";
+		getline(commandStream, options);
+		stringstream optionStream(options);
+		string mode = "";
+		string directory = "";
+		int segmentMB = DEFAULT_SEGMENT_MB;
+		int commitMs = DEFAULT_COMMIT_MS;
+		optionStream >> mode >> directory >> segmentMB >> commitMs;
+		if(mode == "on")
+		{
+			setJournal(directory, segmentMB, commitMs);
+		}
+		else if(mode == "off")
+		{
+			setJournal("", 0, 0);
+		}
+		else
+		{
+			cout << "journal: " << journal.getStatus() << endl;
+		}
+	}
+	else if(input == "capture")
+	{
+		string options = "";
+		getline(commandStream, options);
+		stringstream optionStream(options);
+		string mode = "";
+		string path = "";
+		optionStream >> mode >> path;
+		int sample = 1;
+		string peer = "";
+		unsigned int group = 0;
+		string filter = "";
+		while(optionStream >> filter)
+		{
+			string value = "";
+			optionStream >> value;
+			if(filter == "sample")
+			{
+				sample = atoi(value.c_str());
+			}
+			else if(filter == "peer")
+			{
+				peer = value;
+			}
+			else if(filter == "group")
+			{
+				group = ntohl(inet_addr(value.c_str()));
+			}
+		}
+		if(mode == "start")
+		{
+			if(path.empty() || sample <= 0)
+			{
+				cout << "Usage: capture start file [sample N] [peer name] [group IP]" << endl;
+			}
+			else if(!startCapture(path, sample, peer, group))
+			{
+				cout << "Could not start a capture into " << path << endl;
+			}
+		}
+		else if(mode == "stop")
+		{
+			stopCapture();
+		}
+		else if(capturing)
+		{
+			pthread_mutex_lock(&ruleLock);
+			string path = capturePath;
+			pthread_mutex_unlock(&ruleLock);
+			cout << "capture: " << path << ", " << captured
+				<< " packets, " << captureDropped << " dropped" << endl;
+		}
+		else
+		{
+			cout << "capture: off" << endl;
+		}
+	}
+	else if(input == "replay")
+	{
+		string options = "";
+		getline(commandStream, options);
+		stringstream optionStream(options);
+		double from = 0;
+		double to = 0;
+		double speed = 1;
+		string which = "all";
+		optionStream >> from >> to >> speed >> which;
+		//times <= 0 count back from now, so "replay -60 0" is the last minute
+		long long nowUs = realtimeMicros();
+		long long fromUs = from <= 0 ? nowUs + (long long)(from * 1000000)
+			: (long long)(from * 1000000);
+		long long toUs = to <= 0 ? nowUs + (long long)(to * 1000000)
+			: (long long)(to * 1000000);
+		int directions = JOURNAL_REPLAY_ALL;
+		if(which == "local")
+		{
+			directions = JOURNAL_LOCAL;
+		}
+		else if(which == "remote")
+		{
+			directions = JOURNAL_REMOTE;
+		}
+		pthread_mutex_lock(&ruleLock);
+		string directory = journalDirectory;
+		pthread_mutex_unlock(&ruleLock);
+		if(directory.empty())
+		{
+			cout << "No journal to replay; use journal on <dir> first." << endl;
+		}
+		else if(!replayJournal(directory, fromUs, toUs, speed,
+			directions))
+		{
+			cout << "A replay is already running." << endl;
+		}
+	}
+	else if(input == "header")
+	{
+		string options = "";
+		getline(commandStream, options);
+		stringstream optionStream(options);
+		string mode = "";
+		optionStream >> mode;
+		if(mode == "bloom")
+		{
+			int bytes = DEFAULT_BLOOM_BYTES;
+			int hashes = 0;
+			int ttl = DEFAULT_BLOOM_TTL;
+			optionStream >> bytes >> hashes >> ttl;
+			if(!setBloomFilter(bytes, hashes, ttl))
+			{
+				cout << "Usage: header bloom [bytes (32-64, a multiple of 8) [hashes (1-16, 0 = best for ttl) [ttl (1-255)]]]" << endl;
+			}
+		}
+		else if(mode == "1" || mode == "2" || mode == "3")
+		{
+			unsigned int node = 0;
+			optionStream >> node;
+			if(node > 0xFFFF ||
+				!setHeaderVersion(atoi(mode.c_str()), node))
+			{
+				cout << "The node ID can only change to a free ID (1-65535) while no connection is open." << endl;
+			}
+		}
+		else
+		{
+			showHeader();
+		}
+	}
+	else if(input == "payload")
+	{
+		string options = "";
+		getline(commandStream, options);
+		stringstream optionStream(options);
+		int payload = 0;
+		int fragment = 0;
+		if(!(optionStream >> payload))
+		{
+			showPayload();
+		}
+		else
+		{
+			optionStream >> fragment;
+			if(!setPayload(payload, fragment))
+			{
+				cout << "Usage: payload [bytes (1-65535) [fragment (0 or 256-65507)]]" << endl;
+			}
+		}
+	}
+	else if(input == "config")
+	{
+		string path = "";
+		commandStream >> path;
+		if(path.empty())
+		{
+			showConfig();
+		}
+		else
+		{
+			loadConfig(path);
+		}
+	}
+	else if(input == "reload")
+	{
+		reloadConfig();
+	}
+	else if(input == "upgrade")
+	{
+		string path = "";
+		commandStream >> path;
+		if(path.empty())
+		{
+			cout << "Usage: upgrade socketPath" << endl;
+		}
+		else if(handOff(path) || !running)
+		{
+			return false;	//passed on, or stopped by a failed handoff; quit
+		}
+	}
+	else if(input == "metrics")
+	{
+		string port = "";
+		string address = "";
+		commandStream >> port >> address;
+		if(port == "off")
+		{
+			setMetrics(0, "");
+		}
+		else if(!port.empty())
+		{
+			setMetrics(atoi(port.c_str()), address);
+		}
+		else
+		{
+			pthread_mutex_lock(&ruleLock);
+			cout << "metrics: ";
+			if(metricsPort > 0)
+			{
+				cout << "http://" << (metricsAddress.empty() ? "0.0.0.0" : metricsAddress)
+					<< ":" << metricsPort << "/metrics" << endl;
+			}
+			else
+			{
+				cout << "off" << endl;
+			}
+			pthread_mutex_unlock(&ruleLock);
+		}
+	}
+	else if(input == "fanout")
+	{
+		string workers = "";
+		commandStream >> workers;
+		if(workers == "off")
+		{
+			setFanout(0);
+		}
+		else if(workers == "auto")
+		{
+			setFanout(sysconf(_SC_NPROCESSORS_ONLN));
+		}
+		else if(!workers.empty())
+		{
+			setFanout(atoi(workers.c_str()));
+		}
+		else
+		{
+			pthread_mutex_lock(&fanoutLock);
+			int threads = fanoutPool != NULL ? fanoutPool->getWorkers() : 0;
+			size_t shards = fanoutShards.size();
+			size_t peerCount = fanoutPeers.size();
+			long long tasks = fanoutPool != NULL ? fanoutPool->getTasks() : 0;
+			long long steals = fanoutPool != NULL ? fanoutPool->getSteals() : 0;
+			pthread_mutex_unlock(&fanoutLock);
+			cout << "fanout: ";
+			if(threads > 0)
+			{
+				cout << threads << " threads, " << shards << " shards, "
+					<< peerCount << " peers, " << tasks << " tasks, "
+					<< steals << " steals" << endl;
+			}
+			else
+			{
+				cout << "inline" << endl;
+			}
+		}
+	}
+	else if(input == "udplink")
+	{
+		string mode = "";
+		string target = "";
+		commandStream >> mode >> target;
+		if(mode == "on")
+		{
+			setUdpLinks(target.empty() ? portNumber + UDPLINK_PORT_OFFSET : atoi(target.c_str()));
+		}
+		else if(mode == "off")
+		{
+			setUdpLinks(0);
+		}
+		else if(mode == "add")
+		{
+			addUdpLink(target);
+		}
+		else if(mode == "delete")
+		{
+			removeUdpLink(target);
+		}
+		else
+		{
+			showUdpLinks();
+		}
+	}
+	else if(input == "admin")
+	{
+		string path = "";
+		commandStream >> path;
+		if(path == "off")
+		{
+			stopAdmin();
+		}
+		else if(!path.empty())
+		{
+			startAdmin(path);
+		}
+		else
+		{
+			string current = admin.getPath();
+			cout << "admin socket: " << (current.empty() ? "off" : current) << endl;
+		}
+	}
+	else if(input == "queue")
+	{
+		int packets = 0;
+		if(commandStream >> packets)
+		{
+			setQueueCapacity(packets);
+		}
+		else
+		{
+			cout << "queue: " << laneCapacity << " packets per lane" << endl;
+		}
+	}
+	else if(input == "show")
+	{
+		showTCPConnections();	
+	}
+	else if(input == "help")
+	{
+		displayHelpMenu();
+	}
+	else if(input == "quit")
+	{
+		return false;
+	}
+	else
+	{
+		cout<<"illegal command!"<<endl;
+		displayHelpMenu();	
+	}
+	return true;
+}
+
+
+string UdpRelay::getArgument(string input, int index)
+{
+	string argument = "";
+	for(int i = index; i < input.size(); i++)
+	{
+		argument += input[i]; 
+	}
+	return argument;
+			
+}
+
+
+//
+//void* UdpRelay::commandThread(void* arg) {
+//
+//  UdpRelay* sourceUdpRelay = (UdpRelay*)arg;
+//
+//  string currCommand = "";
+//
+//  string commandParam = "";
+//
+//  while (true) {
+//
+//    cout << "% ";
+//
+//    cin >> currCommand;
+//
+//    if (currCommand.compare(0, 3, "add") == 0) {
+//
+//      cin >> commandParam;
+//
+//      sourceUdpRelay->addRemoteIP(commandParam);
+//
+//    } else if (currCommand == "delete") {
+//
+//      cin >> commandParam;
+//
+//      sourceUdpRelay->terminateRemoteCxn(commandParam);
+//
+//    } else if (currCommand == "show") {
+//
+//      sourceUdpRelay->showTCPConnections();
+//
+//    } else if (currCommand == "help") {
+//
+//      sourceUdpRelay->displayHelpMenu();
+//
+//    } else if (currCommand == "quit") {
+//
+//      sourceUdpRelay->terminateAllTcpConnections();
+//
+//      sem_post(&sourceUdpRelay->mutex);
+//
+//      break;
+//
+//    } else {
+//
+//      cout << "Command not recognized." << endl;
+//
+//      sourceUdpRelay->displayHelpMenu();
+//
+//      continue;
+//
+//    }
+//
+//  }
+//
+//}
+
+
+
+//-----------------------------------------------------------------------------
+
+// relayInThread
+
+// A static class method that is a thread function for the relayIn thread, the
+
+// ingest stage of the local group. It loops continually, receiving UDP
+
+// messages, reassembling fragments and handing them to the local stage; while
+
+// the stage's ring is full it stops reading, leaving packets in the kernel's
+
+// socket buffer
+
+//
+
+// @pre:   *arg parameter represents a valid UdpRelay object
+
+// @post:  None
+
+// @param  *arg:  A void pointer to the UdpRelay object creating the thread
+
+//-----------------------------------------------------------------------------
+
+void* UdpRelay::relayInThread(void* arg) {
+
+    UdpRelay * currInRelay = (UdpRelay*)arg;
+
+    char inPacket[MAX_PACKET_SIZE] = {0};
+
+    int affinity = -1;
+
+    //Left registered when stop() cancels this thread
+
+    latencyBlock* latency = currInRelay->addLatency();
+
+    //stop() cancels this thread; only allow it while waiting for a message so
+
+    //it never dies holding a lock
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    while(currInRelay->running) {
+
+      currInRelay->applyThreadAffinity("relayIn", affinity);
+
+      long long kernelRxUs = 0;
+
+      pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+      int received = currInRelay->recvLocalMessage(inPacket, &kernelRxUs);
+
+      int error = errno;
+
+      pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+      if(received < 0) {
+
+        cerr << "UdpRelay: local group socket failed: " << strerror(error)
+
+            << endl;
+
+        received = 0;
+
+        if(currInRelay->reopenLocalGroup()) {
+
+          continue;
+
+        }
+
+      }
+
+      if(received == 0) {
+
+        //No socket: wait before trying to open one again
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+        sleep(1);
+
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        currInRelay->reopenLocalGroup();
+
+        continue;
+
+      }
+
+      long long arrivalUs = monotonicMicros();
+
+      if(kernelRxUs != 0) {
+
+        latency->stages[LATENCY_LOCAL_RX].record(
+
+            realtimeMicros() - kernelRxUs);
+
+      }
+
+      //Relays on this group split packets larger than its MTU
+
+      if(received > 0 && ControlFrame::isControl(inPacket)) {
+
+        received = currInRelay->reassembleFragment("local", inPacket,
+
+            received);
+
+      }
+
+      if(received > 0 && !currInRelay->isOversized(inPacket)) {
+
+        currInRelay->stagePacket(currInRelay->ingestRing, inPacket,
+
+            arrivalUs);
+
+      }
+
+      memset(inPacket, 0, SIZE);
+
+    }
+
+    return NULL;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// addRemoteIp
+
+// Takes a group IP/name and port number parameter and opens a TCP connection
+
+// to that node. Sends the hostname of this machine to the remote node and
+
+// updates the tcpCxns map
+
+//
+
+// @pre:   remoteGroupID parameter is a valid group IP and port number
+
+// @post:  Socket is opened for TCP and tcpCxns map is updated
+
+// @param  remoteGroupID: An group IP/name and port (XXX.XXX.XXX.XXX:YYYYY)
+
+//-----------------------------------------------------------------------------
+
+//void UdpRelay::addNode(string address)
+void UdpRelay::addRemoteIP(string ipAddress)
+{
+	//Adds a TCP connection to a remote network segment or group 
+	char* ipAddr = new char[1024];
+	//change the addres from string to char*
+	memset(ipAddr, 0, 1024);
+	strcpy(ipAddr,ipAddress.c_str());
+	
+	managePeer(ipAddress);
+	
+	int sd = relaySock->getClientSocket(ipAddr);
+	delete[] ipAddr;
+		
+	if(sd < 0)
+	{
+		cerr<<"TCP connection failed!"<<endl;
+		//buffer traffic for the peer until the retry gets through
+		startEgress(ipAddress);
+		scheduleReconnect(ipAddress);
+	}
+	
+	else
+	{
+		attachRemoteCxn(ipAddress, sd);
+	}
+	
+}
+
+
+
+//-----------------------------------------------------------------------------
+// managePeer
+// Remembers a peer so it is reconnected whenever its link fails or drops
+//
+// @pre:   None
+// @post:  The peer is in managedPeers
+// @param  ipAddress: The IP/name the peer was added with
+//-----------------------------------------------------------------------------
+void UdpRelay::managePeer(const string& ipAddress)
+{
+	pthread_mutex_lock(&cxnLock);
+	if(managedPeers.count(ipAddress) == 0)
+	{
+		managedPeer managed;
+		managed.reconnecting = false;
+		managed.attempts = 0;
+		managed.backlog = NULL;
+		managedPeers[ipAddress] = managed;
+	}
+	pthread_mutex_unlock(&cxnLock);
+}
+
+
+
+//-----------------------------------------------------------------------------
+// attachRemoteCxn
+// Starts relaying over a freshly connected socket to a peer: sends the
+// hostname of this machine with our capabilities to the remote node, then
+// spins up its relayOut and relayEgress threads and updates the tcpCxns map,
+// so no frame can reach the socket ahead of the handshake
+//
+// @pre:   sd is a connected, blocking TCP socket to ipAddress
+// @post:  The connection is registered in tcpCxns
+// @param  ipAddress: The IP/name the peer was added with
+// @param  sd:        The connected socket
+//-----------------------------------------------------------------------------
+void UdpRelay::attachRemoteCxn(const string& ipAddress, int sd)
+{
+	if(handingOff)
+	{
+		close(sd);	//the relay is being passed on; the new one reconnects
+		return;
+	}
+	//instantiates relayOutThread 
+	//check if the ip address is already included in the relayOutConnections 
+	//if(udpRelayOutConnections.count(ipAddress) > 0) 
+    if(tcpCxns.count(ipAddress) > 0) 
+	{
+		//cancel the pthread
+		//int cancelResult = pthread_cancel(workingThreads.find(sd));
+		int cancelResult = pthread_cancel(outThreads[sd]);
+		
+		if (cancelResult != 0)
+		{
+			cerr << "pthread cancel failed in acceptThread" << endl;
+			exit(EXIT_FAILURE);
+		}
+		
+		/*close(udpRelayOutConnections[ipAddress]);-----------------------------------------------
+		udpRelayOutConnections.erase(ipAddress);
+		workingThreads.erase(ipAddress);*/
+		
+		pthread_mutex_lock(&cxnLock);
+		close(tcpCxns[ipAddress]);
+		tcpCxns.erase(ipAddress);
+		peerGeneration++;
+		pthread_mutex_unlock(&cxnLock);
+		outThreads.erase(sd);
+      
+ 		}
+	
+
+/* 		if(outThreads.count(sd) > 0) {
+  if(expiredOutThreads.size() > 5) {
+	while(!expiredOutThreads.empty()) {
+	  pthread_join(expiredOutThreads.front(), NULL);
+	  expiredOutThreads.pop();
+	}
+  }
+  outThreads.erase(sd);
+}*/
+	
+	//--------------------send the hostName to remote node---------------
+	//before anything else can write to the socket: the peer reads the
+	//first 1024 bytes as the handshake
+	char hostName[1024];
+	memset(hostName, 0, 1024);
+	gethostname(hostName, 1023);
+	//tell the remote node we take control frames (heartbeats) and which
+	//header versions we offer, with our node ID for them
+	ControlFrame::addCapabilities(hostName, 1024,
+		capabilitiesFor(headerVersion), identity->nodeId, groupAddress);
+	sendAll(sd, hostName, 1024);
+	
+    // Add a new TCP connection
+	
+	//---------------------------------------change-----------------------------------------------------------
+	//ThreadPara* para = new ThreadPara(this,ipAddr,sd); 		
+	outThreadInfo* para = new outThreadInfo(this, ipAddress.c_str(),sd);
+	registerPeer(ipAddress, false);
+	
+	addWorker();
+	//int pthreadCreation = pthread_create(workingThreads[sd], NULL, relayOutThread, (void*)para);
+	int pthreadCreation = pthread_create(&outThreads[sd], NULL, relayOutThread, (void*)para);
+	
+	if(pthreadCreation != 0)
+	{
+		cerr<<"Thread creation failed!"<<endl;
+		exit(EXIT_FAILURE);
+	}
+	
+	//update the working threads and udp connection list.
+	outThreads.insert(pair<int,pthread_t>(sd,sd));
+	pthread_mutex_lock(&cxnLock);
+	tcpCxns[ipAddress] = sd;
+	peerGeneration++;
+	pthread_mutex_unlock(&cxnLock);
+	tuneSocket(sd);
+	startEgress(ipAddress);
+	cout << "Registered: " << ipAddress << endl;
+	cout<< "Added: "<<ipAddress<< ":"<<sd<<endl;
+	checkReady();
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// connectPeers
+
+// Connects to many peers at once: every connect is started without blocking
+
+// and the sockets are polled together, so bringing up N peers takes at most
+
+// one timeout rather than N. Each peer becomes managed; one that does not
+
+// connect in time is retried with backoff like a failed "add"
+
+//
+
+// @pre:   timeoutMs > 0
+
+// @post:  Every peer is connected or has a reconnect scheduled
+
+// @param  hosts:     The IPs/names of the peers
+
+// @param  timeoutMs: Time each peer has to accept
+
+// @returns int:      Peers connected by this call
+
+//-----------------------------------------------------------------------------
+
+int UdpRelay::connectPeers(const vector<string>& hosts, int timeoutMs) {
+
+  vector<struct pollfd> pending;
+
+  vector<string> pendingHosts;
+
+  for(size_t i = 0; i < hosts.size(); i++) {
+
+    managePeer(hosts[i]);
+
+    pthread_mutex_lock(&cxnLock);
+
+    bool connected = tcpCxns.count(hosts[i]) > 0;
+
+    pthread_mutex_unlock(&cxnLock);
+
+    if(connected) {
+
+      continue;
+
+    }
+
+    int sd = startConnect(hosts[i]);
+
+    if(sd == NULL_SD) {
+
+      cerr << "TCP connection to " << hosts[i] << " failed!" << endl;
+
+      startEgress(hosts[i]);
+
+      scheduleReconnect(hosts[i]);
+
+      continue;
+
+    }
+
+    struct pollfd entry;
+
+    entry.fd = sd;
+
+    entry.events = POLLOUT;
+
+    entry.revents = 0;
+
+    pending.push_back(entry);
+
+    pendingHosts.push_back(hosts[i]);
+
+  }
+
+  int connected = 0;
+
+  int waiting = pending.size();
+
+  long long deadlineUs = monotonicMicros() + timeoutMs * 1000LL;
+
+  while(waiting > 0) {
+
+    long long leftUs = deadlineUs - monotonicMicros();
+
+    if(leftUs <= 0) {
+
+      break;
+
+    }
+
+    if(poll(&pending[0], pending.size(), (int)((leftUs + 999) / 1000)) < 0 &&
+
+        errno != EINTR) {
+
+      break;
+
+    }
+
+    for(size_t i = 0; i < pending.size(); i++) {
+
+      if(pending[i].fd < 0 || pending[i].revents == 0) {
+
+        continue;
+
+      }
+
+      int sd = pending[i].fd;
+
+      pending[i].fd = -1;     //poll() skips negative descriptors
+
+      waiting--;
+
+      int error = 0;
+
+      socklen_t errorLength = sizeof(error);
+
+      getsockopt(sd, SOL_SOCKET, SO_ERROR, &error, &errorLength);
+
+      if(error == 0) {
+
+        fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) & ~O_NONBLOCK);
+
+        attachRemoteCxn(pendingHosts[i], sd);
+
+        connected++;
+
+      } else {
+
+        close(sd);
+
+        cerr << "TCP connection to " << pendingHosts[i] << " failed: "
+
+            << strerror(error) << endl;
+
+        startEgress(pendingHosts[i]);
+
+        scheduleReconnect(pendingHosts[i]);
+
+      }
+
+    }
+
+  }
+
+  for(size_t i = 0; i < pending.size(); i++) {
+
+    if(pending[i].fd >= 0) {
+
+      close(pending[i].fd);
+
+      cerr << "TCP connection to " << pendingHosts[i] << " timed out!" << endl;
+
+      startEgress(pendingHosts[i]);
+
+      scheduleReconnect(pendingHosts[i]);
+
+    }
+
+  }
+
+  return connected;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// startConnect
+
+// Resolves a peer and starts a non-blocking connect to its relay port
+
+//
+
+// @pre:   None
+
+// @post:  The connect is in progress or done on the returned socket
+
+// @param  host:  The IP/name of the peer
+
+// @returns int:  The non-blocking socket, NULL_SD on failure
+
+//-----------------------------------------------------------------------------
+
+int UdpRelay::startConnect(const string& host) {
+
+  struct addrinfo hints;
+
+  memset(&hints, 0, sizeof(hints));
+
+  hints.ai_family = AF_INET;
+
+  hints.ai_socktype = SOCK_STREAM;
+
+  struct addrinfo* resolved = NULL;
+
+  if(getaddrinfo(host.c_str(), NULL, &hints, &resolved) != 0) {
+
+    return NULL_SD;
+
+  }
+
+  struct sockaddr_in peer = *(struct sockaddr_in*)resolved->ai_addr;
+
+  freeaddrinfo(resolved);
+
+  peer.sin_port = htons(portNumber);
+
+  int sd = socket(AF_INET, SOCK_STREAM, 0);
+
+  if(sd < 0) {
+
+    return NULL_SD;
+
+  }
+
+  fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK);
+
+  if(connect(sd, (struct sockaddr*)&peer, sizeof(peer)) < 0 &&
+
+      errno != EINPROGRESS) {
+
+    close(sd);
+
+    return NULL_SD;
+
+  }
+
+  return sd;
+
+}
+
+
+
+/*void UdpRelay::addRemoteIP(string remoteGroupID) {
+
+  const char DELIMITER = ':';
+
+  const int DELIM_POS = remoteGroupID.find(DELIMITER);
+
+  const int LENGTH = remoteGroupID.length();
+
+  string remoteIPAddress = remoteGroupID.substr(0, DELIM_POS);
+
+  string remotePort = remoteGroupID.substr(DELIM_POS + 1, LENGTH);
+
+  int sd = 0;
+
+  char* clientSock = new char[GROUP_LENGTH];
+
+  memset(clientSock, 0, GROUP_LENGTH);
+
+  strcpy(clientSock, remoteIPAddress.c_str());
+
+  sd = relaySock->getClientSocket(clientSock);
+
+  cout << "Registered: " << clientSock << endl;
+
+  if(sd == -1) {
+
+    cerr << "upd relay error establishing remote tcp connection" << endl;
+
+  }
+
+  else {
+
+    checkForDuplicateCxn(remoteGroupID);
+
+    if(outThreads.count(sd) > 0) {
+
+      if(expiredOutThreads.size() > 5) {
+
+        while(!expiredOutThreads.empty()) {
+
+          pthread_join(expiredOutThreads.front(), NULL);
+
+          expiredOutThreads.pop();
+
+        }
+
+      }
+
+      outThreads.erase(sd);
+
+    }
+
+    outThreads.insert(pair<int,pthread_t>(sd, sd));
+
+    tcpCxns[clientSock] = sd;
+
+    peerGeneration++;
+
+    cout << "Added: " << clientSock << ":" << sd << endl;
+
+    char hostName[GROUP_LENGTH] = {0};
+
+    gethostname(hostName, GROUP_LENGTH);
+
+    sendAll(sd, hostName, GROUP_LENGTH);
+
+    outThreadInfo * tempStruct = new outThreadInfo;
+
+    tempStruct->remoteHostName = remoteIPAddress;
+
+    tempStruct->currentRelay = this;
+
+    tempStruct->socketNumber = sd;
+
+    pthread_create(&outThreads[sd], NULL, relayOutThread, (void*)tempStruct);
+
+  }
+
+  if(clientSock != NULL) {
+
+    delete clientSock;
+
+    clientSock = NULL;
+
+  }
+
+}*/
+
+
+
+//-----------------------------------------------------------------------------
+
+// checkForDuplicateCxn
+
+// Checks if the remote connection already exists and if it does, it deletes
+
+// the already existing connection
+
+//
+
+// @pre:   string shall be a valid remote group id host name
+
+// @post:  if a duplicate connection already existed, the previous connection
+
+//         will be closed and deleted from the connections map. Otherwise,
+
+//         there are no changes.
+
+// @param  const string& GRP_ID: remote host name
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::checkForDuplicateCxn(const string& GRP_ID) {
+
+  if(tcpCxns.count(GRP_ID) > 0) {
+
+    close(tcpCxns[GRP_ID]);
+
+    tcpCxns.erase(tcpCxns.find(GRP_ID));
+
+    peerGeneration++;
+
+  }
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// displayHelpMenu
+
+// Called by commandThread to send all available user commands to cout
+
+//
+
+// @pre:   None
+
+// @post:  None
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::displayHelpMenu() {
+
+  cout << "UdpRelay.commandThread: accepts user command" << endl;
+	cout << "add remoteIP:remoteTcpPort : adds TCP connection to a remote network segment or group " << endl;
+	cout << "delete remoteIP : Remove TCP connection from remoteIP" << endl;
+	cout << "priority groupIP bulk|normal|interactive|control|none : set the class of packets from groupIP" << endl;
+	cout << "schedule strict | schedule weighted w0 w1 w2 w3 : select how classes share each link" << endl;
+	cout << "trace [on [N] | off] : trace 1 in N local packets hop by hop, or list the slowest traced paths" << endl;
+	cout << "lowlatency on [busyPollUs] | lowlatency off : poll sockets instead of blocking" << endl;
+	cout << "pin relayIn|relayOut|localStage|remoteStage|egress|rebroadcast cpus|nodeN|none : pin relay threads to CPUs" << endl;
+	cout << "timestamping off|software|hardware [iface] : take kernel/NIC socket timestamps" << endl;
+	cout << "latency : show kernel receive, relay processing and kernel transmit latency" << endl;
+	cout << "shm [add name [slots] | delete name] : shared memory rings name.in/name.out for local clients" << endl;
+	cout << "stages : show how full the rings between relay stages are and how often they pushed back" << endl;
+	cout << "heartbeat ms [misses] | heartbeat off : ping peers every ms, drop a peer silent for misses intervals" << endl;
+	cout << "backlog packets [rate [dir|none]] : buffer for added peers while down, replay at rate/s, spill to dir" << endl;
+	cout << "journal on dir [segmentMB [commitMs]] | journal off | journal : record every relayed packet on disk" << endl;
+	cout << "replay from to [speed [local|remote|all]] : re-inject journaled packets (unix seconds, <= 0 = seconds ago)" << endl;
+	cout << "capture start file [sample N] [peer name] [group IP] | capture stop | capture : write relayed packets to a pcapng file" << endl;
+	cout << "header [1|2|3 [nodeID]] : header version offered to new peers (2 = 16-bit node IDs, 3 = Bloom filter) and this relay's node ID" << endl;
+	cout << "header bloom [bytes [hashes [ttl]]] : offer Bloom filter headers of 32-64 bytes for large meshes" << endl;
+	cout << "payload [bytes [fragment]] : largest message accepted (up to 65535) and local datagram size above which packets are fragmented" << endl;
+	cout << "queue [packets] : packets each priority lane of the rebroadcast and TCP send queues holds" << endl;
+	cout << "config [file] : run a config file's commands and connect its peers in parallel, or show its quorum status" << endl;
+	cout << "reload : apply changes to the config file (also on SIGHUP), keeping unchanged links up" << endl;
+	cout << "upgrade socketPath : hand every socket and link to a new relay started with that takeover path, then quit" << endl;
+	cout << "admin [socketPath | off] : serve batch add/delete, stats and link events to tools on a Unix socket" << endl;
+	cout << "metrics [port [address] | off] : serve per-peer and per-group counters and latency histograms for Prometheus at /metrics" << endl;
+	cout << "fanout [workers | auto | off] : queue received packets on the peers from a work-stealing thread pool" << endl;
+	cout << "udplink [on [port] | add host:port | delete name | off] : reliable per-group streams to peers over UDP instead of TCP" << endl;
+	cout << "tunnel [groupIP unreliable|ordered|none] : send groupIP to UDP link peers best effort, ordered drops late and duplicate packets" << endl;
+	cout << "redundant [groupIP path path... | groupIP none] : send groupIP over every listed peer link, the receiver relays the first copy" << endl;
+	cout << "conflate [name offset length [source] | name off] : a queued packet to peer name is replaced by a newer one with the same payload bytes (and origin)" << endl;
+	cout << "show : show current TCP connections" << endl;
+	cout << "help : summarize available commands" << endl;
+	cout << "quit : Terminate the UdpRelay program" << endl;
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// acceptThread
+
+// A static class method that is a thread function for the accept thread, which
+
+// loops continually accepting TCP connection requests
+
+//
+
+// @pre:   *arg parameter represents a valid UdpRelay object
+
+// @post:  Opens a TCP connection socket and updates a connection map
+
+// @param  *arg:  A void pointer to the UdpRelay object creating the thread
+
+//-----------------------------------------------------------------------------
+
+void* UdpRelay::acceptThread(void* arg)
+{
+  UdpRelay* oneUdpRelay = (UdpRelay*)arg;
+  oneUdpRelay->threadAcception();
+  return NULL;
+}
+
+void UdpRelay::threadAcception()
+{
+  int sd = 0;
+	char ipAddr[1024] ={0}; 
+
+	//stop() cancels this thread; only allow it while waiting for a connection
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	while(running)
+	{
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		//sd = thisSocket->getServerSocket();------------------------------------------------------
+		if(listenSd != NULL_SD)
+		{
+			sd = accept(listenSd, NULL, NULL);	//inherited from the old relay
+		}
+		else
+		{
+			sd = relaySock->getServerSocket();
+		}
+		memset(ipAddr, 0, 1024);
+		recv(sd, ipAddr, 1024, 0);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if(sd < 0)
+		{
+			continue;
+		}
+		string ipString(ipAddr);
 		//if the existing connection includes this sd
 		//if(workingThreads.count(sd) != 0)------------------------------------------------------
     if(outThreads.count(sd) != 0)
@@ -701,8 +3233,11 @@ void UdpRelay::threadAcception()
 			udpRelayOutConnections.erase(ipString);
 			workingThreads.erase(sd);*/
 			
+			pthread_mutex_lock(&cxnLock);
 			close(tcpCxns[ipString]);
 			tcpCxns.erase(ipString);
+			peerGeneration++;
+			pthread_mutex_unlock(&cxnLock);
 			outThreads.erase(sd);
 		}
 		
@@ -714,102 +3249,10695 @@ void UdpRelay::threadAcception()
 		
 		/* 		if(outThreads.count(sd) > 0) {
 
-	  if(expiredOutThreads.size() > 5) {
+	  if(expiredOutThreads.size() > 5) {
+
+		while(!expiredOutThreads.empty()) {
+
+		  pthread_join(expiredOutThreads.front(), NULL);
+
+		  expiredOutThreads.pop();
+		}
+	  }
+	  outThreads.erase(sd);
+	}*/
+	
+		//keep track of the connection list and the working thread list
+		/*udpRelayOutConnections.insert(pair<string,int>ipAddr, sd);----------------------------------------------------
+		workingThreads.insert(pair<int,pthread_t>(sd,sd));
+		udpRelayOutConnections[ipAddr] = sd;*/
+    outThreads.insert(pair<int,pthread_t>(sd,sd));
+		pthread_mutex_lock(&cxnLock);
+		tcpCxns[ipString] = sd;
+		peerGeneration++;
+		pthread_mutex_unlock(&cxnLock);
+		tuneSocket(sd);
+		startEgress(ipString);
+		//answer a relay that takes control frames with a hello so it starts
+		//sending heartbeats too; the hello also settles the header version
+		unsigned int capabilities = ControlFrame::getCapabilities(ipAddr, 1024);
+		bool capable = (capabilities & CAPABILITY_CONTROL) != 0;
+		registerPeer(ipString, capable);
+		unsigned int node = 0;
+		unsigned int group = 0;
+		ControlFrame::getNodeIdentity(ipAddr, 1024, node, group);
+		int version = negotiateHeader(ipString, capabilities, node, group);
+		if(capable)
+		{
+			queueControlFrame(ipString, CONTROL_HELLO, capabilitiesFor(version),
+				ControlFrame::packIdentity(identity->nodeId, groupAddress));
+		}
+    
+		
+		addWorker();
+		//int pthreadCreation = pthread_create(workingThreads[sd], NULL, relayOutThread, (void*)para);--------------------------
+		int pthreadCreation = pthread_create(&outThreads[sd], NULL, relayOutThread, (void*)para);
+		if(pthreadCreation != 0)
+		{
+			cerr<<"Thread creation failed!"<<endl;
+			exit(EXIT_FAILURE);
+		}
+  }
+}
+/*void * UdpRelay::acceptThread(void* arg) {
+
+  UdpRelay * sourceRelay = (UdpRelay*)arg;
+
+  sourceRelay->createUdpRelayServerConnection();
+
+}*/
+
+
+
+//-----------------------------------------------------------------------------
+
+// isDuplicatePacket
+
+// Checks the header of the packet and returns true if the local group IP
+
+// (version 1) or node ID (version 2, or its bits in the version 3 filter) is
+
+// already contained in the header (a duplicate message), false otherwise
+
+//
+
+// @pre:   currentPacket parameter is of the correct packet format
+
+// @post:  None
+
+// @param  currentPacket: The packet received via UDP or TCP
+
+// @returns bool:         True if the current UdpRelay's IP is contained in
+
+//                        the packet header, false otherwise
+
+//-----------------------------------------------------------------------------
+
+bool UdpRelay::isDuplicatePacket(char* currentPacket) {
+
+  int hop = PacketHeader::getHopCount(currentPacket);
+
+  const nodeIdentity* self = identity;
+
+  if (PacketHeader::getVersion(currentPacket) == 3) {
+
+    unsigned long long scratch[MAX_BLOOM_WORDS];
+
+    return PacketHeader::bloomContains(currentPacket,
+
+        getBloomMask(self, currentPacket, scratch));
+
+  }
+
+  if (PacketHeader::getVersion(currentPacket) == 2) {
+
+    for (int i = 0; i < hop; i++) {
+
+      if (PacketHeader::getHop(currentPacket, i) == self->nodeId) {
+
+        return true;
+
+      }
+
+    }
+
+    return false;
+
+  }
+
+  int counter = 0;
+
+
+
+  for (int i = 1; i <= hop; i++) {
+
+    int ipReadIn = 0;
+
+    counter = 0;
+
+    for (int j = (4 * i); j < (4 * (i + 1)); j++) {
+
+      if (currentPacket[j] == ipChars[counter]) {
+
+        ipReadIn++;
+
+      }
+
+      counter++;
+
+    }
+
+    if (ipReadIn == 4) {
+
+      return true;
+
+    }
+
+  }
+
+  return false;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// setIpChars
+
+// Takes the group IP number of format (2XX.255.255.255) and puts each set of
+
+// three numbers into a single char value before storing them in ipChars[]
+
+//
+
+// @pre:   ipNumber is of valid format and ipChars is instantiated
+
+// @post:  ipChars[] array contains the 4-char version of the group IP
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::setIpChars() {
+
+  stringstream ss;
+
+  int currentNumber = 0;
+
+  for (int i = 0; i < 4; i++) {
+
+    ss << ipNumber + (i * 4);
+
+    ss >> currentNumber;
+
+    ipChars[i] = currentNumber;
+
+    ss.clear();
+
+    ss.str(string());
+
+  }
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// putIPIntoPacket
+
+// Takes a char* packet passed as parameter and adds group IP address of the
+
+// current UdpRelay node into the header in the format of a single byte for
+
+// each 3-digit portion of the IP, then increments the "hop" number. While
+
+// version 2 or 3 headers are offered, an older packet is first converted and
+
+// the node ID is added instead
+
+//
+
+// @pre:   currentPacket has valid packet format and is capacity bytes long
+
+// @post:  None
+
+// @param  currentPacket: A packet in valid format described in UdpRelay header
+
+// @param  capacity:      Size of the packet buffer
+
+// @returns bool:         False if the hop list is already full (MAX_HOPS or
+
+//                        MAX_HOPS_V2) or the TTL has run out, in which case
+
+//                        the packet is left unchanged and counted in
+
+//                        hopLimited
+
+//-----------------------------------------------------------------------------
+
+bool UdpRelay::putIPIntoPacket(char* currentPacket, int capacity) {
+
+  int offered = headerVersion;
+
+  if (offered >= 2 && PacketHeader::getVersion(currentPacket) < offered) {
+
+    char converted[MAX_PACKET_SIZE];
+
+    if (convertHeader(currentPacket, converted, offered)) {
+
+      int length = PacketHeader::getLength(converted, MAX_PACKET_SIZE);
+
+      if (length <= capacity) {
+
+        memcpy(currentPacket, converted, length);
+
+      }
+
+    }
+
+  }
+
+  bool added;
+
+  const nodeIdentity* self = identity;
+
+  if (PacketHeader::getVersion(currentPacket) == 3) {
+
+    unsigned long long scratch[MAX_BLOOM_WORDS];
+
+    added = PacketHeader::bloomAdd(currentPacket, self->nodeId,
+
+        getBloomMask(self, currentPacket, scratch));
+
+  } else if (PacketHeader::getVersion(currentPacket) == 2) {
+
+    added = PacketHeader::appendNode(currentPacket, capacity, self->nodeId);
+
+  } else {
+
+    added = PacketHeader::appendHop(currentPacket, capacity, ipChars);
+
+  }
+
+  //Say so once; after that the drops are only counted
+
+  if (!added && __sync_fetch_and_add(&hopLimited, 1) == 0) {
+
+    cout << "UdpRelay: dropped a packet at the hop limit (" << MAX_HOPS
+
+        << " hops in version 1 headers); see \"header\" for the count"
+
+        << endl;
+
+  }
+
+  return added;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// assignPriority
+
+// Returns the priority class of a packet. Packets that already carry a
+
+// non-bulk class keep it; otherwise the class configured for the packet's
+
+// origin group (if any) is written into the header
+
+//
+
+// @pre:   currentPacket has valid packet format and a non-empty hop list
+
+// @post:  The header's priority bits hold the returned class
+
+// @param  currentPacket: A packet in valid format described in UdpRelay header
+
+// @returns int:          PRIORITY_BULK through PRIORITY_CONTROL
+
+//-----------------------------------------------------------------------------
+
+int UdpRelay::assignPriority(char* currentPacket) {
+
+  int priority = PacketHeader::getPriority(currentPacket);
+
+  if (priority != PRIORITY_BULK) {
+
+    return priority;
+
+  }
+
+  pthread_mutex_lock(&ruleLock);
+
+  if (!priorityRules.empty()) {
+
+    map<unsigned int, int>::iterator rule =
+
+        priorityRules.find(getOriginGroup(currentPacket));
+
+    if (rule != priorityRules.end()) {
+
+      priority = rule->second;
+
+    }
+
+  }
+
+  pthread_mutex_unlock(&ruleLock);
+
+  PacketHeader::setPriority(currentPacket, priority);
+
+  return priority;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// sampleTrace
+
+// Adds the per-hop trace extension to a locally received packet if tracing is
+
+// on and the packet falls on the sampling interval
+
+//
+
+// @pre:   currentPacket has valid packet format and this relay's hop entry
+
+//         and is capacity bytes long
+
+// @post:  The packet may carry a trace extension with the current time as its
+
+//         origin
+
+// @param  currentPacket: A packet received via UDP
+
+// @param  capacity:      Size of the packet buffer
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::sampleTrace(char* currentPacket, int capacity) {
+
+  int sampleRate = traceSampleRate;
+
+  if (sampleRate <= 0 || (traceCounter++ % sampleRate) != 0) {
+
+    return;
+
+  }
+
+  PacketHeader::startTrace(currentPacket, capacity, realtimeMicros());
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// recordTrace
+
+// Adds a traced packet's end-to-end latency to the histogram of its path and
+
+// keeps its per-hop breakdown among the recent traces
+
+//
+
+// @pre:   currentPacket has valid packet format and a trace extension
+
+// @post:  pathLatency and recentTraces are updated
+
+// @param  currentPacket: A packet received via TCP, before this relay's hop is
+
+//         added
+
+// @param  arrivalUs:     realtimeMicros() when the packet was received
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::recordTrace(const char* currentPacket, long long arrivalUs) {
+
+  traceSample sample;
+
+  stringstream path;
+
+  stringstream breakdown;
+
+  int hops = PacketHeader::getHopCount(currentPacket);
+
+  bool nodeIds = PacketHeader::getVersion(currentPacket) == 2;
+
+  for (int i = 0; i < hops; i++) {
+
+    struct in_addr hopAddr;
+
+    unsigned int hop = PacketHeader::getHop(currentPacket, i);
+
+    hopAddr.s_addr = htonl(nodeIds ? addressForNode(hop) : hop);
+
+    string hopName = inet_ntoa(hopAddr);
+
+    long long hopArrival = 0;
+
+    long long hopResidence = 0;
+
+    PacketHeader::getTraceEntry(currentPacket, i, hopArrival, hopResidence);
+
+    path << hopName << " > ";
+
+    breakdown << " [" << hopName << " in +";
+
+    if (hopArrival < 0) {
+
+      breakdown << "overflow";
+
+    } else {
+
+      breakdown << hopArrival << "us";
+
+    }
+
+    breakdown << " held ";
+
+    if (hopResidence < 0) {
+
+      breakdown << "overflow";
+
+    } else {
+
+      breakdown << hopResidence << "us";
+
+    }
+
+    breakdown << "]";
+
+  }
+
+  path << ipNumber;
+
+  sample.path = path.str();
+
+  sample.latencyUs = arrivalUs - PacketHeader::getTraceOrigin(currentPacket);
+
+  sample.breakdown = breakdown.str();
+
+
+
+  pthread_mutex_lock(&traceLock);
+
+  pathLatency[sample.path].record(sample.latencyUs);
+
+  recentTraces.push_back(sample);
+
+  if (recentTraces.size() > (size_t)MAX_RECENT_TRACES) {
+
+    recentTraces.pop_front();
+
+  }
+
+  pthread_mutex_unlock(&traceLock);
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// relayOutThread
+
+// A static class method that is a thread function for the relayOut thread,
+
+// which spins up when a TCP connection is established. It is the ingest stage
+
+// of its peer: receives messages via the TCP connection, handles control
+
+// frames and fragments and hands the rest to the remote stage on the peer's
+
+// own ring. While that ring is full it stops reading, so TCP flow control
+
+// slows the peer down
+
+//
+
+// @pre:   *arg parameter represents a valid outThreadInfo struct
+
+// @post:  Removes the connection from the map when the thread terminates
+
+// @param  *arg:  Pointer to the outThreadInfo struct with socket and UdpRelay
+
+//-----------------------------------------------------------------------------
+
+void* UdpRelay::relayOutThread(void *arg) {
+
+  outThreadInfo *outInfo = (outThreadInfo*)arg;
+
+  UdpRelay* thisUdpRelay = outInfo->currentRelay;
+
+  int sd = outInfo->socketNumber;
+
+  string remoteName = outInfo->remoteHostName;
+
+  delete (outThreadInfo*)arg;
+
+  char outPacket[MAX_PACKET_SIZE] = {0};
+
+  IdleBackoff idle;
+
+  int affinity = -1;
+
+  SpscRing* stage = thisUdpRelay->addPeerStage(remoteName);
+
+  latencyBlock* latency = thisUdpRelay->addLatency();
+
+  pthread_mutex_lock(&thisUdpRelay->cxnLock);
+
+  volatile long long* lastHeardUs = thisUdpRelay->heardCell(remoteName);
+
+  pthread_mutex_unlock(&thisUdpRelay->cxnLock);
+
+  long long messageId = 0;        //From a redundant frame, for the next packet
+
+  unsigned int path = 0;
+
+  //handOff cancels this thread; recvRemoteMessage allows it only between
+
+  //frames
+
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+  while(true) {
+
+    thisUdpRelay->applyThreadAffinity("relayOut", affinity);
+
+    long long kernelRxUs = 0;
+
+    int received = thisUdpRelay->recvRemoteMessage(sd, outPacket, idle,
+
+        kernelRxUs);
+
+    if(received <= 0) {
+
+      break;
+
+    }
+
+    long long arrivalUs = monotonicMicros();
+
+    *lastHeardUs = arrivalUs;
+
+    if(ControlFrame::isControl(outPacket)) {
+
+      int type = ControlFrame::getType(outPacket);
+
+      if(type == CONTROL_REDUNDANT) {
+
+        //Holds until the packet after it is whole, even if fragmented
+
+        messageId = ControlFrame::getTimestamp(outPacket);
+
+        path = ControlFrame::getSequence(outPacket);
+
+        continue;
+
+      }
+
+      if(type != CONTROL_FRAGMENT) {
+
+        thisUdpRelay->handleControlFrame(remoteName, outPacket);
+
+        continue;
+
+      }
+
+      if(thisUdpRelay->reassembleFragment(remoteName, outPacket,
+
+          received) <= 0) {
+
+        continue;
+
+      }
+
+    }
+
+    long long copyId = messageId;
+
+    messageId = 0;
+
+    if(thisUdpRelay->isOversized(outPacket)) {
+
+      continue;
+
+    }
+
+    if(copyId != 0 && !thisUdpRelay->redundancy.arrived(copyId,
+
+        redundantPathName(remoteName, path), arrivalUs)) {
+
+      continue;   //Another path's copy came first
+
+    }
+
+    if(kernelRxUs != 0) {
+
+      latency->stages[LATENCY_REMOTE_RX].record(realtimeMicros() - kernelRxUs);
+
+    }
+
+    thisUdpRelay->stagePacket(stage, outPacket, arrivalUs);
+
+  }
+
+  stage->close();   //The remote stage deletes it once it is empty
+
+  thisUdpRelay->retireLatency(latency);
+
+  thisUdpRelay->reassembler->removeSource(remoteName);
+
+  pthread_mutex_lock(&thisUdpRelay->cxnLock);
+
+  bool ownsEntry = thisUdpRelay->tcpCxns.count(remoteName) > 0 &&
+
+      thisUdpRelay->tcpCxns[remoteName] == sd;
+
+  if(ownsEntry) {
+
+    thisUdpRelay->tcpCxns.erase(thisUdpRelay->tcpCxns.find(remoteName));
+
+    thisUdpRelay->peers.erase(remoteName);
+
+    thisUdpRelay->peerGeneration++;
+
+  }
+
+  bool managed = thisUdpRelay->managedPeers.count(remoteName) > 0;
+
+  pthread_mutex_unlock(&thisUdpRelay->cxnLock);
+
+  if(ownsEntry) {
+
+    thisUdpRelay->notifyAdmins("down " + remoteName);
+
+  }
+
+  if(ownsEntry && managed) {
+
+    thisUdpRelay->scheduleReconnect(remoteName);   //Egress keeps buffering
+
+  }
+
+  else if(ownsEntry) {
+
+    thisUdpRelay->stopEgress(remoteName);
+
+  }
+
+  thisUdpRelay->addExpiredOutThread(sd);
+
+  thisUdpRelay->removeWorker();
+
+  return NULL;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// relayEgressThread
+
+// A static class method that is a thread function for a relayEgress thread,
+
+// which spins up when a TCP connection is established. Pops packets from that
+
+// connection's priority queue and sends them via TCP
+
+//
+
+// @pre:   *arg parameter represents a valid egressThreadInfo struct
+
+// @post:  Deletes the connection's queue when the queue is closed
+
+// @param  *arg:  Pointer to the egressThreadInfo struct with the queue, remote
+
+//         group name and UdpRelay
+
+//-----------------------------------------------------------------------------
+
+void* UdpRelay::relayEgressThread(void *arg) {
+
+  egressThreadInfo *egressInfo = (egressThreadInfo*)arg;
+
+  UdpRelay* thisUdpRelay = egressInfo->currentRelay;
+
+  PacketQueue* egress = egressInfo->queue;
+
+  string remoteName = egressInfo->remoteGroupID;
+
+  bool managed = egressInfo->managed;
+
+  delete egressInfo;
+
+  char outMsg[MAX_PACKET_SIZE] = {0};
+
+  char downgraded[MAX_PACKET_SIZE]; //Copy for a peer of an older version
+
+  QueuedPacket packet;
+
+  IdleBackoff idle;
+
+  int affinity = -1;
+
+  int stampGeneration = 0;        //timestampGeneration last applied to sd
+
+  int stampedSd = NULL_SD;        //Socket the transmit keys refer to
+
+  unsigned int bytesSent = 0;     //Bytes sent since transmit stamps began
+
+  deque<TxTimestamp> pendingTx;   //(byte key, realtime at send) awaiting ack
+
+  vector<TxTimestamp> txStamps;
+
+  StoreForward* backlog = NULL;   //Traffic held while a managed peer is down
+
+  CounterBlock* counters = thisUdpRelay->addCounters("sent", remoteName);
+
+  latencyBlock* latency = thisUdpRelay->addLatency();
+
+  if(managed) {
+
+    backlog = thisUdpRelay->createBacklog(remoteName);
+
+  }
+
+  double replayTokens = 0;        //Backlog packets that may be sent now
+
+  long long replayRefillUs = monotonicMicros();
+
+  peerView peer;
+
+  peer.generation = thisUdpRelay->peerGeneration - 1;
+
+  while(true) {
+
+    //Once the peer is back, replay the backlog at replayRate, taking live
+
+    //packets in between so the backlog cannot starve them. While anything is
+
+    //held, poll rather than block so the reconnect is noticed.
+
+    bool holding = backlog != NULL && backlog->size() > 0;
+
+    bool replaying = false;
+
+    if(holding) {
+
+      thisUdpRelay->readPeerView(remoteName, peer);
+
+      replaying = peer.sd != NULL_SD;
+
+    }
+
+    bool replayed = false;
+
+    if(replaying) {
+
+      long long nowUs = monotonicMicros();
+
+      int rate = thisUdpRelay->replayRate;
+
+      replayTokens += (nowUs - replayRefillUs) * rate / 1000000.0;
+
+      replayRefillUs = nowUs;
+
+      if(replayTokens > rate / 10.0 + 1) {
+
+        replayTokens = rate / 10.0 + 1;   //At most 100ms worth in a burst
+
+      }
+
+      if(replayTokens >= 1) {
+
+        packet.data = new char[SIZE];
+
+        if(backlog->pop(packet.data)) {
+
+          packet.length = SIZE;
+
+          packet.priority = PRIORITY_BULK;
+
+          packet.arrivalUs = nowUs;
+
+          packet.messageId = 0;
+
+          replayTokens -= 1;
+
+          replayed = true;
+
+        }
+
+        else {
+
+          delete[] packet.data;
+
+        }
+
+      }
+
+    }
+
+    if(holding && !replayed) {
+
+      if(!egress->pop(packet, replaying ? REPLAY_TICK_MS : HEARTBEAT_TICK_MS)) {
+
+        if(egress->isClosed()) {
+
+          break;
+
+        }
+
+        continue;
+
+      }
+
+    }
+
+    else if(!holding) {
+
+      if(!thisUdpRelay->nextQueuedPacket(egress, packet, idle)) {
+
+        break;
+
+      }
+
+    }
+
+    thisUdpRelay->applyThreadAffinity("egress", affinity);
+
+    thisUdpRelay->readPeerView(remoteName, peer);
+
+    int sd = peer.sd;
+
+    int peerVersion = peer.headerVersion;
+
+    bool peerJumbo = peer.jumbo;
+
+    bool peerCapable = peer.capable;
+
+    bool peerTrace = peer.trace;
+
+    bool peerPriority = peer.priority;
+
+
+
+    if(sd == NULL_SD) {
+
+      //Backlog records are one frame long, so jumbo packets are not held
+
+      if(backlog != NULL && packet.length == SIZE &&
+
+          !ControlFrame::isControl(packet.data)) {
+
+        backlog->push(packet.data);
+
+      }
+
+    }
+
+    else {
+
+      int mode = thisUdpRelay->timestampMode;
+
+      if(mode != TIMESTAMPS_OFF && (sd != stampedSd ||
+
+          stampGeneration != thisUdpRelay->timestampGeneration)) {
+
+        //Re-enabling restarts the kernel's byte key, so restart ours too
+
+        stampGeneration = thisUdpRelay->timestampGeneration;
+
+        stampedSd = sd;
+
+        txStamps.clear();
+
+        SocketTimestamps::readTxTimestamps(sd, txStamps);
+
+        SocketTimestamps::enable(sd, true, mode == TIMESTAMPS_HARDWARE);
+
+        bytesSent = 0;
+
+        pendingTx.clear();
+
+      }
+
+      bool control = ControlFrame::isControl(packet.data);
+
+      if(control) {
+
+        //Stamp pings as late as possible so queueing counts in the RTT only
+
+        //as far as it delays the peer's answer
+
+        if(ControlFrame::getType(packet.data) == CONTROL_PING) {
+
+          ControlFrame::setTimestamp(packet.data, monotonicMicros());
+
+        }
+
+      }
+
+      else if(PacketHeader::hasTrace(packet.data)) {
+
+        PacketHeader::setTraceResidence(packet.data,
+
+            PacketHeader::getHopCount(packet.data) - 1,
+
+            monotonicMicros() - packet.arrivalUs);
+
+      }
+
+      if(mode != TIMESTAMPS_OFF && !control) {
+
+        latency->stages[LATENCY_PROCESS].record(
+
+            monotonicMicros() - packet.arrivalUs);
+
+      }
+
+      //Queued packets keep the version they were relayed in; a peer that
+
+      //negotiated an older version gets a copy in its version
+
+      const char* wire = packet.data;
+
+      int wireLength = packet.length;
+
+      if(!control && PacketHeader::getVersion(packet.data) > peerVersion) {
+
+        if(!thisUdpRelay->convertHeader(packet.data, downgraded,
+
+            peerVersion)) {
+
+          delete[] packet.data;
+
+          continue;
+
+        }
+
+        wire = downgraded;
+
+        wireLength = thisUdpRelay->getFrameLength(downgraded);
+
+      }
+
+      //A relay that did not announce CAPABILITY_TRACE or CAPABILITY_PRIORITY
+
+      //reads those bits of the hop byte as part of its hop count, so it gets
+
+      //the packet without them
+
+      bool strip = !control && !peerTrace && PacketHeader::hasTrace(wire);
+
+      bool demote = !control && !peerPriority &&
+
+          PacketHeader::getPriority(wire) != PRIORITY_BULK;
+
+      if(strip || demote) {
+
+        if(wire != downgraded) {
+
+          memcpy(downgraded, wire, wireLength);
+
+        }
+
+        if(strip) {
+
+          PacketHeader::stripTrace(downgraded, wireLength);
+
+        }
+
+        if(demote) {
+
+          PacketHeader::setPriority(downgraded, PRIORITY_BULK);
+
+        }
+
+        wire = downgraded;
+
+        wireLength = thisUdpRelay->getFrameLength(downgraded);
+
+      }
+
+      //A redundant copy follows the redundant frame that carries its message
+
+      //ID, if this peer is one of its group's paths and takes both frames
+
+      int path = -1;
+
+      if(!control && packet.messageId != 0 && peerCapable &&
+
+          (wireLength <= SIZE || peerJumbo)) {
+
+        path = thisUdpRelay->getRedundantPath(
+
+            thisUdpRelay->getOriginGroup(wire), remoteName);
+
+      }
+
+      long long sentUs = realtimeMicros();
+
+      int sent = 0;
+
+      if(path >= 0) {
+
+        char tag[SIZE];
+
+        ControlFrame::build(tag, SIZE, CONTROL_REDUNDANT, path,
+
+            packet.messageId);
+
+        sent = thisUdpRelay->sendAll(sd, tag, SIZE);
+
+      }
+
+      if(sent >= 0) {
+
+        int frames = thisUdpRelay->sendFrames(sd, wire, wireLength,
+
+            peerJumbo);
+
+        sent = frames > 0 ? sent + frames : frames;
+
+      }
+
+      if(sent == 0) {
+
+        cerr << "UdpRelay: remoteGroup[" << remoteName << "] does not take "
+
+            << wireLength << "-byte packets, dropped packet" << endl;
+
+        delete[] packet.data;
+
+        continue;
+
+      }
+
+      if(sent < 0) {
+
+        shutdown(sd, SHUT_RDWR);
+
+        if(backlog != NULL && packet.length == SIZE && !control) {
+
+          backlog->push(packet.data);
+
+        }
+
+      }
+
+      else {
+
+        if(mode != TIMESTAMPS_OFF && sd == stampedSd) {
+
+          bytesSent += sent;
+
+          pendingTx.push_back(TxTimestamp(bytesSent - 1, sentUs));
+
+          if(pendingTx.size() > MAX_PENDING_TX_STAMPS) {
+
+            pendingTx.pop_front();
+
+          }
+
+          thisUdpRelay->matchTxTimestamps(sd, pendingTx, txStamps,
+
+              latency->stages[LATENCY_TRANSMIT]);
+
+        }
+
+        if(!control) {
+
+          counters->count(thisUdpRelay->getOriginGroup(wire), sent);
+
+          if(thisUdpRelay->capturing) {
+
+            thisUdpRelay->capturePacket(false, remoteName, wire);
+
+          }
+
+          int offset = PacketHeader::getPayloadOffset(packet.data);
+
+          memcpy(outMsg, packet.data + offset, packet.length - offset);
+
+          cout << "UdpRelay: relay " << outMsg << " to remoteGroup["
+
+              << remoteName << "]" << endl;
+
+        }
+
+      }
+
+    }
+
+    delete[] packet.data;
+
+  }
+
+  if(thisUdpRelay->handingOff) {
+
+    //The queue is flushed; handOff passes the link and backlog on
+
+    pthread_mutex_lock(&thisUdpRelay->cxnLock);
+
+    thisUdpRelay->drainedPeers.insert(remoteName);
+
+    if(backlog != NULL) {
+
+      thisUdpRelay->handoffBacklogs[remoteName] = backlog;
+
+      backlog = NULL;
+
+    }
+
+    pthread_mutex_unlock(&thisUdpRelay->cxnLock);
+
+  }
+
+  if(backlog != NULL) {
+
+    thisUdpRelay->releaseBacklog(remoteName, backlog);
+
+  }
+
+  thisUdpRelay->retireCounters(counters);
+
+  thisUdpRelay->retireLatency(latency);
+
+  delete egress;
+
+  thisUdpRelay->removeWorker();
+
+  return NULL;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// rebroadcastThread
+
+// A static class method that is a thread function for the rebroadcast thread.
+
+// It loops continually, popping packets received from remote groups in
+
+// priority order and broadcasting them locally via UDP
+
+//
+
+// @pre:   *arg parameter represents a valid UdpRelay object
+
+// @post:  None
+
+// @param  *arg:  A void pointer to the UdpRelay object creating the thread
+
+//-----------------------------------------------------------------------------
+
+void* UdpRelay::rebroadcastThread(void *arg) {
+
+  UdpRelay* thisUdpRelay = (UdpRelay*)arg;
+
+  QueuedPacket packet;
+
+  char downgraded[MAX_PACKET_SIZE];
+
+  IdleBackoff idle;
+
+  int affinity = -1;
+
+  CounterBlock* counters = thisUdpRelay->addCounters("sent", "local");
+
+  latencyBlock* latency = thisUdpRelay->addLatency();
+
+  while(thisUdpRelay->nextQueuedPacket(thisUdpRelay->rebroadcastQueue, packet,
+
+      idle)) {
+
+    thisUdpRelay->applyThreadAffinity("rebroadcast", affinity);
+
+    PacketHeader::stripTrace(packet.data, packet.length);
+
+    //The local group may hold relays and clients that only read version 1
+
+    //and take the whole hop byte for the hop count
+
+    char* local = packet.data;
+
+    if(PacketHeader::getVersion(packet.data) > 1 &&
+
+        thisUdpRelay->convertHeader(packet.data, downgraded, 1)) {
+
+      local = downgraded;
+
+    }
+
+    PacketHeader::setPriority(local, PRIORITY_BULK);
+
+    thisUdpRelay->deliverToSubscribers(local);
+
+    if(thisUdpRelay->timestampMode != TIMESTAMPS_OFF) {
+
+      latency->stages[LATENCY_PROCESS].record(
+
+          monotonicMicros() - packet.arrivalUs);
+
+    }
+
+    thisUdpRelay->sendLocalMessage(local);
+
+    counters->count(thisUdpRelay->getOriginGroup(local),
+
+        thisUdpRelay->getFrameLength(local));
+
+    thisUdpRelay->broadcastToShmRings(local);
+
+    if(thisUdpRelay->capturing) {
+
+      thisUdpRelay->capturePacket(false, "local", local);
+
+    }
+
+    cout << "UdpRelay: broadcast buf[" << strlen(local) << "] to "
+
+        << thisUdpRelay->getIPNumber() << ":" << PORT_NUM << endl;
+
+    delete[] packet.data;
+
+  }
+
+  thisUdpRelay->retireCounters(counters);
+
+  thisUdpRelay->retireLatency(latency);
+
+  return NULL;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// shmInThread
+
+// A static class method that is a thread function for the shmIn thread. It
+
+// polls every shared memory ingress ring, copying a batch of packets out of the
+
+// ring under shmLock and relaying the copies after releasing it, and backs off
+
+// while the rings are empty
+
+//
+
+// @pre:   *arg parameter represents a valid UdpRelay object
+
+// @post:  None
+
+// @param  *arg:  A void pointer to the UdpRelay object creating the thread
+
+//-----------------------------------------------------------------------------
+
+void* UdpRelay::shmInThread(void *arg) {
+
+  UdpRelay* thisUdpRelay = (UdpRelay*)arg;
+
+  IdleBackoff idle;
+
+  int affinity = -1;
+
+  CounterBlock* counters = thisUdpRelay->addCounters("received", "local");
+
+  //The slots belong to the clients: packets are rewritten in these copies, and
+
+  //a slow peer never holds shmLock or the client's slot
+
+  char* staged = new char[NUM_SHM_BATCH * MAX_PACKET_SIZE];
+
+  long long stagedUs[NUM_SHM_BATCH];
+
+  while(thisUdpRelay->running) {
+
+    thisUdpRelay->applyThreadAffinity("relayIn", affinity);
+
+    int relayed = 0;
+
+    string ringName;          //Last ring polled; rings may come and go
+
+    while(thisUdpRelay->shmRingCount > 0) {
+
+      //Take a bounded batch per ring so one busy client cannot starve others
+
+      int count = 0;
+
+      pthread_mutex_lock(&thisUdpRelay->shmLock);
+
+      map<string, ShmRing*>::iterator ring =
+
+          thisUdpRelay->shmInRings.upper_bound(ringName);
+
+      if(ring == thisUdpRelay->shmInRings.end()) {
+
+        pthread_mutex_unlock(&thisUdpRelay->shmLock);
+
+        break;
+
+      }
+
+      ringName = ring->first;
+
+      int slotSize = ring->second->getSlotSize();
+
+      for(; count < NUM_SHM_BATCH; count++) {
+
+        int length = 0;
+
+        char* slot = ring->second->peek(length);
+
+        if(slot == NULL) {
+
+          break;
+
+        }
+
+        int copied = length < slotSize ? length : slotSize - 1;
+
+        memcpy(staged + count * MAX_PACKET_SIZE, slot, copied);
+
+        staged[count * MAX_PACKET_SIZE + copied] = '\0';
+
+        stagedUs[count] = monotonicMicros();
+
+        ring->second->release();
+
+      }
+
+      pthread_mutex_unlock(&thisUdpRelay->shmLock);
+
+      for(int i = 0; i < count; i++) {
+
+        char* packet = staged + i * MAX_PACKET_SIZE;
+
+        int priority = thisUdpRelay->relayLocalPacket(packet, MAX_PACKET_SIZE,
+
+            stagedUs[i]);
+
+        if(priority >= 0) {
+
+          counters->count(thisUdpRelay->getOriginGroup(packet),
+
+              thisUdpRelay->getFrameLength(packet));
+
+          //Local consumers see it too, as they would a UDP broadcast
+
+          thisUdpRelay->rebroadcastQueue->push(packet,
+
+              thisUdpRelay->getFrameLength(packet), priority, stagedUs[i]);
+
+        }
+
+      }
+
+      relayed += count;
+
+    }
+
+    if(relayed > 0) {
+
+      idle.reset();
+
+    }
+
+    else {
+
+      idle.pause();
+
+    }
+
+  }
+
+  delete[] staged;
+
+  thisUdpRelay->retireCounters(counters);
+
+  return NULL;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// relayLocalPacket
+
+// Sends a packet that originated in the local group to all remote groups:
+
+// drops duplicates, adds this relay's hop, priority and trace sampling, then
+
+// queues it for every connection
+
+//
+
+// @pre:   packet has valid packet format and is capacity bytes long
+
+// @post:  packet holds this relay's hop if it was relayed
+
+// @param  packet:    The packet, modified in place
+
+// @param  capacity:  Size of the packet buffer
+
+// @param  arrivalUs: monotonicMicros() when the packet was received
+
+// @returns int:      The packet's priority class, or -1 if it was dropped
+
+//-----------------------------------------------------------------------------
+
+int UdpRelay::relayLocalPacket(char* packet, int capacity,
+
+    long long arrivalUs) {
+
+  if(isDuplicatePacket(packet) || !putIPIntoPacket(packet, capacity)) {
+
+    return -1;
+
+  }
+
+  int priority = assignPriority(packet);
+
+  journalPacket(JOURNAL_LOCAL, packet);
+
+  if(capturing) {
+
+    capturePacket(true, "local", packet);
+
+  }
+
+  sampleTrace(packet, capacity);
+
+  tcpMultiCastToRemoteGroups(packet, arrivalUs);
+
+  return priority;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// relayRemotePacket
+
+// Queues a packet received from a remote group for local rebroadcast: drops
+
+// duplicates, adds this relay's hop, trace arrival and priority
+
+//
+
+// @pre:   packet has valid packet format and is MAX_PACKET_SIZE bytes long
+
+// @post:  packet holds this relay's hop if it was queued
+
+// @param  remoteGroupID: The peer it came from
+
+// @param  packet:        The packet, modified in place
+
+// @param  arrivalUs:     monotonicMicros() when the packet was received
+
+// @returns bool:         False if the packet was dropped
+
+//-----------------------------------------------------------------------------
+
+bool UdpRelay::relayRemotePacket(const string& remoteGroupID, char* packet,
+
+    long long arrivalUs) {
+
+  if(isDuplicatePacket(packet)) {
+
+    return false;
+
+  }
+
+  int offset = PacketHeader::getPayloadOffset(packet);
+
+  cout << "UdpRelay: received " << strlen(packet) << " bytes from "
+
+      << remoteGroupID << " = " << string(packet + offset,
+
+      strnlen(packet + offset,
+
+      PacketHeader::getLength(packet, MAX_PACKET_SIZE) - offset)) << endl;
+
+  long long arrivalRealUs = 0;
+
+  if(PacketHeader::hasTrace(packet)) {
+
+    arrivalRealUs = realtimeMicros();
+
+    recordTrace(packet, arrivalRealUs);
+
+  }
+
+  if(!putIPIntoPacket(packet, MAX_PACKET_SIZE)) {
+
+    return false;
+
+  }
+
+  if(PacketHeader::hasTrace(packet)) {
+
+    PacketHeader::setTraceArrival(packet, PacketHeader::getHopCount(packet) - 1,
+
+        arrivalRealUs - PacketHeader::getTraceOrigin(packet));
+
+  }
+
+  int priority = assignPriority(packet);
+
+  journalPacket(JOURNAL_REMOTE, packet);
+
+  if(capturing) {
+
+    capturePacket(true, remoteGroupID, packet);
+
+  }
+
+  rebroadcastQueue->push(packet, getFrameLength(packet), priority, arrivalUs);
+
+  return true;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// localStageThread
+
+// A static class method that is a thread function for the local stage. It
+
+// pops the packets relayIn received from ingestRing, drops duplicates,
+
+// rewrites them and queues them for every remote group, until the ring is
+
+// closed and empty
+
+//
+
+// @pre:   *arg parameter represents a valid UdpRelay object
+
+// @post:  None
+
+// @param  *arg:  A void pointer to the UdpRelay object creating the thread
+
+//-----------------------------------------------------------------------------
+
+void* UdpRelay::localStageThread(void *arg) {
+
+  UdpRelay* thisUdpRelay = (UdpRelay*)arg;
+
+  char packet[MAX_PACKET_SIZE] = {0};
+
+  IdleBackoff idle(DEFAULT_SPIN_LIMIT, DEFAULT_YIELD_LIMIT,
+
+      DEFAULT_MIN_SLEEP_US, STAGE_MAX_SLEEP_US);
+
+  int affinity = -1;
+
+  CounterBlock* counters = thisUdpRelay->addCounters("received", "local");
+
+  while(true) {
+
+    thisUdpRelay->applyThreadAffinity("localStage", affinity);
+
+    //Read before popping, so a closed ring found empty is empty for good
+
+    bool closed = thisUdpRelay->ingestRing->isClosed();
+
+    long long arrivalUs = 0;
+
+    if(thisUdpRelay->ingestRing->pop(packet, MAX_PACKET_SIZE,
+
+        arrivalUs) == 0) {
+
+      if(closed) {
+
+        break;
+
+      }
+
+      idle.pause();
+
+      continue;
+
+    }
+
+    idle.reset();
+
+    if(thisUdpRelay->relayLocalPacket(packet, MAX_PACKET_SIZE,
+
+        arrivalUs) >= 0) {
+
+      counters->count(thisUdpRelay->getOriginGroup(packet),
+
+          thisUdpRelay->getFrameLength(packet));
+
+    }
+
+    memset(packet, 0, SIZE);
+
+  }
+
+  thisUdpRelay->retireCounters(counters);
+
+  return NULL;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// remoteStageThread
+
+// A static class method that is a thread function for the remote stage. It
+
+// takes up to STAGE_BATCH packets in turn from the ring of every peer, drops
+
+// duplicates, rewrites them and queues them for rebroadcast, deleting the
+
+// rings of peers that are gone, until stopRemoteStage
+
+//
+
+// @pre:   *arg parameter represents a valid UdpRelay object
+
+// @post:  Every peer ring is deleted
+
+// @param  *arg:  A void pointer to the UdpRelay object creating the thread
+
+//-----------------------------------------------------------------------------
+
+void* UdpRelay::remoteStageThread(void *arg) {
+
+  UdpRelay* thisUdpRelay = (UdpRelay*)arg;
+
+  char packet[MAX_PACKET_SIZE] = {0};
+
+  IdleBackoff idle(DEFAULT_SPIN_LIMIT, DEFAULT_YIELD_LIMIT,
+
+      DEFAULT_MIN_SLEEP_US, STAGE_MAX_SLEEP_US);
+
+  int affinity = -1;
+
+  vector<peerStage*> stages;    //Copy of peerStages, read without the lock
+
+  int generation = -1;
+
+  while(true) {
+
+    thisUdpRelay->applyThreadAffinity("remoteStage", affinity);
+
+    if(generation != thisUdpRelay->stageGeneration) {
+
+      pthread_mutex_lock(&thisUdpRelay->stageLock);
+
+      generation = thisUdpRelay->stageGeneration;
+
+      stages = thisUdpRelay->peerStages;
+
+      pthread_mutex_unlock(&thisUdpRelay->stageLock);
+
+    }
+
+    //Once set, no relayOut thread pushes any more
+
+    bool stopping = thisUdpRelay->remoteStageStopping;
+
+    int relayed = 0;
+
+    vector<peerStage*> finished;
+
+    for(size_t i = 0; i < stages.size(); i++) {
+
+      bool closed = stages[i]->ring->isClosed();
+
+      int popped = 0;
+
+      long long arrivalUs = 0;
+
+      while(popped < STAGE_BATCH && stages[i]->ring->pop(packet,
+
+          MAX_PACKET_SIZE, arrivalUs) > 0) {
+
+        if(thisUdpRelay->relayRemotePacket(stages[i]->name, packet,
+
+            arrivalUs)) {
+
+          stages[i]->counters->count(thisUdpRelay->getOriginGroup(packet),
+
+              thisUdpRelay->getFrameLength(packet));
+
+        }
+
+        memset(packet, 0, SIZE);
+
+        popped++;
+
+      }
+
+      if(closed && popped < STAGE_BATCH) {
+
+        finished.push_back(stages[i]);
+
+      }
+
+      relayed += popped;
+
+    }
+
+    if(stopping && relayed == 0) {
+
+      finished = stages;    //Every ring is empty and stays empty
+
+    }
+
+    if(!finished.empty()) {
+
+      pthread_mutex_lock(&thisUdpRelay->stageLock);
+
+      for(size_t i = 0; i < finished.size(); i++) {
+
+        thisUdpRelay->peerStages.erase(find(thisUdpRelay->peerStages.begin(),
+
+            thisUdpRelay->peerStages.end(), finished[i]));
+
+      }
+
+      thisUdpRelay->stageGeneration++;
+
+      pthread_mutex_unlock(&thisUdpRelay->stageLock);
+
+      for(size_t i = 0; i < finished.size(); i++) {
+
+        thisUdpRelay->retireCounters(finished[i]->counters);
+
+        delete finished[i]->ring;
+
+        delete finished[i];
+
+      }
+
+    }
+
+    if(stopping && relayed == 0) {
+
+      break;
+
+    }
+
+    if(relayed > 0) {
+
+      idle.reset();
+
+    }
+
+    else {
+
+      idle.pause();
+
+    }
+
+  }
+
+  return NULL;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// stagePacket
+
+// Hands a packet to the next stage, waiting while its ring is full
+
+//
+
+// @pre:   Called by the ring's only producer
+
+// @post:  The packet is on the ring if true is returned
+
+// @param  ring:      The next stage's ring
+
+// @param  packet:    A packet in valid packet format
+
+// @param  arrivalUs: monotonicMicros() when the packet was received
+
+// @returns bool:     False if the relay stopped while waiting
+
+//-----------------------------------------------------------------------------
+
+bool UdpRelay::stagePacket(SpscRing* ring, const char* packet,
+
+    long long arrivalUs) {
+
+  int length = getFrameLength(packet);
+
+  if(length > ring->getMaxPacket()) {
+
+    return false;
+
+  }
+
+  IdleBackoff idle(DEFAULT_SPIN_LIMIT, DEFAULT_YIELD_LIMIT,
+
+      DEFAULT_MIN_SLEEP_US, STAGE_MAX_SLEEP_US);
+
+  while(!ring->push(packet, length, arrivalUs)) {
+
+    if(!running) {
+
+      return false;
+
+    }
+
+    idle.pause();
+
+  }
+
+  return true;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// addPeerStage
+
+// Registers the ring a relayOut thread feeds the remote stage with
+
+//
+
+// @pre:   Called by the relayOut thread, which alone pushes to the ring
+
+// @post:  The remote stage reads the ring, and deletes it once it is closed
+
+//         and empty
+
+// @param  remoteGroupID: The peer
+
+// @returns SpscRing*:    The ring
+
+//-----------------------------------------------------------------------------
+
+SpscRing* UdpRelay::addPeerStage(const string& remoteGroupID) {
+
+  peerStage* stage = new peerStage;
+
+  stage->name = remoteGroupID;
+
+  stage->ring = new SpscRing();
+
+  stage->counters = addCounters("received", remoteGroupID);
+
+  pthread_mutex_lock(&stageLock);
+
+  peerStages.push_back(stage);
+
+  stageGeneration++;
+
+  pthread_mutex_unlock(&stageLock);
+
+  return stage->ring;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// stopLocalStage
+
+// Closes ingestRing and waits for the local stage to relay what it holds
+
+//
+
+// @pre:   relayIn has exited
+
+// @post:  The local stage has exited
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::stopLocalStage() {
+
+  ingestRing->close();
+
+  pthread_join(localStageThreadID, NULL);
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// stopRemoteStage
+
+// Waits for the remote stage to queue what every peer ring holds for
+
+// rebroadcast and delete the rings
+
+//
+
+// @pre:   Every relayOut thread has exited
+
+// @post:  The remote stage has exited
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::stopRemoteStage() {
+
+  remoteStageStopping = true;
+
+  pthread_join(remoteStageThreadID, NULL);
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// tcpMulticastToRemoteGroups
+
+// Queues a message on the priority egress queue of every remote node connected
+
+// to this UdpRelay node; the relayEgress threads send it via TCP.
+
+// A group with a tunnel rule goes to UDP link peers through the tunnel
+
+// instead of their links, and a group with a redundancy rule gets a message
+
+// ID its egress threads send to the rule's paths. With a fan-out pool the
+
+
+
+// message is copied once and the pool's shards queue it, so this thread
+
+
+
+// takes fanoutLock for one submit per shard instead of cxnLock for a push
+
+
+
+// per peer
+
+//
+
+// @pre:   outPacket has valid packet format
+
+// @post:  None
+
+// @param  outPacket: A packet received via UDP to be sent out via TCP
+
+// @param  arrivalUs: monotonicMicros() when the packet was received
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::tcpMultiCastToRemoteGroups(char* outPacket,
+
+    long long arrivalUs) {
+
+  int priority = PacketHeader::getPriority(outPacket);
+
+  int length = getFrameLength(outPacket);
+
+  int tunnelMode = TUNNEL_OFF;
+
+  unsigned int group = getOriginGroup(outPacket);
+
+  pthread_mutex_lock(&ruleLock);
+
+  map<unsigned int, int>::iterator rule = tunnelRules.find(group);
+
+  if(rule != tunnelRules.end()) {
+
+    tunnelMode = rule->second;
+
+  }
+
+  bool redundant = redundancyRules.count(group) > 0;
+
+  pthread_mutex_unlock(&ruleLock);
+
+  long long messageId = 0;
+
+  if(redundant) {
+
+    messageId = (long long)(((unsigned long long)fragmentSource << 32) |
+
+        __sync_add_and_fetch(&redundantSequence, 1));
+
+  }
+
+  bool tunneled = tunnelMode != TUNNEL_OFF &&
+
+      tunnelPacket(outPacket, group, tunnelMode);
+
+  pthread_mutex_lock(&fanoutLock);
+
+  if(fanoutPool != NULL) {
+
+    fanoutPacket* packet = new fanoutPacket;
+
+    packet->length = length;
+
+    packet->priority = priority;
+
+    packet->arrivalUs = arrivalUs;
+
+    packet->messageId = messageId;
+
+    packet->group = group;
+
+    vector<bool> used(fanoutShards.size(), false);
+
+    int shards = 0;
+
+    for(map<string, fanoutPeer*>::iterator curPeerIt = fanoutPeers.begin();
+
+        curPeerIt != fanoutPeers.end(); curPeerIt++) {
+
+      if(tunneled && curPeerIt->second->link) {
+
+        continue;
+
+      }
+
+      int shard = curPeerIt->second->shard;
+
+      packet->targets.push_back(make_pair(shard, curPeerIt->second));
+
+      if(!used[shard]) {
+
+        used[shard] = true;
+
+        shards++;
+
+      }
+
+    }
+
+    if(shards == 0) {
+
+      pthread_mutex_unlock(&fanoutLock);
+
+      delete packet;
+
+      return;
+
+    }
+
+    packet->data = new char[length];
+
+    memcpy(packet->data, outPacket, length);
+
+    packet->references = shards;
+
+    for(size_t shard = 0; shard < used.size(); shard++) {
+
+      if(used[shard]) {
+
+        fanoutPool->submit(fanoutShards[shard], fanoutTask, packet,
+
+            (void*)(long)shard);
+
+      }
+
+    }
+
+    pthread_mutex_unlock(&fanoutLock);
+
+    return;
+
+  }
+
+  pthread_mutex_unlock(&fanoutLock);
+
+  pthread_mutex_lock(&cxnLock);
+
+  for(map<string, PacketQueue*>::iterator curQueueIt = egressQueues.begin();
+
+      curQueueIt != egressQueues.end(); curQueueIt++) {
+
+    if(tunneled && curQueueIt->first.compare(0, 4, "udp:") == 0) {
+
+      continue;
+
+    }
+
+    //A full lane counts the drop itself, see showTCPConnections; the origin
+
+    //was worked out above, so conflating by source takes no lock in here
+
+    curQueueIt->second->push(outPacket, length, priority, arrivalUs,
+
+        messageId, group);
+
+  }
+
+  pthread_mutex_unlock(&cxnLock);
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// fanoutTask
+
+// Pool task: queues a packet on the egress queues of the shard's peers and
+
+// frees it once every shard has done so
+
+//
+
+// @pre:   Runs on the shard's strand
+
+// @post:  The packet is queued on, or dropped by, each of the shard's peers
+
+// @param  *context:  A void pointer to the fanoutPacket
+
+// @param  *argument: The shard, cast to a pointer
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::fanoutTask(void* context, void* argument) {
+
+  fanoutPacket* packet = (fanoutPacket*)context;
+
+  int shard = (int)(long)argument;
+
+  for(size_t i = 0; i < packet->targets.size(); i++) {
+
+    if(packet->targets[i].first != shard) {
+
+      continue;   //Another shard's peer, possibly already removed
+
+    }
+
+    //A full lane counts the drop itself, see showTCPConnections
+
+    packet->targets[i].second->queue->push(packet->data, packet->length,
+
+        packet->priority, packet->arrivalUs, packet->messageId,
+
+        packet->group);
+
+  }
+
+  if(__sync_sub_and_fetch(&packet->references, 1) == 0) {
+
+    delete[] packet->data;
+
+    delete packet;
+
+  }
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// addFanoutPeer
+
+// Puts a peer's egress queue on the fan-out shard with the fewest peers
+
+//
+
+// @pre:   cxnLock and fanoutLock are held, and fanoutPool is not NULL
+
+// @post:  fanoutPeers holds the peer
+
+// @param  remoteGroupID: The egressQueues key
+
+// @param  queue:         Its egress queue
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::addFanoutPeer(const string& remoteGroupID, PacketQueue* queue) {
+
+  vector<int> load(fanoutShards.size(), 0);
+
+  for(map<string, fanoutPeer*>::iterator curPeerIt = fanoutPeers.begin();
+
+      curPeerIt != fanoutPeers.end(); curPeerIt++) {
+
+    load[curPeerIt->second->shard]++;
+
+  }
+
+  int shard = 0;
+
+  for(size_t i = 1; i < load.size(); i++) {
+
+    if(load[i] < load[shard]) {
+
+      shard = i;
+
+    }
+
+  }
+
+  fanoutPeer* peer = new fanoutPeer;
+
+  peer->queue = queue;
+
+  peer->name = remoteGroupID;
+
+  peer->link = remoteGroupID.compare(0, 4, "udp:") == 0;
+
+  peer->shard = shard;
+
+  fanoutPeers[remoteGroupID] = peer;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// removeFanoutPeer
+
+// Waits for a peer's shard to run the tasks already handed to it and takes
+
+// the peer off, so its egress queue can be closed
+
+//
+
+// @pre:   cxnLock and fanoutLock are held
+
+// @post:  fanoutPeers does not hold the peer
+
+// @param  remoteGroupID: The egressQueues key
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::removeFanoutPeer(const string& remoteGroupID) {
+
+  map<string, fanoutPeer*>::iterator fanout = fanoutPeers.find(remoteGroupID);
+
+  if(fanout == fanoutPeers.end()) {
+
+    return;
+
+  }
+
+  //Tasks already on the shard may still push to the queue; they never take
+
+  //cxnLock or fanoutLock
+
+  fanoutPool->flush(fanoutShards[fanout->second->shard]);
+
+  delete fanout->second;
+
+  fanoutPeers.erase(fanout);
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// flushFanout
+
+// Waits for the fan-out pool to queue every packet handed to it and drops
+
+// every peer from the shards, so their egress queues can be closed
+
+//
+
+// @pre:   fanoutLock is held
+
+// @post:  fanoutPeers is empty
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::flushFanout() {
+
+  for(size_t i = 0; i < fanoutShards.size(); i++) {
+
+    fanoutPool->flush(fanoutShards[i]);
+
+  }
+
+  for(map<string, fanoutPeer*>::iterator curPeerIt = fanoutPeers.begin();
+
+      curPeerIt != fanoutPeers.end(); curPeerIt++) {
+
+    delete curPeerIt->second;
+
+  }
+
+  fanoutPeers.clear();
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// udpLinkThread
+
+// A static class method that is a thread function for the UDP link socket.
+
+// It hands every datagram to the link of the address it came from, making a
+
+// link for a peer that is new, and lets every link resend what timed out,
+
+// until stopUdpLinks
+
+//
+
+// @pre:   *arg parameter represents a valid UdpRelay object
+
+// @post:  None
+
+// @param  *arg:  A void pointer to the UdpRelay object creating the thread
+
+//-----------------------------------------------------------------------------
+
+void* UdpRelay::udpLinkThread(void *arg) {
+
+  UdpRelay* thisUdpRelay = (UdpRelay*)arg;
+
+  char datagram[MAX_DATAGRAM_SIZE];
+
+  while(thisUdpRelay->udpLinkRunning) {
+
+    int timeoutMs = UDPLINK_POLL_MS;
+
+    pthread_mutex_lock(&thisUdpRelay->udpLinkLock);
+
+    for(map<string, udpLinkPeer*>::iterator curLinkIt =
+
+        thisUdpRelay->udpLinks.begin();
+
+        curLinkIt != thisUdpRelay->udpLinks.end(); curLinkIt++) {
+
+      int dueMs = curLinkIt->second->link->getTimeoutMs();
+
+      if(dueMs < timeoutMs) {
+
+        timeoutMs = dueMs;
+
+      }
+
+    }
+
+    pthread_mutex_unlock(&thisUdpRelay->udpLinkLock);
+
+    struct pollfd ready;
+
+    ready.fd = thisUdpRelay->udpLinkSd;
+
+    ready.events = POLLIN;
+
+    ready.revents = 0;
+
+    poll(&ready, 1, timeoutMs);
+
+    while(true) {
+
+      struct sockaddr_in from;
+
+      socklen_t fromLength = sizeof(from);
+
+      int received = recvfrom(thisUdpRelay->udpLinkSd, datagram,
+
+          sizeof(datagram), MSG_DONTWAIT, (struct sockaddr*)&from,
+
+          &fromLength);
+
+      if(received < 0) {
+
+        break;
+
+      }
+
+      if(UdpTunnel::isTunnelDatagram(datagram, received)) {
+
+        thisUdpRelay->receiveTunneled(datagram, received, from);
+
+        continue;
+
+      }
+
+      if(!UdpLink::isLinkDatagram(datagram, received)) {
+
+        continue;
+
+      }
+
+      string name = udpLinkName(from);
+
+      pthread_mutex_lock(&thisUdpRelay->udpLinkLock);
+
+      map<string, udpLinkPeer*>::iterator found =
+
+          thisUdpRelay->udpLinks.find(name);
+
+      UdpLink* link = (found != thisUdpRelay->udpLinks.end()) ?
+
+          found->second->link : thisUdpRelay->openUdpLink(name, from);
+
+      link->receive(datagram, received);
+
+      pthread_mutex_unlock(&thisUdpRelay->udpLinkLock);
+
+    }
+
+    pthread_mutex_lock(&thisUdpRelay->udpLinkLock);
+
+    for(map<string, udpLinkPeer*>::iterator curLinkIt =
+
+        thisUdpRelay->udpLinks.begin();
+
+        curLinkIt != thisUdpRelay->udpLinks.end(); curLinkIt++) {
+
+      curLinkIt->second->link->service();
+
+    }
+
+    pthread_mutex_unlock(&thisUdpRelay->udpLinkLock);
+
+  }
+
+  return NULL;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// udpLinkEgressThread
+
+// A static class method that is a thread function for a UDP link's egress
+
+// thread. Pops packets from the link's egress queue in priority order and
+
+// sends each one on the stream of its origin group
+
+//
+
+// @pre:   *arg parameter represents a valid udpLinkPeer
+
+// @post:  Deletes the queue, the link and the udpLinkPeer when the queue is
+
+//         closed
+
+// @param  *arg:  A void pointer to the udpLinkPeer
+
+//-----------------------------------------------------------------------------
+
+void* UdpRelay::udpLinkEgressThread(void *arg) {
+
+  udpLinkPeer* peer = (udpLinkPeer*)arg;
+
+  UdpRelay* thisUdpRelay = peer->relay;
+
+  char tagged[CONTROL_FRAME_SIZE + MAX_PACKET_SIZE];
+
+  QueuedPacket packet;
+
+  IdleBackoff idle;
+
+  int affinity = -1;
+
+  CounterBlock* counters = thisUdpRelay->addCounters("sent", peer->name);
+
+  while(thisUdpRelay->nextQueuedPacket(peer->egress, packet, idle)) {
+
+    thisUdpRelay->applyThreadAffinity("egress", affinity);
+
+    if(packet.length > UdpLink::getMaxFrame()) {
+
+      cerr << "UdpRelay: remoteGroup[" << peer->name << "] does not take "
+
+          << packet.length << "-byte packets, dropped packet" << endl;
+
+      delete[] packet.data;
+
+      continue;
+
+    }
+
+    if(PacketHeader::hasTrace(packet.data)) {
+
+      PacketHeader::setTraceResidence(packet.data,
+
+          PacketHeader::getHopCount(packet.data) - 1,
+
+          monotonicMicros() - packet.arrivalUs);
+
+    }
+
+    //Both ends of a link run this relay, so packets keep the version they
+
+    //were relayed in, and a redundant copy leads with the redundant frame
+
+    //header in the same link frame. send() waits while the congestion window
+
+    //is full.
+
+    unsigned int group = thisUdpRelay->getOriginGroup(packet.data);
+
+    const char* frame = packet.data;
+
+    int length = packet.length;
+
+    if(packet.messageId != 0 &&
+
+        length + CONTROL_FRAME_SIZE <= UdpLink::getMaxFrame()) {
+
+      int path = thisUdpRelay->getRedundantPath(group, peer->name);
+
+      if(path >= 0) {
+
+        ControlFrame::build(tagged, CONTROL_FRAME_SIZE, CONTROL_REDUNDANT,
+
+            path, packet.messageId);
+
+        memcpy(tagged + CONTROL_FRAME_SIZE, packet.data, packet.length);
+
+        frame = tagged;
+
+        length += CONTROL_FRAME_SIZE;
+
+      }
+
+    }
+
+    if(peer->link->send(frame, length, group)) {
+
+      counters->count(group, length);
+
+      if(thisUdpRelay->capturing) {
+
+        thisUdpRelay->capturePacket(false, peer->name, packet.data);
+
+      }
+
+    }
+
+    delete[] packet.data;
+
+  }
+
+  thisUdpRelay->retireCounters(counters);
+
+  delete peer->egress;
+
+  delete peer->link;
+
+  delete peer;
+
+  thisUdpRelay->removeWorker();
+
+  return NULL;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// deliverLinkFrame
+
+// UdpLinkDelivery of every link: hands a received packet to the remote stage
+
+// through the link's peer ring, unless it is a redundant copy another path
+
+// delivered first
+
+//
+
+// @pre:   Called by the UDP link thread, the ring's only producer
+
+// @post:  None
+
+// @param  frame:   The packet
+
+// @param  length:  Its length
+
+// @param  context: The udpLinkPeer
+
+// @returns bool:   False if the ring is full, so the link offers it again
+
+//-----------------------------------------------------------------------------
+
+bool UdpRelay::deliverLinkFrame(const char* frame, int length, void* context) {
+
+  udpLinkPeer* peer = (udpLinkPeer*)context;
+
+  UdpRelay* thisUdpRelay = peer->relay;
+
+  long long messageId = 0;
+
+  string path;
+
+  if(length > CONTROL_FRAME_SIZE && ControlFrame::isControl(frame) &&
+
+      ControlFrame::getType(frame) == CONTROL_REDUNDANT) {
+
+    messageId = ControlFrame::getTimestamp(frame);
+
+    path = redundantPathName(peer->name, ControlFrame::getSequence(frame));
+
+    frame += CONTROL_FRAME_SIZE;
+
+    length -= CONTROL_FRAME_SIZE;
+
+  }
+
+  //Frames are queued packets: at least SIZE bytes, ending in the message's
+
+  //\0 or in padding
+
+  if(length < SIZE || length >= MAX_PACKET_SIZE || frame[length - 1] != '\0' ||
+
+      ControlFrame::isControl(frame) ||
+
+      thisUdpRelay->getFrameLength(frame) != length ||
+
+      thisUdpRelay->isOversized(frame)) {
+
+    return true;    //Taken and dropped; resending it would not help
+
+  }
+
+  long long arrivalUs = monotonicMicros();
+
+  if(messageId != 0 &&
+
+      !thisUdpRelay->redundancy.arrived(messageId, path, arrivalUs)) {
+
+    return true;    //Another path's copy came first
+
+  }
+
+  if(!peer->ring->push(frame, length, arrivalUs)) {
+
+    if(messageId != 0) {
+
+      //Offered again later, when another path's copy may have won
+
+      thisUdpRelay->redundancy.retract(messageId, path);
+
+    }
+
+    return false;
+
+  }
+
+  return true;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// openUdpLink
+
+// Creates the link to a peer with its peer ring, egress queue and egress
+
+// thread
+
+//
+
+// @pre:   udpLinkLock is held and udpLinkSd is open
+
+// @post:  udpLinks and egressQueues hold the link
+
+// @param  name:    The link's name, "udp:IP:port"
+
+// @param  address: The peer's UDP link address
+
+// @returns UdpLink*: The new link
+
+//-----------------------------------------------------------------------------
+
+UdpLink* UdpRelay::openUdpLink(const string& name,
+
+    const struct sockaddr_in& address) {
+
+  udpLinkPeer* peer = new udpLinkPeer;
+
+  peer->relay = this;
+
+  peer->name = name;
+
+  peer->link = new UdpLink(udpLinkSd, address, deliverLinkFrame, peer);
+
+  peer->address = address;
+
+  peer->ring = addPeerStage(name);
+
+  peer->egress = new PacketQueue(laneCapacity);
+
+  pthread_mutex_lock(&ruleLock);
+
+  peer->egress->setWeights(weightedSchedule ? scheduleWeights : NULL);
+
+  applyConflation(name, peer->egress);
+
+  pthread_mutex_unlock(&ruleLock);
+
+  udpLinks[name] = peer;
+
+  //The egress thread deletes peer only after its queue is closed, which
+
+  //needs udpLinkLock
+
+  pthread_t egressThreadID;
+
+  addWorker();
+
+  if(pthread_create(&egressThreadID, NULL, udpLinkEgressThread,
+
+      (void*)peer) != 0) {
+
+    cerr << "Thread creation failed!" << endl;
+
+    exit(EXIT_FAILURE);
+
+  }
+
+  pthread_detach(egressThreadID);
+
+  pthread_mutex_lock(&cxnLock);
+
+  egressQueues[name] = peer->egress;
+
+  pthread_mutex_lock(&fanoutLock);
+
+  if(fanoutPool != NULL) {
+
+    addFanoutPeer(name, peer->egress);
+
+  }
+
+  pthread_mutex_unlock(&fanoutLock);
+
+  pthread_mutex_unlock(&cxnLock);
+
+  notifyAdmins("up " + name);
+
+  cout << "UdpRelay: linked " << name << endl;
+
+  return peer->link;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// stopUdpLinks
+
+// Stops the UDP link thread, closes every link and the socket
+
+//
+
+// @pre:   None
+
+// @post:  udpLinks is empty; the links' egress threads exit on their own
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::stopUdpLinks() {
+
+  if(udpLinkSd == NULL_SD) {
+
+    return;
+
+  }
+
+  udpLinkRunning = false;
+
+  pthread_join(udpLinkThreadID, NULL);
+
+  tunnelRing->close();    //The remote stage deletes it
+
+  pthread_mutex_lock(&udpLinkLock);
+
+  map<string, udpLinkPeer*> closing = udpLinks;
+
+  udpLinks.clear();
+
+  tunnelRing = NULL;
+
+  pthread_mutex_unlock(&udpLinkLock);
+
+  for(map<string, udpLinkPeer*>::iterator curLinkIt = closing.begin();
+
+      curLinkIt != closing.end(); curLinkIt++) {
+
+    curLinkIt->second->ring->close();   //The remote stage deletes it
+
+    curLinkIt->second->link->close();   //No datagram is sent after this
+
+    stopEgress(curLinkIt->first);
+
+    notifyAdmins("down " + curLinkIt->first);
+
+  }
+
+  pthread_mutex_lock(&udpLinkLock);
+
+  close(udpLinkSd);
+
+  udpLinkSd = NULL_SD;
+
+  pthread_mutex_unlock(&udpLinkLock);
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// udpLinkName
+
+// Returns the name of the link to an address
+
+//
+
+// @pre:   None
+
+// @post:  None
+
+// @param  address: The peer's UDP link address
+
+// @returns string: "udp:IP:port"
+
+//-----------------------------------------------------------------------------
+
+string UdpRelay::udpLinkName(const struct sockaddr_in& address) {
+
+  char ip[INET_ADDRSTRLEN] = {0};
+
+  inet_ntop(AF_INET, &address.sin_addr, ip, sizeof(ip));
+
+  stringstream name;
+
+  name << "udp:" << ip << ":" << ntohs(address.sin_port);
+
+  return name.str();
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// tunnelPacket
+
+// Sends a packet to every UDP link peer as a tunnel datagram
+
+//
+
+// @pre:   packet has valid packet format
+
+// @post:  None
+
+// @param  packet: The packet
+
+// @param  group:  Its origin group
+
+// @param  mode:   TUNNEL_UNRELIABLE or TUNNEL_ORDERED
+
+// @returns bool:  False if UDP links are off or the packet does not fit in a
+
+//                 datagram
+
+//-----------------------------------------------------------------------------
+
+bool UdpRelay::tunnelPacket(const char* packet, unsigned int group, int mode) {
+
+  int length = PacketHeader::getLength(packet, MAX_PACKET_SIZE);
+
+  if(length > MAX_DATAGRAM_SIZE - UDPTUNNEL_HEADER_SIZE) {
+
+    return false;
+
+  }
+
+  char datagram[MAX_DATAGRAM_SIZE];
+
+  pthread_mutex_lock(&udpLinkLock);
+
+  if(udpLinkSd == NULL_SD) {
+
+    pthread_mutex_unlock(&udpLinkLock);
+
+    return false;
+
+  }
+
+  if(!udpLinks.empty()) {
+
+    int bytes = tunnel.wrap(packet, length, group, mode == TUNNEL_ORDERED,
+
+        datagram);
+
+    for(map<string, udpLinkPeer*>::iterator curLinkIt = udpLinks.begin();
+
+        curLinkIt != udpLinks.end(); curLinkIt++) {
+
+      //A full socket buffer drops the datagram like the network would
+
+      if(sendto(udpLinkSd, datagram, bytes, MSG_DONTWAIT,
+
+          (struct sockaddr*)&curLinkIt->second->address,
+
+          sizeof(curLinkIt->second->address)) == bytes) {
+
+        tunnel.countSent();
+
+      }
+
+      else {
+
+        tunnel.countFailed();
+
+      }
+
+    }
+
+  }
+
+  pthread_mutex_unlock(&udpLinkLock);
+
+  return true;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// receiveTunneled
+
+// Accounts for a tunnel datagram and hands its packet to the remote stage
+
+// unless it is dropped
+
+//
+
+// @pre:   Called by the UDP link thread, tunnelRing's only producer
+
+// @post:  None
+
+// @param  datagram: A tunnel datagram
+
+// @param  length:   Its length
+
+// @param  from:     Address it came from
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::receiveTunneled(const char* datagram, int length,
+
+    const struct sockaddr_in& from) {
+
+  int bytes = tunnel.unwrap(datagram, length, udpLinkName(from));
+
+  if(bytes <= 0 || bytes >= MAX_PACKET_SIZE) {
+
+    return;
+
+  }
+
+  char packet[MAX_PACKET_SIZE];
+
+  memset(packet, 0, SIZE);
+
+  memcpy(packet, datagram + UDPTUNNEL_HEADER_SIZE, bytes);
+
+  //The packet must end in its message's \0, as a link's frame does
+
+  if(packet[bytes - 1] != '\0' || ControlFrame::isControl(packet) ||
+
+      PacketHeader::getLength(packet, MAX_PACKET_SIZE) != bytes ||
+
+      isOversized(packet)) {
+
+    return;
+
+  }
+
+  //Never wait: a full ring drops the packet and counts as a stall
+
+  tunnelRing->push(packet, getFrameLength(packet), monotonicMicros());
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// getRedundantPath
+
+// Returns the path a peer is for an origin group with a redundancy rule
+
+//
+
+// @pre:   None
+
+// @post:  None
+
+// @param  group:         The origin group
+
+// @param  remoteGroupID: The egressQueues key of the peer
+
+// @returns int:          The peer's index in the group's paths, -1 if it is
+
+//                        not one of them
+
+//-----------------------------------------------------------------------------
+
+int UdpRelay::getRedundantPath(unsigned int group,
+
+    const string& remoteGroupID) {
+
+  int path = -1;
+
+  pthread_mutex_lock(&ruleLock);
+
+  map<unsigned int, vector<string> >::iterator rule =
+
+      redundancyRules.find(group);
+
+  if(rule != redundancyRules.end()) {
+
+    vector<string>::iterator found = find(rule->second.begin(),
+
+        rule->second.end(), remoteGroupID);
+
+    if(found != rule->second.end()) {
+
+      path = found - rule->second.begin();
+
+    }
+
+  }
+
+  pthread_mutex_unlock(&ruleLock);
+
+  return path;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// redundantPathName
+
+// Returns the name a redundant copy's path is counted under in redundancy
+
+//
+
+// @pre:   None
+
+// @post:  None
+
+// @param  remoteGroupID: The link the copy came in on
+
+// @param  path:          The sender's index of the path, from its redundant
+
+//                        frame
+
+// @returns string:       "link path index"
+
+//-----------------------------------------------------------------------------
+
+string UdpRelay::redundantPathName(const string& remoteGroupID,
+
+    unsigned int path) {
+
+  stringstream name;
+
+  name << remoteGroupID << " path " << path;
+
+  return name.str();
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// terminateRemoteCxn
+
+// Closes the socket to the remote node IP/name passed as parameter, then
+
+// deletes that connection from the map. A managed peer is no longer
+
+// reconnected and its backlog is discarded
+
+//
+
+// @pre:   remoteGroupID is a valid group IP/name and map contains that group
+
+// @post:  tcpCxns map is updated with group IP/name entry removed
+
+// @param  remoteGroupID: A valid group IP/Name
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::terminateRemoteCxn(string remoteGroupID) {
+
+  pthread_mutex_lock(&cxnLock);
+
+  bool wasManaged = managedPeers.erase(remoteGroupID) > 0;
+
+  pthread_mutex_unlock(&cxnLock);
+
+  char* remoteSocket = new char[remoteGroupID.length() + 1];
+
+ strcpy(remoteSocket, remoteGroupID.c_str());
+
+  if(tcpCxns.count(remoteSocket) != 0) {
+
+    shutdown(tcpCxns[remoteSocket], SHUT_RDWR);
+
+    if(expiredOutThreads.size() > 5) {
+
+      while(!expiredOutThreads.empty()) {
+
+        pthread_join(expiredOutThreads.front(), NULL);
+
+        expiredOutThreads.pop();
+
+      }
+
+    }
+
+    if(tcpCxns.count(remoteSocket) > 0) {
+
+      pthread_mutex_lock(&cxnLock);
+
+      tcpCxns.erase(tcpCxns.find(remoteSocket));
+
+      peers.erase(remoteGroupID);
+
+      peerGeneration++;
+
+      pthread_mutex_unlock(&cxnLock);
+
+      stopEgress(remoteGroupID);
+
+      notifyAdmins("down " + remoteGroupID);
+
+      cout << "UdpRelay: deleted " << remoteGroupID << endl;
+
+    }
+
+  }
+
+  else if(wasManaged) {
+
+    stopEgress(remoteGroupID);
+
+    cout << "UdpRelay: deleted " << remoteGroupID << endl;
+
+  }
+
+  else {
+
+    cout << "No connection to that remote group exists." << endl;
+
+  }
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// terminateAllTcpConnections
+
+// Closes all open TCP sockets and removes the connection entries from both
+
+// tcpCxns and outThreadCxns maps
+
+//
+
+// @pre:   None
+
+// @post:  Sockets are closed and both maps have all entries deleted
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::terminateAllTcpConnections() {
+
+  pthread_mutex_lock(&cxnLock);
+
+  map<string, int>::iterator curSdIt = tcpCxns.begin();
+
+  while(curSdIt != tcpCxns.end()) {
+
+    shutdown(curSdIt->second, SHUT_RDWR);   //Wakes its relayOut thread
+
+    close(curSdIt->second);
+
+    tcpCxns.erase(curSdIt++);
+
+  }
+
+  pthread_mutex_lock(&fanoutLock);
+
+  flushFanout();
+
+  pthread_mutex_unlock(&fanoutLock);
+
+  for(map<string, PacketQueue*>::iterator curQueueIt = egressQueues.begin();
+
+      curQueueIt != egressQueues.end(); curQueueIt++) {
+
+    curQueueIt->second->close();
+
+  }
+
+  egressQueues.clear();
+
+  peers.clear();
+
+  peerGeneration++;
+
+  managedPeers.clear();
+
+  pthread_mutex_unlock(&cxnLock);
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// startEgress
+
+// Creates the priority queue and relayEgress thread for a newly registered TCP
+
+// connection, replacing any queue left over for the same group. A managed peer
+
+// that reconnects keeps its queue and backlog instead
+
+//
+
+// @pre:   remoteGroupID is the key the connection was stored under in tcpCxns
+
+// @post:  egressQueues maps remoteGroupID to a new queue with its own thread
+
+// @param  remoteGroupID: A valid group IP/Name
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::startEgress(const string& remoteGroupID) {
+
+  pthread_mutex_lock(&cxnLock);
+
+  bool managed = managedPeers.count(remoteGroupID) > 0;
+
+  bool buffering = managed && egressQueues.count(remoteGroupID) > 0;
+
+  pthread_mutex_unlock(&cxnLock);
+
+  if(buffering) {
+
+    return;   //Keep the queue and backlog that outlived the last connection
+
+  }
+
+  stopEgress(remoteGroupID);
+
+  PacketQueue* egress = new PacketQueue(laneCapacity);
+
+  pthread_mutex_lock(&ruleLock);
+
+  egress->setWeights(weightedSchedule ? scheduleWeights : NULL);
+
+  applyConflation(remoteGroupID, egress);
+
+  pthread_mutex_unlock(&ruleLock);
+
+
+
+  egressThreadInfo* egressInfo = new egressThreadInfo;
+
+  egressInfo->queue = egress;
+
+  egressInfo->currentRelay = this;
+
+  egressInfo->remoteGroupID = remoteGroupID;
+
+  egressInfo->managed = managed;
+
+  pthread_t egressThreadID;
+
+  addWorker();
+
+  if(pthread_create(&egressThreadID, NULL, relayEgressThread,
+
+      (void*)egressInfo) != 0) {
+
+    cerr << "Thread creation failed!" << endl;
+
+    exit(EXIT_FAILURE);
+
+  }
+
+  pthread_detach(egressThreadID);
+
+
+
+  pthread_mutex_lock(&cxnLock);
+
+  egressQueues[remoteGroupID] = egress;
+
+  pthread_mutex_lock(&fanoutLock);
+
+  if(fanoutPool != NULL) {
+
+    addFanoutPeer(remoteGroupID, egress);
+
+  }
+
+  pthread_mutex_unlock(&fanoutLock);
+
+  pthread_mutex_unlock(&cxnLock);
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// stopEgress
+
+// Closes the priority queue of a connection so its relayEgress thread exits,
+
+// and removes it from egressQueues and the fan-out shards
+
+//
+
+// @pre:   None
+
+// @post:  No queue is registered for remoteGroupID
+
+// @param  remoteGroupID: A valid group IP/Name
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::stopEgress(const string& remoteGroupID) {
+
+  pthread_mutex_lock(&cxnLock);
+
+  map<string, PacketQueue*>::iterator egress =
+
+      egressQueues.find(remoteGroupID);
+
+  if(egress != egressQueues.end()) {
+
+    pthread_mutex_lock(&fanoutLock);
+
+    removeFanoutPeer(remoteGroupID);
+
+    pthread_mutex_unlock(&fanoutLock);
+
+    egress->second->close();
+
+    egressQueues.erase(egress);
+
+  }
+
+  pthread_mutex_unlock(&cxnLock);
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// setPriorityRule
+
+// Assigns a priority class to all untagged packets originating from a group,
+
+// or removes the rule if className is "none"
+
+//
+
+// @pre:   None
+
+// @post:  priorityRules is updated, or an error is reported to cout
+
+// @param  groupIP:   Dotted group IP address of the origin group
+
+// @param  className: bulk, normal, interactive, control or none
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::setPriorityRule(const string& groupIP,
+
+    const string& className) {
+
+  const char* CLASS_NAMES[NUM_PRIORITIES] =
+
+      {"bulk", "normal", "interactive", "control"};
+
+  struct in_addr groupAddr;
+
+  if(inet_pton(AF_INET, groupIP.c_str(), &groupAddr) != 1) {
+
+    cout << "Invalid group IP: " << groupIP << endl;
+
+    return;
+
+  }
+
+  unsigned int origin = ntohl(groupAddr.s_addr);
+
+  pthread_mutex_lock(&ruleLock);
+
+  if(className == "none") {
+
+    priorityRules.erase(origin);
+
+    pthread_mutex_unlock(&ruleLock);
+
+    cout << "UdpRelay: cleared priority of " << groupIP << endl;
+
+    return;
+
+  }
+
+  for(int i = 0; i < NUM_PRIORITIES; i++) {
+
+    if(className == CLASS_NAMES[i]) {
+
+      priorityRules[origin] = i;
+
+      pthread_mutex_unlock(&ruleLock);
+
+      cout << "UdpRelay: " << groupIP << " is now " << className << endl;
+
+      return;
+
+    }
+
+  }
+
+  pthread_mutex_unlock(&ruleLock);
+
+  cout << "Unknown priority class: " << className << endl;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// setTunnelRule
+
+// Sends the packets of an origin group through the best-effort tunnel, or
+
+// over the links again if mode is "none"
+
+//
+
+// @pre:   None
+
+// @post:  tunnelRules is updated, or an error is reported to cout
+
+// @param  groupIP: Dotted group IP address of the origin group
+
+// @param  mode:    unreliable, ordered or none
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::setTunnelRule(const string& groupIP, const string& mode) {
+
+  struct in_addr groupAddr;
+
+  if(inet_pton(AF_INET, groupIP.c_str(), &groupAddr) != 1) {
+
+    cout << "Invalid group IP: " << groupIP << endl;
+
+    return;
+
+  }
+
+  unsigned int origin = ntohl(groupAddr.s_addr);
+
+  int tunnelMode = TUNNEL_OFF;
+
+  if(mode == "unreliable") {
+
+    tunnelMode = TUNNEL_UNRELIABLE;
+
+  }
+
+  else if(mode == "ordered") {
+
+    tunnelMode = TUNNEL_ORDERED;
+
+  }
+
+  else if(mode != "none") {
+
+    cout << "Unknown tunnel mode: " << mode << endl;
+
+    return;
+
+  }
+
+  pthread_mutex_lock(&ruleLock);
+
+  if(tunnelMode == TUNNEL_OFF) {
+
+    tunnelRules.erase(origin);
+
+  }
+
+  else {
+
+    tunnelRules[origin] = tunnelMode;
+
+  }
+
+  pthread_mutex_unlock(&ruleLock);
+
+  if(tunnelMode == TUNNEL_OFF) {
+
+    cout << "UdpRelay: " << groupIP << " goes over the links" << endl;
+
+  }
+
+  else {
+
+    cout << "UdpRelay: " << groupIP << " is tunneled " << mode << endl;
+
+  }
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// setRedundancyRule
+
+// Sends every packet of an origin group over each of several peer links,
+
+// tagged with one message ID, or once per peer again if paths is "none"
+
+//
+
+// @pre:   None
+
+// @post:  redundancyRules is updated, or an error is reported to cout
+
+// @param  groupIP: Dotted group IP address of the origin group
+
+// @param  paths:   The paths' names, or just "none"
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::setRedundancyRule(const string& groupIP,
+
+    const vector<string>& paths) {
+
+  struct in_addr groupAddr;
+
+  if(inet_pton(AF_INET, groupIP.c_str(), &groupAddr) != 1) {
+
+    cout << "Invalid group IP: " << groupIP << endl;
+
+    return;
+
+  }
+
+  unsigned int origin = ntohl(groupAddr.s_addr);
+
+  bool off = paths.size() == 1 && paths[0] == "none";
+
+  if(!off && paths.size() < 2) {
+
+    cout << "A redundant group needs at least two paths" << endl;
+
+    return;
+
+  }
+
+  pthread_mutex_lock(&ruleLock);
+
+  if(off) {
+
+    redundancyRules.erase(origin);
+
+  }
+
+  else {
+
+    redundancyRules[origin] = paths;
+
+  }
+
+  pthread_mutex_unlock(&ruleLock);
+
+  if(off) {
+
+    cout << "UdpRelay: " << groupIP << " goes once to every peer" << endl;
+
+    return;
+
+  }
+
+  cout << "UdpRelay: " << groupIP << " goes redundantly over";
+
+  for(size_t i = 0; i < paths.size(); i++) {
+
+    cout << " " << paths[i];
+
+  }
+
+  cout << endl;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// setConflation
+
+// Conflates a peer's egress queue on a key of payload bytes, and its origin
+
+// if bySource, or stops if length is 0
+
+//
+
+// @pre:   None
+
+// @post:  conflationRules is updated, or an error is reported to cout
+
+// @param  remoteGroupID: The egressQueues key of the peer
+
+// @param  offset:        First payload byte of the key
+
+// @param  length:        Number of key bytes, 0 turns conflation off
+
+// @param  bySource:      Key on origin and payload bytes
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::setConflation(const string& remoteGroupID, int offset,
+
+    int length, bool bySource) {
+
+  if(offset < 0 || length < 0 || offset + length > MAX_PAYLOAD) {
+
+    cout << "Invalid conflation key: " << length << " bytes at " << offset
+
+        << endl;
+
+    return;
+
+  }
+
+  pthread_mutex_lock(&ruleLock);
+
+  if(length == 0) {
+
+    conflationRules.erase(remoteGroupID);
+
+  }
+
+  else {
+
+    conflationRule rule;
+
+    rule.offset = offset;
+
+    rule.length = length;
+
+    rule.bySource = bySource;
+
+    conflationRules[remoteGroupID] = rule;
+
+  }
+
+  pthread_mutex_unlock(&ruleLock);
+
+  pthread_mutex_lock(&cxnLock);
+
+  map<string, PacketQueue*>::iterator egress =
+
+      egressQueues.find(remoteGroupID);
+
+  if(egress != egressQueues.end()) {
+
+    egress->second->setConflation(offset, length, bySource);
+
+  }
+
+  pthread_mutex_unlock(&cxnLock);
+
+  if(length == 0) {
+
+    cout << "UdpRelay: " << remoteGroupID << " gets every packet" << endl;
+
+  }
+
+  else {
+
+    cout << "UdpRelay: " << remoteGroupID << " gets the latest packet per "
+
+        << (bySource ? "origin and " : "") << "payload bytes " << offset
+
+        << ".." << offset + length - 1 << endl;
+
+  }
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// applyConflation
+
+// Sets a new egress queue's conflation from its peer's rule
+
+//
+
+// @pre:   ruleLock is held
+
+// @post:  None
+
+// @param  remoteGroupID: The egressQueues key of the peer
+
+// @param  queue:         Its egress queue
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::applyConflation(const string& remoteGroupID,
+
+    PacketQueue* queue) {
+
+  map<string, conflationRule>::iterator rule =
+
+      conflationRules.find(remoteGroupID);
+
+  if(rule != conflationRules.end()) {
+
+    queue->setConflation(rule->second.offset, rule->second.length,
+
+        rule->second.bySource);
+
+  }
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// setSchedule
+
+// Selects strict priority (weights is NULL) or weighted round robin for the
+
+// rebroadcast queue and every TCP egress queue, current and future
+
+//
+
+// @pre:   weights is NULL or holds NUM_PRIORITIES values > 0
+
+// @post:  All queues use the new scheduling mode
+
+// @param  weights: Packets each class may send per round, bulk first
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::setSchedule(const int* weights) {
+
+  pthread_mutex_lock(&ruleLock);
+
+  weightedSchedule = (weights != NULL);
+
+  for(int i = 0; weights != NULL && i < NUM_PRIORITIES; i++) {
+
+    scheduleWeights[i] = weights[i];
+
+  }
+
+  pthread_mutex_unlock(&ruleLock);
+
+
+
+  rebroadcastQueue->setWeights(weights);
+
+  pthread_mutex_lock(&cxnLock);
+
+  for(map<string, PacketQueue*>::iterator curQueueIt = egressQueues.begin();
+
+      curQueueIt != egressQueues.end(); curQueueIt++) {
+
+    curQueueIt->second->setWeights(weights);
+
+  }
+
+  pthread_mutex_unlock(&cxnLock);
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// setQueueCapacity
+
+// Sets how many packets each priority lane of the rebroadcast queue and every
+
+// TCP egress queue holds, current and future
+
+//
+
+// @pre:   None
+
+// @post:  All queues use the new capacity, or an error is reported to cout
+
+// @param  packets: Packets per lane
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::setQueueCapacity(int packets) {
+
+  if(packets <= 0) {
+
+    cout << "usage: queue <packets per lane>" << endl;
+
+    return;
+
+  }
+
+  laneCapacity = packets;
+
+  rebroadcastQueue->setCapacity(packets);
+
+  pthread_mutex_lock(&cxnLock);
+
+  for(map<string, PacketQueue*>::iterator curQueueIt = egressQueues.begin();
+
+      curQueueIt != egressQueues.end(); curQueueIt++) {
+
+    curQueueIt->second->setCapacity(packets);
+
+  }
+
+  pthread_mutex_unlock(&cxnLock);
+
+  cout << "UdpRelay: queues hold " << packets << " packets per lane" << endl;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// setLowLatency
+
+// Turns low-latency mode on or off. In low-latency mode the relay threads poll
+
+// their sockets and queues instead of blocking, TCP connections use
+
+// TCP_NODELAY and, if busyPollUs > 0, sockets request SO_BUSY_POLL
+
+//
+
+// @pre:   busyPollUs >= 0
+
+// @post:  The mode is applied to the multicast socket and all connections
+
+// @param  on:         True to enable low-latency mode
+
+// @param  busyPollUs: SO_BUSY_POLL budget in microseconds, 0 to leave off
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::setLowLatency(bool on, int busyPollUs) {
+
+  this->busyPollUs = on ? busyPollUs : 0;
+
+  lowLatency = on;
+
+  if(localRecvSd != NULL_SD) {
+
+    tuneSocket(localRecvSd);
+
+  }
+
+  pthread_mutex_lock(&cxnLock);
+
+  for(map<string, int>::iterator curSdIt = tcpCxns.begin();
+
+      curSdIt != tcpCxns.end(); curSdIt++) {
+
+    tuneSocket(curSdIt->second);
+
+  }
+
+  timestampGeneration++;      //tuneSocket restarted the transmit byte keys
+
+  pthread_mutex_unlock(&cxnLock);
+
+  cout << "UdpRelay: low-latency mode " << (on ? "on" : "off") << endl;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// tuneSocket
+
+// Applies the current low-latency socket options to one socket
+
+//
+
+// @pre:   sd is an open socket
+
+// @post:  TCP_NODELAY, SO_BUSY_POLL and SO_TIMESTAMPING reflect the current
+
+//         modes; TCP sockets also get transmit timestamps
+
+// @param  sd: The socket to configure
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::tuneSocket(int sd) {
+
+  int type = 0;
+
+  socklen_t typeLength = sizeof(type);
+
+  getsockopt(sd, SOL_SOCKET, SO_TYPE, &type, &typeLength);
+
+  if(type == SOCK_STREAM) {
+
+    int noDelay = lowLatency ? 1 : 0;
+
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+  }
+
+  if(timestampMode == TIMESTAMPS_OFF) {
+
+    SocketTimestamps::disable(sd);
+
+  }
+
+  else if(!SocketTimestamps::enable(sd, type == SOCK_STREAM,
+
+      timestampMode == TIMESTAMPS_HARDWARE)) {
+
+    cerr << "UdpRelay: SO_TIMESTAMPING refused on socket " << sd << ": "
+
+        << strerror(errno) << endl;
+
+  }
+
+#ifdef SO_BUSY_POLL
+
+  int budget = busyPollUs;
+
+  if(setsockopt(sd, SOL_SOCKET, SO_BUSY_POLL, &budget, sizeof(budget)) < 0 &&
+
+      budget > 0) {
+
+    cerr << "UdpRelay: SO_BUSY_POLL refused on socket " << sd << ": "
+
+        << strerror(errno) << endl;
+
+  }
+
+#endif
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// setThreadAffinity
+
+// Pins every thread of a role to a CPU set; threads pick the change up the
+
+// next time they wake
+
+//
+
+// @pre:   None
+
+// @post:  threadAffinity is updated, or an error is reported to cout
+
+// @param  role: relayIn, relayOut, egress or rebroadcast
+
+// @param  spec: A CPU specification accepted by CpuAffinity, or "none"
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::setThreadAffinity(const string& role, const string& spec) {
+
+  if(role != "relayIn" && role != "relayOut" && role != "localStage" &&
+
+      role != "remoteStage" && role != "egress" && role != "rebroadcast") {
+
+    cout << "Unknown thread role: " << role << endl;
+
+    return;
+
+  }
+
+  cpu_set_t cpus;
+
+  if(!CpuAffinity::parse(spec, cpus)) {
+
+    cout << "Invalid CPU specification: " << spec << endl;
+
+    return;
+
+  }
+
+  pthread_mutex_lock(&ruleLock);
+
+  if(spec == "none") {
+
+    threadAffinity.erase(role);
+
+  }
+
+  else {
+
+    threadAffinity[role] = spec;
+
+  }
+
+  affinityGeneration++;
+
+  pthread_mutex_unlock(&ruleLock);
+
+  cout << "UdpRelay: " << role << " threads pinned to " << spec << endl;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// setTracing
+
+// Turns per-hop tracing of locally received packets on or off
+
+//
+
+// @pre:   sampleRate >= 0
+
+// @post:  One in sampleRate local packets is traced, none if 0
+
+// @param  sampleRate: Trace every sampleRate-th packet, 0 to stop tracing
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::setTracing(int sampleRate) {
+
+  traceCounter = 0;
+
+  traceSampleRate = (sampleRate > 0) ? sampleRate : 0;
+
+  if(traceSampleRate == 0) {
+
+    cout << "UdpRelay: tracing off" << endl;
+
+  }
+
+  else {
+
+    cout << "UdpRelay: tracing 1 in " << traceSampleRate
+
+        << " local packets" << endl;
+
+  }
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// showTraces
+
+// Displays the latency percentiles of every traced path and the per-hop
+
+// breakdown of the slowest recent traced packets to cout
+
+//
+
+// @pre:   None
+
+// @post:  None
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::showTraces() {
+
+  pthread_mutex_lock(&traceLock);
+
+  if(pathLatency.empty()) {
+
+    pthread_mutex_unlock(&traceLock);
+
+    cout << "No traced packets received" << endl;
+
+    return;
+
+  }
+
+  for(map<string, LatencyHistogram>::iterator path = pathLatency.begin();
+
+      path != pathLatency.end(); path++) {
+
+    cout << "path " << path->first << ": " << path->second.count()
+
+        << " packets, p50 " << path->second.percentile(50) << "us, p99 "
+
+        << path->second.percentile(99) << "us, max " << path->second.max()
+
+        << "us" << endl;
+
+  }
+
+  vector<traceSample> slowest(recentTraces.begin(), recentTraces.end());
+
+  pthread_mutex_unlock(&traceLock);
+
+
+
+  for(int shown = 0; shown < SLOWEST_TRACES_SHOWN && !slowest.empty();
+
+      shown++) {
+
+    size_t worst = 0;
+
+    for(size_t i = 1; i < slowest.size(); i++) {
+
+      if(slowest[i].latencyUs > slowest[worst].latencyUs) {
+
+        worst = i;
+
+      }
+
+    }
+
+    cout << slowest[worst].latencyUs << "us " << slowest[worst].path
+
+        << slowest[worst].breakdown << endl;
+
+    slowest.erase(slowest.begin() + worst);
+
+  }
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// setTimestamping
+
+// Turns SO_TIMESTAMPING off, on with software timestamps, or on with
+
+// hardware timestamps from a NIC. Receive timestamps are taken on the
+
+// multicast socket and every TCP connection, transmit timestamps on every
+
+// TCP connection.
+
+//
+
+// @pre:   mode is TIMESTAMPS_OFF, TIMESTAMPS_SOFTWARE or TIMESTAMPS_HARDWARE
+
+// @post:  All sockets use the new mode, or an error is reported to cout
+
+// @param  mode:      The timestamping mode
+
+// @param  interface: NIC to switch to hardware timestamping, if any
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::setTimestamping(int mode, const string& interface) {
+
+  if(mode == TIMESTAMPS_HARDWARE && !interface.empty() &&
+
+      !SocketTimestamps::enableHardware(interface)) {
+
+    cout << "Hardware timestamping could not be enabled on " << interface
+
+        << ": " << strerror(errno) << endl;
+
+    return;
+
+  }
+
+  timestampMode = mode;
+
+  if(localRecvSd != NULL_SD) {
+
+    tuneSocket(localRecvSd);
+
+  }
+
+  pthread_mutex_lock(&cxnLock);
+
+  for(map<string, int>::iterator curSdIt = tcpCxns.begin();
+
+      curSdIt != tcpCxns.end(); curSdIt++) {
+
+    tuneSocket(curSdIt->second);
+
+  }
+
+  timestampGeneration++;
+
+  pthread_mutex_unlock(&cxnLock);
+
+  cout << "UdpRelay: timestamping "
+
+      << (mode == TIMESTAMPS_OFF ? "off" :
+
+          (mode == TIMESTAMPS_SOFTWARE ? "software" : "hardware")) << endl;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// addLatency
+
+// Creates the latency histograms for a relay thread
+
+//
+
+// @pre:   Called by the thread that will record into them
+
+// @post:  readLatency includes the block until retireLatency
+
+// @returns latencyBlock*: The thread's block
+
+//-----------------------------------------------------------------------------
+
+UdpRelay::latencyBlock* UdpRelay::addLatency() {
+
+  latencyBlock* latency = new latencyBlock;
+
+  pthread_mutex_lock(&latencyLock);
+
+  latencyBlocks.push_back(latency);
+
+  pthread_mutex_unlock(&latencyLock);
+
+  return latency;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// retireLatency
+
+// Folds an exiting thread's samples into the totals kept for exited threads
+
+//
+
+// @pre:   latency was returned by addLatency
+
+// @post:  latency is deleted
+
+// @param  latency: The exiting thread's block
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::retireLatency(latencyBlock* latency) {
+
+  pthread_mutex_lock(&latencyLock);
+
+  for(int i = 0; i < LATENCY_STAGES; i++) {
+
+    retiredLatency[i].merge(latency->stages[i]);
+
+  }
+
+  for(size_t i = 0; i < latencyBlocks.size(); i++) {
+
+    if(latencyBlocks[i] == latency) {
+
+      latencyBlocks.erase(latencyBlocks.begin() + i);
+
+      break;
+
+    }
+
+  }
+
+  pthread_mutex_unlock(&latencyLock);
+
+  delete latency;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// readLatency
+
+// Merges the samples of every relay thread, running or exited, by stage
+
+//
+
+// @pre:   totals has LATENCY_STAGES empty histograms
+
+// @post:  totals[i] holds every sample of stage i
+
+// @param  totals: Receives the merged histograms
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::readLatency(LatencyHistogram* totals) {
+
+  pthread_mutex_lock(&latencyLock);
+
+  for(int i = 0; i < LATENCY_STAGES; i++) {
+
+    totals[i].merge(retiredLatency[i]);
+
+    for(size_t j = 0; j < latencyBlocks.size(); j++) {
+
+      totals[i].merge(latencyBlocks[j]->stages[i]);
+
+    }
+
+  }
+
+  pthread_mutex_unlock(&latencyLock);
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// matchTxTimestamps
+
+// Reads the transmit timestamps queued on a TCP socket and records, for
+
+// each send they acknowledge, the time from send() to the kernel/NIC
+
+// transmit timestamp
+
+//
+
+// @pre:   Transmit timestamps are enabled on sd
+
+// @post:  Matched and older sends are removed from pending
+
+// @param  sd:       The socket to read
+
+// @param  pending:  (byte key, realtime at send) of unmatched sends
+
+// @param  scratch:  Buffer reused between calls
+
+// @param  transmit: The calling thread's transmit histogram
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::matchTxTimestamps(int sd, deque<TxTimestamp>& pending,
+
+    vector<TxTimestamp>& scratch, LatencyHistogram& transmit) {
+
+  scratch.clear();
+
+  SocketTimestamps::readTxTimestamps(sd, scratch);
+
+  for(size_t i = 0; i < scratch.size(); i++) {
+
+    //Keys are byte offsets that wrap at 2^32; compare by signed distance
+
+    while(!pending.empty() &&
+
+        (int)(pending.front().first - scratch[i].first) < 0) {
+
+      pending.pop_front();
+
+    }
+
+    if(!pending.empty() && pending.front().first == scratch[i].first) {
+
+      transmit.record(scratch[i].second - pending.front().second);
+
+      pending.pop_front();
+
+    }
+
+  }
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// showLatency
+
+// Displays the kernel receive queueing, relay processing and kernel
+
+// transmit latency histograms to cout
+
+//
+
+// @pre:   None
+
+// @post:  None
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::showLatency() {
+
+  const char* names[] = {"local receive", "remote receive", "processing",
+
+      "transmit"};
+
+  LatencyHistogram latencies[LATENCY_STAGES];
+
+  if(timestampMode == TIMESTAMPS_OFF) {
+
+    cout << "Timestamping is off; enable it with \"timestamping\"" << endl;
+
+  }
+
+  readLatency(latencies);
+
+  for(int i = 0; i < LATENCY_STAGES; i++) {
+
+    cout << names[i] << ": " << latencies[i].count() << " samples, p50 "
+
+        << latencies[i].percentile(50) << "us, p99 "
+
+        << latencies[i].percentile(99) << "us, max "
+
+        << latencies[i].max() << "us" << endl;
+
+  }
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// addShmRing
+
+// Creates the <name>.in queue and <name>.out broadcast ring in shared memory
+
+// for local clients to attach to
+
+//
+
+// @pre:   name is a valid shm_open name without '/'
+
+// @post:  Both rings exist, or an error is reported to cout
+
+// @param  name:  Base name of the rings
+
+// @param  slots: Packets each ring holds
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::addShmRing(const string& name, int slots) {
+
+  if(name.empty() || name.find('/') != string::npos) {
+
+    cout << "Invalid ring name: " << name << endl;
+
+    return;
+
+  }
+
+  removeShmRing(name);
+
+  //Slots hold the largest packet of the payload size set when it is added
+
+  int slotSize = maxPayload + SIZE;
+
+  ShmRing* inRing = ShmRing::create(name + ".in", slots, slotSize, false);
+
+  ShmRing* outRing = ShmRing::create(name + ".out", slots, slotSize, true);
+
+  if(inRing == NULL || outRing == NULL) {
+
+    cout << "Shared memory rings " << name << " could not be created: "
+
+        << strerror(errno) << endl;
+
+    delete inRing;
+
+    delete outRing;
+
+    return;
+
+  }
+
+  pthread_mutex_lock(&shmLock);
+
+  shmInRings[name] = inRing;
+
+  shmOutRings[name] = outRing;
+
+  shmRingCount = shmInRings.size();
+
+  pthread_mutex_unlock(&shmLock);
+
+  cout << "UdpRelay: shared memory rings /dev/shm/" << name << ".in and "
+
+      << name << ".out ready" << endl;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// removeShmRing
+
+// Stops using a pair of shared memory rings and removes their names
+
+//
+
+// @pre:   None
+
+// @post:  The rings are unmapped and unlinked
+
+// @param  name: Base name given to addShmRing
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::removeShmRing(const string& name) {
+
+  pthread_mutex_lock(&shmLock);
+
+  map<string, ShmRing*>::iterator inRing = shmInRings.find(name);
+
+  if(inRing != shmInRings.end()) {
+
+    delete inRing->second;
+
+    shmInRings.erase(inRing);
+
+  }
+
+  map<string, ShmRing*>::iterator outRing = shmOutRings.find(name);
+
+  if(outRing != shmOutRings.end()) {
+
+    delete outRing->second;
+
+    shmOutRings.erase(outRing);
+
+  }
+
+  shmRingCount = shmInRings.size();
+
+  pthread_mutex_unlock(&shmLock);
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// showShmRings
+
+// Displays every shared memory ring pair and its ingress backlog to cout
+
+//
+
+// @pre:   None
+
+// @post:  None
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::showShmRings() {
+
+  pthread_mutex_lock(&shmLock);
+
+  if(shmInRings.empty()) {
+
+    cout << "No shared memory rings." << endl;
+
+  }
+
+  for(map<string, ShmRing*>::iterator curRingIt = shmInRings.begin();
+
+      curRingIt != shmInRings.end(); curRingIt++) {
+
+    cout << "ring " << curRingIt->first << ": " << curRingIt->second->size()
+
+        << " packets waiting, " << shmOutRings[curRingIt->first]->getHead()
+
+        << " delivered" << endl;
+
+  }
+
+  pthread_mutex_unlock(&shmLock);
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// showStages
+
+// Displays the occupancy of every stage ring to cout: bytes and packets held,
+
+// high-water mark and how often the stage before it had to wait
+
+//
+
+// @pre:   None
+
+// @post:  None
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::showStages() {
+
+  cout << "local: " << ingestRing->getPackets() << " packets, "
+
+      << ingestRing->getUsed() << "/" << ingestRing->getCapacity()
+
+      << " bytes, high water " << ingestRing->getHighWater() << ", "
+
+      << ingestRing->getStalls() << " full" << endl;
+
+  pthread_mutex_lock(&stageLock);
+
+  for(size_t i = 0; i < peerStages.size(); i++) {
+
+    SpscRing* ring = peerStages[i]->ring;
+
+    cout << "remote " << peerStages[i]->name << ": " << ring->getPackets()
+
+        << " packets, " << ring->getUsed() << "/" << ring->getCapacity()
+
+        << " bytes, high water " << ring->getHighWater() << ", "
+
+        << ring->getStalls() << " full" << endl;
+
+  }
+
+  pthread_mutex_unlock(&stageLock);
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// showUdpLinks
+
+// Displays every UDP link to cout
+
+//
+
+// @pre:   None
+
+// @post:  None
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::showUdpLinks() {
+
+  pthread_mutex_lock(&udpLinkLock);
+
+  if(udpLinkSd == NULL_SD) {
+
+    cout << "udplink: off" << endl;
+
+  }
+
+  else {
+
+    cout << "udplink: port " << udpLinkPort << ", " << udpLinks.size()
+
+        << " links" << endl;
+
+  }
+
+  for(map<string, udpLinkPeer*>::iterator curLinkIt = udpLinks.begin();
+
+      curLinkIt != udpLinks.end(); curLinkIt++) {
+
+    UdpLinkStats stats = curLinkIt->second->link->getStats();
+
+    cout << curLinkIt->first << ": " << stats.sent << " sent, "
+
+        << stats.retransmitted << " resent, " << stats.received
+
+        << " received, " << stats.duplicates << " duplicates, "
+
+        << stats.delivered << " delivered, " << stats.inFlight
+
+        << " in flight, " << stats.waiting << " waiting, window "
+
+        << (int)stats.cwnd << ", rtt "
+
+        << stats.srttUs << " us" << endl;
+
+  }
+
+  pthread_mutex_unlock(&udpLinkLock);
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// showTunnel
+
+// Displays the tunnel rules and counts to cout
+
+//
+
+// @pre:   None
+
+// @post:  None
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::showTunnel() {
+
+  pthread_mutex_lock(&ruleLock);
+
+  for(map<unsigned int, int>::iterator rule = tunnelRules.begin();
+
+      rule != tunnelRules.end(); rule++) {
+
+    struct in_addr groupAddr;
+
+    groupAddr.s_addr = htonl(rule->first);
+
+    cout << "tunnel rule: " << inet_ntoa(groupAddr) << " -> "
+
+        << (rule->second == TUNNEL_ORDERED ? "ordered" : "unreliable")
+
+        << endl;
+
+  }
+
+  pthread_mutex_unlock(&ruleLock);
+
+  cout << "tunnel: " << tunnel.getSent() << " sent, " << tunnel.getFailed()
+
+      << " not sent" << (udpLinkSd == NULL_SD ? ", UDP links off" : "")
+
+      << endl;
+
+  vector<pair<string, UdpTunnelSource> > sources;
+
+  tunnel.getSources(sources);
+
+  for(size_t i = 0; i < sources.size(); i++) {
+
+    cout << sources[i].first << ": " << sources[i].second.received
+
+        << " received, " << sources[i].second.lost << " lost, "
+
+        << sources[i].second.late << " late, "
+
+        << sources[i].second.duplicates << " duplicates, "
+
+        << sources[i].second.dropped << " dropped" << endl;
+
+  }
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// showRedundancy
+
+// Displays the redundancy rules and how often each path's copy won to cout
+
+//
+
+// @pre:   None
+
+// @post:  None
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::showRedundancy() {
+
+  pthread_mutex_lock(&ruleLock);
+
+  for(map<unsigned int, vector<string> >::iterator rule =
+
+      redundancyRules.begin(); rule != redundancyRules.end(); rule++) {
+
+    struct in_addr groupAddr;
+
+    groupAddr.s_addr = htonl(rule->first);
+
+    cout << "redundancy rule: " << inet_ntoa(groupAddr) << " ->";
+
+    for(size_t i = 0; i < rule->second.size(); i++) {
+
+      cout << " " << rule->second[i];
+
+    }
+
+    cout << endl;
+
+  }
+
+  pthread_mutex_unlock(&ruleLock);
+
+  vector<pair<string, RedundantPathStats> > paths;
+
+  redundancy.getPaths(paths);
+
+  if(paths.empty()) {
+
+    cout << "No redundant copies received" << endl;
+
+  }
+
+  for(size_t i = 0; i < paths.size(); i++) {
+
+    const RedundantPathStats& counts = paths[i].second;
+
+    long long copies = counts.wins + counts.duplicates;
+
+    cout << paths[i].first << ": won " << counts.wins << " of " << copies
+
+        << " (" << (copies > 0 ? 100 * counts.wins / copies : 0) << "%)";
+
+    if(counts.duplicates > 0) {
+
+      cout << ", lost by " << counts.lagUs / counts.duplicates
+
+          << "us on average";
+
+    }
+
+    cout << endl;
+
+  }
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// showConflation
+
+// Displays the conflation rules and each conflated queue's count to cout
+
+//
+
+// @pre:   None
+
+// @post:  None
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::showConflation() {
+
+  pthread_mutex_lock(&ruleLock);
+
+  map<string, conflationRule> rules = conflationRules;
+
+  pthread_mutex_unlock(&ruleLock);
+
+  if(rules.empty()) {
+
+    cout << "No conflated peers" << endl;
+
+  }
+
+  pthread_mutex_lock(&cxnLock);
+
+  for(map<string, conflationRule>::iterator rule = rules.begin();
+
+      rule != rules.end(); rule++) {
+
+    cout << "conflate rule: " << rule->first << " -> payload bytes "
+
+        << rule->second.offset << ".."
+
+        << rule->second.offset + rule->second.length - 1
+
+        << (rule->second.bySource ? " by source" : "");
+
+    map<string, PacketQueue*>::iterator egress =
+
+        egressQueues.find(rule->first);
+
+    if(egress != egressQueues.end()) {
+
+      cout << ", " << egress->second->getConflated() << " conflated";
+
+    }
+
+    else {
+
+      cout << ", not connected";
+
+    }
+
+    cout << endl;
+
+  }
+
+  pthread_mutex_unlock(&cxnLock);
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// broadcastToShmRings
+
+// Copies a packet into every shared memory egress ring
+
+//
+
+// @pre:   packet has valid packet format without a trace extension
+
+// @post:  None
+
+// @param  packet: The packet to deliver
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::broadcastToShmRings(const char* packet) {
+
+  if(shmRingCount == 0) {
+
+    return;
+
+  }
+
+  int length = PacketHeader::getLength(packet, MAX_PACKET_SIZE);
+
+  pthread_mutex_lock(&shmLock);
+
+  for(map<string, ShmRing*>::iterator curRingIt = shmOutRings.begin();
+
+      curRingIt != shmOutRings.end(); curRingIt++) {
+
+    curRingIt->second->push(packet, length);
+
+  }
+
+  pthread_mutex_unlock(&shmLock);
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// heartbeatThread
+
+// A static class method that is a thread function for the heartbeat thread.
+
+// Every heartbeat interval it queues a ping to each peer that understands
+
+// control frames and evicts peers that have been silent for too many
+
+// intervals
+
+//
+
+// @pre:   *arg parameter represents a valid UdpRelay object
+
+// @post:  None
+
+// @param  *arg:  A void pointer to the UdpRelay object creating the thread
+
+//-----------------------------------------------------------------------------
+
+void* UdpRelay::heartbeatThread(void *arg) {
+
+  UdpRelay* thisUdpRelay = (UdpRelay*)arg;
+
+  long long nextBeatUs = monotonicMicros();
+
+  vector<pair<string, unsigned int> > pings;
+
+  int metricsSeen = -1;       //metricsGeneration the server was opened for
+
+  while(thisUdpRelay->running) {
+
+    if(metricsSeen != thisUdpRelay->metricsGeneration) {
+
+      pthread_mutex_lock(&thisUdpRelay->ruleLock);
+
+      metricsSeen = thisUdpRelay->metricsGeneration;
+
+      int port = thisUdpRelay->metricsPort;
+
+      string address = thisUdpRelay->metricsAddress;
+
+      pthread_mutex_unlock(&thisUdpRelay->ruleLock);
+
+      thisUdpRelay->metrics.close();
+
+      if(port > 0 && thisUdpRelay->metrics.open(address, port)) {
+
+        cout << "UdpRelay: metrics on http://"
+
+            << (address.empty() ? "0.0.0.0" : address) << ":" << port
+
+            << "/metrics" << endl;
+
+      }
+
+      else if(port > 0) {
+
+        cout << "UdpRelay: cannot serve metrics on port " << port << ": "
+
+            << strerror(errno) << endl;
+
+      }
+
+    }
+
+    //Scrapes are answered here between ticks
+
+    thisUdpRelay->metrics.serve(HEARTBEAT_TICK_MS, metricsRenderer,
+
+        (void*)thisUdpRelay);
+
+    int intervalMs = thisUdpRelay->heartbeatMs;
+
+    int misses = thisUdpRelay->heartbeatMisses;
+
+    long long nowUs = monotonicMicros();
+
+    thisUdpRelay->reassembler->expire(nowUs);
+
+    if(hangups != thisUdpRelay->hangupsSeen) {
+
+      thisUdpRelay->hangupsSeen = hangups;
+
+      pthread_t reloadThreadID;
+
+      thisUdpRelay->addWorker();
+
+      if(pthread_create(&reloadThreadID, NULL, reloadThread,
+
+          (void*)thisUdpRelay) != 0) {
+
+        cerr << "Thread creation failed!" << endl;
+
+        exit(EXIT_FAILURE);
+
+      }
+
+      pthread_detach(reloadThreadID);
+
+    }
+
+    if(intervalMs <= 0 || nowUs < nextBeatUs) {
+
+      continue;
+
+    }
+
+    nextBeatUs = nowUs + intervalMs * 1000LL;
+
+    long long silenceUs = intervalMs * 1000LL * misses;
+
+    pings.clear();
+
+    pthread_mutex_lock(&thisUdpRelay->cxnLock);
+
+    for(map<string, peerHealth>::iterator peer = thisUdpRelay->peers.begin();
+
+        peer != thisUdpRelay->peers.end(); peer++) {
+
+      if(!peer->second.capable) {
+
+        continue;
+
+      }
+
+      if(nowUs - *peer->second.lastHeardUs > silenceUs) {
+
+        //The relayOut thread wakes up and removes the connection
+
+        map<string, int>::iterator cxn =
+
+            thisUdpRelay->tcpCxns.find(peer->first);
+
+        if(cxn != thisUdpRelay->tcpCxns.end()) {
+
+          cout << "UdpRelay: " << peer->first << " missed " << misses
+
+              << " heartbeats, disconnecting" << endl;
+
+          shutdown(cxn->second, SHUT_RDWR);
+
+        }
+
+        *peer->second.lastHeardUs = nowUs;
+
+        continue;
+
+      }
+
+      peer->second.pingSequence++;
+
+      peer->second.lastPingUs = nowUs;
+
+      pings.push_back(make_pair(peer->first, peer->second.pingSequence));
+
+    }
+
+    pthread_mutex_unlock(&thisUdpRelay->cxnLock);
+
+    for(unsigned int i = 0; i < pings.size(); i++) {
+
+      thisUdpRelay->queueControlFrame(pings[i].first, CONTROL_PING,
+
+          pings[i].second, nowUs);
+
+    }
+
+  }
+
+  thisUdpRelay->metrics.close();
+
+  return NULL;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// registerPeer
+
+// Starts tracking the health of a newly registered connection
+
+//
+
+// @pre:   None
+
+// @post:  The peer has a fresh peerHealth entry
+
+// @param  remoteGroupID: The tcpCxns key of the connection
+
+// @param  capable:       True if the peer is known to accept control frames
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::registerPeer(const string& remoteGroupID, bool capable) {
+
+  peerHealth health;
+
+  health.capable = capable;
+
+  health.lastPingUs = 0;
+
+  health.pingSequence = 0;
+
+  health.lastRttUs = 0;
+
+  health.smoothedRttUs = 0;
+
+  health.jitterUs = 0;
+
+  health.rttSamples = 0;
+
+  health.headerVersion = 1;
+
+  health.nodeId = 0;
+
+  health.jumbo = false;
+
+  health.trace = false;
+
+  health.priority = false;
+
+  pthread_mutex_lock(&cxnLock);
+
+  health.lastHeardUs = heardCell(remoteGroupID);
+
+  *health.lastHeardUs = monotonicMicros();
+
+  peers[remoteGroupID] = health;
+
+  peerGeneration++;
+
+  pthread_mutex_unlock(&cxnLock);
+
+  notifyAdmins("up " + remoteGroupID);
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// heardCell
+
+// Returns the word a peer's relayOut threads store the time of its last frame
+
+// in
+
+//
+
+// @pre:   cxnLock is held
+
+// @post:  heardTimes has an entry for remoteGroupID
+
+// @param  remoteGroupID: The tcpCxns key of the connection
+
+// @returns volatile long long*: The peer's word in heardTimes
+
+//-----------------------------------------------------------------------------
+
+volatile long long* UdpRelay::heardCell(const string& remoteGroupID) {
+
+  map<string, volatile long long*>::iterator heard =
+
+      heardTimes.find(remoteGroupID);
+
+  if(heard != heardTimes.end()) {
+
+    return heard->second;
+
+  }
+
+  volatile long long* cell = new long long(monotonicMicros());
+
+  heardTimes[remoteGroupID] = cell;
+
+  return cell;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// readPeerView
+
+// Copies a connection's socket and negotiated settings for its relayEgress
+
+// thread, if they changed since the copy was taken
+
+//
+
+// @pre:   None
+
+// @post:  view matches tcpCxns and peers as of view.generation
+
+// @param  remoteGroupID: The tcpCxns key of the connection
+
+// @param  view:          The egress thread's copy
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::readPeerView(const string& remoteGroupID, peerView& view) {
+
+  if(view.generation == peerGeneration) {
+
+    return;
+
+  }
+
+  pthread_mutex_lock(&cxnLock);
+
+  view.generation = peerGeneration;
+
+  map<string, int>::iterator cxn = tcpCxns.find(remoteGroupID);
+
+  view.sd = (cxn != tcpCxns.end()) ? cxn->second : NULL_SD;
+
+  map<string, peerHealth>::iterator peer = peers.find(remoteGroupID);
+
+  bool known = peer != peers.end();
+
+  view.headerVersion = known ? peer->second.headerVersion : 1;
+
+  view.capable = known && peer->second.capable;
+
+  view.jumbo = known && peer->second.jumbo;
+
+  view.trace = known && peer->second.trace;
+
+  view.priority = known && peer->second.priority;
+
+  pthread_mutex_unlock(&cxnLock);
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// queueControlFrame
+
+// Queues a control frame on a connection's egress queue at control priority
+
+//
+
+// @pre:   None
+
+// @post:  The frame is queued if the connection has an egress queue
+
+// @param  remoteGroupID: The tcpCxns key of the connection
+
+// @param  type:          CONTROL_HELLO, CONTROL_PING or CONTROL_PONG
+
+// @param  sequence:      Sequence number
+
+// @param  timestampUs:   Timestamp to carry
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::queueControlFrame(const string& remoteGroupID, int type,
+
+    unsigned int sequence, long long timestampUs) {
+
+  char frame[SIZE];
+
+  ControlFrame::build(frame, SIZE, type, sequence, timestampUs);
+
+  pthread_mutex_lock(&cxnLock);
+
+  map<string, PacketQueue*>::iterator queue =
+
+      egressQueues.find(remoteGroupID);
+
+  if(queue != egressQueues.end()) {
+
+    queue->second->push(frame, SIZE, PRIORITY_CONTROL, monotonicMicros());
+
+  }
+
+  pthread_mutex_unlock(&cxnLock);
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// handleControlFrame
+
+// Acts on a control frame received from a peer: a hello marks the peer as
+
+// accepting control frames and settles the header version, a node frame
+
+// binds a node ID, a ping is answered, a pong updates the RTT
+
+//
+
+// @pre:   ControlFrame::isControl(frame)
+
+// @post:  The peer's health entry is updated
+
+// @param  remoteGroupID: The tcpCxns key of the connection
+
+// @param  frame:         The frame received
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::handleControlFrame(const string& remoteGroupID,
+
+    const char* frame) {
+
+  int type = ControlFrame::getType(frame);
+
+  if(type == CONTROL_PING) {
+
+    queueControlFrame(remoteGroupID, CONTROL_PONG,
+
+        ControlFrame::getSequence(frame), ControlFrame::getTimestamp(frame));
+
+    return;
+
+  }
+
+  if(type == CONTROL_NODE) {
+
+    unsigned int node = 0;
+
+    unsigned int group = 0;
+
+    ControlFrame::unpackIdentity(ControlFrame::getTimestamp(frame), node,
+
+        group);
+
+    learnNode(remoteGroupID, node, group);
+
+    return;
+
+  }
+
+  if(type == CONTROL_HELLO) {
+
+    unsigned int capabilities = ControlFrame::getSequence(frame);
+
+    unsigned int node = 0;
+
+    unsigned int group = 0;
+
+    ControlFrame::unpackIdentity(ControlFrame::getTimestamp(frame), node,
+
+        group);
+
+    //Only a refusal is answered, so the peer falls back to our version too
+
+    int version = negotiateHeader(remoteGroupID, capabilities, node, group);
+
+    if((capabilities & ~capabilitiesFor(version) &
+
+        (CAPABILITY_HEADER_V2 | CAPABILITY_HEADER_BLOOM)) != 0) {
+
+      queueControlFrame(remoteGroupID, CONTROL_HELLO, capabilitiesFor(version),
+
+          ControlFrame::packIdentity(identity->nodeId, groupAddress));
+
+    }
+
+  }
+
+  pthread_mutex_lock(&cxnLock);
+
+  map<string, peerHealth>::iterator peer = peers.find(remoteGroupID);
+
+  if(peer != peers.end()) {
+
+    if(type == CONTROL_HELLO) {
+
+      peer->second.capable = true;
+
+      peerGeneration++;
+
+    }
+
+    else if(type == CONTROL_PONG) {
+
+      long long sample = monotonicMicros() - ControlFrame::getTimestamp(frame);
+
+      if(sample >= 0) {
+
+        //Smoothed RTT and mean deviation as TCP keeps them (RFC 6298)
+
+        peerHealth& health = peer->second;
+
+        if(health.rttSamples == 0) {
+
+          health.smoothedRttUs = sample;
+
+          health.jitterUs = sample / 2.0;
+
+        }
+
+        else {
+
+          double deviation = health.smoothedRttUs - sample;
+
+          if(deviation < 0) {
+
+            deviation = -deviation;
+
+          }
+
+          health.jitterUs += (deviation - health.jitterUs) / 4;
+
+          health.smoothedRttUs += (sample - health.smoothedRttUs) / 8;
+
+        }
+
+        health.lastRttUs = sample;
+
+        health.rttSamples++;
+
+      }
+
+    }
+
+  }
+
+  pthread_mutex_unlock(&cxnLock);
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// setHeartbeat
+
+// Changes the heartbeat interval and the number of silent intervals after
+
+// which a peer is evicted
+
+//
+
+// @pre:   intervalMs >= 0, misses > 0
+
+// @post:  The heartbeat thread uses the new values; 0 stops heartbeats
+
+// @param  intervalMs: Interval between heartbeats, 0 to turn them off
+
+// @param  misses:     Silent intervals tolerated before eviction
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::setHeartbeat(int intervalMs, int misses) {
+
+  if(intervalMs < 0 || misses <= 0) {
+
+    cout << "usage: heartbeat <ms> [misses] | heartbeat off" << endl;
+
+    return;
+
+  }
+
+  //Peers were not pinged while heartbeats were off; start their clocks now
+
+  //so they are not evicted on the first beat
+
+  pthread_mutex_lock(&cxnLock);
+
+  long long nowUs = monotonicMicros();
+
+  for(map<string, peerHealth>::iterator peer = peers.begin();
+
+      peer != peers.end(); peer++) {
+
+    *peer->second.lastHeardUs = nowUs;
+
+  }
+
+  heartbeatMisses = misses;
+
+  heartbeatMs = intervalMs;
+
+  pthread_mutex_unlock(&cxnLock);
+
+  if(intervalMs == 0) {
+
+    cout << "UdpRelay: heartbeats off" << endl;
+
+  }
+
+  else {
+
+    cout << "UdpRelay: heartbeat every " << intervalMs << "ms, disconnect after "
+
+        << misses << " missed" << endl;
+
+  }
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// getPeerRtt
+
+// Returns the smoothed round trip time and jitter measured by heartbeats on a
+
+// connection
+
+//
+
+// @pre:   None
+
+// @post:  rttUs and jitterUs are set if true is returned
+
+// @param  remoteGroupID: A valid group IP/Name
+
+// @param  rttUs:         Receives the smoothed RTT in us
+
+// @param  jitterUs:      Receives the smoothed RTT variation in us
+
+// @returns bool:         False if no RTT has been measured for the peer
+
+//-----------------------------------------------------------------------------
+
+bool UdpRelay::getPeerRtt(const string& remoteGroupID, long long& rttUs,
+
+    long long& jitterUs) {
+
+  bool measured = false;
+
+  pthread_mutex_lock(&cxnLock);
+
+  map<string, peerHealth>::iterator peer = peers.find(remoteGroupID);
+
+  if(peer != peers.end() && peer->second.rttSamples > 0) {
+
+    rttUs = (long long)peer->second.smoothedRttUs;
+
+    jitterUs = (long long)peer->second.jitterUs;
+
+    measured = true;
+
+  }
+
+  pthread_mutex_unlock(&cxnLock);
+
+  return measured;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// reconnectThread
+
+// A static class method that is a thread function for a reconnect thread,
+
+// which spins up when the connection to a managed peer fails. Retries the
+
+// connection after randomized, exponentially growing delays until it
+
+// succeeds, the peer is deleted or the relay stops
+
+//
+
+// @pre:   *arg parameter represents a valid reconnectThreadInfo struct
+
+// @post:  The peer is connected, deleted, or the relay is stopping
+
+// @param  *arg:  Pointer to the reconnectThreadInfo struct
+
+//-----------------------------------------------------------------------------
+
+void* UdpRelay::reconnectThread(void *arg) {
+
+  reconnectThreadInfo *reconnectInfo = (reconnectThreadInfo*)arg;
+
+  UdpRelay* thisUdpRelay = reconnectInfo->currentRelay;
+
+  string remoteName = reconnectInfo->remoteGroupID;
+
+  delete reconnectInfo;
+
+  unsigned int seed = (unsigned int)monotonicMicros() ^
+
+      (unsigned int)(unsigned long)pthread_self();
+
+  int attempt = 0;
+
+  while(true) {
+
+    //Wait a random time between half and all of a ceiling that doubles with
+
+    //every failure, so peers that lost the same relay do not retry in step
+
+    int ceiling = RECONNECT_BASE_MS;
+
+    for(int i = 0; i < attempt && ceiling < RECONNECT_MAX_MS; i++) {
+
+      ceiling *= 2;
+
+    }
+
+    if(ceiling > RECONNECT_MAX_MS) {
+
+      ceiling = RECONNECT_MAX_MS;
+
+    }
+
+    long long wakeUs = monotonicMicros() +
+
+        (ceiling / 2 + rand_r(&seed) % (ceiling / 2 + 1)) * 1000LL;
+
+    bool managed = true;
+
+    while(thisUdpRelay->running && managed && monotonicMicros() < wakeUs) {
+
+      usleep(HEARTBEAT_TICK_MS * 1000);
+
+      pthread_mutex_lock(&thisUdpRelay->cxnLock);
+
+      managed = thisUdpRelay->managedPeers.count(remoteName) > 0;
+
+      pthread_mutex_unlock(&thisUdpRelay->cxnLock);
+
+    }
+
+    if(thisUdpRelay->running && managed) {
+
+      attempt++;
+
+      pthread_mutex_lock(&thisUdpRelay->cxnLock);
+
+      map<string, managedPeer>::iterator peer =
+
+          thisUdpRelay->managedPeers.find(remoteName);
+
+      if(peer != thisUdpRelay->managedPeers.end()) {
+
+        peer->second.attempts = attempt;
+
+      }
+
+      pthread_mutex_unlock(&thisUdpRelay->cxnLock);
+
+      thisUdpRelay->addRemoteIP(remoteName);
+
+    }
+
+    //Finish only while holding the lock, so a connection that drops right
+
+    //after succeeding is not missed by scheduleReconnect
+
+    pthread_mutex_lock(&thisUdpRelay->cxnLock);
+
+    map<string, managedPeer>::iterator peer =
+
+        thisUdpRelay->managedPeers.find(remoteName);
+
+    bool done = !thisUdpRelay->running ||
+
+        peer == thisUdpRelay->managedPeers.end() ||
+
+        thisUdpRelay->tcpCxns.count(remoteName) > 0;
+
+    if(done && peer != thisUdpRelay->managedPeers.end()) {
+
+      peer->second.reconnecting = false;
+
+      peer->second.attempts = 0;
+
+    }
+
+    pthread_mutex_unlock(&thisUdpRelay->cxnLock);
+
+    if(done) {
+
+      break;
+
+    }
+
+  }
+
+  thisUdpRelay->removeWorker();
+
+  return NULL;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// scheduleReconnect
+
+// Starts a reconnect thread for a managed peer unless one is running
+
+//
+
+// @pre:   None
+
+// @post:  A reconnect thread is running if the peer is managed
+
+// @param  remoteGroupID: The IP the peer was added with
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::scheduleReconnect(const string& remoteGroupID) {
+
+  pthread_mutex_lock(&cxnLock);
+
+  map<string, managedPeer>::iterator peer = managedPeers.find(remoteGroupID);
+
+  bool start = running && peer != managedPeers.end() &&
+
+      !peer->second.reconnecting;
+
+  if(start) {
+
+    peer->second.reconnecting = true;
+
+    peer->second.attempts = 0;
+
+  }
+
+  pthread_mutex_unlock(&cxnLock);
+
+  if(!start) {
+
+    return;
+
+  }
+
+  cout << "UdpRelay: lost " << remoteGroupID << ", reconnecting" << endl;
+
+  reconnectThreadInfo* reconnectInfo = new reconnectThreadInfo;
+
+  reconnectInfo->currentRelay = this;
+
+  reconnectInfo->remoteGroupID = remoteGroupID;
+
+  pthread_t reconnectThreadID;
+
+  addWorker();
+
+  if(pthread_create(&reconnectThreadID, NULL, reconnectThread,
+
+      (void*)reconnectInfo) != 0) {
+
+    cerr << "Thread creation failed!" << endl;
+
+    exit(EXIT_FAILURE);
+
+  }
+
+  pthread_detach(reconnectThreadID);
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// setStoreForward
+
+// Sets how much traffic is buffered for a managed peer while it is down and
+
+// how fast it is replayed afterwards. The packet limit and rate apply to
+
+// current backlogs as well; the spill directory to backlogs created from now
+
+// on.
+
+//
+
+// @pre:   None
+
+// @post:  The settings are updated, or an error is reported to cout
+
+// @param  packets:   Packets buffered in memory per peer
+
+// @param  rate:      Backlog packets replayed per second after a reconnect
+
+// @param  directory: Directory for spill files, or "" for none
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::setStoreForward(int packets, int rate,
+
+    const string& directory) {
+
+  if(packets <= 0 || rate <= 0) {
+
+    cout << "usage: backlog <packets> <replay packets/s> [spill dir|none]"
+
+        << endl;
+
+    return;
+
+  }
+
+  pthread_mutex_lock(&ruleLock);
+
+  backlogPackets = packets;
+
+  spillDirectory = directory;
+
+  pthread_mutex_unlock(&ruleLock);
+
+  pthread_mutex_lock(&cxnLock);
+
+  for(map<string, managedPeer>::iterator peer = managedPeers.begin();
+
+      peer != managedPeers.end(); peer++) {
+
+    if(peer->second.backlog != NULL) {
+
+      peer->second.backlog->setMemoryLimit(packets);
+
+    }
+
+  }
+
+  pthread_mutex_unlock(&cxnLock);
+
+  replayRate = rate;
+
+  cout << "UdpRelay: backlog " << packets << " packets per peer, replay "
+
+      << rate << "/s, spill " << (directory.empty() ? "off" : directory)
+
+      << endl;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// createBacklog
+
+// Creates the store-and-forward backlog of a managed peer's relayEgress thread
+
+// with the current settings, or takes the one passed on for it by the relay
+
+// this one replaced
+
+//
+
+// @pre:   None
+
+// @post:  The backlog is registered with the peer for "show"
+
+// @param  remoteGroupID:  The IP the peer was added with
+
+// @returns StoreForward*: The backlog, owned by the caller
+
+//-----------------------------------------------------------------------------
+
+StoreForward* UdpRelay::createBacklog(const string& remoteGroupID) {
+
+  pthread_mutex_lock(&ruleLock);
+
+  int packets = backlogPackets;
+
+  string spillPath = "";
+
+  if(!spillDirectory.empty()) {
+
+    spillPath = spillDirectory + "/udprelay-" + remoteGroupID + ".spill";
+
+  }
+
+  pthread_mutex_unlock(&ruleLock);
+
+  StoreForward* backlog = NULL;
+
+  pthread_mutex_lock(&cxnLock);
+
+  map<string, StoreForward*>::iterator adopted =
+
+      handoffBacklogs.find(remoteGroupID);
+
+  if(adopted != handoffBacklogs.end()) {
+
+    backlog = adopted->second;    //Passed on by the relay this one replaced
+
+    handoffBacklogs.erase(adopted);
+
+  }
+
+  pthread_mutex_unlock(&cxnLock);
+
+  if(backlog == NULL) {
+
+    backlog = new StoreForward(SIZE, packets, spillPath);
+
+  }
+
+  pthread_mutex_lock(&cxnLock);
+
+  map<string, managedPeer>::iterator peer = managedPeers.find(remoteGroupID);
+
+  if(peer != managedPeers.end()) {
+
+    peer->second.backlog = backlog;
+
+  }
+
+  pthread_mutex_unlock(&cxnLock);
+
+  return backlog;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// releaseBacklog
+
+// Unregisters and deletes a backlog created by createBacklog
+
+//
+
+// @pre:   backlog was returned by createBacklog(remoteGroupID)
+
+// @post:  Packets still held are discarded
+
+// @param  remoteGroupID: The IP the peer was added with
+
+// @param  backlog:       The backlog to delete
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::releaseBacklog(const string& remoteGroupID,
+
+    StoreForward* backlog) {
+
+  pthread_mutex_lock(&cxnLock);
+
+  map<string, managedPeer>::iterator peer = managedPeers.find(remoteGroupID);
+
+  if(peer != managedPeers.end() && peer->second.backlog == backlog) {
+
+    peer->second.backlog = NULL;
+
+  }
+
+  pthread_mutex_unlock(&cxnLock);
+
+  delete backlog;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// setJournal
+
+// Starts journaling every relayed packet into a directory, or stops it
+
+//
+
+// @pre:   None
+
+// @post:  The journal is open on directory, or closed if directory is ""
+
+// @param  directory: Journal directory, or "" to stop journaling
+
+// @param  segmentMB: Size of each preallocated segment file
+
+// @param  commitMs:  Longest a record waits to be flushed to disk
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::setJournal(const string& directory, int segmentMB,
+
+    int commitMs) {
+
+  journaling = false;
+
+  journal.close();
+
+  if(directory.empty()) {
+
+    cout << "UdpRelay: journal off" << endl;
+
+    return;
+
+  }
+
+  if(segmentMB <= 0 || commitMs <= 0 ||
+
+      !journal.open(directory, segmentMB * 1048576LL, commitMs,
+
+      DEFAULT_COMMIT_RECORDS)) {
+
+    cout << "UdpRelay: could not open a journal in " << directory << endl;
+
+    return;
+
+  }
+
+  pthread_mutex_lock(&ruleLock);
+
+  journalDirectory = directory;
+
+  pthread_mutex_unlock(&ruleLock);
+
+  journaling = true;
+
+  cout << "UdpRelay: journal " << journal.getStatus() << endl;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// journalPacket
+
+// Appends a packet to the journal if journaling is on
+
+//
+
+// @pre:   packet has valid packet format
+
+// @post:  The packet is journaled
+
+// @param  direction: JOURNAL_LOCAL or JOURNAL_REMOTE
+
+// @param  packet:    The packet as relayed
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::journalPacket(int direction, const char* packet) {
+
+  if(!journaling) {
+
+    return;
+
+  }
+
+  journal.append(direction, packet,
+
+      PacketHeader::getLength(packet, MAX_PACKET_SIZE),
+
+      realtimeMicros());
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// replayJournal
+
+// Re-injects the packets a journal recorded in a time range, in a thread of
+
+// its own. Packets from the local group are relayed to the remote groups
+
+// again; packets from remote groups are delivered locally again.
+
+//
+
+// @pre:   None
+
+// @post:  A replay thread runs if true is returned
+
+// @param  directory:  Journal directory to read
+
+// @param  fromUs:     Start of the range, wall clock us
+
+// @param  toUs:       End of the range, wall clock us
+
+// @param  speed:      1 for the original pace, 10 for ten times faster, 0 for
+
+//                     as fast as possible
+
+// @param  directions: JOURNAL_LOCAL, JOURNAL_REMOTE or JOURNAL_REPLAY_ALL
+
+// @returns bool:      False if the relay is not running or a replay is
+
+//                     already in progress
+
+//-----------------------------------------------------------------------------
+
+bool UdpRelay::replayJournal(const string& directory, long long fromUs,
+
+    long long toUs, double speed, int directions) {
+
+  if(!running || speed < 0 ||
+
+      !__sync_bool_compare_and_swap(&replaying, 0, 1)) {
+
+    return false;
+
+  }
+
+  replayThreadInfo* replayInfo = new replayThreadInfo;
+
+  replayInfo->currentRelay = this;
+
+  replayInfo->directory = directory;
+
+  replayInfo->fromUs = fromUs;
+
+  //Packets journaled by the replay itself must not be replayed again
+
+  long long nowUs = realtimeMicros();
+
+  replayInfo->toUs = toUs < nowUs ? toUs : nowUs;
+
+  replayInfo->speed = speed;
+
+  replayInfo->directions = directions;
+
+  pthread_t replayThreadID;
+
+  addWorker();
+
+  if(pthread_create(&replayThreadID, NULL, replayThread,
+
+      (void*)replayInfo) != 0) {
+
+    cerr << "Thread creation failed!" << endl;
+
+    exit(EXIT_FAILURE);
+
+  }
+
+  pthread_detach(replayThreadID);
+
+  return true;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// replayThread
+
+// A static class method that is a thread function for a journal replay. Reads
+
+// the journal in order, waits until each record is due and re-injects it
+
+//
+
+// @pre:   *arg parameter represents a valid replayThreadInfo struct
+
+// @post:  The range has been replayed or the relay is stopping
+
+// @param  *arg:  Pointer to the replayThreadInfo struct
+
+//-----------------------------------------------------------------------------
+
+void* UdpRelay::replayThread(void *arg) {
+
+  replayThreadInfo *replayInfo = (replayThreadInfo*)arg;
+
+  UdpRelay* thisUdpRelay = replayInfo->currentRelay;
+
+  JournalReader reader(replayInfo->directory);
+
+  JournalRecord record;
+
+  char packet[MAX_PACKET_SIZE];
+
+  long long firstUs = -1;       //Journal time of the first record replayed
+
+  long long startUs = 0;        //monotonicMicros() when it was replayed
+
+  long long replayed = 0;
+
+  while(thisUdpRelay->running && reader.next(record)) {
+
+    if(record.timestampUs < replayInfo->fromUs) {
+
+      continue;
+
+    }
+
+    if(record.timestampUs > replayInfo->toUs) {
+
+      break;
+
+    }
+
+    if(replayInfo->directions != JOURNAL_REPLAY_ALL &&
+
+        replayInfo->directions != record.direction) {
+
+      continue;
+
+    }
+
+    //Keep the original spacing, divided by the speed
+
+    if(firstUs < 0) {
+
+      firstUs = record.timestampUs;
+
+      startUs = monotonicMicros();
+
+    }
+
+    else if(replayInfo->speed > 0) {
+
+      long long dueUs = startUs + (long long)((record.timestampUs - firstUs) /
+
+          replayInfo->speed);
+
+      while(thisUdpRelay->running && monotonicMicros() < dueUs) {
+
+        long long waitUs = dueUs - monotonicMicros();
+
+        usleep(waitUs > HEARTBEAT_TICK_MS * 1000 ?
+
+            HEARTBEAT_TICK_MS * 1000 : (waitUs > 0 ? waitUs : 0));
+
+      }
+
+    }
+
+    int length = record.length < MAX_PACKET_SIZE ? record.length :
+
+        MAX_PACKET_SIZE - 1;
+
+    if(record.direction == JOURNAL_LOCAL) {
+
+      //Relay it as a fresh packet from this group so hop checks pass again
+
+      int offset = PacketHeader::getPayloadOffset(record.data);
+
+      if(offset >= length || !PacketHeader::build(packet, MAX_PACKET_SIZE,
+
+          record.data + offset, strnlen(record.data + offset,
+
+          length - offset))) {
+
+        continue;
+
+      }
+
+      PacketHeader::setPriority(packet,
+
+          PacketHeader::getPriority(record.data));
+
+      thisUdpRelay->relayLocalPacket(packet, MAX_PACKET_SIZE,
+
+          monotonicMicros());
+
+    }
+
+    else {
+
+      memset(packet, 0, SIZE);
+
+      memcpy(packet, record.data, length);
+
+      packet[length] = '\0';
+
+      thisUdpRelay->rebroadcastQueue->push(packet,
+
+          thisUdpRelay->getFrameLength(packet),
+
+          PacketHeader::getPriority(packet), monotonicMicros());
+
+    }
+
+    replayed++;
+
+  }
+
+  cout << "UdpRelay: replayed " << replayed << " packets from "
+
+      << replayInfo->directory << endl;
+
+  delete replayInfo;
+
+  thisUdpRelay->replaying = 0;
+
+  thisUdpRelay->removeWorker();
+
+  return NULL;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// startCapture
+
+// Starts mirroring relayed packets into a pcapng file. Packets are copied
+
+// into a lock-free tap ring by the threads that relay them and written by
+
+// the capture thread, so a slow disk drops captured packets rather than
+
+// delaying traffic
+
+//
+
+// @pre:   None
+
+// @post:  The capture thread writes to path if true is returned
+
+// @param  path:   File to create
+
+// @param  sample: Capture one packet in sample, 1 = every packet
+
+// @param  peer:   Only packets to or from this peer ("local" for the local
+
+//                 group), or "" for all
+
+// @param  group:  Only packets that originated in this group, 0 for all
+
+// @returns bool:  False if a capture is running or the file or ring could
+
+//                 not be created
+
+//-----------------------------------------------------------------------------
+
+bool UdpRelay::startCapture(const string& path, int sample,
+
+    const string& peer, unsigned int group) {
+
+  if(capturing || sample <= 0) {
+
+    return false;
+
+  }
+
+  if(captureRing == NULL) {
+
+    //Never freed before destruction: a relay thread may still be pushing
+
+    //a packet it tested capturing for just before the last stop
+
+    captureRing = ShmRing::createLocal(CAPTURE_RING_SLOTS,
+
+        sizeof(captureRecord) + SIZE);
+
+    if(captureRing == NULL) {
+
+      return false;
+
+    }
+
+  }
+
+  int length = 0;
+
+  while(captureRing->peek(length) != NULL) {
+
+    captureRing->release();   //Late packets of the previous capture
+
+  }
+
+  if(!captureFile.open(path)) {
+
+    return false;
+
+  }
+
+  //Relay threads that tested capturing just before the last stop may still
+
+  //read the old settings, so new ones are published instead of changed
+
+  captureSettings* settings = new captureSettings;
+
+  settings->sample = sample;
+
+  settings->peer = peer;
+
+  settings->group = group;
+
+  captureCount = 0;
+
+  captured = 0;
+
+  captureDropped = 0;
+
+  pthread_mutex_lock(&ruleLock);
+
+  capturePath = path;
+
+  captureFilters.push_back(settings);
+
+  pthread_mutex_unlock(&ruleLock);
+
+  __sync_synchronize();
+
+  captureFilter = settings;
+
+  __sync_synchronize();
+
+  capturing = true;
+
+  pthread_create(&captureThreadID, NULL, captureThread, (void*)this);
+
+  cout << "UdpRelay: capturing to " << path << endl;
+
+  return true;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// stopCapture
+
+// Stops the capture, writes what the tap ring holds and closes the file
+
+//
+
+// @pre:   None
+
+// @post:  capturing is false and the capture thread has exited
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::stopCapture() {
+
+  if(!capturing) {
+
+    return;
+
+  }
+
+  capturing = false;
+
+  pthread_join(captureThreadID, NULL);
+
+  captureFile.close();
+
+  cout << "UdpRelay: capture stopped, " << captured << " packets written, "
+
+      << captureDropped << " dropped" << endl;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// capturePacket
+
+// Copies a packet into the tap ring if it passes the sample and filters.
+
+// Callers test capturing first, so the relay pays one branch when off
+
+//
+
+// @pre:   packet has valid packet format
+
+// @post:  The packet is queued for the capture file or counted as dropped
+
+// @param  inbound: True if this relay received the packet
+
+// @param  peer:    Remote group the packet came from or went to, or "local"
+
+// @param  packet:  The packet
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::capturePacket(bool inbound, const string& peer,
+
+    const char* packet) {
+
+  captureSettings* settings = captureFilter;
+
+  if(settings == NULL) {
+
+    return;
+
+  }
+
+  if(!settings->peer.empty() && settings->peer != peer) {
+
+    return;
+
+  }
+
+  if(settings->group != 0 &&
+
+      getOriginGroup(packet) != settings->group) {
+
+    return;
+
+  }
+
+  if(settings->sample > 1 &&
+
+      __sync_fetch_and_add(&captureCount, 1) % settings->sample != 0) {
+
+    return;
+
+  }
+
+  captureRecord record;
+
+  record.timestampUs = realtimeMicros();
+
+  record.inbound = inbound ? 1 : 0;
+
+  strncpy(record.peer, peer.c_str(), CAPTURE_PEER_SIZE - 1);
+
+  record.peer[CAPTURE_PEER_SIZE - 1] = '\0';
+
+  //Like a snap length, only the first SIZE bytes of a jumbo packet are kept
+
+  int length = PacketHeader::getLength(packet, MAX_PACKET_SIZE);
+
+  if(length > SIZE) {
+
+    length = SIZE;
+
+  }
+
+  char slot[sizeof(captureRecord) + SIZE];
+
+  memcpy(slot, &record, sizeof(record));
+
+  memcpy(slot + sizeof(record), packet, length);
+
+  if(!captureRing->push(slot, sizeof(record) + length)) {
+
+    __sync_fetch_and_add(&captureDropped, 1);
+
+  }
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// captureThread
+
+// A static class method that is a thread function for the capture thread.
+
+// Drains the tap ring into the capture file until the capture stops
+
+//
+
+// @pre:   *arg parameter represents a valid UdpRelay object
+
+// @post:  Every packet in the tap ring has been written
+
+// @param  *arg:  A void pointer to the UdpRelay object creating the thread
+
+//-----------------------------------------------------------------------------
+
+void* UdpRelay::captureThread(void *arg) {
+
+  UdpRelay* thisUdpRelay = (UdpRelay*)arg;
+
+  unsigned int localGroup = ntohl(inet_addr(thisUdpRelay->ipNumber));
+
+  IdleBackoff idle;
+
+  while(true) {
+
+    int length = 0;
+
+    char* slot = thisUdpRelay->captureRing->peek(length);
+
+    if(slot == NULL) {
+
+      if(!thisUdpRelay->capturing) {
+
+        break;
+
+      }
+
+      idle.pause();
+
+      continue;
+
+    }
+
+    idle.reset();
+
+    captureRecord record;
+
+    memcpy(&record, slot, sizeof(record));
+
+    const char* packet = slot + sizeof(record);
+
+    //Relayed packets appear as sent on the group they originated in
+
+    unsigned int source = thisUdpRelay->getOriginGroup(packet);
+
+    if(source == 0) {
+
+      source = localGroup;
+
+    }
+
+    string comment = string(record.inbound ? "from " : "to ") + record.peer;
+
+    if(thisUdpRelay->captureFile.write(record.timestampUs,
+
+        record.inbound != 0, comment, source, localGroup,
+
+        thisUdpRelay->portNumber, packet, length - (int)sizeof(record))) {
+
+      thisUdpRelay->captured++;
+
+    }
+
+    thisUdpRelay->captureRing->release();
+
+  }
+
+  return NULL;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// setHeaderVersion
+
+// Changes the header version offered to peers that connect from now on and,
+
+// while no connection is open, this relay's node ID
+
+//
+
+// @pre:   version is 1, 2 or 3
+
+// @post:  New connections negotiate at most version; the node ID is changed
+
+//         if true is returned
+
+// @param  version: 3 to also offer Bloom filter headers, 2 to offer node ID
+
+//                  headers, 1 to send addresses only
+
+// @param  node:    New node ID (1-65535), or 0 to keep the current one
+
+// @returns bool:   False if a node ID was given while connections are open or
+
+//                  the ID is bound to another relay
+
+//-----------------------------------------------------------------------------
+
+bool UdpRelay::setHeaderVersion(int version, unsigned int node) {
+
+  if(node != 0 && node != identity->nodeId) {
+
+    pthread_mutex_lock(&cxnLock);
+
+    bool connected = !tcpCxns.empty();
+
+    pthread_mutex_unlock(&cxnLock);
+
+    if(connected) {
+
+      return false;
+
+    }
+
+    pthread_mutex_lock(&nodeLock);
+
+    bool taken = nodeAddresses.count(node) > 0;
+
+    if(!taken) {
+
+      nodeAddresses.erase(identity->nodeId);
+
+      publishIdentity(node, identity->bloomWords, identity->bloomHashes);
+
+      nodeAddresses[node] = groupAddress;
+
+      addressNodes[groupAddress] = node;
+
+    }
+
+    pthread_mutex_unlock(&nodeLock);
+
+    if(taken) {
+
+      return false;
+
+    }
+
+  }
+
+  headerVersion = version;
+
+  cout << "UdpRelay: offering header version " << version << ", node "
+
+      << identity->nodeId << endl;
+
+  return true;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// negotiateHeader
+
+// Decides the header version of a connection from what the peer announced.
+
+// Version 2 is used if both sides offer it and learnNode binds the peer's node
+
+// ID to its group address. Version 3 additionally needs both sides to offer
+
+// Bloom filters.
+
+//
+
+// @pre:   The peer has a peerHealth entry
+
+// @post:  The peer's headerVersion, nodeId and jumbo are set
+
+// @param  remoteGroupID: The tcpCxns key of the connection
+
+// @param  capabilities:  CAPABILITY_* bits the peer announced
+
+// @param  node:          The peer's node ID
+
+// @param  group:         The peer's group IP, packed; 0 if not announced
+
+// @returns int:          The header version the connection uses
+
+//-----------------------------------------------------------------------------
+
+int UdpRelay::negotiateHeader(const string& remoteGroupID,
+
+    unsigned int capabilities, unsigned int node, unsigned int group) {
+
+  bool nodeIds = headerVersion >= 2 &&
+
+      (capabilities & CAPABILITY_HEADER_V2) != 0 && group != 0;
+
+  if(nodeIds) {
+
+    nodeIds = learnNode(remoteGroupID, node, group);
+
+    if(!nodeIds) {
+
+      cout << "UdpRelay: node ID " << node << " of " << remoteGroupID
+
+          << " is already in use; sending it version 1 headers" << endl;
+
+    }
+
+  }
+
+  int version = nodeIds ? 2 : 1;
+
+  if(nodeIds && headerVersion >= 3 &&
+
+      (capabilities & CAPABILITY_HEADER_BLOOM) != 0) {
+
+    version = 3;
+
+  }
+
+  pthread_mutex_lock(&cxnLock);
+
+  map<string, peerHealth>::iterator peer = peers.find(remoteGroupID);
+
+  if(peer != peers.end()) {
+
+    peer->second.headerVersion = version;
+
+    peer->second.nodeId = nodeIds ? node : 0;
+
+    peer->second.jumbo = (capabilities & CAPABILITY_JUMBO) != 0;
+
+    peer->second.trace = (capabilities & CAPABILITY_TRACE) != 0;
+
+    peer->second.priority = (capabilities & CAPABILITY_PRIORITY) != 0;
+
+    peerGeneration++;
+
+  }
+
+  pthread_mutex_unlock(&cxnLock);
+
+  return version;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// learnNode
+
+// Binds a relay's node ID to its group address and passes a new binding on to
+
+// every version 2 peer but the one it came from, so each relay learns the IDs
+
+// of the whole mesh. An ID two relays claim stays with the larger group
+
+// address: a binding that loses is answered with the one that wins, and if
+
+// this relay loses its own ID it takes a free one and announces it with a
+
+// hello to every peer.
+
+//
+
+// @pre:   nodeLock and cxnLock are not held
+
+// @post:  nodeAddresses and addressNodes hold the winning binding
+
+// @param  remoteGroupID: The tcpCxns key of the peer that announced it
+
+// @param  node:          The relay's node ID
+
+// @param  group:         The relay's group IP, packed
+
+// @returns bool:         True if node is now bound to group
+
+//-----------------------------------------------------------------------------
+
+bool UdpRelay::learnNode(const string& remoteGroupID, unsigned int node,
+
+    unsigned int group) {
+
+  if(node == 0 || node > 0xFFFF || group == 0 || group == groupAddress) {
+
+    return false;
+
+  }
+
+  bool learned = true;
+
+  bool renumbered = false;
+
+  unsigned int winner = group;
+
+  pthread_mutex_lock(&nodeLock);
+
+  map<unsigned short, unsigned int>::iterator bound = nodeAddresses.find(node);
+
+  if(bound != nodeAddresses.end() && bound->second == group) {
+
+    pthread_mutex_unlock(&nodeLock);
+
+    return true;
+
+  }
+
+  if(bound != nodeAddresses.end()) {
+
+    __sync_fetch_and_add(&nodeCollisions, 1);
+
+    if(bound->second > group) {
+
+      learned = false;
+
+      winner = bound->second;
+
+    }
+
+    else if(bound->second == groupAddress) {
+
+      renumbered = true;
+
+    }
+
+    else {
+
+      addressNodes.erase(bound->second);
+
+    }
+
+  }
+
+  if(learned) {
+
+    //A relay that changed its ID gives up the old one
+
+    map<unsigned int, unsigned short>::iterator previous =
+
+        addressNodes.find(group);
+
+    if(previous != addressNodes.end() && previous->second != node) {
+
+      nodeAddresses.erase(previous->second);
+
+    }
+
+    nodeAddresses[node] = group;
+
+    addressNodes[group] = node;
+
+  }
+
+  if(renumbered) {
+
+    //A packet already carrying the old ID, now the winner's, is not taken for
+
+    //a loop when it comes back; its hop limit or TTL still ends the loop
+
+    unsigned short unused = identity->nodeId;
+
+    for(int tries = 0; tries < 0xFFFF &&
+
+        (unused == 0 || nodeAddresses.count(unused) > 0); tries++) {
+
+      unused++;
+
+    }
+
+    publishIdentity(unused, identity->bloomWords, identity->bloomHashes);
+
+    nodeAddresses[unused] = groupAddress;
+
+    addressNodes[groupAddress] = unused;
+
+  }
+
+  pthread_mutex_unlock(&nodeLock);
+
+  if(!learned) {
+
+    queueControlFrame(remoteGroupID, CONTROL_NODE, 0,
+
+        ControlFrame::packIdentity(node, winner));
+
+    return false;
+
+  }
+
+  vector<string> relays;
+
+  vector<string> capable;
+
+  pthread_mutex_lock(&cxnLock);
+
+  for(map<string, peerHealth>::iterator peer = peers.begin();
+
+      peer != peers.end(); peer++) {
+
+    if(peer->second.headerVersion >= 2 && peer->first != remoteGroupID) {
+
+      relays.push_back(peer->first);
+
+    }
+
+    if(peer->second.capable) {
+
+      capable.push_back(peer->first);
+
+    }
+
+  }
+
+  pthread_mutex_unlock(&cxnLock);
+
+  for(int i = 0; i < (int)relays.size(); i++) {
+
+    queueControlFrame(relays[i], CONTROL_NODE, 0,
+
+        ControlFrame::packIdentity(node, group));
+
+  }
+
+  if(renumbered) {
+
+    cout << "UdpRelay: node ID " << node << " is taken by a relay with a "
+
+        << "larger group address; this relay is now node "
+
+        << identity->nodeId << endl;
+
+    for(int i = 0; i < (int)capable.size(); i++) {
+
+      queueControlFrame(capable[i], CONTROL_HELLO,
+
+          capabilitiesFor(headerVersion),
+
+          ControlFrame::packIdentity(identity->nodeId, groupAddress));
+
+    }
+
+  }
+
+  return true;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// capabilitiesFor
+
+// Returns the capabilities to announce for a header version
+
+//
+
+// @pre:   None
+
+// @post:  None
+
+// @param  version:   1, 2 or 3
+
+// @returns unsigned: CAPABILITY_CONTROL, CAPABILITY_JUMBO,
+
+//                    CAPABILITY_TRACE, CAPABILITY_PRIORITY and the
+
+//                    CAPABILITY_HEADER_* bits of version and every version
+
+//                    below it
+
+//-----------------------------------------------------------------------------
+
+unsigned int UdpRelay::capabilitiesFor(int version) {
+
+  unsigned int capabilities = CAPABILITY_CONTROL | CAPABILITY_JUMBO |
+
+      CAPABILITY_TRACE | CAPABILITY_PRIORITY;
+
+  if(version >= 2) {
+
+    capabilities |= CAPABILITY_HEADER_V2;
+
+  }
+
+  if(version >= 3) {
+
+    capabilities |= CAPABILITY_HEADER_BLOOM;
+
+  }
+
+  return capabilities;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// setBloomFilter
+
+// Offers version 3 headers to peers that connect from now on and sets the
+
+// filter packets get when this relay converts them
+
+//
+
+// @pre:   None
+
+// @post:  headerVersion is 3 if true is returned
+
+// @param  bytes:  Filter size, 32 to 64 in steps of 8
+
+// @param  hashes: Bits set per node ID, 0 to pick the best for ttl relays
+
+// @param  ttl:    Relays a packet may pass once converted, 1 to 255
+
+// @returns bool:  False if a value is out of range
+
+//-----------------------------------------------------------------------------
+
+bool UdpRelay::setBloomFilter(int bytes, int hashes, int ttl) {
+
+  int words = bytes / BLOOM_WORD_SIZE;
+
+  if(bytes % BLOOM_WORD_SIZE != 0 || words < MIN_BLOOM_WORDS ||
+
+      words > MAX_BLOOM_WORDS || hashes < 0 || hashes > MAX_BLOOM_HASHES ||
+
+      ttl < 1 || ttl > 255) {
+
+    return false;
+
+  }
+
+  if(hashes == 0) {
+
+    //bits / entries * ln 2 minimizes false positives with ttl entries
+
+    hashes = (int)(words * BLOOM_WORD_SIZE * 8 * 0.693 / ttl + 0.5);
+
+    hashes = hashes < 1 ? 1 : (hashes > MAX_BLOOM_HASHES ?
+
+        MAX_BLOOM_HASHES : hashes);
+
+  }
+
+  pthread_mutex_lock(&nodeLock);
+
+  bloomTtl = ttl;
+
+  publishIdentity(identity->nodeId, words, hashes);
+
+  pthread_mutex_unlock(&nodeLock);
+
+  headerVersion = 3;
+
+  cout << "UdpRelay: offering Bloom filter headers, " << bytes << " bytes, "
+
+      << hashes << " hashes, ttl " << ttl << endl;
+
+  return true;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// showHeader
+
+// Displays the header version offered, the node ID and, in Bloom filter mode,
+
+// the filter's false positive rate at a few path lengths
+
+//
+
+// @pre:   None
+
+// @post:  None
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::showHeader() {
+
+  const nodeIdentity* self = identity;
+
+  cout << "header: version " << headerVersion << " offered, node "
+
+      << self->nodeId
+
+      << ", " << hopLimited << " packets dropped at the hop limit, "
+
+      << nodeCollisions << " node ID collisions" << endl;
+
+  if(headerVersion < 3) {
+
+    return;
+
+  }
+
+  cout << "bloom filter: " << self->bloomWords * BLOOM_WORD_SIZE << " bytes, "
+
+      << self->bloomHashes << " hashes, ttl " << bloomTtl << endl;
+
+  for(int hops = 4; hops <= 64; hops *= 2) {
+
+    cout << "  false positives after " << hops << " hops: "
+
+        << PacketHeader::bloomFalsePositiveRate(self->bloomWords,
+
+        self->bloomHashes, hops) << endl;
+
+  }
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// setPayload
+
+// Sets the largest message the relay accepts and the size above which packets
+
+// are split into fragments on the local group and on links
+
+//
+
+// @pre:   None
+
+// @post:  maxPayload and fragmentSize are set if true is returned
+
+// @param  payload:  Largest message, 1 to MAX_PAYLOAD bytes
+
+// @param  fragment: Largest datagram on the local group, MIN_FRAGMENT_SIZE to
+
+//                   MAX_DATAGRAM_SIZE, or 0 to only fragment what does not
+
+//                   fit in a datagram
+
+// @returns bool:    False if a value is out of range
+
+//-----------------------------------------------------------------------------
+
+bool UdpRelay::setPayload(int payload, int fragment) {
+
+  if(payload < 1 || payload > MAX_PAYLOAD || (fragment != 0 &&
+
+      (fragment < MIN_FRAGMENT_SIZE || fragment > MAX_DATAGRAM_SIZE))) {
+
+    return false;
+
+  }
+
+  maxPayload = payload;
+
+  fragmentSize = fragment;
+
+  return true;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// showPayload
+
+// Displays the payload and fragment sizes and the reassembly counters
+
+//
+
+// @pre:   None
+
+// @post:  None
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::showPayload() {
+
+  cout << "payload: up to " << maxPayload << " bytes; ";
+
+  if(fragmentSize > 0) {
+
+    cout << "fragments of " << fragmentSize << " bytes on the local group, "
+
+        << SIZE << " on links" << endl;
+
+  }
+
+  else {
+
+    cout << "whole packets of up to " << MAX_DATAGRAM_SIZE
+
+        << " bytes on the local group, jumbo frames on links" << endl;
+
+  }
+
+  cout << "reassembly: " << reassembler->getPendingBytes()
+
+      << " bytes pending, " << reassembler->getReassembled()
+
+      << " packets reassembled, " << reassembler->getDropped()
+
+      << " given up; " << oversized << " oversized packets dropped" << endl;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// loadConfig
+
+// Reads a config file (see RelayConfig). If the relay is running, its
+
+// commands are run and its peers connected in parallel right away; otherwise
+
+// start() does so
+
+//
+
+// @pre:   None
+
+// @post:  The config is applied or pending, or an error is reported to cout
+
+// @param  path:  The config file
+
+// @returns bool: False if the file cannot be read or has a bad line
+
+//-----------------------------------------------------------------------------
+
+bool UdpRelay::loadConfig(const string& path) {
+
+  RelayConfig loaded;
+
+  if(!loaded.load(path)) {
+
+    cout << "config: " << loaded.getError() << endl;
+
+    return false;
+
+  }
+
+  pthread_mutex_lock(&ruleLock);
+
+  config = loaded;
+
+  configPath = path;
+
+  pthread_mutex_unlock(&ruleLock);
+
+  if(running) {
+
+    applyConfig(loaded);
+
+  }
+
+  return true;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// applyConfig
+
+// Runs a config's commands in file order, then connects its peers in parallel
+
+// and waits for the quorum
+
+//
+
+// @pre:   The relay is running
+
+// @post:  Every configured peer is connected or being reconnected
+
+// @param  applied: The config to apply
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::applyConfig(const RelayConfig& applied) {
+
+  //SIGHUP reloads the file from now on
+
+  hangupsSeen = hangups;
+
+  struct sigaction hangup;
+
+  memset(&hangup, 0, sizeof(hangup));
+
+  hangup.sa_handler = hangupHandler;
+
+  hangup.sa_flags = SA_RESTART;
+
+  sigaction(SIGHUP, &hangup, NULL);
+
+  //Commands first, so header versions and tuning are in place before any
+
+  //link opens
+
+  const vector<string>& commands = applied.getCommands();
+
+  for(size_t i = 0; i < commands.size(); i++) {
+
+    executeCommand(commands[i]);
+
+  }
+
+  const vector<string>& peers = applied.getPeers();
+
+  pthread_mutex_lock(&cxnLock);
+
+  quorumPeers = peers;
+
+  quorum = applied.getQuorum();
+
+  ready = false;
+
+  pthread_mutex_unlock(&cxnLock);
+
+  long long startUs = monotonicMicros();
+
+  int connected = connectPeers(peers, applied.getConnectTimeoutMs());
+
+  cout << "UdpRelay: connected " << connected << " of " << peers.size()
+
+      << " configured peers in " << (monotonicMicros() - startUs) / 1000
+
+      << " ms" << endl;
+
+  checkReady();
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// checkReady
+
+// Reports readiness once the configured quorum of peers is connected
+
+//
+
+// @pre:   None
+
+// @post:  ready is true if the quorum is connected
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::checkReady() {
+
+  pthread_mutex_lock(&cxnLock);
+
+  int connected = 0;
+
+  for(size_t i = 0; i < quorumPeers.size(); i++) {
+
+    connected += tcpCxns.count(quorumPeers[i]);
+
+  }
+
+  int configured = quorumPeers.size();
+
+  bool nowReady = !ready && connected >= quorum;
+
+  if(nowReady) {
+
+    ready = true;
+
+  }
+
+  pthread_mutex_unlock(&cxnLock);
+
+  if(nowReady) {
+
+    cout << "UdpRelay: ready, " << connected << " of " << configured
+
+        << " peers connected (quorum " << quorum << ")" << endl;
+
+    notifyAdmins("ready");
+
+  }
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// isReady
+
+// Tells whether the configured quorum of peers has been connected. A relay
+
+// without a config file is always ready
+
+//
+
+// @pre:   None
+
+// @post:  None
+
+// @returns bool: True once the quorum has been connected
+
+//-----------------------------------------------------------------------------
+
+bool UdpRelay::isReady() {
+
+  return ready;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// showConfig
+
+// Prints the config file in use and how many of its peers are connected
+
+//
+
+// @pre:   None
+
+// @post:  None
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::showConfig() {
+
+  pthread_mutex_lock(&ruleLock);
+
+  string path = configPath;
+
+  pthread_mutex_unlock(&ruleLock);
+
+  if(path.empty()) {
+
+    cout << "config: none" << endl;
+
+    return;
+
+  }
+
+  pthread_mutex_lock(&cxnLock);
+
+  int connected = 0;
+
+  for(size_t i = 0; i < quorumPeers.size(); i++) {
+
+    connected += tcpCxns.count(quorumPeers[i]);
+
+  }
+
+  int configured = quorumPeers.size();
+
+  int needed = quorum;
+
+  pthread_mutex_unlock(&cxnLock);
+
+  cout << "config: " << path << ", " << connected << " of " << configured
+
+      << " peers connected, quorum " << needed
+
+      << (ready ? ", ready" : ", not ready") << endl;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// reloadConfig
+
+// Reads the config file again and applies only what changed: peers no longer
+
+// listed are deleted, new ones are connected in parallel, and settings whose
+
+// line changed are run again or, if removed, put back to their defaults.
+
+// Links to peers still listed keep running. Also run on SIGHUP
+
+//
+
+// @pre:   None
+
+// @post:  The running state matches the file, or an error is reported to
+
+//         cout and nothing changed
+
+// @returns bool: False if there is no config file, it has a bad line or a
+
+//                reload is already running
+
+//-----------------------------------------------------------------------------
+
+bool UdpRelay::reloadConfig() {
+
+  if(__sync_lock_test_and_set(&reloading, 1)) {
+
+    cout << "A reload is already running." << endl;
+
+    return false;
+
+  }
+
+  pthread_mutex_lock(&ruleLock);
+
+  string path = configPath;
+
+  RelayConfig current = config;
+
+  pthread_mutex_unlock(&ruleLock);
+
+  RelayConfig loaded;
+
+  if(path.empty()) {
+
+    cout << "reload: no config file; use config <file> first" << endl;
+
+    __sync_lock_release(&reloading);
+
+    return false;
+
+  }
+
+  if(!loaded.load(path)) {
+
+    cout << "reload: " << loaded.getError() << "; keeping the running config"
+
+        << endl;
+
+    __sync_lock_release(&reloading);
+
+    return false;
+
+  }
+
+  //Settings: the last line for each one wins, as it did when it was run
+
+  map<string, string> oldSettings;
+
+  map<string, string> newSettings;
+
+  const vector<string>& oldCommands = current.getCommands();
+
+  const vector<string>& newCommands = loaded.getCommands();
+
+  for(size_t i = 0; i < oldCommands.size(); i++) {
+
+    oldSettings[RelayConfig::getKey(oldCommands[i])] = oldCommands[i];
+
+  }
+
+  for(size_t i = 0; i < newCommands.size(); i++) {
+
+    newSettings[RelayConfig::getKey(newCommands[i])] = newCommands[i];
+
+  }
+
+  int changed = 0;
+
+  for(map<string, string>::iterator setting = oldSettings.begin();
+
+      setting != oldSettings.end(); setting++) {
+
+    string revert = revertCommand(setting->first);
+
+    if(newSettings.count(setting->first) == 0 && !revert.empty()) {
+
+      executeCommand(revert);
+
+      changed++;
+
+    }
+
+  }
+
+  for(size_t i = 0; i < newCommands.size(); i++) {
+
+    string key = RelayConfig::getKey(newCommands[i]);
+
+    map<string, string>::iterator before = oldSettings.find(key);
+
+    if(newSettings[key] == newCommands[i] &&
+
+        (before == oldSettings.end() || before->second != newCommands[i])) {
+
+      executeCommand(newCommands[i]);
+
+      changed++;
+
+    }
+
+  }
+
+  //Peers: only the ones added or removed are touched
+
+  const vector<string>& oldPeers = current.getPeers();
+
+  const vector<string>& newPeers = loaded.getPeers();
+
+  set<string> kept(newPeers.begin(), newPeers.end());
+
+  int removed = 0;
+
+  for(size_t i = 0; i < oldPeers.size(); i++) {
+
+    if(kept.count(oldPeers[i]) == 0) {
+
+      terminateRemoteCxn(oldPeers[i]);
+
+      removed++;
+
+    }
+
+  }
+
+  set<string> existing(oldPeers.begin(), oldPeers.end());
+
+  vector<string> added;
+
+  for(size_t i = 0; i < newPeers.size(); i++) {
+
+    if(existing.count(newPeers[i]) == 0) {
+
+      added.push_back(newPeers[i]);
+
+    }
+
+  }
+
+  pthread_mutex_lock(&ruleLock);
+
+  config = loaded;
+
+  pthread_mutex_unlock(&ruleLock);
+
+  pthread_mutex_lock(&cxnLock);
+
+  quorumPeers = newPeers;
+
+  quorum = loaded.getQuorum();
+
+  pthread_mutex_unlock(&cxnLock);
+
+  connectPeers(added, loaded.getConnectTimeoutMs());
+
+  cout << "UdpRelay: reloaded " << path << ": " << added.size()
+
+      << " peers added, " << removed << " removed, "
+
+      << newPeers.size() - added.size() << " kept; " << changed
+
+      << " settings changed" << endl;
+
+  checkReady();
+
+  __sync_lock_release(&reloading);
+
+  return true;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// revertCommand
+
+// Returns the console command that puts a setting back to its default
+
+//
+
+// @pre:   None
+
+// @post:  None
+
+// @param  key:     A setting, as returned by RelayConfig::getKey
+
+// @returns string: The command, or "" if the setting has no default to return
+
+//                  to
+
+//-----------------------------------------------------------------------------
+
+string UdpRelay::revertCommand(const string& key) {
+
+  stringstream keyStream(key);
+
+  string name = "";
+
+  string subject = "";
+
+  keyStream >> name >> subject;
+
+  stringstream revert;
+
+  if(name == "priority" || name == "pin" || name == "tunnel" ||
+
+      name == "redundant") {
+
+    revert << name << " " << subject << " none";
+
+  } else if(name == "conflate") {
+
+    revert << "conflate " << subject << " off";
+
+  } else if(name == "shm" && !subject.empty()) {
+
+    revert << "shm delete " << subject;
+
+  } else if(name == "schedule") {
+
+    revert << "schedule strict";
+
+  } else if(name == "trace" || name == "lowlatency" ||
+
+      name == "timestamping" || name == "journal") {
+
+    revert << name << " off";
+
+  } else if(name == "capture") {
+
+    revert << "capture stop";
+
+  } else if(name == "udplink" && !subject.empty()) {
+
+    revert << "udplink delete " << subject;
+
+  } else if(name == "admin" || name == "metrics" || name == "udplink" ||
+
+      name == "fanout") {
+
+    revert << name << " off";
+
+  } else if(name == "heartbeat") {
+
+    revert << "heartbeat " << DEFAULT_HEARTBEAT_MS << " "
+
+        << DEFAULT_HEARTBEAT_MISSES;
+
+  } else if(name == "backlog") {
+
+    revert << "backlog " << DEFAULT_BACKLOG_PACKETS << " "
+
+        << DEFAULT_REPLAY_RATE << " none";
+
+  } else if(name == "payload") {
+
+    revert << "payload " << DEFAULT_MAX_PAYLOAD << " 0";
+
+  } else if(name == "queue") {
+
+    revert << "queue " << DEFAULT_LANE_CAPACITY;
+
+  }
+
+  return revert.str();
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// reloadThread
+
+// A static class method that is a thread function for a reload started by
+
+// SIGHUP, so the heartbeat thread does not wait for peers to connect
+
+//
+
+// @pre:   *arg parameter represents a valid UdpRelay object
+
+// @post:  The config file has been reloaded
+
+// @param  *arg:  A void pointer to the UdpRelay object
+
+//-----------------------------------------------------------------------------
+
+void* UdpRelay::reloadThread(void *arg) {
+
+  UdpRelay* thisUdpRelay = (UdpRelay*)arg;
+
+  cout << "UdpRelay: SIGHUP, reloading the config file" << endl;
+
+  thisUdpRelay->reloadConfig();
+
+  thisUdpRelay->removeWorker();
+
+  return NULL;
+
+}
+
+
+
+
+
+
+
+volatile sig_atomic_t UdpRelay::hangups = 0;
+
+
+
+
+
+
+
+//-----------------------------------------------------------------------------
+
+// hangupHandler
+
+// SIGHUP handler; counts the signal for the heartbeat threads to see
+
+//
+
+// @pre:   None
+
+// @post:  hangups is incremented
+
+// @param  signal: SIGHUP
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::hangupHandler(int signal) {
+
+  (void)signal;
+
+  hangups = hangups + 1;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// handOff
+
+// Passes the relay to a new process without dropping a link: waits for it to
+
+// connect to a Unix socket at path (see the takeoverPath constructor
+
+// parameter), stops every relay thread, flushes the egress queues onto their
+
+// links, and sends the listening, multicast and peer sockets with the peers'
+
+// state and store-and-forward backlogs. The relay is stopped afterwards, with
+
+// its sockets open in the new process only.
+
+//
+
+// @pre:   The relay is running
+
+// @post:  The new process owns the sockets if true is returned; if false is
+
+//         returned before it connected, nothing changed
+
+// @param  path:  The Unix socket to listen on
+
+// @returns bool: False if no process took over
+
+//-----------------------------------------------------------------------------
+
+bool UdpRelay::handOff(const string& path) {
+
+  if(!running) {
+
+    cout << "UdpRelay: not running" << endl;
+
+    return false;
+
+  }
+
+  int listener = Handoff::listenAt(path);
+
+  if(listener < 0) {
+
+    cout << "UdpRelay: cannot listen on " << path << ": " << strerror(errno)
+
+        << endl;
+
+    return false;
+
+  }
+
+  cout << "UdpRelay: waiting for the new relay on " << path << endl;
+
+  int sd = Handoff::acceptWithin(listener, HANDOFF_WAIT_MS);
+
+  close(listener);
+
+  unlink(path.c_str());
+
+  if(sd < 0) {
+
+    cout << "UdpRelay: no relay took over within " << HANDOFF_WAIT_MS / 1000
+
+        << " s" << endl;
+
+    return false;
+
+  }
+
+  long long startUs = monotonicMicros();
+
+  //The new relay opens its own admin socket, if configured, once it starts.
+
+  //UDP links are not handed over; their peers link to the new relay again.
+
+  stopAdmin();
+
+  stopUdpLinks();
+
+  //Stop the relay threads as stop() does, but leave every socket open
+
+  handingOff = true;
+
+  running = false;
+
+  pthread_cancel(relayInThreadID);
+
+  pthread_cancel(acceptThreadID);
+
+  pthread_join(relayInThreadID, NULL);
+
+  pthread_join(acceptThreadID, NULL);
+
+  stopLocalStage();
+
+  pthread_join(shmInThreadID, NULL);
+
+  pthread_join(heartbeatThreadID, NULL);
+
+  pthread_mutex_lock(&cxnLock);
+
+  map<string, int> links = tcpCxns;
+
+  pthread_mutex_unlock(&cxnLock);
+
+  for(map<string, int>::iterator link = links.begin(); link != links.end();
+
+      link++) {
+
+    pthread_cancel(outThreads[link->second]);
+
+  }
+
+  for(map<string, int>::iterator link = links.begin(); link != links.end();
+
+      link++) {
+
+    void* result = NULL;
+
+    pthread_join(outThreads[link->second], &result);
+
+    outThreads.erase(link->second);
+
+    if(result == PTHREAD_CANCELED) {
+
+      removeWorker();   //It stopped between frames, leaving its link as is
+
+    }
+
+  }
+
+  stopRemoteStage();
+
+  //Let the egress threads flush their queues onto the links; they keep the
+
+  //backlogs of peers that are down for the new relay. A link whose queue
+
+  //does not flush in time is left out and its peer reconnects.
+
+  pthread_mutex_lock(&cxnLock);
+
+  pthread_mutex_lock(&fanoutLock);
+
+  flushFanout();
+
+  pthread_mutex_unlock(&fanoutLock);
+
+  size_t flushing = egressQueues.size();
+
+  for(map<string, PacketQueue*>::iterator egress = egressQueues.begin();
+
+      egress != egressQueues.end(); egress++) {
+
+    egress->second->close();
+
+  }
+
+  egressQueues.clear();
+
+  pthread_mutex_unlock(&cxnLock);
+
+  rebroadcastQueue->close();
+
+  pthread_join(rebroadcastThreadID, NULL);
+
+  long long drainUs = monotonicMicros() + HANDOFF_DRAIN_MS * 1000LL;
+
+  while(monotonicMicros() < drainUs) {
+
+    pthread_mutex_lock(&cxnLock);
+
+    bool flushed = drainedPeers.size() >= flushing;
+
+    pthread_mutex_unlock(&cxnLock);
+
+    if(flushed) {
+
+      break;
+
+    }
+
+    usleep(REPLAY_TICK_MS * 1000);
+
+  }
+
+  vector<int> fds;
+
+  string state = packHandoff(fds);
+
+  bool sent = Handoff::send(sd, state, fds);
+
+  close(sd);
+
+  //Close this relay's copies; the links stay up in the new relay. Links left
+
+  //out, or all of them if the new relay went away, are shut down so their
+
+  //peers reconnect.
+
+  int handed = 0;
+
+  pthread_mutex_lock(&cxnLock);
+
+  for(map<string, int>::iterator link = tcpCxns.begin();
+
+      link != tcpCxns.end(); link++) {
+
+    if(sent && drainedPeers.count(link->first) > 0) {
+
+      handed++;
+
+    } else {
+
+      shutdown(link->second, SHUT_RDWR);
+
+    }
+
+    close(link->second);
+
+  }
+
+  tcpCxns.clear();
+
+  peers.clear();
+
+  peerGeneration++;
+
+  managedPeers.clear();
+
+  pthread_mutex_unlock(&cxnLock);
+
+  pthread_mutex_lock(&workerLock);
+
+  while(liveWorkers > 0) {
+
+    pthread_cond_wait(&workersDone, &workerLock);
+
+  }
+
+  pthread_mutex_unlock(&workerLock);
+
+  pthread_mutex_lock(&cxnLock);
+
+  for(map<string, StoreForward*>::iterator backlog = handoffBacklogs.begin();
+
+      backlog != handoffBacklogs.end(); backlog++) {
+
+    delete backlog->second;
+
+  }
+
+  handoffBacklogs.clear();
+
+  drainedPeers.clear();
+
+  pthread_mutex_unlock(&cxnLock);
+
+  journaling = false;
+
+  journal.close();
+
+  stopCapture();
+
+  if(!sent) {
+
+    cout << "UdpRelay: the new relay went away; relay stopped" << endl;
+
+    return false;
+
+  }
+
+  cout << "UdpRelay: handed " << handed << " links to the new relay in "
+
+      << (monotonicMicros() - startUs) / 1000 << " ms" << endl;
+
+  return true;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// packHandoff
+
+// Serializes the listening and multicast sockets, the node ID table and every
+
+// link and managed peer for handOff
+
+//
+
+// @pre:   The relay threads have stopped
+
+// @post:  fds holds the sockets the state refers to, by index; the backlogs
+
+//         handed to handOff are emptied into the state
+
+// @param  fds:     Receives the sockets to pass
+
+// @returns string: The state
+
+//-----------------------------------------------------------------------------
+
+string UdpRelay::packHandoff(vector<int>& fds) {
+
+  string state = "";
+
+  Handoff::putNumber(state, HANDOFF_VERSION);
+
+  int listener = listenSd;
+
+  if(listener == NULL_SD) {
+
+    listener = Handoff::findListener(portNumber);   //Opened inside Socket
+
+  }
+
+  int shared[2] = {listener, localRecvSd};
+
+  for(int i = 0; i < 2; i++) {
+
+    Handoff::putNumber(state,
+
+        shared[i] != NULL_SD ? (long long)fds.size() : -1);
+
+    if(shared[i] != NULL_SD) {
+
+      fds.push_back(shared[i]);
+
+    }
+
+  }
+
+  pthread_mutex_lock(&nodeLock);
+
+  Handoff::putNumber(state, nodeAddresses.size());
+
+  for(map<unsigned short, unsigned int>::iterator node =
+
+      nodeAddresses.begin(); node != nodeAddresses.end(); node++) {
+
+    Handoff::putNumber(state, node->first);
+
+    Handoff::putNumber(state, node->second);
+
+  }
+
+  pthread_mutex_unlock(&nodeLock);
+
+  pthread_mutex_lock(&cxnLock);
+
+  set<string> names;
+
+  for(map<string, int>::iterator link = tcpCxns.begin();
+
+      link != tcpCxns.end(); link++) {
+
+    if(drainedPeers.count(link->first) > 0) {
+
+      names.insert(link->first);
+
+    }
+
+  }
+
+  for(map<string, managedPeer>::iterator peer = managedPeers.begin();
+
+      peer != managedPeers.end(); peer++) {
+
+    names.insert(peer->first);
+
+  }
+
+  Handoff::putNumber(state, names.size());
+
+  char frame[SIZE];
+
+  for(set<string>::iterator name = names.begin(); name != names.end();
+
+      name++) {
+
+    map<string, int>::iterator link = tcpCxns.find(*name);
+
+    bool linked = link != tcpCxns.end() && drainedPeers.count(*name) > 0;
+
+    map<string, peerHealth>::iterator health = peers.find(*name);
+
+    bool known = linked && health != peers.end();
+
+    Handoff::putBytes(state, *name);
+
+    Handoff::putNumber(state, linked ? (long long)fds.size() : -1);
+
+    if(linked) {
+
+      fds.push_back(link->second);
+
+    }
+
+    Handoff::putNumber(state, managedPeers.count(*name));
+
+    Handoff::putNumber(state, known && health->second.capable);
+
+    Handoff::putNumber(state, known ? health->second.headerVersion : 1);
+
+    Handoff::putNumber(state, known ? health->second.nodeId : 0);
+
+    Handoff::putNumber(state, known && health->second.jumbo);
+
+    Handoff::putNumber(state,
+
+        (known && health->second.trace ? CAPABILITY_TRACE : 0) |
+
+        (known && health->second.priority ? CAPABILITY_PRIORITY : 0));
+
+    vector<string> held;
+
+    map<string, StoreForward*>::iterator backlog = handoffBacklogs.find(*name);
+
+    while(backlog != handoffBacklogs.end() && backlog->second->pop(frame)) {
+
+      held.push_back(string(frame, SIZE));
+
+    }
+
+    Handoff::putNumber(state, held.size());
+
+    for(size_t i = 0; i < held.size(); i++) {
+
+      Handoff::putBytes(state, held[i]);
+
+    }
+
+  }
+
+  pthread_mutex_unlock(&cxnLock);
+
+  return state;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// takeOver
+
+// Receives the state and sockets of a relay running handOff and keeps them for
+
+// start()
+
+//
+
+// @pre:   Called from the constructor, before any socket is opened
+
+// @post:  listenSd, localRecvSd and adoptedPeers hold what was passed if true
+
+//         is returned
+
+// @param  path:  The old relay's handoff socket
+
+// @returns bool: False if nothing or a malformed state was received
+
+//-----------------------------------------------------------------------------
+
+bool UdpRelay::takeOver(const string& path) {
+
+  localRecvSd = NULL_SD;
+
+  int sd = Handoff::connectTo(path);
+
+  if(sd < 0) {
+
+    cerr << "UdpRelay: cannot connect to " << path << ": " << strerror(errno)
+
+        << endl;
+
+    return false;
+
+  }
+
+  string state = "";
+
+  vector<int> fds;
+
+  bool valid = Handoff::receive(sd, state, fds);
+
+  close(sd);
+
+  size_t position = 0;
+
+  long long version = 0;
+
+  long long listener = -1;
+
+  long long multicast = -1;
+
+  long long count = 0;
+
+  valid = valid && Handoff::getNumber(state, position, version) &&
+
+      version == HANDOFF_VERSION &&
+
+      Handoff::getNumber(state, position, listener) &&
+
+      Handoff::getNumber(state, position, multicast) &&
+
+      Handoff::getNumber(state, position, count);
+
+  for(long long i = 0; valid && i < count; i++) {
+
+    long long node = 0;
+
+    long long group = 0;
+
+    valid = Handoff::getNumber(state, position, node) &&
+
+        Handoff::getNumber(state, position, group);
+
+    if(valid && (unsigned int)group != groupAddress) {
+
+      nodeAddresses[(unsigned short)node] = (unsigned int)group;
+
+      addressNodes[(unsigned int)group] = (unsigned short)node;
+
+    }
+
+  }
+
+  valid = valid && Handoff::getNumber(state, position, count);
+
+  for(long long i = 0; valid && i < count; i++) {
+
+    handoffPeer adopted;
+
+    long long link = -1;
+
+    long long managed = 0;
+
+    long long capable = 0;
+
+    long long peerVersion = 1;
+
+    long long node = 0;
+
+    long long jumbo = 0;
+
+    long long extensions = 0;
+
+    long long held = 0;
+
+    valid = Handoff::getBytes(state, position, adopted.name) &&
+
+        Handoff::getNumber(state, position, link) &&
+
+        Handoff::getNumber(state, position, managed) &&
+
+        Handoff::getNumber(state, position, capable) &&
+
+        Handoff::getNumber(state, position, peerVersion) &&
+
+        Handoff::getNumber(state, position, node) &&
+
+        Handoff::getNumber(state, position, jumbo) &&
+
+        Handoff::getNumber(state, position, extensions) &&
+
+        Handoff::getNumber(state, position, held);
+
+    if(!valid) {
+
+      break;
+
+    }
+
+    adopted.sd = (link >= 0 && link < (long long)fds.size()) ? fds[link] :
+
+        NULL_SD;
+
+    adopted.managed = managed != 0;
+
+    adopted.capable = capable != 0;
+
+    adopted.headerVersion = (int)peerVersion;
+
+    adopted.nodeId = (unsigned short)node;
+
+    adopted.jumbo = jumbo != 0;
+
+    adopted.extensions = (unsigned int)extensions;
+
+    if(held > 0) {
+
+      StoreForward* backlog = new StoreForward(SIZE,
+
+          held > backlogPackets ? (int)held : backlogPackets, "");
+
+      handoffBacklogs[adopted.name] = backlog;
+
+    }
+
+    string frame = "";
+
+    for(long long j = 0; valid && j < held; j++) {
+
+      valid = Handoff::getBytes(state, position, frame);
+
+      if(valid && frame.size() == (size_t)SIZE) {
+
+        handoffBacklogs[adopted.name]->push(frame.data());
+
+      }
+
+    }
+
+    adoptedPeers.push_back(adopted);
+
+  }
+
+  if(!valid) {
+
+    for(size_t i = 0; i < fds.size(); i++) {
+
+      close(fds[i]);
+
+    }
+
+    adoptedPeers.clear();
+
+    for(map<string, StoreForward*>::iterator backlog =
+
+        handoffBacklogs.begin(); backlog != handoffBacklogs.end(); backlog++) {
+
+      delete backlog->second;
+
+    }
+
+    handoffBacklogs.clear();
+
+    cerr << "UdpRelay: no relay state received from " << path << endl;
+
+    return false;
+
+  }
+
+  if(listener >= 0 && listener < (long long)fds.size()) {
+
+    listenSd = fds[listener];
+
+  }
+
+  if(multicast >= 0 && multicast < (long long)fds.size()) {
+
+    localRecvSd = fds[multicast];
+
+  }
+
+  if(localRecvSd == NULL_SD) {
+
+    localRecvSd = localRecvGroup->getServerSocket();
+
+  }
+
+  cout << "UdpRelay: took over " << adoptedPeers.size() << " peers from "
+
+      << path << endl;
+
+  return true;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// adoptPeers
+
+// Resumes relaying on the links taken over from the old relay: restores each
+
+// peer's state and backlog and spins up its relayOut and relayEgress threads
+
+// without a new handshake
+
+//
+
+// @pre:   The relay is running
+
+// @post:  adoptedPeers is empty
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::adoptPeers() {
+
+  if(adoptedPeers.empty()) {
+
+    return;
+
+  }
+
+  for(size_t i = 0; i < adoptedPeers.size(); i++) {
+
+    const handoffPeer& adopted = adoptedPeers[i];
+
+    if(adopted.managed) {
+
+      managePeer(adopted.name);
+
+    }
+
+    if(adopted.sd == NULL_SD) {
+
+      //Down in the old relay too: keep buffering and retrying
+
+      startEgress(adopted.name);
+
+      scheduleReconnect(adopted.name);
+
+      continue;
+
+    }
+
+    registerPeer(adopted.name, adopted.capable);
+
+    pthread_mutex_lock(&cxnLock);
+
+    peerHealth& health = peers[adopted.name];
+
+    health.headerVersion = adopted.headerVersion;
+
+    health.nodeId = adopted.nodeId;
+
+    health.jumbo = adopted.jumbo;
+
+    health.trace = (adopted.extensions & CAPABILITY_TRACE) != 0;
+
+    health.priority = (adopted.extensions & CAPABILITY_PRIORITY) != 0;
+
+    tcpCxns[adopted.name] = adopted.sd;
+
+    peerGeneration++;
+
+    pthread_mutex_unlock(&cxnLock);
+
+    tuneSocket(adopted.sd);
+
+    startEgress(adopted.name);
+
+    outThreadInfo* outInfo = new outThreadInfo(this, adopted.name.c_str(),
+
+        adopted.sd);
+
+    addWorker();
+
+    if(pthread_create(&outThreads[adopted.sd], NULL, relayOutThread,
+
+        (void*)outInfo) != 0) {
+
+      cerr << "Thread creation failed!" << endl;
+
+      exit(EXIT_FAILURE);
+
+    }
+
+  }
+
+  cout << "UdpRelay: resumed " << adoptedPeers.size() << " peers" << endl;
+
+  adoptedPeers.clear();
+
+  checkReady();
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// startAdmin
+
+// Serves the admin protocol on a Unix socket (see the header for the
+
+// protocol)
+
+//
+
+// @pre:   None
+
+// @post:  Clients can connect to path if true is returned; a socket opened
+
+//         before is closed
+
+// @param  path:  The socket file
+
+// @returns bool: False if the socket cannot be created
+
+//-----------------------------------------------------------------------------
+
+bool UdpRelay::startAdmin(const string& path) {
+
+  stopAdmin();
+
+  if(!admin.open(path)) {
+
+    cout << "UdpRelay: cannot open admin socket " << path << ": "
+
+        << strerror(errno) << endl;
+
+    return false;
+
+  }
+
+  adminRunning = true;
+
+  if(pthread_create(&adminThreadID, NULL, adminThread, (void*)this) != 0) {
+
+    cerr << "Thread creation failed!" << endl;
+
+    exit(EXIT_FAILURE);
+
+  }
+
+  cout << "UdpRelay: admin socket on " << path << endl;
+
+  return true;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// stopAdmin
+
+// Disconnects every admin client and removes the admin socket
+
+//
+
+// @pre:   None
+
+// @post:  The admin thread has exited
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::stopAdmin() {
+
+  if(!adminRunning) {
+
+    return;
+
+  }
+
+  adminRunning = false;
+
+  admin.wake();
+
+  pthread_join(adminThreadID, NULL);
+
+  admin.close();
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// adminThread
+
+// A static class method that is a thread function for the admin socket:
+
+// accepts clients, reads their requests and writes out their replies
+
+//
+
+// @pre:   *arg parameter represents a valid UdpRelay object
+
+// @post:  stopAdmin has been called
+
+// @param  *arg:  A void pointer to the UdpRelay object
+
+//-----------------------------------------------------------------------------
+
+void* UdpRelay::adminThread(void *arg) {
+
+  UdpRelay* thisUdpRelay = (UdpRelay*)arg;
+
+  vector<AdminRequest> requests;
+
+  while(thisUdpRelay->adminRunning) {
+
+    requests.clear();
+
+    thisUdpRelay->admin.wait(-1, requests);
+
+    for(size_t i = 0; i < requests.size(); i++) {
+
+      thisUdpRelay->handleAdminRequest(requests[i]);
+
+    }
+
+  }
+
+  return NULL;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// handleAdminRequest
+
+// Carries out one admin request and queues its reply (see startAdmin)
+
+//
+
+// @pre:   Called from the admin thread
+
+// @post:  The reply is queued, or will be by an adminBatchThread
+
+// @param  request: The client and its request line
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::handleAdminRequest(const AdminRequest& request) {
+
+  stringstream requestStream(request.line);
+
+  string tag = "";
+
+  string verb = "";
+
+  if(!(requestStream >> tag)) {
+
+    return;     //Blank line
+
+  }
+
+  if(!(requestStream >> verb)) {
+
+    admin.reply(request.client, "? error expected: tag command [arguments]\n");
+
+    return;
+
+  }
+
+  vector<string> hosts;
+
+  string host = "";
+
+  while(requestStream >> host) {
+
+    hosts.push_back(host.substr(0, host.find(':')));  //Port ignored, as in add
+
+  }
+
+  stringstream reply;
+
+  if((verb == "add" || verb == "delete") && hosts.empty()) {
+
+    reply << tag << " error usage: " << verb << " host...\n";
+
+  }
+
+  else if(verb == "add") {
+
+    //Connecting can take the whole connect timeout, so it is answered from
+
+    //its own thread and later requests are not held up
+
+    adminBatchInfo* batchInfo = new adminBatchInfo;
+
+    batchInfo->currentRelay = this;
+
+    batchInfo->client = request.client;
+
+    batchInfo->tag = tag;
+
+    batchInfo->hosts = hosts;
+
+    pthread_t batchThreadID;
+
+    addWorker();
+
+    if(pthread_create(&batchThreadID, NULL, adminBatchThread,
+
+        (void*)batchInfo) != 0) {
+
+      cerr << "Thread creation failed!" << endl;
+
+      exit(EXIT_FAILURE);
+
+    }
+
+    pthread_detach(batchThreadID);
+
+    return;
+
+  }
+
+  else if(verb == "delete") {
+
+    int deleted = 0;
+
+    for(size_t i = 0; i < hosts.size(); i++) {
+
+      pthread_mutex_lock(&cxnLock);
+
+      bool known = tcpCxns.count(hosts[i]) > 0 ||
+
+          managedPeers.count(hosts[i]) > 0;
+
+      pthread_mutex_unlock(&cxnLock);
+
+      if(known) {
+
+        terminateRemoteCxn(hosts[i]);
+
+        deleted++;
+
+      }
+
+      else {
+
+        reply << tag << " unknown " << hosts[i] << "\n";
+
+      }
+
+    }
+
+    reply << tag << " ok deleted " << deleted << " of " << hosts.size()
+
+        << "\n";
+
+  }
+
+  else if(verb == "peers" || verb == "stats") {
+
+    bool detailed = verb == "stats";
+
+    pthread_mutex_lock(&cxnLock);
+
+    set<string> names;
+
+    for(map<string, int>::iterator link = tcpCxns.begin();
+
+        link != tcpCxns.end(); link++) {
+
+      names.insert(link->first);
+
+    }
+
+    for(map<string, managedPeer>::iterator managed = managedPeers.begin();
+
+        managed != managedPeers.end(); managed++) {
+
+      names.insert(managed->first);
+
+    }
+
+    if(!hosts.empty()) {
+
+      set<string> wanted;
+
+      for(size_t i = 0; i < hosts.size(); i++) {
+
+        if(names.count(hosts[i]) > 0) {
+
+          wanted.insert(hosts[i]);
+
+        }
+
+        else {
+
+          reply << tag << " unknown " << hosts[i] << "\n";
+
+        }
+
+      }
+
+      names.swap(wanted);
+
+    }
+
+    for(set<string>::iterator name = names.begin(); name != names.end();
+
+        name++) {
+
+      reply << tag << " peer " << *name << " state="
+
+          << (tcpCxns.count(*name) > 0 ? "up" : "down");
+
+      if(!detailed) {
+
+        reply << "\n";
+
+        continue;
+
+      }
+
+      int queued = 0;
+
+      long long dropped = 0;
+
+      map<string, PacketQueue*>::iterator egress = egressQueues.find(*name);
+
+      if(egress != egressQueues.end()) {
+
+        for(int lane = 0; lane < NUM_PRIORITIES; lane++) {
+
+          queued += egress->second->size(lane);
+
+          dropped += egress->second->getDropped(lane);
+
+        }
+
+      }
+
+      reply << " queued=" << queued << " dropped=" << dropped;
+
+      map<string, peerHealth>::iterator peer = peers.find(*name);
+
+      if(peer != peers.end()) {
+
+        reply << " rtt_us=" << (long long)peer->second.smoothedRttUs
+
+            << " jitter_us=" << (long long)peer->second.jitterUs
+
+            << " header=" << peer->second.headerVersion;
+
+      }
+
+      map<string, managedPeer>::iterator managed = managedPeers.find(*name);
+
+      if(managed != managedPeers.end()) {
+
+        reply << " attempts=" << managed->second.attempts;
+
+        if(managed->second.backlog != NULL) {
+
+          reply << " backlog=" << managed->second.backlog->size()
+
+              << " spilled=" << managed->second.backlog->getSpilled();
+
+        }
+
+      }
+
+      reply << "\n";
+
+    }
+
+    int listed = names.size();
+
+    int links = tcpCxns.size();
+
+    pthread_mutex_unlock(&cxnLock);
+
+    if(detailed) {
+
+      reply << tag << " relay links=" << links << " rebroadcast_queued="
+
+          << rebroadcastQueue->size() << " ready=" << (ready ? 1 : 0)
+
+          << "\n";
+
+    }
+
+    reply << tag << " ok " << listed << "\n";
+
+  }
+
+  else if(verb == "ready") {
+
+    pthread_mutex_lock(&cxnLock);
+
+    int connected = 0;
+
+    for(size_t i = 0; i < quorumPeers.size(); i++) {
+
+      connected += tcpCxns.count(quorumPeers[i]);
+
+    }
+
+    reply << tag << " ok " << (ready ? "ready" : "waiting") << " connected="
+
+        << connected << " configured=" << quorumPeers.size() << " quorum="
+
+        << quorum << "\n";
+
+    pthread_mutex_unlock(&cxnLock);
+
+  }
+
+  else if(verb == "subscribe" || verb == "unsubscribe") {
+
+    admin.setSubscribed(request.client, verb == "subscribe");
+
+    reply << tag << " ok\n";
+
+  }
+
+  else {
+
+    reply << tag << " error unknown command " << verb << " (add, delete, "
+
+        << "peers, stats, ready, subscribe, unsubscribe)\n";
+
+  }
+
+  admin.reply(request.client, reply.str());
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// adminBatchThread
+
+// A static class method that is a thread function for an admin "add", which
+
+// connects the hosts in parallel and then replies with their state
+
+//
+
+// @pre:   *arg parameter represents a valid adminBatchInfo object
+
+// @post:  The reply is queued and *arg is deleted
+
+// @param  *arg:  A void pointer to an adminBatchInfo
+
+//-----------------------------------------------------------------------------
+
+void* UdpRelay::adminBatchThread(void *arg) {
+
+  adminBatchInfo* batchInfo = (adminBatchInfo*)arg;
+
+  UdpRelay* thisUdpRelay = batchInfo->currentRelay;
+
+  pthread_mutex_lock(&thisUdpRelay->ruleLock);
+
+  int timeoutMs = thisUdpRelay->config.getConnectTimeoutMs();
+
+  pthread_mutex_unlock(&thisUdpRelay->ruleLock);
+
+  thisUdpRelay->connectPeers(batchInfo->hosts, timeoutMs);
+
+  stringstream reply;
+
+  int up = 0;
+
+  pthread_mutex_lock(&thisUdpRelay->cxnLock);
+
+  for(size_t i = 0; i < batchInfo->hosts.size(); i++) {
+
+    bool connected = thisUdpRelay->tcpCxns.count(batchInfo->hosts[i]) > 0;
+
+    up += connected ? 1 : 0;
+
+    reply << batchInfo->tag << " peer " << batchInfo->hosts[i] << " state="
+
+        << (connected ? "up" : "down") << "\n";
+
+  }
+
+  pthread_mutex_unlock(&thisUdpRelay->cxnLock);
+
+  reply << batchInfo->tag << " ok connected " << up << " of "
+
+      << batchInfo->hosts.size() << "\n";
+
+  thisUdpRelay->admin.reply(batchInfo->client, reply.str());
+
+  delete batchInfo;
+
+  thisUdpRelay->removeWorker();
+
+  return NULL;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// notifyAdmins
+
+// Sends an event line to the admin clients that subscribed
+
+//
+
+// @pre:   None
+
+// @post:  "* event" is queued for each subscriber
+
+// @param  event: "up NAME", "down NAME" or "ready"
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::notifyAdmins(const string& event) {
+
+  if(adminRunning) {
+
+    admin.publish("* " + event + "\n");
+
+  }
+
+}
+
+
+
+
+
+
+
+//-----------------------------------------------------------------------------
+
+// setMetrics
+
+// Serves Prometheus metrics over HTTP at /metrics on a port
+
+//
+
+// @pre:   None
+
+// @post:  The heartbeat thread (re)opens or closes the port on its next tick,
+
+//         or on start()
+
+// @param  port:    The TCP port, 0 to stop serving
+
+// @param  address: The IP to bind, "" for every interface
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::setMetrics(int port, const string& address) {
+
+  if(port < 0 || port > 65535) {
+
+    cout << "Usage: metrics port [address] | metrics off" << endl;
+
+    return;
+
+  }
+
+  pthread_mutex_lock(&ruleLock);
+
+  metricsPort = port;
+
+  metricsAddress = address;
+
+  metricsGeneration++;
+
+  pthread_mutex_unlock(&ruleLock);
+
+  if(port == 0) {
+
+    cout << "UdpRelay: metrics off" << endl;
+
+  }
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// setUdpLinks
+
+// Opens the UDP link socket on a port and starts the UDP link thread, or
+
+// closes every link and the socket with 0
+
+//
+
+// @pre:   The relay is running
+
+// @post:  With port 0, every link is closed and its queued packets are
+
+//         dropped
+
+// @param  port: UDP port to bind, 0 to close the socket
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::setUdpLinks(int port) {
+
+  if(port < 0 || port > 65535) {
+
+    cout << "Usage: udplink on [port] | udplink off" << endl;
+
+    return;
+
+  }
+
+  if(port != 0 && !running) {
+
+    cout << "UdpRelay: not running" << endl;
+
+    return;
+
+  }
+
+  stopUdpLinks();
+
+  if(port == 0) {
+
+    cout << "UdpRelay: UDP links off" << endl;
+
+    return;
+
+  }
+
+  int sd = socket(AF_INET, SOCK_DGRAM, 0);
+
+  struct sockaddr_in address;
+
+  memset(&address, 0, sizeof(address));
+
+  address.sin_family = AF_INET;
+
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  address.sin_port = htons(port);
+
+  if(sd < 0 || bind(sd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+
+    cout << "UdpRelay: cannot bind UDP port " << port << ": "
+
+        << strerror(errno) << endl;
+
+    if(sd >= 0) {
+
+      close(sd);
+
+    }
+
+    return;
+
+  }
+
+  tunnelRing = addPeerStage("tunnel");
+
+  pthread_mutex_lock(&udpLinkLock);
+
+  udpLinkSd = sd;
+
+  udpLinkPort = port;
+
+  pthread_mutex_unlock(&udpLinkLock);
+
+  udpLinkRunning = true;
+
+  pthread_create(&udpLinkThreadID, NULL, udpLinkThread, (void*)this);
+
+  cout << "UdpRelay: UDP links on port " << port << endl;
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// addUdpLink
+
+// Links to a peer relay's UDP link port
+
+//
+
+// @pre:   None
+
+// @post:  Packets from the local group are queued for the peer, or an error
+
+//         is reported to cout
+
+// @param  hostPort: "host:port" of the peer
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::addUdpLink(const string& hostPort) {
+
+  size_t colon = hostPort.rfind(':');
+
+  if(colon == string::npos) {
+
+    cout << "Usage: udplink add host:port" << endl;
+
+    return;
+
+  }
+
+  if(udpLinkSd == NULL_SD) {
+
+    cout << "UdpRelay: UDP links are off, see udplink on" << endl;
+
+    return;
+
+  }
+
+  struct addrinfo hints;
+
+  memset(&hints, 0, sizeof(hints));
+
+  hints.ai_family = AF_INET;
+
+  hints.ai_socktype = SOCK_DGRAM;
+
+  struct addrinfo* resolved = NULL;
+
+  if(getaddrinfo(hostPort.substr(0, colon).c_str(), NULL, &hints,
+
+      &resolved) != 0) {
+
+    cout << "UdpRelay: cannot resolve " << hostPort.substr(0, colon) << endl;
+
+    return;
+
+  }
+
+  struct sockaddr_in address = *(struct sockaddr_in*)resolved->ai_addr;
+
+  freeaddrinfo(resolved);
+
+  address.sin_port = htons(atoi(hostPort.substr(colon + 1).c_str()));
+
+  string name = udpLinkName(address);
+
+  pthread_mutex_lock(&udpLinkLock);
+
+  if(udpLinks.count(name) > 0) {
+
+    cout << "UdpRelay: already linked to " << name << endl;
+
+  }
+
+  else {
+
+    openUdpLink(name, address);
+
+  }
+
+  pthread_mutex_unlock(&udpLinkLock);
+
+}
+
+
+
+//-----------------------------------------------------------------------------
+
+// removeUdpLink
+
+// Closes the link to a peer, dropping the packets queued for it
+
+//
+
+// @pre:   None
+
+// @post:  udpLinks and egressQueues no longer hold the link
+
+// @param  hostPort: The link name "udp:IP:port", or "IP:port"
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::removeUdpLink(const string& hostPort) {
+
+  string name = hostPort.compare(0, 4, "udp:") == 0 ? hostPort :
+
+      "udp:" + hostPort;
+
+  pthread_mutex_lock(&udpLinkLock);
+
+  map<string, udpLinkPeer*>::iterator found = udpLinks.find(name);
+
+  if(found == udpLinks.end()) {
+
+    pthread_mutex_unlock(&udpLinkLock);
+
+    cout << "No link to that remote group exists." << endl;
+
+    return;
+
+  }
+
+  //The UDP link thread uses the link and pushes to its ring only under
+
+  //udpLinkLock
+
+  found->second->ring->close();
+
+  found->second->link->close();
+
+  udpLinks.erase(found);
+
+  pthread_mutex_unlock(&udpLinkLock);
+
+  stopEgress(name);
+
+  notifyAdmins("down " + name);
+
+  cout << "UdpRelay: deleted " << name << endl;
+
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+
+// setFanout
+
+// Moves the fan-out of packets received from the local group onto a pool of
+
+// worker threads, or back inline with 0
+
+//
+
+// @pre:   None
+
+// @post:  Packets already handed to the old pool are queued; later packets
+
+//         use the new one
+
+// @param  workers: Pool threads, 0 for no pool
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::setFanout(int workers) {
+
+  if(workers < 0) {
+
+    cout << "Usage: fanout workers | fanout auto | fanout off" << endl;
+
+    return;
+
+  }
+
+  pthread_mutex_lock(&cxnLock);
+
+  pthread_mutex_lock(&fanoutLock);
+
+  //Draining the old pool first keeps every peer's packets in order
+
+  flushFanout();
+
+  for(size_t i = 0; i < fanoutShards.size(); i++) {
+
+    fanoutPool->removeStrand(fanoutShards[i]);
+
+  }
+
+  fanoutShards.clear();
+
+  delete fanoutPool;
+
+  fanoutPool = NULL;
+
+  if(workers > 0) {
+
+    fanoutPool = new WorkPool(workers);
+
+    for(int i = 0; i < workers * FANOUT_SHARDS_PER_WORKER; i++) {
+
+      fanoutShards.push_back(fanoutPool->addStrand());
+
+    }
+
+    for(map<string, PacketQueue*>::iterator curQueueIt = egressQueues.begin();
+
+        curQueueIt != egressQueues.end(); curQueueIt++) {
+
+      addFanoutPeer(curQueueIt->first, curQueueIt->second);
+
+    }
+
+  }
+
+  pthread_mutex_unlock(&fanoutLock);
+
+  pthread_mutex_unlock(&cxnLock);
+
+  if(workers > 0) {
+
+    cout << "UdpRelay: fan-out on " << workers << " threads, "
+
+        << workers * FANOUT_SHARDS_PER_WORKER << " shards" << endl;
+
+  } else {
+
+    cout << "UdpRelay: fan-out inline" << endl;
+
+  }
+
+}
+
+
+
+
+
+
+
+//-----------------------------------------------------------------------------
+
+// addCounters
+
+// Creates the counter block for a relay thread
+
+//
+
+// @pre:   Called by the thread that will count with it
+
+// @post:  Scrapes include the block until retireCounters
+
+// @param  direction:      "received" or "sent"
+
+// @param  peer:           The peer, or "local" for the local group
+
+// @returns CounterBlock*: The thread's block
+
+//-----------------------------------------------------------------------------
+
+CounterBlock* UdpRelay::addCounters(const string& direction,
+
+    const string& peer) {
+
+  CounterBlock* counters = new CounterBlock(direction, peer);
+
+  pthread_mutex_lock(&metricsLock);
+
+  counterBlocks.push_back(counters);
+
+  pthread_mutex_unlock(&metricsLock);
+
+  return counters;
+
+}
+
+
+
+
+
+
+
+//-----------------------------------------------------------------------------
+
+// retireCounters
+
+// Folds an exiting thread's counts into the totals kept for its peer, so
+
+// counters do not go back when a link is re-established
+
+//
+
+// @pre:   counters was returned by addCounters
+
+// @post:  counters is deleted
+
+// @param  counters: The exiting thread's block
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::retireCounters(CounterBlock* counters) {
+
+  pthread_mutex_lock(&metricsLock);
+
+  counters->addTo(retiredCounters[make_pair(counters->getDirection(),
+
+      counters->getPeer())]);
+
+  for(size_t i = 0; i < counterBlocks.size(); i++) {
+
+    if(counterBlocks[i] == counters) {
+
+      counterBlocks.erase(counterBlocks.begin() + i);
+
+      break;
+
+    }
+
+  }
+
+  pthread_mutex_unlock(&metricsLock);
+
+  delete counters;
+
+}
+
+
+
+
+
+
+
+//-----------------------------------------------------------------------------
+
+// metricsRenderer
+
+// A static class method that is the MetricsRenderer for the metrics server
+
+//
+
+// @pre:   *context represents a valid UdpRelay object
+
+// @post:  body holds the metrics
+
+// @param  body:     Receives the response body
+
+// @param  *context: A void pointer to the UdpRelay object
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::metricsRenderer(string& body, void* context) {
+
+  ((UdpRelay*)context)->renderMetrics(body);
+
+}
+
+
+
+
+
+
+
+//-----------------------------------------------------------------------------
+
+// renderMetrics
+
+// Writes the metrics in the Prometheus text format. Packet counts come from
+
+// the relay threads' own counter blocks and latency histograms, read while
+
+// they keep counting; queue depths and drops are words the queues keep for
+
+// readers. Everything is copied first, under the locks that keep the queues
+
+// and rings alive, and formatted after those locks are released.
+
+//
+
+// @pre:   None
+
+// @post:  body holds the metrics
+
+// @param  body: Receives the metrics
+
+//-----------------------------------------------------------------------------
+
+void UdpRelay::renderMetrics(string& body) {
+
+  map<pair<string, string>, CounterSnapshot> counts;
+
+  pthread_mutex_lock(&metricsLock);
+
+  counts = retiredCounters;
+
+  for(size_t i = 0; i < counterBlocks.size(); i++) {
+
+    counterBlocks[i]->addTo(counts[make_pair(counterBlocks[i]->getDirection(),
+
+        counterBlocks[i]->getPeer())]);
+
+  }
+
+  pthread_mutex_unlock(&metricsLock);
+
+  //Per-peer gauges, as showTCPConnections reads them
+
+  map<string, peerGauges> gauges;
+
+  pthread_mutex_lock(&cxnLock);
+
+  for(map<string, int>::iterator link = tcpCxns.begin();
+
+      link != tcpCxns.end(); link++) {
+
+    gauges[link->first].up = true;
+
+  }
+
+  for(map<string, managedPeer>::iterator managed = managedPeers.begin();
+
+      managed != managedPeers.end(); managed++) {
+
+    gauges[managed->first].up = tcpCxns.count(managed->first) > 0;
+
+  }
+
+  for(map<string, peerGauges>::iterator gauge = gauges.begin();
+
+      gauge != gauges.end(); gauge++) {
+
+    gauge->second.queued = 0;
+
+    gauge->second.dropped = 0;
+
+    gauge->second.conflated = 0;
+
+    map<string, PacketQueue*>::iterator egress =
+
+        egressQueues.find(gauge->first);
+
+    if(egress != egressQueues.end()) {
+
+      for(int lane = 0; lane < NUM_PRIORITIES; lane++) {
+
+        gauge->second.queued += egress->second->size(lane);
+
+        gauge->second.dropped += egress->second->getDropped(lane);
+
+      }
+
+      gauge->second.conflated = egress->second->getConflated();
+
+    }
+
+    map<string, peerHealth>::iterator peer = peers.find(gauge->first);
+
+    gauge->second.timed = peer != peers.end() && peer->second.rttSamples > 0;
+
+    gauge->second.rttUs = gauge->second.timed ? peer->second.smoothedRttUs : 0;
+
+    gauge->second.jitterUs = gauge->second.timed ? peer->second.jitterUs : 0;
+
+    map<string, managedPeer>::iterator managed =
+
+        managedPeers.find(gauge->first);
+
+    gauge->second.backlog = (managed != managedPeers.end() &&
+
+        managed->second.backlog != NULL) ? managed->second.backlog->size() : 0;
+
+  }
+
+  pthread_mutex_unlock(&cxnLock);
+
+  const char* stages[] = {"local_receive", "remote_receive", "processing",
+
+      "transmit"};
+
+  LatencyHistogram latencies[LATENCY_STAGES];
+
+  readLatency(latencies);
+
+  stringstream metricsOut;
+
+  metricsOut.precision(9);
+
+  metricsOut << "# HELP udprelay_packets_total Packets relayed, by direction "
+
+      << "and peer (\"local\" is the local group).\n"
+
+      << "# TYPE udprelay_packets_total counter\n";
+
+  for(map<pair<string, string>, CounterSnapshot>::iterator count =
+
+      counts.begin(); count != counts.end(); count++) {
+
+    metricsOut << "udprelay_packets_total{direction=\"" << count->first.first
+
+        << "\",peer=\"" << count->first.second << "\"} "
+
+        << count->second.packets << "\n";
+
+  }
+
+  metricsOut << "# HELP udprelay_bytes_total Bytes relayed, by direction and "
+
+      << "peer.\n# TYPE udprelay_bytes_total counter\n";
+
+  for(map<pair<string, string>, CounterSnapshot>::iterator count =
+
+      counts.begin(); count != counts.end(); count++) {
+
+    metricsOut << "udprelay_bytes_total{direction=\"" << count->first.first
+
+        << "\",peer=\"" << count->first.second << "\"} "
+
+        << count->second.bytes << "\n";
+
+  }
+
+  //Per origin group, summed over peers
+
+  map<pair<string, unsigned int>, pair<long long, long long> > groups;
+
+  for(map<pair<string, string>, CounterSnapshot>::iterator count =
+
+      counts.begin(); count != counts.end(); count++) {
+
+    for(map<unsigned int, pair<long long, long long> >::iterator group =
+
+        count->second.groups.begin(); group != count->second.groups.end();
+
+        group++) {
+
+      pair<long long, long long>& total =
+
+          groups[make_pair(count->first.first, group->first)];
+
+      total.first += group->second.first;
+
+      total.second += group->second.second;
+
+    }
+
+  }
+
+  metricsOut << "# HELP udprelay_group_packets_total Packets relayed, by "
+
+      << "direction and origin group.\n"
+
+      << "# TYPE udprelay_group_packets_total counter\n";
+
+  for(map<pair<string, unsigned int>, pair<long long, long long> >::iterator
+
+      group = groups.begin(); group != groups.end(); group++) {
+
+    struct in_addr groupAddr;
+
+    groupAddr.s_addr = htonl(group->first.second);
+
+    metricsOut << "udprelay_group_packets_total{direction=\""
+
+        << group->first.first << "\",group=\""
+
+        << (group->first.second == 0 ? "other" : inet_ntoa(groupAddr))
+
+        << "\"} " << group->second.first << "\n";
+
+  }
+
+  metricsOut << "# HELP udprelay_group_bytes_total Bytes relayed, by "
+
+      << "direction and origin group.\n"
+
+      << "# TYPE udprelay_group_bytes_total counter\n";
+
+  for(map<pair<string, unsigned int>, pair<long long, long long> >::iterator
+
+      group = groups.begin(); group != groups.end(); group++) {
+
+    struct in_addr groupAddr;
+
+    groupAddr.s_addr = htonl(group->first.second);
+
+    metricsOut << "udprelay_group_bytes_total{direction=\""
+
+        << group->first.first << "\",group=\""
+
+        << (group->first.second == 0 ? "other" : inet_ntoa(groupAddr))
+
+        << "\"} " << group->second.second << "\n";
+
+  }
+
+  metricsOut << "# HELP udprelay_peer_up Whether the link to a peer is up.\n"
+
+      << "# TYPE udprelay_peer_up gauge\n";
+
+  for(map<string, peerGauges>::iterator gauge = gauges.begin();
+
+      gauge != gauges.end(); gauge++) {
+
+    metricsOut << "udprelay_peer_up{peer=\"" << gauge->first << "\"} "
+
+        << (gauge->second.up ? 1 : 0) << "\n";
+
+  }
+
+  metricsOut << "# HELP udprelay_peer_queued_packets Packets waiting in a "
+
+      << "peer's egress queue.\n# TYPE udprelay_peer_queued_packets gauge\n";
+
+  for(map<string, peerGauges>::iterator gauge = gauges.begin();
+
+      gauge != gauges.end(); gauge++) {
+
+    metricsOut << "udprelay_peer_queued_packets{peer=\"" << gauge->first
+
+        << "\"} " << gauge->second.queued << "\n";
+
+  }
+
+  metricsOut << "# HELP udprelay_peer_dropped_packets_total Packets dropped "
+
+      << "from a peer's full egress queue.\n"
+
+      << "# TYPE udprelay_peer_dropped_packets_total counter\n";
+
+  for(map<string, peerGauges>::iterator gauge = gauges.begin();
+
+      gauge != gauges.end(); gauge++) {
+
+    metricsOut << "udprelay_peer_dropped_packets_total{peer=\""
+
+        << gauge->first << "\"} " << gauge->second.dropped << "\n";
+
+  }
+
+  metricsOut << "# HELP udprelay_peer_conflated_packets_total Packets in a "
+
+      << "peer's egress queue replaced by a newer one with the same key.\n"
+
+      << "# TYPE udprelay_peer_conflated_packets_total counter\n";
+
+  for(map<string, peerGauges>::iterator gauge = gauges.begin();
+
+      gauge != gauges.end(); gauge++) {
+
+    metricsOut << "udprelay_peer_conflated_packets_total{peer=\""
+
+        << gauge->first << "\"} " << gauge->second.conflated << "\n";
+
+  }
+
+  metricsOut << "# HELP udprelay_peer_backlog_packets Packets held for a "
+
+      << "peer that is down.\n# TYPE udprelay_peer_backlog_packets gauge\n";
+
+  for(map<string, peerGauges>::iterator gauge = gauges.begin();
+
+      gauge != gauges.end(); gauge++) {
+
+    metricsOut << "udprelay_peer_backlog_packets{peer=\"" << gauge->first
+
+        << "\"} " << gauge->second.backlog << "\n";
+
+  }
+
+  metricsOut << "# HELP udprelay_peer_rtt_seconds Smoothed heartbeat round "
+
+      << "trip time.\n# TYPE udprelay_peer_rtt_seconds gauge\n";
+
+  for(map<string, peerGauges>::iterator gauge = gauges.begin();
+
+      gauge != gauges.end(); gauge++) {
+
+    if(gauge->second.timed) {
+
+      metricsOut << "udprelay_peer_rtt_seconds{peer=\"" << gauge->first
+
+          << "\"} " << gauge->second.rttUs / 1000000 << "\n";
+
+    }
+
+  }
+
+  metricsOut << "# HELP udprelay_peer_jitter_seconds Mean deviation of the "
+
+      << "round trip time.\n# TYPE udprelay_peer_jitter_seconds gauge\n";
+
+  for(map<string, peerGauges>::iterator gauge = gauges.begin();
+
+      gauge != gauges.end(); gauge++) {
+
+    if(gauge->second.timed) {
+
+      metricsOut << "udprelay_peer_jitter_seconds{peer=\"" << gauge->first
+
+          << "\"} " << gauge->second.jitterUs / 1000000 << "\n";
+
+    }
+
+  }
+
+  metricsOut << "# HELP udprelay_rebroadcast_queued_packets Packets waiting "
+
+      << "to be sent to the local group.\n"
+
+      << "# TYPE udprelay_rebroadcast_queued_packets gauge\n"
+
+      << "udprelay_rebroadcast_queued_packets " << rebroadcastQueue->size()
+
+      << "\n# HELP udprelay_ready Whether the config file's quorum of peers "
+
+      << "is connected.\n# TYPE udprelay_ready gauge\n"
+
+      << "udprelay_ready " << (ready ? 1 : 0) << "\n";
+
+  //Stage rings: local is relayIn to the local stage, a peer's is its
+
+  //relayOut thread to the remote stage. The remote stage deletes closed
+
+  //rings under stageLock, so their gauges are copied under it.
+
+  vector<SpscRing*> stageRings(1, ingestRing);
+
+  vector<ringGauges> rings(1);
+
+  pthread_mutex_lock(&stageLock);
+
+  for(size_t i = 0; i < peerStages.size(); i++) {
+
+    stageRings.push_back(peerStages[i]->ring);
+
+    rings.push_back(ringGauges());
+
+    rings.back().peer = peerStages[i]->name;
+
+  }
+
+  for(size_t i = 0; i < rings.size(); i++) {
+
+    rings[i].packets = stageRings[i]->getPackets();
+
+    rings[i].used = stageRings[i]->getUsed();
+
+    rings[i].capacity = stageRings[i]->getCapacity();
+
+    rings[i].highWater = stageRings[i]->getHighWater();
+
+    rings[i].stalls = stageRings[i]->getStalls();
+
+  }
+
+  pthread_mutex_unlock(&stageLock);
+
+  vector<string> labels(1, "stage=\"local\"");
+
+  for(size_t i = 1; i < rings.size(); i++) {
+
+    labels.push_back("stage=\"remote\",peer=\"" + rings[i].peer + "\"");
+
+  }
+
+  metricsOut << "# HELP udprelay_stage_ring_packets Packets waiting between "
+
+      << "two relay stages.\n# TYPE udprelay_stage_ring_packets gauge\n";
+
+  for(size_t i = 0; i < rings.size(); i++) {
+
+    metricsOut << "udprelay_stage_ring_packets{" << labels[i] << "} "
+
+        << rings[i].packets << "\n";
+
+  }
+
+  metricsOut << "# HELP udprelay_stage_ring_bytes Bytes held by a stage "
+
+      << "ring.\n# TYPE udprelay_stage_ring_bytes gauge\n";
+
+  for(size_t i = 0; i < rings.size(); i++) {
+
+    metricsOut << "udprelay_stage_ring_bytes{" << labels[i] << "} "
+
+        << rings[i].used << "\n";
+
+  }
+
+  metricsOut << "# HELP udprelay_stage_ring_capacity_bytes Size of a stage "
+
+      << "ring.\n# TYPE udprelay_stage_ring_capacity_bytes gauge\n";
+
+  for(size_t i = 0; i < rings.size(); i++) {
+
+    metricsOut << "udprelay_stage_ring_capacity_bytes{" << labels[i]
+
+        << "} " << rings[i].capacity << "\n";
+
+  }
+
+  metricsOut << "# HELP udprelay_stage_ring_high_water_bytes Most bytes a "
+
+      << "stage ring has held.\n"
+
+      << "# TYPE udprelay_stage_ring_high_water_bytes gauge\n";
+
+  for(size_t i = 0; i < rings.size(); i++) {
+
+    metricsOut << "udprelay_stage_ring_high_water_bytes{" << labels[i]
+
+        << "} " << rings[i].highWater << "\n";
+
+  }
+
+  metricsOut << "# HELP udprelay_stage_ring_full_total Pushes that found a "
+
+      << "stage ring full and made the stage before it wait.\n"
+
+      << "# TYPE udprelay_stage_ring_full_total counter\n";
+
+  for(size_t i = 0; i < rings.size(); i++) {
+
+    metricsOut << "udprelay_stage_ring_full_total{" << labels[i] << "} "
+
+        << rings[i].stalls << "\n";
+
+  }
+
+  pthread_mutex_lock(&fanoutLock);
+
+  bool pooled = fanoutPool != NULL;
+
+  long long fanoutTasks = pooled ? fanoutPool->getTasks() : 0;
+
+  long long fanoutSteals = pooled ? fanoutPool->getSteals() : 0;
+
+  pthread_mutex_unlock(&fanoutLock);
+
+  if(pooled) {
+
+    metricsOut << "# HELP udprelay_fanout_tasks_total Shard tasks run by the "
+
+        << "fan-out pool.\n# TYPE udprelay_fanout_tasks_total counter\n"
+
+        << "udprelay_fanout_tasks_total " << fanoutTasks
+
+        << "\n# HELP udprelay_fanout_steals_total Shards a fan-out worker "
+
+        << "took from another.\n# TYPE udprelay_fanout_steals_total counter\n"
+
+        << "udprelay_fanout_steals_total " << fanoutSteals << "\n";
+
+  }
+
+  //UDP links, copied so udpLinkLock is not held while writing
+
+  map<string, UdpLinkStats> linkStats;
+
+  pthread_mutex_lock(&udpLinkLock);
+
+  for(map<string, udpLinkPeer*>::iterator curLinkIt = udpLinks.begin();
+
+      curLinkIt != udpLinks.end(); curLinkIt++) {
+
+    linkStats[curLinkIt->first] = curLinkIt->second->link->getStats();
+
+  }
+
+  pthread_mutex_unlock(&udpLinkLock);
+
+  metricsOut << "# HELP udprelay_hop_limit_dropped_packets_total Packets "
+
+      << "dropped because their hop list was full or their TTL ran out.\n"
+
+      << "# TYPE udprelay_hop_limit_dropped_packets_total counter\n"
+
+      << "udprelay_hop_limit_dropped_packets_total " << hopLimited << "\n";
+
+  metricsOut << "# HELP udprelay_node_id_collisions_total Node IDs found "
+
+      << "claimed by two relays.\n"
+
+      << "# TYPE udprelay_node_id_collisions_total counter\n"
+
+      << "udprelay_node_id_collisions_total " << nodeCollisions << "\n";
+
+  metricsOut << "# HELP udprelay_tunnel_sent_total Tunnel datagrams handed "
+
+      << "to the socket.\n# TYPE udprelay_tunnel_sent_total counter\n"
+
+      << "udprelay_tunnel_sent_total " << tunnel.getSent()
+
+      << "\n# HELP udprelay_tunnel_send_failed_total Tunnel datagrams the "
+
+      << "socket did not take.\n"
+
+      << "# TYPE udprelay_tunnel_send_failed_total counter\n"
+
+      << "udprelay_tunnel_send_failed_total " << tunnel.getFailed() << "\n";
+
+  vector<pair<string, UdpTunnelSource> > sources;
+
+  tunnel.getSources(sources);
+
+  if(!sources.empty()) {
+
+    const char* TUNNEL_COUNTS[5] = {"received", "lost", "late", "duplicate",
+
+        "dropped"};
+
+    const char* TUNNEL_HELP[5] = {"Tunnel datagrams that arrived",
+
+        "Tunnel packets skipped and not filled in later",
+
+        "Tunnel datagrams older than one already received",
+
+        "Tunnel datagrams whose sequence already arrived",
+
+        "Late or duplicate tunnel datagrams dropped in ordered mode"};
+
+    for(int kind = 0; kind < 5; kind++) {
+
+      metricsOut << "# HELP udprelay_tunnel_" << TUNNEL_COUNTS[kind]
+
+          << "_total " << TUNNEL_HELP[kind] << ", by sender and origin "
+
+          << "group.\n# TYPE udprelay_tunnel_" << TUNNEL_COUNTS[kind]
+
+          << "_total counter\n";
+
+      for(size_t i = 0; i < sources.size(); i++) {
+
+        const UdpTunnelSource& counts = sources[i].second;
+
+        long long value = kind == 0 ? counts.received : kind == 1 ?
+
+            counts.lost : kind == 2 ? counts.late : kind == 3 ?
+
+            counts.duplicates : counts.dropped;
+
+        size_t space = sources[i].first.find(' ');
+
+        metricsOut << "udprelay_tunnel_" << TUNNEL_COUNTS[kind]
+
+            << "_total{sender=\"" << sources[i].first.substr(0, space)
+
+            << "\",group=\"" << sources[i].first.substr(space + 1) << "\"} "
+
+            << value << "\n";
+
+      }
+
+    }
+
+  }
+
+  vector<pair<string, RedundantPathStats> > redundantPaths;
+
+  redundancy.getPaths(redundantPaths);
+
+  if(!redundantPaths.empty()) {
+
+    metricsOut << "# HELP udprelay_redundant_copies_total Copies of redundant "
+
+        << "messages by the link and sender's path they came over: won "
+
+        << "(first, relayed) or lost (dropped).\n"
+
+        << "# TYPE udprelay_redundant_copies_total counter\n";
+
+    for(size_t i = 0; i < redundantPaths.size(); i++) {
+
+      const string& name = redundantPaths[i].first;
+
+      size_t split = name.rfind(" path ");
+
+      string labels = "{peer=\"" + name.substr(0, split) + "\",path=\"" +
+
+          name.substr(split + 6) + "\",result=\"";
+
+      metricsOut << "udprelay_redundant_copies_total" << labels << "won\"} "
+
+          << redundantPaths[i].second.wins
+
+          << "\nudprelay_redundant_copies_total" << labels << "lost\"} "
+
+          << redundantPaths[i].second.duplicates << "\n";
+
+    }
+
+    metricsOut << "# HELP udprelay_redundant_lag_seconds_total Time lost "
+
+        << "copies arrived after the winning copy.\n"
+
+        << "# TYPE udprelay_redundant_lag_seconds_total counter\n";
+
+    for(size_t i = 0; i < redundantPaths.size(); i++) {
+
+      const string& name = redundantPaths[i].first;
+
+      size_t split = name.rfind(" path ");
+
+      metricsOut << "udprelay_redundant_lag_seconds_total{peer=\""
+
+          << name.substr(0, split) << "\",path=\"" << name.substr(split + 6)
+
+          << "\"} " << redundantPaths[i].second.lagUs / 1000000.0 << "\n";
+
+    }
+
+  }
+
+  if(!linkStats.empty()) {
+
+    metricsOut << "# HELP udprelay_udplink_frames_total Frames on a UDP "
+
+        << "link: sent, retransmitted, received, duplicate or delivered.\n"
+
+        << "# TYPE udprelay_udplink_frames_total counter\n";
+
+    for(map<string, UdpLinkStats>::iterator link = linkStats.begin();
+
+        link != linkStats.end(); link++) {
+
+      string peer = "{peer=\"" + link->first + "\",kind=\"";
+
+      metricsOut << "udprelay_udplink_frames_total" << peer << "sent\"} "
+
+          << link->second.sent << "\nudprelay_udplink_frames_total" << peer
+
+          << "retransmitted\"} " << link->second.retransmitted
+
+          << "\nudprelay_udplink_frames_total" << peer << "received\"} "
+
+          << link->second.received << "\nudprelay_udplink_frames_total"
+
+          << peer << "duplicate\"} " << link->second.duplicates
+
+          << "\nudprelay_udplink_frames_total" << peer << "delivered\"} "
+
+          << link->second.delivered << "\n";
+
+    }
+
+    metricsOut << "# HELP udprelay_udplink_in_flight_frames Frames sent on "
+
+        << "a UDP link and not yet acknowledged.\n"
+
+        << "# TYPE udprelay_udplink_in_flight_frames gauge\n";
+
+    for(map<string, UdpLinkStats>::iterator link = linkStats.begin();
+
+        link != linkStats.end(); link++) {
+
+      metricsOut << "udprelay_udplink_in_flight_frames{peer=\"" << link->first
+
+          << "\"} " << link->second.inFlight << "\n";
+
+    }
+
+    metricsOut << "# HELP udprelay_udplink_waiting_frames Frames queued on a "
+
+        << "UDP link behind their stream's window.\n"
+
+        << "# TYPE udprelay_udplink_waiting_frames gauge\n";
+
+    for(map<string, UdpLinkStats>::iterator link = linkStats.begin();
+
+        link != linkStats.end(); link++) {
+
+      metricsOut << "udprelay_udplink_waiting_frames{peer=\"" << link->first
+
+          << "\"} " << link->second.waiting << "\n";
+
+    }
+
+    metricsOut << "# HELP udprelay_udplink_cwnd_frames Congestion window of "
+
+        << "a UDP link.\n# TYPE udprelay_udplink_cwnd_frames gauge\n";
+
+    for(map<string, UdpLinkStats>::iterator link = linkStats.begin();
+
+        link != linkStats.end(); link++) {
+
+      metricsOut << "udprelay_udplink_cwnd_frames{peer=\"" << link->first
+
+          << "\"} " << link->second.cwnd << "\n";
 
-		while(!expiredOutThreads.empty()) {
+    }
 
-		  pthread_join(expiredOutThreads.front(), NULL);
+    metricsOut << "# HELP udprelay_udplink_rtt_seconds Smoothed round trip "
+
+        << "time of a UDP link.\n# TYPE udprelay_udplink_rtt_seconds gauge\n";
+
+    for(map<string, UdpLinkStats>::iterator link = linkStats.begin();
+
+        link != linkStats.end(); link++) {
+
+      if(link->second.srttUs > 0) {
+
+        metricsOut << "udprelay_udplink_rtt_seconds{peer=\"" << link->first
+
+            << "\"} " << link->second.srttUs / 1000000.0 << "\n";
+
+      }
+
+    }
 
-		  expiredOutThreads.pop();
-		}
-	  }
-	  outThreads.erase(sd);
-	}*/
-	
-		//keep track of the connection list and the working thread list
-		/*udpRelayOutConnections.insert(pair<string,int>ipAddr, sd);----------------------------------------------------
-		workingThreads.insert(pair<int,pthread_t>(sd,sd));
-		udpRelayOutConnections[ipAddr] = sd;*/
-    outThreads.insert(pair<int,pthread_t>(sd,sd));
-		tcpCxns.insert(pair<string,int>(ipString, sd));
-    
-		
-		//int pthreadCreation = pthread_create(workingThreads[sd], NULL, relayOutThread, (void*)para);--------------------------
-		int pthreadCreation = pthread_create(&outThreads[sd], NULL, relayOutThread, (void*)para);
-		if(pthreadCreation != 0)
-		{
-			cerr<<"Thread creation failed!"<<endl;
-			exit(EXIT_FAILURE);
-		}
   }
-}
-/*void * UdpRelay::acceptThread(void* arg) {
 
-  UdpRelay * sourceRelay = (UdpRelay*)arg;
+  metricsOut << "# HELP udprelay_latency_seconds Latency of each stage, "
 
-  sourceRelay->createUdpRelayServerConnection();
+      << "while timestamping is on.\n"
 
-}*/
+      << "# TYPE udprelay_latency_seconds histogram\n";
 
+  for(int i = 0; i < LATENCY_STAGES; i++) {
 
+    long long cumulative = 0;
 
-//-----------------------------------------------------------------------------
+    for(int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
 
-// isDuplicatePacket
+      cumulative += latencies[i].bucketCount(bucket);
 
-// Checks the header of the packet and returns true if the local group IP is
+      metricsOut << "udprelay_latency_seconds_bucket{stage=\"" << stages[i]
 
-// already contained in the header (a duplicate message), false otherwise
+          << "\",le=\"" << LatencyHistogram::bucketBound(bucket) / 1000000.0
 
-//
+          << "\"} " << cumulative << "\n";
 
-// @pre:   currentPacket parameter is of the correct packet format
+    }
 
-// @post:  None
+    metricsOut << "udprelay_latency_seconds_bucket{stage=\"" << stages[i]
 
-// @param  currentPacket: The packet received via UDP or TCP
+        << "\",le=\"+Inf\"} " << latencies[i].count() << "\n"
+
+        << "udprelay_latency_seconds_sum{stage=\"" << stages[i] << "\"} "
+
+        << latencies[i].sum() / 1000000.0 << "\n"
+
+        << "udprelay_latency_seconds_count{stage=\"" << stages[i] << "\"} "
+
+        << latencies[i].count() << "\n";
+
+  }
+
+  body = metricsOut.str();
+
+}
 
-// @returns bool:         True if the current UdpRelay's IP is contained in
 
-//                        the packet header, false otherwise
 
 //-----------------------------------------------------------------------------
 
-bool UdpRelay::isDuplicatePacket(char* currentPacket) {
+// getBloomMask
 
-  int hop = currentPacket[3];
+// Returns this relay's filter bits for the geometry of a version 3 packet
 
-  int counter = 0;
+//
 
+// @pre:   getVersion(packet) == 3
 
+// @post:  None
 
-  for (int i = 1; i <= hop; i++) {
+// @param  self:    The identity read for this packet
 
-    int ipReadIn = 0;
+// @param  packet:  The packet to check or add to
 
-    counter = 0;
+// @param  scratch: MAX_BLOOM_WORDS words used if the packet's geometry
 
-    for (int j = (4 * i); j < (4 * (i + 1)); j++) {
+//                  differs from this relay's
 
-      if (currentPacket[j] == ipChars[counter]) {
+// @returns unsigned long long*: The mask
 
-        ipReadIn++;
+//-----------------------------------------------------------------------------
 
-      }
+const unsigned long long* UdpRelay::getBloomMask(const nodeIdentity* self,
 
-      counter++;
+    const char* packet, unsigned long long* scratch) {
 
-    }
+  int words = PacketHeader::getBloomWords(packet);
 
-    if (ipReadIn == 4) {
+  int hashes = PacketHeader::getBloomHashes(packet);
 
-      return true;
+  if(words == self->bloomWords && hashes == self->bloomHashes) {
 
-    }
+    return self->bloomMask;
 
   }
 
-  return false;
+  PacketHeader::bloomMask(self->nodeId, words, hashes, scratch);
+
+  return scratch;
 
 }
 
@@ -817,39 +13945,47 @@ bool UdpRelay::isDuplicatePacket(char* currentPacket) {
 
 //-----------------------------------------------------------------------------
 
-// setIpChars
+// publishIdentity
 
-// Takes the group IP number of format (2XX.255.255.255) and puts each set of
+// Makes a new node ID and filter geometry current, with the ID's filter bits
 
-// three numbers into a single char value before storing them in ipChars[]
+// worked out once
 
 //
 
-// @pre:   ipNumber is of valid format and ipChars is instantiated
+// @pre:   nodeLock is held, or the relay is being constructed
 
-// @post:  ipChars[] array contains the 4-char version of the group IP
+// @post:  identity points at the new identity; the old one stays readable
+
+//         until the relay is destroyed
+
+// @param  node:   This relay's node ID
+
+// @param  words:  Filter size in BLOOM_WORD_SIZE words
+
+// @param  hashes: Bits per node ID in the filter
 
 //-----------------------------------------------------------------------------
 
-void UdpRelay::setIpChars() {
+void UdpRelay::publishIdentity(unsigned short node, int words, int hashes) {
 
-  stringstream ss;
+  nodeIdentity* next = new nodeIdentity;
 
-  int currentNumber = 0;
+  next->nodeId = node;
 
-  for (int i = 0; i < 4; i++) {
+  next->bloomWords = words;
 
-    ss << ipNumber + (i * 4);
+  next->bloomHashes = hashes;
 
-    ss >> currentNumber;
+  PacketHeader::bloomMask(node, words, hashes, next->bloomMask);
 
-    ipChars[i] = currentNumber;
+  //Forwarding threads may still hold the old one
 
-    ss.clear();
+  identities.push_back(next);
 
-    ss.str(string());
+  __sync_synchronize();
 
-  }
+  identity = next;
 
 }
 
@@ -857,37 +13993,39 @@ void UdpRelay::setIpChars() {
 
 //-----------------------------------------------------------------------------
 
-// putIPIntoPacket
-
-// Takes a char* packet passed as parameter and adds group IP address of the
+// nodeForAddress
 
-// current UdpRelay node into the header in the format of a single byte for
+// Returns the node ID bound to a group address at handshake, or the low 16
 
-// each 3-digit portion of the IP, then increments the "hop" number
+// bits of the address, which is how node IDs are assigned by default
 
 //
 
-// @pre:   currentPacket has valid packet format
+// @pre:   None
 
 // @post:  None
 
-// @param  currentPacket: A packet in valid format described in UdpRelay header
+// @param  address:         A group IP, packed
+
+// @returns unsigned short: The node ID
 
 //-----------------------------------------------------------------------------
 
-void UdpRelay::putIPIntoPacket(char* currentPacket) {
+unsigned short UdpRelay::nodeForAddress(unsigned int address) {
+
+  pthread_mutex_lock(&nodeLock);
 
-  int offset = 4 + (currentPacket[3] * 4);
+  map<unsigned int, unsigned short>::iterator bound =
 
-  char tempMessage[SIZE] = {0};
+      addressNodes.find(address);
 
-  memcpy(tempMessage, currentPacket + offset, SIZE - offset);
+  unsigned short node = (bound != addressNodes.end()) ? bound->second :
 
-  memcpy(currentPacket + offset, ipChars, 4);
+      (unsigned short)(address & 0xFFFF);
 
-  memcpy(currentPacket + offset + 4, tempMessage, SIZE - offset - 4);
+  pthread_mutex_unlock(&nodeLock);
 
-  currentPacket[3] += 1;
+  return node;
 
 }
 
@@ -895,224 +14033,298 @@ void UdpRelay::putIPIntoPacket(char* currentPacket) {
 
 //-----------------------------------------------------------------------------
 
-// relayOutThread
-
-// A static class method that is a thread function for the relayOut thread,
+// addressForNode
 
-// which spins up when a TCP connection is established. Receives messages via
+// Returns the group address bound to a node ID at handshake, or the address
 
-// TCP connection and broadcasts them using UDP, if not a duplicate message
+// in this relay's /16 that would default to the ID
 
 //
 
-// @pre:   *arg parameter represents a valid outThreadInfo struct
+// @pre:   None
 
-// @post:  Removes the connection from the map when the thread terminates
+// @post:  None
 
-// @param  *arg:  Pointer to the outThreadInfo struct with socket and UdpRelay
+// @param  node:      A node ID
+
+// @returns unsigned: The group IP, packed
 
 //-----------------------------------------------------------------------------
 
-void* UdpRelay::relayOutThread(void *arg) {
+unsigned int UdpRelay::addressForNode(unsigned int node) {
 
-  outThreadInfo *outInfo = (outThreadInfo*)arg;
+  pthread_mutex_lock(&nodeLock);
 
-  UdpRelay* thisUdpRelay = outInfo->currentRelay;
+  map<unsigned short, unsigned int>::iterator bound =
 
-  int sd = outInfo->socketNumber;
+      nodeAddresses.find(node);
 
-  string remoteName = outInfo->remoteHostName;
+  unsigned int address = (bound != nodeAddresses.end()) ? bound->second :
 
-  delete (outThreadInfo*)arg;
+      (groupAddress & 0xFFFF0000) | (node & 0xFFFF);
 
-  char outPacket[SIZE] = {0};
+  pthread_mutex_unlock(&nodeLock);
 
-  char outMsg[SIZE] = {0};
+  return address;
 
-  while(true) {
+}
 
-    if(recv(sd, outPacket, SIZE, 0) <= 0) {
 
-      break;
 
-    }
+//-----------------------------------------------------------------------------
 
-    if(!thisUdpRelay->isDuplicatePacket(outPacket)) {
+// convertHeader
 
-      int hop = outPacket[3];
+// Copies a packet into the given header version. Going to version 1, the
 
-      int offset = 4 + (hop * 4);
+// oldest hops are left out if the hop list would not fit otherwise. Going
 
-      memcpy(outMsg, outPacket + offset, SIZE - offset);
+// from version 3, the hop list is rebuilt from the origin, the relays this
 
-      cout << "UdpRelay: received " << strlen(outPacket) << " bytes from "
+// relay knows that are in the filter, and this relay.
 
-          << remoteName << " = " << outMsg << endl;
+//
 
-      thisUdpRelay->putIPIntoPacket(outPacket);
+// @pre:   packet has valid packet format; out is MAX_PACKET_SIZE bytes
 
-      thisUdpRelay->sendLocalMessage(outPacket);
+// @post:  out holds the packet in version if true is returned
 
-      cout << "UdpRelay: broadcast buf[" << strlen(outPacket) << "] to "
+// @param  packet:  The packet to convert
 
-          << thisUdpRelay->getIPNumber() << ":" << PORT_NUM << endl;
+// @param  out:     Receives the converted packet
 
-    }
+// @param  version: 1, 2 or 3
 
-  }
+// @returns bool:   False if the message does not fit
+
+//-----------------------------------------------------------------------------
 
-  if(thisUdpRelay->tcpCxns.count(remoteName) > 0) {
+bool UdpRelay::convertHeader(const char* packet, char* out, int version) {
 
-    thisUdpRelay->tcpCxns.erase(thisUdpRelay->tcpCxns.find(remoteName));
+  int from = PacketHeader::getVersion(packet);
+
+  if(from == 3 && version == 3) {
+
+    memcpy(out, packet, PacketHeader::getLength(packet, MAX_PACKET_SIZE));
+
+    return true;
 
   }
 
-  thisUdpRelay->addExpiredOutThread(sd);
+  if(from == 3) {
 
-}
+    return convertFromBloom(packet, out, version);
 
+  }
 
+  int hops = PacketHeader::getHopCount(packet);
 
-//-----------------------------------------------------------------------------
+  unsigned int translated[MAX_HOPS_V2];
 
-// tcpMulticastToRemoteGroups
+  for(int i = 0; i < hops; i++) {
 
-// Sends a message via TCP to all remote nodes connected to this UdpRelay node,
+    unsigned int hop = PacketHeader::getHop(packet, i);
 
-// and informs the user what message was sent and how many bytes
+    if(from == version) {
 
-//
+      translated[i] = hop;
 
-// @pre:   outPacket has valid packet format
+    }
 
-// @post:  None
+    else if(version == 2) {
 
-// @param  outPacket: A packet received via UDP to be sent out via TCP
+      translated[i] = nodeForAddress(hop);
 
-//-----------------------------------------------------------------------------
+    }
 
-void UdpRelay::tcpMultiCastToRemoteGroups(char* outPacket) {
+    else {
 
-  char outMsg[SIZE];
+      translated[i] = addressForNode(hop);
 
-  int hop = outPacket[3];
+    }
 
-  int offset = 4 + (hop * 4);
+  }
 
-  memcpy(outMsg, outPacket + offset, SIZE - offset);
+  if(version == 3) {
 
+    const nodeIdentity* self = identity;
 
+    return PacketHeader::toBloom(packet, out, MAX_PACKET_SIZE,
 
-  for(map<string, int>::iterator curSdIt = tcpCxns.begin();
+        self->bloomWords, self->bloomHashes, bloomTtl, translated);
 
-      curSdIt != tcpCxns.end(); curSdIt++) {
+  }
 
-    if(send(curSdIt->second, outPacket, SIZE, 0) <= 0) {
+  int dropOldest = (version == 1 && hops > MAX_HOPS) ? hops - MAX_HOPS : 0;
 
-      close(curSdIt->second);
+  while(!PacketHeader::convert(packet, out, MAX_PACKET_SIZE, version,
 
-      tcpCxns.erase(curSdIt->first);
+      translated, dropOldest)) {
 
-    }
+    if(version == 2 || dropOldest >= hops) {
+
+      return false;
 
-    cout << "UdpRelay: relay " << outMsg << " to remoteGroup["
+    }
 
-        << curSdIt->first << "]" << endl;
+    dropOldest++;
 
   }
 
+  return true;
+
 }
 
 
 
 //-----------------------------------------------------------------------------
 
-// terminateRemoteCxn
+// convertFromBloom
 
-// Closes the socket to the remote node IP/name passed as parameter, then
+// Writes a version 3 packet as version 1 or 2. Since the filter cannot be
 
-// deletes that connection from the map
+// listed, the hop list holds the origin, every relay bound at handshake whose
+
+// bits are in the filter, and this relay last. The next relay is one of the
+
+// bound ones, so it still finds itself if the packet loops back to it.
 
 //
 
-// @pre:   remoteGroupID is a valid group IP/name and map contains that group
+// @pre:   getVersion(packet) == 3; out is MAX_PACKET_SIZE bytes
 
-// @post:  tcpCxns map is updated with group IP/name entry removed
+// @post:  out holds the packet in version if true is returned
 
-// @param  remoteGroupID: A valid group IP/Name
+// @param  packet:  The packet to convert
+
+// @param  out:     Receives the converted packet
+
+// @param  version: 1 or 2
+
+// @returns bool:   False if the message does not fit
 
 //-----------------------------------------------------------------------------
 
-void UdpRelay::terminateRemoteCxn(string remoteGroupID) {
+bool UdpRelay::convertFromBloom(const char* packet, char* out, int version) {
 
-  char* remoteSocket = new char[remoteGroupID.length() + 1];
+  int limit = version == 2 ? MAX_HOPS_V2 : MAX_HOPS;
 
- strcpy(remoteSocket, remoteGroupID.c_str());
+  int words = PacketHeader::getBloomWords(packet);
 
-  if(tcpCxns.count(remoteSocket) != 0) {
+  int hashes = PacketHeader::getBloomHashes(packet);
 
-    shutdown(tcpCxns[remoteSocket], SHUT_RDWR);
+  unsigned short origin = PacketHeader::getBloomOrigin(packet);
 
-    if(expiredOutThreads.size() > 5) {
+  unsigned short self = identity->nodeId;
 
-      while(!expiredOutThreads.empty()) {
+  unsigned int nodes[MAX_HOPS_V2];
 
-        pthread_join(expiredOutThreads.front(), NULL);
+  int count = 0;
 
-        expiredOutThreads.pop();
+  if(PacketHeader::getHopCount(packet) > 0) {
 
-      }
+    nodes[count++] = origin;
+
+  }
+
+  pthread_mutex_lock(&nodeLock);
+
+  for(map<unsigned short, unsigned int>::iterator known =
+
+      nodeAddresses.begin(); known != nodeAddresses.end() &&
+
+      count < limit - 1; known++) {
+
+    if(known->first == origin || known->first == self) {
+
+      continue;
 
     }
 
-    if(tcpCxns.count(remoteSocket) > 0) {
+    unsigned long long mask[MAX_BLOOM_WORDS];
 
-      tcpCxns.erase(tcpCxns.find(remoteSocket));
+    PacketHeader::bloomMask(known->first, words, hashes, mask);
 
-      cout << "UdpRelay: deleted " << remoteGroupID << endl;
+    if(PacketHeader::bloomContains(packet, mask)) {
+
+      nodes[count++] = known->first;
 
     }
 
   }
 
-  else {
+  pthread_mutex_unlock(&nodeLock);
 
-    cout << "No connection to that remote group exists." << endl;
+  if(count == 0 || origin != self) {
+
+    nodes[count++] = self;
+
+  }
+
+  if(version == 1) {
+
+    for(int i = 0; i < count; i++) {
+
+      nodes[i] = addressForNode(nodes[i]);
+
+    }
 
   }
 
+  return PacketHeader::fromBloom(packet, out, MAX_PACKET_SIZE, version, nodes,
+
+      count);
+
 }
 
 
 
 //-----------------------------------------------------------------------------
 
-// terminateAllTcpConnections
+// getOriginGroup
 
-// Closes all open TCP sockets and removes the connection entries from both
+// Returns the group IP of the relay that first saw a packet, in either header
 
-// tcpCxns and outThreadCxns maps
+// version
 
 //
 
-// @pre:   None
+// @pre:   packet has valid packet format
 
-// @post:  Sockets are closed and both maps have all entries deleted
+// @post:  None
+
+// @param  packet:    The packet to inspect
+
+// @returns unsigned: The origin group IP packed as by inet_addr in host byte
+
+//                    order, or 0 if the hop list is empty
 
 //-----------------------------------------------------------------------------
 
-void UdpRelay::terminateAllTcpConnections() {
+unsigned int UdpRelay::getOriginGroup(const char* packet) {
 
-  for(map<string, int>::iterator curSdIt = tcpCxns.begin();
+  int version = PacketHeader::getVersion(packet);
 
-      curSdIt != tcpCxns.end(); curSdIt++) {
+  if(version == 1) {
 
-    close(curSdIt->second);
+    return PacketHeader::getOriginAddress(packet);
+
+  }
+
+  if(PacketHeader::getHopCount(packet) == 0) {
+
+    return 0;
+
+  }
+
+  if(version == 3) {
 
-    tcpCxns.erase(curSdIt->first);
+    return addressForNode(PacketHeader::getBloomOrigin(packet));
 
   }
 
+  return addressForNode(PacketHeader::getHop(packet, 0));
+
 }
 
 
@@ -1173,6 +14385,7 @@ void UdpRelay::showTCPConnections() {
     			<< it->second << endl;
     	}
     }*/
+    pthread_mutex_lock(&cxnLock);
     if(tcpCxns.size() == 0)
     {
     	cout << "No connection" << endl;
@@ -1183,9 +14396,121 @@ void UdpRelay::showTCPConnections() {
     	for(it = tcpCxns.begin(); it != tcpCxns.end(); it++)
     	{
     		cout << "remote group name: "<< it->first << ", socket descriptor:"
-    			<< it->second << endl;
+    			<< it->second;
+    		if(egressQueues.count(it->first) > 0)
+    		{
+    			PacketQueue* egress = egressQueues[it->first];
+    			cout << ", queued/dropped (control..bulk):";
+    			for(int lane = NUM_PRIORITIES - 1; lane >= 0; lane--)
+    			{
+    				cout << " " << egress->size(lane) << "/"
+    					<< egress->getDropped(lane);
+    			}
+    		}
+    		map<string, peerHealth>::iterator peer = peers.find(it->first);
+    		if(peer != peers.end() && peer->second.rttSamples > 0)
+    		{
+    			cout << ", rtt " << (long long)peer->second.smoothedRttUs
+    				<< "us, jitter " << (long long)peer->second.jitterUs << "us";
+    		}
+    		else if(peer != peers.end() && !peer->second.capable)
+    		{
+    			cout << ", no heartbeat";
+    		}
+    		if(peer != peers.end())
+    		{
+    			cout << ", header v" << peer->second.headerVersion;
+    			if(peer->second.headerVersion == 2)
+    			{
+    				cout << " (node " << peer->second.nodeId << ")";
+    			}
+    		}
+    		map<string, managedPeer>::iterator managed =
+    			managedPeers.find(it->first);
+    		if(managed != managedPeers.end() && managed->second.backlog != NULL
+    			&& managed->second.backlog->size() > 0)
+    		{
+    			cout << ", replaying " << managed->second.backlog->size();
+    		}
+    		cout << endl;
+    	}
+    }
+    for(map<string, managedPeer>::iterator managed = managedPeers.begin();
+        managed != managedPeers.end(); managed++)
+    {
+    	if(tcpCxns.count(managed->first) > 0)
+    	{
+    		continue;
+    	}
+    	cout << "remote group name: " << managed->first << ", down, attempt "
+    		<< managed->second.attempts;
+    	StoreForward* backlog = managed->second.backlog;
+    	if(backlog != NULL)
+    	{
+    		cout << ", backlog " << backlog->size() << " (" << backlog->getSpilled()
+    			<< " on disk, " << backlog->getDropped() << " dropped)";
+    	}
+    	cout << endl;
+    }
+    pthread_mutex_unlock(&cxnLock);
+    cout << "rebroadcast queued: " << rebroadcastQueue->size() << endl;
+    cout << "low-latency mode: " << (lowLatency ? "on" : "off");
+    if(lowLatency && busyPollUs > 0)
+    {
+    	cout << ", busy poll " << busyPollUs << "us";
+    }
+    cout << endl;
+    if(heartbeatMs > 0)
+    {
+    	cout << "heartbeat: every " << heartbeatMs << "ms, evict after "
+    		<< heartbeatMisses << " missed" << endl;
+    }
+    else
+    {
+    	cout << "heartbeat: off" << endl;
+    }
+    pthread_mutex_lock(&ruleLock);
+    for(map<string, string>::iterator pin = threadAffinity.begin();
+        pin != threadAffinity.end(); pin++)
+    {
+    	cout << "pinned: " << pin->first << " -> " << pin->second << endl;
+    }
+    for(map<unsigned int, int>::iterator rule = priorityRules.begin();
+        rule != priorityRules.end(); rule++)
+    {
+    	struct in_addr groupAddr;
+    	groupAddr.s_addr = htonl(rule->first);
+    	cout << "priority rule: " << inet_ntoa(groupAddr) << " -> class "
+    		<< rule->second << endl;
+    }
+    for(map<unsigned int, int>::iterator rule = tunnelRules.begin();
+        rule != tunnelRules.end(); rule++)
+    {
+    	struct in_addr groupAddr;
+    	groupAddr.s_addr = htonl(rule->first);
+    	cout << "tunnel rule: " << inet_ntoa(groupAddr) << " -> "
+    		<< (rule->second == TUNNEL_ORDERED ? "ordered" : "unreliable") << endl;
+    }
+    for(map<unsigned int, vector<string> >::iterator rule = redundancyRules.begin();
+        rule != redundancyRules.end(); rule++)
+    {
+    	struct in_addr groupAddr;
+    	groupAddr.s_addr = htonl(rule->first);
+    	cout << "redundancy rule: " << inet_ntoa(groupAddr) << " ->";
+    	for(size_t i = 0; i < rule->second.size(); i++)
+    	{
+    		cout << " " << rule->second[i];
     	}
+    	cout << endl;
+    }
+    for(map<string, conflationRule>::iterator rule = conflationRules.begin();
+        rule != conflationRules.end(); rule++)
+    {
+    	cout << "conflate rule: " << rule->first << " -> payload bytes "
+    		<< rule->second.offset << ".." << rule->second.offset + rule->second.length - 1
+    		<< (rule->second.bySource ? " by source" : "") << endl;
     }
+    pthread_mutex_unlock(&ruleLock);
 }
 
 
@@ -1278,6 +14603,8 @@ void UdpRelay::createUdpRelayServerConnection() {
 
     tcpCxns.insert(pair<string,int>(ip, sd));
 
+    peerGeneration++;
+
     tempStruct->remoteHostName = ip;
 
     pthread_create(&outThreads[sd], NULL, relayOutThread, (void*)tempStruct);
@@ -20,12 +20,108 @@
 
 #include <map>
 
+#include <set>
+
 #include "UdpMulticast.h"
 
 #include "Socket.h"
 
+#include "PacketHeader.h"
+
+#include "PacketQueue.h"
+
+
+
+#include "LatencyHistogram.h"
+
+
+
+#include "IdleBackoff.h"
+
+
+
+#include "CpuAffinity.h"
+
+
+
+#include "SocketTimestamps.h"
+
+#include "ShmRing.h"
+
+#include "ControlFrame.h"
+
+#include "StoreForward.h"
+
+#include "Journal.h"
+
+#include "PcapWriter.h"
+
+#include "Reassembler.h"
+
+#include "RelayConfig.h"
+
+#include "Handoff.h"
+
+
+
+#include "AdminSocket.h"
+
+
+
+#include "CounterBlock.h"
+
+
+
+#include "MetricsServer.h"
+
+
+
+#include "SpscRing.h"
+
+#include "UdpLink.h"
+
+#include "UdpTunnel.h"
+
+
+
+#include "RedundancyFilter.h"
+
+
+
+#include "WorkPool.h"
+
+
+
+#include <errno.h>
+
+
+
+#include <netinet/tcp.h>
+
+
+
+#include <deque>
+
+
+
+#include <vector>
+
+#include <pthread.h>
+
+#include <arpa/inet.h>
+
+#include <netdb.h>
+
+#include <fcntl.h>
+
+#include <poll.h>
+
+#include <signal.h>
+
 #include <queue>
 
+#include <algorithm>
+
 using namespace std;
 
 
@@ -44,6 +140,92 @@ const int MAX_HOST_LENGTH = 20;   //Max length of a host IP address
 
 const int GROUP_LENGTH = 11;      //Max length of a group name (uw1-320-10\0)
 
+const int MAX_RECENT_TRACES = 256; //Traced packets kept for "trace"
+
+const int SLOWEST_TRACES_SHOWN = 10; //Traced packets listed by "trace"
+
+const int TIMESTAMPS_OFF = 0;     //No SO_TIMESTAMPING
+
+const int TIMESTAMPS_SOFTWARE = 1; //Kernel software timestamps
+
+const int TIMESTAMPS_HARDWARE = 2; //NIC timestamps, software as fallback
+
+const int LATENCY_LOCAL_RX = 0;   //Kernel receive to recv(), multicast
+
+const int LATENCY_REMOTE_RX = 1;  //Kernel receive to recv(), TCP
+
+const int LATENCY_PROCESS = 2;    //recv() to send() inside the relay
+
+const int LATENCY_TRANSMIT = 3;   //send() to kernel transmit, TCP
+
+const int LATENCY_STAGES = 4;     //Latency histograms kept per thread
+
+const int MAX_PENDING_TX_STAMPS = 1024; //Sends awaiting a transmit timestamp
+
+const int NUM_SHM_BATCH = 32;     //Packets taken from one ring per poll
+
+const int DEFAULT_HEARTBEAT_MS = 1000; //Interval between heartbeats
+
+const int DEFAULT_HEARTBEAT_MISSES = 3; //Silent intervals before eviction
+
+const int HEARTBEAT_TICK_MS = 10; //How often the heartbeat thread wakes
+
+const int RECONNECT_BASE_MS = 250; //First reconnect delay ceiling
+
+const int RECONNECT_MAX_MS = 30000; //Largest reconnect delay ceiling
+
+const int DEFAULT_REPLAY_RATE = 1000; //Backlog packets replayed per second
+
+const int REPLAY_TICK_MS = 1;     //Egress wait for live traffic while replaying
+
+const int JOURNAL_REPLAY_ALL = 2; //Replay both JOURNAL_LOCAL and _REMOTE
+
+const int CAPTURE_RING_SLOTS = 8192; //Tap ring between relay threads and writer
+
+const int CAPTURE_PEER_SIZE = 32; //Peer name bytes kept per captured packet
+
+const int DEFAULT_HEADER_VERSION = 2; //Header version offered to new peers
+
+const int DEFAULT_BLOOM_BYTES = 32; //Filter size of version 3 headers
+
+const int DEFAULT_BLOOM_TTL = 32; //Relays a version 3 packet may pass
+
+const int MAX_PAYLOAD = 65535;    //Largest message (version 2 length field)
+
+const int MAX_PACKET_SIZE = MAX_PAYLOAD + 2 * SIZE; //Message and largest header
+
+const int DEFAULT_MAX_PAYLOAD = 8192; //Largest message accepted by default
+
+const int MAX_DATAGRAM_SIZE = 65507; //Largest UDP payload over IPv4
+
+const int MIN_FRAGMENT_SIZE = 256; //Smallest fragment "payload" accepts
+
+const int HANDOFF_WAIT_MS = 30000; //Time "upgrade" waits for the new relay
+
+const int HANDOFF_DRAIN_MS = 1000; //Time egress queues have to flush on upgrade
+
+const int HANDOFF_VERSION = 2;    //Layout of the state passed on upgrade
+
+const int FANOUT_SHARDS_PER_WORKER = 4; //Fan-out strands per pool thread
+
+const int STAGE_BATCH = 32;       //Packets the remote stage takes from one peer
+
+                                  //before moving on to the next
+
+const int STAGE_MAX_SLEEP_US = 200; //Longest idle sleep of a stage or of a
+
+                                    //producer waiting on a full stage ring
+
+const int UDPLINK_PORT_OFFSET = 1; //Default UDP link port past portNumber
+
+const int UDPLINK_POLL_MS = 100;  //Longest wait of the UDP link thread
+
+//Receives each message delivered to an in-process subscriber. The message is
+
+//only valid for the duration of the call.
+
+typedef void (*RelaySubscriber)(const char* message, int length, void* context);
+
 
 
 //-----------------------------------------------------------------------------
@@ -58,518 +240,4850 @@ const int GROUP_LENGTH = 11;      //Max length of a group name (uw1-320-10\0)
 
 //              commands for the UdpRelay object. The threads are:
 
-//
+//
+
+//              Command Thread:   Spun up after execution, only a single thread
+
+//                                which takes user commands (add remote group,
+
+//                                delete remote group, show TCP connections,
+
+//                                quit).
+
+//              relayIn Thread:   Spun up after execution, only a single thread
+
+//                                which accepts local UDP broadcasts and sends
+
+//                                them via TCP to all active connections.
+
+//              acceptThread:     Spun up after execution, only a single thread
+
+//                                which accepts TCP connection requests from a
+
+//                                remote group.
+
+//              relayOut Thread:  Spun up after a TCP connection request is
+
+//                                accepted, it accepts TCP messages and
+
+//                                queues them for local UDP rebroadcast
+
+//              relayEgress Thread: One per TCP connection, it drains that
+
+//                                connection's priority queue onto the socket
+
+//              rebroadcast Thread: Spun up after execution, only a single
+
+//                                thread which drains the local priority queue
+
+//                                and broadcasts the packets via UDP
+
+//              shmIn Thread:     Spun up after execution, only a single thread
+
+//                                which polls the shared memory ingress rings
+
+//              localStage Thread: Spun up after execution, only a single
+
+//                                thread which drops duplicates, rewrites and
+
+//                                queues what relayIn hands it for every peer
+
+//              remoteStage Thread: Spun up after execution, only a single
+
+//                                thread which does the same with what the
+
+//                                relayOut threads hand it, for rebroadcast
+
+//
+
+//              Only two hops are lock-free SpscRing stages that push back
+
+//              when full: relayIn to the local stage, and each relayOut
+
+//              thread or UDP link to the remote stage. A full ring stops the
+
+//              thread before it reading its socket. publish() and the shmIn
+
+//              and pcap replay threads skip the rings and run the rewrite
+
+//              step on their own threads. The egress and rebroadcast queues
+
+//              are PacketQueues, since both stages, publishers and control
+
+//              frames all feed them; they take a mutex per packet and, when
+
+//              full, drop the new packet rather than push back.
+
+//
+
+//              Embedded in another process, the relay is constructed without
+
+//              the command thread and driven with start() and stop(). The
+
+//              host then publishes messages into the relay and subscribes to
+
+//              the messages it delivers without going through the local UDP
+
+//              multicast group.
+
+//
+
+//              Local processes can also skip the kernel through shared memory
+
+//              rings ("shm add <name>"). Producers attach to the ShmRing queue
+
+//              <name>.in and push packets built with PacketHeader::build; the
+
+//              shmIn thread copies them out and relays them like local UDP
+
+//              broadcasts.
+
+//              Consumers attach to the broadcast ring <name>.out, which
+
+//              carries every packet the rebroadcast thread delivers.
+
+//
+
+//              Messages sent are in a packet format as follows:
+
+//              Packet header: -32, -31, -30, hop, 4-byte IP addresses of all
+
+//                             nodes that have received the message
+
+//              Followed By:   Actual message terminated by \0
+
+//              The low 5 bits of "hop" are the number of IP addresses in the
+
+//              header and bits 5-6 are the priority class (see PacketHeader)
+
+//
+
+//              Between relays that both offer it at connection time, packets
+
+//              use header version 2, which lists 16-bit node IDs instead of
+
+//              IP addresses and holds up to 255 hops. Each relay announces
+
+//              its node ID (by default the low 16 bits of its group IP) with
+
+//              its group IP, and a peer whose ID collides with one already
+
+//              known is sent version 1. The local group and version 1 peers
+
+//              always receive version 1.
+
+//
+
+//              In large meshes, relays can also offer header version 3,
+
+//              which replaces the hop list with a 32-64 byte Bloom filter of
+
+//              node IDs and a TTL, so the header and the loop check cost the
+
+//              same at any path length.
+
+//-----------------------------------------------------------------------------
+
+class UdpRelay {
+
+ public:
+
+  //---------------------------------------------------------------------------
+
+  // UdpRelay Constructor
+
+  // Parses command line input into IP and port numbers, instantiates all data
+
+  // members, spins up command, relayIn and accept threads then calls a
+
+  // semaphore
+
+  // wait until a "quit" command is issued.
+
+  // If interactive is false, only instantiates the data members and returns;
+
+  // the caller runs the relay with start() and stop().
+
+  // A config file, if given, is read here and applied by start() (see
+
+  // loadConfig).
+
+  // If takeoverPath is given, the relay takes over the sockets, links and
+
+  // backlogs of a running relay that was told to "upgrade" on that path,
+
+  // instead of opening its own; start() resumes relaying on them.
+
+  //
+
+  // @pre:   char* parameter is a valid IP number concatenated with a port
+
+  //         number
+
+  // @post:  3 threads are spun up, IP and port numbers are saved
+
+  // @param *ipPlusPort:  The IP address and port number:
+
+  //        (XXX.XXX.XXX.XXX:YYYYY)
+
+  // @param interactive:  False to embed the relay without a command thread
+
+  // @param *configPath:  A config file (see RelayConfig), or NULL
+
+  // @param *takeoverPath: The old relay's handoff socket (see handOff), or
+
+  //        NULL
+
+  // @throw: throws invalid_argument if the config file cannot be read,
+
+  //         runtime_error if the takeover fails
+
+  //---------------------------------------------------------------------------
+
+  UdpRelay(const char* ipPlusPort, bool interactive = true,
+
+      const char* configPath = NULL, const char* takeoverPath = NULL);
+
+  //---------------------------------------------------------------------------
+
+  // start
+
+  // Spins up the relayIn, accept, rebroadcast, shmIn and heartbeat threads
+
+  //
+
+  // @pre:   None
+
+  // @post:  The relay forwards messages until stop() is called
+
+  // @returns bool: False if the relay was already started
+
+  //---------------------------------------------------------------------------
+
+  bool start();
+
+  //---------------------------------------------------------------------------
+
+  // stop
+
+  // Stops accepting and relaying messages, closes all TCP connections and
+
+  // waits until every relay thread has exited. A stopped relay cannot be
+
+  // started again.
+
+  //
+
+  // @pre:   None
+
+  // @post:  No relay thread is running; subscribers are no longer called
+
+  //---------------------------------------------------------------------------
+
+  void stop();
+
+  //---------------------------------------------------------------------------
+
+  // publish
+
+  // Sends a message from this process to every connected remote group and
+
+  // every in-process subscriber, exactly as if it had been received on the
+
+  // local UDP multicast group
+
+  //
+
+  // @pre:   None
+
+  // @post:  The message is queued for all remote groups
+
+  // @param  message: The message bytes; the wire format ends it at the
+
+  //         first \0
+
+  // @param  length:  Number of message bytes
+
+  // @returns bool:   False if the relay is not running or the message does
+
+  //                  not fit in a packet
+
+  //---------------------------------------------------------------------------
+
+  bool publish(const char* message, int length);
+
+  //---------------------------------------------------------------------------
+
+  // subscribe
+
+  // Registers a callback for every message the relay delivers locally: all
+
+  // messages received from remote groups and all messages published in this
+
+  // process. Callbacks run on relay threads and must not call subscribe or
+
+  // unsubscribe.
+
+  //
+
+  // @pre:   callback is not NULL
+
+  // @post:  callback is called for each later message
+
+  // @param  callback: The function to call
+
+  // @param  context:  Passed unchanged to callback
+
+  // @returns int:     Subscription ID for unsubscribe
+
+  //---------------------------------------------------------------------------
+
+  int subscribe(RelaySubscriber callback, void* context);
+
+  //---------------------------------------------------------------------------
+
+  // unsubscribe
+
+  // Removes a subscription. Once this returns the callback is not running
+
+  // and will not be called again.
+
+  //
+
+  // @pre:   None
+
+  // @post:  The subscription no longer exists
+
+  // @param  subscriptionID: A value returned by subscribe
+
+  //---------------------------------------------------------------------------
+
+  void unsubscribe(int subscriptionID);
+
+  //---------------------------------------------------------------------------
+
+  // addRemoteIp
+
+  // Takes a group IP/name and port number parameter and opens a TCP connection
+
+  // to that node. Sends the hostname of this machine to the remote node and
+
+  // updates the tcpCxns map. The peer stays managed until it is deleted:
+
+  // whenever the connection fails or drops it is retried with backoff, and
+
+  // packets for it are buffered meanwhile
+
+  //
+
+  // @pre:   remoteGroupID parameter is a valid group IP and port number
+
+  // @post:  Socket is opened for TCP and tcpCxns map is updated, or a
+
+  //         reconnect is scheduled
+
+  // @param  remoteGroupID: An group IP/name and port (XXX.XXX.XXX.XXX:YYYYY)
+
+  //---------------------------------------------------------------------------
+
+  void addRemoteIP(string remoteGroupID);
+
+  //---------------------------------------------------------------------------
+
+  // terminateRemoteCxn
+
+  // Closes the socket to the remote node IP/name passed as parameter, then
+
+  // deletes that connection from the map. A managed peer is no longer
+
+  // reconnected and its backlog is discarded
+
+  //
+
+  // @pre:   remoteGroupID is a valid group IP/name and map contains that group
+
+  // @post:  tcpCxns map is updated with group IP/name entry removed
+
+  // @param  remoteGroupID: A valid group IP/Name
+
+  //---------------------------------------------------------------------------
+
+  void terminateRemoteCxn(string remoteGroupID);
+
+  //---------------------------------------------------------------------------
+
+  // getPeerRtt
+
+  // Returns the smoothed round trip time and jitter measured by heartbeats
+
+  // on a connection
+
+  //
+
+  // @pre:   None
+
+  // @post:  rttUs and jitterUs are set if true is returned
+
+  // @param  remoteGroupID: A valid group IP/Name
+
+  // @param  rttUs:         Receives the smoothed RTT in us
+
+  // @param  jitterUs:      Receives the smoothed RTT variation in us
+
+  // @returns bool:         False if no RTT has been measured for the peer
+
+  //---------------------------------------------------------------------------
+
+  bool getPeerRtt(const string& remoteGroupID, long long& rttUs,
+
+      long long& jitterUs);
+
+  //---------------------------------------------------------------------------
+
+  // replayJournal
+
+  // Re-injects the packets a journal recorded in a time range, in a thread of
+
+  // its own. Packets from the local group are relayed to the remote groups
+
+  // again; packets from remote groups are delivered locally again.
+
+  //
+
+  // @pre:   None
+
+  // @post:  A replay thread runs if true is returned
+
+  // @param  directory:  Journal directory to read
+
+  // @param  fromUs:     Start of the range, wall clock us
+
+  // @param  toUs:       End of the range, wall clock us
+
+  // @param  speed:      1 for the original pace, 10 for ten times faster,
+
+  //                     0 for as fast as possible
+
+  // @param  directions: JOURNAL_LOCAL, JOURNAL_REMOTE or JOURNAL_REPLAY_ALL
+
+  // @returns bool:      False if the relay is not running or a replay is
+
+  //                     already in progress
+
+  //---------------------------------------------------------------------------
+
+  bool replayJournal(const string& directory, long long fromUs, long long toUs,
+
+      double speed, int directions);
+
+  //---------------------------------------------------------------------------
+
+  // UdpRelay Destructor
+
+  // Deletes any dynamically allocated data members
+
+  //
+
+  // @pre:   None
+
+  // @post:  char * ipNumber is deleted
+
+  //---------------------------------------------------------------------------
+
+  ~UdpRelay();
+
+  //---------------------------------------------------------------------------
+
+  // sendLocalMessage
+
+  // Broadcasts the char* parameter via UDP on the relay's multicast client
+
+  // socket, which is opened once in the constructor
+
+  //
+
+  // @pre:   currentMessage is not NULL
+
+  // @post:  currentMessage is broadcast via UDP
+
+  // @param  *currentMessage: The message to broadcast UDP
+
+  //---------------------------------------------------------------------------
+
+  void sendLocalMessage(char * currentMessage);
+
+  //---------------------------------------------------------------------------
+
+  // sendLocalFragments
+
+  // Multicasts a packet that is larger than the local group's MTU as fragment
+
+  // frames of at most mtu bytes, which relays on the group reassemble
+
+  //
+
+  // @pre:   packet has valid packet format, mtu > FRAGMENT_HEADER_SIZE
+
+  // @post:  Every fragment of the packet has been sent
+
+  // @param  packet: The packet to send
+
+  // @param  length: Bytes in the packet
+
+  // @param  mtu:    Largest datagram to send
+
+  //---------------------------------------------------------------------------
+
+  void sendLocalFragments(const char* packet, int length, int mtu);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // sendLocalDatagram
+
+  // Sends bytes to the local group as one datagram. UdpMulticast::multicast
+
+  // always sends a SIZE byte frame, so larger packets go out here
+
+  //
+
+  // @pre:   bytes <= MAX_DATAGRAM_SIZE
+
+  // @post:  The datagram has been sent
+
+  // @param  datagram: The bytes to send
+
+  // @param  bytes:    Number of bytes
+
+  //---------------------------------------------------------------------------
+
+  void sendLocalDatagram(const char* datagram, int bytes);
+
+  //---------------------------------------------------------------------------
+
+  // recvLocalMessage
+
+  // Receives a local UDP broadcast on the relay's multicast server socket.
+
+  // In low-latency mode the socket is polled without blocking and the thread
+
+  // spins, yields, then sleeps while idle (see IdleBackoff)
+
+  //
+
+  // @pre:   currentMessage is not NULL and is of at least MAX_PACKET_SIZE
+
+  //         length
+
+  // @post:  The message received via UDP is copied into currentMessage,
+
+  //         followed by a \0
+
+  // @param  *currentMessage: The buffer that will contain the message received
+
+  // @param  *kernelRxUs:     If not NULL, receives the kernel/NIC receive
+
+  //         timestamp (realtime us) when timestamping is on, else 0
+
+  // @returns int:            Bytes received, 0 if there is no socket, -1 if
+
+  //                          the socket failed and must be reopened
+
+  //---------------------------------------------------------------------------
+
+  int recvLocalMessage(char * currentMessage, long long * kernelRxUs = NULL);
+
+
+
+
+
+  //---------------------------------------------------------------------------
+
+  // reopenLocalGroup
+
+  // Replaces the multicast server socket after it failed: closes it and joins
+
+  // the group again on a new one
+
+  //
+
+  // @pre:   Only relayIn calls it
+
+  // @post:  localRecvSd is the new socket, or NULL_SD if none could be opened
+
+  // @returns bool: False if no socket could be opened
+
+  //---------------------------------------------------------------------------
+
+  bool reopenLocalGroup();
+
+
+
+  //---------------------------------------------------------------------------
+
+  // recvRemoteMessage
+
+  // Receives one complete SIZE-byte frame from a TCP connection, polling
+
+  // without blocking in low-latency mode. A jumbo frame is followed by the
+
+  // packet it announces, which is received in its place. The calling thread
+
+  // can be cancelled while it waits for a frame, never partway through one.
+
+  //
+
+  // @pre:   sd is a connected TCP socket, currentMessage holds
+
+  //         MAX_PACKET_SIZE bytes
+
+  // @post:  currentMessage holds the frame or packet, followed by a \0, if
+
+  //         the return value is positive
+
+  // @param  sd:             The socket to read
+
+  // @param  currentMessage: The buffer that will contain the packet
+
+  // @param  idle:           Backoff state of the calling thread
+
+  // @param  kernelRxUs:     Receives the kernel/NIC receive timestamp of the
+
+  //                         packet's first byte when timestamping is on, else 0
+
+  // @returns int:           Bytes received (SIZE, or a jumbo packet's
+
+  //                         length), or <= 0 if the connection closed, failed
+
+  //                         or announced a packet larger than MAX_PACKET_SIZE
+
+  //---------------------------------------------------------------------------
+
+  int recvRemoteMessage(int sd, char * currentMessage, IdleBackoff& idle,
+
+      long long& kernelRxUs);
+
+  //---------------------------------------------------------------------------
+
+  // recvRemoteBytes
+
+  // Receives exactly length bytes from a TCP connection, polling without
+
+  // blocking in low-latency mode
+
+  //
+
+  // @pre:   sd is a connected TCP socket, buffer holds length bytes
+
+  // @post:  buffer holds the bytes if the return value is positive
+
+  // @param  sd:         The socket to read
+
+  // @param  buffer:     Receives the bytes
+
+  // @param  length:     Bytes to read
+
+  // @param  idle:       Backoff state of the calling thread
+
+  // @param  kernelRxUs: Receives the kernel/NIC receive timestamp of the first
+
+  //                     byte when timestamping is on, else 0
+
+  // @param  cancelable: Let the thread be cancelled until the first byte
+
+  //                     arrives, so it stops only between frames
+
+  // @returns int:       length, or <= 0 if the connection closed or failed
+
+  //---------------------------------------------------------------------------
+
+  int recvRemoteBytes(int sd, char * buffer, int length, IdleBackoff& idle,
+
+      long long& kernelRxUs, bool cancelable = false);
+
+  //---------------------------------------------------------------------------
+
+  // sendAll
+
+  // Writes a whole buffer to a TCP connection, resuming after short writes
+
+  // and signals
+
+  //
+
+  // @pre:   sd is a connected, blocking TCP socket
+
+  // @post:  None
+
+  // @param  sd:     The socket to write
+
+  // @param  buffer: The bytes to send
+
+  // @param  length: Number of bytes
+
+  // @returns int:   length, or -1 if sending failed
+
+  //---------------------------------------------------------------------------
+
+  int sendAll(int sd, const char* buffer, int length);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // sendFrames
+
+  // Sends a packet on a TCP connection: as one SIZE-byte frame if it fits,
+
+  // else to a peer that takes jumbo frames either whole after a jumbo frame
+
+  // or, while fragmenting is on, as SIZE-byte fragment frames
+
+  //
+
+  // @pre:   sd is a connected TCP socket, packet holds max(length, SIZE) bytes
+
+  // @post:  None
+
+  // @param  sd:     The socket to write
+
+  // @param  packet: The packet to send
+
+  // @param  length: getFrameLength(packet)
+
+  // @param  jumbo:  The peer offered CAPABILITY_JUMBO
+
+  // @returns int:   Bytes sent, 0 if the packet is too large for the peer
+
+  //                 (counted as oversized), < 0 if sending failed
+
+  //---------------------------------------------------------------------------
+
+  int sendFrames(int sd, const char* packet, int length, bool jumbo);
+
+  //---------------------------------------------------------------------------
+
+  // reassembleFragment
+
+  // Passes a fragment frame received from a link or the local group to the
+
+  // reassembler, and writes the packet over the frame once it is complete.
+
+  // Fragments this relay sent itself are ignored.
+
+  //
+
+  // @pre:   isControl(frame), frame holds MAX_PACKET_SIZE bytes
+
+  // @post:  frame holds the packet, followed by a \0, if the return value is
+
+  //         positive
+
+  // @param  source: The link the frame arrived on, or "local"
+
+  // @param  frame:  The frame received
+
+  // @param  length: Bytes received
+
+  // @returns int:   The packet's length once complete, else 0
+
+  //---------------------------------------------------------------------------
+
+  int reassembleFragment(const string& source, char* frame, int length);
+
+  //---------------------------------------------------------------------------
+
+  // isOversized
+
+  // Returns true, and counts the packet, if its message is larger than the
+
+  // configured maximum payload
+
+  //
+
+  // @pre:   packet has valid packet format and ends with a \0
+
+  // @post:  None
+
+  // @param  packet: The packet received
+
+  // @returns bool:  True if the packet must be dropped
+
+  //---------------------------------------------------------------------------
+
+  bool isOversized(const char* packet);
+
+  //---------------------------------------------------------------------------
+
+  // getFrameLength
+
+  // Returns the bytes to queue for a packet: its length, but at least SIZE,
+
+  // the size of a frame on the TCP connections
+
+  //
+
+  // @pre:   packet has valid packet format and its buffer holds at least SIZE
+
+  //         bytes
+
+  // @post:  None
+
+  // @param  packet: The packet
+
+  // @returns int:   max(PacketHeader::getLength(packet), SIZE)
+
+  //---------------------------------------------------------------------------
+
+  int getFrameLength(const char* packet);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // nextQueuedPacket
+
+  // Pops the next packet from a queue, blocking normally or polling with
+
+  // backoff in low-latency mode
+
+  //
+
+  // @pre:   queue is not NULL
+
+  // @post:  On success the caller owns packet.data and must delete[] it
+
+  // @param  queue:  The queue to pop
+
+  // @param  packet: Receives the packet
+
+  // @param  idle:   Backoff state of the calling thread
+
+  // @returns bool:  False once the queue is closed and empty
+
+  //---------------------------------------------------------------------------
+
+  bool nextQueuedPacket(PacketQueue* queue, QueuedPacket& packet,
+
+      IdleBackoff& idle);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // applyThreadAffinity
+
+  // Pins the calling thread to the CPUs configured for its role if the
+
+  // configuration changed since the thread last applied it
+
+  //
+
+  // @pre:   role is relayIn, relayOut, egress or rebroadcast
+
+  // @post:  appliedGeneration equals the current configuration generation
+
+  // @param  role:              The kind of thread calling
+
+  // @param  appliedGeneration: The generation the thread last applied
+
+  //---------------------------------------------------------------------------
+
+  void applyThreadAffinity(const string& role, int& appliedGeneration);
+
+  //---------------------------------------------------------------------------
+
+  // commandThread
+
+  // A static class method that is a thread function for the command thread
+
+  //
+
+  // @pre:   *arg parameter represents a valid UdpRelay object
+
+  // @post:  Acts based on user input, eventually terminating upon quit command
+
+  // @param  *arg:  A void pointer to the UdpRelay object creating the thread
+
+  //---------------------------------------------------------------------------
+
+  static void* commandThread(void* arg);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // executeCommand
+
+  // Runs one console command line, as typed at the command thread or read
+
+  // from a config file. Output goes to cout
+
+  //
+
+  // @pre:   None
+
+  // @post:  The command has been carried out
+
+  // @param  line:  The command and its arguments
+
+  // @returns bool: False if the command was quit
+
+  //---------------------------------------------------------------------------
+
+  bool executeCommand(const string& line);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // loadConfig
+
+  // Reads a config file (see RelayConfig). If the relay is running, its
+
+  // commands are run and its peers connected in parallel right away;
+
+  // otherwise start() does so
+
+  //
+
+  // @pre:   None
+
+  // @post:  The config is applied or pending, or an error is reported to cout
+
+  // @param  path:  The config file
+
+  // @returns bool: False if the file cannot be read or has a bad line
+
+  //---------------------------------------------------------------------------
+
+  bool loadConfig(const string& path);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // isReady
+
+  // Tells whether the configured quorum of peers has been connected. A relay
+
+  // without a config file is always ready
+
+  //
+
+  // @pre:   None
+
+  // @post:  None
+
+  // @returns bool: True once the quorum has been connected
+
+  //---------------------------------------------------------------------------
+
+  bool isReady();
+
+
+
+  //---------------------------------------------------------------------------
+
+  // showConfig
+
+  // Prints the config file in use and how many of its peers are connected
+
+  //
+
+  // @pre:   None
+
+  // @post:  None
+
+  //---------------------------------------------------------------------------
+
+  void showConfig();
+
+
+
+  //---------------------------------------------------------------------------
+
+  // reloadConfig
+
+  // Reads the config file again and applies only what changed: peers no
+
+  // longer listed are deleted, new ones are connected in parallel, and
+
+  // settings whose line changed are run again or, if removed, put back to
+
+  // their defaults. Links to peers still listed keep running. Also run on
+
+  // SIGHUP
+
+  //
+
+  // @pre:   None
+
+  // @post:  The running state matches the file, or an error is reported to
+
+  //         cout and nothing changed
+
+  // @returns bool: False if there is no config file, it has a bad line or
+
+  //                a reload is already running
+
+  //---------------------------------------------------------------------------
+
+  bool reloadConfig();
+
+  //---------------------------------------------------------------------------
+
+  // handOff
+
+  // Passes the relay to a new process without dropping a link: waits for it
+
+  // to connect to a Unix socket at path (see the takeoverPath constructor
+
+  // parameter), stops every relay thread, flushes the egress queues onto
+
+  // their links, and sends the listening, multicast and peer sockets with
+
+  // the peers' state and store-and-forward backlogs. The relay is stopped
+
+  // afterwards, with its sockets open in the new process only.
+
+  //
+
+  // @pre:   The relay is running
+
+  // @post:  The new process owns the sockets if true is returned; if false
+
+  //         is returned before it connected, nothing changed
+
+  // @param  path:  The Unix socket to listen on
+
+  // @returns bool: False if no process took over
+
+  //---------------------------------------------------------------------------
+
+  bool handOff(const string& path);
+
+  //---------------------------------------------------------------------------
+
+  // startAdmin
+
+  // Serves the admin protocol on a Unix socket, for tools that drive many
+
+  // relays. Each request is one line, "tag command [arguments]"; every
+
+  // reply line starts with the tag and the last one is "tag ok ..." or
+
+  // "tag error reason", so a client can pipeline requests and match the
+
+  // answers. Commands:
+
+  //   add host...     connect the hosts in parallel (as in a config file)
+
+  //   delete host...  disconnect the hosts
+
+  //   peers           one "tag peer NAME state=up|down" line per peer
+
+  //   stats [host...] peer lines with queue, drop, RTT and backlog counts,
+
+  //                   then a "tag relay" line
+
+  //   ready           whether the config file's quorum is connected
+
+  //   subscribe       also send "* up NAME", "* down NAME" and "* ready"
+
+  //   unsubscribe     events as links come up and go down
+
+  // A slow "add" is answered when it finishes without holding up the
+
+  // client's later requests.
+
+  //
+
+  // @pre:   None
+
+  // @post:  Clients can connect to path if true is returned; a socket
+
+  //         opened before is closed
+
+  // @param  path:  The socket file
+
+  // @returns bool: False if the socket cannot be created
+
+  //---------------------------------------------------------------------------
+
+  bool startAdmin(const string& path);
+
+  //---------------------------------------------------------------------------
+
+  // stopAdmin
+
+  // Disconnects every admin client and removes the admin socket
+
+  //
+
+  // @pre:   None
+
+  // @post:  The admin thread has exited
+
+  //---------------------------------------------------------------------------
+
+  void stopAdmin();
+
+  //---------------------------------------------------------------------------
+
+  // setMetrics
+
+  // Serves Prometheus metrics over HTTP at /metrics on a port: packets and
+
+  // bytes received and sent per peer and per origin group, per-peer link
+
+  // state, queue depth, drops, RTT and backlog, and the latency histograms.
+
+  // The heartbeat thread serves scrapes between its ticks, reading each
+
+  // relay thread's counters without stopping it.
+
+  //
+
+  // @pre:   None
+
+  // @post:  The heartbeat thread (re)opens or closes the port on its next
+
+  //         tick, or on start()
+
+  // @param  port:    The TCP port, 0 to stop serving
+
+  // @param  address: The IP to bind, "" for every interface
+
+  //---------------------------------------------------------------------------
+
+  void setMetrics(int port, const string& address);
+
+  //---------------------------------------------------------------------------
+
+  // setUdpLinks
+
+  // Opens or closes the UDP socket peers can link to instead of connecting
+
+  // over TCP. A UdpLink carries each origin group's packets as its own
+
+  // reliable stream, so a lost datagram delays only that group, and its
+
+  // congestion window slows the sender on a lossy path. Links are added
+
+  // with addUdpLink or when a peer's first datagram arrives; TCP stays the
+
+  // default for "add".
+
+  //
+
+  // @pre:   The relay is running
+
+  // @post:  With port 0, every link is closed and its queued packets are
+
+  //         dropped
+
+  // @param  port: UDP port to bind, 0 to close the socket
+
+  //---------------------------------------------------------------------------
+
+  void setUdpLinks(int port);
+
+  //---------------------------------------------------------------------------
+
+  // addUdpLink / removeUdpLink
+
+  // Link to a peer relay's UDP link port, or close the link to it (a peer
+
+  // that keeps sending links again, as a TCP peer reconnects)
+
+  //
+
+  // @pre:   UDP links are on
+
+  // @post:  addUdpLink: packets from the local group are queued for the peer
+
+  // @param  hostPort: "host:port" of the peer, or for removeUdpLink the link
+
+  //                   name "udp:IP:port"
+
+  //---------------------------------------------------------------------------
+
+  void addUdpLink(const string& hostPort);
+
+  void removeUdpLink(const string& hostPort);
+
+  //---------------------------------------------------------------------------
+
+  // setFanout
+
+  // Moves the fan-out of packets received from the local group onto a pool
+
+  // of worker threads. Peers are spread over shards, several per worker;
+
+  // each received packet is copied once and one task per shard queues it on
+
+  // that shard's peers, so a peer's packets stay in order while the shards
+
+  // run on whichever workers are free. The receiving thread takes only
+
+  // fanoutLock, never cxnLock. 0 queues on every peer inline, in the
+
+  // receiving thread.
+
+  //
+
+  // @pre:   None
+
+  // @post:  Packets already handed to the old pool are queued; later packets
+
+  //         use the new one
+
+  // @param  workers: Pool threads, 0 for no pool
+
+  //---------------------------------------------------------------------------
+
+  void setFanout(int workers);
+
+  //---------------------------------------------------------------------------
+
+  // acceptThread
+
+  // A static class method that is a thread function for the accept thread,
+
+  // which loops continually accepting TCP connection requests
+
+  //
+
+  // @pre:   *arg parameter represents a valid UdpRelay object
+
+  // @post:  Opens a TCP connection socket and updates a connection map
+
+  // @param  *arg:  A void pointer to the UdpRelay object creating the thread
+
+  //---------------------------------------------------------------------------
+
+  static void* acceptThread(void* arg);
+
+  //---------------------------------------------------------------------------
+
+  // relayInThread
+
+  // A static class method that is a thread function for the relayIn thread,
+
+  // the ingest stage of the local group. It loops continually, receiving UDP
+
+  // messages, reassembling fragments and handing them to the local stage;
+
+  // while the stage's ring is full it stops reading, leaving packets in the
+
+  // kernel's socket buffer
+
+  //
+
+  // @pre:   *arg parameter represents a valid UdpRelay object
+
+  // @post:  None
+
+  // @param  *arg:  A void pointer to the UdpRelay object creating the thread
+
+  //---------------------------------------------------------------------------
+
+  static void* relayInThread(void* arg);
+
+  //---------------------------------------------------------------------------
+
+  // relayOutThread
+
+  // A static class method that is a thread function for the relayOut thread,
+
+  // which spins up when a TCP connection is established. It is the ingest
+
+  // stage of its peer: receives messages via the TCP connection, handles
+
+  // control frames and fragments and hands the rest to the remote stage on
+
+  // the peer's own ring. While that ring is full it stops reading, so TCP
+
+  // flow control slows the peer down
+
+  //
+
+  // @pre:   *arg parameter represents a valid outThreadInfo struct
+
+  // @post:  Removes the connection from the map when the thread terminates
+
+  // @param  *arg:  Pointer to the outThreadInfo struct with socket and
+
+  //         UdpRelay
+
+  //---------------------------------------------------------------------------
+
+  static void* relayOutThread(void *arg);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // relayEgressThread
+
+  // A static class method that is a thread function for a relayEgress thread,
+
+  // which spins up when a TCP connection is established. Pops packets from
+
+  // that connection's priority queue and sends them via TCP
+
+  //
+
+  // @pre:   *arg parameter represents a valid egressThreadInfo struct
+
+  // @post:  Deletes the connection's queue when the queue is closed
+
+  // @param  *arg:  Pointer to the egressThreadInfo struct with the queue,
+
+  //         remote group name and UdpRelay
+
+  //---------------------------------------------------------------------------
+
+  static void* relayEgressThread(void *arg);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // rebroadcastThread
+
+  // A static class method that is a thread function for the rebroadcast
+
+  // thread. It loops continually, popping packets received from remote groups
+
+  // in priority order and broadcasting them locally via UDP
+
+  //
+
+  // @pre:   *arg parameter represents a valid UdpRelay object
+
+  // @post:  None
+
+  // @param  *arg:  A void pointer to the UdpRelay object creating the thread
+
+  //---------------------------------------------------------------------------
+
+  static void* rebroadcastThread(void *arg);
+
+  //---------------------------------------------------------------------------
+
+  // shmInThread
+
+  // A static class method that is a thread function for the shmIn thread. It
+
+  // polls every shared memory ingress ring, copying a batch of packets out of
+
+  // the ring under shmLock and relaying the copies after releasing it, and
+
+  // backs off while the rings are empty
+
+  //
+
+  // @pre:   *arg parameter represents a valid UdpRelay object
+
+  // @post:  None
+
+  // @param  *arg:  A void pointer to the UdpRelay object creating the thread
+
+  //---------------------------------------------------------------------------
+
+  static void* shmInThread(void *arg);
+
+  //---------------------------------------------------------------------------
+
+  // localStageThread
+
+  // A static class method that is a thread function for the local stage. It
+
+  // pops the packets relayIn received from ingestRing, drops duplicates,
+
+  // rewrites them and queues them for every remote group, until the ring is
+
+  // closed and empty
+
+  //
+
+  // @pre:   *arg parameter represents a valid UdpRelay object
+
+  // @post:  None
+
+  // @param  *arg:  A void pointer to the UdpRelay object creating the thread
+
+  //---------------------------------------------------------------------------
+
+  static void* localStageThread(void *arg);
+
+  //---------------------------------------------------------------------------
+
+  // remoteStageThread
+
+  // A static class method that is a thread function for the remote stage. It
+
+  // takes up to STAGE_BATCH packets in turn from the ring of every peer,
+
+  // drops duplicates, rewrites them and queues them for rebroadcast, deleting
+
+  // the rings of peers that are gone, until stopRemoteStage
+
+  //
+
+  // @pre:   *arg parameter represents a valid UdpRelay object
+
+  // @post:  Every peer ring is deleted
+
+  // @param  *arg:  A void pointer to the UdpRelay object creating the thread
+
+  //---------------------------------------------------------------------------
+
+  static void* remoteStageThread(void *arg);
+
+  //---------------------------------------------------------------------------
+
+  // stagePacket
+
+  // Hands a packet to the next stage, waiting while its ring is full
+
+  //
+
+  // @pre:   Called by the ring's only producer
+
+  // @post:  The packet is on the ring if true is returned
+
+  // @param  ring:      The next stage's ring
+
+  // @param  packet:    A packet in valid packet format
+
+  // @param  arrivalUs: monotonicMicros() when the packet was received
+
+  // @returns bool:     False if the relay stopped while waiting
+
+  //---------------------------------------------------------------------------
+
+  bool stagePacket(SpscRing* ring, const char* packet, long long arrivalUs);
+
+  //---------------------------------------------------------------------------
+
+  // addPeerStage / stopLocalStage / stopRemoteStage
+
+  // Register the ring a relayOut thread feeds the remote stage with, or close
+
+  // ingestRing and wait for the local stage to empty it, or wait for the
+
+  // remote stage to empty every peer ring once no relayOut thread is left
+
+  //
+
+  // @pre:   stopLocalStage: relayIn has exited; stopRemoteStage: every
+
+  //         relayOut thread has exited
+
+  // @post:  addPeerStage: the returned ring is deleted by the remote stage
+
+  //         after it is closed and empty
+
+  //---------------------------------------------------------------------------
+
+  SpscRing* addPeerStage(const string& remoteGroupID);
+
+  void stopLocalStage();
+
+  void stopRemoteStage();
+
+  //---------------------------------------------------------------------------
+
+  // relayRemotePacket
+
+  // Queues a packet received from a remote group for local rebroadcast:
+
+  // drops duplicates, adds this relay's hop, trace arrival and priority
+
+  //
+
+  // @pre:   packet has valid packet format and is MAX_PACKET_SIZE bytes long
+
+  // @post:  packet holds this relay's hop if it was queued
+
+  // @param  remoteGroupID: The peer it came from
+
+  // @param  packet:        The packet, modified in place
+
+  // @param  arrivalUs:     monotonicMicros() when the packet was received
+
+  // @returns bool:         False if the packet was dropped
+
+  //---------------------------------------------------------------------------
+
+  bool relayRemotePacket(const string& remoteGroupID, char* packet,
+
+      long long arrivalUs);
+
+  //---------------------------------------------------------------------------
+
+  // relayLocalPacket
+
+  // Sends a packet that originated in the local group to all remote groups:
+
+  // drops duplicates, adds this relay's hop, priority and trace sampling,
+
+  // then queues it for every connection
+
+  //
+
+  // @pre:   packet has valid packet format and is capacity bytes long
+
+  // @post:  packet holds this relay's hop if it was relayed
+
+  // @param  packet:    The packet, modified in place
+
+  // @param  capacity:  Size of the packet buffer
+
+  // @param  arrivalUs: monotonicMicros() when the packet was received
+
+  // @returns int:      The packet's priority class, or -1 if it was dropped
+
+  //---------------------------------------------------------------------------
+
+  int relayLocalPacket(char* packet, int capacity, long long arrivalUs);
+
+  //---------------------------------------------------------------------------
+
+  // isDuplicatePacket
+
+  // Checks the header of the packet and returns true if the local group IP
+
+  // (version 1) or node ID (version 2) is already contained in the header (a
+
+  // duplicate message), false otherwise
+
+  //
+
+  // @pre:   currentPacket parameter is of the correct packet format
+
+  // @post:  None
+
+  // @param  currentPacket: The packet received via UDP or TCP
+
+  // @returns bool:         True if the current UdpRelay's IP is contained in
+
+  //                        the packet header, false otherwise
+
+  //---------------------------------------------------------------------------
+
+  bool isDuplicatePacket(char* currentPacket);
+
+  //---------------------------------------------------------------------------
+
+  // putIPIntoPacket
+
+  // Takes a char* packet passed as parameter and adds group IP address of the
+
+  // current UdpRelay node into the header in the format of a single byte for
+
+  // each 3-digit portion of the IP, then increments the "hop" number. While
+
+  // version 2 headers are offered, a version 1 packet is first converted and
+
+  // the node ID is added instead
+
+  //
+
+  // @pre:   currentPacket has valid packet format and is capacity bytes long
+
+  // @post:  None
+
+  // @param  currentPacket: A packet in valid format described in UdpRelay
+
+  //         header
+
+  // @param  capacity:      Size of the packet buffer
+
+  // @returns bool:         False if the hop list is already full (MAX_HOPS or
+
+  //                        MAX_HOPS_V2), in which case the packet is left
+
+  //                        unchanged
+
+  //---------------------------------------------------------------------------
+
+  bool putIPIntoPacket(char* currentPacket, int capacity);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // assignPriority
+
+  // Returns the priority class of a packet. Packets that already carry a
+
+  // non-bulk class keep it; otherwise the class configured for the packet's
+
+  // origin group (if any) is written into the header
+
+  //
+
+  // @pre:   currentPacket has valid packet format and a non-empty hop list
+
+  // @post:  The header's priority bits hold the returned class
+
+  // @param  currentPacket: A packet in valid format described in UdpRelay
+
+  //         header
+
+  // @returns int:          PRIORITY_BULK through PRIORITY_CONTROL
+
+  //---------------------------------------------------------------------------
+
+  int assignPriority(char* currentPacket);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // sampleTrace
+
+  // Adds the per-hop trace extension to a locally received packet if tracing
+
+  // is on and the packet falls on the sampling interval
+
+  //
+
+  // @pre:   currentPacket has valid packet format and this relay's hop entry
+
+  //         and is capacity bytes long
+
+  // @post:  The packet may carry a trace extension with the current time as
+
+  //         its origin
+
+  // @param  currentPacket: A packet received via UDP
+
+  // @param  capacity:      Size of the packet buffer
+
+  //---------------------------------------------------------------------------
+
+  void sampleTrace(char* currentPacket, int capacity);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // recordTrace
+
+  // Adds a traced packet's end-to-end latency to the histogram of its path
+
+  // and keeps its per-hop breakdown among the recent traces
+
+  //
+
+  // @pre:   currentPacket has valid packet format and a trace extension
+
+  // @post:  pathLatency and recentTraces are updated
+
+  // @param  currentPacket: A packet received via TCP, before this relay's hop
+
+  //         is added
+
+  // @param  arrivalUs:     realtimeMicros() when the packet was received
+
+  //---------------------------------------------------------------------------
+
+  void recordTrace(const char* currentPacket, long long arrivalUs);
+
+  //---------------------------------------------------------------------------
+
+  // getIPNumber
+
+  // Returns the group IP number used at command line execution
+
+  //
+
+  // @pre:   ipNumber is not NULL
+
+  // @post:  None
+
+  // @returns char*:  Group IP number
+
+  //---------------------------------------------------------------------------
+
+  char* getIPNumber();
+
+  //---------------------------------------------------------------------------
+
+  // addExpiredOutThread
+
+  // Pushes a socket descriptor that has been closed into the expiredOutThreads
+
+  // queue
+
+  //
+
+  // @pre:   sd is a closed socket descriptor
+
+  // @post:  sd is added to expiredOutThreads
+
+  // @param  sd: a socket descriptor
+
+  //---------------------------------------------------------------------------
+
+  void addExpiredOutThread(int sd);
+
+  //---------------------------------------------------------------------------
+
+  // checkForDuplicateCxn
+
+  // Checks if the remote connection already exists and if it does, it deletes
+
+  // the already existing connection
+
+  //
+
+  // @pre:   string shall be a valid remote group id host name
+
+  // @post:  if a duplicate connection already existed, the previous connection
+
+  //         will be closed and deleted from the connections map. Otherwise,
+
+  //         there are no changes.
+
+  // @param  const string& GRP_ID: remote host name
+
+  //---------------------------------------------------------------------------
+
+  void checkForDuplicateCxn(const string& GRP_ID);
+
+
+
+ private:
+
+  UdpRelay() {}
+
+  //---------------------------------------------------------------------------
+
+  // getArgument
+
+  // Returns the part of a command line starting at index
+
+  //
+
+  // @pre:   0 <= index
+
+  // @post:  None
+
+  // @param  input:   The command line
+
+  // @param  index:   Position of the first character to return
+
+  // @returns string: input from index to the end
+
+  //---------------------------------------------------------------------------
+
+  string getArgument(string input, int index);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // managePeer
+
+  // Remembers a peer so it is reconnected whenever its link fails or drops
+
+  //
+
+  // @pre:   None
+
+  // @post:  The peer is in managedPeers
+
+  // @param  ipAddress: The IP/name the peer was added with
+
+  //---------------------------------------------------------------------------
+
+  void managePeer(const string& ipAddress);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // attachRemoteCxn
+
+  // Starts relaying over a freshly connected socket to a peer: spins up its
+
+  // relayOut and relayEgress threads, updates the tcpCxns map and sends the
+
+  // hostname of this machine with our capabilities to the remote node
+
+  //
+
+  // @pre:   sd is a connected, blocking TCP socket to ipAddress
+
+  // @post:  The connection is registered in tcpCxns
+
+  // @param  ipAddress: The IP/name the peer was added with
+
+  // @param  sd:        The connected socket
+
+  //---------------------------------------------------------------------------
+
+  void attachRemoteCxn(const string& ipAddress, int sd);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // connectPeers
+
+  // Connects to many peers at once: every connect is started without
+
+  // blocking and the sockets are polled together, so bringing up N peers
+
+  // takes at most one timeout rather than N. Each peer becomes managed; one
+
+  // that does not connect in time is retried with backoff like a failed "add"
+
+  //
+
+  // @pre:   timeoutMs > 0
+
+  // @post:  Every peer is connected or has a reconnect scheduled
+
+  // @param  hosts:     The IPs/names of the peers
+
+  // @param  timeoutMs: Time each peer has to accept
+
+  // @returns int:      Peers connected by this call
+
+  //---------------------------------------------------------------------------
+
+  int connectPeers(const vector<string>& hosts, int timeoutMs);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // startConnect
+
+  // Resolves a peer and starts a non-blocking connect to its relay port
+
+  //
+
+  // @pre:   None
+
+  // @post:  The connect is in progress or done on the returned socket
+
+  // @param  host:  The IP/name of the peer
+
+  // @returns int:  The non-blocking socket, NULL_SD on failure
+
+  //---------------------------------------------------------------------------
+
+  int startConnect(const string& host);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // applyConfig
+
+  // Runs a config's commands in file order, then connects its peers in
+
+  // parallel and waits for the quorum
+
+  //
+
+  // @pre:   The relay is running
+
+  // @post:  Every configured peer is connected or being reconnected
+
+  // @param  applied: The config to apply
+
+  //---------------------------------------------------------------------------
+
+  void applyConfig(const RelayConfig& applied);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // checkReady
+
+  // Reports readiness once the configured quorum of peers is connected
+
+  //
+
+  // @pre:   None
+
+  // @post:  ready is true if the quorum is connected
+
+  //---------------------------------------------------------------------------
+
+  void checkReady();
+
+  //---------------------------------------------------------------------------
+
+  // threadAcception
+
+  // Called by acceptThread, loops accepting TCP connection requests. Receives
+
+  // the remote host name, registers the connection and spins up its relayOut
+
+  // and relayEgress threads
+
+  //
+
+  // @pre:   None
+
+  // @post:  tcpCxns, outThreads and egressQueues are updated per connection
+
+  //---------------------------------------------------------------------------
+
+  void threadAcception();
+
+  //---------------------------------------------------------------------------
+
+  // deliverToSubscribers
+
+  // Calls every in-process subscriber with the message of a packet
+
+  //
+
+  // @pre:   packet has valid packet format without a trace extension
+
+  // @post:  None
+
+  // @param  packet: The packet to deliver
+
+  //---------------------------------------------------------------------------
+
+  void deliverToSubscribers(const char* packet);
+
+  //---------------------------------------------------------------------------
+
+  // addWorker
+
+  // Counts a relayOut or relayEgress thread about to be spun up, so stop()
+
+  // can wait for it
+
+  //
+
+  // @pre:   None
+
+  // @post:  liveWorkers is incremented
+
+  //---------------------------------------------------------------------------
+
+  void addWorker();
+
+  //---------------------------------------------------------------------------
+
+  // removeWorker
+
+  // Called by a relayOut or relayEgress thread as its last access to this
+
+  // object
+
+  //
+
+  // @pre:   The thread was counted by addWorker
+
+  // @post:  liveWorkers is decremented and stop() is woken when it reaches 0
+
+  //---------------------------------------------------------------------------
+
+  void removeWorker();
+
+  //---------------------------------------------------------------------------
+
+  // addShmRing
+
+  // Creates the <name>.in queue and <name>.out broadcast ring in shared
+
+  // memory for local clients to attach to
+
+  //
+
+  // @pre:   name is a valid shm_open name without '/'
+
+  // @post:  Both rings exist, or an error is reported to cout
+
+  // @param  name:  Base name of the rings
+
+  // @param  slots: Packets each ring holds
+
+  //---------------------------------------------------------------------------
+
+  void addShmRing(const string& name, int slots);
+
+  //---------------------------------------------------------------------------
+
+  // removeShmRing
+
+  // Stops using a pair of shared memory rings and removes their names
+
+  //
+
+  // @pre:   None
+
+  // @post:  The rings are unmapped and unlinked
+
+  // @param  name: Base name given to addShmRing
+
+  //---------------------------------------------------------------------------
+
+  void removeShmRing(const string& name);
+
+  //---------------------------------------------------------------------------
+
+  // showShmRings
+
+  // Displays every shared memory ring pair and its ingress backlog to cout
+
+  //
+
+  // @pre:   None
+
+  // @post:  None
+
+  //---------------------------------------------------------------------------
+
+  void showShmRings();
+
+  //---------------------------------------------------------------------------
+
+  // showStages
+
+  // Displays the occupancy of every stage ring to cout: bytes and packets
+
+  // held, high-water mark and how often the stage before it had to wait
+
+  //
+
+  // @pre:   None
+
+  // @post:  None
+
+  //---------------------------------------------------------------------------
+
+  void showStages();
+
+  //---------------------------------------------------------------------------
+
+  // showUdpLinks
+
+  // Displays every UDP link to cout: frames sent, resent, received and
+
+  // delivered, the congestion window and the smoothed round trip time
+
+  //
+
+  // @pre:   None
+
+  // @post:  None
+
+  //---------------------------------------------------------------------------
+
+  void showUdpLinks();
+
+  //---------------------------------------------------------------------------
+
+  // showTunnel
+
+  // Displays the tunnel rules, the datagrams sent, and what was received,
+
+  // lost, late, duplicated and dropped from every source to cout
+
+  //
+
+  // @pre:   None
+
+  // @post:  None
+
+  //---------------------------------------------------------------------------
+
+  void showTunnel();
+
+
+
+  //---------------------------------------------------------------------------
+
+  // showRedundancy
+
+  // Displays the redundancy rules and, for every path copies came in over,
+
+  // how often its copy won and how often it lost to cout
+
+  //
+
+  // @pre:   None
+
+  // @post:  None
+
+  //---------------------------------------------------------------------------
+
+  void showRedundancy();
+
+
+
+  //---------------------------------------------------------------------------
+
+  // showConflation
+
+  // Displays the conflation rules and how many queued packets each peer's
+
+  // egress queue replaced with a newer one to cout
+
+  //
+
+  // @pre:   None
+
+  // @post:  None
+
+  //---------------------------------------------------------------------------
+
+  void showConflation();
+
+  //---------------------------------------------------------------------------
+
+  // broadcastToShmRings
+
+  // Copies a packet into every shared memory egress ring
+
+  //
+
+  // @pre:   packet has valid packet format without a trace extension
+
+  // @post:  None
+
+  // @param  packet: The packet to deliver
+
+  //---------------------------------------------------------------------------
+
+  void broadcastToShmRings(const char* packet);
+
+  //---------------------------------------------------------------------------
+
+  // heartbeatThread
+
+  // A static class method that is a thread function for the heartbeat
+
+  // thread. Every heartbeat interval it queues a ping to each peer that
+
+  // understands control frames and evicts peers that have been silent for
+
+  // too many intervals
+
+  //
+
+  // @pre:   *arg parameter represents a valid UdpRelay object
+
+  // @post:  None
+
+  // @param  *arg:  A void pointer to the UdpRelay object creating the thread
+
+  //---------------------------------------------------------------------------
+
+  static void* heartbeatThread(void *arg);
+
+  //---------------------------------------------------------------------------
+
+  // registerPeer
+
+  // Starts tracking the health of a newly registered connection
+
+  //
+
+  // @pre:   None
+
+  // @post:  The peer has a fresh peerHealth entry
+
+  // @param  remoteGroupID: The tcpCxns key of the connection
+
+  // @param  capable:       True if the peer is known to accept control frames
+
+  //---------------------------------------------------------------------------
+
+  void registerPeer(const string& remoteGroupID, bool capable);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // heardCell
+
+  // Returns the word a peer's relayOut threads store the time of its last
+
+  // frame in
+
+  //
+
+  // @pre:   cxnLock is held
+
+  // @post:  heardTimes has an entry for remoteGroupID
+
+  // @param  remoteGroupID: The tcpCxns key of the connection
+
+  // @returns volatile long long*: The peer's word in heardTimes
+
+  //---------------------------------------------------------------------------
+
+  volatile long long* heardCell(const string& remoteGroupID);
+
+
+
+  //A relayEgress thread's copy of its connection and peerHealth entry,
+
+  //refreshed only when peerGeneration moves
+
+  struct peerView {
+
+    int generation;           //peerGeneration the copy was taken at
+
+    int sd;                   //tcpCxns entry, NULL_SD if none
+
+    int headerVersion;        //Header version sent to the peer
+
+    bool capable;             //Peer accepts control frames
+
+    bool jumbo;               //Peer accepts jumbo and fragment frames
+
+    bool trace;               //Peer parses the trace extension
+
+    bool priority;            //Peer reads priority bits
+
+  };
+
+
+
+  //---------------------------------------------------------------------------
+
+  // readPeerView
+
+  // Copies a connection's socket and negotiated settings for its relayEgress
+
+  // thread, if they changed since the copy was taken
+
+  //
+
+  // @pre:   None
+
+  // @post:  view matches tcpCxns and peers as of view.generation
+
+  // @param  remoteGroupID: The tcpCxns key of the connection
+
+  // @param  view:          The egress thread's copy
+
+  //---------------------------------------------------------------------------
+
+  void readPeerView(const string& remoteGroupID, peerView& view);
+
+  //---------------------------------------------------------------------------
+
+  // queueControlFrame
+
+  // Queues a control frame on a connection's egress queue at control
+
+  // priority
+
+  //
+
+  // @pre:   None
+
+  // @post:  The frame is queued if the connection has an egress queue
+
+  // @param  remoteGroupID: The tcpCxns key of the connection
+
+  // @param  type:          CONTROL_HELLO, CONTROL_PING or CONTROL_PONG
+
+  // @param  sequence:      Sequence number
+
+  // @param  timestampUs:   Timestamp to carry
+
+  //---------------------------------------------------------------------------
+
+  void queueControlFrame(const string& remoteGroupID, int type,
+
+      unsigned int sequence, long long timestampUs);
+
+  //---------------------------------------------------------------------------
+
+  // handleControlFrame
+
+  // Acts on a control frame received from a peer: a hello marks the peer as
+
+  // accepting control frames, a ping is answered, a pong updates the RTT
+
+  //
+
+  // @pre:   ControlFrame::isControl(frame)
+
+  // @post:  The peer's health entry is updated
+
+  // @param  remoteGroupID: The tcpCxns key of the connection
+
+  // @param  frame:         The frame received
+
+  //---------------------------------------------------------------------------
+
+  void handleControlFrame(const string& remoteGroupID, const char* frame);
+
+  //---------------------------------------------------------------------------
+
+  // setHeartbeat
+
+  // Changes the heartbeat interval and the number of silent intervals after
+
+  // which a peer is evicted
+
+  //
+
+  // @pre:   intervalMs >= 0, misses > 0
+
+  // @post:  The heartbeat thread uses the new values; 0 stops heartbeats
+
+  // @param  intervalMs: Interval between heartbeats, 0 to turn them off
+
+  // @param  misses:     Silent intervals tolerated before eviction
+
+  //---------------------------------------------------------------------------
+
+  void setHeartbeat(int intervalMs, int misses);
+
+  //---------------------------------------------------------------------------
+
+  // reconnectThread
+
+  // A static class method that is a thread function for a reconnect thread,
+
+  // which spins up when the connection to a managed peer fails. Retries the
+
+  // connection after randomized, exponentially growing delays until it
+
+  // succeeds, the peer is deleted or the relay stops
+
+  //
+
+  // @pre:   *arg parameter represents a valid reconnectThreadInfo struct
+
+  // @post:  The peer is connected, deleted, or the relay is stopping
+
+  // @param  *arg:  Pointer to the reconnectThreadInfo struct
+
+  //---------------------------------------------------------------------------
+
+  static void* reconnectThread(void *arg);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // reloadThread
+
+  // A static class method that is a thread function for a reload started by
+
+  // SIGHUP, so the heartbeat thread does not wait for peers to connect
+
+  //
+
+  // @pre:   *arg parameter represents a valid UdpRelay object
+
+  // @post:  The config file has been reloaded
+
+  // @param  *arg:  A void pointer to the UdpRelay object
+
+  //---------------------------------------------------------------------------
+
+  static void* reloadThread(void *arg);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // hangupHandler
+
+  // SIGHUP handler; counts the signal for the heartbeat threads to see
+
+  //
+
+  // @pre:   None
+
+  // @post:  hangups is incremented
+
+  // @param  signal: SIGHUP
+
+  //---------------------------------------------------------------------------
+
+  static void hangupHandler(int signal);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // revertCommand
+
+  // Returns the console command that puts a setting back to its default
+
+  //
+
+  // @pre:   None
+
+  // @post:  None
+
+  // @param  key:     A setting, as returned by RelayConfig::getKey
+
+  // @returns string: The command, or "" if the setting has no default to
+
+  //                  return to
+
+  //---------------------------------------------------------------------------
+
+  string revertCommand(const string& key);
+
+  //---------------------------------------------------------------------------
+
+  // packHandoff
+
+  // Serializes the listening and multicast sockets and every link and
+
+  // managed peer for handOff
+
+  //
+
+  // @pre:   The relay threads have stopped
+
+  // @post:  fds holds the sockets the state refers to, by index
+
+  // @param  fds:     Receives the sockets to pass
+
+  // @returns string: The state
+
+  //---------------------------------------------------------------------------
+
+  string packHandoff(vector<int>& fds);
+
+  //---------------------------------------------------------------------------
+
+  // takeOver
+
+  // Receives the state and sockets of a relay running handOff and keeps them
+
+  // for start()
+
+  //
+
+  // @pre:   Called from the constructor, before any socket is opened
+
+  // @post:  listenSd, localRecvSd and adoptedPeers hold what was passed if
+
+  //         true is returned
+
+  // @param  path:  The old relay's handoff socket
+
+  // @returns bool: False if nothing or a malformed state was received
+
+  //---------------------------------------------------------------------------
+
+  bool takeOver(const string& path);
+
+  //---------------------------------------------------------------------------
+
+  // adoptPeers
+
+  // Resumes relaying on the links taken over from the old relay: restores
+
+  // each peer's state and backlog and spins up its relayOut and relayEgress
+
+  // threads without a new handshake
+
+  //
+
+  // @pre:   The relay is running
+
+  // @post:  adoptedPeers is empty
+
+  //---------------------------------------------------------------------------
+
+  void adoptPeers();
+
+  //---------------------------------------------------------------------------
+
+  // adminThread
+
+  // A static class method that is a thread function for the admin socket:
+
+  // accepts clients, reads their requests and writes out their replies
+
+  //
+
+  // @pre:   *arg parameter represents a valid UdpRelay object
+
+  // @post:  stopAdmin has been called
+
+  // @param  *arg:  A void pointer to the UdpRelay object
+
+  //---------------------------------------------------------------------------
+
+  static void* adminThread(void *arg);
+
+  //---------------------------------------------------------------------------
+
+  // handleAdminRequest
+
+  // Carries out one admin request and queues its reply (see startAdmin)
+
+  //
+
+  // @pre:   Called from the admin thread
+
+  // @post:  The reply is queued, or will be by an adminBatchThread
+
+  // @param  request: The client and its request line
+
+  //---------------------------------------------------------------------------
+
+  void handleAdminRequest(const AdminRequest& request);
+
+  //---------------------------------------------------------------------------
+
+  // adminBatchThread
+
+  // A static class method that is a thread function for an admin "add",
+
+  // which connects the hosts in parallel and then replies with their state
+
+  //
+
+  // @pre:   *arg parameter represents a valid adminBatchInfo object
+
+  // @post:  The reply is queued and *arg is deleted
+
+  // @param  *arg:  A void pointer to an adminBatchInfo
+
+  //---------------------------------------------------------------------------
+
+  static void* adminBatchThread(void *arg);
+
+  //---------------------------------------------------------------------------
+
+  // notifyAdmins
+
+  // Sends an event line to the admin clients that subscribed
+
+  //
+
+  // @pre:   None
+
+  // @post:  "* event" is queued for each subscriber
+
+  // @param  event: "up NAME", "down NAME" or "ready"
+
+  //---------------------------------------------------------------------------
+
+  void notifyAdmins(const string& event);
+
+  //---------------------------------------------------------------------------
+
+  // addCounters
+
+  // Creates the counter block for a relay thread
+
+  //
+
+  // @pre:   Called by the thread that will count with it
+
+  // @post:  Scrapes include the block until retireCounters
+
+  // @param  direction:      "received" or "sent"
+
+  // @param  peer:           The peer, or "local" for the local group
+
+  // @returns CounterBlock*: The thread's block
+
+  //---------------------------------------------------------------------------
+
+  CounterBlock* addCounters(const string& direction, const string& peer);
+
+  //---------------------------------------------------------------------------
+
+  // retireCounters
+
+  // Folds an exiting thread's counts into the totals kept for its peer, so
+
+  // counters do not go back when a link is re-established
+
+  //
+
+  // @pre:   counters was returned by addCounters
+
+  // @post:  counters is deleted
+
+  // @param  counters: The exiting thread's block
+
+  //---------------------------------------------------------------------------
+
+  void retireCounters(CounterBlock* counters);
+
+  //---------------------------------------------------------------------------
+
+  // metricsRenderer
+
+  // A static class method that is the MetricsRenderer for the metrics server
+
+  //
+
+  // @pre:   *context represents a valid UdpRelay object
+
+  // @post:  body holds the metrics
+
+  // @param  body:     Receives the response body
+
+  // @param  *context: A void pointer to the UdpRelay object
+
+  //---------------------------------------------------------------------------
+
+  static void metricsRenderer(string& body, void* context);
+
+  //---------------------------------------------------------------------------
+
+  // renderMetrics
+
+  // Writes the metrics in the Prometheus text format
+
+  //
+
+  // @pre:   None
+
+  // @post:  body holds the metrics
+
+  // @param  body: Receives the metrics
+
+  //---------------------------------------------------------------------------
+
+  void renderMetrics(string& body);
+
+  //---------------------------------------------------------------------------
+
+  // udpLinkThread
+
+  // A static class method that is a thread function for the UDP link socket.
+
+  // It hands every datagram to the link of the address it came from, making
+
+  // a link for a peer that is new, and lets every link resend what timed
+
+  // out, until stopUdpLinks
+
+  //
+
+  // @pre:   *arg parameter represents a valid UdpRelay object
+
+  // @post:  None
+
+  // @param  *arg:  A void pointer to the UdpRelay object creating the thread
+
+  //---------------------------------------------------------------------------
+
+  static void* udpLinkThread(void *arg);
+
+  //---------------------------------------------------------------------------
+
+  // udpLinkEgressThread
+
+  // A static class method that is a thread function for a UDP link's egress
+
+  // thread. It pops packets from the link's egress queue in priority order
+
+  // and sends each one on the stream of its origin group, waiting while the
+
+  // congestion window is full
+
+  //
+
+  // @pre:   *arg parameter represents a valid udpLinkPeer
+
+  // @post:  Deletes the queue, the link and the udpLinkPeer when the queue is
+
+  //         closed
+
+  // @param  *arg:  A void pointer to the udpLinkPeer
+
+  //---------------------------------------------------------------------------
+
+  static void* udpLinkEgressThread(void *arg);
+
+  //---------------------------------------------------------------------------
+
+  // deliverLinkFrame
+
+  // UdpLinkDelivery of every link: hands a received packet to the remote
+
+  // stage through the link's peer ring
+
+  //
+
+  // @pre:   Called by the UDP link thread, the ring's only producer
+
+  // @post:  None
+
+  // @param  frame:   The packet
+
+  // @param  length:  Its length
+
+  // @param  context: The udpLinkPeer
+
+  // @returns bool:   False if the ring is full, so the link offers it again
+
+  //                  and the peer's window stops growing
+
+  //---------------------------------------------------------------------------
+
+  static bool deliverLinkFrame(const char* frame, int length, void* context);
+
+  //---------------------------------------------------------------------------
+
+  // openUdpLink
+
+  // Creates the link to a peer with its peer ring, egress queue and egress
+
+  // thread
+
+  //
+
+  // @pre:   udpLinkLock is held and udpLinkSd is open
+
+  // @post:  udpLinks and egressQueues hold the link
+
+  // @param  name:    The link's name, "udp:IP:port"
+
+  // @param  address: The peer's UDP link address
+
+  // @returns UdpLink*: The new link
+
+  //---------------------------------------------------------------------------
+
+  UdpLink* openUdpLink(const string& name, const struct sockaddr_in& address);
+
+  //---------------------------------------------------------------------------
+
+  // stopUdpLinks
+
+  // Stops the UDP link thread, closes every link and the socket
+
+  //
+
+  // @pre:   None
+
+  // @post:  udpLinks is empty; the links' egress threads exit on their own
+
+  //---------------------------------------------------------------------------
+
+  void stopUdpLinks();
+
+  //---------------------------------------------------------------------------
+
+  // udpLinkName
+
+  // Returns the name of the link to an address
+
+  //
+
+  // @pre:   None
+
+  // @post:  None
+
+  // @param  address: The peer's UDP link address
+
+  // @returns string: "udp:IP:port"
+
+  //---------------------------------------------------------------------------
+
+  static string udpLinkName(const struct sockaddr_in& address);
+
+  //---------------------------------------------------------------------------
+
+  // tunnelPacket
+
+  // Sends a packet to every UDP link peer as a tunnel datagram
+
+  //
+
+  // @pre:   packet has valid packet format
+
+  // @post:  None
+
+  // @param  packet: The packet
+
+  // @param  group:  Its origin group
+
+  // @param  mode:   TUNNEL_UNRELIABLE or TUNNEL_ORDERED
+
+  // @returns bool:  False if UDP links are off or the packet does not fit in
+
+  //                 a datagram, so it goes over the links instead
+
+  //---------------------------------------------------------------------------
+
+  bool tunnelPacket(const char* packet, unsigned int group, int mode);
+
+  //---------------------------------------------------------------------------
+
+  // receiveTunneled
+
+  // Accounts for a tunnel datagram and hands its packet to the remote stage
+
+  // unless it is dropped
+
+  //
+
+  // @pre:   Called by the UDP link thread, tunnelRing's only producer
+
+  // @post:  None
+
+  // @param  datagram: A tunnel datagram
+
+  // @param  length:   Its length
+
+  // @param  from:     Address it came from
+
+  //---------------------------------------------------------------------------
+
+  void receiveTunneled(const char* datagram, int length,
+
+      const struct sockaddr_in& from);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // getRedundantPath
+
+  // Returns the path a peer is for an origin group with a redundancy rule
+
+  //
+
+  // @pre:   None
+
+  // @post:  None
+
+  // @param  group:         The origin group
+
+  // @param  remoteGroupID: The egressQueues key of the peer
+
+  // @returns int:          The peer's index in the group's paths, -1 if it
+
+  //                        is not one of them
+
+  //---------------------------------------------------------------------------
+
+  int getRedundantPath(unsigned int group, const string& remoteGroupID);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // redundantPathName
+
+  // Returns the name a redundant copy's path is counted under in redundancy
+
+  //
+
+  // @pre:   None
+
+  // @post:  None
+
+  // @param  remoteGroupID: The link the copy came in on
+
+  // @param  path:          The sender's index of the path, from its
+
+  //                        redundant frame
+
+  // @returns string:       "link path index"
+
+  //---------------------------------------------------------------------------
+
+  static string redundantPathName(const string& remoteGroupID,
+
+      unsigned int path);
+
+  //---------------------------------------------------------------------------
+
+  // fanoutTask
+
+  // Pool task: queues a packet on the egress queues of the shard's peers and
+
+  // frees it once every shard has done so
+
+  //
+
+  // @pre:   Runs on the shard's strand
+
+  // @post:  The packet is queued on, or dropped by, each of the shard's peers
+
+  // @param  *context:  A void pointer to the fanoutPacket
+
+  // @param  *argument: The shard, cast to a pointer
+
+  //---------------------------------------------------------------------------
+
+  static void fanoutTask(void* context, void* argument);
+
+  //---------------------------------------------------------------------------
+
+  // addFanoutPeer / removeFanoutPeer
+
+  // Put a peer's egress queue on the fan-out shard with the fewest peers, or
+
+  // wait for its shard to run the tasks already handed to it and take the
+
+  // peer off, so its queue can be closed
+
+  //
+
+  // @pre:   cxnLock and fanoutLock are held
+
+  // @post:  fanoutPeers holds the peer, or no longer does
+
+  // @param  remoteGroupID: The egressQueues key
+
+  // @param  queue:         Its egress queue
+
+  //---------------------------------------------------------------------------
+
+  void addFanoutPeer(const string& remoteGroupID, PacketQueue* queue);
+
+  void removeFanoutPeer(const string& remoteGroupID);
+
+  //---------------------------------------------------------------------------
+
+  // flushFanout
+
+  // Waits for the fan-out pool to queue every packet handed to it and drops
+
+  // every peer from the shards, so their egress queues can be closed
+
+  //
+
+  // @pre:   fanoutLock is held
+
+  // @post:  fanoutPeers is empty
+
+  //---------------------------------------------------------------------------
+
+  void flushFanout();
+
+  //---------------------------------------------------------------------------
+
+  // scheduleReconnect
+
+  // Starts a reconnect thread for a managed peer unless one is running
+
+  //
+
+  // @pre:   None
+
+  // @post:  A reconnect thread is running if the peer is managed
+
+  // @param  remoteGroupID: The IP the peer was added with
+
+  //---------------------------------------------------------------------------
+
+  void scheduleReconnect(const string& remoteGroupID);
+
+  //---------------------------------------------------------------------------
+
+  // setStoreForward
+
+  // Sets how much traffic is buffered for a managed peer while it is down
+
+  // and how fast it is replayed afterwards. The packet limit and rate apply
+
+  // to current backlogs as well; the spill directory to backlogs created
+
+  // from now on.
+
+  //
+
+  // @pre:   None
+
+  // @post:  The settings are updated, or an error is reported to cout
+
+  // @param  packets:   Packets buffered in memory per peer
+
+  // @param  rate:      Backlog packets replayed per second after a reconnect
+
+  // @param  directory: Directory for spill files, or "" for none
+
+  //---------------------------------------------------------------------------
+
+  void setStoreForward(int packets, int rate, const string& directory);
+
+  //---------------------------------------------------------------------------
+
+  // createBacklog
+
+  // Creates the store-and-forward backlog of a managed peer's relayEgress
+
+  // thread with the current settings, or takes the one passed on for it by
+
+  // the relay this one replaced
+
+  //
+
+  // @pre:   None
+
+  // @post:  The backlog is registered with the peer for "show"
+
+  // @param  remoteGroupID:  The IP the peer was added with
+
+  // @returns StoreForward*: The backlog, owned by the caller
+
+  //---------------------------------------------------------------------------
+
+  StoreForward* createBacklog(const string& remoteGroupID);
+
+  //---------------------------------------------------------------------------
+
+  // releaseBacklog
+
+  // Unregisters and deletes a backlog created by createBacklog
+
+  //
+
+  // @pre:   backlog was returned by createBacklog(remoteGroupID)
+
+  // @post:  Packets still held are discarded
+
+  // @param  remoteGroupID: The IP the peer was added with
+
+  // @param  backlog:       The backlog to delete
+
+  //---------------------------------------------------------------------------
+
+  void releaseBacklog(const string& remoteGroupID, StoreForward* backlog);
+
+  //---------------------------------------------------------------------------
+
+  // setJournal
+
+  // Starts journaling every relayed packet into a directory, or stops it
+
+  //
+
+  // @pre:   None
+
+  // @post:  The journal is open on directory, or closed if directory is ""
+
+  // @param  directory: Journal directory, or "" to stop journaling
+
+  // @param  segmentMB: Size of each preallocated segment file
+
+  // @param  commitMs:  Longest a record waits to be flushed to disk
+
+  //---------------------------------------------------------------------------
+
+  void setJournal(const string& directory, int segmentMB, int commitMs);
+
+  //---------------------------------------------------------------------------
+
+  // journalPacket
+
+  // Appends a packet to the journal if journaling is on
+
+  //
+
+  // @pre:   packet has valid packet format
+
+  // @post:  The packet is journaled
+
+  // @param  direction: JOURNAL_LOCAL or JOURNAL_REMOTE
+
+  // @param  packet:    The packet as relayed
+
+  //---------------------------------------------------------------------------
+
+  void journalPacket(int direction, const char* packet);
+
+  //---------------------------------------------------------------------------
+
+  // replayThread
+
+  // A static class method that is a thread function for a journal replay.
+
+  // Reads the journal in order, waits until each record is due and
+
+  // re-injects it
+
+  //
+
+  // @pre:   *arg parameter represents a valid replayThreadInfo struct
+
+  // @post:  The range has been replayed or the relay is stopping
+
+  // @param  *arg:  Pointer to the replayThreadInfo struct
+
+  //---------------------------------------------------------------------------
+
+  static void* replayThread(void *arg);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // startCapture
+
+  // Starts mirroring relayed packets into a pcapng file. Packets are copied
+
+  // into a lock-free tap ring by the threads that relay them and written by
+
+  // the capture thread, so a slow disk drops captured packets rather than
+
+  // delaying traffic
+
+  //
+
+  // @pre:   None
+
+  // @post:  The capture thread writes to path if true is returned
+
+  // @param  path:   File to create
+
+  // @param  sample: Capture one packet in sample, 1 = every packet
+
+  // @param  peer:   Only packets to or from this peer ("local" for the local
+
+  //                 group), or "" for all
+
+  // @param  group:  Only packets that originated in this group, 0 for all
+
+  // @returns bool:  False if a capture is running or the file or ring could
+
+  //                 not be created
+
+  //---------------------------------------------------------------------------
+
+  bool startCapture(const string& path, int sample, const string& peer,
+
+      unsigned int group);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // stopCapture
+
+  // Stops the capture, writes what the tap ring holds and closes the file
+
+  //
+
+  // @pre:   None
+
+  // @post:  capturing is false and the capture thread has exited
+
+  //---------------------------------------------------------------------------
+
+  void stopCapture();
+
+
+
+  //---------------------------------------------------------------------------
+
+  // capturePacket
+
+  // Copies a packet into the tap ring if it passes the sample and filters.
+
+  // Callers test capturing first, so the relay pays one branch when off
+
+  //
+
+  // @pre:   packet has valid packet format
+
+  // @post:  The packet is queued for the capture file or counted as dropped
+
+  // @param  inbound: True if this relay received the packet
+
+  // @param  peer:    Remote group the packet came from or went to, or "local"
+
+  // @param  packet:  The packet
+
+  //---------------------------------------------------------------------------
+
+  void capturePacket(bool inbound, const string& peer, const char* packet);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // captureThread
+
+  // A static class method that is a thread function for the capture thread.
+
+  // Drains the tap ring into the capture file until the capture stops
+
+  //
+
+  // @pre:   *arg parameter represents a valid UdpRelay object
+
+  // @post:  Every packet in the tap ring has been written
+
+  // @param  *arg:  A void pointer to the UdpRelay object creating the thread
+
+  //---------------------------------------------------------------------------
+
+  static void* captureThread(void *arg);
+
+  //---------------------------------------------------------------------------
+
+  // setHeaderVersion
+
+  // Changes the header version offered to peers that connect from now on and,
+
+  // while no connection is open, this relay's node ID
+
+  //
+
+  // @pre:   version is 1, 2 or 3
+
+  // @post:  New connections negotiate at most version; the node ID is changed
+
+  //         if true is returned
+
+  // @param  version: 3 to also offer Bloom filter headers, 2 to offer node ID
+
+  //                  headers, 1 to send addresses only
+
+  // @param  node:    New node ID (1-65535), or 0 to keep the current one
+
+  // @returns bool:   False if a node ID was given while connections are open
+
+  //                  or the ID is bound to another relay
+
+  //---------------------------------------------------------------------------
+
+  bool setHeaderVersion(int version, unsigned int node);
+
+  //---------------------------------------------------------------------------
+
+  // negotiateHeader
+
+  // Decides the header version of a connection from what the peer announced.
+
+  // Version 2 is used if both sides offer it and learnNode binds the peer's
+
+  // node ID to its group address. Version 3 additionally needs both sides to
+
+  // offer Bloom filters.
+
+  //
+
+  // @pre:   The peer has a peerHealth entry
+
+  // @post:  The peer's headerVersion, nodeId and extension flags are set
+
+  // @param  remoteGroupID: The tcpCxns key of the connection
+
+  // @param  capabilities:  CAPABILITY_* bits the peer announced
+
+  // @param  node:          The peer's node ID
+
+  // @param  group:         The peer's group IP, packed; 0 if not announced
+
+  // @returns int:          The header version the connection uses
+
+  //---------------------------------------------------------------------------
+
+  int negotiateHeader(const string& remoteGroupID, unsigned int capabilities,
+
+      unsigned int node, unsigned int group);
+
+  //---------------------------------------------------------------------------
+
+  // learnNode
+
+  // Binds a relay's node ID to its group address and passes a new binding on
+
+  // to every version 2 peer but the one it came from, so each relay learns
+
+  // the IDs of the whole mesh. An ID two relays claim stays with the larger
+
+  // group address: a binding that loses is answered with the one that wins,
+
+  // and if this relay loses its own ID it takes a free one and announces it
+
+  // with a hello to every peer.
+
+  //
+
+  // @pre:   nodeLock and cxnLock are not held
+
+  // @post:  nodeAddresses and addressNodes hold the winning binding
+
+  // @param  remoteGroupID: The tcpCxns key of the peer that announced it
+
+  // @param  node:          The relay's node ID
+
+  // @param  group:         The relay's group IP, packed
+
+  // @returns bool:         True if node is now bound to group
+
+  //---------------------------------------------------------------------------
+
+  bool learnNode(const string& remoteGroupID, unsigned int node,
+
+      unsigned int group);
+
+  //---------------------------------------------------------------------------
+
+  // capabilitiesFor
+
+  // Returns the capabilities to announce for a header version
+
+  //
+
+  // @pre:   None
+
+  // @post:  None
+
+  // @param  version:   1, 2 or 3
+
+  // @returns unsigned: CAPABILITY_CONTROL, CAPABILITY_JUMBO,
+
+  //                    CAPABILITY_TRACE, CAPABILITY_PRIORITY and the
+
+  //                    CAPABILITY_HEADER_* bits of version and every version
+
+  //                    below it
+
+  //---------------------------------------------------------------------------
+
+  unsigned int capabilitiesFor(int version);
+
+  //---------------------------------------------------------------------------
+
+  // setBloomFilter
+
+  // Offers version 3 headers to peers that connect from now on and sets the
+
+  // filter packets get when this relay converts them
+
+  //
+
+  // @pre:   None
+
+  // @post:  headerVersion is 3 if true is returned
+
+  // @param  bytes:  Filter size, 32 to 64 in steps of 8
+
+  // @param  hashes: Bits set per node ID, 0 to pick the best for ttl relays
+
+  // @param  ttl:    Relays a packet may pass once converted, 1 to 255
+
+  // @returns bool:  False if a value is out of range
+
+  //---------------------------------------------------------------------------
+
+  bool setBloomFilter(int bytes, int hashes, int ttl);
+
+  //---------------------------------------------------------------------------
+
+  // showHeader
+
+  // Displays the header version offered, the node ID and, in Bloom filter
+
+  // mode, the filter's false positive rate at a few path lengths
+
+  //
+
+  // @pre:   None
+
+  // @post:  None
+
+  //---------------------------------------------------------------------------
+
+  void showHeader();
+
+  //---------------------------------------------------------------------------
+
+  // setPayload
+
+  // Sets the largest message the relay accepts and the size above which
+
+  // packets are split into fragments on the local group and on links
+
+  //
+
+  // @pre:   None
+
+  // @post:  maxPayload and fragmentSize are set if true is returned
+
+  // @param  payload:  Largest message, 1 to MAX_PAYLOAD bytes
+
+  // @param  fragment: Largest datagram on the local group, MIN_FRAGMENT_SIZE
+
+  //                   to MAX_DATAGRAM_SIZE, or 0 to only fragment what does
+
+  //                   not fit in a datagram
+
+  // @returns bool:    False if a value is out of range
+
+  //---------------------------------------------------------------------------
+
+  bool setPayload(int payload, int fragment);
+
+  //---------------------------------------------------------------------------
+
+  // showPayload
+
+  // Displays the payload and fragment sizes and the reassembly counters
+
+  //
+
+  // @pre:   None
+
+  // @post:  None
+
+  //---------------------------------------------------------------------------
+
+  void showPayload();
+
+  //This relay's node ID and the filter geometry of packets it converts to
+
+  //version 3, published whole through identity so readers never see half of
+
+  //a change
+
+  struct nodeIdentity {
+
+    unsigned short nodeId;    //This relay's ID in version 2 and 3 headers
+
+    int bloomWords;           //Filter size in BLOOM_WORD_SIZE words
+
+    int bloomHashes;          //Bits per node ID in the filter
+
+    unsigned long long bloomMask[MAX_BLOOM_WORDS]; //nodeId's bits in it
+
+  };
+
+
+
+  //---------------------------------------------------------------------------
+
+  // publishIdentity
+
+  // Makes a new node ID and filter geometry current, with the ID's filter
+
+  // bits worked out once
+
+  //
+
+  // @pre:   nodeLock is held, or the relay is being constructed
+
+  // @post:  identity points at the new identity; the old one stays readable
+
+  //         until the relay is destroyed
+
+  // @param  node:   This relay's node ID
+
+  // @param  words:  Filter size in BLOOM_WORD_SIZE words
+
+  // @param  hashes: Bits per node ID in the filter
+
+  //---------------------------------------------------------------------------
+
+  void publishIdentity(unsigned short node, int words, int hashes);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // getBloomMask
+
+  // Returns this relay's filter bits for the geometry of a version 3 packet
+
+  //
+
+  // @pre:   getVersion(packet) == 3
+
+  // @post:  None
+
+  // @param  self:    The identity read for this packet
+
+  // @param  packet:  The packet to check or add to
+
+  // @param  scratch: MAX_BLOOM_WORDS words used if the packet's geometry
+
+  //                  differs from this relay's
+
+  // @returns unsigned long long*: The mask
+
+  //---------------------------------------------------------------------------
+
+  const unsigned long long* getBloomMask(const nodeIdentity* self,
+
+      const char* packet, unsigned long long* scratch);
+
+  //---------------------------------------------------------------------------
+
+  // nodeForAddress / addressForNode
+
+  // Translates between group addresses and node IDs: through the bindings
+
+  // learnNode made, else through the low 16 bits of the address, which
+
+  // is how node IDs are assigned by default
+
+  //
+
+  // @pre:   None
+
+  // @post:  None
+
+  // @param  address: A group IP, packed
+
+  // @param  node:    A node ID
+
+  //---------------------------------------------------------------------------
+
+  unsigned short nodeForAddress(unsigned int address);
+
+  unsigned int addressForNode(unsigned int node);
+
+  //---------------------------------------------------------------------------
+
+  // convertHeader
+
+  // Copies a packet into the given header version. Going to version 1, the
+
+  // oldest hops are left out if the hop list would not fit otherwise. Going
+
+  // from version 3, the hop list is rebuilt from the origin, the relays this
+
+  // relay knows that are in the filter, and this relay.
+
+  //
+
+  // @pre:   packet has valid packet format; out is MAX_PACKET_SIZE bytes
+
+  // @post:  out holds the packet in version if true is returned
+
+  // @param  packet:  The packet to convert
+
+  // @param  out:     Receives the converted packet
+
+  // @param  version: 1, 2 or 3
+
+  // @returns bool:   False if the message does not fit
+
+  //---------------------------------------------------------------------------
+
+  bool convertHeader(const char* packet, char* out, int version);
+
+  //---------------------------------------------------------------------------
+
+  // convertFromBloom
+
+  // Writes a version 3 packet as version 1 or 2. Since the filter cannot be
+
+  // listed, the hop list holds the origin, every relay bound at handshake
+
+  // whose bits are in the filter, and this relay last. The next relay is one
+
+  // of the bound ones, so it still finds itself if the packet loops back to
+
+  // it.
+
+  //
+
+  // @pre:   getVersion(packet) == 3; out is MAX_PACKET_SIZE bytes
+
+  // @post:  out holds the packet in version if true is returned
+
+  // @param  packet:  The packet to convert
+
+  // @param  out:     Receives the converted packet
+
+  // @param  version: 1 or 2
+
+  // @returns bool:   False if the message does not fit
+
+  //---------------------------------------------------------------------------
+
+  bool convertFromBloom(const char* packet, char* out, int version);
+
+  //---------------------------------------------------------------------------
+
+  // getOriginGroup
+
+  // Returns the group IP of the relay that first saw a packet, in either
+
+  // header version
+
+  //
+
+  // @pre:   packet has valid packet format
+
+  // @post:  None
+
+  // @param  packet:    The packet to inspect
+
+  // @returns unsigned: The origin group IP packed as by inet_addr in host
+
+  //                    byte order, or 0 if the hop list is empty
+
+  //---------------------------------------------------------------------------
+
+  unsigned int getOriginGroup(const char* packet);
+
+  //---------------------------------------------------------------------------
+
+  // showTCPConnections
+
+  // Displays all open TCP connections, either outgoing or incoming, to cout.
+
+  // If no connections exist, tells user there are no open connections
+
+  //
+
+  // @pre:   None
+
+  // @post:  None
+
+  //---------------------------------------------------------------------------
+
+  void showTCPConnections();
+
+  //---------------------------------------------------------------------------
+
+  // displayHelpMenu
+
+  // Called by commandThread to send all available user commands to cout
+
+  //
+
+  // @pre:   None
+
+  // @post:  None
+
+  //---------------------------------------------------------------------------
+
+  void displayHelpMenu();
+
+  //---------------------------------------------------------------------------
+
+  // setIpChars
+
+  // Takes the group IP number of format (2XX.255.255.255) and puts each set of
+
+  // three numbers into a single char value before storing them in ipChars[]
+
+  //
+
+  // @pre:   ipNumber is of valid format and ipChars is instantiated
+
+  // @post:  ipChars[] array contains the 4-char version of the group IP
+
+  //---------------------------------------------------------------------------
+
+  void setIpChars();
+
+  //---------------------------------------------------------------------------
+
+  // tcpMulticastToRemoteGroups
+
+  // Queues a message on the priority egress queue of every remote node
+
+  // connected to this UdpRelay node; the relayEgress threads send it via TCP
+
+  //
+
+  // @pre:   outPacket has valid packet format
+
+  // @post:  None
+
+  // @param  outPacket: A packet received via UDP to be sent out via TCP
+
+  // @param  arrivalUs: monotonicMicros() when the packet was received
+
+  //---------------------------------------------------------------------------
+
+  void tcpMultiCastToRemoteGroups(char* outPacket, long long arrivalUs);
+
+  //---------------------------------------------------------------------------
+
+  // createUdpRelayServerConnection
+
+  // Called by acceptThread, this method creates a TCP server socket and
+
+  // connects to a TCP client, receives their group name/IP and spins up a
+
+  // relayOut thread before adding the new connection the outThread and
+
+  // outThreadCxns maps
+
+  //
+
+  // @pre:   None
+
+  // @post:  outThread and outThreadCxns maps are updated, a socket is opened
+
+  //---------------------------------------------------------------------------
+
+  void createUdpRelayServerConnection();
+
+  //---------------------------------------------------------------------------
+
+  // terminateAllTcpConnections
+
+  // Closes all open TCP sockets and removes the connection entries from both
+
+  // tcpCxns and outThreadCxns maps
+
+  //
+
+  // @pre:   None
+
+  // @post:  Sockets are closed and both maps have all entries deleted
+
+  //---------------------------------------------------------------------------
+
+  void terminateAllTcpConnections();
+
+
+
+  //---------------------------------------------------------------------------
+
+  // startEgress
+
+  // Creates the priority queue and relayEgress thread for a newly registered
+
+  // TCP connection, replacing any queue left over for the same group. A
+
+  // managed peer that reconnects keeps its queue and backlog instead
+
+  //
+
+  // @pre:   remoteGroupID is the key the connection was stored under in
+
+  //         tcpCxns
+
+  // @post:  egressQueues maps remoteGroupID to a new queue with its own thread
+
+  // @param  remoteGroupID: A valid group IP/Name
+
+  //---------------------------------------------------------------------------
+
+  void startEgress(const string& remoteGroupID);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // stopEgress
+
+  // Closes the priority queue of a connection so its relayEgress thread
+
+  // exits, and removes it from egressQueues
+
+  //
+
+  // @pre:   None
+
+  // @post:  No queue is registered for remoteGroupID
+
+  // @param  remoteGroupID: A valid group IP/Name
+
+  //---------------------------------------------------------------------------
+
+  void stopEgress(const string& remoteGroupID);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // setPriorityRule
+
+  // Assigns a priority class to all untagged packets originating from a
+
+  // group, or removes the rule if className is "none"
+
+  //
+
+  // @pre:   None
+
+  // @post:  priorityRules is updated, or an error is reported to cout
+
+  // @param  groupIP:   Dotted group IP address of the origin group
+
+  // @param  className: bulk, normal, interactive, control or none
+
+  //---------------------------------------------------------------------------
+
+  void setPriorityRule(const string& groupIP, const string& className);
+
+  //---------------------------------------------------------------------------
+
+  // setTunnelRule
+
+  // Sends the packets of an origin group to UDP link peers through the
+
+  // best-effort tunnel instead of their links: no retransmission, and with
+
+  // conflate a receiver drops a packet that arrives after a newer one from
+
+  // the same source. Peers linked only over TCP still get the group over
+
+  // TCP, as do all peers while UDP links are off.
+
+  //
+
+  // @pre:   None
+
+  // @post:  tunnelRules is updated, or an error is reported to cout
+
+  // @param  groupIP: Dotted group IP address of the origin group
+
+  // @param  mode:    unreliable, ordered or none
+
+  //---------------------------------------------------------------------------
+
+  void setTunnelRule(const string& groupIP, const string& mode);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // setRedundancyRule
+
+  // Sends every packet of an origin group over each of several independent
+
+  // paths, tagged with the same message ID, so the receiving relay relays
+
+  // whichever copy arrives first and drops the rest. A path is a peer link
+
+  // (a TCP peer name or "udp:IP:port"); peers not listed get the group
+
+  // untagged as before.
+
+  //
+
+  // @pre:   None
+
+  // @post:  redundancyRules is updated, or an error is reported to cout
+
+  // @param  groupIP: Dotted group IP address of the origin group
+
+  // @param  paths:   The paths' names, or just "none"
+
+  //---------------------------------------------------------------------------
+
+  void setRedundancyRule(const string& groupIP, const vector<string>& paths);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // setConflation
+
+  // Conflates a peer's egress queue: a packet whose key matches one still
+
+  // queued for the peer replaces it, so a peer that cannot keep up gets the
+
+  // latest value of every key instead of a growing backlog. The key is a
+
+  // byte range of the payload, and the packet's origin too if bySource.
+
+  // Applies to the peer's current queue and any it gets later.
+
+  //
+
+  // @pre:   None
+
+  // @post:  conflationRules is updated, or an error is reported to cout
+
+  // @param  remoteGroupID: The egressQueues key of the peer
+
+  // @param  offset:        First payload byte of the key
+
+  // @param  length:        Number of key bytes, 0 turns conflation off
+
+  // @param  bySource:      Key on origin and payload bytes
+
+  //---------------------------------------------------------------------------
+
+  void setConflation(const string& remoteGroupID, int offset, int length,
+
+      bool bySource);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // applyConflation
+
+  // Sets a new egress queue's conflation from its peer's rule
+
+  //
+
+  // @pre:   ruleLock is held
+
+  // @post:  None
+
+  // @param  remoteGroupID: The egressQueues key of the peer
+
+  // @param  queue:         Its egress queue
+
+  //---------------------------------------------------------------------------
+
+  void applyConflation(const string& remoteGroupID, PacketQueue* queue);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // setSchedule
+
+  // Selects strict priority (weights is NULL) or weighted round robin for the
+
+  // rebroadcast queue and every TCP egress queue, current and future
+
+  //
+
+  // @pre:   weights is NULL or holds NUM_PRIORITIES values > 0
+
+  // @post:  All queues use the new scheduling mode
+
+  // @param  weights: Packets each class may send per round, bulk first
+
+  //---------------------------------------------------------------------------
+
+  void setSchedule(const int* weights);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // setQueueCapacity
+
+  // Sets how many packets each priority lane of the rebroadcast queue and
+
+  // every TCP egress queue holds, current and future
+
+  //
+
+  // @pre:   None
+
+  // @post:  All queues use the new capacity, or an error is reported to cout
+
+  // @param  packets: Packets per lane
+
+  //---------------------------------------------------------------------------
+
+  void setQueueCapacity(int packets);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // setTracing
+
+  // Turns per-hop tracing of locally received packets on or off
+
+  //
+
+  // @pre:   sampleRate >= 0
+
+  // @post:  One in sampleRate local packets is traced, none if 0
+
+  // @param  sampleRate: Trace every sampleRate-th packet, 0 to stop tracing
+
+  //---------------------------------------------------------------------------
+
+  void setTracing(int sampleRate);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // showTraces
+
+  // Displays the latency percentiles of every traced path and the per-hop
+
+  // breakdown of the slowest recent traced packets to cout
+
+  //
+
+  // @pre:   None
+
+  // @post:  None
+
+  //---------------------------------------------------------------------------
+
+  void showTraces();
+
+
+
+  //---------------------------------------------------------------------------
+
+  // setLowLatency
+
+  // Turns low-latency mode on or off. In low-latency mode the relay threads
+
+  // poll their sockets and queues instead of blocking, TCP connections use
+
+  // TCP_NODELAY and, if busyPollUs > 0, sockets request SO_BUSY_POLL
+
+  //
+
+  // @pre:   busyPollUs >= 0
+
+  // @post:  The mode is applied to the multicast socket and all connections
+
+  // @param  on:         True to enable low-latency mode
+
+  // @param  busyPollUs: SO_BUSY_POLL budget in microseconds, 0 to leave off
+
+  //---------------------------------------------------------------------------
+
+  void setLowLatency(bool on, int busyPollUs);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // tuneSocket
+
+  // Applies the current low-latency socket options to one socket
+
+  //
+
+  // @pre:   sd is an open socket
+
+  // @post:  TCP_NODELAY and SO_BUSY_POLL reflect the current mode
+
+  // @param  sd: The socket to configure
+
+  //---------------------------------------------------------------------------
+
+  void tuneSocket(int sd);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // setThreadAffinity
+
+  // Pins every thread of a role to a CPU set; threads pick the change up the
+
+  // next time they wake
+
+  //
+
+  // @pre:   None
+
+  // @post:  threadAffinity is updated, or an error is reported to cout
+
+  // @param  role: relayIn, relayOut, egress or rebroadcast
+
+  // @param  spec: A CPU specification accepted by CpuAffinity, or "none"
+
+  //---------------------------------------------------------------------------
+
+  void setThreadAffinity(const string& role, const string& spec);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // setTimestamping
+
+  // Turns SO_TIMESTAMPING off, on with software timestamps, or on with
+
+  // hardware timestamps from a NIC. Receive timestamps are taken on the
+
+  // multicast socket and every TCP connection, transmit timestamps on every
+
+  // TCP connection.
+
+  //
+
+  // @pre:   mode is TIMESTAMPS_OFF, TIMESTAMPS_SOFTWARE or TIMESTAMPS_HARDWARE
+
+  // @post:  All sockets use the new mode, or an error is reported to cout
+
+  // @param  mode:      The timestamping mode
+
+  // @param  interface: NIC to switch to hardware timestamping, if any
+
+  //---------------------------------------------------------------------------
+
+  void setTimestamping(int mode, const string& interface);
+
+
+
+  //One relay thread's latency histograms, indexed by LATENCY_LOCAL_RX etc.
+
+  //Only the owning thread records into them, so recording takes no lock
+
+  struct latencyBlock {
+
+    LatencyHistogram stages[LATENCY_STAGES];
+
+  };
+
+
+
+  //---------------------------------------------------------------------------
+
+  // addLatency
+
+  // Creates the latency histograms for a relay thread
+
+  //
+
+  // @pre:   Called by the thread that will record into them
+
+  // @post:  readLatency includes the block until retireLatency
+
+  // @returns latencyBlock*: The thread's block
+
+  //---------------------------------------------------------------------------
+
+  latencyBlock* addLatency();
+
+
+
+  //---------------------------------------------------------------------------
+
+  // retireLatency
+
+  // Folds an exiting thread's samples into the totals kept for exited
+
+  // threads
+
+  //
+
+  // @pre:   latency was returned by addLatency
+
+  // @post:  latency is deleted
+
+  // @param  latency: The exiting thread's block
+
+  //---------------------------------------------------------------------------
+
+  void retireLatency(latencyBlock* latency);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // readLatency
+
+  // Merges the samples of every relay thread, running or exited, by stage
+
+  //
+
+  // @pre:   totals has LATENCY_STAGES empty histograms
+
+  // @post:  totals[i] holds every sample of stage i
+
+  // @param  totals: Receives the merged histograms
+
+  //---------------------------------------------------------------------------
+
+  void readLatency(LatencyHistogram* totals);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // matchTxTimestamps
+
+  // Reads the transmit timestamps queued on a TCP socket and records, for
+
+  // each send they acknowledge, the time from send() to the kernel/NIC
+
+  // transmit timestamp
+
+  //
+
+  // @pre:   Transmit timestamps are enabled on sd
+
+  // @post:  Matched and older sends are removed from pending
+
+  // @param  sd:       The socket to read
+
+  // @param  pending:  (byte key, realtime at send) of unmatched sends
+
+  // @param  scratch:  Buffer reused between calls
+
+  // @param  transmit: The calling thread's transmit histogram
+
+  //---------------------------------------------------------------------------
+
+  void matchTxTimestamps(int sd, deque<TxTimestamp>& pending,
+
+      vector<TxTimestamp>& scratch, LatencyHistogram& transmit);
+
+
+
+  //---------------------------------------------------------------------------
+
+  // showLatency
+
+  // Displays the kernel receive queueing, relay processing and kernel
+
+  // transmit latency histograms to cout
+
+  //
+
+  // @pre:   None
+
+  // @post:  None
+
+  //---------------------------------------------------------------------------
+
+  void showLatency();
+
+
+
+  sem_t mutex;        //Halts the main thread until "quit"
+
+  char ipChars[5];    //Chars representing the IP address of the local machine
+
+  char* ipNumber;     //IP number read in from command line at execution
+
+  int portNumber;     //Port number read in from command line at execution
+
+  map<string, int> tcpCxns;  //All outgoing sockets mapped to group name
+
+  map<int, pthread_t> outThreads; //pthread IDs mapped to active sockets
+
+  queue<pthread_t> expiredOutThreads; //Holds terminated relayOut socket #'s
+
+  Socket * relaySock;   //The Socket object used for TCP connections
+
+  map<string, PacketQueue*> egressQueues; //TCP send queues by group name
+
+  PacketQueue * rebroadcastQueue; //Packets waiting for local UDP broadcast
+
+  map<unsigned int, int> priorityRules; //Priority class by origin group IP
+
+  map<unsigned int, int> tunnelRules; //TUNNEL_ mode by origin group IP,
+
+                                      //under ruleLock
+
+  map<unsigned int, vector<string> > redundancyRules; //Paths by origin group
+
+                                      //IP, under ruleLock
+
+  //Conflation key of a peer's egress queue, see setConflation
+
+  struct conflationRule {
+
+    int offset;
+
+    int length;
+
+    bool bySource;
+
+  };
+
+  map<string, conflationRule> conflationRules; //By egressQueues key, under
+
+                                      //ruleLock
+
+  bool weightedSchedule;  //False = strict priority across classes
+
+  int scheduleWeights[NUM_PRIORITIES]; //Weights used when weightedSchedule
+
+  pthread_mutex_t cxnLock;  //Guards tcpCxns and egressQueues
+
+  pthread_mutex_t fanoutLock; //Guards fanoutPool, fanoutShards and
+
+                              //fanoutPeers, taken after cxnLock
+
+  pthread_mutex_t ruleLock; //Guards priorityRules, schedule, threadAffinity
+
+  UdpMulticast * localRecvGroup; //Multicast server side, joined once
+
+  UdpMulticast * localSendGroup; //Multicast client side for rebroadcasts
+
+  int localRecvSd;          //Socket of localRecvGroup
+
+  volatile bool lowLatency; //Poll sockets and queues instead of blocking
+
+  int busyPollUs;           //SO_BUSY_POLL budget in low-latency mode
+
+  map<string, string> threadAffinity; //CPU specification by thread role
+
+  volatile int affinityGeneration; //Bumped whenever threadAffinity changes
+
+  volatile int timestampMode; //TIMESTAMPS_OFF, _SOFTWARE or _HARDWARE
+
+  volatile int timestampGeneration; //Bumped whenever timestampMode changes
+
+  pthread_mutex_t latencyLock; //Guards latencyBlocks and retiredLatency
+
+  vector<latencyBlock*> latencyBlocks; //Blocks of the running relay threads
+
+  LatencyHistogram retiredLatency[LATENCY_STAGES]; //Samples of exited threads
+
+  int traceSampleRate;      //Trace one in this many local packets, 0 = off
+
+  unsigned int traceCounter; //Local packets seen since tracing was set
+
+  map<string, LatencyHistogram> pathLatency; //End-to-end latency by hop list
+
+  pthread_mutex_t traceLock; //Guards pathLatency and recentTraces
+
+  volatile bool running;    //Between start() and stop()
+
+  bool started;             //start() has been called
+
+  pthread_t relayInThreadID;
+
+  pthread_t acceptThreadID;
+
+  pthread_t rebroadcastThreadID;
+
+  pthread_t localStageThreadID;
+
+  pthread_t remoteStageThreadID;
+
+  SpscRing* ingestRing;     //relayIn to the local stage
+
+  //A relayOut thread's ring to the remote stage
+
+  struct peerStage {
+
+    string name;              //tcpCxns key
+
+    SpscRing* ring;
+
+    CounterBlock* counters;   //Counted by the remote stage
+
+  };
+
+  pthread_mutex_t stageLock; //Guards peerStages
+
+  vector<peerStage*> peerStages; //Rings the remote stage reads
+
+  volatile int stageGeneration; //Bumped when peerStages changes
 
-//              Command Thread:   Spun up after execution, only a single thread
+  volatile bool remoteStageStopping; //No relayOut thread is left
 
-//                                which takes user commands (add remote group,
+  int liveWorkers;          //relayOut and relayEgress threads not yet exited
 
-//                                delete remote group, show TCP connections,
+  pthread_cond_t workersDone; //Signalled when liveWorkers drops to 0
 
-//                                quit).
+  pthread_mutex_t workerLock; //Guards liveWorkers
 
-//              relayIn Thread:   Spun up after execution, only a single thread
+  pthread_mutex_t subscriberLock; //Guards subscribers, held during callbacks
 
-//                                which accepts local UDP broadcasts and sends
+  volatile int subscriberCount; //Size of subscribers, read without the lock
 
-//                                them via TCP to all active connections.
+  int nextSubscriberID;
 
-//              acceptThread:     Spun up after execution, only a single thread
+  pthread_t shmInThreadID;
 
-//                                which accepts TCP connection requests from a
+  map<string, ShmRing*> shmInRings;  //Ingress queues by base name
 
-//                                remote group.
+  map<string, ShmRing*> shmOutRings; //Egress broadcast rings by base name
 
-//              relayOut Thread:  Spun up after a TCP connection request is
+  pthread_mutex_t shmLock;  //Guards shmInRings and shmOutRings
 
-//                                accepted, it accepts TCP messages and
+  volatile int shmRingCount; //Size of shmInRings, read without the lock
 
-//                                broadcasts them locally via UDP
+  pthread_t heartbeatThreadID;
 
-//
+  volatile int heartbeatMs; //Interval between heartbeats, 0 = off
 
-//              Messages sent are in a packet format as follows:
+  volatile int heartbeatMisses; //Silent intervals before a peer is evicted
 
-//              Packet header: -32, -31, -30, hop, 4-byte IP addresses of all
 
-//                             nodes that have received the message
 
-//              Followed By:   Actual message terminated by \0
+  //As thread functions need to be static, this struct includes all needed data
 
-//              The "hop" is the number of IP addresses in the header
+  struct outThreadInfo {
 
-//-----------------------------------------------------------------------------
+    int socketNumber;         //Socket number just created for relayOut thread
 
-class UdpRelay {
+    UdpRelay * currentRelay;  //Pointer to UdpRelay object
 
- public:
+    string remoteHostName;
 
-  //---------------------------------------------------------------------------
+    outThreadInfo(UdpRelay* relay, const char* hostName, int sd) :
 
-  // UdpRelay Constructor
+        socketNumber(sd), currentRelay(relay), remoteHostName(hostName) {}
 
-  // Parses command line input into IP and port numbers, instantiates all data
+  };
 
-  // members, spins up command, relayIn and accept threads then calls a
+  //A registered in-process subscriber
 
-  // semaphore
+  struct subscription {
 
-  // wait until a "quit" command is issued.
+    RelaySubscriber callback;
 
-  //
+    void * context;           //Passed back to callback
 
-  // @pre:   char* parameter is a valid IP number concatenated with a port
+  };
 
-  //         number
+  map<int, subscription> subscribers; //In-process subscribers by ID
 
-  // @post:  3 threads are spun up, IP and port numbers are saved
+  //Liveness and RTT of one connection, kept under cxnLock
 
-  // @param *ipPlusPort:  The IP address and port number:
+  struct peerHealth {
 
-  //        (XXX.XXX.XXX.XXX:YYYYY)
+    bool capable;             //Peer accepts control frames
 
-  //---------------------------------------------------------------------------
+    volatile long long* lastHeardUs; //monotonicMicros() of the last frame
 
-  UdpRelay(const char* ipPlusPort);
+                              //received, the peer's word in heardTimes
 
-  //---------------------------------------------------------------------------
+    long long lastPingUs;     //monotonicMicros() of the last ping queued
 
-  // UdpRelay Destructor
+    unsigned int pingSequence; //Sequence number of the last ping queued
 
-  // Deletes any dynamically allocated data members
+    long long lastRttUs;      //Most recent RTT sample
 
-  //
+    double smoothedRttUs;     //RTT smoothed with gain 1/8
 
-  // @pre:   None
+    double jitterUs;          //Mean RTT deviation smoothed with gain 1/4
 
-  // @post:  char * ipNumber is deleted
+    int rttSamples;           //Pongs received
 
-  //---------------------------------------------------------------------------
+    int headerVersion;        //Header version sent to the peer
 
-  ~UdpRelay();
+    unsigned short nodeId;    //Peer's node ID if headerVersion is 2
 
-  //---------------------------------------------------------------------------
+    bool jumbo;               //Peer accepts jumbo and fragment frames
 
-  // sendLocalMessage
+    bool trace;               //Peer parses the trace extension; others get
 
-  // Broadcasts the char* parameter via UDP
+                              //packets with it stripped
 
-  //
+    bool priority;            //Peer reads priority bits; others get them
 
-  // @pre:   currentMessage is not NULL
+                              //cleared
 
-  // @post:  currentMessage is broadcast via UDP
+  };
 
-  // @param  *currentMessage: The message to broadcast UDP
+  map<string, peerHealth> peers; //Health by tcpCxns key
 
-  //---------------------------------------------------------------------------
+  //Last receive time by tcpCxns key, created under cxnLock and never erased,
 
-  void sendLocalMessage(char * currentMessage);
+  //so relayOut threads store into their word without a lock
 
-  //---------------------------------------------------------------------------
+  map<string, volatile long long*> heardTimes;
 
-  // recvLocalMessage
+  volatile int peerGeneration; //Bumped under cxnLock whenever tcpCxns or the
 
-  // Receives a local UDP broadcast
+                              //settings in a peerView change
 
-  //
+  volatile int headerVersion; //Highest header version offered to peers
 
-  // @pre:   currentMessage is not NULL and is of at least SIZE length
+  nodeIdentity* volatile identity; //Current node ID and filter geometry,
 
-  // @post:  The message received via UDP is copied into currentMessage
+                              //read without a lock; replaced, never changed,
 
-  // @param  *currentMessage: The buffer that will contain the message received
+                              //when another relay wins the ID
 
-  //---------------------------------------------------------------------------
+  vector<nodeIdentity*> identities; //Every identity published, freed in the
 
-  void recvLocalMessage(char * currentMessage);
+                              //destructor
 
-  //---------------------------------------------------------------------------
+  unsigned int groupAddress;  //ipNumber packed, host byte order
 
-  // commandThread
+  pthread_mutex_t nodeLock;   //Guards nodeAddresses, addressNodes and
 
-  // A static class method that is a thread function for the command thread
+                              //identities
 
-  //
+  int bloomTtl;               //TTL of packets this relay converts
 
-  // @pre:   *arg parameter represents a valid UdpRelay object
+  map<unsigned short, unsigned int> nodeAddresses; //Group IP by node ID
 
-  // @post:  Acts based on user input, eventually terminating upon quit command
+  map<unsigned int, unsigned short> addressNodes;  //Node ID by group IP
 
-  // @param  *arg:  A void pointer to the UdpRelay object creating the thread
+  volatile int maxPayload;    //Largest message accepted, in bytes
 
-  //---------------------------------------------------------------------------
+  volatile int fragmentSize;  //Largest local datagram, 0 = MAX_DATAGRAM_SIZE
 
-  static void* commandThread(void* arg);
+  volatile unsigned int fragmentSequence; //Packet ID of the next fragmented
 
-  //---------------------------------------------------------------------------
+  unsigned int fragmentSource; //Random ID in the fragments this relay sends
 
-  // acceptThread
+  volatile long oversized;    //Packets dropped for their size
 
-  // A static class method that is a thread function for the accept thread,
+  volatile long hopLimited;   //Packets dropped with a full hop list or no TTL
 
-  // which loops continually accepting TCP connection requests
+  volatile long nodeCollisions; //Node IDs found claimed by two relays
 
-  //
+  Reassembler* reassembler;   //Fragments from links and the local group
 
-  // @pre:   *arg parameter represents a valid UdpRelay object
+  //A peer added with addRemoteIP, kept under cxnLock
 
-  // @post:  Opens a TCP connection socket and updates a connection map
+  struct managedPeer {
 
-  // @param  *arg:  A void pointer to the UdpRelay object creating the thread
+    bool reconnecting;        //A reconnect thread is running
 
-  //---------------------------------------------------------------------------
+    int attempts;             //Connection attempts since the link dropped
 
-  static void* acceptThread(void* arg);
+    StoreForward* backlog;    //Owned by the peer's relayEgress thread
 
-  //---------------------------------------------------------------------------
+  };
 
-  // relayInThread
+  map<string, managedPeer> managedPeers; //Managed peers by IP
 
-  // A static class method that is a thread function for the relayIn thread. It
+  RelayConfig config;         //Last config file loaded, under ruleLock
 
-  // loops continually, receiving UDP messages and sending them via TCP to
+  string configPath;          //"" = no config file, under ruleLock
 
-  // nodes connected to this UdpRelay object
+  vector<string> quorumPeers; //Configured peers, under cxnLock
 
-  //
+  int quorum;                 //quorumPeers needed for ready, under cxnLock
 
-  // @pre:   *arg parameter represents a valid UdpRelay object
+  volatile bool ready;        //The quorum has been connected
 
-  // @post:  None
+  volatile int reloading;     //1 while reloadConfig runs
 
-  // @param  *arg:  A void pointer to the UdpRelay object creating the thread
+  static volatile sig_atomic_t hangups; //SIGHUPs received by the process
 
-  //---------------------------------------------------------------------------
+  int hangupsSeen;            //hangups acted on by the heartbeat thread
 
-  static void* relayInThread(void* arg);
+  volatile int laneCapacity;  //Packets per lane of new egress queues
 
-  //---------------------------------------------------------------------------
+  volatile bool handingOff;   //handOff is stopping the relay for a successor
 
-  // relayOutThread
+  int listenSd;               //Listening socket taken over, or NULL_SD
 
-  // A static class method that is a thread function for the relayOut thread,
+  set<string> drainedPeers;   //Egress flushed for handOff, under cxnLock
 
-  // which spins up when a TCP connection is established. Receives messages via
+  map<string, StoreForward*> handoffBacklogs; //Backlogs passed in a handoff
 
-  // TCP connection and broadcasts them using UDP, if not a duplicate message
+                                              //by peer, under cxnLock
 
-  //
+  //A link or managed peer passed in a handoff
 
-  // @pre:   *arg parameter represents a valid outThreadInfo struct
+  struct handoffPeer {
 
-  // @post:  Removes the connection from the map when the thread terminates
+    string name;              //tcpCxns or managedPeers key
 
-  // @param  *arg:  Pointer to the outThreadInfo struct with socket and
+    int sd;                   //The link, NULL_SD if the peer is down
 
-  //         UdpRelay
+    bool managed;             //In managedPeers
 
-  //---------------------------------------------------------------------------
+    bool capable;             //peerHealth fields
 
-  static void* relayOutThread(void *arg);
+    int headerVersion;
 
-  //---------------------------------------------------------------------------
+    unsigned short nodeId;
 
-  // isDuplicatePacket
+    bool jumbo;
 
-  // Checks the header of the packet and returns true if the local group IP is
+    unsigned int extensions;  //CAPABILITY_TRACE and CAPABILITY_PRIORITY as
 
-  // already contained in the header (a duplicate message), false otherwise
+                              //in peerHealth
 
-  //
+  };
 
-  // @pre:   currentPacket parameter is of the correct packet format
+  vector<handoffPeer> adoptedPeers; //Passed to this relay, until start()
 
-  // @post:  None
+  AdminSocket admin;          //Admin protocol clients
 
-  // @param  currentPacket: The packet received via UDP or TCP
+  pthread_t adminThreadID;
 
-  // @returns bool:         True if the current UdpRelay's IP is contained in
+  volatile bool adminRunning; //The admin thread is running
 
-  //                        the packet header, false otherwise
+  pthread_mutex_t metricsLock; //Guards counterBlocks and retiredCounters
 
-  //---------------------------------------------------------------------------
+  vector<CounterBlock*> counterBlocks; //Blocks of the running relay threads
 
-  bool isDuplicatePacket(char* currentPacket);
+  //Counts of exited threads by (direction, peer), under metricsLock
 
-  //---------------------------------------------------------------------------
+  map<pair<string, string>, CounterSnapshot> retiredCounters;
 
-  // putIPIntoPacket
+  MetricsServer metrics;      //Used by the heartbeat thread only
 
-  // Takes a char* packet passed as parameter and adds group IP address of the
+  int metricsPort;            //0 = off, under ruleLock
 
-  // current UdpRelay node into the header in the format of a single byte for
+  string metricsAddress;      //"" = every interface, under ruleLock
 
-  // each 3-digit portion of the IP, then increments the "hop" number
+  volatile int metricsGeneration; //Bumped by setMetrics
 
-  //
+  //A link to a peer over the UDP link socket
 
-  // @pre:   currentPacket has valid packet format
+  struct udpLinkPeer {
 
-  // @post:  None
+    UdpRelay* relay;
 
-  // @param  currentPacket: A packet in valid format described in UdpRelay
+    string name;              //"udp:IP:port", the egressQueues key
 
-  //         header
+    UdpLink* link;
 
-  //---------------------------------------------------------------------------
+    struct sockaddr_in address; //Where tunnel datagrams go
 
-  void putIPIntoPacket(char* currentPacket);
+    SpscRing* ring;           //To the remote stage, fed by the link thread
 
-  //---------------------------------------------------------------------------
+    PacketQueue* egress;
 
-  // getIPNumber
+  };
 
-  // Returns the group IP number used at command line execution
+  int udpLinkSd;              //NULL_SD = UDP links off
 
-  //
+  int udpLinkPort;
 
-  // @pre:   ipNumber is not NULL
+  pthread_t udpLinkThreadID;
 
-  // @post:  None
+  volatile bool udpLinkRunning; //The UDP link thread keeps going
 
-  // @returns char*:  Group IP number
+  pthread_mutex_t udpLinkLock; //Guards udpLinks, taken before cxnLock
 
-  //---------------------------------------------------------------------------
+  map<string, udpLinkPeer*> udpLinks; //By name
 
-  char* getIPNumber();
+  UdpTunnel tunnel;           //Best-effort groups, over udpLinkSd
 
-  //---------------------------------------------------------------------------
+  SpscRing* tunnelRing;       //Tunneled packets to the remote stage, NULL
 
-  // addExpiredOutThread
+                              //while UDP links are off
 
-  // Pushes a socket descriptor that has been closed into the expiredOutThreads
+  volatile unsigned int redundantSequence; //Low half of the next message ID
 
-  // queue
+  RedundancyFilter redundancy; //First-arrival suppression of copies received
 
-  //
+  //A peer's egress queue as the fan-out pool sees it
 
-  // @pre:   sd is a closed socket descriptor
+  struct fanoutPeer {
 
-  // @post:  sd is added to expiredOutThreads
+    PacketQueue* queue;
 
-  // @param  sd: a socket descriptor
+    string name;              //egressQueues key
 
-  //---------------------------------------------------------------------------
+    bool link;                //A UDP link, skipped by tunneled packets
 
-  void addExpiredOutThread(int sd);
+    int shard;                //Index in fanoutShards
 
-  //---------------------------------------------------------------------------
+  };
 
-  // checkForDuplicateCxn
+  WorkPool* fanoutPool;       //NULL = fan out inline
 
-  // Checks if the remote connection already exists and if it does, it deletes
+  vector<WorkStrand*> fanoutShards; //One strand per shard
 
-  // the already existing connection
+  map<string, fanoutPeer*> fanoutPeers; //By egressQueues key
 
-  //
+  int backlogPackets;         //Memory backlog per peer, under ruleLock
 
-  // @pre:   string shall be a valid remote group id host name
+  string spillDirectory;      //"" = no spill files, under ruleLock
 
-  // @post:  if a duplicate connection already existed, the previous connection
+  volatile int replayRate;    //Backlog packets replayed per second
 
-  //         will be closed and deleted from the connections map. Otherwise,
+  Journal journal;            //On-disk log of relayed packets
 
-  //         there are no changes.
+  volatile bool journaling;   //journal is open
 
-  // @param  const string& GRP_ID: remote host name
+  string journalDirectory;    //Last directory journaled to, under ruleLock
 
-  //---------------------------------------------------------------------------
+  volatile int replaying;     //1 while a replay thread runs
 
-  void checkForDuplicateCxn(const string& GRP_ID);
+  volatile bool capturing;    //Relay threads copy packets into captureRing
 
+  ShmRing* captureRing;       //Tap ring, kept until destruction
 
+  PcapWriter captureFile;     //Written only by the capture thread
 
- private:
+  pthread_t captureThreadID;
 
-  UdpRelay() {}
+  string capturePath;         //File being written, under ruleLock
 
-  //---------------------------------------------------------------------------
+  //Sample and filters of one capture, never changed once published
 
-  // addRemoteIp
+  struct captureSettings {
 
-  // Takes a group IP/name and port number parameter and opens a TCP connection
+    int sample;               //Capture one packet in sample
 
-  // to that node. Sends the hostname of this machine to the remote node and
+    string peer;              //Peer filter, "" = all
 
-  // updates the tcpCxns map
+    unsigned int group;       //Origin group filter, 0 = all
 
-  //
+  };
 
-  // @pre:   remoteGroupID parameter is a valid group IP and port number
+  captureSettings* volatile captureFilter; //Current capture's, read by relay
 
-  // @post:  Socket is opened for TCP and tcpCxns map is updated
+                                           //threads without a lock
 
-  // @param  remoteGroupID: An group IP/name and port (XXX.XXX.XXX.XXX:YYYYY)
+  vector<captureSettings*> captureFilters; //Every one published, under
 
-  //---------------------------------------------------------------------------
+                                           //ruleLock; a relay thread may
 
-  void addRemoteIP(string remoteGroupID);
+                                           //still read an old one, so they
 
-  //---------------------------------------------------------------------------
+                                           //are kept until destruction
 
-  // terminateRemoteCxn
+  unsigned int captureCount;  //Packets offered since start, for sampling
 
-  // Closes the socket to the remote node IP/name passed as parameter, then
+  long captured;              //Packets written since start
 
-  // deletes that connection from the map
+  long captureDropped;        //Packets lost to a full tap ring
 
-  //
+  //Precedes a packet in a captureRing slot
 
-  // @pre:   remoteGroupID is a valid group IP/name and map contains that group
+  struct captureRecord {
 
-  // @post:  tcpCxns map is updated with group IP/name entry removed
+    long long timestampUs;    //realtimeMicros() when captured
 
-  // @param  remoteGroupID: A valid group IP/Name
+    int inbound;              //1 = received by this relay, 0 = sent
 
-  //---------------------------------------------------------------------------
+    char peer[CAPTURE_PEER_SIZE]; //Remote group or "local", NUL-terminated
 
-  void terminateRemoteCxn(string remoteGroupID);
+  };
 
-  //---------------------------------------------------------------------------
 
-  // showTCPConnections
 
-  // Displays all open TCP connections, either outgoing or incoming, to cout.
+  //Startup data for a relayEgress thread
 
-  // If no connections exist, tells user there are no open connections
+  struct egressThreadInfo {
 
-  //
+    PacketQueue * queue;      //Queue the thread drains
 
-  // @pre:   None
+    UdpRelay * currentRelay;  //Pointer to UdpRelay object
 
-  // @post:  None
+    string remoteGroupID;     //tcpCxns key of the connection
 
-  //---------------------------------------------------------------------------
+    bool managed;             //Buffer packets while the peer is down
 
-  void showTCPConnections();
+  };
 
-  //---------------------------------------------------------------------------
+  //Startup data for a journal replay thread
 
-  // displayHelpMenu
+  struct replayThreadInfo {
 
-  // Called by commandThread to send all available user commands to cout
+    UdpRelay * currentRelay;  //Pointer to UdpRelay object
 
-  //
+    string directory;         //Journal directory to read
 
-  // @pre:   None
+    long long fromUs;         //Range to replay, wall clock us
 
-  // @post:  None
+    long long toUs;
 
-  //---------------------------------------------------------------------------
+    double speed;             //Pace relative to the original, 0 = unpaced
 
-  void displayHelpMenu();
+    int directions;           //JOURNAL_LOCAL, _REMOTE or JOURNAL_REPLAY_ALL
 
-  //---------------------------------------------------------------------------
+  };
 
-  // setIpChars
+  //Startup data for a reconnect thread
 
-  // Takes the group IP number of format (2XX.255.255.255) and puts each set of
+  struct reconnectThreadInfo {
 
-  // three numbers into a single char value before storing them in ipChars[]
+    UdpRelay * currentRelay;  //Pointer to UdpRelay object
 
-  //
+    string remoteGroupID;     //IP the peer was added with
 
-  // @pre:   ipNumber is of valid format and ipChars is instantiated
+  };
 
-  // @post:  ipChars[] array contains the 4-char version of the group IP
+  //Startup data for an admin "add"
 
-  //---------------------------------------------------------------------------
+  struct adminBatchInfo {
 
-  void setIpChars();
+    UdpRelay * currentRelay;  //Pointer to UdpRelay object
 
-  //---------------------------------------------------------------------------
+    int client;               //AdminRequest::client to reply to
 
-  // tcpMulticastToRemoteGroups
+    string tag;               //The request's tag
 
-  // Sends a message via TCP to all remote nodes connected to this UdpRelay
+    vector<string> hosts;     //Hosts to connect
 
-  // node, and informs the user what message was sent and how many bytes
+  };
 
-  //
+  //A peer's gauges, copied for a metrics scrape
 
-  // @pre:   outPacket has valid packet format
+  struct peerGauges {
 
-  // @post:  None
+    bool up;                  //The link is up
 
-  // @param  outPacket: A packet received via UDP to be sent out via TCP
+    int queued;               //Egress queue, all lanes
 
-  //---------------------------------------------------------------------------
+    long long dropped;        //Egress drops, all lanes
 
-  void tcpMultiCastToRemoteGroups(char* outPacket);
+    long long conflated;      //Egress packets replaced by newer ones
 
-  //---------------------------------------------------------------------------
+    bool timed;               //rttUs and jitterUs have samples
 
-  // createUdpRelayServerConnection
+    double rttUs;
 
-  // Called by acceptThread, this method creates a TCP server socket and
+    double jitterUs;
 
-  // connects to a TCP client, receives their group name/IP and spins up a
+    int backlog;              //Store-and-forward packets held
 
-  // relayOut thread before adding the new connection the outThread and
+  };
 
-  // outThreadCxns maps
 
-  //
 
-  // @pre:   None
+  //A stage ring's gauges, copied for a metrics scrape
 
-  // @post:  outThread and outThreadCxns maps are updated, a socket is opened
+  struct ringGauges {
 
-  //---------------------------------------------------------------------------
+    string peer;              //peerStages name, "" for the local stage
 
-  void createUdpRelayServerConnection();
+    int packets;
 
-  //---------------------------------------------------------------------------
+    int used;
 
-  // terminateAllTcpConnections
+    int capacity;
 
-  // Closes all open TCP sockets and removes the connection entries from both
+    int highWater;
 
-  // tcpCxns and outThreadCxns maps
+    long long stalls;
 
-  //
+  };
 
-  // @pre:   None
 
-  // @post:  Sockets are closed and both maps have all entries deleted
 
-  //---------------------------------------------------------------------------
+  //A packet handed to the fan-out pool, freed by the last shard's task
 
-  void terminateAllTcpConnections();
+  struct fanoutPacket {
 
+    char* data;
 
+    int length;
 
-  sem_t mutex;        //Halts the main thread until "quit"
+    int priority;
 
-  char ipChars[5];    //Chars representing the IP address of the local machine
+    long long arrivalUs;
 
-  char* ipNumber;     //IP number read in from command line at execution
+    long long messageId;      //0 unless the origin has a redundancy rule
 
-  int portNumber;     //Port number read in from command line at execution
+    unsigned int group;       //Origin group, for conflation by source
 
-  map<string, int> tcpCxns;  //All outgoing sockets mapped to group name
+    vector<pair<int, fanoutPeer*> > targets; //(shard, peer); a task reads
 
-  map<int, pthread_t> outThreads; //pthread IDs mapped to active sockets
+                                             //only its own shard's peers
 
-  queue<pthread_t> expiredOutThreads; //Holds terminated relayOut socket #'s
+    volatile int references;  //Shard tasks not yet run
 
-  Socket * relaySock;   //The Socket object used for TCP connections
+  };
 
 
 
-  //As thread functions need to be static, this struct includes all needed data
+  //A traced packet as seen by this relay, kept for the "trace" command
 
-  struct outThreadInfo {
+  struct traceSample {
 
-    int socketNumber;         //Socket number just created for relayOut thread
+    string path;          //Hop list, origin first
 
-    UdpRelay * currentRelay;  //Pointer to UdpRelay object
+    long long latencyUs;  //Origin time to arrival here
 
-    string remoteHostName;
+    string breakdown;     //Per-hop arrival offsets and residence times
 
   };
 
+
+
+  deque<traceSample> recentTraces; //Most recent traced packets, oldest first
+
 };
 
 
@@ -0,0 +1,414 @@
+//-----------------------------------------------------------------------------
+// relay_replay
+// Replays recorded traffic into a relay's multicast group and measures what
+// arrives at another relay's group, so that relay changes can be compared on
+// identical input.
+//
+//   relay_replay send <file|journal dir> <group:port> [speed [udp port]]
+//   relay_replay receive <group:port> <seconds> [expected]
+//
+// send reads a pcap or pcapng capture (UDP datagrams, optionally only those
+// to one port) or a relay journal directory and multicasts one relay packet
+// per datagram, keeping the recorded inter-arrival times divided by speed
+// (0 = as fast as possible). Relay packets keep their message and priority;
+// other payloads become the message. Each message is prefixed with a probe
+// tag "#R<sequence>@<send time us>#", so datagrams are numbered in file
+// order and every run of the same file sends the same sequence.
+//
+// receive listens on a group for the packets a relay rebroadcasts there and
+// reports loss, duplicates, reordering and the send-to-receive latency. The
+// latency is only as good as the clock synchronization of the two hosts.
+//
+// Build from the repository root, with the UdpMulticast sources the relay is
+// built with:
+//   g++ -pthread -I. -o relay_replay tools/relay_replay.cpp PcapReader.cpp
+//       PcapWriter.cpp Journal.cpp PacketHeader.cpp LatencyHistogram.cpp
+//       UdpMulticast.cpp -lrt
+//-----------------------------------------------------------------------------
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include "PacketHeader.h"
+#include "LatencyHistogram.h"
+#include "PcapReader.h"
+#include "Journal.h"
+#include "UdpMulticast.h"
+
+using namespace std;
+
+const int SIZE = 1024;              //Relay packet size, as in UdpRelay.h
+const int MAX_TAG = 40;             //Longest probe tag
+const int RECEIVE_TICK_MS = 100;    //Receive timeout between deadline checks
+
+//A datagram to replay, read from a capture or a journal
+struct ReplayItem {
+  long long timestampUs;            //When it was recorded
+  const char* data;
+  int length;
+};
+
+//-----------------------------------------------------------------------------
+// Class:       ReplaySource
+// Description: Reads datagrams in recorded order from either a capture file
+//              or a journal directory
+//-----------------------------------------------------------------------------
+class ReplaySource {
+ public:
+  //---------------------------------------------------------------------------
+  // ReplaySource Constructor
+  // Opens a journal if path is a directory, else a pcap or pcapng file
+  //
+  // @pre:   None
+  // @post:  isOpen() tells whether path could be read
+  // @param  path: Capture file or journal directory
+  // @param  port: Only replay captured datagrams to this UDP port, 0 = all
+  //---------------------------------------------------------------------------
+  ReplaySource(const string& path, int port) {
+    journal = NULL;
+    this->port = port;
+    struct stat status;
+    if (stat(path.c_str(), &status) == 0 && S_ISDIR(status.st_mode)) {
+      journal = new JournalReader(path);
+      opened = journal->getSegmentCount() > 0;
+    } else {
+      opened = capture.open(path);
+    }
+  }
+
+  //---------------------------------------------------------------------------
+  // ReplaySource Destructor
+  // Closes the capture or journal
+  //
+  // @pre:   None
+  // @post:  None
+  //---------------------------------------------------------------------------
+  ~ReplaySource() {
+    delete journal;
+  }
+
+  //---------------------------------------------------------------------------
+  // isOpen
+  // Returns true if the capture or journal could be read
+  //
+  // @pre:   None
+  // @post:  None
+  // @returns bool: False if the path was neither a capture nor a journal
+  //---------------------------------------------------------------------------
+  bool isOpen() const {
+    return opened;
+  }
+
+  //---------------------------------------------------------------------------
+  // next
+  // Reads the next datagram to replay
+  //
+  // @pre:   isOpen()
+  // @post:  item describes the datagram if true is returned
+  // @param  item:  Receives the datagram, valid until the next call
+  // @returns bool: False once everything has been read
+  //---------------------------------------------------------------------------
+  bool next(ReplayItem& item) {
+    if (journal != NULL) {
+      JournalRecord record;
+      if (!journal->next(record)) {
+        return false;
+      }
+      item.timestampUs = record.timestampUs;
+      item.data = record.data;
+      item.length = record.length;
+      return true;
+    }
+    PcapDatagram datagram;
+    while (capture.next(datagram)) {
+      if (port == 0 || datagram.destinationPort == port) {
+        item.timestampUs = datagram.timestampUs;
+        item.data = datagram.payload;
+        item.length = datagram.length;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  //---------------------------------------------------------------------------
+  // getSkipped
+  // Returns the captured frames that were not UDP datagrams
+  //
+  // @pre:   None
+  // @post:  None
+  // @returns long: Frames skipped, 0 for a journal
+  //---------------------------------------------------------------------------
+  long getSkipped() const {
+    return journal != NULL ? 0 : capture.getSkipped();
+  }
+
+ private:
+  JournalReader* journal;   //NULL when reading a capture
+  PcapReader capture;
+  int port;
+  bool opened;
+};
+
+//-----------------------------------------------------------------------------
+// parseGroup
+// Splits "group:port" into a group IP string and a port number
+//
+// @pre:   None
+// @post:  group and port are set if true is returned
+// @param  groupPort: The argument to parse
+// @param  group:     Receives the group IP, NUL-terminated
+// @param  port:      Receives the port
+// @returns bool:     False if the argument has no port
+//-----------------------------------------------------------------------------
+static bool parseGroup(const char* groupPort, char* group, int& port) {
+  const char* colon = strchr(groupPort, ':');
+  if (colon == NULL || colon - groupPort > 15 || atoi(colon + 1) <= 0) {
+    return false;
+  }
+  memcpy(group, groupPort, colon - groupPort);
+  group[colon - groupPort] = '\0';
+  port = atoi(colon + 1);
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// sleepUntil
+// Sleeps until CLOCK_MONOTONIC reaches a time
+//
+// @pre:   None
+// @post:  monotonicMicros() >= dueUs
+// @param  dueUs: The time, as returned by monotonicMicros()
+//-----------------------------------------------------------------------------
+static void sleepUntil(long long dueUs) {
+  struct timespec due;
+  due.tv_sec = dueUs / 1000000;
+  due.tv_nsec = (dueUs % 1000000) * 1000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR) {
+  }
+}
+
+//-----------------------------------------------------------------------------
+// printLatency
+// Prints the percentiles of a histogram on one line
+//
+// @pre:   None
+// @post:  None
+// @param  name:      Label for the line
+// @param  histogram: The samples
+//-----------------------------------------------------------------------------
+static void printLatency(const char* name, const LatencyHistogram& histogram) {
+  if (histogram.count() == 0) {
+    cout << name << ": no samples" << endl;
+    return;
+  }
+  cout << name << " us: mean " << histogram.sum() / histogram.count()
+      << " p50 " << histogram.percentile(50)
+      << " p90 " << histogram.percentile(90)
+      << " p99 " << histogram.percentile(99)
+      << " p99.9 " << histogram.percentile(99.9)
+      << " max " << histogram.max() << endl;
+}
+
+//-----------------------------------------------------------------------------
+// sendReplay
+// Multicasts the datagrams of a capture or journal with their recorded
+// spacing divided by speed
+//
+// @pre:   None
+// @post:  Every datagram that fits a relay packet has been sent
+// @param  path:  Capture file or journal directory
+// @param  group: Group IP to send to
+// @param  port:  Relay port of the group
+// @param  speed: Timing multiplier, 0 = as fast as possible
+// @param  filterPort: Only captured datagrams to this UDP port, 0 = all
+// @returns int:  Exit status
+//-----------------------------------------------------------------------------
+static int sendReplay(const string& path, char* group, int port, double speed,
+    int filterPort) {
+  ReplaySource source(path, filterPort);
+  if (!source.isOpen()) {
+    cerr << "relay_replay: cannot read " << path << endl;
+    return 1;
+  }
+  UdpMulticast sendGroup(group, port);
+  if (sendGroup.getClientSocket() == NULL_SD) {
+    cerr << "relay_replay: cannot open a socket for " << group << endl;
+    return 1;
+  }
+  LatencyHistogram lateness;      //How far behind schedule each send was
+  char packet[SIZE];
+  char message[SIZE];
+  ReplayItem item;
+  long long firstUs = 0;
+  long long startUs = 0;
+  unsigned int sequence = 0;
+  long truncated = 0;
+  while (source.next(item)) {
+    long long nowUs = monotonicMicros();
+    if (sequence == 0) {
+      firstUs = item.timestampUs;
+      startUs = nowUs;
+    }
+    if (speed > 0) {
+      long long dueUs = startUs +
+          (long long)((item.timestampUs - firstUs) / speed);
+      if (dueUs > nowUs) {
+        sleepUntil(dueUs);
+      }
+      lateness.record(monotonicMicros() - dueUs);
+    }
+    //Relay packets keep their message and priority; the header is rebuilt so
+    //the relays do not take their own hops for a loop
+    const char* body = item.data;
+    int bodyLength = item.length;
+    int priority = PRIORITY_NORMAL;
+    if (item.length >= V2_HEADER_SIZE &&
+        PacketHeader::getVersion(item.data) != 0) {
+      int offset = PacketHeader::getPayloadOffset(item.data);
+      priority = PacketHeader::getPriority(item.data);
+      body = item.data + (offset < item.length ? offset : item.length);
+      bodyLength = item.length - (body - item.data);
+    }
+    const char* end = (const char*)memchr(body, '\0', bodyLength);
+    if (end != NULL) {
+      bodyLength = end - body;
+    }
+    int tagLength = snprintf(message, MAX_TAG, "#R%u@%lld#", sequence,
+        realtimeMicros());
+    int room = SIZE - 1 - (MAGIC_SIZE + 1) - tagLength;
+    if (bodyLength > room) {
+      bodyLength = room;
+      truncated++;
+    }
+    memcpy(message + tagLength, body, bodyLength);
+    PacketHeader::build(packet, SIZE, message, tagLength + bodyLength);
+    PacketHeader::setPriority(packet, priority);
+    sendGroup.multicast(packet);
+    sequence++;
+  }
+  double seconds = (monotonicMicros() - startUs) / 1000000.0;
+  cout << "sent " << sequence << " packets in " << seconds << " s";
+  if (seconds > 0) {
+    cout << " (" << (long)(sequence / seconds) << "/s)";
+  }
+  cout << ", " << truncated << " truncated, " << source.getSkipped()
+      << " frames skipped" << endl;
+  printLatency("schedule lag", lateness);
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// receiveReplay
+// Counts the probe-tagged packets that arrive on a group for a number of
+// seconds and reports loss and latency
+//
+// @pre:   None
+// @post:  The report is printed
+// @param  group:    Group IP to listen on
+// @param  port:     Relay port of the group
+// @param  seconds:  How long to listen
+// @param  expected: Packets sent, 0 = one more than the highest sequence seen
+// @returns int:     Exit status
+//-----------------------------------------------------------------------------
+static int receiveReplay(char* group, int port, int seconds, long expected) {
+  UdpMulticast receiveGroup(group, port);
+  int sd = receiveGroup.getServerSocket();
+  if (sd == NULL_SD) {
+    cerr << "relay_replay: cannot join " << group << endl;
+    return 1;
+  }
+  struct timeval timeout;
+  timeout.tv_sec = 0;
+  timeout.tv_usec = RECEIVE_TICK_MS * 1000;
+  setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  vector<bool> seen;
+  LatencyHistogram latency;
+  long received = 0;
+  long duplicates = 0;
+  long reordered = 0;
+  long foreign = 0;
+  long long highest = -1;
+  char packet[SIZE];
+  long long deadlineUs = monotonicMicros() + seconds * 1000000LL;
+  while (monotonicMicros() < deadlineUs) {
+    memset(packet, 0, SIZE);
+    if (!receiveGroup.recv(packet, SIZE)) {
+      continue;
+    }
+    long long arrivalUs = realtimeMicros();
+    unsigned int sequence = 0;
+    long long sentUs = 0;
+    if (PacketHeader::getVersion(packet) == 0 ||
+        sscanf(packet + PacketHeader::getPayloadOffset(packet), "#R%u@%lld#",
+        &sequence, &sentUs) != 2) {
+      foreign++;
+      continue;
+    }
+    if (sequence >= seen.size()) {
+      seen.resize(sequence + 1, false);
+    }
+    if (seen[sequence]) {
+      duplicates++;
+      continue;
+    }
+    seen[sequence] = true;
+    received++;
+    if ((long long)sequence < highest) {
+      reordered++;
+    } else {
+      highest = sequence;
+    }
+    latency.record(arrivalUs - sentUs);
+  }
+  if (expected <= 0) {
+    expected = highest + 1;
+  }
+  long lost = expected > received ? expected - received : 0;
+  cout << "received " << received << " of " << expected << ", lost " << lost;
+  if (expected > 0) {
+    cout << " (" << 100.0 * lost / expected << "%)";
+  }
+  cout << ", " << duplicates << " duplicates, " << reordered
+      << " reordered, " << foreign << " untagged" << endl;
+  printLatency("latency", latency);
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// main
+// Parses the command line and runs the sender or the receiver
+//
+// @pre:   None
+// @post:  None
+// @param  argc: Argument count
+// @param  argv: send or receive and their arguments
+// @returns int: 0 on success, 1 on a usage or I/O error
+//-----------------------------------------------------------------------------
+int main(int argc, char** argv) {
+  char group[16];
+  int port = 0;
+  if (argc >= 4 && strcmp(argv[1], "send") == 0 &&
+      parseGroup(argv[3], group, port)) {
+    double speed = argc > 4 ? atof(argv[4]) : 1;
+    int filterPort = argc > 5 ? atoi(argv[5]) : 0;
+    return sendReplay(argv[2], group, port, speed, filterPort);
+  }
+  if (argc >= 4 && strcmp(argv[1], "receive") == 0 &&
+      parseGroup(argv[2], group, port)) {
+    return receiveReplay(group, port, atoi(argv[3]),
+        argc > 4 ? atol(argv[4]) : 0);
+  }
+  cerr << "usage: relay_replay send <file|journal dir> <group:port> "
+      << "[speed [udp port]]" << endl
+      << "       relay_replay receive <group:port> <seconds> [expected]"
+      << endl;
+  return 1;
+}